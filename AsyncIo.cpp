@@ -0,0 +1,674 @@
+// ============================================================================
+// INFERNO - Asynchronous block I/O queues
+// ============================================================================
+
+#include "AsyncIo.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define INFERNO_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#endif
+
+// Larger transfers are split; every backend counts bytes in 32 bits.
+static const size_t MAX_TRANSFER = 1 << 30;
+
+static int LastSystemError() {
+#ifdef _WIN32
+    return (int)GetLastError();
+#else
+    return errno;
+#endif
+}
+
+const wchar_t* AsyncBackendName(AsyncBackend backend) {
+    switch (backend) {
+    case AsyncBackend::IoUring: return L"io_uring";
+    case AsyncBackend::Iocp: return L"iocp";
+    case AsyncBackend::ThreadPool: return L"threads";
+    default: return L"auto";
+    }
+}
+
+// ============================================================================
+// QUEUE
+// ============================================================================
+
+AsyncBlockIo::AsyncBlockIo(uint32_t queueDepth) : m_queueDepth(queueDepth) {
+    for (uint32_t slot = queueDepth; slot > 0; slot--) {
+        m_freeSlots.push_back(slot - 1);
+    }
+}
+
+uint32_t AsyncBlockIo::AllocateSlot() {
+    uint32_t slot = m_freeSlots.back();
+    m_freeSlots.pop_back();
+    m_inFlight++;
+    return slot;
+}
+
+void AsyncBlockIo::FreeSlot(uint32_t slot) {
+    m_freeSlots.push_back(slot);
+    m_inFlight--;
+}
+
+bool AsyncBlockIo::Submit(const AsyncRequest& request) {
+    if (m_freeSlots.empty()) {
+        return false;
+    }
+    Enqueue(AllocateSlot(), request);
+    return true;
+}
+
+size_t AsyncBlockIo::Reap(AsyncCompletion* completions, size_t capacity, size_t minimum) {
+    minimum = std::min<size_t>({minimum, capacity, m_inFlight});
+    if (capacity == 0 || m_inFlight == 0) {
+        return 0;
+    }
+    return Collect(completions, capacity, minimum);
+}
+
+// ============================================================================
+// THREAD POOL BACKEND
+// ============================================================================
+
+class ThreadPoolBlockIo : public AsyncBlockIo {
+public:
+    ThreadPoolBlockIo(const std::vector<BlockDevice*>& devices, uint32_t queueDepth)
+        : AsyncBlockIo(queueDepth), m_devices(devices), m_requests(queueDepth) {
+        // Blocking calls need a thread per request in flight, within reason.
+        uint32_t threads = std::min<uint32_t>(queueDepth, 32);
+        for (uint32_t i = 0; i < threads; i++) {
+            m_threads.emplace_back([this] { WorkerLoop(); });
+        }
+    }
+
+    ~ThreadPoolBlockIo() override {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_stopping = true;
+        }
+        m_queued.notify_all();
+        for (std::thread& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    AsyncBackend GetBackend() const override { return AsyncBackend::ThreadPool; }
+
+    bool RegisterBuffers(const std::vector<std::pair<void*, size_t>>&) override { return true; }
+
+protected:
+    void Enqueue(uint32_t slot, const AsyncRequest& request) override {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_requests[slot] = request;
+            m_pending.push_back(slot);
+        }
+        m_queued.notify_one();
+    }
+
+    size_t Collect(AsyncCompletion* completions, size_t capacity, size_t minimum) override {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_finished.wait(guard, [&] { return m_completed.size() >= minimum; });
+        size_t count = 0;
+        while (count < capacity && !m_completed.empty()) {
+            std::pair<uint32_t, AsyncCompletion> done = m_completed.front();
+            m_completed.pop_front();
+            completions[count++] = done.second;
+            FreeSlot(done.first);
+        }
+        return count;
+    }
+
+private:
+    void WorkerLoop() {
+        for (;;) {
+            uint32_t slot;
+            AsyncRequest request;
+            {
+                std::unique_lock<std::mutex> guard(m_lock);
+                m_queued.wait(guard, [&] { return m_stopping || !m_pending.empty(); });
+                if (m_pending.empty()) return;
+                slot = m_pending.front();
+                m_pending.pop_front();
+                request = m_requests[slot];
+            }
+
+            BlockDevice& device = *m_devices[request.device];
+            AsyncCompletion completion;
+            completion.userData = request.userData;
+            switch (request.op) {
+            case AsyncOp::Read:
+                completion.ok = device.Read(request.offset, request.buffer, request.length);
+                break;
+            case AsyncOp::Write:
+                completion.ok = device.Write(request.offset, request.buffer, request.length);
+                break;
+            case AsyncOp::Flush:
+                completion.ok = device.Flush();
+                break;
+            }
+            if (!completion.ok) completion.error = LastSystemError();
+
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_completed.push_back({slot, completion});
+            }
+            m_finished.notify_one();
+        }
+    }
+
+    std::vector<BlockDevice*> m_devices;
+    std::vector<AsyncRequest> m_requests;   // by slot
+    std::vector<std::thread> m_threads;
+    std::mutex m_lock;
+    std::condition_variable m_queued;
+    std::condition_variable m_finished;
+    std::deque<uint32_t> m_pending;
+    std::deque<std::pair<uint32_t, AsyncCompletion>> m_completed;
+    bool m_stopping = false;
+};
+
+// ============================================================================
+// IO_URING BACKEND
+// ============================================================================
+
+#ifdef INFERNO_HAVE_IO_URING
+
+// Raw system calls: liburing is not a dependency, and the ring protocol is
+// small enough to drive directly.
+static int IoUringSetup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int IoUringEnter(int ring, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static int IoUringRegister(int ring, unsigned opcode, const void* arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, ring, opcode, arg, count);
+}
+
+class IoUringBlockIo : public AsyncBlockIo {
+public:
+    IoUringBlockIo(const std::vector<BlockDevice*>& devices, uint32_t queueDepth)
+        : AsyncBlockIo(queueDepth), m_slots(queueDepth) {
+        for (BlockDevice* device : devices) {
+            m_fds.push_back((int)device->GetNativeHandle());
+        }
+    }
+
+    ~IoUringBlockIo() override {
+        // The kernel may still be writing into caller buffers; wait it out.
+        std::vector<AsyncCompletion> drain(m_queueDepth);
+        while (m_ring >= 0 && m_inFlight > 0) {
+            Collect(drain.data(), drain.size(), 1);
+        }
+        if (m_sqes) munmap(m_sqes, m_sqesSize);
+        if (m_cqRing && m_cqRing != m_sqRing) munmap(m_cqRing, m_cqRingSize);
+        if (m_sqRing) munmap(m_sqRing, m_sqRingSize);
+        if (m_ring >= 0) close(m_ring);
+    }
+
+    bool Open(std::wstring& error) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        m_ring = IoUringSetup(m_queueDepth, &params);
+        if (m_ring < 0) {
+            error = L"io_uring_setup failed (errno " + std::to_wstring(errno) + L").";
+            return false;
+        }
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+        m_sqRing = (uint8_t*)mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  m_ring, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED) {
+            m_sqRing = nullptr;
+            error = L"Cannot map the io_uring submission ring.";
+            return false;
+        }
+        if (single) {
+            m_cqRing = m_sqRing;
+        } else {
+            m_cqRing = (uint8_t*)mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      m_ring, IORING_OFF_CQ_RING);
+            if (m_cqRing == MAP_FAILED) {
+                m_cqRing = nullptr;
+                error = L"Cannot map the io_uring completion ring.";
+                return false;
+            }
+        }
+        m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        m_sqes = (struct io_uring_sqe*)mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQES);
+        if (m_sqes == MAP_FAILED) {
+            m_sqes = nullptr;
+            error = L"Cannot map the io_uring submission entries.";
+            return false;
+        }
+
+        m_sqTail = (uint32_t*)(m_sqRing + params.sq_off.tail);
+        m_sqMask = *(uint32_t*)(m_sqRing + params.sq_off.ring_mask);
+        m_sqArray = (uint32_t*)(m_sqRing + params.sq_off.array);
+        m_cqHead = (uint32_t*)(m_cqRing + params.cq_off.head);
+        m_cqTail = (uint32_t*)(m_cqRing + params.cq_off.tail);
+        m_cqMask = *(uint32_t*)(m_cqRing + params.cq_off.ring_mask);
+        m_cqes = (struct io_uring_cqe*)(m_cqRing + params.cq_off.cqes);
+        m_localTail = *m_sqTail;
+
+        // Plain read and write opcodes arrived in 5.6, as did probing.
+        std::vector<uint8_t> probeSpace(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+        struct io_uring_probe* probe = (struct io_uring_probe*)probeSpace.data();
+        if (IoUringRegister(m_ring, IORING_REGISTER_PROBE, probe, 256) < 0) {
+            error = L"io_uring is too old (no opcode probe).";
+            return false;
+        }
+        const uint8_t needed[] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                                  IORING_OP_FSYNC};
+        for (uint8_t op : needed) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                error = L"io_uring lacks a required opcode.";
+                return false;
+            }
+        }
+
+        // Fixed files spare the kernel a file table lookup per request.
+        m_fixedFiles = IoUringRegister(m_ring, IORING_REGISTER_FILES, m_fds.data(), (unsigned)m_fds.size()) == 0;
+        return true;
+    }
+
+    AsyncBackend GetBackend() const override { return AsyncBackend::IoUring; }
+
+    bool RegisterBuffers(const std::vector<std::pair<void*, size_t>>& buffers) override {
+        if (!m_buffers.empty()) {
+            IoUringRegister(m_ring, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+            m_buffers.clear();
+        }
+        if (buffers.empty()) return true;
+        std::vector<struct iovec> vectors;
+        for (const auto& buffer : buffers) {
+            vectors.push_back({buffer.first, buffer.second});
+        }
+        // Pinned pages count against RLIMIT_MEMLOCK; unregistered buffers
+        // still work, just without the saving.
+        if (IoUringRegister(m_ring, IORING_REGISTER_BUFFERS, vectors.data(), (unsigned)vectors.size()) != 0) {
+            LogEvent(LogLevel::Debug, "asyncio", "register_buffers_failed", {{"errno", errno}});
+            return false;
+        }
+        m_buffers = buffers;
+        return true;
+    }
+
+protected:
+    void Enqueue(uint32_t slot, const AsyncRequest& request) override {
+        m_slots[slot].request = request;
+        m_slots[slot].done = 0;
+        m_slots[slot].active = true;
+        Queue(slot);
+    }
+
+    size_t Collect(AsyncCompletion* completions, size_t capacity, size_t minimum) override {
+        size_t count = 0;
+        if (m_broken) {
+            // The ring failed; every request still held fails with it.
+            for (uint32_t slot = 0; slot < m_slots.size() && count < capacity; slot++) {
+                if (!m_slots[slot].active) continue;
+                m_slots[slot].active = false;
+                AsyncCompletion& completion = completions[count++];
+                completion.userData = m_slots[slot].request.userData;
+                completion.ok = false;
+                completion.error = m_broken;
+                FreeSlot(slot);
+            }
+            return count;
+        }
+        for (;;) {
+            uint32_t head = *m_cqHead;
+            uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+            while (head != tail && count < capacity) {
+                const struct io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+                Complete((uint32_t)cqe.user_data, cqe.res, completions, count);
+                head++;
+            }
+            __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+            bool satisfied = count >= minimum || count == capacity;
+            if (satisfied && m_unsubmitted == 0) {
+                return count;
+            }
+            unsigned flags = satisfied ? 0 : IORING_ENTER_GETEVENTS;
+            int submitted = IoUringEnter(m_ring, m_unsubmitted, satisfied ? 0 : 1, flags);
+            if (submitted < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+                m_broken = errno;
+                LogEvent(LogLevel::Error, "asyncio", "enter_failed", {{"errno", errno}});
+                return count + Collect(completions + count, capacity - count, 0);
+            }
+            m_unsubmitted -= (uint32_t)submitted;
+        }
+    }
+
+private:
+    struct Slot {
+        AsyncRequest request;
+        size_t done = 0;
+        bool active = false;
+    };
+
+    // Writes the SQE for the unfinished part of a slot's request; the ring
+    // is sized to the queue depth, so there is always room.
+    void Queue(uint32_t slot) {
+        const AsyncRequest& request = m_slots[slot].request;
+        size_t done = m_slots[slot].done;
+        uint32_t index = m_localTail & m_sqMask;
+        struct io_uring_sqe* sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = slot;
+        if (m_fixedFiles) {
+            sqe->fd = (int32_t)request.device;
+            sqe->flags = IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = m_fds[request.device];
+        }
+
+        if (request.op == AsyncOp::Flush) {
+            sqe->opcode = IORING_OP_FSYNC;
+        } else {
+            bool write = request.op == AsyncOp::Write;
+            uint8_t* data = (uint8_t*)request.buffer + done;
+            size_t length = std::min(request.length - done, MAX_TRANSFER);
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            for (size_t i = 0; i < m_buffers.size(); i++) {
+                uint8_t* base = (uint8_t*)m_buffers[i].first;
+                if (data >= base && data + length <= base + m_buffers[i].second) {
+                    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                    sqe->buf_index = (uint16_t)i;
+                    break;
+                }
+            }
+            sqe->addr = (uint64_t)(uintptr_t)data;
+            sqe->len = (uint32_t)length;
+            sqe->off = request.offset + done;
+        }
+
+        m_sqArray[index] = index;
+        m_localTail++;
+        __atomic_store_n(m_sqTail, m_localTail, __ATOMIC_RELEASE);
+        m_unsubmitted++;
+    }
+
+    void Complete(uint32_t slot, int32_t result, AsyncCompletion* completions, size_t& count) {
+        Slot& state = m_slots[slot];
+        const AsyncRequest& request = state.request;
+        if (result == -EINTR || result == -EAGAIN) {
+            Queue(slot);
+            return;
+        }
+        if (result > 0 && request.op != AsyncOp::Flush) {
+            state.done += (size_t)result;
+            if (state.done < request.length) {
+                Queue(slot);
+                return;
+            }
+        }
+
+        AsyncCompletion& completion = completions[count++];
+        completion.userData = request.userData;
+        if (result < 0) {
+            completion.ok = false;
+            completion.error = -result;
+        } else if (result == 0 && request.op != AsyncOp::Flush && request.length > 0) {
+            completion.ok = false;      // past the end of the device
+            completion.error = EIO;
+        } else {
+            completion.ok = true;
+            completion.error = 0;
+        }
+        state.active = false;
+        FreeSlot(slot);
+    }
+
+    std::vector<int> m_fds;
+    std::vector<Slot> m_slots;
+    std::vector<std::pair<void*, size_t>> m_buffers;
+    bool m_fixedFiles = false;
+    int m_broken = 0;               // errno of a failed io_uring_enter
+
+    int m_ring = -1;
+    uint8_t* m_sqRing = nullptr;
+    uint8_t* m_cqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    size_t m_cqRingSize = 0;
+    struct io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+    uint32_t* m_sqTail = nullptr;
+    uint32_t* m_sqArray = nullptr;
+    uint32_t m_sqMask = 0;
+    uint32_t m_localTail = 0;
+    uint32_t m_unsubmitted = 0;
+    uint32_t* m_cqHead = nullptr;
+    uint32_t* m_cqTail = nullptr;
+    uint32_t m_cqMask = 0;
+    struct io_uring_cqe* m_cqes = nullptr;
+};
+
+#endif
+
+// ============================================================================
+// IOCP BACKEND
+// ============================================================================
+
+#ifdef _WIN32
+
+class IocpBlockIo : public AsyncBlockIo {
+public:
+    IocpBlockIo(const std::vector<BlockDevice*>& devices, uint32_t queueDepth)
+        : AsyncBlockIo(queueDepth), m_devices(devices), m_slots(queueDepth) {}
+
+    ~IocpBlockIo() override {
+        std::vector<AsyncCompletion> drain(m_queueDepth);
+        while (m_port && m_inFlight > 0) {
+            Collect(drain.data(), drain.size(), 1);
+        }
+        for (HANDLE handle : m_handles) {
+            CloseHandle(handle);
+        }
+        if (m_port) CloseHandle(m_port);
+    }
+
+    bool Open(std::wstring& error) {
+        m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        if (!m_port) {
+            error = L"Cannot create an I/O completion port.";
+            return false;
+        }
+        // The devices were opened for synchronous I/O; a second handle to the
+        // same object can be overlapped.
+        for (size_t i = 0; i < m_devices.size(); i++) {
+            HANDLE original = (HANDLE)m_devices[i]->GetNativeHandle();
+            HANDLE handle = ReOpenFile(original, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                       FILE_FLAG_OVERLAPPED);
+            if (handle == INVALID_HANDLE_VALUE) {
+                handle = ReOpenFile(original, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_FLAG_OVERLAPPED);
+            }
+            if (handle == INVALID_HANDLE_VALUE) {
+                error = L"Cannot reopen " + m_devices[i]->GetPath() + L" for overlapped I/O.";
+                return false;
+            }
+            m_handles.push_back(handle);
+            if (!CreateIoCompletionPort(handle, m_port, (ULONG_PTR)i, 0)) {
+                error = L"Cannot attach " + m_devices[i]->GetPath() + L" to the completion port.";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    AsyncBackend GetBackend() const override { return AsyncBackend::Iocp; }
+
+    bool RegisterBuffers(const std::vector<std::pair<void*, size_t>>&) override { return true; }
+
+protected:
+    void Enqueue(uint32_t slot, const AsyncRequest& request) override {
+        m_slots[slot].request = request;
+        m_slots[slot].done = 0;
+        Start(slot);
+    }
+
+    size_t Collect(AsyncCompletion* completions, size_t capacity, size_t minimum) override {
+        size_t count = 0;
+        while (count < capacity && !m_ready.empty()) {
+            completions[count++] = m_ready.front().second;
+            FreeSlot(m_ready.front().first);
+            m_ready.pop_front();
+        }
+
+        OVERLAPPED_ENTRY entries[64];
+        while (count < capacity) {
+            bool wait = count < minimum;
+            ULONG want = (ULONG)std::min<size_t>(capacity - count, 64);
+            ULONG got = 0;
+            if (!GetQueuedCompletionStatusEx(m_port, entries, want, &got, wait ? INFINITE : 0, FALSE)) {
+                break;
+            }
+            for (ULONG i = 0; i < got; i++) {
+                Slot* state = CONTAINING_RECORD(entries[i].lpOverlapped, Slot, overlapped);
+                uint32_t slot = (uint32_t)(state - m_slots.data());
+                DWORD bytes = 0;
+                BOOL ok = GetOverlappedResult(m_handles[state->request.device], &state->overlapped, &bytes, FALSE);
+                if (ok && bytes > 0) {
+                    state->done += bytes;
+                    if (state->done < state->request.length) {
+                        Start(slot);
+                        continue;
+                    }
+                }
+                AsyncCompletion& completion = completions[count++];
+                completion.userData = state->request.userData;
+                completion.ok = ok && bytes > 0;
+                completion.error = ok ? (completion.ok ? 0 : ERROR_HANDLE_EOF) : (int)GetLastError();
+                FreeSlot(slot);
+            }
+            // Completed flushes and failed starts may have been queued meanwhile.
+            while (count < capacity && !m_ready.empty()) {
+                completions[count++] = m_ready.front().second;
+                FreeSlot(m_ready.front().first);
+                m_ready.pop_front();
+            }
+            if (!wait && got == 0) break;
+        }
+        return count;
+    }
+
+private:
+    struct Slot {
+        OVERLAPPED overlapped;
+        AsyncRequest request;
+        size_t done = 0;
+    };
+
+    void Start(uint32_t slot) {
+        Slot& state = m_slots[slot];
+        const AsyncRequest& request = state.request;
+        HANDLE handle = m_handles[request.device];
+
+        AsyncCompletion completion;
+        completion.userData = request.userData;
+        if (request.op == AsyncOp::Flush) {
+            // There is no overlapped flush; it completes before Reap.
+            completion.ok = FlushFileBuffers(handle) != FALSE;
+            completion.error = completion.ok ? 0 : (int)GetLastError();
+            m_ready.push_back({slot, completion});
+            return;
+        }
+
+        uint64_t offset = request.offset + state.done;
+        memset(&state.overlapped, 0, sizeof(state.overlapped));
+        state.overlapped.Offset = (DWORD)offset;
+        state.overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        BYTE* data = (BYTE*)request.buffer + state.done;
+        DWORD length = (DWORD)std::min(request.length - state.done, MAX_TRANSFER);
+        BOOL started = request.op == AsyncOp::Write ? WriteFile(handle, data, length, NULL, &state.overlapped)
+                                                    : ReadFile(handle, data, length, NULL, &state.overlapped);
+        // Synchronous success still posts a completion packet.
+        if (!started && GetLastError() != ERROR_IO_PENDING) {
+            completion.ok = false;
+            completion.error = (int)GetLastError();
+            m_ready.push_back({slot, completion});
+        }
+    }
+
+    std::vector<BlockDevice*> m_devices;
+    std::vector<HANDLE> m_handles;
+    std::vector<Slot> m_slots;
+    std::deque<std::pair<uint32_t, AsyncCompletion>> m_ready;
+    HANDLE m_port = NULL;
+};
+
+#endif
+
+// ============================================================================
+// FACTORY
+// ============================================================================
+
+std::unique_ptr<AsyncBlockIo> CreateAsyncBlockIo(const std::vector<BlockDevice*>& devices, uint32_t queueDepth,
+                                                 std::wstring& error, AsyncBackend backend) {
+    if (devices.empty() || queueDepth == 0) {
+        error = L"An I/O queue needs devices and a queue depth.";
+        return nullptr;
+    }
+    bool native = std::all_of(devices.begin(), devices.end(),
+                              [](BlockDevice* device) { return device->GetNativeHandle() != -1; });
+
+    std::wstring kernelError;
+    if (backend != AsyncBackend::ThreadPool) {
+        if (!native) {
+            kernelError = L"Some devices have no native handle.";
+        }
+#ifdef INFERNO_HAVE_IO_URING
+        else if (backend == AsyncBackend::Auto || backend == AsyncBackend::IoUring) {
+            std::unique_ptr<IoUringBlockIo> ring(new IoUringBlockIo(devices, queueDepth));
+            if (ring->Open(kernelError)) return ring;
+        }
+#endif
+#ifdef _WIN32
+        else if (backend == AsyncBackend::Auto || backend == AsyncBackend::Iocp) {
+            std::unique_ptr<IocpBlockIo> port(new IocpBlockIo(devices, queueDepth));
+            if (port->Open(kernelError)) return std::move(port);
+        }
+#endif
+        else {
+            kernelError = std::wstring(AsyncBackendName(backend)) + L" is not available on this platform.";
+        }
+
+        if (backend != AsyncBackend::Auto) {
+            error = kernelError;
+            return nullptr;
+        }
+        LogMessage(LogLevel::Debug, "asyncio", L"Using the thread pool: " + kernelError);
+    }
+    return std::unique_ptr<AsyncBlockIo>(new ThreadPoolBlockIo(devices, queueDepth));
+}
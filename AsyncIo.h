@@ -0,0 +1,91 @@
+// ============================================================================
+// INFERNO - Asynchronous block I/O queues
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class AsyncBackend {
+    Auto,           // the kernel queue where it works, else the thread pool
+    IoUring,        // Linux 5.6+
+    Iocp,           // Windows overlapped I/O on a completion port
+    ThreadPool      // blocking BlockDevice calls on worker threads
+};
+
+const wchar_t* AsyncBackendName(AsyncBackend backend);
+
+enum class AsyncOp {
+    Read,
+    Write,
+    Flush
+};
+
+struct AsyncRequest {
+    AsyncOp op = AsyncOp::Write;
+    uint32_t device = 0;        // index into the devices the queue was created with
+    uint64_t offset = 0;
+    void* buffer = nullptr;
+    size_t length = 0;
+    uint64_t userData = 0;      // returned with the completion
+};
+
+struct AsyncCompletion {
+    uint64_t userData = 0;
+    bool ok = false;            // the whole length was transferred
+    int error = 0;              // errno or GetLastError() when not ok
+};
+
+// A submission/completion queue over a fixed set of devices, driven from one
+// thread: Submit queues requests without blocking and Reap hands all queued
+// requests to the backend before collecting finished ones, so one thread can
+// keep `queueDepth` requests in flight across every device. Short transfers
+// are resubmitted internally; a completion means the request is done.
+//
+// Devices and buffers must outlive the requests that use them, and the queue
+// must not be shared between threads.
+class AsyncBlockIo {
+public:
+    virtual ~AsyncBlockIo() = default;
+
+    virtual AsyncBackend GetBackend() const = 0;
+    uint32_t GetQueueDepth() const { return m_queueDepth; }
+    uint32_t GetInFlight() const { return m_inFlight; }
+
+    // Buffers used for most requests, such as pipeline chunks. io_uring pins
+    // them once and skips per-request page mapping; other backends ignore
+    // this. Call only while nothing is in flight.
+    virtual bool RegisterBuffers(const std::vector<std::pair<void*, size_t>>& buffers) = 0;
+
+    // False when `queueDepth` requests are already queued or in flight.
+    bool Submit(const AsyncRequest& request);
+
+    // Waits until at least `minimum` completions are available (0 polls)
+    // and stores up to `capacity` of them. Returns the number stored.
+    size_t Reap(AsyncCompletion* completions, size_t capacity, size_t minimum);
+
+protected:
+    explicit AsyncBlockIo(uint32_t queueDepth);
+
+    virtual void Enqueue(uint32_t slot, const AsyncRequest& request) = 0;
+    virtual size_t Collect(AsyncCompletion* completions, size_t capacity, size_t minimum) = 0;
+
+    uint32_t AllocateSlot();
+    void FreeSlot(uint32_t slot);
+
+    uint32_t m_queueDepth;
+    uint32_t m_inFlight = 0;
+    std::vector<uint32_t> m_freeSlots;
+};
+
+// Kernel queues need each device's native handle (BlockDevice::
+// GetNativeHandle); with devices that have none, or when the kernel refuses
+// the queue, Auto falls back to the thread pool.
+std::unique_ptr<AsyncBlockIo> CreateAsyncBlockIo(const std::vector<BlockDevice*>& devices, uint32_t queueDepth,
+                                                 std::wstring& error, AsyncBackend backend = AsyncBackend::Auto);
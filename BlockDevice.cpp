@@ -0,0 +1,820 @@
+// ============================================================================
+// INFERNO - Raw block device access
+// ============================================================================
+
+#include "BlockDevice.h"
+#include "Platform.h"
+#include "SimulatedDevice.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <cwchar>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#include <setupapi.h>
+#include <cfgmgr32.h>
+#else
+#include <cerrno>
+#include <cstdio>
+#include <climits>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#endif
+
+static std::wstring TrimIdentityString(const std::string& text) {
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos) return std::wstring();
+    size_t last = text.find_last_not_of(" \t\r\n");
+    return Utf8ToWide(text.substr(first, last - first + 1));
+}
+
+// ============================================================================
+// WINDOWS BACKEND
+// ============================================================================
+
+#ifdef _WIN32
+
+class Win32BlockDevice : public BlockDevice {
+public:
+    Win32BlockDevice(HANDLE handle, const std::wstring& path) : m_handle(handle), m_path(path) {
+        QueryGeometry();
+        QueryIdentity();
+        QueryTraits();
+    }
+
+    ~Win32BlockDevice() override {
+        for (HANDLE volume : m_lockedVolumes) {
+            CloseHandle(volume);
+        }
+        CloseHandle(m_handle);
+    }
+
+    bool Read(uint64_t offset, void* buffer, size_t length) override {
+        BYTE* cursor = (BYTE*)buffer;
+        while (length > 0) {
+            DWORD chunk = (DWORD)std::min<size_t>(length, 0x40000000);
+            OVERLAPPED ov = {0};
+            ov.Offset = (DWORD)offset;
+            ov.OffsetHigh = (DWORD)(offset >> 32);
+            DWORD done = 0;
+            if (!ReadFile(m_handle, cursor, chunk, &done, &ov) || done == 0) {
+                return false;
+            }
+            cursor += done;
+            offset += done;
+            length -= done;
+        }
+        return true;
+    }
+
+    bool Write(uint64_t offset, const void* buffer, size_t length) override {
+        const BYTE* cursor = (const BYTE*)buffer;
+        while (length > 0) {
+            DWORD chunk = (DWORD)std::min<size_t>(length, 0x40000000);
+            OVERLAPPED ov = {0};
+            ov.Offset = (DWORD)offset;
+            ov.OffsetHigh = (DWORD)(offset >> 32);
+            DWORD done = 0;
+            if (!WriteFile(m_handle, cursor, chunk, &done, &ov) || done == 0) {
+                return false;
+            }
+            cursor += done;
+            offset += done;
+            length -= done;
+        }
+        return true;
+    }
+
+    bool Flush() override {
+        return FlushFileBuffers(m_handle) != FALSE;
+    }
+
+    bool ReloadPartitionTable() override {
+        DWORD bytes = 0;
+        return DeviceIoControl(m_handle, IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &bytes, NULL) != FALSE;
+    }
+
+    bool Discard(uint64_t offset, uint64_t length) override {
+        if (length == 0) return true;
+        if (!m_traits.supportsDiscard) return false;
+        DWORD bytes = 0;
+        if (m_traits.isRegularFile) {
+            // Deallocates the range of a sparse file and zeros it otherwise.
+            FILE_ZERO_DATA_INFORMATION zero;
+            zero.FileOffset.QuadPart = (LONGLONG)offset;
+            zero.BeyondFinalZero.QuadPart = (LONGLONG)(offset + length);
+            return DeviceIoControl(m_handle, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &bytes, NULL) != FALSE;
+        }
+
+        struct {
+            DEVICE_MANAGE_DATA_SET_ATTRIBUTES attributes;
+            DEVICE_DATA_SET_RANGE range;
+        } request = {};
+        request.attributes.Size = sizeof(request.attributes);
+        request.attributes.Action = DeviceDsmAction_Trim;
+        request.attributes.DataSetRangesOffset = offsetof(decltype(request), range);
+        request.attributes.DataSetRangesLength = sizeof(request.range);
+        request.range.StartingOffset = (LONGLONG)offset;
+        request.range.LengthInBytes = length;
+        return DeviceIoControl(m_handle, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &request, sizeof(request),
+                               NULL, 0, &bytes, NULL) != FALSE;
+    }
+
+    // Locks and dismounts every volume with an extent on this disk; Windows
+    // refuses raw writes over a mounted volume.
+    bool Lock(std::wstring& error) override {
+        if (m_traits.isRegularFile || !m_lockedVolumes.empty()) return true;
+
+        DWORD bytes = 0;
+        STORAGE_DEVICE_NUMBER disk;
+        if (!DeviceIoControl(m_handle, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0, &disk, sizeof(disk), &bytes, NULL)) {
+            error = L"Cannot identify the disk number of " + m_path;
+            return false;
+        }
+
+        wchar_t name[MAX_PATH];
+        HANDLE search = FindFirstVolumeW(name, MAX_PATH);
+        if (search == INVALID_HANDLE_VALUE) return true;
+        bool ok = true;
+        do {
+            // Without its trailing backslash a volume name opens the volume
+            // rather than its root directory.
+            std::wstring volumePath = name;
+            if (!volumePath.empty() && volumePath.back() == L'\\') volumePath.pop_back();
+            HANDLE volume = CreateFileW(volumePath.c_str(), GENERIC_READ | GENERIC_WRITE,
+                                        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+            if (volume == INVALID_HANDLE_VALUE) continue;
+
+            std::vector<BYTE> buffer(sizeof(VOLUME_DISK_EXTENTS) + 31 * sizeof(DISK_EXTENT));
+            bool onDisk = false;
+            if (DeviceIoControl(volume, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0,
+                                buffer.data(), (DWORD)buffer.size(), &bytes, NULL)) {
+                const VOLUME_DISK_EXTENTS* extents = (const VOLUME_DISK_EXTENTS*)buffer.data();
+                for (DWORD i = 0; i < extents->NumberOfDiskExtents; i++) {
+                    if (extents->Extents[i].DiskNumber == disk.DeviceNumber) onDisk = true;
+                }
+            }
+            if (!onDisk) {
+                CloseHandle(volume);
+                continue;
+            }
+
+            // Explorer and antivirus scanners let go of a volume within a few
+            // seconds; retry before giving up.
+            bool locked = false;
+            for (int attempt = 0; attempt < 20 && !locked; attempt++) {
+                locked = DeviceIoControl(volume, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &bytes, NULL) != FALSE;
+                if (!locked) Sleep(250);
+            }
+            if (!locked) {
+                error = L"A volume on " + m_path + L" is in use by another program.";
+                CloseHandle(volume);
+                ok = false;
+                break;
+            }
+            DeviceIoControl(volume, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &bytes, NULL);
+            m_lockedVolumes.push_back(volume);
+        } while (FindNextVolumeW(search, name, MAX_PATH));
+        FindVolumeClose(search);
+        return ok;
+    }
+
+    const DeviceGeometry& GetGeometry() const override { return m_geometry; }
+    const DeviceIdentity& GetIdentity() const override { return m_identity; }
+    const DeviceTraits& GetTraits() const override { return m_traits; }
+    const std::wstring& GetPath() const override { return m_path; }
+    intptr_t GetNativeHandle() const override { return (intptr_t)m_handle; }
+
+private:
+    void QueryIdentity() {
+        STORAGE_PROPERTY_QUERY query = {};
+        query.PropertyId = StorageDeviceProperty;
+        query.QueryType = PropertyStandardQuery;
+        std::vector<BYTE> buffer(1024);
+        DWORD bytes = 0;
+        if (!DeviceIoControl(m_handle, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+                             buffer.data(), (DWORD)buffer.size(), &bytes, NULL) ||
+            bytes < sizeof(STORAGE_DEVICE_DESCRIPTOR)) {
+            return;
+        }
+
+        const STORAGE_DEVICE_DESCRIPTOR* descriptor = (const STORAGE_DEVICE_DESCRIPTOR*)buffer.data();
+        auto field = [&](DWORD offset) -> std::wstring {
+            if (offset == 0 || offset >= bytes) return std::wstring();
+            const char* text = (const char*)buffer.data() + offset;
+            return TrimIdentityString(std::string(text, strnlen(text, bytes - offset)));
+        };
+        m_identity.vendor = field(descriptor->VendorIdOffset);
+        m_identity.product = field(descriptor->ProductIdOffset);
+        m_identity.revision = field(descriptor->ProductRevisionOffset);
+        m_traits.removable = descriptor->RemovableMedia != FALSE;
+        m_traits.usb = descriptor->BusType == BusTypeUsb;
+    }
+
+    void QueryTraits() {
+        if (m_traits.isRegularFile) {
+            m_traits.supportsDiscard = true;
+            m_traits.discardZeroesData = true;
+            m_traits.discardGranularity = m_geometry.logicalSectorSize;
+            return;
+        }
+
+        DWORD bytes = 0;
+        STORAGE_PROPERTY_QUERY query = {};
+        query.QueryType = PropertyStandardQuery;
+
+        query.PropertyId = StorageDeviceSeekPenaltyProperty;
+        DEVICE_SEEK_PENALTY_DESCRIPTOR seekPenalty = {};
+        if (DeviceIoControl(m_handle, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+                            &seekPenalty, sizeof(seekPenalty), &bytes, NULL)) {
+            m_traits.rotational = seekPenalty.IncursSeekPenalty != FALSE;
+        }
+
+        query.PropertyId = StorageDeviceTrimProperty;
+        DEVICE_TRIM_DESCRIPTOR trim = {};
+        if (DeviceIoControl(m_handle, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+                            &trim, sizeof(trim), &bytes, NULL)) {
+            m_traits.supportsDiscard = trim.TrimEnabled != FALSE;
+            m_traits.discardGranularity = m_geometry.physicalSectorSize;
+        }
+    }
+
+    void QueryGeometry() {
+        DWORD bytes = 0;
+        DISK_GEOMETRY_EX diskGeometry;
+        if (DeviceIoControl(m_handle, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL, 0,
+                            &diskGeometry, sizeof(diskGeometry), &bytes, NULL)) {
+            m_geometry.sizeBytes = diskGeometry.DiskSize.QuadPart;
+            m_geometry.logicalSectorSize = diskGeometry.Geometry.BytesPerSector;
+            m_geometry.physicalSectorSize = diskGeometry.Geometry.BytesPerSector;
+
+            GET_LENGTH_INFO lengthInfo;
+            if (DeviceIoControl(m_handle, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0,
+                                &lengthInfo, sizeof(lengthInfo), &bytes, NULL)) {
+                m_geometry.sizeBytes = lengthInfo.Length.QuadPart;
+            }
+
+            STORAGE_PROPERTY_QUERY query = {};
+            query.PropertyId = StorageAccessAlignmentProperty;
+            query.QueryType = PropertyStandardQuery;
+            STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR alignment = {};
+            if (DeviceIoControl(m_handle, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+                                &alignment, sizeof(alignment), &bytes, NULL) &&
+                alignment.BytesPerPhysicalSector >= m_geometry.logicalSectorSize) {
+                m_geometry.physicalSectorSize = alignment.BytesPerPhysicalSector;
+            }
+        } else {
+            // Not a disk: a plain image file.
+            m_traits.isRegularFile = true;
+            LARGE_INTEGER size;
+            if (GetFileSizeEx(m_handle, &size)) {
+                m_geometry.sizeBytes = size.QuadPart;
+            }
+        }
+    }
+
+    HANDLE m_handle;
+    std::wstring m_path;
+    DeviceGeometry m_geometry;
+    DeviceIdentity m_identity;
+    DeviceTraits m_traits;
+    std::vector<HANDLE> m_lockedVolumes;
+};
+
+static std::unique_ptr<BlockDevice> OpenSystemBlockDevice(const std::wstring& path, bool writable) {
+    DWORD access = GENERIC_READ | (writable ? GENERIC_WRITE : 0);
+    HANDLE handle = CreateFileW(path.c_str(), access, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    return std::unique_ptr<BlockDevice>(new Win32BlockDevice(handle, path));
+}
+
+std::wstring GetPhysicalDrivePath(uint32_t diskNumber) {
+    return L"\\\\.\\PhysicalDrive" + std::to_wstring(diskNumber);
+}
+
+// GUID_DEVINTERFACE_DISK, spelled out so no translation unit needs initguid.h
+static const GUID DISK_INTERFACE_GUID = {0x53f56307, 0xb6bf, 0x11d0, {0x94, 0xf2, 0x00, 0xa0, 0xc9, 0x1e, 0xfb, 0x8b}};
+
+// The device node of the disk interface that reports `diskNumber`.
+static bool FindDiskDeviceNode(uint32_t diskNumber, DEVINST& node) {
+    HDEVINFO set = SetupDiGetClassDevsW(&DISK_INTERFACE_GUID, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+    if (set == INVALID_HANDLE_VALUE) return false;
+    bool found = false;
+    SP_DEVICE_INTERFACE_DATA item = {sizeof(item)};
+    for (DWORD index = 0; !found && SetupDiEnumDeviceInterfaces(set, NULL, &DISK_INTERFACE_GUID, index, &item); index++) {
+        DWORD required = 0;
+        SetupDiGetDeviceInterfaceDetailW(set, &item, NULL, 0, &required, NULL);
+        if (required < sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W)) continue;
+        std::vector<uint8_t> buffer(required);
+        SP_DEVICE_INTERFACE_DETAIL_DATA_W* detail = (SP_DEVICE_INTERFACE_DETAIL_DATA_W*)buffer.data();
+        detail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W);
+        SP_DEVINFO_DATA info = {sizeof(info)};
+        if (!SetupDiGetDeviceInterfaceDetailW(set, &item, detail, required, NULL, &info)) continue;
+
+        HANDLE handle = CreateFileW(detail->DevicePath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                    OPEN_EXISTING, 0, NULL);
+        if (handle == INVALID_HANDLE_VALUE) continue;
+        STORAGE_DEVICE_NUMBER number = {};
+        DWORD bytes = 0;
+        if (DeviceIoControl(handle, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0, &number, sizeof(number), &bytes, NULL) &&
+            number.DeviceNumber == diskNumber) {
+            node = info.DevInst;
+            found = true;
+        }
+        CloseHandle(handle);
+    }
+    SetupDiDestroyDeviceInfoList(set);
+    return found;
+}
+
+// The first location path of a device node, e.g.
+// "PCIROOT(0)#PCI(1400)#USBROOT(0)#USB(2)#USB(3)".
+static std::wstring GetLocationPath(DEVINST node) {
+    ULONG bytes = 0;
+    if (CM_Get_DevNode_Registry_PropertyW(node, CM_DRP_LOCATION_PATHS, NULL, NULL, &bytes, 0) != CR_BUFFER_SMALL ||
+        bytes == 0) {
+        return std::wstring();
+    }
+    std::vector<wchar_t> buffer(bytes / sizeof(wchar_t) + 1, 0);
+    if (CM_Get_DevNode_Registry_PropertyW(node, CM_DRP_LOCATION_PATHS, NULL, buffer.data(), &bytes, 0) != CR_SUCCESS) {
+        return std::wstring();
+    }
+    return buffer.data();
+}
+
+// Windows does not publish link speeds outside the hub driver's IOCTLs, so
+// the hubs come from the location path of the USB device above the disk.
+static bool QueryDiskUsbTopology(uint32_t diskNumber, UsbTopology& topology) {
+    DEVINST node = 0;
+    if (!FindDiskDeviceNode(diskNumber, node)) return false;
+    std::wstring location;
+    for (int depth = 0; depth < 8 && location.empty(); depth++) {
+        DEVINST parent = 0;
+        if (CM_Get_Parent(&parent, node, 0) != CR_SUCCESS) return false;
+        node = parent;
+        std::wstring path = GetLocationPath(node);
+        if (path.find(L"#USBROOT(") != std::wstring::npos) location = path;
+    }
+    // A UAS or composite device reports the interface below the device.
+    size_t function = location.find(L"#USBMI(");
+    if (function != std::wstring::npos) location.erase(function);
+    size_t root = location.find(L"#USBROOT(");
+    if (root == std::wstring::npos) return false;
+
+    topology = UsbTopology();
+    topology.controller = location.substr(0, root);
+    size_t end = location.find(L'#', root + 1);
+    while (end != std::wstring::npos) {
+        topology.hubs.push_back({location.substr(0, end), 0});
+        end = location.find(L'#', end + 1);
+    }
+    size_t port = location.rfind(L"#USB(");
+    if (port != std::wstring::npos && port > root) {
+        topology.port = (uint32_t)wcstoul(location.c_str() + port + 5, nullptr, 10);
+    }
+    return true;
+}
+
+std::vector<BlockDeviceInfo> EnumerateBlockDevices() {
+    std::vector<BlockDeviceInfo> devices;
+    // Zero access rights are enough for the property queries and need no
+    // elevation. Disk numbers can have gaps after hot-unplugging.
+    for (uint32_t diskNumber = 0; diskNumber < 64; diskNumber++) {
+        std::wstring path = GetPhysicalDrivePath(diskNumber);
+        HANDLE handle = CreateFileW(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                    NULL, OPEN_EXISTING, 0, NULL);
+        if (handle == INVALID_HANDLE_VALUE) continue;
+        Win32BlockDevice device(handle, path);
+        if (device.GetGeometry().sizeBytes == 0) continue;      // card reader without a card
+        BlockDeviceInfo info;
+        info.path = path;
+        info.geometry = device.GetGeometry();
+        info.identity = device.GetIdentity();
+        info.traits = device.GetTraits();
+        if (info.traits.usb) QueryDiskUsbTopology(diskNumber, info.topology);
+        devices.push_back(info);
+    }
+    return devices;
+}
+
+static bool QuerySystemUsbTopology(const std::wstring& path, UsbTopology& topology) {
+    std::wstring prefix = GetPhysicalDrivePath(0);
+    prefix.pop_back();
+    if (path.compare(0, prefix.size(), prefix) != 0) return false;
+    return QueryDiskUsbTopology((uint32_t)wcstoul(path.c_str() + prefix.size(), nullptr, 10), topology);
+}
+
+// ============================================================================
+// POSIX BACKEND
+// ============================================================================
+
+#else
+
+#ifdef __linux__
+
+static std::string ReadSysfsLine(const std::string& path) {
+    std::string text;
+    if (FILE* file = fopen(path.c_str(), "r")) {
+        char line[256];
+        if (fgets(line, sizeof(line), file)) text = line;
+        fclose(file);
+    }
+    return text;
+}
+
+static uint64_t ReadSysfsNumber(const std::string& path) {
+    return strtoull(ReadSysfsLine(path).c_str(), nullptr, 10);
+}
+
+// The sysfs directory of the whole disk behind a block device node, so a
+// partition reports the properties of the disk it lives on.
+static std::string GetSysfsDiskDirectory(dev_t device) {
+    char link[64];
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(device), minor(device));
+    char resolved[PATH_MAX];
+    if (!realpath(link, resolved)) return std::string();
+    std::string directory = resolved;
+    if (access((directory + "/partition").c_str(), F_OK) == 0) {
+        directory.erase(directory.rfind('/'));
+    }
+    return directory;
+}
+
+static void ReadSysfsDiskProperties(const std::string& directory, DeviceGeometry& geometry,
+                                    DeviceIdentity& identity, DeviceTraits& traits) {
+    // SD/MMC cards publish their allocation unit; USB mass storage does not.
+    geometry.eraseBlockSize = (uint32_t)ReadSysfsNumber(directory + "/device/preferred_erase_size");
+
+    identity.vendor = TrimIdentityString(ReadSysfsLine(directory + "/device/vendor"));
+    identity.product = TrimIdentityString(ReadSysfsLine(directory + "/device/model"));
+    identity.revision = TrimIdentityString(ReadSysfsLine(directory + "/device/rev"));
+
+    traits.rotational = ReadSysfsNumber(directory + "/queue/rotational") != 0;
+    traits.removable = ReadSysfsNumber(directory + "/removable") != 0;
+    // The resolved path runs through the host controller and hub chain.
+    traits.usb = directory.find("/usb") != std::string::npos;
+    traits.discardGranularity = (uint32_t)ReadSysfsNumber(directory + "/queue/discard_granularity");
+    traits.maxDiscardBytes = ReadSysfsNumber(directory + "/queue/discard_max_bytes");
+    traits.supportsDiscard = traits.maxDiscardBytes > 0;
+    // The kernel no longer promises zeros after BLKDISCARD (discard_zeroes_data
+    // is always 0), so callers verify by reading back.
+    traits.discardZeroesData = false;
+}
+
+// USB devices are named after their port chain ("2-1.3" is port 3 of the
+// hub on port 1 of bus 2); interfaces below them carry a ':'.
+static bool IsUsbDeviceName(const std::string& name) {
+    return !name.empty() && isdigit((unsigned char)name[0]) && name.find('-') != std::string::npos &&
+           name.find(':') == std::string::npos;
+}
+
+// The resolved sysfs path of a USB disk runs from the host controller
+// through its root hub and every hub to the device:
+// .../0000:00:14.0/usb2/2-1/2-1.3/2-1.3:1.0/host6/.../block/sdb
+static bool ReadSysfsUsbTopology(const std::string& directory, UsbTopology& topology) {
+    std::vector<std::string> parts;
+    size_t start = 1;
+    while (start < directory.size()) {
+        size_t end = directory.find('/', start);
+        if (end == std::string::npos) end = directory.size();
+        parts.push_back(directory.substr(start, end - start));
+        start = end + 1;
+    }
+    size_t root = 1;
+    while (root < parts.size() && !(parts[root].compare(0, 3, "usb") == 0 && parts[root].size() > 3 &&
+                                    isdigit((unsigned char)parts[root][3]))) {
+        root++;
+    }
+    if (root >= parts.size()) return false;
+
+    topology = UsbTopology();
+    topology.controller = Utf8ToWide(parts[root - 1]);
+    std::string path;
+    for (size_t i = 0; i <= root; i++) path += "/" + parts[i];
+    topology.hubs.push_back({Utf8ToWide(parts[root]), (uint32_t)ReadSysfsNumber(path + "/speed")});
+    for (size_t i = root + 1; i < parts.size() && IsUsbDeviceName(parts[i]); i++) {
+        path += "/" + parts[i];
+        uint32_t speed = (uint32_t)ReadSysfsNumber(path + "/speed");
+        if (i + 1 < parts.size() && IsUsbDeviceName(parts[i + 1])) {
+            topology.hubs.push_back({Utf8ToWide(parts[i]), speed});
+        } else {
+            topology.speedMbps = speed;
+            topology.port = (uint32_t)strtoul(parts[i].c_str() + parts[i].find_last_of("-.") + 1, nullptr, 10);
+        }
+    }
+    return true;
+}
+
+#endif
+
+class PosixBlockDevice : public BlockDevice {
+public:
+    PosixBlockDevice(int fd, const std::wstring& path) : m_fd(fd), m_path(path) {
+        QueryGeometry();
+    }
+
+    ~PosixBlockDevice() override {
+        if (m_lockFd >= 0) close(m_lockFd);
+        close(m_fd);
+    }
+
+    bool Read(uint64_t offset, void* buffer, size_t length) override {
+        char* cursor = (char*)buffer;
+        while (length > 0) {
+            ssize_t done = pread(m_fd, cursor, length, (off_t)offset);
+            if (done < 0 && errno == EINTR) continue;
+            if (done <= 0) return false;
+            cursor += done;
+            offset += done;
+            length -= done;
+        }
+        return true;
+    }
+
+    bool Write(uint64_t offset, const void* buffer, size_t length) override {
+        const char* cursor = (const char*)buffer;
+        while (length > 0) {
+            ssize_t done = pwrite(m_fd, cursor, length, (off_t)offset);
+            if (done < 0 && errno == EINTR) continue;
+            if (done <= 0) return false;
+            cursor += done;
+            offset += done;
+            length -= done;
+        }
+        return true;
+    }
+
+    bool Flush() override {
+        return fsync(m_fd) == 0;
+    }
+
+    bool ReloadPartitionTable() override {
+#ifdef BLKRRPART
+        if (m_isBlockDevice) {
+            return ioctl(m_fd, BLKRRPART) == 0;
+        }
+#endif
+        return true;
+    }
+
+    bool Discard(uint64_t offset, uint64_t length) override {
+        if (length == 0) return true;
+        if (!m_traits.supportsDiscard) return false;
+#ifdef __linux__
+        if (m_isBlockDevice) {
+            uint64_t range[2] = {offset, length};
+            return ioctl(m_fd, BLKDISCARD, range) == 0;
+        }
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+        return fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length) == 0;
+#else
+        return false;
+#endif
+    }
+
+    bool Lock(std::wstring& error) override {
+        if (m_locked) return true;
+        if (m_isBlockDevice) {
+            // Linux refuses O_EXCL on a block device that is mounted, held by
+            // device-mapper or opened exclusively by another program, and
+            // keeps the disk to us while the descriptor stays open.
+            m_lockFd = open(WideToUtf8(m_path).c_str(), O_RDONLY | O_EXCL | O_CLOEXEC);
+            if (m_lockFd < 0) {
+                error = L"The device is in use (mounted or opened by another program): " + m_path;
+                return false;
+            }
+        }
+        // Advisory lock for cooperating tools such as another Inferno job.
+        if (flock(m_fd, LOCK_EX | LOCK_NB) != 0) {
+            if (m_lockFd >= 0) close(m_lockFd);
+            m_lockFd = -1;
+            error = L"Another program holds a lock on " + m_path;
+            return false;
+        }
+        m_locked = true;
+        return true;
+    }
+
+    const DeviceGeometry& GetGeometry() const override { return m_geometry; }
+    const DeviceIdentity& GetIdentity() const override { return m_identity; }
+    const DeviceTraits& GetTraits() const override { return m_traits; }
+    const std::wstring& GetPath() const override { return m_path; }
+    intptr_t GetNativeHandle() const override { return m_fd; }
+
+private:
+    void QueryGeometry() {
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) return;
+
+        m_isBlockDevice = S_ISBLK(st.st_mode);
+        if (!m_isBlockDevice) {
+            m_geometry.sizeBytes = (uint64_t)st.st_size;
+            m_traits.isRegularFile = true;
+#ifdef FALLOC_FL_PUNCH_HOLE
+            // Punched holes read back as zeros on every filesystem that
+            // accepts them; the others fail the call and callers write zeros.
+            m_traits.supportsDiscard = true;
+            m_traits.discardZeroesData = true;
+            m_traits.discardGranularity = (uint32_t)st.st_blksize;
+#endif
+            return;
+        }
+
+#ifdef __linux__
+        uint64_t size = 0;
+        if (ioctl(m_fd, BLKGETSIZE64, &size) == 0) m_geometry.sizeBytes = size;
+        int logical = 0;
+        if (ioctl(m_fd, BLKSSZGET, &logical) == 0 && logical > 0) m_geometry.logicalSectorSize = logical;
+        unsigned int physical = 0;
+        if (ioctl(m_fd, BLKPBSZGET, &physical) == 0 && physical >= m_geometry.logicalSectorSize) {
+            m_geometry.physicalSectorSize = physical;
+        } else {
+            m_geometry.physicalSectorSize = m_geometry.logicalSectorSize;
+        }
+
+        std::string directory = GetSysfsDiskDirectory(st.st_rdev);
+        if (!directory.empty()) {
+            ReadSysfsDiskProperties(directory, m_geometry, m_identity, m_traits);
+        }
+#endif
+    }
+
+    int m_fd;
+    int m_lockFd = -1;
+    bool m_isBlockDevice = false;
+    bool m_locked = false;
+    std::wstring m_path;
+    DeviceGeometry m_geometry;
+    DeviceIdentity m_identity;
+    DeviceTraits m_traits;
+};
+
+static std::unique_ptr<BlockDevice> OpenSystemBlockDevice(const std::wstring& path, bool writable) {
+    int fd = open(WideToUtf8(path).c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    return std::unique_ptr<BlockDevice>(new PosixBlockDevice(fd, path));
+}
+
+std::wstring GetPhysicalDrivePath(uint32_t diskNumber) {
+    // Linux names whole disks sda, sdb, ... sdz, sdaa, ...
+    std::wstring suffix;
+    uint32_t n = diskNumber;
+    do {
+        suffix.insert(suffix.begin(), (wchar_t)(L'a' + n % 26));
+        n = n / 26;
+    } while (n-- > 0);
+    return L"/dev/sd" + suffix;
+}
+
+std::vector<BlockDeviceInfo> EnumerateBlockDevices() {
+    std::vector<BlockDeviceInfo> devices;
+#ifdef __linux__
+    // Read from sysfs rather than by opening the nodes, which needs root.
+    DIR* directory = opendir("/sys/block");
+    if (!directory) return devices;
+    while (struct dirent* entry = readdir(directory)) {
+        std::string name = entry->d_name;
+        if (name[0] == '.') continue;
+        static const char* const VIRTUAL_PREFIXES[] = {"loop", "ram", "zram", "dm-", "nbd"};
+        bool isVirtual = false;
+        for (const char* prefix : VIRTUAL_PREFIXES) {
+            if (name.compare(0, strlen(prefix), prefix) == 0) isVirtual = true;
+        }
+        if (isVirtual) continue;
+
+        char resolved[PATH_MAX];
+        if (!realpath(("/sys/block/" + name).c_str(), resolved)) continue;
+        std::string sysfs = resolved;
+
+        BlockDeviceInfo info;
+        info.path = Utf8ToWide("/dev/" + name);
+        // sysfs counts the size in 512-byte units whatever the sector size.
+        info.geometry.sizeBytes = ReadSysfsNumber(sysfs + "/size") * 512;
+        if (info.geometry.sizeBytes == 0) continue;     // card reader without a card
+        uint32_t logical = (uint32_t)ReadSysfsNumber(sysfs + "/queue/logical_block_size");
+        uint32_t physical = (uint32_t)ReadSysfsNumber(sysfs + "/queue/physical_block_size");
+        if (logical > 0) info.geometry.logicalSectorSize = logical;
+        info.geometry.physicalSectorSize = std::max(physical, info.geometry.logicalSectorSize);
+        ReadSysfsDiskProperties(sysfs, info.geometry, info.identity, info.traits);
+        if (info.traits.usb) ReadSysfsUsbTopology(sysfs, info.topology);
+        devices.push_back(info);
+    }
+    closedir(directory);
+    std::sort(devices.begin(), devices.end(),
+              [](const BlockDeviceInfo& a, const BlockDeviceInfo& b) { return a.path < b.path; });
+#endif
+    return devices;
+}
+
+static bool QuerySystemUsbTopology(const std::wstring& path, UsbTopology& topology) {
+#ifdef __linux__
+    struct stat st;
+    if (stat(WideToUtf8(path).c_str(), &st) != 0 || !S_ISBLK(st.st_mode)) return false;
+    std::string directory = GetSysfsDiskDirectory(st.st_rdev);
+    return directory.find("/usb") != std::string::npos && ReadSysfsUsbTopology(directory, topology);
+#else
+    return false;
+#endif
+}
+
+#endif
+
+// ============================================================================
+// COMMON
+// ============================================================================
+
+uint32_t GetWriteAlignment(const DeviceGeometry& geometry) {
+    return std::max(geometry.logicalSectorSize, geometry.physicalSectorSize);
+}
+
+bool WriteAligned(BlockDevice& device, uint64_t offset, const void* data, size_t length) {
+    const DeviceGeometry& geometry = device.GetGeometry();
+    uint64_t unit = GetWriteAlignment(geometry);
+    uint64_t begin = offset / unit * unit;
+    uint64_t end = (offset + length + unit - 1) / unit * unit;
+    // A size that is not a whole number of physical sectors ends in a part
+    // of one, which is as far as the device can be written.
+    if (geometry.sizeBytes > 0 && end > geometry.sizeBytes) {
+        end = std::max(geometry.sizeBytes, offset + length);
+    }
+    if (begin == offset && end == offset + length) {
+        return device.Write(offset, data, length);
+    }
+
+    std::vector<uint8_t> span((size_t)(end - begin));
+    if (begin < offset && !device.Read(begin, span.data(), (size_t)std::min<uint64_t>(unit, span.size()))) {
+        return false;
+    }
+    uint64_t tail = std::max(end - unit, begin);
+    if (end > offset + length && (tail > begin || begin == offset) &&
+        !device.Read(tail, span.data() + (tail - begin), (size_t)(end - tail))) {
+        return false;
+    }
+    memcpy(span.data() + (offset - begin), data, length);
+    return device.Write(begin, span.data(), span.size());
+}
+
+std::unique_ptr<BlockDevice> OpenBlockDevice(const std::wstring& path, bool writable) {
+    if (IsSimulatedDeviceSpec(path)) {
+        SimulatedDeviceConfig config;
+        std::wstring error;
+        if (!ParseSimulatedDeviceSpec(path, config, error)) {
+            return nullptr;
+        }
+        return CreateSimulatedDevice(config, error);
+    }
+    return OpenSystemBlockDevice(path, writable);
+}
+
+bool QueryUsbTopology(const std::wstring& path, UsbTopology& topology) {
+    if (IsSimulatedDeviceSpec(path)) {
+        SimulatedDeviceConfig config;
+        std::wstring error;
+        if (!ParseSimulatedDeviceSpec(path, config, error) || config.hub.empty()) {
+            return false;
+        }
+        topology = UsbTopology();
+        topology.controller = L"sim";
+        topology.hubs.push_back({L"sim/" + config.hub, config.hubSpeedMbps});
+        topology.speedMbps = config.hubSpeedMbps;
+        return true;
+    }
+    return QuerySystemUsbTopology(path, topology);
+}
+
+std::wstring DescribeUsbTopology(const UsbTopology& topology) {
+    if (!topology.IsKnown()) return L"not on USB";
+    std::wstring text = topology.controller;
+    for (const UsbHub& hub : topology.hubs) {
+        text += L" > " + hub.path;
+    }
+    if (topology.port) text += L", port " + std::to_wstring(topology.port);
+    if (topology.speedMbps) text += L" (" + std::to_wstring(topology.speedMbps) + L" Mb/s)";
+    return text;
+}
+
+double EstimateUsbLinkBytesPerSecond(uint32_t speedMbps) {
+    // Bulk-only transport keeps about 60% of a high-speed link busy with
+    // payload; SuperSpeed links lose less to encoding and protocol overhead.
+    double bytes = speedMbps * 125000.0;
+    return speedMbps <= 480 ? bytes * 0.6 : bytes * 0.7;
+}
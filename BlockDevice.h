@@ -0,0 +1,132 @@
+// ============================================================================
+// INFERNO - Raw block device access
+// ============================================================================
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct DeviceGeometry {
+    uint64_t sizeBytes = 0;
+    uint32_t logicalSectorSize = 512;
+    uint32_t physicalSectorSize = 512;
+    uint32_t eraseBlockSize = 0;        // 0 when the device does not report it
+};
+
+// Vendor, product and revision strings as reported by the device. Together
+// they identify a stick model; empty for image files.
+struct DeviceIdentity {
+    std::wstring vendor;
+    std::wstring product;
+    std::wstring revision;
+
+    bool IsKnown() const { return !vendor.empty() || !product.empty(); }
+};
+
+// How the device is attached and what it can do beyond reads and writes.
+struct DeviceTraits {
+    bool isRegularFile = false;         // an image file rather than a disk
+    bool rotational = false;
+    bool removable = false;
+    bool usb = false;
+    bool supportsDiscard = false;
+    bool discardZeroesData = false;     // discarded ranges are known to read back as zeros
+    uint32_t discardGranularity = 0;    // bytes; discards are rounded inward to this
+    uint64_t maxDiscardBytes = 0;       // largest single discard request; 0 when unlimited
+};
+
+// One hub between a USB host controller and a disk.
+struct UsbHub {
+    std::wstring path;                  // unique on the machine ("usb2", "2-1" or a Windows location path)
+    uint32_t speedMbps = 0;             // its upstream link; 0 when unknown
+};
+
+// Where a USB disk is attached: the host controller and the hubs (root hub
+// first) whose bandwidth it shares with every other disk below them.
+struct UsbTopology {
+    std::wstring controller;            // PCI address or location path; empty when not on USB
+    std::vector<UsbHub> hubs;
+    uint32_t port = 0;                  // on the last hub
+    uint32_t speedMbps = 0;             // the disk's own link; 0 when unknown
+
+    bool IsKnown() const { return !controller.empty(); }
+};
+
+// A whole disk (\\.\PhysicalDriveN, /dev/sdX) or a regular image file.
+// Offsets are absolute byte offsets; Read and Write are positional and may be
+// called from several threads at once.
+class BlockDevice {
+public:
+    virtual ~BlockDevice() = default;
+
+    virtual bool Read(uint64_t offset, void* buffer, size_t length) = 0;
+    virtual bool Write(uint64_t offset, const void* buffer, size_t length) = 0;
+    virtual bool Flush() = 0;
+
+    // Ask the OS to re-read the partition table after it has been rewritten.
+    virtual bool ReloadPartitionTable() = 0;
+
+    virtual const DeviceGeometry& GetGeometry() const = 0;
+    virtual const DeviceIdentity& GetIdentity() const = 0;
+    virtual const std::wstring& GetPath() const = 0;
+    virtual const DeviceTraits& GetTraits() const {
+        static const DeviceTraits none;
+        return none;
+    }
+
+    // Tells the device that a byte range no longer holds data (TRIM/UNMAP on
+    // disks, hole punching on image files). The range must be sector
+    // aligned. Whether it then reads back as zeros depends on the device;
+    // see DeviceTraits::discardZeroesData.
+    virtual bool Discard(uint64_t /*offset*/, uint64_t /*length*/) { return false; }
+
+    // Takes exclusive ownership of the disk for destructive operations:
+    // dismounts and locks its volumes on Windows, holds an exclusive open
+    // and an advisory lock elsewhere. Held until the device is closed.
+    virtual bool Lock(std::wstring& /*error*/) { return true; }
+
+    // The OS handle (a HANDLE on Windows, a file descriptor elsewhere) for
+    // asynchronous I/O queues, or -1 when the device is not backed by one.
+    virtual intptr_t GetNativeHandle() const { return -1; }
+};
+
+// The unit writes should come in: the physical sector, which 512e drives
+// hide behind 512-byte logical sectors and rebuild with a read-modify-write
+// for every write that covers one only in part.
+uint32_t GetWriteAlignment(const DeviceGeometry& geometry);
+
+// Writes `length` bytes at any `offset` as whole physical sectors: the
+// partly covered ones at either end are read and merged first, so the
+// device only sees aligned writes.
+bool WriteAligned(BlockDevice& device, uint64_t offset, const void* data, size_t length);
+
+// `path` may also be a "sim:" spec for a simulated device (SimulatedDevice.h).
+std::unique_ptr<BlockDevice> OpenBlockDevice(const std::wstring& path, bool writable);
+std::wstring GetPhysicalDrivePath(uint32_t diskNumber);
+
+struct BlockDeviceInfo {
+    std::wstring path;
+    DeviceGeometry geometry;
+    DeviceIdentity identity;
+    DeviceTraits traits;
+    UsbTopology topology;
+};
+
+// Whole disks attached to the machine, opened read-only for their
+// properties. Virtual devices (loop, RAM, device-mapper) are skipped.
+std::vector<BlockDeviceInfo> EnumerateBlockDevices();
+
+// The USB topology of a whole-disk path, or of a "sim:" spec with hub=.
+// False for disks not on USB and where the OS does not tell.
+bool QueryUsbTopology(const std::wstring& path, UsbTopology& topology);
+
+// "0000:00:14.0 > usb2 > 2-1, port 3 (480 Mb/s)"
+std::wstring DescribeUsbTopology(const UsbTopology& topology);
+
+// Payload a USB link of `speedMbps` carries in practice for bulk mass
+// storage transfers, in bytes per second; 0 for 0.
+double EstimateUsbLinkBytesPerSecond(uint32_t speedMbps);
@@ -0,0 +1,423 @@
+// ============================================================================
+// INFERNO - In-place boot menu patching after a raw copy
+// ============================================================================
+
+#include "BootConfig.h"
+#include "Checksum.h"
+#include "Log.h"
+#include "PartitionTable.h"
+#include "Platform.h"
+#include "Trace.h"
+#include "VolumeEditor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cwctype>
+
+// Where boot loaders keep their configuration, relative to a volume's root.
+struct ConfigLocation {
+    const wchar_t* directory;
+    const wchar_t* suffix;          // of the file names taken
+    BootConfigSyntax syntax;
+};
+
+static const ConfigLocation CONFIG_LOCATIONS[] = {
+    {L"boot/grub", L".cfg", BootConfigSyntax::Grub},
+    {L"boot/grub2", L".cfg", BootConfigSyntax::Grub},
+    {L"efi/boot", L".cfg", BootConfigSyntax::Grub},
+    {L"", L"linux.cfg", BootConfigSyntax::Syslinux},
+    {L"isolinux", L".cfg", BootConfigSyntax::Syslinux},
+    {L"syslinux", L".cfg", BootConfigSyntax::Syslinux},
+    {L"boot/isolinux", L".cfg", BootConfigSyntax::Syslinux},
+    {L"boot/syslinux", L".cfg", BootConfigSyntax::Syslinux},
+    {L"boot/x86_64/loader", L".cfg", BootConfigSyntax::Syslinux},
+    {L"loader/entries", L".conf", BootConfigSyntax::LoaderEntry},
+    {L"loader", L"loader.conf", BootConfigSyntax::LoaderConf},
+};
+
+static const wchar_t* const CHECKSUM_LISTS[] = {L"md5sum.txt", L"sha1sum.txt", L"sha256sum.txt", L"sha512sum.txt",
+                                                L"MD5SUMS", L"SHA256SUMS"};
+
+// Bounds the volumes a damaged partition table can make us probe.
+static const size_t MAX_VOLUMES = 16;
+
+// ============================================================================
+// TEXT
+// ============================================================================
+
+static std::string ToLowerAscii(std::string text) {
+    for (char& c : text) c = (char)tolower((unsigned char)c);
+    return text;
+}
+
+static std::wstring ToLower(std::wstring text) {
+    for (wchar_t& c : text) c = (wchar_t)towlower(c);
+    return text;
+}
+
+static bool EndsWith(const std::wstring& text, const std::wstring& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Whitespace-separated words of a line, as [begin, end) offsets.
+static std::vector<std::pair<size_t, size_t>> SplitWords(const std::string& line) {
+    std::vector<std::pair<size_t, size_t>> words;
+    size_t position = 0;
+    while (position < line.size()) {
+        while (position < line.size() && isspace((unsigned char)line[position])) position++;
+        size_t begin = position;
+        while (position < line.size() && !isspace((unsigned char)line[position])) position++;
+        if (position > begin) words.push_back({begin, position});
+    }
+    return words;
+}
+
+static std::string Word(const std::string& line, const std::pair<size_t, size_t>& word) {
+    return line.substr(word.first, word.second - word.first);
+}
+
+// Adds `parameters` to the command line in `line`, whose arguments start at
+// word `first`. Debian and Ubuntu pass what follows "---" on to the
+// installed system, so new parameters go before it.
+static bool AddKernelParameters(std::string& line, size_t first, const std::vector<std::string>& parameters) {
+    bool changed = false;
+    for (const std::string& parameter : parameters) {
+        std::vector<std::pair<size_t, size_t>> words = SplitWords(line);
+        std::string key = parameter.substr(0, parameter.find('='));
+        bool hasValue = key.size() < parameter.size();
+        bool present = false;
+        size_t insertAt = line.size();
+        for (size_t i = first; i < words.size(); i++) {
+            std::string word = Word(line, words[i]);
+            if (word == "---") {
+                insertAt = words[i].first;
+                break;
+            }
+            if (word == parameter) {
+                present = true;
+                break;
+            }
+            if (hasValue && word.compare(0, key.size() + 1, key + "=") == 0) {
+                line.replace(words[i].first, words[i].second - words[i].first, parameter);
+                present = changed = true;
+                break;
+            }
+        }
+        if (present) continue;
+        if (insertAt == line.size()) {
+            line += " " + parameter;
+        } else {
+            line.insert(insertAt, parameter + " ");
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+// The parameters one command line gets: the patch's own, and the
+// persistence switch of the live system it boots.
+static std::vector<std::string> ParametersFor(const std::string& line, const BootConfigPatch& patch) {
+    std::vector<std::string> parameters = patch.kernelParameters;
+    if (patch.persistence) {
+        std::vector<std::pair<size_t, size_t>> words = SplitWords(line);
+        for (const auto& word : words) {
+            std::string text = Word(line, word);
+            if (text == "boot=casper") parameters.push_back("persistent");
+            if (text == "boot=live") parameters.push_back("persistence");
+        }
+    }
+    parameters.erase(std::remove_if(parameters.begin(), parameters.end(),
+                                    [](const std::string& parameter) {
+                                        return parameter.empty() ||
+                                               std::any_of(parameter.begin(), parameter.end(),
+                                                           [](char c) { return isspace((unsigned char)c); });
+                                    }),
+                     parameters.end());
+    return parameters;
+}
+
+// Replaces the number in "timeout N" or "set timeout=N" style lines from
+// the first digit on.
+static bool ReplaceNumber(std::string& line, size_t from, int value) {
+    size_t begin = line.find_first_of("0123456789", from);
+    if (begin == std::string::npos) return false;
+    size_t end = line.find_first_not_of("0123456789", begin);
+    if (end == std::string::npos) end = line.size();
+    std::string number = std::to_string(value);
+    if (line.compare(begin, end - begin, number) == 0) return false;
+    line.replace(begin, end - begin, number);
+    return true;
+}
+
+static bool IsMenuTitle(const std::string& line, const std::vector<std::pair<size_t, size_t>>& words) {
+    return words.size() > 1 && ToLowerAscii(Word(line, words[0])) == "menu" &&
+           ToLowerAscii(Word(line, words[1])) == "title";
+}
+
+static bool HasMenuTitle(const std::string& contents) {
+    size_t position = 0;
+    while (position < contents.size()) {
+        size_t newline = contents.find('\n', position);
+        if (newline == std::string::npos) newline = contents.size();
+        std::string line = contents.substr(position, newline - position);
+        if (IsMenuTitle(line, SplitWords(line))) return true;
+        position = newline + 1;
+    }
+    return false;
+}
+
+static bool PatchLines(BootConfigSyntax syntax, const BootConfigPatch& patch, bool insertTitle, std::string& contents) {
+    // Lines keep their own endings, CR LF or LF.
+    std::vector<std::string> lines;
+    std::vector<std::string> endings;
+    size_t position = 0;
+    while (position < contents.size()) {
+        size_t newline = contents.find('\n', position);
+        size_t end = newline == std::string::npos ? contents.size() : newline;
+        size_t textEnd = end > position && contents[end - 1] == '\r' ? end - 1 : end;
+        lines.push_back(contents.substr(position, textEnd - position));
+        endings.push_back(contents.substr(textEnd, (newline == std::string::npos ? end : end + 1) - textEnd));
+        position = newline == std::string::npos ? contents.size() : newline + 1;
+    }
+    std::string defaultEnding = endings.empty() || endings[0].empty() ? "\n" : endings[0];
+
+    std::string title = WideToUtf8(patch.menuTitle);
+    title.erase(std::remove_if(title.begin(), title.end(), [](char c) { return c == '\r' || c == '\n'; }),
+                title.end());
+    bool changed = false;
+    bool hasTitle = false;
+    size_t menuLine = SIZE_MAX;             // after which a missing syslinux title goes
+    std::string kernel;                     // of the syslinux label being read
+
+    for (size_t index = 0; index < lines.size(); index++) {
+        std::string& line = lines[index];
+        std::vector<std::pair<size_t, size_t>> words = SplitWords(line);
+        if (words.empty()) continue;
+        std::string command = ToLowerAscii(Word(line, words[0]));
+        bool lineChanged = false;
+
+        switch (syntax) {
+            case BootConfigSyntax::Grub:
+                if (command == "linux" || command == "linuxefi" || command == "linux16") {
+                    lineChanged = AddKernelParameters(line, 2, ParametersFor(line, patch));
+                } else if (patch.timeoutSeconds >= 0 &&
+                           (command.compare(0, 8, "timeout=") == 0 ||
+                            (command == "set" && words.size() > 1 &&
+                             ToLowerAscii(Word(line, words[1])).compare(0, 8, "timeout=") == 0))) {
+                    lineChanged = ReplaceNumber(line, line.find('=', words[0].first), patch.timeoutSeconds);
+                }
+                break;
+
+            case BootConfigSyntax::Syslinux:
+                if (command == "label") {
+                    kernel.clear();
+                } else if (command == "kernel" || command == "linux") {
+                    kernel = words.size() > 1 ? ToLowerAscii(Word(line, words[1])) : std::string();
+                } else if (command == "append") {
+                    // COM32 modules (chain.c32, menus) take arguments of their own.
+                    bool module = kernel.size() >= 4 && kernel.compare(kernel.size() - 4, 4, ".c32") == 0;
+                    if (!module) lineChanged = AddKernelParameters(line, 1, ParametersFor(line, patch));
+                } else if (command == "timeout" && patch.timeoutSeconds >= 0) {
+                    // Tenths of a second; 0 would wait forever.
+                    lineChanged = ReplaceNumber(line, words[0].second, std::max(1, patch.timeoutSeconds * 10));
+                } else if (IsMenuTitle(line, words)) {
+                    hasTitle = true;
+                    if (!title.empty()) {
+                        std::string replaced = line.substr(0, words[1].second) + " " + title;
+                        lineChanged = replaced != line;
+                        line = replaced;
+                    }
+                } else if (command == "ui" || (command == "default" && words.size() > 1 &&
+                                               ToLowerAscii(Word(line, words[1])).find("menu.c32") !=
+                                                   std::string::npos)) {
+                    if (menuLine == SIZE_MAX) menuLine = index;
+                }
+                break;
+
+            case BootConfigSyntax::LoaderEntry:
+                if (command == "options") {
+                    lineChanged = AddKernelParameters(line, 1, ParametersFor(line, patch));
+                }
+                break;
+
+            case BootConfigSyntax::LoaderConf:
+                if (command == "timeout" && patch.timeoutSeconds >= 0) {
+                    lineChanged = ReplaceNumber(line, words[0].second, patch.timeoutSeconds);
+                }
+                break;
+        }
+        changed = changed || lineChanged;
+    }
+
+    if (syntax == BootConfigSyntax::Syslinux && insertTitle && !title.empty() && !hasTitle && menuLine != SIZE_MAX) {
+        lines.insert(lines.begin() + menuLine + 1, "MENU TITLE " + title);
+        endings.insert(endings.begin() + menuLine + 1, defaultEnding);
+        if (endings[menuLine].empty()) endings[menuLine] = defaultEnding;
+        changed = true;
+    }
+    if (!changed) return false;
+
+    contents.clear();
+    for (size_t i = 0; i < lines.size(); i++) contents += lines[i] + endings[i];
+    return true;
+}
+
+bool PatchBootConfigText(BootConfigSyntax syntax, const BootConfigPatch& patch, std::string& contents) {
+    return PatchLines(syntax, patch, true, contents);
+}
+
+// ============================================================================
+// VOLUMES
+// ============================================================================
+
+struct ConfigFile {
+    std::wstring path;
+    BootConfigSyntax syntax;
+    std::string contents;
+};
+
+// Re-hashes or drops the lines of the patched files in the checksum lists
+// at the root of the volume.
+static bool UpdateChecksumLists(VolumeEditor& editor, const std::vector<ConfigFile>& patched, std::wstring& error) {
+    std::vector<VolumeFileEntry> root;
+    if (!editor.List(L"", root, error)) return false;
+    for (const wchar_t* listName : CHECKSUM_LISTS) {
+        auto entry = std::find_if(root.begin(), root.end(), [&](const VolumeFileEntry& candidate) {
+            return !candidate.directory && ToLower(candidate.name) == ToLower(listName);
+        });
+        if (entry == root.end()) continue;
+        bool sha256 = ToLower(listName).find(L"sha256") != std::wstring::npos;
+
+        std::string list;
+        if (!editor.ReadFile(entry->name, list, error)) return false;
+        std::string updated;
+        size_t position = 0;
+        while (position < list.size()) {
+            size_t newline = list.find('\n', position);
+            size_t end = newline == std::string::npos ? list.size() : newline + 1;
+            std::string line = list.substr(position, end - position);
+            position = end;
+
+            // "<digest>  ./path" or "<digest> *path".
+            std::vector<std::pair<size_t, size_t>> words = SplitWords(line);
+            const ConfigFile* file = nullptr;
+            if (words.size() >= 2) {
+                std::string name = line.substr(words[1].first);
+                name.erase(name.find_last_not_of("\r\n") + 1);
+                if (name.compare(0, 1, "*") == 0) name.erase(0, 1);
+                if (name.compare(0, 2, "./") == 0) name.erase(0, 2);
+                if (name.compare(0, 1, "/") == 0) name.erase(0, 1);
+                std::wstring path = ToLower(Utf8ToWide(name));
+                for (const ConfigFile& candidate : patched) {
+                    if (ToLower(candidate.path) == path) file = &candidate;
+                }
+            }
+            if (!file) {
+                updated += line;
+            } else if (sha256) {
+                uint8_t digest[Sha256::DIGEST_SIZE];
+                Sha256 hash;
+                hash.Update(file->contents.data(), file->contents.size());
+                hash.Final(digest);
+                updated += WideToUtf8(DigestToHex(digest, sizeof(digest))) + line.substr(words[0].second);
+            }
+        }
+        if (updated != list && !editor.WriteFile(entry->name, updated, error)) return false;
+    }
+    return true;
+}
+
+static bool PatchVolume(VolumeEditor& editor, const BootConfigPatch& patch, BootConfigPatchReport& report,
+                        std::wstring& error) {
+    std::wstring volumeName = std::wstring(VolumeTypeName(editor.GetType())) + L" at " +
+                              std::to_wstring(editor.GetOffset());
+    std::vector<ConfigFile> patched;
+    for (const ConfigLocation& location : CONFIG_LOCATIONS) {
+        std::vector<VolumeFileEntry> entries;
+        std::wstring missing;
+        if (!editor.List(location.directory, entries, missing)) continue;
+
+        std::vector<ConfigFile> files;
+        for (const VolumeFileEntry& entry : entries) {
+            if (entry.directory || !EndsWith(ToLower(entry.name), location.suffix)) continue;
+            ConfigFile file;
+            file.path = std::wstring(location.directory) + (location.directory[0] ? L"/" : L"") + entry.name;
+            file.syntax = location.syntax;
+            if (!editor.ReadFile(file.path, file.contents, error)) return false;
+            files.push_back(file);
+        }
+        report.configFiles += files.size();
+
+        // A syslinux menu split over several files gets a title only if none
+        // of them has one.
+        bool hasTitle = std::any_of(files.begin(), files.end(), [](const ConfigFile& file) {
+            return file.syntax == BootConfigSyntax::Syslinux && HasMenuTitle(file.contents);
+        });
+        for (ConfigFile& file : files) {
+            if (!PatchLines(file.syntax, patch, !hasTitle, file.contents)) continue;
+            if (!editor.WriteFile(file.path, file.contents, error)) {
+                error = volumeName + L": " + file.path + L": " + error;
+                return false;
+            }
+            report.patchedFiles.push_back(volumeName + L": /" + file.path);
+            patched.push_back(file);
+        }
+    }
+    if (!patched.empty() && !UpdateChecksumLists(editor, patched, error)) {
+        error = volumeName + L": " + error;
+        return false;
+    }
+    return true;
+}
+
+bool PatchBootConfigs(BlockDevice& device, const BootConfigPatch& patch, BootConfigPatchReport* report,
+                      std::wstring& error) {
+    TraceSpan span("io", "patch boot configs");
+    auto start = std::chrono::steady_clock::now();
+    BootConfigPatchReport local;
+    BootConfigPatchReport& result = report ? *report : local;
+    result = BootConfigPatchReport();
+
+    // The image's own volume, then each partition's. A hybrid image's first
+    // partition usually starts at 0 too.
+    std::vector<std::pair<uint64_t, uint64_t>> volumes = {{0, 0}};
+    PartitionTable table;
+    if (ReadPartitionTable(device, table)) {
+        for (const PartitionEntry& partition : table.partitions) {
+            uint64_t offset = partition.startLba * table.sectorSize;
+            bool known = std::any_of(volumes.begin(), volumes.end(),
+                                     [&](const std::pair<uint64_t, uint64_t>& volume) { return volume.first == offset; });
+            if (!known && volumes.size() < MAX_VOLUMES) {
+                volumes.push_back({offset, partition.sectorCount * table.sectorSize});
+            }
+        }
+    }
+
+    for (const auto& volume : volumes) {
+        std::wstring reason;
+        std::unique_ptr<VolumeEditor> editor = OpenVolumeEditor(device, volume.first, volume.second, reason);
+        if (!editor) continue;
+        result.volumes++;
+        bool patched = PatchVolume(*editor, patch, result, error);
+        result.sectorsWritten += editor->GetSectorsWritten();
+        if (!patched) return false;
+    }
+    if (result.configFiles == 0) {
+        error = L"No GRUB, syslinux or systemd-boot configuration found on the drive";
+        return false;
+    }
+    if (result.sectorsWritten && !device.Flush()) {
+        error = L"Cannot flush the drive after patching its boot configuration";
+        return false;
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    LogEvent(LogLevel::Info, "bootcfg", "patched",
+             {{"volumes", (int64_t)result.volumes}, {"files", (int64_t)result.patchedFiles.size()},
+              {"sectors", (int64_t)result.sectorsWritten}, {"microseconds", (int64_t)(result.seconds * 1e6)}});
+    for (const std::wstring& file : result.patchedFiles) {
+        LogMessage(LogLevel::Debug, "bootcfg", L"Patched " + file);
+    }
+    return true;
+}
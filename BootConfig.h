@@ -0,0 +1,65 @@
+// ============================================================================
+// INFERNO - In-place boot menu patching after a raw copy
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+
+#include <string>
+#include <vector>
+
+// What to change in the boot menus of an image that has been copied to a
+// drive sector by sector.
+struct BootConfigPatch {
+    // Added to every Linux command line; "key=value" replaces an existing
+    // "key=..." rather than adding a second one.
+    std::vector<std::string> kernelParameters;
+    // The live system's own persistence switch, on the command lines that
+    // boot one it is known for: "persistent" for casper (Ubuntu and
+    // derivatives), "persistence" for live-boot (Debian, Kali, Tails).
+    bool persistence = false;
+    // Syslinux MENU TITLE. GRUB menus have no title to set.
+    std::wstring menuTitle;
+    // GRUB, syslinux and systemd-boot timeouts; -1 keeps the image's own.
+    int timeoutSeconds = -1;
+
+    bool IsEmpty() const {
+        return kernelParameters.empty() && !persistence && menuTitle.empty() && timeoutSeconds < 0;
+    }
+};
+
+enum class BootConfigSyntax : uint8_t {
+    Grub,           // grub.cfg, loopback.cfg
+    Syslinux,       // isolinux.cfg, syslinux.cfg, txt.cfg ...
+    LoaderEntry,    // systemd-boot loader/entries/*.conf
+    LoaderConf      // systemd-boot loader/loader.conf
+};
+
+// Applies `patch` to one configuration file, keeping every line it does not
+// change byte for byte. True when `contents` changed.
+bool PatchBootConfigText(BootConfigSyntax syntax, const BootConfigPatch& patch, std::string& contents);
+
+struct BootConfigPatchReport {
+    size_t volumes = 0;                     // ISO9660 and FAT volumes looked at
+    size_t configFiles = 0;                 // boot configurations found on them
+    std::vector<std::wstring> patchedFiles; // "FAT16 at 1048576: /EFI/BOOT/grub.cfg"
+    uint64_t sectorsWritten = 0;
+    double seconds = 0.0;
+};
+
+// Patches the GRUB, syslinux and systemd-boot configurations on a drive
+// the image has just been copied to: the ISO9660 volume at its start and
+// the ISO9660 or FAT volume of each partition (a hybrid image's EFI system
+// partition keeps a grub.cfg of its own). Only the sectors of the files and
+// directory entries that change are written (see VolumeEditor.h), where
+// extracting the image in file mode would copy every file.
+//
+// Checksum lists at a volume's root (md5sum.txt, sha256sum.txt ...) would
+// fail an integrity check of the media on the patched files: SHA-256 lines
+// are recomputed and the patched files' other lines dropped. A checksum
+// implanted in the primary volume descriptor (isomd5sum) cannot be kept.
+//
+// Fails when no boot configuration is found, or on a read or write error.
+bool PatchBootConfigs(BlockDevice& device, const BootConfigPatch& patch, BootConfigPatchReport* report,
+                      std::wstring& error);
@@ -0,0 +1,298 @@
+// ============================================================================
+// INFERNO - Pooled I/O buffer arena
+// ============================================================================
+
+#include "BufferArena.h"
+#include "Log.h"
+#include "Platform.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+struct ArenaBuffer::Slab {
+    BufferArena* arena;
+    uint8_t* data;
+    size_t size;
+    bool hugePage;
+    std::atomic<uint32_t> references;
+};
+
+// ============================================================================
+// OS MEMORY
+// ============================================================================
+
+#ifdef _WIN32
+
+// Large pages need SeLockMemoryPrivilege, which only accounts granted "Lock
+// pages in memory" hold; it still has to be enabled in the process token.
+static size_t GetLargePageSize() {
+    static const size_t size = [] {
+        SIZE_T minimum = GetLargePageMinimum();
+        if (minimum == 0) return (size_t)0;
+        HANDLE token;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) return (size_t)0;
+        TOKEN_PRIVILEGES privileges = {};
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        bool enabled = LookupPrivilegeValueW(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+                       AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+                       GetLastError() == ERROR_SUCCESS;
+        CloseHandle(token);
+        return enabled ? (size_t)minimum : (size_t)0;
+    }();
+    return size;
+}
+
+static uint8_t* MapSlab(size_t size, bool& hugePage) {
+    size_t largePage = GetLargePageSize();
+    if (largePage && size % largePage == 0) {
+        void* memory = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (memory) {
+            hugePage = true;
+            return (uint8_t*)memory;
+        }
+    }
+    hugePage = false;
+    return (uint8_t*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+static void UnmapSlab(uint8_t* data, size_t) {
+    VirtualFree(data, 0, MEM_RELEASE);
+}
+
+#else
+
+static uint8_t* MapSlab(size_t size, bool& hugePage) {
+    hugePage = false;
+    if (size % BufferArena::HUGE_PAGE != 0) {
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return memory == MAP_FAILED ? nullptr : (uint8_t*)memory;
+    }
+
+#ifdef MAP_HUGETLB
+    // Explicit huge pages, when the administrator has reserved some.
+    void* reserved = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (reserved != MAP_FAILED) {
+        hugePage = true;
+        return (uint8_t*)reserved;
+    }
+#endif
+
+    // Otherwise map with room to align to a huge page boundary, trim the
+    // excess and ask for transparent huge pages.
+    size_t mapped = size + BufferArena::HUGE_PAGE;
+    void* memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    uintptr_t base = (uintptr_t)memory;
+    uintptr_t aligned = (base + BufferArena::HUGE_PAGE - 1) & ~(uintptr_t)(BufferArena::HUGE_PAGE - 1);
+    if (aligned > base) munmap(memory, aligned - base);
+    if (aligned + size < base + mapped) munmap((void*)(aligned + size), base + mapped - aligned - size);
+#ifdef MADV_HUGEPAGE
+    hugePage = madvise((void*)aligned, size, MADV_HUGEPAGE) == 0;
+#endif
+    return (uint8_t*)aligned;
+}
+
+static void UnmapSlab(uint8_t* data, size_t size) {
+    munmap(data, size);
+}
+
+#endif
+
+// ============================================================================
+// BUFFERS
+// ============================================================================
+
+ArenaBuffer::ArenaBuffer(const ArenaBuffer& other) : m_slab(other.m_slab) {
+    if (m_slab) m_slab->references.fetch_add(1, std::memory_order_relaxed);
+}
+
+ArenaBuffer::ArenaBuffer(ArenaBuffer&& other) noexcept : m_slab(other.m_slab) {
+    other.m_slab = nullptr;
+}
+
+ArenaBuffer& ArenaBuffer::operator=(ArenaBuffer other) noexcept {
+    std::swap(m_slab, other.m_slab);
+    return *this;
+}
+
+ArenaBuffer::~ArenaBuffer() {
+    if (m_slab && m_slab->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        m_slab->arena->Release(m_slab);
+    }
+}
+
+uint8_t* ArenaBuffer::Data() const {
+    return m_slab ? m_slab->data : nullptr;
+}
+
+size_t ArenaBuffer::Size() const {
+    return m_slab ? m_slab->size : 0;
+}
+
+bool ArenaBuffer::IsHugePage() const {
+    return m_slab && m_slab->hugePage;
+}
+
+// ============================================================================
+// ARENA
+// ============================================================================
+
+BufferArena::BufferArena(uint64_t memoryLimit) {
+    m_stats.memoryLimit = memoryLimit;
+}
+
+BufferArena::~BufferArena() {
+    Trim();
+}
+
+BufferArena& BufferArena::Default() {
+    // Never destroyed: buffers may still be released by threads that outlive
+    // static destruction.
+    static BufferArena* arena = [] {
+        const uint64_t MIB = 1024 * 1024;
+        uint64_t limit = GetPhysicalMemorySize() / 8;
+        limit = std::min<uint64_t>(std::max<uint64_t>(limit, 64 * MIB), 1024 * MIB);
+        return new BufferArena(limit);
+    }();
+    return *arena;
+}
+
+// Powers of two up to a huge page, whole huge pages above, so pipeline
+// chunks (powers of two, sometimes doubled for read-back) share classes.
+size_t BufferArena::SizeClass(size_t size) {
+    if (size >= HUGE_PAGE) {
+        return (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    }
+    size_t sizeClass = MIN_SLAB;
+    while (sizeClass < size) sizeClass *= 2;
+    return sizeClass;
+}
+
+ArenaBuffer BufferArena::Acquire(size_t size) {
+    return Get(size, true);
+}
+
+ArenaBuffer BufferArena::TryAcquire(size_t size) {
+    return Get(size, false);
+}
+
+ArenaBuffer BufferArena::Get(size_t size, bool wait) {
+    size_t sizeClass = SizeClass(std::max<size_t>(size, 1));
+    std::unique_lock<std::mutex> guard(m_lock);
+    if (sizeClass > m_stats.memoryLimit) {
+        return ArenaBuffer();
+    }
+
+    bool waited = false;
+    for (;;) {
+        std::vector<Slab*>& cached = m_cache[sizeClass];
+        if (!cached.empty()) {
+            Slab* slab = cached.back();
+            cached.pop_back();
+            slab->references = 1;
+            m_stats.inUseBytes += slab->size;
+            m_stats.reuses++;
+            return ArenaBuffer(slab);
+        }
+        if (m_stats.reservedBytes + sizeClass <= m_stats.memoryLimit) {
+            break;
+        }
+        if (EvictCachedLocked()) {
+            continue;
+        }
+        if (!wait) {
+            return ArenaBuffer();
+        }
+        if (!waited) {
+            m_stats.waits++;
+            waited = true;
+        }
+        m_released.wait(guard);
+        if (sizeClass > m_stats.memoryLimit) {
+            return ArenaBuffer();
+        }
+    }
+
+    // Count the slab before mapping it so concurrent requests see the cap.
+    m_stats.reservedBytes += sizeClass;
+    m_stats.inUseBytes += sizeClass;
+    guard.unlock();
+
+    bool hugePage = false;
+    uint8_t* data = MapSlab(sizeClass, hugePage);
+
+    guard.lock();
+    if (!data) {
+        m_stats.reservedBytes -= sizeClass;
+        m_stats.inUseBytes -= sizeClass;
+        guard.unlock();
+        m_released.notify_all();
+        LogEvent(LogLevel::Warning, "arena", "map_failed", {{"bytes", (int64_t)sizeClass}});
+        return ArenaBuffer();
+    }
+    m_stats.peakReservedBytes = std::max(m_stats.peakReservedBytes, m_stats.reservedBytes);
+    m_stats.allocations++;
+    if (hugePage) m_stats.hugePageBytes += sizeClass;
+
+    Slab* slab = new Slab{this, data, sizeClass, hugePage, {1}};
+    return ArenaBuffer(slab);
+}
+
+// Unmaps one cached slab, the largest first. Called with m_lock held.
+bool BufferArena::EvictCachedLocked() {
+    for (auto it = m_cache.rbegin(); it != m_cache.rend(); ++it) {
+        if (it->second.empty()) continue;
+        Slab* slab = it->second.back();
+        it->second.pop_back();
+        m_stats.reservedBytes -= slab->size;
+        if (slab->hugePage) m_stats.hugePageBytes -= slab->size;
+        UnmapSlab(slab->data, slab->size);
+        delete slab;
+        return true;
+    }
+    return false;
+}
+
+void BufferArena::Release(Slab* slab) {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stats.inUseBytes -= slab->size;
+        m_cache[slab->size].push_back(slab);
+        // A lowered cap is enforced as buffers come back.
+        while (m_stats.reservedBytes > m_stats.memoryLimit && EvictCachedLocked()) {
+        }
+    }
+    m_released.notify_all();
+}
+
+void BufferArena::SetMemoryLimit(uint64_t memoryLimit) {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stats.memoryLimit = memoryLimit;
+        while (m_stats.reservedBytes > m_stats.memoryLimit && EvictCachedLocked()) {
+        }
+    }
+    m_released.notify_all();
+}
+
+void BufferArena::Trim() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        while (EvictCachedLocked()) {
+        }
+    }
+    m_released.notify_all();
+}
+
+ArenaStats BufferArena::GetStats() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_stats;
+}
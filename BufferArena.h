@@ -0,0 +1,101 @@
+// ============================================================================
+// INFERNO - Pooled I/O buffer arena
+// ============================================================================
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+class BufferArena;
+
+// A reference-counted handle to one arena slab. Copies share the slab; it
+// returns to the arena when the last handle goes away. Slabs are page
+// aligned (and so sector aligned) and at least as large as requested.
+class ArenaBuffer {
+public:
+    ArenaBuffer() = default;
+    ArenaBuffer(const ArenaBuffer& other);
+    ArenaBuffer(ArenaBuffer&& other) noexcept;
+    ArenaBuffer& operator=(ArenaBuffer other) noexcept;
+    ~ArenaBuffer();
+
+    uint8_t* Data() const;
+    size_t Size() const;
+    bool IsHugePage() const;
+    explicit operator bool() const { return m_slab != nullptr; }
+
+private:
+    friend class BufferArena;
+    struct Slab;
+    explicit ArenaBuffer(Slab* slab) : m_slab(slab) {}
+
+    Slab* m_slab = nullptr;
+};
+
+struct ArenaStats {
+    uint64_t memoryLimit = 0;
+    uint64_t reservedBytes = 0;     // mapped: in use plus cached for reuse
+    uint64_t inUseBytes = 0;
+    uint64_t peakReservedBytes = 0;
+    uint64_t hugePageBytes = 0;     // reserved bytes backed by huge pages
+    uint64_t allocations = 0;       // slabs mapped from the OS
+    uint64_t reuses = 0;            // requests served from the cache
+    uint64_t waits = 0;             // requests that waited for memory
+};
+
+// Large aligned buffers for every pipeline stage, drawn from one pool with a
+// memory cap. Released slabs are cached by size class and handed out again,
+// so steady-state pipelines do not touch the OS allocator. Slabs of 2 MiB
+// and up are backed by huge pages where the OS allows (MAP_HUGETLB, else
+// transparent huge pages on Linux; MEM_LARGE_PAGES on Windows), which keeps
+// TLB pressure flat as the number of concurrent jobs grows.
+//
+// Cached slabs of other sizes are unmapped to make room before a request
+// waits. A caller must not block in Acquire while it holds other buffers
+// from the same arena, or concurrent callers can deadlock; take the first
+// buffer with Acquire and any further ones with TryAcquire.
+class BufferArena {
+public:
+    static const size_t MIN_SLAB = 64 * 1024;
+    static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+    explicit BufferArena(uint64_t memoryLimit);
+    ~BufferArena();
+    BufferArena(const BufferArena&) = delete;
+    BufferArena& operator=(const BufferArena&) = delete;
+
+    // The process-wide arena, capped at an eighth of physical memory
+    // (between 64 MiB and 1 GiB).
+    static BufferArena& Default();
+
+    // Blocks until the memory cap allows the slab. Returns an empty buffer
+    // only when `size` alone exceeds the cap or the OS refuses the memory.
+    ArenaBuffer Acquire(size_t size);
+    // Returns an empty buffer instead of waiting.
+    ArenaBuffer TryAcquire(size_t size);
+
+    void SetMemoryLimit(uint64_t memoryLimit);
+    // Unmaps every cached slab.
+    void Trim();
+    ArenaStats GetStats() const;
+
+private:
+    friend class ArenaBuffer;
+    using Slab = ArenaBuffer::Slab;
+
+    static size_t SizeClass(size_t size);
+    ArenaBuffer Get(size_t size, bool wait);
+    bool EvictCachedLocked();
+    void Release(Slab* slab);
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_released;
+    std::map<size_t, std::vector<Slab*>> m_cache;   // free slabs by size class
+    ArenaStats m_stats;
+};
@@ -0,0 +1,167 @@
+// ============================================================================
+// INFERNO - Checksums and digests
+// ============================================================================
+
+#include "Checksum.h"
+
+#include <algorithm>
+#include <cstring>
+
+// ============================================================================
+// CRC
+// ============================================================================
+
+static const uint32_t* GetCrcTable(uint32_t polynomial) {
+    static uint32_t tables[2][256];
+    static bool initialized = [] {
+        const uint32_t polynomials[2] = {0xEDB88320u, 0x82F63B78u};
+        for (int t = 0; t < 2; t++) {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? (polynomials[t] ^ (c >> 1)) : (c >> 1);
+                }
+                tables[t][i] = c;
+            }
+        }
+        return true;
+    }();
+    (void)initialized;
+    return tables[polynomial == 0xEDB88320u ? 0 : 1];
+}
+
+static uint32_t UpdateCrc(const uint32_t* table, const void* data, size_t length, uint32_t crc) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t Crc32(const void* data, size_t length, uint32_t crc) {
+    return UpdateCrc(GetCrcTable(0xEDB88320u), data, length, crc);
+}
+
+uint32_t Crc32c(const void* data, size_t length, uint32_t crc) {
+    return UpdateCrc(GetCrcTable(0x82F63B78u), data, length, crc);
+}
+
+uint16_t Crc16(const void* data, size_t length, uint16_t crc) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (uint16_t)(0xA001 ^ (crc >> 1)) : (uint16_t)(crc >> 1);
+        }
+    }
+    return crc;
+}
+
+// ============================================================================
+// SHA-256
+// ============================================================================
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t RotateRight(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+Sha256::Sha256() : m_length(0), m_buffered(0) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(m_state, initial, sizeof(m_state));
+}
+
+void Sha256::Transform(const uint8_t block[64]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = RotateRight(w[i - 15], 7) ^ RotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = RotateRight(w[i - 2], 17) ^ RotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t S1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + S1 + ch + SHA256_K[i] + w[i];
+        uint32_t S0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = S0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+    m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+}
+
+void Sha256::Update(const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    m_length += length;
+
+    if (m_buffered > 0) {
+        size_t take = std::min(length, sizeof(m_buffer) - m_buffered);
+        memcpy(m_buffer + m_buffered, bytes, take);
+        m_buffered += take;
+        bytes += take;
+        length -= take;
+        if (m_buffered < sizeof(m_buffer)) return;
+        Transform(m_buffer);
+        m_buffered = 0;
+    }
+    while (length >= 64) {
+        Transform(bytes);
+        bytes += 64;
+        length -= 64;
+    }
+    memcpy(m_buffer, bytes, length);
+    m_buffered = length;
+}
+
+void Sha256::Final(uint8_t digest[DIGEST_SIZE]) {
+    uint64_t bitLength = m_length * 8;
+    uint8_t padding[72] = {0x80};
+    size_t padLength = (m_buffered < 56) ? (56 - m_buffered) : (120 - m_buffered);
+    Update(padding, padLength);
+
+    uint8_t lengthBytes[8];
+    for (int i = 0; i < 8; i++) {
+        lengthBytes[i] = (uint8_t)(bitLength >> (56 - 8 * i));
+    }
+    Update(lengthBytes, 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(m_state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(m_state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(m_state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)m_state[i];
+    }
+}
+
+std::wstring DigestToHex(const uint8_t* digest, size_t length) {
+    static const wchar_t digits[] = L"0123456789abcdef";
+    std::wstring hex;
+    hex.reserve(length * 2);
+    for (size_t i = 0; i < length; i++) {
+        hex += digits[digest[i] >> 4];
+        hex += digits[digest[i] & 0x0F];
+    }
+    return hex;
+}
@@ -0,0 +1,41 @@
+// ============================================================================
+// INFERNO - Checksums and digests
+// ============================================================================
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// CRC-32 (IEEE 802.3, reflected), as used by GPT headers and entry arrays.
+// Pass the previous result as `crc` to continue a running checksum.
+uint32_t Crc32(const void* data, size_t length, uint32_t crc = 0);
+
+// CRC-32C (Castagnoli, reflected), as used by ext4 metadata checksums; runs
+// the same way as Crc32.
+uint32_t Crc32c(const void* data, size_t length, uint32_t crc = 0);
+
+// CRC-16 (ARC: polynomial 0x8005 reflected, no final inversion), as used
+// by ext4 group descriptors without metadata_csum. Starts from `crc`.
+uint16_t Crc16(const void* data, size_t length, uint16_t crc);
+
+// SHA-256 (FIPS 180-4), streaming.
+class Sha256 {
+public:
+    static const size_t DIGEST_SIZE = 32;
+
+    Sha256();
+    void Update(const void* data, size_t length);
+    void Final(uint8_t digest[DIGEST_SIZE]);
+
+private:
+    void Transform(const uint8_t block[64]);
+
+    uint32_t m_state[8];
+    uint64_t m_length;
+    uint8_t m_buffer[64];
+    size_t m_buffered;
+};
+
+std::wstring DigestToHex(const uint8_t* digest, size_t length);
@@ -0,0 +1,542 @@
+// ============================================================================
+// INFERNO - Sector encryption and key derivation
+// ============================================================================
+
+#ifdef _WIN32
+#define _CRT_RAND_S
+#endif
+
+#include "Crypto.h"
+#include "Checksum.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef INFERNO_X86
+#include <immintrin.h>
+#endif
+
+// ============================================================================
+// PORTABLE AES
+// ============================================================================
+
+struct AesTables {
+    uint8_t sbox[256];
+    uint8_t inverseSbox[256];
+    uint32_t encrypt[4][256];   // SubBytes + MixColumns, one table per byte position
+    uint32_t decrypt[4][256];   // InvSubBytes + InvMixColumns
+    uint8_t exp[256];
+    uint8_t log[256];
+
+    AesTables() {
+        // Powers of the generator 3 enumerate every non-zero field element.
+        uint8_t x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = x;
+            log[x] = (uint8_t)i;
+            x ^= (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1B : 0));
+        }
+        exp[255] = exp[0];
+        log[0] = 0;
+
+        for (int a = 0; a < 256; a++) {
+            uint8_t inverse = a ? exp[(255 - log[a]) % 255] : 0;
+            uint8_t s = inverse;
+            for (int shift = 1; shift <= 4; shift++) {
+                s ^= (uint8_t)((inverse << shift) | (inverse >> (8 - shift)));
+            }
+            s ^= 0x63;
+            sbox[a] = s;
+            inverseSbox[s] = (uint8_t)a;
+        }
+
+        for (int a = 0; a < 256; a++) {
+            uint8_t s = sbox[a];
+            uint8_t is = inverseSbox[a];
+            uint32_t e = ((uint32_t)Multiply(2, s) << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | Multiply(3, s);
+            uint32_t d = ((uint32_t)Multiply(14, is) << 24) | ((uint32_t)Multiply(9, is) << 16) |
+                         ((uint32_t)Multiply(13, is) << 8) | Multiply(11, is);
+            for (int t = 0; t < 4; t++) {
+                encrypt[t][a] = t ? (e >> (8 * t)) | (e << (32 - 8 * t)) : e;
+                decrypt[t][a] = t ? (d >> (8 * t)) | (d << (32 - 8 * t)) : d;
+            }
+        }
+    }
+
+    uint8_t Multiply(uint8_t a, uint8_t b) const {
+        return (a && b) ? exp[(log[a] + log[b]) % 255] : 0;
+    }
+};
+
+static const AesTables& GetAesTables() {
+    static const AesTables tables;
+    return tables;
+}
+
+// FIPS-197 key expansion for 128- and 256-bit keys.
+static int ExpandAesKey(const uint8_t* key, size_t keyBytes, uint8_t* roundKeys) {
+    const AesTables& tables = GetAesTables();
+    int nk = (int)keyBytes / 4;
+    int rounds = nk + 6;
+    memcpy(roundKeys, key, keyBytes);
+    uint8_t rcon = 1;
+    for (int i = nk; i < 4 * (rounds + 1); i++) {
+        uint8_t word[4];
+        memcpy(word, roundKeys + (i - 1) * 4, 4);
+        if (i % nk == 0) {
+            uint8_t first = word[0];
+            word[0] = tables.sbox[word[1]] ^ rcon;
+            word[1] = tables.sbox[word[2]];
+            word[2] = tables.sbox[word[3]];
+            word[3] = tables.sbox[first];
+            rcon = (uint8_t)((rcon << 1) ^ ((rcon & 0x80) ? 0x1B : 0));
+        } else if (nk > 6 && i % nk == 4) {
+            for (int k = 0; k < 4; k++) word[k] = tables.sbox[word[k]];
+        }
+        for (int k = 0; k < 4; k++) {
+            roundKeys[i * 4 + k] = roundKeys[(i - nk) * 4 + k] ^ word[k];
+        }
+    }
+    return rounds;
+}
+
+// Round keys for the equivalent inverse cipher: reversed, with
+// InvMixColumns applied to every round but the first and last. This is the
+// layout both the tables and AESDEC expect.
+static void InvertAesKey(const uint8_t* encryptKeys, int rounds, uint8_t* decryptKeys) {
+    const AesTables& tables = GetAesTables();
+    for (int r = 0; r <= rounds; r++) {
+        const uint8_t* in = encryptKeys + 16 * (rounds - r);
+        uint8_t* out = decryptKeys + 16 * r;
+        if (r == 0 || r == rounds) {
+            memcpy(out, in, 16);
+            continue;
+        }
+        for (int c = 0; c < 16; c += 4) {
+            uint8_t a0 = in[c], a1 = in[c + 1], a2 = in[c + 2], a3 = in[c + 3];
+            out[c] = tables.Multiply(14, a0) ^ tables.Multiply(11, a1) ^ tables.Multiply(13, a2) ^ tables.Multiply(9, a3);
+            out[c + 1] = tables.Multiply(9, a0) ^ tables.Multiply(14, a1) ^ tables.Multiply(11, a2) ^ tables.Multiply(13, a3);
+            out[c + 2] = tables.Multiply(13, a0) ^ tables.Multiply(9, a1) ^ tables.Multiply(14, a2) ^ tables.Multiply(11, a3);
+            out[c + 3] = tables.Multiply(11, a0) ^ tables.Multiply(13, a1) ^ tables.Multiply(9, a2) ^ tables.Multiply(14, a3);
+        }
+    }
+}
+
+static inline uint32_t LoadBe32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void StoreBe32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void AesEncryptBlockPortable(const uint8_t* roundKeys, int rounds, const uint8_t in[16], uint8_t out[16]) {
+    const AesTables& t = GetAesTables();
+    const uint8_t* rk = roundKeys;
+    uint32_t s0 = LoadBe32(in) ^ LoadBe32(rk), s1 = LoadBe32(in + 4) ^ LoadBe32(rk + 4);
+    uint32_t s2 = LoadBe32(in + 8) ^ LoadBe32(rk + 8), s3 = LoadBe32(in + 12) ^ LoadBe32(rk + 12);
+    for (int r = 1; r < rounds; r++) {
+        rk += 16;
+        uint32_t t0 = t.encrypt[0][s0 >> 24] ^ t.encrypt[1][(s1 >> 16) & 0xFF] ^
+                      t.encrypt[2][(s2 >> 8) & 0xFF] ^ t.encrypt[3][s3 & 0xFF] ^ LoadBe32(rk);
+        uint32_t t1 = t.encrypt[0][s1 >> 24] ^ t.encrypt[1][(s2 >> 16) & 0xFF] ^
+                      t.encrypt[2][(s3 >> 8) & 0xFF] ^ t.encrypt[3][s0 & 0xFF] ^ LoadBe32(rk + 4);
+        uint32_t t2 = t.encrypt[0][s2 >> 24] ^ t.encrypt[1][(s3 >> 16) & 0xFF] ^
+                      t.encrypt[2][(s0 >> 8) & 0xFF] ^ t.encrypt[3][s1 & 0xFF] ^ LoadBe32(rk + 8);
+        uint32_t t3 = t.encrypt[0][s3 >> 24] ^ t.encrypt[1][(s0 >> 16) & 0xFF] ^
+                      t.encrypt[2][(s1 >> 8) & 0xFF] ^ t.encrypt[3][s2 & 0xFF] ^ LoadBe32(rk + 12);
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+    rk += 16;
+    const uint8_t* s = t.sbox;
+    StoreBe32(out, (((uint32_t)s[s0 >> 24] << 24) | ((uint32_t)s[(s1 >> 16) & 0xFF] << 16) |
+                    ((uint32_t)s[(s2 >> 8) & 0xFF] << 8) | s[s3 & 0xFF]) ^ LoadBe32(rk));
+    StoreBe32(out + 4, (((uint32_t)s[s1 >> 24] << 24) | ((uint32_t)s[(s2 >> 16) & 0xFF] << 16) |
+                        ((uint32_t)s[(s3 >> 8) & 0xFF] << 8) | s[s0 & 0xFF]) ^ LoadBe32(rk + 4));
+    StoreBe32(out + 8, (((uint32_t)s[s2 >> 24] << 24) | ((uint32_t)s[(s3 >> 16) & 0xFF] << 16) |
+                        ((uint32_t)s[(s0 >> 8) & 0xFF] << 8) | s[s1 & 0xFF]) ^ LoadBe32(rk + 8));
+    StoreBe32(out + 12, (((uint32_t)s[s3 >> 24] << 24) | ((uint32_t)s[(s0 >> 16) & 0xFF] << 16) |
+                         ((uint32_t)s[(s1 >> 8) & 0xFF] << 8) | s[s2 & 0xFF]) ^ LoadBe32(rk + 12));
+}
+
+static void AesDecryptBlockPortable(const uint8_t* roundKeys, int rounds, const uint8_t in[16], uint8_t out[16]) {
+    const AesTables& t = GetAesTables();
+    const uint8_t* rk = roundKeys;
+    uint32_t s0 = LoadBe32(in) ^ LoadBe32(rk), s1 = LoadBe32(in + 4) ^ LoadBe32(rk + 4);
+    uint32_t s2 = LoadBe32(in + 8) ^ LoadBe32(rk + 8), s3 = LoadBe32(in + 12) ^ LoadBe32(rk + 12);
+    for (int r = 1; r < rounds; r++) {
+        rk += 16;
+        uint32_t t0 = t.decrypt[0][s0 >> 24] ^ t.decrypt[1][(s3 >> 16) & 0xFF] ^
+                      t.decrypt[2][(s2 >> 8) & 0xFF] ^ t.decrypt[3][s1 & 0xFF] ^ LoadBe32(rk);
+        uint32_t t1 = t.decrypt[0][s1 >> 24] ^ t.decrypt[1][(s0 >> 16) & 0xFF] ^
+                      t.decrypt[2][(s3 >> 8) & 0xFF] ^ t.decrypt[3][s2 & 0xFF] ^ LoadBe32(rk + 4);
+        uint32_t t2 = t.decrypt[0][s2 >> 24] ^ t.decrypt[1][(s1 >> 16) & 0xFF] ^
+                      t.decrypt[2][(s0 >> 8) & 0xFF] ^ t.decrypt[3][s3 & 0xFF] ^ LoadBe32(rk + 8);
+        uint32_t t3 = t.decrypt[0][s3 >> 24] ^ t.decrypt[1][(s2 >> 16) & 0xFF] ^
+                      t.decrypt[2][(s1 >> 8) & 0xFF] ^ t.decrypt[3][s0 & 0xFF] ^ LoadBe32(rk + 12);
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+    rk += 16;
+    const uint8_t* s = t.inverseSbox;
+    StoreBe32(out, (((uint32_t)s[s0 >> 24] << 24) | ((uint32_t)s[(s3 >> 16) & 0xFF] << 16) |
+                    ((uint32_t)s[(s2 >> 8) & 0xFF] << 8) | s[s1 & 0xFF]) ^ LoadBe32(rk));
+    StoreBe32(out + 4, (((uint32_t)s[s1 >> 24] << 24) | ((uint32_t)s[(s0 >> 16) & 0xFF] << 16) |
+                        ((uint32_t)s[(s3 >> 8) & 0xFF] << 8) | s[s2 & 0xFF]) ^ LoadBe32(rk + 4));
+    StoreBe32(out + 8, (((uint32_t)s[s2 >> 24] << 24) | ((uint32_t)s[(s1 >> 16) & 0xFF] << 16) |
+                        ((uint32_t)s[(s0 >> 8) & 0xFF] << 8) | s[s3 & 0xFF]) ^ LoadBe32(rk + 8));
+    StoreBe32(out + 12, (((uint32_t)s[s3 >> 24] << 24) | ((uint32_t)s[(s2 >> 16) & 0xFF] << 16) |
+                         ((uint32_t)s[(s1 >> 8) & 0xFF] << 8) | s[s0 & 0xFF]) ^ LoadBe32(rk + 12));
+}
+
+// Tweak times the primitive element of GF(2^128), little-endian as in XTS.
+static inline void MultiplyAlpha(uint8_t tweak[16]) {
+    uint8_t carry = 0;
+    for (int i = 0; i < 16; i++) {
+        uint8_t next = tweak[i] >> 7;
+        tweak[i] = (uint8_t)((tweak[i] << 1) | carry);
+        carry = next;
+    }
+    if (carry) tweak[0] ^= 0x87;
+}
+
+static void XtsBlocksPortable(bool encrypt, const uint8_t* roundKeys, int rounds, uint8_t* data, size_t blocks,
+                              uint8_t tweak[16]) {
+    uint8_t block[16];
+    for (size_t i = 0; i < blocks; i++, data += 16) {
+        for (int k = 0; k < 16; k++) block[k] = data[k] ^ tweak[k];
+        if (encrypt) {
+            AesEncryptBlockPortable(roundKeys, rounds, block, block);
+        } else {
+            AesDecryptBlockPortable(roundKeys, rounds, block, block);
+        }
+        for (int k = 0; k < 16; k++) data[k] = block[k] ^ tweak[k];
+        MultiplyAlpha(tweak);
+    }
+}
+
+// ============================================================================
+// AES-NI AND VAES
+// ============================================================================
+
+#ifdef INFERNO_X86
+
+static inline __m128i MultiplyAlphaSse(__m128i tweak) {
+    // Sign bits of the high dwords of each half, swapped into position: the
+    // low half's carry moves into bit 64, the high half's folds back as 0x87.
+    __m128i carry = _mm_shuffle_epi32(_mm_srai_epi32(tweak, 31), _MM_SHUFFLE(1, 1, 3, 3));
+    return _mm_xor_si128(_mm_slli_epi64(tweak, 1), _mm_and_si128(carry, _mm_set_epi32(0, 1, 0, 0x87)));
+}
+
+INFERNO_TARGET("aes,sse2")
+static __m128i AesEncryptBlockAesNi(const uint8_t* roundKeys, int rounds, __m128i block) {
+    block = _mm_xor_si128(block, _mm_load_si128((const __m128i*)roundKeys));
+    for (int r = 1; r < rounds; r++) {
+        block = _mm_aesenc_si128(block, _mm_load_si128((const __m128i*)(roundKeys + 16 * r)));
+    }
+    return _mm_aesenclast_si128(block, _mm_load_si128((const __m128i*)(roundKeys + 16 * rounds)));
+}
+
+// Eight independent blocks per pass keep the AES units busy despite each
+// round's latency.
+template <bool Encrypt>
+INFERNO_TARGET("aes,sse2")
+static __m128i XtsBlocksAesNi(const uint8_t* roundKeys, int rounds, uint8_t* data, size_t blocks, __m128i tweak) {
+    __m128i keys[15];
+    for (int r = 0; r <= rounds; r++) {
+        keys[r] = _mm_load_si128((const __m128i*)(roundKeys + 16 * r));
+    }
+
+    size_t i = 0;
+    for (; i + 8 <= blocks; i += 8) {
+        __m128i tweaks[8];
+        __m128i b[8];
+        __m128i* p = (__m128i*)(data + 16 * i);
+        for (int j = 0; j < 8; j++) {
+            tweaks[j] = tweak;
+            tweak = MultiplyAlphaSse(tweak);
+            b[j] = _mm_xor_si128(_mm_loadu_si128(p + j), _mm_xor_si128(tweaks[j], keys[0]));
+        }
+        for (int r = 1; r < rounds; r++) {
+            for (int j = 0; j < 8; j++) {
+                b[j] = Encrypt ? _mm_aesenc_si128(b[j], keys[r]) : _mm_aesdec_si128(b[j], keys[r]);
+            }
+        }
+        for (int j = 0; j < 8; j++) {
+            b[j] = Encrypt ? _mm_aesenclast_si128(b[j], keys[rounds]) : _mm_aesdeclast_si128(b[j], keys[rounds]);
+            _mm_storeu_si128(p + j, _mm_xor_si128(b[j], tweaks[j]));
+        }
+    }
+    for (; i < blocks; i++) {
+        __m128i* p = (__m128i*)(data + 16 * i);
+        __m128i b = _mm_xor_si128(_mm_loadu_si128(p), _mm_xor_si128(tweak, keys[0]));
+        for (int r = 1; r < rounds; r++) {
+            b = Encrypt ? _mm_aesenc_si128(b, keys[r]) : _mm_aesdec_si128(b, keys[r]);
+        }
+        b = Encrypt ? _mm_aesenclast_si128(b, keys[rounds]) : _mm_aesdeclast_si128(b, keys[rounds]);
+        _mm_storeu_si128(p, _mm_xor_si128(b, tweak));
+        tweak = MultiplyAlphaSse(tweak);
+    }
+    return tweak;
+}
+
+// Two blocks per instruction, sixteen per pass.
+template <bool Encrypt>
+INFERNO_TARGET("vaes,avx2,aes")
+static __m128i XtsBlocksVaes(const uint8_t* roundKeys, int rounds, uint8_t* data, size_t blocks, __m128i tweak) {
+    __m256i keys[15];
+    for (int r = 0; r <= rounds; r++) {
+        keys[r] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)(roundKeys + 16 * r)));
+    }
+
+    size_t i = 0;
+    for (; i + 16 <= blocks; i += 16) {
+        alignas(32) __m128i serial[16];
+        for (int j = 0; j < 16; j++) {
+            serial[j] = tweak;
+            tweak = MultiplyAlphaSse(tweak);
+        }
+        __m256i tweaks[8];
+        __m256i b[8];
+        __m256i* p = (__m256i*)(data + 16 * i);
+        for (int j = 0; j < 8; j++) {
+            tweaks[j] = _mm256_load_si256((const __m256i*)&serial[2 * j]);
+            b[j] = _mm256_xor_si256(_mm256_loadu_si256(p + j), _mm256_xor_si256(tweaks[j], keys[0]));
+        }
+        for (int r = 1; r < rounds; r++) {
+            for (int j = 0; j < 8; j++) {
+                b[j] = Encrypt ? _mm256_aesenc_epi128(b[j], keys[r]) : _mm256_aesdec_epi128(b[j], keys[r]);
+            }
+        }
+        for (int j = 0; j < 8; j++) {
+            b[j] = Encrypt ? _mm256_aesenclast_epi128(b[j], keys[rounds])
+                           : _mm256_aesdeclast_epi128(b[j], keys[rounds]);
+            _mm256_storeu_si256(p + j, _mm256_xor_si256(b[j], tweaks[j]));
+        }
+    }
+    if (i < blocks) {
+        tweak = XtsBlocksAesNi<Encrypt>(roundKeys, rounds, data + 16 * i, blocks - i, tweak);
+    }
+    return tweak;
+}
+
+#endif
+
+enum class AesBackend {
+    Portable,
+    AesNi,
+    Vaes
+};
+
+static AesBackend GetAesBackend() {
+    const CpuFeatures& cpu = GetCpuFeatures();
+    return cpu.vaes ? AesBackend::Vaes : cpu.aesni ? AesBackend::AesNi : AesBackend::Portable;
+}
+
+const char* GetAesImplementationName() {
+    switch (GetAesBackend()) {
+    case AesBackend::Vaes:  return "vaes";
+    case AesBackend::AesNi: return "aes-ni";
+    default:                return "portable";
+    }
+}
+
+// ============================================================================
+// XTS
+// ============================================================================
+
+XtsCipher::XtsCipher() {
+    memset(m_encryptKeys, 0, sizeof(m_encryptKeys));
+    memset(m_decryptKeys, 0, sizeof(m_decryptKeys));
+    memset(m_tweakKeys, 0, sizeof(m_tweakKeys));
+}
+
+XtsCipher::~XtsCipher() {
+    SecureZero(m_encryptKeys, sizeof(m_encryptKeys));
+    SecureZero(m_decryptKeys, sizeof(m_decryptKeys));
+    SecureZero(m_tweakKeys, sizeof(m_tweakKeys));
+}
+
+bool XtsCipher::SetKey(const uint8_t* key, size_t keyBytes) {
+    if (keyBytes != 32 && keyBytes != 64) {
+        return false;
+    }
+    size_t half = keyBytes / 2;
+    m_rounds = ExpandAesKey(key, half, m_encryptKeys);
+    ExpandAesKey(key + half, half, m_tweakKeys);
+    InvertAesKey(m_encryptKeys, m_rounds, m_decryptKeys);
+    m_keyBytes = keyBytes;
+    return true;
+}
+
+void XtsCipher::EncryptSectors(uint64_t firstSector, uint32_t sectorSize, uint8_t* data, size_t length) const {
+    Process(true, firstSector, sectorSize, data, length);
+}
+
+void XtsCipher::DecryptSectors(uint64_t firstSector, uint32_t sectorSize, uint8_t* data, size_t length) const {
+    Process(false, firstSector, sectorSize, data, length);
+}
+
+void XtsCipher::Process(bool encrypt, uint64_t firstSector, uint32_t sectorSize, uint8_t* data,
+                        size_t length) const {
+    AesBackend backend = GetAesBackend();
+    const uint8_t* keys = encrypt ? m_encryptKeys : m_decryptKeys;
+    size_t blocksPerSector = sectorSize / 16;
+
+    for (size_t offset = 0; offset + sectorSize <= length; offset += sectorSize) {
+        // plain64: the sector number, little-endian, zero-extended to a block.
+        uint8_t tweak[16] = {};
+        uint64_t sector = firstSector + offset / sectorSize;
+        for (int i = 0; i < 8; i++) tweak[i] = (uint8_t)(sector >> (8 * i));
+
+#ifdef INFERNO_X86
+        if (backend != AesBackend::Portable) {
+            __m128i t = AesEncryptBlockAesNi(m_tweakKeys, m_rounds, _mm_loadu_si128((const __m128i*)tweak));
+            if (backend == AesBackend::Vaes) {
+                encrypt ? XtsBlocksVaes<true>(keys, m_rounds, data + offset, blocksPerSector, t)
+                        : XtsBlocksVaes<false>(keys, m_rounds, data + offset, blocksPerSector, t);
+            } else {
+                encrypt ? XtsBlocksAesNi<true>(keys, m_rounds, data + offset, blocksPerSector, t)
+                        : XtsBlocksAesNi<false>(keys, m_rounds, data + offset, blocksPerSector, t);
+            }
+            continue;
+        }
+#endif
+        AesEncryptBlockPortable(m_tweakKeys, m_rounds, tweak, tweak);
+        XtsBlocksPortable(encrypt, keys, m_rounds, data + offset, blocksPerSector, tweak);
+    }
+}
+
+// ============================================================================
+// KEY DERIVATION
+// ============================================================================
+
+// HMAC with the padded key hashed once; each MAC then costs two blocks.
+struct HmacSha256Key {
+    Sha256 inner;
+    Sha256 outer;
+
+    HmacSha256Key(const void* key, size_t keyLength) {
+        uint8_t block[64] = {};
+        if (keyLength > sizeof(block)) {
+            Sha256 hash;
+            hash.Update(key, keyLength);
+            hash.Final(block);
+        } else if (keyLength > 0) {
+            memcpy(block, key, keyLength);
+        }
+        uint8_t pad[64];
+        for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x36;
+        inner.Update(pad, sizeof(pad));
+        for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x5C;
+        outer.Update(pad, sizeof(pad));
+        SecureZero(block, sizeof(block));
+        SecureZero(pad, sizeof(pad));
+    }
+
+    void Mac(const void* data, size_t length, const void* extra, size_t extraLength, uint8_t mac[32]) const {
+        Sha256 innerHash = inner;
+        innerHash.Update(data, length);
+        if (extraLength) innerHash.Update(extra, extraLength);
+        uint8_t digest[32];
+        innerHash.Final(digest);
+        Sha256 outerHash = outer;
+        outerHash.Update(digest, sizeof(digest));
+        outerHash.Final(mac);
+    }
+};
+
+void HmacSha256(const void* key, size_t keyLength, const void* data, size_t dataLength, uint8_t mac[32]) {
+    HmacSha256Key(key, keyLength).Mac(data, dataLength, nullptr, 0, mac);
+}
+
+void Pbkdf2Sha256(const void* password, size_t passwordLength, const uint8_t* salt, size_t saltLength,
+                  uint32_t iterations, uint8_t* output, size_t outputLength) {
+    HmacSha256Key key(password, passwordLength);
+    for (uint32_t blockIndex = 1; outputLength > 0; blockIndex++) {
+        uint8_t counter[4];
+        StoreBe32(counter, blockIndex);
+        uint8_t u[32];
+        uint8_t t[32];
+        key.Mac(salt, saltLength, counter, sizeof(counter), u);
+        memcpy(t, u, sizeof(t));
+        for (uint32_t i = 1; i < iterations; i++) {
+            key.Mac(u, sizeof(u), nullptr, 0, u);
+            for (int k = 0; k < 32; k++) t[k] ^= u[k];
+        }
+        size_t take = std::min<size_t>(outputLength, sizeof(t));
+        memcpy(output, t, take);
+        output += take;
+        outputLength -= take;
+        SecureZero(u, sizeof(u));
+        SecureZero(t, sizeof(t));
+    }
+}
+
+uint32_t CalibratePbkdf2Iterations(uint32_t milliseconds, size_t outputLength, uint32_t minimum) {
+    static const uint8_t password[] = "calibration";
+    static const uint8_t salt[32] = {};
+    std::vector<uint8_t> output(std::max<size_t>(outputLength, 1));
+
+    // Grow the sample until the clock's resolution no longer matters.
+    uint32_t iterations = 1000;
+    for (;;) {
+        auto start = std::chrono::steady_clock::now();
+        Pbkdf2Sha256(password, sizeof(password) - 1, salt, sizeof(salt), iterations, output.data(), output.size());
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (elapsed >= 50.0 || iterations >= (1u << 30)) {
+            double scaled = iterations * (milliseconds / std::max(elapsed, 1e-3));
+            return (uint32_t)std::max<double>(minimum, std::min<double>(scaled, UINT32_MAX));
+        }
+        iterations *= 2;
+    }
+}
+
+// ============================================================================
+// RANDOM AND CLEANUP
+// ============================================================================
+
+bool GetRandomBytes(void* buffer, size_t length) {
+    uint8_t* out = (uint8_t*)buffer;
+#ifdef _WIN32
+    while (length > 0) {
+        unsigned int value;
+        if (rand_s(&value) != 0) return false;
+        size_t take = std::min(length, sizeof(value));
+        memcpy(out, &value, take);
+        out += take;
+        length -= take;
+    }
+    return true;
+#else
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    while (length > 0) {
+        ssize_t got = read(fd, out, length);
+        if (got <= 0) {
+            close(fd);
+            return false;
+        }
+        out += got;
+        length -= (size_t)got;
+    }
+    close(fd);
+    return true;
+#endif
+}
+
+void SecureZero(void* buffer, size_t length) {
+    volatile uint8_t* p = (volatile uint8_t*)buffer;
+    while (length--) *p++ = 0;
+}
@@ -0,0 +1,60 @@
+// ============================================================================
+// INFERNO - Sector encryption and key derivation
+// ============================================================================
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// XTS-AES (IEEE 1619) over whole sectors, as dm-crypt's aes-xts-plain64:
+// the tweak of a sector is its 64-bit little-endian index. Uses VAES or
+// AES-NI when the CPU supports them and a table-driven AES otherwise. A
+// keyed cipher is read-only, so one instance can serve many threads.
+class XtsCipher {
+public:
+    XtsCipher();
+    ~XtsCipher();
+
+    XtsCipher(const XtsCipher&) = delete;
+    XtsCipher& operator=(const XtsCipher&) = delete;
+
+    // `key` is the data key followed by the tweak key: 32 bytes for
+    // XTS-AES-128, 64 bytes for XTS-AES-256.
+    bool SetKey(const uint8_t* key, size_t keyBytes);
+    size_t GetKeySize() const { return m_keyBytes; }
+
+    // `length` is a whole number of sectors; `sectorSize` is a multiple of 16.
+    void EncryptSectors(uint64_t firstSector, uint32_t sectorSize, uint8_t* data, size_t length) const;
+    void DecryptSectors(uint64_t firstSector, uint32_t sectorSize, uint8_t* data, size_t length) const;
+
+private:
+    void Process(bool encrypt, uint64_t firstSector, uint32_t sectorSize, uint8_t* data, size_t length) const;
+
+    // Expanded round keys, 16 bytes per round, in FIPS-197 byte order.
+    alignas(16) uint8_t m_encryptKeys[15 * 16];
+    alignas(16) uint8_t m_decryptKeys[15 * 16];
+    alignas(16) uint8_t m_tweakKeys[15 * 16];
+    int m_rounds = 0;
+    size_t m_keyBytes = 0;
+};
+
+// "vaes", "aes-ni" or "portable".
+const char* GetAesImplementationName();
+
+void HmacSha256(const void* key, size_t keyLength, const void* data, size_t dataLength, uint8_t mac[32]);
+
+// PBKDF2 (RFC 8018) with HMAC-SHA-256.
+void Pbkdf2Sha256(const void* password, size_t passwordLength, const uint8_t* salt, size_t saltLength,
+                  uint32_t iterations, uint8_t* output, size_t outputLength);
+
+// Iteration count that takes about `milliseconds` on this machine to derive
+// `outputLength` bytes, never less than `minimum`.
+uint32_t CalibratePbkdf2Iterations(uint32_t milliseconds, size_t outputLength, uint32_t minimum = 1000);
+
+// Bytes from the operating system's cryptographic random source.
+bool GetRandomBytes(void* buffer, size_t length);
+
+// Zeroes key material in a way the compiler may not drop.
+void SecureZero(void* buffer, size_t length);
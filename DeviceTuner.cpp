@@ -0,0 +1,319 @@
+// ============================================================================
+// INFERNO - Per-device write tuning and profile database
+// ============================================================================
+
+#include "DeviceTuner.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+static const uint64_t MIB = 1024 * 1024;
+
+static const uint32_t CHUNK_SIZES[] = {128 * 1024, 512 * 1024, 1024 * 1024, 2 * 1024 * 1024, 4 * 1024 * 1024};
+static const uint32_t QUEUE_DEPTHS[] = {1, 2, 4, 8};
+
+// ============================================================================
+// PROFILES
+// ============================================================================
+
+TuningProfile ParseTuningProfile(const std::wstring& name) {
+    if (name == L"capacity") return TuningProfile::Capacity;
+    if (name == L"balanced") return TuningProfile::Balanced;
+    return TuningProfile::Performance;
+}
+
+WriterParams SelectWriterParams(const std::vector<TuningSample>& samples, TuningProfile profile,
+                                double* expectedBytesPerSecond) {
+    WriterParams params;
+    if (samples.empty()) {
+        return params;
+    }
+
+    const TuningSample* fastest = &samples[0];
+    for (const TuningSample& sample : samples) {
+        if (sample.bytesPerSecond > fastest->bytesPerSecond) fastest = &sample;
+    }
+
+    const TuningSample* chosen = fastest;
+    if (profile != TuningProfile::Performance) {
+        double threshold = fastest->bytesPerSecond * (profile == TuningProfile::Balanced ? 0.95 : 0.85);
+        for (const TuningSample& sample : samples) {
+            if (sample.bytesPerSecond < threshold) continue;
+            uint64_t footprint = (uint64_t)sample.chunkSize * sample.queueDepth;
+            uint64_t chosenFootprint = (uint64_t)chosen->chunkSize * chosen->queueDepth;
+            if (footprint < chosenFootprint ||
+                (footprint == chosenFootprint && sample.bytesPerSecond > chosen->bytesPerSecond)) {
+                chosen = &sample;
+            }
+        }
+    }
+
+    params.chunkSize = chosen->chunkSize;
+    params.queueDepth = chosen->queueDepth;
+    if (expectedBytesPerSecond) {
+        *expectedBytesPerSecond = chosen->bytesPerSecond;
+    }
+    return params;
+}
+
+// ============================================================================
+// PROFILE DATABASE
+// ============================================================================
+
+DeviceProfileDatabase::DeviceProfileDatabase(const std::wstring& path) : m_path(path) {
+}
+
+DeviceProfileDatabase& DeviceProfileDatabase::Default() {
+#ifdef _WIN32
+    static DeviceProfileDatabase database(GetInfernoDataDirectory() + L"\\device_profiles.tsv");
+#else
+    static DeviceProfileDatabase database(GetInfernoDataDirectory() + L"/device_profiles.tsv");
+#endif
+    return database;
+}
+
+static bool SameIdentity(const DeviceIdentity& a, const DeviceIdentity& b) {
+    return a.vendor == b.vendor && a.product == b.product && a.revision == b.revision;
+}
+
+static std::string SanitizeField(const std::wstring& text) {
+    std::string field = WideToUtf8(text);
+    std::replace(field.begin(), field.end(), '\t', ' ');
+    std::replace(field.begin(), field.end(), '\n', ' ');
+    std::replace(field.begin(), field.end(), '\r', ' ');
+    return field;
+}
+
+void DeviceProfileDatabase::Load() {
+    m_loaded = true;
+    m_profiles.clear();
+
+    std::ifstream file(WideToUtf8(m_path));
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, '\t')) fields.push_back(field);
+        if (fields.size() != 6) continue;
+
+        DeviceIdentity identity;
+        identity.vendor = Utf8ToWide(fields[0]);
+        identity.product = Utf8ToWide(fields[1]);
+        identity.revision = Utf8ToWide(fields[2]);
+
+        // Cliff rows read as a zero chunk size to older versions, which skip them.
+        bool cliff = (fields[3] == "slc");
+        TuningSample sample;
+        sample.chunkSize = (uint32_t)strtoul(fields[3].c_str(), nullptr, 10);
+        sample.queueDepth = (uint32_t)strtoul(fields[4].c_str(), nullptr, 10);
+        sample.bytesPerSecond = strtod(fields[5].c_str(), nullptr);
+        if (!cliff && (sample.chunkSize == 0 || sample.queueDepth == 0)) continue;
+
+        auto it = std::find_if(m_profiles.begin(), m_profiles.end(),
+                               [&](const DeviceProfile& p) { return SameIdentity(p.identity, identity); });
+        if (it == m_profiles.end()) {
+            m_profiles.push_back(DeviceProfile());
+            m_profiles.back().identity = identity;
+            it = m_profiles.end() - 1;
+        }
+        if (cliff) {
+            it->slcCacheBytes = strtoull(fields[4].c_str(), nullptr, 10);
+            it->slcExhaustedBytesPerSecond = sample.bytesPerSecond;
+        } else {
+            it->samples.push_back(sample);
+        }
+    }
+}
+
+bool DeviceProfileDatabase::Save() {
+    std::ostringstream out;
+    out << "# Inferno device profiles: vendor, product, revision, chunk bytes, queue depth, bytes/s\n"
+           "# or vendor, product, revision, slc, SLC cache bytes, bytes/s past it\n";
+    for (const DeviceProfile& profile : m_profiles) {
+        std::string identity = SanitizeField(profile.identity.vendor) + '\t' +
+                               SanitizeField(profile.identity.product) + '\t' +
+                               SanitizeField(profile.identity.revision) + '\t';
+        for (const TuningSample& sample : profile.samples) {
+            out << identity << sample.chunkSize << '\t' << sample.queueDepth << '\t'
+                << (uint64_t)sample.bytesPerSecond << '\n';
+        }
+        if (profile.slcCacheBytes > 0) {
+            out << identity << "slc\t" << profile.slcCacheBytes << '\t'
+                << (uint64_t)profile.slcExhaustedBytesPerSecond << '\n';
+        }
+    }
+    return WriteFileAtomically(m_path, out.str());
+}
+
+bool DeviceProfileDatabase::Find(const DeviceIdentity& identity, DeviceProfile& profile) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (!m_loaded) Load();
+    for (const DeviceProfile& candidate : m_profiles) {
+        if (SameIdentity(candidate.identity, identity) &&
+            (!candidate.samples.empty() || candidate.slcCacheBytes > 0)) {
+            profile = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool DeviceProfileDatabase::Store(const DeviceProfile& profile) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    // Pick up profiles stored by other processes since we last looked.
+    Load();
+    auto it = std::find_if(m_profiles.begin(), m_profiles.end(),
+                           [&](const DeviceProfile& p) { return SameIdentity(p.identity, profile.identity); });
+    if (it != m_profiles.end()) {
+        *it = profile;
+    } else {
+        m_profiles.push_back(profile);
+    }
+    return Save();
+}
+
+bool DeviceProfileDatabase::StoreWriteCliff(const DeviceIdentity& identity, uint64_t cacheBytes,
+                                            double exhaustedBytesPerSecond) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    Load();
+    auto it = std::find_if(m_profiles.begin(), m_profiles.end(),
+                           [&](const DeviceProfile& p) { return SameIdentity(p.identity, identity); });
+    if (it == m_profiles.end()) {
+        m_profiles.push_back(DeviceProfile());
+        m_profiles.back().identity = identity;
+        it = m_profiles.end() - 1;
+    }
+    it->slcCacheBytes = cacheBytes;
+    it->slcExhaustedBytesPerSecond = exhaustedBytesPerSecond;
+    return Save();
+}
+
+// ============================================================================
+// CALIBRATION
+// ============================================================================
+
+static bool MeasureWrite(BlockDevice& device, uint64_t offset, uint64_t length, const WriterParams& params,
+                         const std::vector<uint8_t>& pattern, double& bytesPerSecond, std::wstring& error) {
+    ChunkSource source = [&](uint64_t position, void* buffer, size_t want) -> int64_t {
+        // Incompressible data: some controllers shortcut runs of zeros.
+        size_t start = (size_t)(position % (pattern.size() / 2));
+        memcpy(buffer, pattern.data() + start, std::min(want, pattern.size() - start));
+        return (int64_t)want;
+    };
+
+    WriteStats stats;
+    if (!RunWritePipeline(device, offset, length, source, params, nullptr, &stats, error)) {
+        return false;
+    }
+    bytesPerSecond = stats.BytesPerSecond();
+    return true;
+}
+
+bool CalibrateDevice(BlockDevice& device, uint64_t scratchOffset, uint64_t scratchLength,
+                     std::vector<TuningSample>& samples, std::wstring& error) {
+    samples.clear();
+    if (scratchLength < 16 * MIB) {
+        error = L"Scratch region is too small for calibration.";
+        return false;
+    }
+    // A region that splits physical sectors would time the drive's
+    // read-modify-write instead of its writes.
+    if (scratchOffset % GetWriteAlignment(device.GetGeometry()) != 0) {
+        error = L"Scratch region is not aligned to the device's physical sectors.";
+        return false;
+    }
+
+    // Twice the largest chunk so any window of a chunk is in range.
+    std::vector<uint8_t> pattern(2 * CHUNK_SIZES[sizeof(CHUNK_SIZES) / sizeof(CHUNK_SIZES[0]) - 1]);
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < pattern.size(); i += sizeof(uint64_t)) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        memcpy(&pattern[i], &state, sizeof(state));
+    }
+
+    // Warm-up write: wakes the device and sizes the trials to about a second each.
+    WriterParams params;
+    params.chunkSize = 1024 * 1024;
+    params.queueDepth = 2;
+    double warmupSpeed = 0.0;
+    if (!MeasureWrite(device, scratchOffset, 8 * MIB, params, pattern, warmupSpeed, error)) {
+        return false;
+    }
+    uint64_t trialBytes = std::max<uint64_t>(4 * MIB, std::min<uint64_t>((uint64_t)warmupSpeed, 64 * MIB));
+    trialBytes = std::min(trialBytes, scratchLength) / (4 * MIB) * (4 * MIB);
+
+    auto trial = [&](uint32_t chunkSize, uint32_t queueDepth) -> bool {
+        for (const TuningSample& sample : samples) {
+            if (sample.chunkSize == chunkSize && sample.queueDepth == queueDepth) return true;
+        }
+        TuningSample sample;
+        sample.chunkSize = chunkSize;
+        sample.queueDepth = queueDepth;
+        WriterParams trialParams;
+        trialParams.chunkSize = chunkSize;
+        trialParams.queueDepth = queueDepth;
+        if (!MeasureWrite(device, scratchOffset, trialBytes, trialParams, pattern, sample.bytesPerSecond, error)) {
+            return false;
+        }
+        samples.push_back(sample);
+        return true;
+    };
+    auto fastest = [&]() -> const TuningSample& {
+        return *std::max_element(samples.begin(), samples.end(), [](const TuningSample& a, const TuningSample& b) {
+            return a.bytesPerSecond < b.bytesPerSecond;
+        });
+    };
+
+    // Coordinate search: chunk size at queue depth 2, then queue depth at the
+    // best chunk size. Seven trials instead of the full twenty-cell grid.
+    for (uint32_t chunkSize : CHUNK_SIZES) {
+        if (!trial(chunkSize, 2)) return false;
+    }
+    uint32_t bestChunk = fastest().chunkSize;
+    for (uint32_t queueDepth : QUEUE_DEPTHS) {
+        if (!trial(bestChunk, queueDepth)) return false;
+    }
+    return true;
+}
+
+bool TuneWriter(BlockDevice& device, TuningProfile profile, DeviceProfileDatabase& database,
+                TuningResult& result, std::wstring& error) {
+    const DeviceIdentity& identity = device.GetIdentity();
+
+    DeviceProfile stored;
+    bool found = identity.IsKnown() && database.Find(identity, stored);
+    if (found && !stored.samples.empty()) {
+        result.params = SelectWriterParams(stored.samples, profile, &result.expectedBytesPerSecond);
+        result.fromDatabase = true;
+        return true;
+    }
+
+    const DeviceGeometry& geometry = device.GetGeometry();
+    uint64_t scratchOffset = 16 * MIB;
+    if (geometry.sizeBytes < scratchOffset + 32 * MIB) {
+        error = L"Device is too small to calibrate.";
+        return false;
+    }
+    uint64_t scratchLength = std::min<uint64_t>(64 * MIB, geometry.sizeBytes - scratchOffset);
+
+    DeviceProfile measured = stored;    // keeps an SLC cliff stored on its own
+    measured.identity = identity;
+    if (!CalibrateDevice(device, scratchOffset, scratchLength, measured.samples, error)) {
+        return false;
+    }
+
+    result.params = SelectWriterParams(measured.samples, profile, &result.expectedBytesPerSecond);
+    result.fromDatabase = false;
+    if (identity.IsKnown()) {
+        database.Store(measured);
+    }
+    return true;
+}
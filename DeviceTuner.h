@@ -0,0 +1,85 @@
+// ============================================================================
+// INFERNO - Per-device write tuning and profile database
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+#include "ImageWriter.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+// FormatOptions::optimizationProfile. "performance" takes the fastest
+// measured parameters; "balanced" and "capacity" take the smallest in-flight
+// memory (chunk size x queue depth) within 95% / 85% of the fastest.
+enum class TuningProfile {
+    Performance,
+    Balanced,
+    Capacity
+};
+
+TuningProfile ParseTuningProfile(const std::wstring& name);
+
+struct TuningSample {
+    uint32_t chunkSize = 0;
+    uint32_t queueDepth = 0;
+    double bytesPerSecond = 0.0;
+};
+
+struct DeviceProfile {
+    DeviceIdentity identity;
+    std::vector<TuningSample> samples;
+    // Where a full write last fell off the SLC cache (see WriteController.h);
+    // 0 when no cliff has been seen.
+    uint64_t slcCacheBytes = 0;
+    double slcExhaustedBytesPerSecond = 0.0;
+};
+
+// Calibration results keyed by vendor, product and revision, stored as a
+// tab-separated file. Every measured sample is kept so a different tuning
+// profile can be chosen later without recalibrating. A profile may hold
+// only an SLC cliff.
+class DeviceProfileDatabase {
+public:
+    explicit DeviceProfileDatabase(const std::wstring& path);
+
+    // The shared database in the Inferno data directory.
+    static DeviceProfileDatabase& Default();
+
+    bool Find(const DeviceIdentity& identity, DeviceProfile& profile);
+    bool Store(const DeviceProfile& profile);
+
+    // Updates the profile's SLC cliff, keeping its samples.
+    bool StoreWriteCliff(const DeviceIdentity& identity, uint64_t cacheBytes, double exhaustedBytesPerSecond);
+
+private:
+    void Load();
+    bool Save();
+
+    std::mutex m_lock;
+    std::wstring m_path;
+    bool m_loaded = false;
+    std::vector<DeviceProfile> m_profiles;
+};
+
+struct TuningResult {
+    WriterParams params;
+    double expectedBytesPerSecond = 0.0;
+    bool fromDatabase = false;
+};
+
+// Measure sequential write throughput across chunk sizes and queue depths.
+// DESTRUCTIVE: overwrites [scratchOffset, scratchOffset + scratchLength).
+bool CalibrateDevice(BlockDevice& device, uint64_t scratchOffset, uint64_t scratchLength,
+                     std::vector<TuningSample>& samples, std::wstring& error);
+
+WriterParams SelectWriterParams(const std::vector<TuningSample>& samples, TuningProfile profile,
+                                double* expectedBytesPerSecond = nullptr);
+
+// Reuse the stored profile for this device model, or calibrate on a scratch
+// region near the start of the device (which the caller is about to
+// overwrite anyway) and store the result.
+bool TuneWriter(BlockDevice& device, TuningProfile profile, DeviceProfileDatabase& database,
+                TuningResult& result, std::wstring& error);
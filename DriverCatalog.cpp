@@ -0,0 +1,504 @@
+// ============================================================================
+// INFERNO - Driver package indexer and catalog
+// ============================================================================
+
+#include "DriverCatalog.h"
+#include "Checksum.h"
+#include "Log.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cwctype>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+static const wchar_t PATH_SEPARATOR = L'\\';
+#else
+static const wchar_t PATH_SEPARATOR = L'/';
+#endif
+
+static std::wstring ToLower(std::wstring text) {
+    for (wchar_t& c : text) c = (wchar_t)towlower(c);
+    return text;
+}
+
+static std::wstring ToUpper(std::wstring text) {
+    for (wchar_t& c : text) c = (wchar_t)towupper(c);
+    return text;
+}
+
+static std::wstring Trim(const std::wstring& text) {
+    size_t begin = 0, end = text.size();
+    while (begin < end && iswspace(text[begin])) begin++;
+    while (end > begin && iswspace(text[end - 1])) end--;
+    return text.substr(begin, end - begin);
+}
+
+static uint32_t ArchitectureFromName(const std::wstring& lowerName) {
+    if (lowerName == L"x86" || lowerName == L"i386") return DRIVER_ARCH_X86;
+    if (lowerName == L"x64" || lowerName == L"amd64") return DRIVER_ARCH_X64;
+    if (lowerName == L"arm64" || lowerName == L"aarch64") return DRIVER_ARCH_ARM64;
+    if (lowerName == L"arm") return DRIVER_ARCH_ARM;
+    if (lowerName == L"ia64") return DRIVER_ARCH_IA64;
+    return 0;
+}
+
+uint32_t ParseDriverArchitecture(const std::wstring& name) {
+    uint32_t architectures = 0;
+    std::wstringstream stream(ToLower(name));
+    std::wstring part;
+    while (std::getline(stream, part, L'/')) {
+        architectures |= ArchitectureFromName(Trim(part));
+    }
+    return architectures ? architectures : DRIVER_ARCH_ALL;
+}
+
+// ============================================================================
+// INF PARSING
+// ============================================================================
+
+// Unicode INFs are UTF-16LE with a byte order mark; others are UTF-8 with a
+// mark, or ANSI, which is taken as Latin-1 since only ASCII matters here.
+static std::wstring DecodeInf(const std::string& contents) {
+    const unsigned char* bytes = (const unsigned char*)contents.data();
+    size_t length = contents.size();
+    std::wstring text;
+    if (length >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+        text.reserve(length / 2);
+        for (size_t i = 2; i + 1 < length; i += 2) {
+            text.push_back((wchar_t)(bytes[i] | (bytes[i + 1] << 8)));
+        }
+    } else if (length >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) {
+        text = Utf8ToWide(contents.substr(3));
+    } else {
+        text.resize(length);
+        for (size_t i = 0; i < length; i++) text[i] = (wchar_t)bytes[i];
+    }
+    return text;
+}
+
+// Drops a comment (';' outside quotes) from one physical line.
+static std::wstring StripComment(const std::wstring& line) {
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); i++) {
+        if (line[i] == L'"') quoted = !quoted;
+        else if (line[i] == L';' && !quoted) return line.substr(0, i);
+    }
+    return line;
+}
+
+// Section name (lower case) to its logical lines, with comments removed and
+// '\' continuations joined. Repeated sections are merged.
+static std::map<std::wstring, std::vector<std::wstring>> SplitSections(const std::wstring& text) {
+    std::map<std::wstring, std::vector<std::wstring>> sections;
+    std::vector<std::wstring>* current = nullptr;
+    std::wstring pending;
+    size_t position = 0;
+    while (position <= text.size()) {
+        size_t end = text.find(L'\n', position);
+        if (end == std::wstring::npos) end = text.size();
+        std::wstring line = Trim(StripComment(text.substr(position, end - position)));
+        position = end + 1;
+
+        if (!line.empty() && line.back() == L'\\') {
+            pending += line.substr(0, line.size() - 1);
+            continue;
+        }
+        line = Trim(pending + line);
+        pending.clear();
+        if (line.empty()) continue;
+
+        if (line[0] == L'[') {
+            size_t close = line.find(L']');
+            size_t length = close == std::wstring::npos ? std::wstring::npos : close - 1;
+            current = &sections[ToLower(Trim(line.substr(1, length)))];
+        } else if (current) {
+            current->push_back(line);
+        }
+    }
+    return sections;
+}
+
+static std::wstring Unquote(const std::wstring& field) {
+    std::wstring text = Trim(field);
+    if (text.size() >= 2 && text.front() == L'"' && text.back() == L'"') {
+        text = text.substr(1, text.size() - 2);
+    }
+    return text;
+}
+
+// "key = a, b, c" into the lower-case key (empty when there is no '=') and
+// the comma-separated fields.
+static void SplitEntry(const std::wstring& line, std::wstring& key, std::vector<std::wstring>& fields) {
+    key.clear();
+    fields.clear();
+    std::wstring field;
+    bool quoted = false, haveKey = false;
+    for (wchar_t c : line) {
+        if (c == L'"') quoted = !quoted;
+        if (c == L'=' && !quoted && !haveKey) {
+            key = ToLower(Trim(field));
+            field.clear();
+            haveKey = true;
+        } else if (c == L',' && !quoted) {
+            fields.push_back(Unquote(field));
+            field.clear();
+        } else {
+            field.push_back(c);
+        }
+    }
+    fields.push_back(Unquote(field));
+}
+
+// Replaces %token% with its [Strings] value; "%%" is a literal percent.
+static std::wstring ExpandStrings(const std::wstring& text, const std::map<std::wstring, std::wstring>& strings) {
+    std::wstring result;
+    size_t position = 0;
+    while (position < text.size()) {
+        size_t open = text.find(L'%', position);
+        size_t close = open == std::wstring::npos ? std::wstring::npos : text.find(L'%', open + 1);
+        if (close == std::wstring::npos) {
+            result += text.substr(position);
+            break;
+        }
+        result += text.substr(position, open - position);
+        std::wstring token = text.substr(open + 1, close - open - 1);
+        if (token.empty()) {
+            result += L'%';
+        } else {
+            auto it = strings.find(ToLower(token));
+            result += it != strings.end() ? it->second : text.substr(open, close - open + 1);
+        }
+        position = close + 1;
+    }
+    return result;
+}
+
+// A [Manufacturer] decoration such as NTamd64 or NTx86.6.1 gives the
+// platform its models section serves; plain "NT" serves every platform.
+static uint32_t DecorationArchitecture(const std::wstring& decoration) {
+    std::wstring lower = ToLower(decoration);
+    if (lower.compare(0, 2, L"nt") != 0) return 0;
+    std::wstring platform = lower.substr(2, lower.find(L'.') == std::wstring::npos ? std::wstring::npos
+                                                                                   : lower.find(L'.') - 2);
+    return platform.empty() ? DRIVER_ARCH_ALL : ArchitectureFromName(platform);
+}
+
+bool ParseInfFile(const std::string& contents, DriverPackage& package, std::wstring& error) {
+    std::map<std::wstring, std::vector<std::wstring>> sections = SplitSections(DecodeInf(contents));
+    auto version = sections.find(L"version");
+    if (version == sections.end()) {
+        error = L"No [Version] section.";
+        return false;
+    }
+
+    // Base strings first, then localized ones only where the base has none.
+    std::map<std::wstring, std::wstring> strings;
+    std::wstring key;
+    std::vector<std::wstring> fields;
+    for (const auto& section : sections) {
+        if (section.first != L"strings" && section.first.compare(0, 8, L"strings.") != 0) continue;
+        bool localized = section.first != L"strings";
+        for (const std::wstring& line : section.second) {
+            SplitEntry(line, key, fields);
+            if (key.empty() || (localized && strings.count(key))) continue;
+            strings[key] = fields[0];
+        }
+    }
+
+    for (const std::wstring& line : version->second) {
+        SplitEntry(line, key, fields);
+        std::wstring value = ExpandStrings(fields[0], strings);
+        if (key == L"class") package.driverClass = value;
+        else if (key == L"classguid") package.classGuid = ToUpper(value);
+        else if (key == L"provider") package.provider = value;
+        else if (key == L"driverver") package.version = fields.size() > 1 ? ExpandStrings(fields[1], strings) : value;
+    }
+
+    uint32_t architectures = 0;
+    std::vector<std::wstring> ids;
+    auto manufacturer = sections.find(L"manufacturer");
+    if (manufacturer != sections.end()) {
+        for (const std::wstring& line : manufacturer->second) {
+            SplitEntry(line, key, fields);
+            std::wstring base = ToLower(fields[0]);
+            if (base.empty()) continue;
+
+            std::vector<std::pair<std::wstring, uint32_t>> models;
+            if (fields.size() == 1) {
+                models.push_back({base, DRIVER_ARCH_X86});
+            }
+            for (size_t i = 1; i < fields.size(); i++) {
+                uint32_t platform = DecorationArchitecture(fields[i]);
+                if (platform) models.push_back({base + L"." + ToLower(fields[i]), platform});
+            }
+
+            for (const auto& model : models) {
+                auto section = sections.find(model.first);
+                if (section == sections.end()) continue;
+                architectures |= model.second;
+                std::vector<std::wstring> modelFields;
+                for (const std::wstring& entry : section->second) {
+                    SplitEntry(entry, key, modelFields);
+                    if (key.empty()) continue;
+                    for (size_t i = 1; i < modelFields.size(); i++) {
+                        std::wstring id = ToUpper(ExpandStrings(modelFields[i], strings));
+                        if (!id.empty()) ids.push_back(id);
+                    }
+                }
+            }
+        }
+    }
+
+    // Packages that ship files per platform say so in their section names.
+    for (const auto& section : sections) {
+        const std::wstring prefix = L"sourcedisksfiles.";
+        if (section.first.compare(0, prefix.size(), prefix) == 0) {
+            architectures |= ArchitectureFromName(section.first.substr(prefix.size()));
+        }
+    }
+
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    package.architectures = architectures;
+    package.hardwareIds = ids;
+    return true;
+}
+
+// ============================================================================
+// CATALOG
+// ============================================================================
+
+DriverCatalog::DriverCatalog(const std::wstring& path) : m_path(path) {}
+
+DriverCatalog& DriverCatalog::Default() {
+#ifdef _WIN32
+    static DriverCatalog catalog(GetInfernoDataDirectory() + L"\\driver_catalog.tsv");
+#else
+    static DriverCatalog catalog(GetInfernoDataDirectory() + L"/driver_catalog.tsv");
+#endif
+    return catalog;
+}
+
+static std::string SanitizeField(const std::wstring& text) {
+    std::string field = WideToUtf8(text);
+    std::replace(field.begin(), field.end(), '\t', ' ');
+    std::replace(field.begin(), field.end(), '\n', ' ');
+    std::replace(field.begin(), field.end(), '\r', ' ');
+    return field;
+}
+
+static bool ByPath(const DriverPackage& a, const DriverPackage& b) {
+    return a.path < b.path;
+}
+
+void DriverCatalog::Load() {
+    m_loaded = true;
+    m_packages.clear();
+
+    std::ifstream file(WideToUtf8(m_path));
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, '\t')) fields.push_back(field);
+        if (fields.size() == 9) fields.push_back(std::string());
+        if (fields.size() != 10) continue;
+
+        DriverPackage package;
+        package.path = Utf8ToWide(fields[0]);
+        package.size = strtoull(fields[1].c_str(), nullptr, 10);
+        package.modifiedTime = strtoll(fields[2].c_str(), nullptr, 10);
+        package.sha256 = fields[3];
+        package.driverClass = Utf8ToWide(fields[4]);
+        package.classGuid = Utf8ToWide(fields[5]);
+        package.provider = Utf8ToWide(fields[6]);
+        package.version = Utf8ToWide(fields[7]);
+        package.architectures = (uint32_t)strtoul(fields[8].c_str(), nullptr, 10);
+        std::stringstream ids(fields[9]);
+        while (std::getline(ids, field, ',')) {
+            if (!field.empty()) package.hardwareIds.push_back(Utf8ToWide(field));
+        }
+        if (package.path.empty() || package.sha256.size() != 2 * Sha256::DIGEST_SIZE) continue;
+        m_packages.push_back(package);
+    }
+    std::sort(m_packages.begin(), m_packages.end(), ByPath);
+}
+
+bool DriverCatalog::Save() {
+    std::ostringstream out;
+    out << "# Inferno driver catalog: path, bytes, mtime ns, sha256, class, class guid, provider, version, "
+           "architectures, hardware ids\n";
+    for (const DriverPackage& package : m_packages) {
+        out << SanitizeField(package.path) << '\t' << package.size << '\t' << package.modifiedTime << '\t'
+            << package.sha256 << '\t' << SanitizeField(package.driverClass) << '\t'
+            << SanitizeField(package.classGuid) << '\t' << SanitizeField(package.provider) << '\t'
+            << SanitizeField(package.version) << '\t' << package.architectures << '\t';
+        for (size_t i = 0; i < package.hardwareIds.size(); i++) {
+            out << (i ? "," : "") << SanitizeField(package.hardwareIds[i]);
+        }
+        out << '\n';
+    }
+    return WriteFileAtomically(m_path, out.str());
+}
+
+static std::wstring NormalizeRoot(std::wstring root) {
+    while (root.size() > 1 && (root.back() == L'/' || root.back() == L'\\')) root.pop_back();
+    return root;
+}
+
+static bool IsUnder(const std::wstring& path, const std::wstring& root) {
+    return path.size() > root.size() && path.compare(0, root.size(), root) == 0 &&
+           (path[root.size()] == PATH_SEPARATOR || root.back() == PATH_SEPARATOR);
+}
+
+// Hashes a package and, unless its contents match `previous`, parses it.
+// Returns false when the INF cannot be read at all.
+static bool IndexPackage(const FileInfo& file, const DriverPackage* previous, DriverPackage& package,
+                         bool& parsed) {
+    std::string contents;
+    if (!ReadWholeFile(file.path, contents)) return false;
+
+    Sha256 hash;
+    hash.Update(contents.data(), contents.size());
+    uint8_t digest[Sha256::DIGEST_SIZE];
+    hash.Final(digest);
+    std::string sha256 = WideToUtf8(DigestToHex(digest, sizeof(digest)));
+
+    parsed = !previous || previous->sha256 != sha256;
+    if (parsed) {
+        // An INF that does not parse is still recorded, with no
+        // architectures, so it is not re-read until it changes.
+        package = DriverPackage();
+        std::wstring parseError;
+        if (!ParseInfFile(contents, package, parseError)) {
+            LogMessage(LogLevel::Debug, "drivers", file.path + L": " + parseError);
+        }
+    } else {
+        package = *previous;
+    }
+    package.path = file.path;
+    package.size = file.size;
+    package.modifiedTime = file.modifiedTime;
+    package.sha256 = sha256;
+    return true;
+}
+
+bool DriverCatalog::Update(const std::wstring& root, DriverIndexStats* stats, std::wstring& error) {
+    auto started = std::chrono::steady_clock::now();
+    std::wstring base = NormalizeRoot(root);
+    std::vector<FileInfo> files;
+    if (!ListFiles(base, L".inf", files, error)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    // Pick up packages indexed by other processes since we last looked.
+    Load();
+
+    DriverIndexStats counts;
+    counts.packages = files.size();
+    std::vector<DriverPackage> packages(files.size());
+    std::vector<const DriverPackage*> previous(files.size(), nullptr);
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < files.size(); i++) {
+        DriverPackage key;
+        key.path = files[i].path;
+        auto it = std::lower_bound(m_packages.begin(), m_packages.end(), key, ByPath);
+        if (it != m_packages.end() && it->path == files[i].path) {
+            previous[i] = &*it;
+            if (it->size == files[i].size && it->modifiedTime == files[i].modifiedTime) {
+                packages[i] = *it;
+                counts.reused++;
+                continue;
+            }
+        }
+        pending.push_back(i);
+    }
+
+    // Large driver folders are mostly small files; reading and parsing them
+    // on several threads keeps the first index of a big folder short.
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> parsedCount{0}, rehashedCount{0}, failedCount{0};
+    std::vector<uint8_t> readable(files.size(), 1);
+    auto worker = [&]() {
+        for (size_t n = next++; n < pending.size(); n = next++) {
+            size_t i = pending[n];
+            bool parsed = false;
+            if (!IndexPackage(files[i], previous[i], packages[i], parsed)) {
+                readable[i] = 0;
+                failedCount++;
+            } else if (parsed) {
+                parsedCount++;
+            } else {
+                rehashedCount++;
+            }
+        }
+    };
+    size_t threadCount = std::min<size_t>(pending.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threadCount; t++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+
+    std::vector<DriverPackage> updated;
+    for (const DriverPackage& package : m_packages) {
+        if (!IsUnder(package.path, base)) updated.push_back(package);
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+        if (readable[i]) updated.push_back(packages[i]);
+    }
+    std::sort(updated.begin(), updated.end(), ByPath);
+    m_packages.swap(updated);
+
+    counts.parsed = parsedCount;
+    counts.rehashed = rehashedCount;
+    counts.failed = failedCount;
+    counts.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    LogEvent(LogLevel::Info, "drivers", "index",
+             {{"packages", (int64_t)counts.packages}, {"reused", (int64_t)counts.reused},
+              {"rehashed", (int64_t)counts.rehashed}, {"parsed", (int64_t)counts.parsed},
+              {"failed", (int64_t)counts.failed}, {"ms", (int64_t)(counts.seconds * 1000)}});
+    if (stats) {
+        *stats = counts;
+    }
+
+    if (!Save()) {
+        // The index is still usable for this run; it is just rebuilt next time.
+        LogMessage(LogLevel::Warning, "drivers", L"Cannot save the driver catalog " + m_path + L".");
+    }
+    return true;
+}
+
+std::vector<DriverPackage> DriverCatalog::Select(const std::wstring& root, uint32_t architectures,
+                                                 const std::vector<std::wstring>& classes) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (!m_loaded) Load();
+
+    std::wstring base = NormalizeRoot(root);
+    std::vector<DriverPackage> selected;
+    for (const DriverPackage& package : m_packages) {
+        if (!IsUnder(package.path, base) || !(package.architectures & architectures)) continue;
+        if (!classes.empty() &&
+            std::none_of(classes.begin(), classes.end(), [&](const std::wstring& name) {
+                return ToLower(name) == ToLower(package.driverClass);
+            })) {
+            continue;
+        }
+        selected.push_back(package);
+    }
+    return selected;
+}
@@ -0,0 +1,78 @@
+// ============================================================================
+// INFERNO - Driver package indexer and catalog
+// ============================================================================
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Processor architectures a driver package installs on, as a bit mask.
+static const uint32_t DRIVER_ARCH_X86 = 1 << 0;
+static const uint32_t DRIVER_ARCH_X64 = 1 << 1;
+static const uint32_t DRIVER_ARCH_ARM64 = 1 << 2;
+static const uint32_t DRIVER_ARCH_ARM = 1 << 3;
+static const uint32_t DRIVER_ARCH_IA64 = 1 << 4;
+static const uint32_t DRIVER_ARCH_ALL = 0x1F;
+
+// Accepts ISOInfo::architecture values such as L"x64", L"amd64", L"arm64"
+// or L"x64/x86". Unknown names match every architecture.
+uint32_t ParseDriverArchitecture(const std::wstring& name);
+
+// One INF file and what it declares.
+struct DriverPackage {
+    std::wstring path;                      // the INF; its folder holds the package
+    uint64_t size = 0;
+    int64_t modifiedTime = 0;
+    std::string sha256;                     // hex digest of the INF
+    std::wstring driverClass;               // [Version] Class, e.g. SCSIAdapter
+    std::wstring classGuid;
+    std::wstring provider;
+    std::wstring version;                   // DriverVer
+    uint32_t architectures = 0;
+    std::vector<std::wstring> hardwareIds;  // upper case
+};
+
+// Fills everything but the file identity (path, size, time, hash).
+bool ParseInfFile(const std::string& contents, DriverPackage& package, std::wstring& error);
+
+struct DriverIndexStats {
+    size_t packages = 0;
+    size_t reused = 0;      // size and modification time unchanged
+    size_t rehashed = 0;    // touched, but the contents hash still matched
+    size_t parsed = 0;      // new or changed
+    size_t failed = 0;
+    double seconds = 0.0;
+};
+
+// Parsed INF packages keyed by path, remembered with the size, modification
+// time and SHA-256 they had when parsed, in a tab-separated file. Updating
+// re-reads only the packages whose size or time changed, and re-parses only
+// those whose contents did; new and changed packages are parsed in parallel.
+class DriverCatalog {
+public:
+    explicit DriverCatalog(const std::wstring& path);
+
+    // driver_catalog.tsv in the Inferno data directory.
+    static DriverCatalog& Default();
+
+    // Brings the packages under `root` up to date and saves the catalog.
+    // Packages under other roots are kept.
+    bool Update(const std::wstring& root, DriverIndexStats* stats, std::wstring& error);
+
+    // Packages under `root` for any of `architectures` whose class is one of
+    // `classes` (case-insensitive; empty for every class).
+    std::vector<DriverPackage> Select(const std::wstring& root, uint32_t architectures,
+                                      const std::vector<std::wstring>& classes);
+
+private:
+    void Load();
+    bool Save();
+
+    std::mutex m_lock;
+    std::wstring m_path;
+    bool m_loaded = false;
+    std::vector<DriverPackage> m_packages;  // sorted by path
+};
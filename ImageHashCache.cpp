@@ -0,0 +1,260 @@
+// ============================================================================
+// INFERNO - Persistent image digest cache
+// ============================================================================
+
+#include "ImageHashCache.h"
+#include "BlockDevice.h"
+#include "Checksum.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+static const uint32_t FINGERPRINT_BLOCKS = 16;
+static const uint32_t FINGERPRINT_BLOCK_SIZE = 64 * 1024;
+
+// ============================================================================
+// FINGERPRINT
+// ============================================================================
+
+bool ComputeFileFingerprint(const std::wstring& path, uint64_t size, std::string& fingerprint) {
+    std::unique_ptr<BlockDevice> file = OpenBlockDevice(path, false);
+    if (!file) return false;
+
+    Sha256 hash;
+    hash.Update(&size, sizeof(size));
+    std::vector<uint8_t> block(FINGERPRINT_BLOCK_SIZE);
+    uint64_t span = size > FINGERPRINT_BLOCK_SIZE ? size - FINGERPRINT_BLOCK_SIZE : 0;
+    for (uint32_t i = 0; i < FINGERPRINT_BLOCKS; i++) {
+        uint64_t offset = span * i / (FINGERPRINT_BLOCKS - 1);
+        size_t length = (size_t)std::min<uint64_t>(FINGERPRINT_BLOCK_SIZE, size - offset);
+        if (length == 0) break;
+        if (!file->Read(offset, block.data(), length)) return false;
+        hash.Update(block.data(), length);
+    }
+    uint8_t digest[Sha256::DIGEST_SIZE];
+    hash.Final(digest);
+    fingerprint = WideToUtf8(DigestToHex(digest, sizeof(digest)));
+    return true;
+}
+
+// ============================================================================
+// CACHE FILE
+// ============================================================================
+
+static bool SameFile(const FileIdentity& a, const FileIdentity& b) {
+    return a.size == b.size && a.modifiedTime == b.modifiedTime && a.volumeId == b.volumeId &&
+           a.fileId == b.fileId;
+}
+
+static std::string SanitizeField(const std::wstring& text) {
+    std::string field = WideToUtf8(text);
+    std::replace(field.begin(), field.end(), '\t', ' ');
+    std::replace(field.begin(), field.end(), '\n', ' ');
+    std::replace(field.begin(), field.end(), '\r', ' ');
+    return field;
+}
+
+static std::string BytesToHex(const uint8_t* data, size_t length) {
+    static const char DIGITS[] = "0123456789abcdef";
+    std::string hex(length * 2, '0');
+    for (size_t i = 0; i < length; i++) {
+        hex[2 * i] = DIGITS[data[i] >> 4];
+        hex[2 * i + 1] = DIGITS[data[i] & 15];
+    }
+    return hex;
+}
+
+static bool HexToBytes(const std::string& hex, size_t offset, uint8_t* data, size_t length) {
+    if (offset + length * 2 > hex.size()) return false;
+    for (size_t i = 0; i < length * 2; i++) {
+        char c = hex[offset + i];
+        int value = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (value < 0) return false;
+        if (i % 2 == 0) data[i / 2] = (uint8_t)(value << 4);
+        else data[i / 2] |= (uint8_t)value;
+    }
+    return true;
+}
+
+ImageHashCache::ImageHashCache(const std::wstring& path) : m_path(path) {
+}
+
+ImageHashCache& ImageHashCache::Default() {
+#ifdef _WIN32
+    static ImageHashCache cache(GetInfernoDataDirectory() + L"\\image_hashes.tsv");
+#else
+    static ImageHashCache cache(GetInfernoDataDirectory() + L"/image_hashes.tsv");
+#endif
+    return cache;
+}
+
+// Rereads the file when another process (or cache object) has replaced it.
+// Called with m_lock held.
+void ImageHashCache::LoadIfChanged() {
+    FileIdentity current;
+    bool exists = GetFileIdentity(m_path, current);
+    if (m_loaded && (exists ? SameFile(current, m_loadedIdentity) : m_entries.empty())) {
+        return;
+    }
+    m_loaded = true;
+    m_loadedIdentity = current;
+    m_entries.clear();
+
+    std::ifstream file(WideToUtf8(m_path));
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, '\t')) fields.push_back(field);
+        if (fields.size() != 11) continue;
+
+        ImageHashEntry entry;
+        entry.path = Utf8ToWide(fields[0]);
+        entry.file.size = strtoull(fields[1].c_str(), nullptr, 10);
+        entry.file.modifiedTime = strtoll(fields[2].c_str(), nullptr, 10);
+        entry.file.volumeId = strtoull(fields[3].c_str(), nullptr, 10);
+        entry.file.fileId = strtoull(fields[4].c_str(), nullptr, 10);
+        entry.fingerprint = fields[5];
+        entry.digest.length = strtoull(fields[7].c_str(), nullptr, 10);
+        entry.digest.chunkSize = (uint32_t)strtoul(fields[8].c_str(), nullptr, 10);
+        entry.hashedTime = strtoll(fields[10].c_str(), nullptr, 10);
+        if (!HexToBytes(fields[6], 0, entry.digest.sha256, sizeof(entry.digest.sha256))) continue;
+
+        const std::string& chunks = fields[9];
+        size_t chunkHex = 2 * sizeof(ChunkDigest);
+        if (entry.digest.chunkSize == 0 || chunks.size() % chunkHex != 0 ||
+            chunks.size() / chunkHex != (entry.digest.length + entry.digest.chunkSize - 1) / entry.digest.chunkSize) {
+            continue;
+        }
+        entry.digest.chunks.resize(chunks.size() / chunkHex);
+        bool valid = true;
+        for (size_t i = 0; i < entry.digest.chunks.size() && valid; i++) {
+            valid = HexToBytes(chunks, i * chunkHex, entry.digest.chunks[i].data(), sizeof(ChunkDigest));
+        }
+        if (valid) m_entries.push_back(entry);
+    }
+}
+
+bool ImageHashCache::Save() {
+    std::ostringstream out;
+    out << "# Inferno image digests: path, size, mtime ns, volume, file id, fingerprint, sha256, "
+           "content bytes, chunk bytes, chunk sha256s, hashed at\n";
+    for (const ImageHashEntry& entry : m_entries) {
+        out << SanitizeField(entry.path) << '\t' << entry.file.size << '\t' << entry.file.modifiedTime << '\t'
+            << entry.file.volumeId << '\t' << entry.file.fileId << '\t' << entry.fingerprint << '\t'
+            << BytesToHex(entry.digest.sha256, sizeof(entry.digest.sha256)) << '\t' << entry.digest.length << '\t'
+            << entry.digest.chunkSize << '\t';
+        for (const ChunkDigest& chunk : entry.digest.chunks) {
+            out << BytesToHex(chunk.data(), chunk.size());
+        }
+        out << '\t' << entry.hashedTime << '\n';
+    }
+    if (!WriteFileAtomically(m_path, out.str())) {
+        return false;
+    }
+    // Our own write needs no reread.
+    GetFileIdentity(m_path, m_loadedIdentity);
+    return true;
+}
+
+bool ImageHashCache::Lookup(const std::wstring& imagePath, ImageDigest& digest) {
+    FileIdentity file;
+    if (!GetFileIdentity(imagePath, file)) {
+        return false;
+    }
+
+    ImageHashEntry candidate;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        LoadIfChanged();
+        // The same path first, then the same file under another name.
+        auto it = std::find_if(m_entries.begin(), m_entries.end(), [&](const ImageHashEntry& entry) {
+            return entry.path == imagePath && SameFile(entry.file, file);
+        });
+        if (it == m_entries.end()) {
+            it = std::find_if(m_entries.begin(), m_entries.end(),
+                              [&](const ImageHashEntry& entry) { return SameFile(entry.file, file); });
+        }
+        if (it == m_entries.end()) {
+            return false;
+        }
+        candidate = *it;
+    }
+
+    // Read outside the lock: other jobs may be looking up other images.
+    std::string fingerprint;
+    if (!ComputeFileFingerprint(imagePath, file.size, fingerprint) || fingerprint != candidate.fingerprint) {
+        LogMessage(LogLevel::Info, "hashcache", L"Stale digest for " + imagePath);
+        return false;
+    }
+    digest = candidate.digest;
+    return true;
+}
+
+bool ImageHashCache::Store(const std::wstring& imagePath, const FileIdentity& before, const ImageDigest& digest) {
+    ImageHashEntry entry;
+    entry.path = imagePath;
+    entry.digest = digest;
+    entry.hashedTime = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if (digest.chunkSize == 0 || !GetFileIdentity(imagePath, entry.file) || !SameFile(entry.file, before) ||
+        !ComputeFileFingerprint(imagePath, entry.file.size, entry.fingerprint)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    ScopedFileLock fileLock(m_path + L".lock");
+    if (!fileLock.IsLocked()) {
+        return false;
+    }
+    // Merge into what other processes have stored meanwhile.
+    LoadIfChanged();
+    m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(),
+                                   [&](const ImageHashEntry& old) {
+                                       return old.path == imagePath || (old.file.volumeId == entry.file.volumeId &&
+                                                                        old.file.fileId == entry.file.fileId);
+                                   }),
+                    m_entries.end());
+    m_entries.push_back(entry);
+    if (m_entries.size() > MAX_ENTRIES) {
+        std::sort(m_entries.begin(), m_entries.end(), [](const ImageHashEntry& a, const ImageHashEntry& b) {
+            return a.hashedTime > b.hashedTime;
+        });
+        m_entries.resize(MAX_ENTRIES);
+    }
+    return Save();
+}
+
+// ============================================================================
+// CACHED HASHING
+// ============================================================================
+
+bool GetImageDigest(const std::wstring& imagePath, ImageHashCache& cache, ImageDigest& digest,
+                    const ProgressCallback& progress, bool* fromCache, std::wstring& error, ReadPolicy policy) {
+    if (cache.Lookup(imagePath, digest)) {
+        if (fromCache) *fromCache = true;
+        return true;
+    }
+    if (fromCache) *fromCache = false;
+
+    FileIdentity before;
+    if (!GetFileIdentity(imagePath, before)) {
+        error = L"Cannot open " + imagePath + L".";
+        return false;
+    }
+    if (!HashImage(imagePath, IMAGE_DIGEST_CHUNK, digest, progress, error, policy)) {
+        return false;
+    }
+    if (!cache.Store(imagePath, before, digest)) {
+        LogMessage(LogLevel::Warning, "hashcache", L"Digest not cached for " + imagePath);
+    }
+    return true;
+}
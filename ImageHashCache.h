@@ -0,0 +1,71 @@
+// ============================================================================
+// INFERNO - Persistent image digest cache
+// ============================================================================
+
+#pragma once
+
+#include "ImageWriter.h"
+#include "Platform.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Chunk digests are kept at this granularity.
+static const uint32_t IMAGE_DIGEST_CHUNK = 4 * 1024 * 1024;
+
+struct ImageHashEntry {
+    std::wstring path;
+    FileIdentity file;
+    std::string fingerprint;    // hex SHA-256 of blocks sampled across the file
+    ImageDigest digest;
+    int64_t hashedTime = 0;     // seconds since the Unix epoch; the oldest entries go first
+};
+
+// Digests of image files already hashed, so a repeat job on an unchanged
+// image neither re-reads it for its checksum nor for verification. An entry
+// is used only while the file has the same size, modification time, volume
+// and file ID (so a replaced file misses even with a copied timestamp) and
+// the same sampled-content fingerprint (which catches in-place rewrites that
+// restore the timestamp). A file renamed on the same volume still hits.
+//
+// One tab-separated file serves every process: it is reread when another
+// process has replaced it, and updates merge into its current contents
+// under a lock file before being written back atomically.
+class ImageHashCache {
+public:
+    static const size_t MAX_ENTRIES = 64;
+
+    explicit ImageHashCache(const std::wstring& path);
+
+    // The shared cache in the Inferno data directory.
+    static ImageHashCache& Default();
+
+    bool Lookup(const std::wstring& imagePath, ImageDigest& digest);
+
+    // `before` is the file's identity from before it was hashed; the digest
+    // is not stored if the file has changed since.
+    bool Store(const std::wstring& imagePath, const FileIdentity& before, const ImageDigest& digest);
+
+private:
+    void LoadIfChanged();
+    bool Save();
+
+    std::mutex m_lock;
+    std::wstring m_path;
+    FileIdentity m_loadedIdentity;
+    bool m_loaded = false;
+    std::vector<ImageHashEntry> m_entries;
+};
+
+// SHA-256 of the file size and of 16 blocks of 64 KiB spread evenly over the
+// raw file, first and last included.
+bool ComputeFileFingerprint(const std::wstring& path, uint64_t size, std::string& fingerprint);
+
+// The digest of `imagePath` from `cache` if it holds one for this exact
+// file; otherwise the image is hashed with chunk digests and the result
+// stored. `fromCache` tells which happened.
+bool GetImageDigest(const std::wstring& imagePath, ImageHashCache& cache, ImageDigest& digest,
+                    const ProgressCallback& progress, bool* fromCache, std::wstring& error,
+                    ReadPolicy policy = ReadPolicy::Buffered);
@@ -0,0 +1,1112 @@
+// ============================================================================
+// INFERNO - Image library index and folder watcher
+// ============================================================================
+
+#include "ImageLibrary.h"
+#include "Checksum.h"
+#include "DriverCatalog.h"
+#include "ImageHashCache.h"
+#include "ImageSource.h"
+#include "IsoHybrid.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cwctype>
+#include <map>
+#include <set>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#endif
+
+#ifdef _WIN32
+static const wchar_t PATH_SEPARATOR = L'\\';
+#else
+static const wchar_t PATH_SEPARATOR = L'/';
+#endif
+
+static const wchar_t* const IMAGE_EXTENSIONS[] = {L".iso", L".img", L".img.gz", L".wim", L".esd", L".vhd", L".vhdx"};
+
+// Bounds on what a damaged or hostile image can make us read.
+static const uint32_t ISO_FIRST_DESCRIPTOR = 16;
+static const uint32_t ISO_MAX_DESCRIPTORS = 32;
+static const uint32_t MAX_DIRECTORY_BYTES = 1024 * 1024;
+static const uint64_t MAX_WIM_XML_BYTES = 4 * 1024 * 1024;
+
+// Images on a share are mostly waiting on the network, so several are read
+// at once even on few cores.
+static const size_t MIN_READ_THREADS = 8;
+
+static const uint8_t DESCRIPTOR_PRIMARY = 1;
+static const uint8_t DESCRIPTOR_SUPPLEMENTARY = 2;
+static const uint8_t DESCRIPTOR_TERMINATOR = 255;
+
+// Sleep granularity of the watcher thread, and the folder scan interval
+// where there are no change notifications.
+static const int WATCH_TICK_MILLISECONDS = 200;
+static const double POLL_SECONDS = 60.0;
+
+static uint16_t ReadLe16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t ReadLe32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t ReadLe64(const uint8_t* p) {
+    return (uint64_t)ReadLe32(p) | ((uint64_t)ReadLe32(p + 4) << 32);
+}
+
+static std::wstring ToLower(std::wstring text) {
+    for (wchar_t& c : text) c = (wchar_t)towlower(c);
+    return text;
+}
+
+static std::wstring Trim(const std::wstring& text) {
+    size_t begin = 0, end = text.size();
+    while (begin < end && iswspace(text[begin])) begin++;
+    while (end > begin && iswspace(text[end - 1])) end--;
+    return text.substr(begin, end - begin);
+}
+
+static std::wstring NormalizeRoot(std::wstring root) {
+    while (root.size() > 1 && (root.back() == L'/' || root.back() == L'\\')) root.pop_back();
+    return root;
+}
+
+static bool IsUnder(const std::wstring& path, const std::wstring& root) {
+    return path.size() > root.size() && path.compare(0, root.size(), root) == 0 &&
+           (path[root.size()] == PATH_SEPARATOR || root.back() == PATH_SEPARATOR);
+}
+
+static std::wstring FileName(const std::wstring& path) {
+    size_t slash = path.find_last_of(L"/\\");
+    return slash == std::wstring::npos ? path : path.substr(slash + 1);
+}
+
+static bool EndsWith(const std::wstring& text, const std::wstring& suffix) {
+    return text.size() > suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+const wchar_t* ImageFormatName(ImageFormat format) {
+    switch (format) {
+    case ImageFormat::Iso9660: return L"ISO9660";
+    case ImageFormat::DiskImage: return L"Disk image";
+    case ImageFormat::WindowsImage: return L"Windows image";
+    case ImageFormat::VirtualDisk: return L"Virtual disk";
+    default: return L"Unknown";
+    }
+}
+
+const wchar_t* ImageOsName(ImageOs os) {
+    switch (os) {
+    case ImageOs::Windows: return L"Windows";
+    case ImageOs::Linux: return L"Linux";
+    default: return L"Unknown";
+    }
+}
+
+std::wstring DescribeArchitectures(uint32_t architectures) {
+    static const std::pair<uint32_t, const wchar_t*> names[] = {
+        {DRIVER_ARCH_X64, L"x64"}, {DRIVER_ARCH_X86, L"x86"}, {DRIVER_ARCH_ARM64, L"arm64"},
+        {DRIVER_ARCH_ARM, L"arm"}, {DRIVER_ARCH_IA64, L"ia64"}};
+    std::wstring text;
+    for (const auto& name : names) {
+        if (!(architectures & name.first)) continue;
+        if (!text.empty()) text += L'/';
+        text += name.second;
+    }
+    return text;
+}
+
+bool IsLibraryImageName(const std::wstring& path) {
+    std::wstring name = ToLower(FileName(path));
+    return std::any_of(std::begin(IMAGE_EXTENSIONS), std::end(IMAGE_EXTENSIONS),
+                       [&](const wchar_t* extension) { return EndsWith(name, extension); });
+}
+
+// ============================================================================
+// ISO9660
+// ============================================================================
+
+struct IsoDirectoryEntry {
+    std::wstring name;          // lower case, without the ";1" version
+    uint32_t sector = 0;
+    uint32_t bytes = 0;
+    bool directory = false;
+};
+
+// Looks up paths in one directory tree (the primary one or Joliet's),
+// reading each directory once.
+class IsoTree {
+public:
+    IsoTree(ImageReader& reader, uint32_t rootSector, uint32_t rootBytes, bool joliet)
+        : m_reader(reader), m_rootSector(rootSector), m_rootBytes(rootBytes), m_joliet(joliet) {}
+
+    // `path` is lower case with '/' separators.
+    bool Exists(const std::wstring& path) {
+        uint32_t sector = m_rootSector, bytes = m_rootBytes;
+        size_t position = 0;
+        while (position < path.size()) {
+            size_t slash = path.find(L'/', position);
+            if (slash == std::wstring::npos) slash = path.size();
+            std::wstring part = path.substr(position, slash - position);
+            position = slash + 1;
+
+            const std::vector<IsoDirectoryEntry>& entries = List(sector, bytes);
+            auto it = std::find_if(entries.begin(), entries.end(),
+                                   [&](const IsoDirectoryEntry& entry) { return entry.name == part; });
+            if (it == entries.end()) return false;
+            if (position < path.size() && !it->directory) return false;
+            sector = it->sector;
+            bytes = it->bytes;
+        }
+        return true;
+    }
+
+private:
+    const std::vector<IsoDirectoryEntry>& List(uint32_t sector, uint32_t bytes) {
+        auto cached = m_directories.find(sector);
+        if (cached != m_directories.end()) return cached->second;
+        std::vector<IsoDirectoryEntry>& entries = m_directories[sector];
+
+        std::vector<uint8_t> extent(std::min(bytes, MAX_DIRECTORY_BYTES));
+        std::wstring error;
+        if (extent.empty() ||
+            !m_reader.ReadAt((uint64_t)sector * ISO_SECTOR_SIZE, extent.data(), extent.size(), error)) {
+            return entries;
+        }
+        // Records never span sectors; a zero length pads to the next one.
+        size_t position = 0;
+        while (position + 34 <= extent.size()) {
+            uint8_t length = extent[position];
+            if (length == 0) {
+                position = (position / ISO_SECTOR_SIZE + 1) * ISO_SECTOR_SIZE;
+                continue;
+            }
+            if (length < 34 || position + length > extent.size()) break;
+            const uint8_t* record = extent.data() + position;
+            position += length;
+            uint8_t nameLength = record[32];
+            if (33u + nameLength > length || (nameLength == 1 && record[33] <= 1)) continue;
+
+            IsoDirectoryEntry entry;
+            const uint8_t* name = record + 33;
+            if (m_joliet) {
+                for (uint8_t i = 0; i + 1 < nameLength; i += 2) {
+                    entry.name.push_back((wchar_t)((name[i] << 8) | name[i + 1]));
+                }
+            } else {
+                entry.name.assign(name, name + nameLength);
+            }
+            size_t version = entry.name.find(L';');
+            if (version != std::wstring::npos) entry.name.resize(version);
+            if (!entry.name.empty() && entry.name.back() == L'.') entry.name.pop_back();
+            entry.name = ToLower(entry.name);
+            entry.sector = ReadLe32(record + 2);
+            entry.bytes = ReadLe32(record + 10);
+            entry.directory = (record[25] & 0x02) != 0;
+            entries.push_back(entry);
+        }
+        return entries;
+    }
+
+    ImageReader& m_reader;
+    uint32_t m_rootSector;
+    uint32_t m_rootBytes;
+    bool m_joliet;
+    std::map<uint32_t, std::vector<IsoDirectoryEntry>> m_directories;
+};
+
+// Files whose presence tells what an image installs or runs, most specific
+// first within each system.
+static const wchar_t* const WINDOWS_MARKERS[] = {L"sources/install.wim", L"sources/install.esd",
+                                                 L"sources/install.swm", L"sources/boot.wim", L"bootmgr"};
+static const wchar_t* const LINUX_MARKERS[] = {L"casper", L"live", L"liveos", L"isolinux", L"syslinux",
+                                               L"boot/grub", L"boot/grub2", L"images/pxeboot", L"arch",
+                                               L"install.amd", L".disk", L"boot/x86_64/loader"};
+static const std::pair<const wchar_t*, uint32_t> EFI_LOADERS[] = {
+    {L"efi/boot/bootx64.efi", DRIVER_ARCH_X64}, {L"efi/boot/bootia32.efi", DRIVER_ARCH_X86},
+    {L"efi/boot/bootaa64.efi", DRIVER_ARCH_ARM64}, {L"efi/boot/bootarm.efi", DRIVER_ARCH_ARM}};
+
+// Descriptor text fields are d-characters (or UCS-2 big-endian for Joliet)
+// padded with spaces.
+static std::wstring DescriptorText(const uint8_t* field, size_t bytes, bool joliet) {
+    std::wstring text;
+    if (joliet) {
+        for (size_t i = 0; i + 1 < bytes; i += 2) text.push_back((wchar_t)((field[i] << 8) | field[i + 1]));
+    } else {
+        text.assign(field, field + bytes);
+    }
+    return Trim(text);
+}
+
+static bool IsJolietDescriptor(const uint8_t* descriptor) {
+    return descriptor[88] == '%' && descriptor[89] == '/' &&
+           (descriptor[90] == '@' || descriptor[90] == 'C' || descriptor[90] == 'E');
+}
+
+static void ReadIsoInfo(ImageReader& reader, bool sequential, ImageInfo& info) {
+    info.format = ImageFormat::Iso9660;
+    uint32_t rootSector = 0, rootBytes = 0;
+    bool joliet = false;
+    std::wstring error;
+    for (uint32_t index = 0; index < ISO_MAX_DESCRIPTORS; index++) {
+        uint8_t descriptor[ISO_SECTOR_SIZE];
+        uint64_t offset = (uint64_t)(ISO_FIRST_DESCRIPTOR + index) * ISO_SECTOR_SIZE;
+        if (!reader.ReadAt(offset, descriptor, sizeof(descriptor), error) || memcmp(descriptor + 1, "CD001", 5) != 0 ||
+            descriptor[0] == DESCRIPTOR_TERMINATOR) {
+            break;
+        }
+        // Joliet keeps the long names and the label's lower case letters.
+        bool isJoliet = descriptor[0] == DESCRIPTOR_SUPPLEMENTARY && IsJolietDescriptor(descriptor);
+        if (!(descriptor[0] == DESCRIPTOR_PRIMARY && rootSector == 0) && !isJoliet) {
+            continue;
+        }
+        // Joliet labels hold 16 characters to the primary's 32, so one that
+        // is only the primary's cut short is not taken.
+        std::wstring label = DescriptorText(descriptor + 40, 32, isJoliet);
+        if (!label.empty() && (info.label.empty() || (isJoliet && ToLower(info.label).find(ToLower(label)) != 0))) {
+            info.label = label;
+        }
+        if (!joliet) {
+            rootSector = ReadLe32(descriptor + 156 + 2);
+            rootBytes = ReadLe32(descriptor + 156 + 10);
+            joliet = isJoliet;
+        }
+    }
+    // A compressed image would be decompressed up to each directory read.
+    if (sequential || rootSector == 0) {
+        return;
+    }
+
+    IsoTree tree(reader, rootSector, rootBytes, joliet);
+    if (std::any_of(std::begin(WINDOWS_MARKERS), std::end(WINDOWS_MARKERS),
+                    [&](const wchar_t* marker) { return tree.Exists(marker); })) {
+        info.os = ImageOs::Windows;
+    } else if (std::any_of(std::begin(LINUX_MARKERS), std::end(LINUX_MARKERS),
+                           [&](const wchar_t* marker) { return tree.Exists(marker); })) {
+        info.os = ImageOs::Linux;
+    }
+    for (const auto& loader : EFI_LOADERS) {
+        if (tree.Exists(loader.first)) info.architectures |= loader.second;
+    }
+    if (info.architectures) {
+        info.boot |= IMAGE_BOOT_UEFI;
+    }
+
+    IsoBootInfo boot;
+    if (ReadIsoBootInfo(info.path, boot, error)) {
+        if (boot.hasBiosImage) info.boot |= IMAGE_BOOT_BIOS;
+        if (boot.hasEfiImage) info.boot |= IMAGE_BOOT_UEFI;
+        if (boot.alreadyHybrid) info.boot |= IMAGE_BOOT_RAW;
+    }
+}
+
+// ============================================================================
+// DISKS AND WINDOWS IMAGES
+// ============================================================================
+
+static void ReadDiskInfo(const uint8_t* head, size_t headBytes, ImageInfo& info) {
+    info.format = ImageFormat::DiskImage;
+    info.boot |= IMAGE_BOOT_RAW;
+    bool bootCode = std::any_of(head, head + 440, [](uint8_t byte) { return byte != 0; });
+    bool gpt = headBytes >= 1024 && memcmp(head + 512, "EFI PART", 8) == 0;
+    for (int i = 0; i < 4; i++) {
+        uint8_t type = head[446 + i * 16 + 4];
+        if (type == 0xEE) gpt = true;
+        if (type == 0xEF) info.boot |= IMAGE_BOOT_UEFI;
+    }
+    if (gpt) info.boot |= IMAGE_BOOT_UEFI;
+    if (bootCode) info.boot |= IMAGE_BOOT_BIOS;
+}
+
+// The value of the first <tag> in UTF-16LE XML, or empty.
+static std::wstring XmlValue(const std::wstring& xml, const std::wstring& tag) {
+    size_t start = xml.find(L"<" + tag + L">");
+    if (start == std::wstring::npos) return std::wstring();
+    start += tag.size() + 2;
+    size_t end = xml.find(L"</" + tag + L">", start);
+    return end == std::wstring::npos ? std::wstring() : Trim(xml.substr(start, end - start));
+}
+
+// WIM and ESD files describe their images in an uncompressed XML resource
+// named by the header.
+static void ReadWimInfo(ImageReader& reader, const uint8_t* head, ImageInfo& info) {
+    info.format = ImageFormat::WindowsImage;
+    info.os = ImageOs::Windows;
+    uint64_t xmlBytes = ReadLe64(head + 72) & 0x00FFFFFFFFFFFFFFull;
+    uint64_t xmlOffset = ReadLe64(head + 80);
+    if (xmlBytes < 2 || xmlBytes > MAX_WIM_XML_BYTES) return;
+
+    std::vector<uint8_t> data((size_t)xmlBytes);
+    std::wstring error;
+    if (!reader.ReadAt(xmlOffset, data.data(), data.size(), error)) return;
+    std::wstring xml;
+    xml.reserve(data.size() / 2);
+    for (size_t i = 0; i + 1 < data.size(); i += 2) xml.push_back((wchar_t)ReadLe16(&data[i]));
+
+    std::wstring name = XmlValue(xml, L"DISPLAYNAME");
+    info.label = name.empty() ? XmlValue(xml, L"NAME") : name;
+    // Every image in the file, by PROCESSOR_ARCHITECTURE value.
+    for (size_t position = xml.find(L"<ARCH>"); position != std::wstring::npos;
+         position = xml.find(L"<ARCH>", position + 1)) {
+        switch (wcstol(xml.c_str() + position + 6, nullptr, 10)) {
+        case 0: info.architectures |= DRIVER_ARCH_X86; break;
+        case 5: info.architectures |= DRIVER_ARCH_ARM; break;
+        case 6: info.architectures |= DRIVER_ARCH_IA64; break;
+        case 9: info.architectures |= DRIVER_ARCH_X64; break;
+        case 12: info.architectures |= DRIVER_ARCH_ARM64; break;
+        }
+    }
+}
+
+// Names in the label or file name, for what the contents did not settle.
+static void GuessFromNames(ImageInfo& info) {
+    std::wstring names = ToLower(info.label + L" " + FileName(info.path));
+    auto contains = [&](const wchar_t* word) { return names.find(word) != std::wstring::npos; };
+    if (info.os == ImageOs::Unknown) {
+        static const wchar_t* const windows[] = {L"windows", L"win10", L"win11", L"winpe", L"ccsa", L"ccco"};
+        static const wchar_t* const linux[] = {L"linux", L"ubuntu", L"debian", L"fedora", L"mint", L"kali",
+                                               L"centos", L"rocky", L"alma", L"opensuse", L"manjaro", L"raspios"};
+        if (std::any_of(std::begin(windows), std::end(windows), contains)) info.os = ImageOs::Windows;
+        else if (std::any_of(std::begin(linux), std::end(linux), contains)) info.os = ImageOs::Linux;
+    }
+    if (info.architectures == 0) {
+        if (contains(L"x64") || contains(L"amd64") || contains(L"x86_64")) info.architectures |= DRIVER_ARCH_X64;
+        if (contains(L"arm64") || contains(L"aarch64")) info.architectures |= DRIVER_ARCH_ARM64;
+        if (contains(L"i386") || contains(L"i686") || (contains(L"x86") && !contains(L"x86_64"))) {
+            info.architectures |= DRIVER_ARCH_X86;
+        }
+    }
+}
+
+bool ReadImageInfo(const std::wstring& path, ImageInfo& info, std::wstring& error) {
+    info = ImageInfo();
+    info.path = path;
+    FileIdentity file;
+    if (!GetFileIdentity(path, file)) {
+        error = L"Cannot open " + path + L".";
+        return false;
+    }
+    info.size = file.size;
+    info.modifiedTime = file.modifiedTime;
+    {
+        std::unique_ptr<ImageSource> source = OpenImageSource(path, error);
+        if (!source) return false;
+        info.compressed = source->IsSequential();
+    }
+
+    ImageReader reader(path);
+    uint8_t head[4096] = {};
+    size_t headBytes = info.compressed ? sizeof(head) : (size_t)std::min<uint64_t>(file.size, sizeof(head));
+    if (!reader.ReadAt(0, head, headBytes, error)) {
+        headBytes = 512;
+        if (!info.compressed || !reader.ReadAt(0, head, headBytes, error)) return false;
+    }
+    uint8_t descriptor[8];
+    std::wstring ignored;
+    if (memcmp(head, "MSWIM\0\0\0", 8) == 0) {
+        ReadWimInfo(reader, head, info);
+    } else if (memcmp(head, "conectix", 8) == 0 || memcmp(head, "vhdxfile", 8) == 0) {
+        info.format = ImageFormat::VirtualDisk;
+    } else if (reader.ReadAt((uint64_t)ISO_FIRST_DESCRIPTOR * ISO_SECTOR_SIZE, descriptor, sizeof(descriptor),
+                             ignored) &&
+               memcmp(descriptor + 1, "CD001", 5) == 0) {
+        ReadIsoInfo(reader, info.compressed, info);
+    } else if (head[510] == 0x55 && head[511] == 0xAA) {
+        ReadDiskInfo(head, headBytes, info);
+        // A fixed VHD is a raw disk with a footer.
+        if (EndsWith(ToLower(path), L".vhd")) {
+            info.format = ImageFormat::VirtualDisk;
+        }
+    }
+    GuessFromNames(info);
+
+    ImageDigest digest;
+    if (ImageHashCache::Default().Lookup(path, digest)) {
+        info.sha256 = WideToUtf8(DigestToHex(digest.sha256, sizeof(digest.sha256)));
+    }
+    return true;
+}
+
+// ============================================================================
+// INDEX FORMAT
+// ============================================================================
+
+// The index is a header, `count` fixed-size entries sorted by UTF-8 path and
+// a table of the entries' UTF-8 strings, all stored as laid out on the
+// little-endian hosts Inferno runs on.
+static const char INDEX_MAGIC[8] = {'I', 'N', 'F', 'L', 'I', 'B', '\r', '\n'};
+static const uint32_t INDEX_VERSION = 1;
+
+static const uint8_t ENTRY_COMPRESSED = 1 << 0;
+static const uint8_t ENTRY_SHA256 = 1 << 1;
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t entrySize;
+    uint32_t reserved;
+    uint64_t stringBytes;
+};
+
+struct IndexEntry {
+    uint32_t pathOffset;        // into the string table
+    uint32_t pathLength;
+    uint32_t labelOffset;
+    uint32_t labelLength;
+    uint32_t keyOffset;         // lower-case search text
+    uint32_t keyLength;
+    uint64_t size;
+    int64_t modifiedTime;
+    uint8_t format;
+    uint8_t os;
+    uint8_t flags;              // ENTRY_*
+    uint8_t reserved;
+    uint32_t architectures;
+    uint32_t boot;
+    uint32_t reserved2;
+    uint8_t sha256[32];
+};
+
+static_assert(sizeof(IndexHeader) == 32, "index header layout");
+static_assert(sizeof(IndexEntry) == 88, "index entry layout");
+
+static const IndexEntry* GetEntries(const MappedFile& file) {
+    return (const IndexEntry*)(file.GetData() + sizeof(IndexHeader));
+}
+
+static const char* GetStrings(const MappedFile& file) {
+    const IndexHeader* header = (const IndexHeader*)file.GetData();
+    return (const char*)(file.GetData() + sizeof(IndexHeader) + (uint64_t)header->count * sizeof(IndexEntry));
+}
+
+// Checks everything later reads trust, once per mapping.
+static bool IsValidIndex(const MappedFile& file) {
+    if (file.GetSize() < sizeof(IndexHeader)) return false;
+    const IndexHeader* header = (const IndexHeader*)file.GetData();
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header->version != INDEX_VERSION ||
+        header->entrySize != sizeof(IndexEntry)) {
+        return false;
+    }
+    uint64_t tableStart = sizeof(IndexHeader) + (uint64_t)header->count * sizeof(IndexEntry);
+    if (tableStart > file.GetSize() || header->stringBytes > file.GetSize() - tableStart) return false;
+    const IndexEntry* entries = GetEntries(file);
+    auto inTable = [&](uint32_t offset, uint32_t length) {
+        return (uint64_t)offset + length <= header->stringBytes;
+    };
+    for (uint32_t i = 0; i < header->count; i++) {
+        const IndexEntry& entry = entries[i];
+        if (!inTable(entry.pathOffset, entry.pathLength) || !inTable(entry.labelOffset, entry.labelLength) ||
+            !inTable(entry.keyOffset, entry.keyLength)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::string HexToBytes(const std::string& hex) {
+    std::string bytes;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        bytes.push_back((char)strtoul(hex.substr(i, 2).c_str(), nullptr, 16));
+    }
+    return bytes;
+}
+
+static ImageInfo DecodeEntry(const IndexEntry& entry, const char* strings) {
+    ImageInfo info;
+    info.path = Utf8ToWide(std::string(strings + entry.pathOffset, entry.pathLength));
+    info.label = Utf8ToWide(std::string(strings + entry.labelOffset, entry.labelLength));
+    info.size = entry.size;
+    info.modifiedTime = entry.modifiedTime;
+    info.format = (ImageFormat)entry.format;
+    info.os = (ImageOs)entry.os;
+    info.compressed = (entry.flags & ENTRY_COMPRESSED) != 0;
+    info.architectures = entry.architectures;
+    info.boot = entry.boot;
+    if (entry.flags & ENTRY_SHA256) {
+        info.sha256 = WideToUtf8(DigestToHex(entry.sha256, sizeof(entry.sha256)));
+    }
+    return info;
+}
+
+// Everything a search matches against, one field per line.
+static std::string SearchKey(const ImageInfo& info) {
+    std::wstring key = info.path + L"\n" + info.label + L"\n" + ImageOsName(info.os) + L"\n" +
+                       DescribeArchitectures(info.architectures) + L"\n" + ImageFormatName(info.format);
+    if (info.boot & IMAGE_BOOT_BIOS) key += L" bios";
+    if (info.boot & IMAGE_BOOT_UEFI) key += L" uefi";
+    if (info.boot & IMAGE_BOOT_RAW) key += L" hybrid";
+    return WideToUtf8(ToLower(key));
+}
+
+static std::string EncodeIndex(const std::vector<ImageInfo>& images) {
+    std::vector<std::pair<std::string, const ImageInfo*>> sorted;
+    for (const ImageInfo& info : images) sorted.push_back({WideToUtf8(info.path), &info});
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<std::string, const ImageInfo*>& a, const std::pair<std::string, const ImageInfo*>& b) {
+                  return a.first < b.first;
+              });
+
+    std::vector<IndexEntry> entries(sorted.size());
+    std::string strings;
+    auto addString = [&](const std::string& text, uint32_t& offset, uint32_t& length) {
+        offset = (uint32_t)strings.size();
+        length = (uint32_t)text.size();
+        strings += text;
+    };
+    for (size_t i = 0; i < sorted.size(); i++) {
+        const ImageInfo& info = *sorted[i].second;
+        IndexEntry& entry = entries[i];
+        memset(&entry, 0, sizeof(entry));
+        addString(sorted[i].first, entry.pathOffset, entry.pathLength);
+        addString(WideToUtf8(info.label), entry.labelOffset, entry.labelLength);
+        addString(SearchKey(info), entry.keyOffset, entry.keyLength);
+        entry.size = info.size;
+        entry.modifiedTime = info.modifiedTime;
+        entry.format = (uint8_t)info.format;
+        entry.os = (uint8_t)info.os;
+        entry.architectures = info.architectures;
+        entry.boot = info.boot;
+        if (info.compressed) entry.flags |= ENTRY_COMPRESSED;
+        std::string sha256 = HexToBytes(info.sha256);
+        if (sha256.size() == sizeof(entry.sha256)) {
+            memcpy(entry.sha256, sha256.data(), sha256.size());
+            entry.flags |= ENTRY_SHA256;
+        }
+    }
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.count = (uint32_t)entries.size();
+    header.entrySize = sizeof(IndexEntry);
+    header.stringBytes = strings.size();
+
+    std::string contents((const char*)&header, sizeof(header));
+    contents.append((const char*)entries.data(), entries.size() * sizeof(IndexEntry));
+    contents += strings;
+    return contents;
+}
+
+// ============================================================================
+// LIBRARY
+// ============================================================================
+
+ImageLibrary::ImageLibrary(const std::wstring& path) : m_path(path) {
+}
+
+ImageLibrary& ImageLibrary::Default() {
+#ifdef _WIN32
+    static ImageLibrary library(GetInfernoDataDirectory() + L"\\image_library.idx");
+#else
+    static ImageLibrary library(GetInfernoDataDirectory() + L"/image_library.idx");
+#endif
+    return library;
+}
+
+static bool SameFile(const FileIdentity& a, const FileIdentity& b) {
+    return a.size == b.size && a.modifiedTime == b.modifiedTime && a.volumeId == b.volumeId && a.fileId == b.fileId;
+}
+
+// Maps the index again if another process (or this one) replaced it. Called
+// with m_lock held.
+bool ImageLibrary::MapIfChanged() {
+    FileIdentity current;
+    if (!GetFileIdentity(m_path, current)) {
+        m_file.Close();
+        m_count = 0;
+        return false;
+    }
+    if (m_file.GetData() && SameFile(current, m_mappedIdentity)) {
+        return true;
+    }
+    m_mappedIdentity = current;
+    m_count = 0;
+    if (!m_file.Open(m_path)) {
+        return false;
+    }
+    if (!IsValidIndex(m_file)) {
+        LogMessage(LogLevel::Warning, "library", L"Ignoring damaged image library index " + m_path + L".");
+        m_file.Close();
+        return false;
+    }
+    m_count = ((const IndexHeader*)m_file.GetData())->count;
+    return true;
+}
+
+bool ImageLibrary::Open() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return MapIfChanged();
+}
+
+size_t ImageLibrary::GetCount() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    MapIfChanged();
+    return m_count;
+}
+
+// Called with m_lock held.
+std::vector<ImageInfo> ImageLibrary::ReadAll() {
+    std::vector<ImageInfo> images;
+    images.reserve(m_count);
+    const IndexEntry* entries = GetEntries(m_file);
+    const char* strings = GetStrings(m_file);
+    for (size_t i = 0; i < m_count; i++) {
+        images.push_back(DecodeEntry(entries[i], strings));
+    }
+    return images;
+}
+
+bool ImageLibrary::Find(const std::wstring& path, ImageInfo& info) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (!MapIfChanged()) return false;
+    std::string key = WideToUtf8(path);
+    const IndexEntry* entries = GetEntries(m_file);
+    const char* strings = GetStrings(m_file);
+    const IndexEntry* found = std::lower_bound(entries, entries + m_count, key,
+                                               [&](const IndexEntry& entry, const std::string& value) {
+                                                   return std::string(strings + entry.pathOffset, entry.pathLength) <
+                                                          value;
+                                               });
+    if (found == entries + m_count || std::string(strings + found->pathOffset, found->pathLength) != key) {
+        return false;
+    }
+    info = DecodeEntry(*found, strings);
+    return true;
+}
+
+std::vector<ImageInfo> ImageLibrary::Search(const std::wstring& root, const std::wstring& query, size_t limit) {
+    std::vector<std::string> words;
+    std::string lower = WideToUtf8(ToLower(query));
+    size_t position = 0;
+    while (position < lower.size()) {
+        size_t end = lower.find_first_of(" \t", position);
+        if (end == std::string::npos) end = lower.size();
+        if (end > position) words.push_back(lower.substr(position, end - position));
+        position = end + 1;
+    }
+    std::string base = WideToUtf8(NormalizeRoot(root));
+    char separator = (char)PATH_SEPARATOR;
+
+    std::vector<ImageInfo> found;
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (!MapIfChanged()) return found;
+    const IndexEntry* entries = GetEntries(m_file);
+    const char* strings = GetStrings(m_file);
+    for (size_t i = 0; i < m_count && found.size() < limit; i++) {
+        const IndexEntry& entry = entries[i];
+        const char* path = strings + entry.pathOffset;
+        if (!base.empty() && !(entry.pathLength > base.size() && memcmp(path, base.data(), base.size()) == 0 &&
+                               (path[base.size()] == separator || base.back() == separator))) {
+            continue;
+        }
+        const char* key = strings + entry.keyOffset;
+        const char* keyEnd = key + entry.keyLength;
+        bool matches = std::all_of(words.begin(), words.end(), [&](const std::string& word) {
+            return std::search(key, keyEnd, word.begin(), word.end()) != keyEnd;
+        });
+        if (matches) found.push_back(DecodeEntry(entry, strings));
+    }
+    return found;
+}
+
+// Reads the images among `files` that are new or changed since the index
+// last saw them, then replaces every entry `replaced` accepts with the result.
+bool ImageLibrary::Index(const std::vector<FileInfo>& files, bool hashImages,
+                         const std::function<bool(const std::wstring&)>& replaced, LibraryIndexStats& counts,
+                         std::wstring& error) {
+    auto started = std::chrono::steady_clock::now();
+    counts.images = files.size();
+    std::vector<ImageInfo> images(files.size());
+    std::vector<size_t> pending;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        MapIfChanged();
+        const IndexEntry* entries = m_file.GetData() ? GetEntries(m_file) : nullptr;
+        const char* strings = m_file.GetData() ? GetStrings(m_file) : nullptr;
+        for (size_t i = 0; i < files.size(); i++) {
+            std::string key = WideToUtf8(files[i].path);
+            const IndexEntry* found = std::lower_bound(
+                entries, entries + m_count, key, [&](const IndexEntry& entry, const std::string& value) {
+                    return std::string(strings + entry.pathOffset, entry.pathLength) < value;
+                });
+            if (found != entries + m_count && std::string(strings + found->pathOffset, found->pathLength) == key &&
+                found->size == files[i].size && found->modifiedTime == files[i].modifiedTime &&
+                !(hashImages && !(found->flags & ENTRY_SHA256))) {
+                images[i] = DecodeEntry(*found, strings);
+                counts.reused++;
+                continue;
+            }
+            pending.push_back(i);
+        }
+    }
+
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> readCount{0}, failedCount{0};
+    std::vector<uint8_t> readable(files.size(), 1);
+    auto worker = [&]() {
+        for (size_t n = next++; n < pending.size(); n = next++) {
+            size_t i = pending[n];
+            std::wstring readError;
+            if (!ReadImageInfo(files[i].path, images[i], readError)) {
+                LogMessage(LogLevel::Debug, "library", readError);
+                readable[i] = 0;
+                failedCount++;
+                continue;
+            }
+            if (hashImages && images[i].sha256.empty()) {
+                ImageDigest digest;
+                if (GetImageDigest(files[i].path, ImageHashCache::Default(), digest, ProgressCallback(), nullptr,
+                                   readError)) {
+                    images[i].sha256 = WideToUtf8(DigestToHex(digest.sha256, sizeof(digest.sha256)));
+                } else {
+                    LogMessage(LogLevel::Debug, "library", readError);
+                }
+            }
+            readCount++;
+        }
+    };
+    size_t threads = std::max<size_t>(MIN_READ_THREADS, std::thread::hardware_concurrency());
+    size_t threadCount = std::min<size_t>(pending.size(), threads);
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threadCount; t++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+
+    std::vector<ImageInfo> updated;
+    std::set<std::wstring> current;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!readable[i]) continue;
+        current.insert(images[i].path);
+        updated.push_back(std::move(images[i]));
+    }
+
+    ScopedFileLock fileLock(m_path + L".lock");
+    std::lock_guard<std::mutex> guard(m_lock);
+    // Merge into what other processes saved in the meantime.
+    MapIfChanged();
+    for (ImageInfo& info : ReadAll()) {
+        if (!replaced(info.path)) {
+            if (!current.count(info.path)) updated.push_back(std::move(info));
+        } else if (!current.count(info.path)) {
+            counts.removed++;
+        }
+    }
+    std::string contents = EncodeIndex(updated);
+    // A mapped file cannot be replaced on Windows.
+    m_file.Close();
+    bool saved = WriteFileAtomically(m_path, contents);
+    MapIfChanged();
+
+    counts.read = readCount;
+    counts.failed = failedCount;
+    counts.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    LogEvent(LogLevel::Info, "library", "index",
+             {{"images", (int64_t)counts.images}, {"reused", (int64_t)counts.reused},
+              {"read", (int64_t)counts.read}, {"ms", (int64_t)(counts.seconds * 1000)}});
+    if (!saved) {
+        error = L"Cannot save the image library index " + m_path + L".";
+        return false;
+    }
+    return true;
+}
+
+bool ImageLibrary::Update(const std::wstring& root, LibraryIndexStats* stats, std::wstring& error, bool hashImages) {
+    std::wstring base = NormalizeRoot(root);
+    std::vector<FileInfo> listed;
+    if (!ListFiles(base, L"", listed, error)) {
+        return false;
+    }
+    std::vector<FileInfo> files;
+    for (FileInfo& file : listed) {
+        if (IsLibraryImageName(file.path)) files.push_back(std::move(file));
+    }
+
+    LibraryIndexStats counts;
+    bool ok = Index(files, hashImages, [&](const std::wstring& path) { return IsUnder(path, base); }, counts, error);
+    if (stats) {
+        *stats = counts;
+    }
+    return ok;
+}
+
+bool ImageLibrary::Refresh(const std::vector<std::wstring>& paths, LibraryIndexStats* stats, std::wstring& error) {
+    std::vector<std::wstring> bases;
+    std::vector<FileInfo> files;
+    for (const std::wstring& path : paths) {
+        std::wstring base = NormalizeRoot(path);
+        if (std::find(bases.begin(), bases.end(), base) != bases.end()) continue;
+        bases.push_back(base);
+
+        std::wstring ignored;
+        std::vector<FileInfo> listed;
+        if (ListFiles(base, L"", listed, ignored)) {
+            // A folder created, or moved in.
+            for (FileInfo& file : listed) {
+                if (IsLibraryImageName(file.path)) files.push_back(std::move(file));
+            }
+            continue;
+        }
+        FileIdentity identity;
+        if (IsLibraryImageName(base) && GetFileIdentity(base, identity)) {
+            FileInfo file;
+            file.path = base;
+            file.size = identity.size;
+            file.modifiedTime = identity.modifiedTime;
+            files.push_back(file);
+        }
+    }
+    // One path may be listed both as a file and below a folder.
+    std::sort(files.begin(), files.end(), [](const FileInfo& a, const FileInfo& b) { return a.path < b.path; });
+    files.erase(std::unique(files.begin(), files.end(),
+                            [](const FileInfo& a, const FileInfo& b) { return a.path == b.path; }),
+                files.end());
+
+    LibraryIndexStats counts;
+    bool ok = Index(files, false,
+                    [&](const std::wstring& path) {
+                        return std::any_of(bases.begin(), bases.end(), [&](const std::wstring& base) {
+                            return path == base || IsUnder(path, base);
+                        });
+                    },
+                    counts, error);
+    if (stats) {
+        *stats = counts;
+    }
+    return ok;
+}
+
+// ============================================================================
+// WATCHER
+// ============================================================================
+
+ImageLibraryWatcher::ImageLibraryWatcher(ImageLibrary& library, const std::wstring& root,
+                                         const ChangeCallback& changed, double settleSeconds)
+    : m_library(library), m_root(NormalizeRoot(root)), m_changed(changed), m_settleSeconds(settleSeconds) {
+#ifdef _WIN32
+    m_stopEvent = (intptr_t)CreateEventW(NULL, TRUE, FALSE, NULL);
+#endif
+    m_thread = std::thread(&ImageLibraryWatcher::Run, this);
+}
+
+ImageLibraryWatcher::~ImageLibraryWatcher() {
+    m_stop = true;
+#ifdef _WIN32
+    if (m_stopEvent) SetEvent((HANDLE)m_stopEvent);
+#endif
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+#ifdef _WIN32
+    if (m_stopEvent) CloseHandle((HANDLE)m_stopEvent);
+#endif
+}
+
+void ImageLibraryWatcher::Apply(std::vector<std::wstring>& paths, bool everything) {
+    LibraryIndexStats stats;
+    std::wstring error;
+    bool ok = everything ? m_library.Update(m_root, &stats, error) : m_library.Refresh(paths, &stats, error);
+    paths.clear();
+    if (!ok) {
+        LogMessage(LogLevel::Warning, "library", error);
+        return;
+    }
+    if (m_changed && (everything || stats.read || stats.removed || stats.failed)) {
+        m_changed(stats);
+    }
+}
+
+// Where there are no notifications: rescan on a timer, which reads only
+// what changed.
+static void PollFolder(const std::atomic<bool>& stop, const std::function<void()>& update) {
+    auto last = std::chrono::steady_clock::now();
+    while (!stop) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_TICK_MILLISECONDS));
+        if (std::chrono::duration<double>(std::chrono::steady_clock::now() - last).count() >= POLL_SECONDS) {
+            update();
+            last = std::chrono::steady_clock::now();
+        }
+    }
+}
+
+#ifdef _WIN32
+
+void ImageLibraryWatcher::Run() {
+    std::vector<std::wstring> pending;
+    auto pollUpdate = [&]() { Apply(pending, true); };
+    HANDLE directory = CreateFileW(m_root.c_str(), FILE_LIST_DIRECTORY,
+                                   FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                                   FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (directory == INVALID_HANDLE_VALUE) {
+        PollFolder(m_stop, pollUpdate);
+        return;
+    }
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    // 64 KiB is the most a network share returns at once; DWORD-aligned.
+    std::vector<DWORD> buffer(16 * 1024);
+    const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE |
+                         FILE_NOTIFY_CHANGE_LAST_WRITE;
+    bool everything = false;
+    bool armed = false;
+    bool notifications = true;
+    auto lastEvent = std::chrono::steady_clock::now();
+    while (!m_stop) {
+        if (!armed) {
+            if (!ReadDirectoryChangesW(directory, buffer.data(), (DWORD)(buffer.size() * sizeof(DWORD)), TRUE,
+                                       filter, NULL, &overlapped, NULL)) {
+                notifications = false;
+                break;
+            }
+            armed = true;
+        }
+        HANDLE events[] = {overlapped.hEvent, (HANDLE)m_stopEvent};
+        bool waiting = everything || !pending.empty();
+        DWORD wait = WaitForMultipleObjects(2, events, FALSE, waiting ? WATCH_TICK_MILLISECONDS : INFINITE);
+        if (wait == WAIT_OBJECT_0 + 1) {
+            break;
+        }
+        if (wait == WAIT_OBJECT_0) {
+            armed = false;
+            DWORD bytes = 0;
+            if (!GetOverlappedResult(directory, &overlapped, &bytes, FALSE) || bytes == 0) {
+                // The buffer overflowed: the changes are lost, so look at everything.
+                everything = true;
+            } else {
+                const uint8_t* record = (const uint8_t*)buffer.data();
+                for (;;) {
+                    const FILE_NOTIFY_INFORMATION* change = (const FILE_NOTIFY_INFORMATION*)record;
+                    pending.push_back(m_root + L"\\" +
+                                      std::wstring(change->FileName, change->FileNameLength / sizeof(WCHAR)));
+                    if (change->NextEntryOffset == 0) break;
+                    record += change->NextEntryOffset;
+                }
+            }
+            lastEvent = std::chrono::steady_clock::now();
+        }
+        double quiet = std::chrono::duration<double>(std::chrono::steady_clock::now() - lastEvent).count();
+        if ((everything || !pending.empty()) && quiet >= m_settleSeconds) {
+            Apply(pending, everything);
+            everything = false;
+        }
+    }
+    if (armed) {
+        DWORD bytes = 0;
+        CancelIo(directory);
+        GetOverlappedResult(directory, &overlapped, &bytes, TRUE);
+    }
+    CloseHandle(overlapped.hEvent);
+    CloseHandle(directory);
+    if (!notifications) {
+        LogMessage(LogLevel::Info, "library", L"No change notifications for " + m_root + L"; polling it.");
+        PollFolder(m_stop, pollUpdate);
+    }
+}
+
+#elif defined(__linux__)
+
+static const uint32_t WATCH_EVENTS = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                     IN_DELETE_SELF | IN_ONLYDIR;
+
+// inotify watches one directory at a time, so every folder of the tree gets one.
+static void WatchTree(int fd, const std::string& directory, std::map<int, std::string>& watches) {
+    int watch = inotify_add_watch(fd, directory.c_str(), WATCH_EVENTS);
+    if (watch < 0) return;
+    watches[watch] = directory;
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) return;
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        std::string path = directory + "/" + name;
+        struct stat info;
+        if (lstat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+            WatchTree(fd, path, watches);
+        }
+    }
+    closedir(dir);
+}
+
+void ImageLibraryWatcher::Run() {
+    std::vector<std::wstring> pending;
+    auto pollUpdate = [&]() { Apply(pending, true); };
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        PollFolder(m_stop, pollUpdate);
+        return;
+    }
+    std::map<int, std::string> watches;
+    WatchTree(fd, WideToUtf8(m_root), watches);
+    if (watches.empty()) {
+        close(fd);
+        PollFolder(m_stop, pollUpdate);
+        return;
+    }
+
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    bool everything = false;
+    auto lastEvent = std::chrono::steady_clock::now();
+    while (!m_stop) {
+        struct pollfd ready = {fd, POLLIN, 0};
+        if (poll(&ready, 1, WATCH_TICK_MILLISECONDS) > 0) {
+            ssize_t bytes;
+            while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (char* position = buffer; position < buffer + bytes;) {
+                    const struct inotify_event* event = (const struct inotify_event*)position;
+                    position += sizeof(struct inotify_event) + event->len;
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        everything = true;
+                        continue;
+                    }
+                    auto watch = watches.find(event->wd);
+                    if (watch == watches.end()) continue;
+                    if (event->mask & IN_IGNORED) {
+                        watches.erase(watch);
+                        continue;
+                    }
+                    if (event->len == 0) continue;
+                    std::string path = watch->second + "/" + event->name;
+                    if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                        WatchTree(fd, path, watches);
+                    }
+                    pending.push_back(Utf8ToWide(path));
+                }
+            }
+            lastEvent = std::chrono::steady_clock::now();
+        }
+        double quiet = std::chrono::duration<double>(std::chrono::steady_clock::now() - lastEvent).count();
+        if ((everything || !pending.empty()) && quiet >= m_settleSeconds) {
+            Apply(pending, everything);
+            everything = false;
+        }
+    }
+    close(fd);
+}
+
+#else
+
+void ImageLibraryWatcher::Run() {
+    std::vector<std::wstring> pending;
+    PollFolder(m_stop, [&]() { Apply(pending, true); });
+}
+
+#endif
@@ -0,0 +1,155 @@
+// ============================================================================
+// INFERNO - Image library index and folder watcher
+// ============================================================================
+
+#pragma once
+
+#include "Platform.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class ImageFormat : uint8_t {
+    Unknown,
+    Iso9660,
+    DiskImage,          // MBR or GPT disk, written raw
+    WindowsImage,       // WIM or ESD
+    VirtualDisk         // VHD or VHDX
+};
+
+enum class ImageOs : uint8_t {
+    Unknown,
+    Windows,
+    Linux
+};
+
+// Ways an image can boot, as a bit mask.
+static const uint32_t IMAGE_BOOT_BIOS = 1 << 0;
+static const uint32_t IMAGE_BOOT_UEFI = 1 << 1;
+static const uint32_t IMAGE_BOOT_RAW = 1 << 2;     // boots when copied sector by sector (hybrid ISO or disk)
+
+// What the library knows about one image file.
+struct ImageInfo {
+    std::wstring path;
+    uint64_t size = 0;                  // of the file
+    int64_t modifiedTime = 0;           // nanoseconds since the Unix epoch
+    ImageFormat format = ImageFormat::Unknown;
+    bool compressed = false;
+    std::wstring label;                 // volume label or image name; empty when there is none
+    ImageOs os = ImageOs::Unknown;
+    uint32_t architectures = 0;         // DRIVER_ARCH_* (see DriverCatalog.h); 0 when unknown
+    uint32_t boot = 0;                  // IMAGE_BOOT_*
+    std::string sha256;                 // hex; empty until the image has been hashed
+};
+
+const wchar_t* ImageFormatName(ImageFormat format);
+const wchar_t* ImageOsName(ImageOs os);
+
+// "x64/x86", the form ParseDriverArchitecture reads; empty for 0.
+std::wstring DescribeArchitectures(uint32_t architectures);
+
+// Whether the library indexes files named like `path` (.iso, .img, .img.gz,
+// .wim, .esd, .vhd, .vhdx).
+bool IsLibraryImageName(const std::wstring& path);
+
+// Reads an image's volume descriptors, directories, El Torito catalog,
+// partition tables or WIM XML for its label, OS, architectures and boot
+// modes, with a few small reads wherever the file lives. Compressed images
+// are only examined at their start. The SHA-256 comes from the image digest
+// cache, if it is there.
+bool ReadImageInfo(const std::wstring& path, ImageInfo& info, std::wstring& error);
+
+struct LibraryIndexStats {
+    size_t images = 0;
+    size_t reused = 0;      // size and modification time unchanged
+    size_t read = 0;        // new or changed
+    size_t removed = 0;
+    size_t failed = 0;
+    double seconds = 0.0;
+};
+
+// Metadata of every image under the folders a technician works from, kept
+// in one compact binary index: fixed-size entries sorted by path followed by
+// their strings, including a lower-case search text per image. The index is
+// memory-mapped rather than parsed, so opening it at startup and searching a
+// few hundred images touch nothing but the pages of the mapping.
+//
+// Updates read only the images whose size or time changed, on several
+// threads, then merge into the current index under a lock file and replace
+// it atomically, so several processes can share it.
+class ImageLibrary {
+public:
+    explicit ImageLibrary(const std::wstring& path);
+
+    // image_library.idx in the Inferno data directory.
+    static ImageLibrary& Default();
+
+    // Maps the index as last saved. False when there is none yet.
+    bool Open();
+
+    // Brings the images under `root` up to date and saves the index. Images
+    // under other roots are kept. `hashImages` also computes the SHA-256 of
+    // images the digest cache does not have, which reads them in full.
+    bool Update(const std::wstring& root, LibraryIndexStats* stats, std::wstring& error, bool hashImages = false);
+
+    // Re-reads the given files and folders only, dropping those that no
+    // longer exist. Used for change notifications.
+    bool Refresh(const std::vector<std::wstring>& paths, LibraryIndexStats* stats, std::wstring& error);
+
+    // Images under `root` (empty for all) whose path, label, OS, architecture
+    // or boot modes contain every word of `query`, case-insensitively, in
+    // path order.
+    std::vector<ImageInfo> Search(const std::wstring& root, const std::wstring& query,
+                                  size_t limit = SIZE_MAX);
+
+    bool Find(const std::wstring& path, ImageInfo& info);
+
+    size_t GetCount();
+
+private:
+    bool MapIfChanged();
+    std::vector<ImageInfo> ReadAll();
+    bool Index(const std::vector<FileInfo>& files, bool hashImages,
+               const std::function<bool(const std::wstring&)>& replaced, LibraryIndexStats& counts,
+               std::wstring& error);
+
+    std::mutex m_lock;
+    std::wstring m_path;
+    MappedFile m_file;
+    FileIdentity m_mappedIdentity;
+    size_t m_count = 0;                 // entries in the mapping
+};
+
+// Keeps `library` current for one folder tree from change notifications
+// (ReadDirectoryChangesW, which also works on SMB shares, or inotify),
+// falling back to a periodic Update where neither exists. Changes are
+// collected until the folder has been quiet for `settleSeconds`, so an image
+// still being copied is read once, when it is complete. `changed` is called
+// on the watcher thread after each refresh.
+class ImageLibraryWatcher {
+public:
+    using ChangeCallback = std::function<void(const LibraryIndexStats& stats)>;
+
+    ImageLibraryWatcher(ImageLibrary& library, const std::wstring& root, const ChangeCallback& changed,
+                        double settleSeconds = 2.0);
+    ~ImageLibraryWatcher();
+    ImageLibraryWatcher(const ImageLibraryWatcher&) = delete;
+    ImageLibraryWatcher& operator=(const ImageLibraryWatcher&) = delete;
+
+private:
+    void Run();
+    void Apply(std::vector<std::wstring>& paths, bool everything);
+
+    ImageLibrary& m_library;
+    std::wstring m_root;
+    ChangeCallback m_changed;
+    double m_settleSeconds;
+    std::atomic<bool> m_stop{false};
+    intptr_t m_stopEvent = 0;           // Windows: signalled to wake the watcher thread
+    std::thread m_thread;
+};
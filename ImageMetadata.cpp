@@ -0,0 +1,293 @@
+// ============================================================================
+// INFERNO - Image metadata regions
+// ============================================================================
+
+#include "ImageMetadata.h"
+#include "ImageSource.h"
+#include "IsoHybrid.h"
+
+#include <algorithm>
+#include <cstring>
+#include <set>
+
+static const uint64_t HEAD_BYTES = 1024 * 1024;
+static const uint64_t PARTITION_HEAD_BYTES = 1024 * 1024;
+
+// Bounds on what damaged or hostile metadata can make us collect.
+static const uint64_t MAX_REGION_BYTES = 256ull * 1024 * 1024;
+static const uint32_t MAX_GPT_ENTRIES = 1024;
+static const uint32_t MAX_DIRECTORIES = 65536;
+static const uint32_t MAX_DIRECTORY_BYTES = 16 * 1024 * 1024;
+
+static const uint32_t ISO_FIRST_DESCRIPTOR = 16;
+static const uint32_t ISO_MAX_DESCRIPTORS = 32;
+static const uint8_t DESCRIPTOR_PRIMARY = 1;
+static const uint8_t DESCRIPTOR_SUPPLEMENTARY = 2;
+static const uint8_t DESCRIPTOR_TERMINATOR = 255;
+
+// ============================================================================
+// BYTE ORDER
+// ============================================================================
+
+static uint16_t ReadLe16(const uint8_t* p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t ReadLe32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t ReadLe64(const uint8_t* p) {
+    return (uint64_t)ReadLe32(p) | (uint64_t)ReadLe32(p + 4) << 32;
+}
+
+static uint32_t ReadBe32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static void AddRegion(std::vector<ByteRange>& regions, uint64_t offset, uint64_t length) {
+    if (length == 0) return;
+    regions.push_back({offset, std::min(length, MAX_REGION_BYTES)});
+}
+
+// ============================================================================
+// FILE SYSTEMS
+// ============================================================================
+
+static bool IsPowerOfTwo(uint32_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// The metadata at the start of the partition at `start`, found from its
+// boot sector.
+static void AddFileSystemMetadata(ImageReader& reader, uint64_t start, uint64_t length,
+                                  std::vector<ByteRange>& regions) {
+    uint64_t limit = std::min(length, MAX_REGION_BYTES);
+    uint8_t boot[512];
+    std::wstring error;
+    if (!reader.ReadAt(start, boot, sizeof(boot), error)) {
+        return;
+    }
+
+    if (memcmp(boot + 3, "EXFAT   ", 8) == 0 && boot[108] >= 9 && boot[108] <= 12) {
+        uint64_t sectorSize = 1ull << boot[108];
+        uint64_t fatOffset = ReadLe32(boot + 80);
+        uint64_t fatLength = ReadLe32(boot + 84);
+        uint64_t heapOffset = ReadLe32(boot + 88);
+        // Main and backup boot regions, then the FATs; the allocation
+        // bitmap, up-case table and root directory usually lead the heap.
+        AddRegion(regions, start, std::min(limit, (fatOffset + fatLength * std::max<uint8_t>(boot[110], 1)) * sectorSize));
+        if (heapOffset * sectorSize < length) {
+            AddRegion(regions, start + heapOffset * sectorSize,
+                      std::min(PARTITION_HEAD_BYTES, length - heapOffset * sectorSize));
+        }
+        return;
+    }
+
+    if (memcmp(boot + 3, "NTFS    ", 8) == 0) {
+        uint32_t sectorSize = ReadLe16(boot + 11);
+        uint32_t clusterSectors = boot[13] > 0x80 ? 1u << (256 - boot[13]) : boot[13];
+        uint64_t mftOffset = ReadLe64(boot + 48) * clusterSectors * sectorSize;
+        AddRegion(regions, start, std::min(limit, PARTITION_HEAD_BYTES));
+        if (mftOffset < length) {
+            AddRegion(regions, start + mftOffset, std::min(PARTITION_HEAD_BYTES, length - mftOffset));
+        }
+        return;
+    }
+
+    uint32_t sectorSize = ReadLe16(boot + 11);
+    uint32_t clusterSectors = boot[13];
+    uint32_t reserved = ReadLe16(boot + 14);
+    uint32_t fats = boot[16];
+    uint32_t rootEntries = ReadLe16(boot + 17);
+    uint32_t fatSectors = ReadLe16(boot + 22) ? ReadLe16(boot + 22) : ReadLe32(boot + 36);
+    bool fat = ReadLe16(boot + 510) == 0xAA55 && sectorSize >= 512 && sectorSize <= 4096 &&
+               IsPowerOfTwo(sectorSize) && IsPowerOfTwo(clusterSectors) && reserved > 0 && fats >= 1 && fats <= 2 &&
+               fatSectors > 0;
+    if (fat) {
+        uint64_t metadataSectors = reserved + (uint64_t)fats * fatSectors + (rootEntries * 32 + sectorSize - 1) / sectorSize;
+        AddRegion(regions, start, std::min(limit, metadataSectors * sectorSize));
+        // FAT32 keeps its root directory in the data area.
+        uint32_t rootCluster = ReadLe16(boot + 22) == 0 ? ReadLe32(boot + 44) : 0;
+        uint64_t rootOffset = (metadataSectors + (uint64_t)(rootCluster - 2) * clusterSectors) * sectorSize;
+        if (rootCluster >= 2 && rootOffset < length) {
+            AddRegion(regions, start + rootOffset, std::min<uint64_t>((uint64_t)clusterSectors * sectorSize, length - rootOffset));
+        }
+        return;
+    }
+
+    // ext2/3/4 superblock and group descriptors, or anything unrecognised.
+    AddRegion(regions, start, std::min(limit, PARTITION_HEAD_BYTES));
+}
+
+// ============================================================================
+// PARTITION TABLES
+// ============================================================================
+
+static void AddPartitionTables(ImageReader& reader, std::vector<ByteRange>& regions) {
+    uint8_t mbr[512];
+    std::wstring error;
+    if (!reader.ReadAt(0, mbr, sizeof(mbr), error) || ReadLe16(mbr + 510) != 0xAA55) {
+        return;
+    }
+
+    std::vector<ByteRange> partitions;
+    for (int i = 0; i < 4; i++) {
+        const uint8_t* record = mbr + 446 + 16 * i;
+        uint32_t first = ReadLe32(record + 8);
+        uint32_t count = ReadLe32(record + 12);
+        if (record[4] != 0 && record[4] != 0xEE && count != 0) {
+            partitions.push_back({(uint64_t)first * 512, (uint64_t)count * 512});
+        }
+    }
+
+    // The GPT header is at LBA 1, whichever the image's sector size.
+    for (uint32_t sectorSize : {512u, 4096u}) {
+        uint8_t header[92];
+        if (!reader.ReadAt(sectorSize, header, sizeof(header), error) || memcmp(header, "EFI PART", 8) != 0) {
+            continue;
+        }
+        uint64_t backupLba = ReadLe64(header + 32);
+        uint64_t entriesLba = ReadLe64(header + 72);
+        uint32_t entryCount = ReadLe32(header + 80);
+        uint32_t entrySize = ReadLe32(header + 84);
+        if (entrySize < 128 || entrySize > 4096 || entryCount > MAX_GPT_ENTRIES) {
+            break;
+        }
+        uint64_t entryBytes = (uint64_t)entryCount * entrySize;
+        uint64_t entrySectors = (entryBytes + sectorSize - 1) / sectorSize;
+        AddRegion(regions, entriesLba * sectorSize, entryBytes);
+        // The backup entries sit just before the backup header.
+        if (backupLba > entrySectors) {
+            AddRegion(regions, (backupLba - entrySectors) * sectorSize, (entrySectors + 1) * sectorSize);
+        }
+
+        std::vector<uint8_t> entries((size_t)entryBytes);
+        if (entryBytes && reader.ReadAt(entriesLba * sectorSize, entries.data(), entries.size(), error)) {
+            partitions.clear();     // a hybrid MBR only repeats GPT partitions
+            for (uint32_t i = 0; i < entryCount; i++) {
+                const uint8_t* entry = entries.data() + (size_t)i * entrySize;
+                uint64_t first = ReadLe64(entry + 32);
+                uint64_t last = ReadLe64(entry + 40);
+                bool used = std::any_of(entry, entry + 16, [](uint8_t b) { return b != 0; });
+                if (used && last >= first) {
+                    partitions.push_back({first * sectorSize, (last - first + 1) * sectorSize});
+                }
+            }
+        }
+        break;
+    }
+
+    for (const ByteRange& partition : partitions) {
+        AddFileSystemMetadata(reader, partition.offset, partition.length, regions);
+    }
+}
+
+// ============================================================================
+// ISO9660
+// ============================================================================
+
+// Every directory below the one at `rootSector`, breadth first.
+static void AddIsoDirectories(ImageReader& reader, uint32_t rootSector, uint32_t rootBytes,
+                              std::vector<ByteRange>& regions) {
+    std::set<uint32_t> visited;
+    std::vector<std::pair<uint32_t, uint32_t>> queue = {{rootSector, rootBytes}};
+    std::vector<uint8_t> extent;
+    std::wstring error;
+    for (size_t next = 0; next < queue.size() && visited.size() < MAX_DIRECTORIES; next++) {
+        uint32_t sector = queue[next].first;
+        uint32_t bytes = std::min(queue[next].second, MAX_DIRECTORY_BYTES);
+        if (bytes == 0 || !visited.insert(sector).second) continue;
+
+        extent.resize(bytes);
+        if (!reader.ReadAt((uint64_t)sector * ISO_SECTOR_SIZE, extent.data(), extent.size(), error)) {
+            continue;
+        }
+        AddRegion(regions, (uint64_t)sector * ISO_SECTOR_SIZE, bytes);
+
+        // Records never span sectors; a zero length pads to the next one.
+        size_t position = 0;
+        while (position + 34 <= extent.size()) {
+            uint8_t length = extent[position];
+            if (length == 0) {
+                position = (position / ISO_SECTOR_SIZE + 1) * ISO_SECTOR_SIZE;
+                continue;
+            }
+            if (length < 34 || position + length > extent.size()) break;
+            const uint8_t* record = extent.data() + position;
+            bool directory = (record[25] & 0x02) != 0;
+            bool self = record[32] == 1 && (record[33] == 0 || record[33] == 1);
+            if (directory && !self) {
+                queue.push_back({ReadLe32(record + 2), ReadLe32(record + 10)});
+            }
+            position += length;
+        }
+    }
+}
+
+static void AddIsoMetadata(ImageReader& reader, const std::wstring& imagePath, std::vector<ByteRange>& regions) {
+    std::wstring error;
+    for (uint32_t index = 0; index < ISO_MAX_DESCRIPTORS; index++) {
+        uint64_t offset = (uint64_t)(ISO_FIRST_DESCRIPTOR + index) * ISO_SECTOR_SIZE;
+        uint8_t descriptor[ISO_SECTOR_SIZE];
+        if (!reader.ReadAt(offset, descriptor, sizeof(descriptor), error) || memcmp(descriptor + 1, "CD001", 5) != 0) {
+            break;
+        }
+        AddRegion(regions, offset, ISO_SECTOR_SIZE);
+        if (descriptor[0] == DESCRIPTOR_TERMINATOR) {
+            break;
+        }
+        if (descriptor[0] != DESCRIPTOR_PRIMARY && descriptor[0] != DESCRIPTOR_SUPPLEMENTARY) {
+            continue;
+        }
+
+        // Type L tables are little-endian, type M big-endian; either may
+        // have an optional copy.
+        uint32_t pathTableBytes = ReadLe32(descriptor + 132);
+        uint32_t pathTables[] = {ReadLe32(descriptor + 140), ReadLe32(descriptor + 144), ReadBe32(descriptor + 148),
+                                 ReadBe32(descriptor + 152)};
+        for (uint32_t table : pathTables) {
+            if (table) AddRegion(regions, (uint64_t)table * ISO_SECTOR_SIZE, pathTableBytes);
+        }
+        const uint8_t* root = descriptor + 156;
+        AddIsoDirectories(reader, ReadLe32(root + 2), ReadLe32(root + 10), regions);
+    }
+
+    IsoBootInfo boot;
+    if (ReadIsoBootInfo(imagePath, boot, error) && boot.catalogOffset) {
+        AddRegion(regions, boot.catalogOffset, ISO_SECTOR_SIZE);
+        for (const ByteRange& image : boot.bootImages) {
+            AddRegion(regions, image.offset, image.length);
+        }
+    }
+}
+
+// ============================================================================
+// REGIONS
+// ============================================================================
+
+bool FindImageMetadataRegions(const std::wstring& imagePath, std::vector<ByteRange>& regions, std::wstring& error) {
+    regions.clear();
+    ImageReader reader(imagePath);
+    uint8_t probe[512];
+    if (!reader.ReadAt(0, probe, sizeof(probe), error)) {
+        return false;
+    }
+
+    AddRegion(regions, 0, HEAD_BYTES);
+    AddPartitionTables(reader, regions);
+    AddIsoMetadata(reader, imagePath, regions);
+
+    std::sort(regions.begin(), regions.end(),
+              [](const ByteRange& a, const ByteRange& b) { return a.offset < b.offset; });
+    std::vector<ByteRange> merged;
+    for (const ByteRange& region : regions) {
+        if (!merged.empty() && region.offset <= merged.back().offset + merged.back().length) {
+            merged.back().length = std::max(merged.back().length, region.offset + region.length - merged.back().offset);
+        } else {
+            merged.push_back(region);
+        }
+    }
+    regions.swap(merged);
+    return true;
+}
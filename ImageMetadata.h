@@ -0,0 +1,26 @@
+// ============================================================================
+// INFERNO - Image metadata regions
+// ============================================================================
+
+#pragma once
+
+#include "ImageWriter.h"
+
+#include <string>
+#include <vector>
+
+// Byte ranges of an image that booting and mounting it depend on:
+//  - the first MiB (MBR or protective MBR, primary GPT, ISO9660 system area
+//    and volume descriptors, boot code in the gap before the first partition)
+//  - the GPT entries and the backup GPT
+//  - each partition's boot sector and file system metadata (FAT reserved
+//    area, FATs and root directory; exFAT boot region, FAT and the start of
+//    the cluster heap; NTFS boot sector and first MFT records; the first MiB
+//    of anything else)
+//  - the ISO9660 path tables and every directory of the primary and Joliet
+//    trees
+//  - the El Torito boot catalog and its boot images, the EFI image whole
+//
+// Returned sorted and merged. Structures that do not parse are left out
+// rather than failing the call, which fails only if the image is unreadable.
+bool FindImageMetadataRegions(const std::wstring& imagePath, std::vector<ByteRange>& regions, std::wstring& error);
@@ -0,0 +1,905 @@
+// ============================================================================
+// INFERNO - Image sources (raw and compressed)
+// ============================================================================
+
+#include "ImageSource.h"
+#include "BlockDevice.h"
+#include "BufferArena.h"
+#include "Log.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef INFERNO_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Uncached reads must be aligned to the file system's block size; a page is
+// a multiple of every block size Inferno meets.
+static const size_t DIRECT_ALIGNMENT = 4096;
+
+// Direct reads: DIRECT_BLOCKS blocks of DIRECT_BLOCK bytes read ahead of the
+// consumer, up to DIRECT_READERS of them at once so fast drives see a queue.
+static const size_t DIRECT_BLOCK = 2 * 1024 * 1024;
+static const uint32_t DIRECT_BLOCKS = 8;
+static const uint32_t DIRECT_READERS = 4;
+
+// Drop-behind hints are batched: each one walks the file's cached pages.
+static const uint64_t DROP_BEHIND_BATCH = 8 * 1024 * 1024;
+
+// Pinned images are loaded from the file in steps of at least this much.
+static const uint64_t PIN_LOAD_STEP = 8 * 1024 * 1024;
+
+const wchar_t* ReadPolicyName(ReadPolicy policy) {
+    switch (policy) {
+        case ReadPolicy::Buffered: return L"buffered";
+        case ReadPolicy::Sequential: return L"sequential";
+        case ReadPolicy::DropBehind: return L"drop-behind";
+        case ReadPolicy::Direct: return L"direct";
+        case ReadPolicy::Pinned: return L"pinned";
+    }
+    return L"buffered";
+}
+
+bool ParseReadPolicy(const std::wstring& name, ReadPolicy& policy) {
+    const ReadPolicy ALL[] = {ReadPolicy::Buffered, ReadPolicy::Sequential, ReadPolicy::DropBehind,
+                              ReadPolicy::Direct, ReadPolicy::Pinned};
+    for (ReadPolicy candidate : ALL) {
+        if (name == ReadPolicyName(candidate)) {
+            policy = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// ============================================================================
+// SOURCE FILES
+// ============================================================================
+
+// An image file opened with the OS cache behaviour of a read policy.
+class SourceFile {
+public:
+    SourceFile() = default;
+    ~SourceFile();
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    // `direct` bypasses the OS cache and fails where the file system
+    // refuses that; `sequential` asks for aggressive readahead.
+    bool Open(const std::wstring& path, bool sequential, bool direct);
+
+    uint64_t GetSize() const { return m_size; }
+
+    // Reads until `length` bytes are read or the file ends. Direct files
+    // need DIRECT_ALIGNMENT-aligned offsets, lengths and buffers.
+    int64_t ReadAt(uint64_t offset, void* buffer, size_t length);
+
+    // Drops [offset, offset + length) from the OS cache; length 0 means to
+    // the end of the file.
+    void DropCached(uint64_t offset, uint64_t length);
+
+private:
+#ifdef _WIN32
+    HANDLE m_handle = INVALID_HANDLE_VALUE;
+#else
+    int m_fd = -1;
+#endif
+    uint64_t m_size = 0;
+    bool m_direct = false;
+};
+
+#ifdef _WIN32
+
+SourceFile::~SourceFile() {
+    if (m_handle != INVALID_HANDLE_VALUE) CloseHandle(m_handle);
+}
+
+bool SourceFile::Open(const std::wstring& path, bool sequential, bool direct) {
+    DWORD flags = FILE_ATTRIBUTE_NORMAL;
+    if (sequential) flags |= FILE_FLAG_SEQUENTIAL_SCAN;
+    if (direct) flags |= FILE_FLAG_NO_BUFFERING;
+    m_handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                           flags, NULL);
+    if (m_handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_handle, &size)) {
+        return false;
+    }
+    m_size = (uint64_t)size.QuadPart;
+    m_direct = direct;
+    return true;
+}
+
+int64_t SourceFile::ReadAt(uint64_t offset, void* buffer, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        uint64_t position = offset + total;
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = (DWORD)position;
+        overlapped.OffsetHigh = (DWORD)(position >> 32);
+        DWORD want = (DWORD)std::min<size_t>(length - total, 1u << 30);
+        DWORD got = 0;
+        if (!ReadFile(m_handle, (uint8_t*)buffer + total, want, &got, &overlapped)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) break;
+            return -1;
+        }
+        total += got;
+        // Regular files only come up short at their end.
+        if (got < want) break;
+    }
+    return (int64_t)total;
+}
+
+// The cache manager has no per-range eviction; unbuffered handles are how
+// Windows avoids caching in the first place.
+void SourceFile::DropCached(uint64_t, uint64_t) {
+}
+
+#else
+
+SourceFile::~SourceFile() {
+    if (m_fd >= 0) close(m_fd);
+}
+
+bool SourceFile::Open(const std::wstring& path, bool sequential, bool direct) {
+    int flags = O_RDONLY | O_CLOEXEC;
+#ifdef O_DIRECT
+    if (direct) flags |= O_DIRECT;
+#endif
+    m_fd = open(WideToUtf8(path).c_str(), flags);
+    if (m_fd < 0) {
+        return false;
+    }
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    if (direct && fcntl(m_fd, F_NOCACHE, 1) != 0) return false;
+#elif !defined(O_DIRECT)
+    if (direct) return false;
+#endif
+    off_t end = lseek(m_fd, 0, SEEK_END);
+    if (end < 0) {
+        return false;
+    }
+    m_size = (uint64_t)end;
+    m_direct = direct;
+    if (sequential) {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#elif defined(F_RDAHEAD)
+        fcntl(m_fd, F_RDAHEAD, 1);
+#endif
+    }
+    return true;
+}
+
+int64_t SourceFile::ReadAt(uint64_t offset, void* buffer, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t got = pread(m_fd, (uint8_t*)buffer + total, length - total, (off_t)(offset + total));
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (got == 0) break;
+        total += (size_t)got;
+        // A direct read that ends off alignment has reached the end of the
+        // file; reading on from there would fail.
+        if (m_direct && total % DIRECT_ALIGNMENT != 0) break;
+    }
+    return (int64_t)total;
+}
+
+void SourceFile::DropCached(uint64_t offset, uint64_t length) {
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(m_fd, (off_t)offset, (off_t)length, POSIX_FADV_DONTNEED);
+#else
+    (void)offset;
+    (void)length;
+#endif
+}
+
+#endif
+
+// ============================================================================
+// READAHEAD WINDOW
+// ============================================================================
+
+// Keeps the blocks ahead of the consumer's position in flight on reader
+// threads, which direct reads need because the OS does no readahead for
+// them. The window follows the consumer: a read outside it restarts the
+// window there, so occasional seeks (a header probe, a verify pass) work,
+// just without the benefit.
+class ReadaheadWindow {
+public:
+    ReadaheadWindow(SourceFile& file, ArenaBuffer memory);
+    ~ReadaheadWindow();
+
+    // Same contract as SourceFile::ReadAt, without the alignment rules.
+    int64_t Read(uint64_t offset, void* buffer, size_t length);
+
+private:
+    struct Block {
+        uint8_t* data = nullptr;
+        uint64_t offset = 0;
+        int64_t length = 0;     // bytes read; short at the end of the file, -1 on error
+        bool ready = false;
+    };
+
+    void RunReader();
+    void RestartLocked(uint64_t position);
+
+    SourceFile& m_file;
+    ArenaBuffer m_memory;
+    std::vector<Block> m_blocks;
+    std::vector<Block*> m_free;
+    std::deque<Block*> m_window;    // in file order: [front offset, m_next)
+    uint64_t m_next = 0;            // offset of the next block to claim
+    uint64_t m_generation = 0;      // bumped by restarts; stale reads are discarded
+    bool m_end = false;             // a block has reached the end of the file
+    bool m_stop = false;
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    std::vector<std::thread> m_readers;
+};
+
+ReadaheadWindow::ReadaheadWindow(SourceFile& file, ArenaBuffer memory)
+    : m_file(file), m_memory(std::move(memory)), m_blocks(DIRECT_BLOCKS) {
+    for (uint32_t i = 0; i < DIRECT_BLOCKS; i++) {
+        m_blocks[i].data = m_memory.Data() + (size_t)i * DIRECT_BLOCK;
+        m_free.push_back(&m_blocks[i]);
+    }
+    for (uint32_t i = 0; i < DIRECT_READERS; i++) {
+        m_readers.emplace_back([this] { RunReader(); });
+    }
+}
+
+ReadaheadWindow::~ReadaheadWindow() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_changed.notify_all();
+    for (std::thread& reader : m_readers) reader.join();
+}
+
+void ReadaheadWindow::RunReader() {
+    std::unique_lock<std::mutex> guard(m_lock);
+    for (;;) {
+        m_changed.wait(guard, [&] { return m_stop || (!m_end && !m_free.empty()); });
+        if (m_stop) return;
+
+        Block* block = m_free.back();
+        m_free.pop_back();
+        block->offset = m_next;
+        block->ready = false;
+        m_window.push_back(block);
+        m_next += DIRECT_BLOCK;
+        uint64_t generation = m_generation;
+
+        guard.unlock();
+        int64_t got = m_file.ReadAt(block->offset, block->data, DIRECT_BLOCK);
+        guard.lock();
+
+        if (generation != m_generation) {
+            // The window moved while this block was read; it is no longer in it.
+            m_free.push_back(block);
+        } else {
+            block->length = got;
+            block->ready = true;
+            if (got < (int64_t)DIRECT_BLOCK) m_end = true;
+        }
+        m_changed.notify_all();
+    }
+}
+
+// Called with m_lock held. Blocks still being read return to the free list
+// from their reader.
+void ReadaheadWindow::RestartLocked(uint64_t position) {
+    m_generation++;
+    for (Block* block : m_window) {
+        if (block->ready) m_free.push_back(block);
+    }
+    m_window.clear();
+    m_next = position / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+    m_end = false;
+    m_changed.notify_all();
+}
+
+int64_t ReadaheadWindow::Read(uint64_t offset, void* buffer, size_t length) {
+    std::unique_lock<std::mutex> guard(m_lock);
+    size_t done = 0;
+    while (done < length) {
+        uint64_t position = offset + done;
+
+        // Full blocks behind the position are consumed. The last block of
+        // the file stays, so reads past it see the end rather than a seek.
+        while (!m_window.empty() && m_window.front()->ready && m_window.front()->length == (int64_t)DIRECT_BLOCK &&
+               m_window.front()->offset + DIRECT_BLOCK <= position) {
+            m_free.push_back(m_window.front());
+            m_window.pop_front();
+            m_changed.notify_all();
+        }
+
+        bool inWindow = m_window.empty() ? (position == m_next && !m_end)
+                                         : (position >= m_window.front()->offset && position < m_next);
+        if (!inWindow) {
+            RestartLocked(position);
+        }
+        if (m_window.empty() || !m_window.front()->ready) {
+            m_changed.wait(guard);
+            continue;
+        }
+
+        const Block* block = m_window.front();
+        if (block->length < 0) {
+            return -1;
+        }
+        uint64_t end = block->offset + (uint64_t)block->length;
+        if (position >= end) {
+            break;
+        }
+        size_t piece = (size_t)std::min<uint64_t>(length - done, end - position);
+        memcpy((uint8_t*)buffer + done, block->data + (position - block->offset), piece);
+        done += piece;
+    }
+    return (int64_t)done;
+}
+
+// ============================================================================
+// RAW IMAGES
+// ============================================================================
+
+// Buffered images and devices used as images.
+class RawImageSource : public ImageSource {
+public:
+    explicit RawImageSource(std::unique_ptr<BlockDevice> file) : m_file(std::move(file)) {
+    }
+
+    uint64_t GetSize() const override { return m_file->GetGeometry().sizeBytes; }
+    bool IsSequential() const override { return false; }
+
+    int64_t Read(uint64_t offset, void* buffer, size_t length) override {
+        uint64_t size = GetSize();
+        if (offset >= size) return 0;
+        size_t want = (size_t)std::min<uint64_t>(length, size - offset);
+        return m_file->Read(offset, buffer, want) ? (int64_t)want : -1;
+    }
+
+private:
+    std::unique_ptr<BlockDevice> m_file;
+};
+
+// Image files under the Sequential, DropBehind and Direct policies.
+class FileImageSource : public ImageSource {
+public:
+    FileImageSource(std::unique_ptr<SourceFile> file, std::unique_ptr<ReadaheadWindow> window, bool dropBehind)
+        : m_file(std::move(file)), m_window(std::move(window)), m_dropBehind(dropBehind) {
+    }
+
+    ~FileImageSource() override {
+        m_window.reset();
+        if (m_dropBehind) m_file->DropCached(m_dropped, 0);
+    }
+
+    uint64_t GetSize() const override { return m_file->GetSize(); }
+    bool IsSequential() const override { return false; }
+
+    int64_t Read(uint64_t offset, void* buffer, size_t length) override {
+        uint64_t size = GetSize();
+        if (offset >= size) return 0;
+        size_t want = (size_t)std::min<uint64_t>(length, size - offset);
+        int64_t got = m_window ? m_window->Read(offset, buffer, want) : m_file->ReadAt(offset, buffer, want);
+        if (got != (int64_t)want) {
+            return -1;
+        }
+        uint64_t end = offset + want;
+        if (m_dropBehind && end >= m_dropped + DROP_BEHIND_BATCH) {
+            uint64_t dropTo = end / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+            m_file->DropCached(m_dropped, dropTo - m_dropped);
+            m_dropped = dropTo;
+        }
+        return got;
+    }
+
+private:
+    std::unique_ptr<SourceFile> m_file;
+    std::unique_ptr<ReadaheadWindow> m_window;
+    bool m_dropBehind;
+    uint64_t m_dropped = 0;     // the cache holds nothing of the file below this
+};
+
+// ============================================================================
+// PINNED IMAGES
+// ============================================================================
+
+// One image held in memory, filled from the front as jobs read it.
+struct PinnedImage {
+    std::wstring path;
+    FileIdentity identity;
+    uint8_t* data = nullptr;
+    uint64_t size = 0;
+    bool locked = false;                // kept out of swap
+    std::atomic<uint64_t> loaded{0};    // bytes from the start already in memory
+    std::mutex loadLock;
+    uint64_t lastUsed = 0;
+
+    ~PinnedImage();
+};
+
+#ifdef _WIN32
+
+static uint8_t* AllocatePinned(uint64_t size, bool& locked) {
+    uint8_t* data = (uint8_t*)VirtualAlloc(NULL, (SIZE_T)size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (!data) return nullptr;
+    // VirtualLock is limited by the minimum working set; grow it first.
+    SIZE_T minimum = 0, maximum = 0;
+    locked = GetProcessWorkingSetSize(GetCurrentProcess(), &minimum, &maximum) &&
+             SetProcessWorkingSetSize(GetCurrentProcess(), minimum + (SIZE_T)size, maximum + (SIZE_T)size) &&
+             VirtualLock(data, (SIZE_T)size);
+    return data;
+}
+
+static void FreePinned(uint8_t* data, uint64_t size, bool locked) {
+    if (locked) VirtualUnlock(data, (SIZE_T)size);
+    VirtualFree(data, 0, MEM_RELEASE);
+}
+
+#else
+
+static uint8_t* AllocatePinned(uint64_t size, bool& locked) {
+    void* data = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) return nullptr;
+    // Needs RLIMIT_MEMLOCK headroom; unlocked memory still works, it may
+    // just be swapped out under pressure.
+    locked = mlock(data, (size_t)size) == 0;
+    return (uint8_t*)data;
+}
+
+static void FreePinned(uint8_t* data, uint64_t size, bool locked) {
+    if (locked) munlock(data, (size_t)size);
+    munmap(data, (size_t)size);
+}
+
+#endif
+
+PinnedImage::~PinnedImage() {
+    if (data) FreePinned(data, size, locked);
+}
+
+static std::mutex g_pinnedLock;
+static std::vector<std::shared_ptr<PinnedImage>> g_pinned;
+static uint64_t g_pinnedClock = 0;
+
+static bool SameFileVersion(const FileIdentity& a, const FileIdentity& b) {
+    return a.size == b.size && a.modifiedTime == b.modifiedTime && a.volumeId == b.volumeId &&
+           a.fileId == b.fileId;
+}
+
+static uint64_t PinnedBytesLocked() {
+    uint64_t total = 0;
+    for (const std::shared_ptr<PinnedImage>& image : g_pinned) total += image->size;
+    return total;
+}
+
+// The pinned copy of this version of the file, made room for if it is new.
+// Null when the image cannot fit in a quarter of RAM next to the images
+// other jobs are reading.
+static std::shared_ptr<PinnedImage> AcquirePinnedImage(const std::wstring& path, const FileIdentity& identity) {
+    std::lock_guard<std::mutex> guard(g_pinnedLock);
+    for (auto it = g_pinned.begin(); it != g_pinned.end(); ++it) {
+        if ((*it)->path != path) continue;
+        if (SameFileVersion((*it)->identity, identity)) {
+            (*it)->lastUsed = ++g_pinnedClock;
+            return *it;
+        }
+        // Changed on disk; sources still reading the old copy keep it alive.
+        g_pinned.erase(it);
+        break;
+    }
+
+    uint64_t limit = GetPhysicalMemorySize() / 4;
+    if (identity.size == 0 || identity.size > limit) {
+        return nullptr;
+    }
+    while (PinnedBytesLocked() + identity.size > limit) {
+        // Evict the least recently used image no source is reading.
+        auto victim = g_pinned.end();
+        for (auto it = g_pinned.begin(); it != g_pinned.end(); ++it) {
+            if (it->use_count() == 1 && (victim == g_pinned.end() || (*it)->lastUsed < (*victim)->lastUsed)) {
+                victim = it;
+            }
+        }
+        if (victim == g_pinned.end()) {
+            return nullptr;
+        }
+        LogMessage(LogLevel::Info, "source", L"Unpinned " + (*victim)->path);
+        g_pinned.erase(victim);
+    }
+
+    std::shared_ptr<PinnedImage> image(new PinnedImage());
+    image->path = path;
+    image->identity = identity;
+    image->size = identity.size;
+    image->data = AllocatePinned(identity.size, image->locked);
+    if (!image->data) {
+        return nullptr;
+    }
+    image->lastUsed = ++g_pinnedClock;
+    g_pinned.push_back(image);
+    LogEvent(LogLevel::Info, "source", "pin",
+             {{"bytes", (int64_t)image->size}, {"locked", image->locked ? 1 : 0}});
+    return image;
+}
+
+uint64_t GetPinnedImageBytes() {
+    std::lock_guard<std::mutex> guard(g_pinnedLock);
+    return PinnedBytesLocked();
+}
+
+void ReleasePinnedImages() {
+    std::lock_guard<std::mutex> guard(g_pinnedLock);
+    g_pinned.clear();
+}
+
+void ReleaseUnusedPinnedImages(const std::vector<std::wstring>& inUse) {
+    std::lock_guard<std::mutex> guard(g_pinnedLock);
+    for (auto it = g_pinned.begin(); it != g_pinned.end();) {
+        if (std::find(inUse.begin(), inUse.end(), (*it)->path) != inUse.end()) {
+            ++it;
+            continue;
+        }
+        LogMessage(LogLevel::Info, "source", L"Unpinned " + (*it)->path);
+        it = g_pinned.erase(it);
+    }
+}
+
+// Serves a pinned image from memory, loading what earlier jobs have not yet
+// read from the file as this job reaches it. Loaded ranges are dropped from
+// the OS cache: the pinned copy replaces it.
+class PinnedImageSource : public ImageSource {
+public:
+    PinnedImageSource(std::shared_ptr<PinnedImage> image, std::unique_ptr<SourceFile> file)
+        : m_image(std::move(image)), m_file(std::move(file)) {
+    }
+
+    uint64_t GetSize() const override { return m_image->size; }
+    bool IsSequential() const override { return false; }
+
+    int64_t Read(uint64_t offset, void* buffer, size_t length) override {
+        uint64_t size = GetSize();
+        if (offset >= size) return 0;
+        size_t want = (size_t)std::min<uint64_t>(length, size - offset);
+        if (offset + want > m_image->loaded.load(std::memory_order_acquire) && !Load(offset, offset + want)) {
+            // Far ahead of what is loaded (a probe of the image's tail):
+            // read around the pinned copy rather than load up to it.
+            if (!m_file) return -1;
+            return m_file->ReadAt(offset, buffer, want) == (int64_t)want ? (int64_t)want : -1;
+        }
+        memcpy(buffer, m_image->data + offset, want);
+        return (int64_t)want;
+    }
+
+private:
+    bool Load(uint64_t offset, uint64_t end) {
+        std::lock_guard<std::mutex> guard(m_image->loadLock);
+        uint64_t loaded = m_image->loaded.load(std::memory_order_relaxed);
+        if (end <= loaded) return true;
+        if (!m_file || offset > loaded + PIN_LOAD_STEP) return false;
+
+        uint64_t target = std::min(m_image->size, std::max(end, loaded + PIN_LOAD_STEP));
+        int64_t got = m_file->ReadAt(loaded, m_image->data + loaded, (size_t)(target - loaded));
+        if (got != (int64_t)(target - loaded)) {
+            return false;
+        }
+        m_file->DropCached(loaded, target - loaded);
+        m_image->loaded.store(target, std::memory_order_release);
+        return true;
+    }
+
+    std::shared_ptr<PinnedImage> m_image;
+    std::unique_ptr<SourceFile> m_file;     // null once the image is fully loaded
+};
+
+// ============================================================================
+// GZIP IMAGES
+// ============================================================================
+
+#ifdef INFERNO_HAVE_ZLIB
+
+class GzipImageSource : public ImageSource {
+public:
+    // `fd` is the descriptor zlib reads, for drop-behind hints; -1 for none.
+    GzipImageSource(gzFile file, int fd, bool dropBehind) : m_file(file), m_fd(fd), m_dropBehind(dropBehind) {
+        gzbuffer(m_file, 256 * 1024);
+    }
+
+    ~GzipImageSource() override {
+        DropBehind(true);
+        gzclose(m_file);
+    }
+
+    // ISIZE in the trailer is only the size modulo 4 GiB.
+    uint64_t GetSize() const override { return IMAGE_SIZE_UNKNOWN; }
+    bool IsSequential() const override { return true; }
+
+    int64_t Read(uint64_t offset, void* buffer, size_t length) override {
+        if (offset != m_position) return -1;
+        size_t total = 0;
+        while (total < length) {
+            int got = gzread(m_file, (char*)buffer + total, (unsigned)std::min<size_t>(length - total, 1 << 30));
+            if (got < 0) return -1;
+            if (got == 0) break;
+            total += got;
+        }
+        m_position += total;
+        DropBehind(false);
+        return (int64_t)total;
+    }
+
+private:
+    // Drops the compressed bytes zlib has consumed, in batches unless `all`.
+    void DropBehind(bool all) {
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+        if (!m_dropBehind || m_fd < 0) return;
+        z_off_t consumed = gzoffset(m_file);
+        if (consumed < 0 || (!all && (uint64_t)consumed < m_dropped + DROP_BEHIND_BATCH)) return;
+        uint64_t dropTo = all ? 0 : (uint64_t)consumed / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        posix_fadvise(m_fd, (off_t)m_dropped, all ? 0 : (off_t)(dropTo - m_dropped), POSIX_FADV_DONTNEED);
+        m_dropped = dropTo;
+#else
+        (void)all;
+#endif
+    }
+
+    gzFile m_file;
+    int m_fd;
+    bool m_dropBehind;
+    uint64_t m_position = 0;
+    uint64_t m_dropped = 0;
+};
+
+#endif
+
+bool IsDecompressionSupported() {
+#ifdef INFERNO_HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+// ============================================================================
+// OPENING
+// ============================================================================
+
+static std::unique_ptr<ImageSource> OpenDirectImageSource(const std::wstring& path) {
+    std::unique_ptr<SourceFile> file(new SourceFile());
+    if (!file->Open(path, false, true)) {
+        return nullptr;
+    }
+    // Without a buffer the window cannot start; never wait for one here, as
+    // the caller may already hold pipeline buffers.
+    ArenaBuffer memory = BufferArena::Default().TryAcquire(DIRECT_BLOCK * DIRECT_BLOCKS);
+    if (!memory) {
+        return nullptr;
+    }
+    // Some file systems accept the open and refuse the reads.
+    if (file->GetSize() > 0 && file->ReadAt(0, memory.Data(), DIRECT_ALIGNMENT) < 0) {
+        return nullptr;
+    }
+    std::unique_ptr<ReadaheadWindow> window(new ReadaheadWindow(*file, std::move(memory)));
+    return std::unique_ptr<ImageSource>(new FileImageSource(std::move(file), std::move(window), false));
+}
+
+static std::unique_ptr<ImageSource> OpenPinnedImageSource(const std::wstring& path) {
+    FileIdentity identity;
+    if (!GetFileIdentity(path, identity)) {
+        return nullptr;
+    }
+    std::shared_ptr<PinnedImage> image = AcquirePinnedImage(path, identity);
+    if (!image) {
+        return nullptr;
+    }
+    std::unique_ptr<SourceFile> file;
+    if (image->loaded.load(std::memory_order_acquire) < image->size) {
+        file.reset(new SourceFile());
+        if (!file->Open(path, true, false) || file->GetSize() != image->size) {
+            return nullptr;
+        }
+    }
+    return std::unique_ptr<ImageSource>(new PinnedImageSource(std::move(image), std::move(file)));
+}
+
+// Raw image files under any policy but Buffered, stepping down to the
+// nearest policy that works.
+static std::unique_ptr<ImageSource> OpenRawImageFile(const std::wstring& path, ReadPolicy policy) {
+    ReadPolicy requested = policy;
+    std::unique_ptr<ImageSource> source;
+    if (policy == ReadPolicy::Pinned) {
+        source = OpenPinnedImageSource(path);
+        if (!source) policy = ReadPolicy::DropBehind;
+    }
+#ifdef _WIN32
+    if (policy == ReadPolicy::DropBehind) policy = ReadPolicy::Direct;
+#endif
+    if (policy == ReadPolicy::Direct) {
+        source = OpenDirectImageSource(path);
+        if (!source) policy = ReadPolicy::Sequential;
+    }
+    if (!source) {
+        std::unique_ptr<SourceFile> file(new SourceFile());
+        if (!file->Open(path, true, false)) {
+            return nullptr;
+        }
+        source.reset(new FileImageSource(std::move(file), nullptr, policy == ReadPolicy::DropBehind));
+    }
+
+    if (policy != requested) {
+        LogMessage(LogLevel::Info, "source",
+                   std::wstring(L"Reading ") + path + L" " + ReadPolicyName(policy) + L" instead of " +
+                       ReadPolicyName(requested));
+    }
+    return source;
+}
+
+std::unique_ptr<ImageSource> OpenImageSource(const std::wstring& path, std::wstring& error, ReadPolicy policy) {
+    std::unique_ptr<BlockDevice> file = OpenBlockDevice(path, false);
+    if (!file) {
+        error = L"Cannot open the image file.";
+        return nullptr;
+    }
+
+    unsigned char magic[2] = {0, 0};
+    bool gzip = file->GetGeometry().sizeBytes >= 2 && file->Read(0, magic, 2) &&
+                magic[0] == 0x1F && magic[1] == 0x8B;
+    if (!gzip) {
+        // Devices read as images keep plain reads.
+        if (policy == ReadPolicy::Buffered || !file->GetTraits().isRegularFile) {
+            return std::unique_ptr<ImageSource>(new RawImageSource(std::move(file)));
+        }
+        file.reset();
+        std::unique_ptr<ImageSource> source = OpenRawImageFile(path, policy);
+        if (!source) {
+            error = L"Cannot open the image file.";
+        }
+        return source;
+    }
+
+#ifdef INFERNO_HAVE_ZLIB
+    file.reset();
+    bool dropBehind = policy != ReadPolicy::Buffered && policy != ReadPolicy::Sequential;
+#ifdef _WIN32
+    // zlib opens the file itself, without hints.
+    gzFile stream = gzopen_w(path.c_str(), "rb");
+    int fd = -1;
+#else
+    int fd = open(WideToUtf8(path).c_str(), O_RDONLY | O_CLOEXEC);
+    gzFile stream = nullptr;
+    if (fd >= 0) {
+#ifdef POSIX_FADV_SEQUENTIAL
+        if (policy != ReadPolicy::Buffered) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        stream = gzdopen(fd, "rb");
+        if (!stream) close(fd);
+    }
+#endif
+    if (!stream) {
+        error = L"Cannot open the compressed image.";
+        return nullptr;
+    }
+    return std::unique_ptr<ImageSource>(new GzipImageSource(stream, fd, dropBehind));
+#else
+    error = L"Compressed images are not supported by this build.";
+    return nullptr;
+#endif
+}
+
+// ============================================================================
+// RANDOM ACCESS
+// ============================================================================
+
+bool ImageReader::ReadAt(uint64_t offset, void* buffer, size_t length, std::wstring& error) {
+    if (!m_source || (m_source->IsSequential() && offset < m_position)) {
+        m_source = OpenImageSource(m_path, error);
+        m_position = 0;
+        if (!m_source) return false;
+    }
+    if (m_source->IsSequential()) {
+        std::vector<uint8_t> skip(64 * 1024);
+        while (m_position < offset) {
+            size_t step = (size_t)std::min<uint64_t>(skip.size(), offset - m_position);
+            if (m_source->Read(m_position, skip.data(), step) != (int64_t)step) break;
+            m_position += step;
+        }
+    }
+    int64_t got = m_source->Read(offset, buffer, length);
+    if (got != (int64_t)length) {
+        error = L"The image is too short or unreadable at byte offset " + std::to_wstring(offset) + L".";
+        return false;
+    }
+    m_position = offset + length;
+    return true;
+}
+
+// ============================================================================
+// CACHE CONTROL
+// ============================================================================
+
+#ifdef _WIN32
+
+// Residency of a file in the Windows cache is not exposed to applications.
+int64_t GetCachedImageBytes(const std::wstring&) {
+    return -1;
+}
+
+// Opening a file unbuffered makes the cache manager flush and purge it.
+bool EvictImageFromCache(const std::wstring& path) {
+    HANDLE handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                                FILE_FLAG_NO_BUFFERING, NULL);
+    if (handle == INVALID_HANDLE_VALUE) return false;
+    CloseHandle(handle);
+    return true;
+}
+
+#else
+
+int64_t GetCachedImageBytes(const std::wstring& path) {
+    int fd = open(WideToUtf8(path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    off_t size = lseek(fd, 0, SEEK_END);
+    int64_t cached = -1;
+    void* map = size > 0 ? mmap(nullptr, (size_t)size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (size == 0) return 0;
+    if (map == MAP_FAILED) return -1;
+
+#ifdef __APPLE__
+    typedef char Residency;
+#else
+    typedef unsigned char Residency;
+#endif
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    std::vector<Residency> resident(((size_t)size + pageSize - 1) / pageSize);
+    if (mincore(map, (size_t)size, resident.data()) == 0) {
+        cached = 0;
+        for (Residency page : resident) {
+            if (page & 1) cached += (int64_t)pageSize;
+        }
+        cached = std::min<int64_t>(cached, (int64_t)size);
+    }
+    munmap(map, (size_t)size);
+    return cached;
+}
+
+bool EvictImageFromCache(const std::wstring& path) {
+#ifdef POSIX_FADV_DONTNEED
+    int fd = open(WideToUtf8(path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    close(fd);
+    return ok;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,86 @@
+// ============================================================================
+// INFERNO - Image sources (raw and compressed)
+// ============================================================================
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+static const uint64_t IMAGE_SIZE_UNKNOWN = ~0ull;
+
+// How an image file is read, chosen per job. Images are read once, front to
+// back, so the OS cache gains nothing from keeping them unless the same image
+// is flashed again soon.
+enum class ReadPolicy {
+    Buffered,       // plain cached reads
+    Sequential,     // cached reads with the OS told to read ahead aggressively
+    DropBehind,     // as Sequential, then dropped from the OS cache once consumed
+    Direct,         // uncached reads through Inferno's own readahead window
+    Pinned          // kept whole in locked process memory for later jobs (a "hot" image)
+};
+
+const wchar_t* ReadPolicyName(ReadPolicy policy);
+bool ParseReadPolicy(const std::wstring& name, ReadPolicy& policy);
+
+class ImageSource {
+public:
+    virtual ~ImageSource() = default;
+
+    // Uncompressed size, or IMAGE_SIZE_UNKNOWN when the format does not record it.
+    virtual uint64_t GetSize() const = 0;
+
+    // Sequential sources only accept reads at the current stream position.
+    virtual bool IsSequential() const = 0;
+
+    // Returns the number of bytes read (0 at end of image) or -1 on error.
+    virtual int64_t Read(uint64_t offset, void* buffer, size_t length) = 0;
+};
+
+// Opens a raw image, or a gzip-compressed one when built with zlib
+// (detected by content, not extension).
+//
+// `policy` falls back to the nearest one the file and platform support:
+// Direct becomes Sequential on file systems that refuse uncached reads,
+// Pinned becomes DropBehind when the image does not fit in a quarter of RAM,
+// and compressed images (read through zlib) get at most DropBehind. Windows
+// has no drop-behind hint, so DropBehind reads it Direct.
+std::unique_ptr<ImageSource> OpenImageSource(const std::wstring& path, std::wstring& error,
+                                             ReadPolicy policy = ReadPolicy::Buffered);
+
+// Images held in memory by Pinned sources. An image stays pinned after its
+// sources close, until it changes on disk, room is needed for another, or
+// it is released here.
+uint64_t GetPinnedImageBytes();
+void ReleasePinnedImages();
+
+// Releases the pinned images whose path is not in `inUse`, typically the
+// images of the jobs still queued or running.
+void ReleaseUnusedPinnedImages(const std::vector<std::wstring>& inUse);
+
+// Bytes of `path` in the OS file cache, or -1 where this cannot be measured.
+int64_t GetCachedImageBytes(const std::wstring& path);
+
+// Drops the clean cached pages of `path`, so the next read comes from disk.
+bool EvictImageFromCache(const std::wstring& path);
+
+bool IsDecompressionSupported();
+
+// Random reads over any image source, for parsing image metadata.
+// Sequential (compressed) sources are reopened when a read goes backwards
+// and skipped forward otherwise.
+class ImageReader {
+public:
+    explicit ImageReader(const std::wstring& path) : m_path(path) {}
+
+    // Fails unless all `length` bytes are read.
+    bool ReadAt(uint64_t offset, void* buffer, size_t length, std::wstring& error);
+
+private:
+    std::wstring m_path;
+    std::unique_ptr<ImageSource> m_source;
+    uint64_t m_position = 0;
+};
@@ -0,0 +1,1185 @@
+// ============================================================================
+// INFERNO - Image write pipeline
+// ============================================================================
+
+#include "ImageWriter.h"
+#include "AsyncIo.h"
+#include "BufferArena.h"
+#include "Checksum.h"
+#include "ImageSource.h"
+#include "Log.h"
+#include "Trace.h"
+#include "WriteController.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// ============================================================================
+// PIPELINE
+// ============================================================================
+
+struct PendingChunk {
+    ArenaBuffer* buffer;
+    uint64_t offset;
+    size_t length;
+};
+
+// Applied by a pipeline worker to each sector-padded chunk of the stream.
+// `scratch` is a chunk-sized, sector-aligned work area that travels with the
+// chunk, or null when the pipeline was not asked for one.
+using ChunkAction = std::function<bool(uint64_t offset, uint8_t* data, uint8_t* scratch,
+                                       size_t length, std::wstring& error)>;
+
+// One thread reads the source sequentially while `queueDepth` workers apply
+// `action` to the chunks it produces. `length` may be IMAGE_SIZE_UNKNOWN, in
+// which case the stream ends when the source returns 0. `actionName` labels
+// the per-chunk trace spans. Chunk sizes are rounded up to `alignment`, the
+// tail is padded to `sectorSize`.
+//
+// Chunk buffers come from the shared BufferArena. The first is waited for;
+// more (up to two per worker, so the reader can run ahead of the device) are
+// taken only while the arena's memory cap allows, so many concurrent
+// pipelines share bounded memory instead of each holding a full set.
+//
+// With a `controller`, buffers and workers are sized for its largest
+// settings and each chunk is read at its current chunk size and handed out
+// while fewer than its current queue depth are in flight.
+static bool RunChunkPipeline(uint64_t length, uint32_t sectorSize, uint32_t alignment, const ChunkSource& source,
+                             const WriterParams& params, const char* actionName, bool withScratch,
+                             const ChunkAction& action, const ProgressCallback& progress,
+                             uint64_t* bytesProcessed, std::wstring& error,
+                             WriteController* controller = nullptr) {
+    if (params.chunkSize == 0 || params.queueDepth == 0) {
+        error = L"Invalid writer parameters.";
+        return false;
+    }
+
+    auto roundToSector = [&](uint32_t size) { return ((size_t)size + alignment - 1) / alignment * alignment; };
+    size_t chunkSize = roundToSector(controller ? std::max(params.chunkSize, controller->GetMaxChunkSize())
+                                                : params.chunkSize);
+    uint32_t workerCount = controller ? std::max(params.queueDepth, controller->GetMaxQueueDepth())
+                                      : params.queueDepth;
+    auto currentDepth = [&] { return controller ? controller->GetQueueDepth() : params.queueDepth; };
+    bool lengthKnown = (length != IMAGE_SIZE_UNKNOWN);
+    uint64_t progressTotal = lengthKnown ? length : 0;
+
+    BufferArena& arena = BufferArena::Default();
+    size_t bufferSize = withScratch ? 2 * chunkSize : chunkSize;
+    size_t bufferLimit = (size_t)workerCount * 2;
+    std::vector<ArenaBuffer> buffers;
+    std::vector<ArenaBuffer*> freeBuffers;
+    buffers.reserve(bufferLimit);
+    buffers.push_back(arena.Acquire(bufferSize));
+    if (!buffers.back()) {
+        error = L"Not enough buffer memory for " + std::to_wstring(bufferSize) + L"-byte chunks.";
+        return false;
+    }
+    freeBuffers.push_back(&buffers.back());
+
+    std::mutex lock;
+    std::condition_variable chunkReady;
+    std::condition_variable bufferFree;
+    std::deque<PendingChunk> pending;
+    std::atomic<bool> failed(false);
+    bool readerDone = false;
+    uint32_t inFlight = 0;
+    uint64_t processed = 0;
+    std::wstring pipelineError;
+    TraceSpan pipelineSpan("pipeline", actionName);
+
+    auto workerLoop = [&](uint32_t worker) {
+        TraceSetThreadName("pipeline worker");
+        for (;;) {
+            PendingChunk chunk;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                auto ready = [&] {
+                    return failed || (pending.empty() ? readerDone : inFlight < currentDepth());
+                };
+                if (!ready()) {
+                    // The device is waiting on the source (or on the controller's queue limit).
+                    TraceSpan stall("stall", "waiting for source data");
+                    chunkReady.wait(guard, ready);
+                }
+                if (pending.empty() || failed) return;
+                chunk = pending.front();
+                pending.pop_front();
+                inFlight++;
+                TraceCounter("queued chunks", (int64_t)pending.size());
+            }
+
+            std::wstring actionError;
+            bool ok;
+            {
+                TraceSpan span("io", actionName);
+                span.SetArg("offset", (int64_t)chunk.offset);
+                span.SetArg("bytes", (int64_t)chunk.length);
+                bool logChunk = IsLogging(LogLevel::Debug);
+                bool timeChunk = logChunk || controller;
+                auto chunkStart = timeChunk ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+                uint8_t* data = chunk.buffer->Data();
+                ok = action(chunk.offset, data, withScratch ? data + chunkSize : nullptr, chunk.length,
+                            actionError);
+                if (timeChunk) {
+                    std::chrono::duration<double> taken = std::chrono::steady_clock::now() - chunkStart;
+                    if (controller && ok) controller->OnChunkWritten(chunk.length, taken.count());
+                    if (logChunk) {
+                        LogEvent(LogLevel::Debug, "pipeline", actionName,
+                                 {{"offset", (int64_t)chunk.offset}, {"bytes", (int64_t)chunk.length},
+                                  {"worker", worker}, {"us", (int64_t)(taken.count() * 1e6)}});
+                    }
+                }
+            }
+            if (!ok) {
+                LogMessage(LogLevel::Error, "pipeline", actionError);
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (!ok && !failed) {
+                failed = true;
+                pipelineError = actionError;
+            }
+            processed += chunk.length;
+            inFlight--;
+            TraceCounter("bytes processed", (int64_t)processed);
+            freeBuffers.push_back(chunk.buffer);
+            bufferFree.notify_one();
+            // Under a controller, workers also wait for a free slot in its
+            // queue; once the stream is drained every one of them must exit.
+            if (!ok || (controller && readerDone && pending.empty())) chunkReady.notify_all();
+            else if (controller) chunkReady.notify_one();
+        }
+    };
+
+    if (controller) {
+        controller->Begin();
+    }
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < workerCount; i++) {
+        workers.emplace_back(workerLoop, i);
+    }
+
+    uint64_t offset = 0;
+    while (offset < length && !failed) {
+        ArenaBuffer* buffer;
+        uint64_t done;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (freeBuffers.empty() && buffers.size() < std::min<size_t>(bufferLimit, 2 * currentDepth())) {
+                ArenaBuffer extra = arena.TryAcquire(bufferSize);
+                if (extra) {
+                    buffers.push_back(std::move(extra));
+                    freeBuffers.push_back(&buffers.back());
+                }
+            }
+            auto available = [&] { return !freeBuffers.empty() || failed; };
+            if (!available()) {
+                // Every buffer is queued or in flight: the device is the bottleneck.
+                TraceSpan stall("stall", "waiting for free buffer");
+                bufferFree.wait(guard, available);
+            }
+            if (failed) break;
+            buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+            done = processed;
+        }
+
+        if (progress && !progress(done, progressTotal)) {
+            std::lock_guard<std::mutex> guard(lock);
+            failed = true;
+            pipelineError = L"Operation cancelled.";
+            break;
+        }
+
+        size_t readSize = controller ? roundToSector(controller->GetChunkSize()) : chunkSize;
+        size_t want = (size_t)std::min<uint64_t>(readSize, length - offset);
+        int64_t got;
+        {
+            TraceSpan span("io", "source read");
+            span.SetArg("offset", (int64_t)offset);
+            got = source(offset, buffer->Data(), want);
+            span.SetArg("bytes", got);
+        }
+        if (got == 0 && !lengthKnown) {
+            std::lock_guard<std::mutex> guard(lock);
+            freeBuffers.push_back(buffer);
+            break;
+        }
+        if (got <= 0) {
+            std::lock_guard<std::mutex> guard(lock);
+            failed = true;
+            pipelineError = (got == 0) ? L"Source ended before the expected length."
+                                       : L"Read failed at source offset " + std::to_wstring(offset) + L".";
+            break;
+        }
+
+        // Devices only accept whole sectors; pad the tail with zeros.
+        size_t padded = ((size_t)got + sectorSize - 1) / sectorSize * sectorSize;
+        memset(buffer->Data() + got, 0, padded - (size_t)got);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.push_back({buffer, offset, padded});
+            TraceCounter("queued chunks", (int64_t)pending.size());
+        }
+        chunkReady.notify_one();
+        offset += (uint64_t)got;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        readerDone = true;
+    }
+    chunkReady.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    if (failed) {
+        error = pipelineError;
+        return false;
+    }
+    LogEvent(LogLevel::Info, "pipeline", actionName,
+             {{"bytes", (int64_t)processed}, {"chunk", (int64_t)chunkSize}, {"queue_depth", params.queueDepth}});
+    if (bytesProcessed) {
+        *bytesProcessed = processed;
+    }
+    if (progress) {
+        progress(offset, lengthKnown ? length : offset);
+    }
+    return true;
+}
+
+bool RunWritePipeline(BlockDevice& target, uint64_t targetOffset, uint64_t length,
+                      const ChunkSource& source, const WriterParams& params,
+                      const ProgressCallback& progress, WriteStats* stats, std::wstring& error,
+                      const ChunkTransform& transform) {
+    uint32_t sectorSize = target.GetGeometry().logicalSectorSize;
+    if (targetOffset % sectorSize != 0) {
+        error = L"Write offset is not sector aligned.";
+        return false;
+    }
+    // Whole chunks cover whole physical sectors; an offset that splits one
+    // makes a 512e drive read-modify-write at every chunk boundary.
+    uint32_t alignment = GetWriteAlignment(target.GetGeometry());
+    if (targetOffset % alignment != 0) {
+        LogEvent(LogLevel::Warning, "writer", "unaligned_write",
+                 {{"offset", (int64_t)targetOffset}, {"physical_sector", (int64_t)alignment}});
+        alignment = sectorSize;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    ChunkAction write = [&](uint64_t offset, uint8_t* data, uint8_t*, size_t chunkLength,
+                            std::wstring& chunkError) -> bool {
+        if (transform) {
+            TraceSpan span("cpu", "transform");
+            transform(offset, data, chunkLength);
+        }
+        if (!target.Write(targetOffset + offset, data, chunkLength)) {
+            chunkError = L"Write failed at byte offset " + std::to_wstring(targetOffset + offset) + L".";
+            return false;
+        }
+        if (params.controller && params.controller->TakeFlush(chunkLength)) {
+            TraceSpan span("io", "flush");
+            if (!target.Flush()) {
+                chunkError = L"Failed to flush the target device.";
+                return false;
+            }
+        }
+        return true;
+    };
+
+    uint64_t bytesWritten = 0;
+    if (!RunChunkPipeline(length, sectorSize, alignment, source, params, "write", false, write, progress,
+                          &bytesWritten, error, params.controller)) {
+        return false;
+    }
+    bool flushed;
+    {
+        TraceSpan span("io", "flush");
+        flushed = target.Flush();
+    }
+    if (!flushed) {
+        error = L"Failed to flush the target device.";
+        return false;
+    }
+
+    if (stats) {
+        stats->bytesWritten = bytesWritten;
+        stats->elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    }
+    return true;
+}
+
+// Reads `length` bytes of `target` at `deviceOffset` into `scratch` and
+// compares them with `data`.
+static bool CompareWithDevice(BlockDevice& target, uint64_t deviceOffset, const uint8_t* data, uint8_t* scratch,
+                              size_t length, uint64_t* mismatchOffset, std::wstring& error) {
+    if (!target.Read(deviceOffset, scratch, length)) {
+        error = L"Read-back failed at byte offset " + std::to_wstring(deviceOffset) + L".";
+        return false;
+    }
+    if (memcmp(scratch, data, length) != 0) {
+        size_t first = 0;
+        while (first < length && scratch[first] == data[first]) first++;
+        if (mismatchOffset) *mismatchOffset = deviceOffset + first;
+        error = L"Data mismatch at byte offset " + std::to_wstring(deviceOffset + first) + L".";
+        return false;
+    }
+    return true;
+}
+
+bool RunVerifyPipeline(BlockDevice& target, uint64_t targetOffset, uint64_t length,
+                       const ChunkSource& source, const WriterParams& params,
+                       const ProgressCallback& progress, uint64_t* mismatchOffset, std::wstring& error,
+                       const ChunkTransform& transform) {
+    uint32_t sectorSize = target.GetGeometry().logicalSectorSize;
+    if (targetOffset % sectorSize != 0) {
+        error = L"Verify offset is not sector aligned.";
+        return false;
+    }
+
+    ChunkAction compare = [&](uint64_t offset, uint8_t* data, uint8_t* scratch, size_t chunkLength,
+                              std::wstring& chunkError) -> bool {
+        if (transform) {
+            TraceSpan span("cpu", "transform");
+            transform(offset, data, chunkLength);
+        }
+        return CompareWithDevice(target, targetOffset + offset, data, scratch, chunkLength, mismatchOffset,
+                                 chunkError);
+    };
+
+    return RunChunkPipeline(length, sectorSize, sectorSize, source, params, "verify", true, compare, progress, nullptr,
+                            error);
+}
+
+// ============================================================================
+// FAN-OUT PIPELINE
+// ============================================================================
+
+bool RunFanOutWritePipeline(const std::vector<BlockDevice*>& targets, uint64_t length, const ChunkSource& source,
+                            const WriterParams& params, const ProgressCallback& progress, WriteStats* stats,
+                            std::wstring& error, AsyncBackend backend) {
+    if (targets.empty() || params.chunkSize == 0 || params.queueDepth == 0) {
+        error = L"Invalid writer parameters.";
+        return false;
+    }
+    uint32_t sectorSize = 512;
+    uint32_t alignment = 512;
+    for (BlockDevice* target : targets) {
+        sectorSize = std::max(sectorSize, target->GetGeometry().logicalSectorSize);
+        alignment = std::max(alignment, GetWriteAlignment(target->GetGeometry()));
+    }
+    // As in RunChunkPipeline, a controller's largest settings size the buffers.
+    WriteController* controller = params.controller;
+    auto roundToSector = [&](uint32_t size) { return ((size_t)size + alignment - 1) / alignment * alignment; };
+    size_t chunkSize = roundToSector(controller ? std::max(params.chunkSize, controller->GetMaxChunkSize())
+                                                : params.chunkSize);
+    uint32_t maxDepth = controller ? std::max(params.queueDepth, controller->GetMaxQueueDepth()) : params.queueDepth;
+    bool lengthKnown = (length != IMAGE_SIZE_UNKNOWN);
+    uint64_t progressTotal = lengthKnown ? length : 0;
+    size_t targetCount = targets.size();
+    auto startTime = std::chrono::steady_clock::now();
+
+    // As in RunChunkPipeline: wait for one buffer, take the rest if the cap allows.
+    BufferArena& arena = BufferArena::Default();
+    std::vector<ArenaBuffer> buffers;
+    buffers.push_back(arena.Acquire(chunkSize));
+    if (!buffers.back()) {
+        error = L"Not enough buffer memory for " + std::to_wstring(chunkSize) + L"-byte chunks.";
+        return false;
+    }
+    while (buffers.size() < (size_t)maxDepth * 2) {
+        ArenaBuffer extra = arena.TryAcquire(chunkSize);
+        if (!extra) break;
+        buffers.push_back(std::move(extra));
+    }
+
+    // Every buffer can be in flight to every target at once, plus one flush
+    // per target for a controller.
+    size_t requestSlots = buffers.size() + (controller ? 1 : 0);
+    std::unique_ptr<AsyncBlockIo> io =
+        CreateAsyncBlockIo(targets, (uint32_t)(requestSlots * targetCount), error, backend);
+    if (!io) {
+        return false;
+    }
+    std::vector<std::pair<void*, size_t>> registered;
+    for (const ArenaBuffer& buffer : buffers) {
+        registered.push_back({buffer.Data(), buffer.Size()});
+    }
+    io->RegisterBuffers(registered);
+    TraceSpan pipelineSpan("pipeline", "fan-out write");
+
+    std::vector<size_t> freeBuffers;
+    for (size_t i = buffers.size(); i > 0; i--) freeBuffers.push_back(i - 1);
+    std::vector<size_t> chunkLength(buffers.size(), 0);
+    std::vector<size_t> pendingWrites(buffers.size(), 0);
+    std::vector<std::chrono::steady_clock::time_point> submitted(buffers.size());
+    std::vector<bool> flushing(targetCount, false);
+    std::vector<std::wstring> targetErrors(targetCount);
+    size_t liveTargets = targetCount;
+    std::vector<AsyncCompletion> completions(io->GetQueueDepth());
+
+    // One thread reads the source and keeps every target's writes in flight;
+    // a target that fails is dropped and the others carry on.
+    // Flushes the controller asks for mid-stream are tagged past the writes.
+    const uint64_t flushTag = (uint64_t)buffers.size() * targetCount;
+    auto handleCompletions = [&](size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            bool flush = completions[i].userData >= flushTag;
+            size_t buffer = (size_t)(completions[i].userData / targetCount);
+            size_t target = (size_t)(flush ? completions[i].userData - flushTag : completions[i].userData % targetCount);
+            if (!completions[i].ok && targetErrors[target].empty()) {
+                targetErrors[target] = (flush ? L"Failed to flush " + targets[target]->GetPath() :
+                                       L"Write failed on " + targets[target]->GetPath()) + L" (error " +
+                                       std::to_wstring(completions[i].error) + L").";
+                LogMessage(LogLevel::Error, "pipeline", targetErrors[target]);
+                liveTargets--;
+            }
+            if (flush) {
+                flushing[target] = false;
+                continue;
+            }
+            if (--pendingWrites[buffer] == 0) {
+                freeBuffers.push_back(buffer);
+                if (controller) {
+                    std::chrono::duration<double> taken = std::chrono::steady_clock::now() - submitted[buffer];
+                    controller->OnChunkWritten(chunkLength[buffer], taken.count());
+                }
+            }
+        }
+        TraceCounter("requests in flight", (int64_t)io->GetInFlight());
+    };
+
+    auto mayRead = [&] {
+        return !freeBuffers.empty() &&
+               (!controller || buffers.size() - freeBuffers.size() < 2 * (size_t)controller->GetQueueDepth());
+    };
+
+    if (controller) {
+        controller->Begin();
+    }
+    uint64_t offset = 0;
+    bool sourceDone = lengthKnown && length == 0;
+    std::wstring pipelineError;
+    while (true) {
+        while (!sourceDone && pipelineError.empty() && mayRead()) {
+            if (liveTargets == 0) {
+                pipelineError = L"Every target failed.";
+                break;
+            }
+            if (progress && !progress(offset, progressTotal)) {
+                pipelineError = L"Operation cancelled.";
+                break;
+            }
+            size_t buffer = freeBuffers.back();
+            size_t readSize = controller ? roundToSector(controller->GetChunkSize()) : chunkSize;
+            size_t want = (size_t)std::min<uint64_t>(readSize, length - offset);
+            int64_t got;
+            {
+                TraceSpan span("io", "source read");
+                span.SetArg("offset", (int64_t)offset);
+                got = source(offset, buffers[buffer].Data(), want);
+            }
+            if (got == 0 && !lengthKnown) {
+                sourceDone = true;
+                break;
+            }
+            if (got <= 0) {
+                pipelineError = (got == 0) ? L"Source ended before the expected length."
+                                           : L"Read failed at source offset " + std::to_wstring(offset) + L".";
+                break;
+            }
+            freeBuffers.pop_back();
+
+            size_t padded = ((size_t)got + sectorSize - 1) / sectorSize * sectorSize;
+            memset(buffers[buffer].Data() + got, 0, padded - (size_t)got);
+            chunkLength[buffer] = padded;
+            submitted[buffer] = std::chrono::steady_clock::now();
+            for (size_t target = 0; target < targetCount; target++) {
+                if (!targetErrors[target].empty()) continue;
+                AsyncRequest request;
+                request.op = AsyncOp::Write;
+                request.device = (uint32_t)target;
+                request.offset = offset;
+                request.buffer = buffers[buffer].Data();
+                request.length = padded;
+                request.userData = buffer * targetCount + target;
+                io->Submit(request);
+                pendingWrites[buffer]++;
+            }
+            offset += (uint64_t)got;
+            if (lengthKnown && offset >= length) sourceDone = true;
+            if (controller && controller->TakeFlush(padded)) {
+                for (size_t target = 0; target < targetCount; target++) {
+                    if (!targetErrors[target].empty() || flushing[target]) continue;
+                    AsyncRequest request;
+                    request.op = AsyncOp::Flush;
+                    request.device = (uint32_t)target;
+                    request.userData = flushTag + target;
+                    flushing[target] = io->Submit(request);
+                }
+            }
+
+            // Hand the kernel what is queued without waiting.
+            handleCompletions(io->Reap(completions.data(), completions.size(), 0));
+        }
+        if (io->GetInFlight() == 0) break;
+        TraceSpan stall("stall", "waiting for device");
+        handleCompletions(io->Reap(completions.data(), completions.size(), 1));
+    }
+
+    if (pipelineError.empty()) {
+        TraceSpan span("io", "flush");
+        for (size_t target = 0; target < targetCount; target++) {
+            if (!targetErrors[target].empty()) continue;
+            AsyncRequest request;
+            request.op = AsyncOp::Flush;
+            request.device = (uint32_t)target;
+            request.userData = target;
+            io->Submit(request);
+        }
+        while (io->GetInFlight() > 0) {
+            size_t count = io->Reap(completions.data(), completions.size(), 1);
+            for (size_t i = 0; i < count; i++) {
+                size_t target = (size_t)completions[i].userData;
+                if (!completions[i].ok && targetErrors[target].empty()) {
+                    targetErrors[target] = L"Failed to flush " + targets[target]->GetPath() + L".";
+                }
+            }
+        }
+    }
+    for (const std::wstring& targetError : targetErrors) {
+        if (pipelineError.empty() && !targetError.empty()) pipelineError = targetError;
+    }
+    if (!pipelineError.empty()) {
+        error = pipelineError;
+        return false;
+    }
+
+    LogEvent(LogLevel::Info, "pipeline", "fan-out write",
+             {{"bytes", (int64_t)offset}, {"targets", (int64_t)targetCount}, {"chunk", (int64_t)chunkSize},
+              {"queue_depth", (int64_t)io->GetQueueDepth()}, {"buffers", (int64_t)buffers.size()}});
+    if (stats) {
+        stats->bytesWritten = offset;
+        stats->elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    }
+    if (progress) {
+        progress(offset, lengthKnown ? length : offset);
+    }
+    return true;
+}
+
+// ============================================================================
+// IMAGE FILES
+// ============================================================================
+
+static ChunkSource MakeImageChunkSource(ImageSource& image) {
+    return [&image](uint64_t offset, void* buffer, size_t length) -> int64_t {
+        return image.Read(offset, buffer, length);
+    };
+}
+
+bool WriteImage(const std::wstring& imagePath, BlockDevice& target, const WriterParams& params,
+                const ProgressCallback& progress, WriteStats* stats, std::wstring& error,
+                const ChunkTransform& transform) {
+    std::unique_ptr<ImageSource> image = OpenImageSource(imagePath, error, params.readPolicy);
+    if (!image) {
+        return false;
+    }
+
+    uint64_t imageSize = image->GetSize();
+    const DeviceGeometry& geometry = target.GetGeometry();
+    if (imageSize != IMAGE_SIZE_UNKNOWN && geometry.sizeBytes > 0 && imageSize > geometry.sizeBytes) {
+        error = L"The image is larger than the target device.";
+        return false;
+    }
+    return RunWritePipeline(target, 0, imageSize, MakeImageChunkSource(*image), params, progress, stats, error,
+                            transform);
+}
+
+bool WriteImageToDevices(const std::wstring& imagePath, const std::vector<BlockDevice*>& targets,
+                         const WriterParams& params, const ProgressCallback& progress, WriteStats* stats,
+                         std::wstring& error) {
+    std::unique_ptr<ImageSource> image = OpenImageSource(imagePath, error, params.readPolicy);
+    if (!image) {
+        return false;
+    }
+
+    uint64_t imageSize = image->GetSize();
+    for (BlockDevice* target : targets) {
+        uint64_t capacity = target->GetGeometry().sizeBytes;
+        if (imageSize != IMAGE_SIZE_UNKNOWN && capacity > 0 && imageSize > capacity) {
+            error = L"The image is larger than " + target->GetPath() + L".";
+            return false;
+        }
+    }
+    return RunFanOutWritePipeline(targets, imageSize, MakeImageChunkSource(*image), params, progress, stats, error);
+}
+
+bool VerifyImage(const std::wstring& imagePath, BlockDevice& target, const WriterParams& params,
+                 const ProgressCallback& progress, uint64_t* mismatchOffset, std::wstring& error,
+                 const ChunkTransform& transform) {
+    std::unique_ptr<ImageSource> image = OpenImageSource(imagePath, error, params.readPolicy);
+    if (!image) {
+        return false;
+    }
+    return RunVerifyPipeline(target, 0, image->GetSize(), MakeImageChunkSource(*image), params,
+                             progress, mismatchOffset, error, transform);
+}
+
+bool HashImage(const std::wstring& imagePath, uint8_t digest[32], const ProgressCallback& progress,
+               std::wstring& error) {
+    ImageDigest result;
+    if (!HashImage(imagePath, 0, result, progress, error)) {
+        return false;
+    }
+    memcpy(digest, result.sha256, sizeof(result.sha256));
+    return true;
+}
+
+bool HashImage(const std::wstring& imagePath, uint32_t chunkSize, ImageDigest& digest,
+               const ProgressCallback& progress, std::wstring& error, ReadPolicy policy) {
+    if (chunkSize % 4096 != 0) {
+        error = L"Invalid digest chunk size.";
+        return false;
+    }
+    std::unique_ptr<ImageSource> image = OpenImageSource(imagePath, error, policy);
+    if (!image) {
+        return false;
+    }
+
+    uint64_t size = image->GetSize();
+    uint64_t total = (size == IMAGE_SIZE_UNKNOWN) ? 0 : size;
+    ArenaBuffer buffer = BufferArena::Default().Acquire(4 * 1024 * 1024);
+    if (!buffer) {
+        error = L"Not enough buffer memory.";
+        return false;
+    }
+    digest = ImageDigest();
+    digest.chunkSize = chunkSize;
+    Sha256 hash;
+    Sha256 chunkHash;
+    uint64_t offset = 0;
+    for (;;) {
+        int64_t got = image->Read(offset, buffer.Data(), buffer.Size());
+        if (got < 0) {
+            error = L"Read failed at source offset " + std::to_wstring(offset) + L".";
+            return false;
+        }
+        if (got == 0) break;
+        hash.Update(buffer.Data(), (size_t)got);
+
+        // Reads need not line up with chunks; split them at chunk boundaries.
+        for (size_t used = 0; chunkSize && used < (size_t)got;) {
+            size_t piece = (size_t)std::min<uint64_t>((uint64_t)got - used, chunkSize - (offset + used) % chunkSize);
+            chunkHash.Update(buffer.Data() + used, piece);
+            used += piece;
+            if ((offset + used) % chunkSize == 0) {
+                digest.chunks.emplace_back();
+                chunkHash.Final(digest.chunks.back().data());
+                chunkHash = Sha256();
+            }
+        }
+        offset += (uint64_t)got;
+        if (progress && !progress(offset, total)) {
+            error = L"Operation cancelled.";
+            return false;
+        }
+    }
+    if (chunkSize && offset % chunkSize != 0) {
+        digest.chunks.emplace_back();
+        chunkHash.Final(digest.chunks.back().data());
+    }
+    hash.Final(digest.sha256);
+    digest.length = offset;
+    return true;
+}
+
+static bool CheckDigestUsable(BlockDevice& target, const ImageDigest& digest, std::wstring& error) {
+    uint32_t sectorSize = target.GetGeometry().logicalSectorSize;
+    uint64_t expectedChunks = digest.chunkSize ? (digest.length + digest.chunkSize - 1) / digest.chunkSize : 0;
+    if (digest.chunkSize == 0 || digest.chunkSize % sectorSize != 0 || digest.chunks.size() != expectedChunks) {
+        error = L"The image digest has no usable chunk digests.";
+        return false;
+    }
+    if (target.GetGeometry().sizeBytes > 0 && digest.length > target.GetGeometry().sizeBytes) {
+        error = L"The image is larger than the target device.";
+        return false;
+    }
+    return true;
+}
+
+// Reads the chunk at image offset `offset` from `target` into `data` and
+// checks it against its digest.
+static bool CheckChunkDigest(BlockDevice& target, const ImageDigest& digest, uint64_t offset, uint8_t* data,
+                             size_t length, uint64_t* mismatchOffset, std::wstring& error) {
+    if (!target.Read(offset, data, length)) {
+        error = L"Read-back failed at byte offset " + std::to_wstring(offset) + L".";
+        return false;
+    }
+    ChunkDigest actual;
+    {
+        TraceSpan span("cpu", "hash");
+        Sha256 hash;
+        hash.Update(data, (size_t)std::min<uint64_t>(length, digest.length - offset));
+        hash.Final(actual.data());
+    }
+    if (actual != digest.chunks[(size_t)(offset / digest.chunkSize)]) {
+        if (mismatchOffset) *mismatchOffset = offset;
+        error = L"Data mismatch in the chunk at byte offset " + std::to_wstring(offset) + L".";
+        return false;
+    }
+    return true;
+}
+
+bool VerifyImageDigest(BlockDevice& target, const ImageDigest& digest, const WriterParams& params,
+                       const ProgressCallback& progress, uint64_t* mismatchOffset, std::wstring& error) {
+    if (!CheckDigestUsable(target, digest, error)) {
+        return false;
+    }
+    uint32_t sectorSize = target.GetGeometry().logicalSectorSize;
+
+    // Nothing comes from the source: each worker reads its chunk from the
+    // device itself, so reads stay `queueDepth` deep.
+    ChunkSource none = [](uint64_t, void*, size_t length) -> int64_t { return (int64_t)length; };
+    ChunkAction check = [&](uint64_t offset, uint8_t* data, uint8_t*, size_t chunkLength,
+                            std::wstring& chunkError) -> bool {
+        return CheckChunkDigest(target, digest, offset, data, chunkLength, mismatchOffset, chunkError);
+    };
+
+    WriterParams chunked = params;
+    chunked.chunkSize = digest.chunkSize;
+    return RunChunkPipeline(digest.length, sectorSize, sectorSize, none, chunked, "verify digest", false, check,
+                            progress, nullptr, error);
+}
+
+// ============================================================================
+// SAMPLED VERIFICATION
+// ============================================================================
+
+// splitmix64, so that a seed reproduces a sample on any platform.
+static uint64_t NextRandom(uint64_t& state) {
+    uint64_t x = (state += 0x9E3779B97F4A7C15ull);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// The most damaged chunks among `population` that a clean sample of
+// `samples` of them, drawn without replacement, still had a chance above
+// 1 - `confidence` of missing entirely.
+static uint64_t UndetectedBound(uint64_t population, uint64_t samples, double confidence) {
+    if (samples >= population) {
+        return 0;
+    }
+    double limit = std::log(1.0 - confidence);
+    auto logMissed = [&](uint64_t damaged) {
+        double sum = 0.0;
+        for (uint64_t i = 0; i < samples; i++) {
+            sum += std::log((double)(population - damaged - i) / (double)(population - i));
+        }
+        return sum;
+    };
+    // Missing gets less likely as damage grows, and impossible at `high`.
+    uint64_t low = 0;
+    uint64_t high = population - samples + 1;
+    while (high - low > 1) {
+        uint64_t middle = low + (high - low) / 2;
+        if (logMissed(middle) > limit) low = middle;
+        else high = middle;
+    }
+    return low;
+}
+
+std::vector<uint64_t> PlanSampledVerify(uint64_t length, uint32_t chunkSize, const std::vector<ByteRange>& metadata,
+                                        const SampledVerifyParams& sampling, SampledVerifyReport& report) {
+    report = SampledVerifyReport();
+    report.chunkSize = chunkSize;
+    uint64_t chunks = chunkSize ? (length + chunkSize - 1) / chunkSize : 0;
+
+    std::vector<bool> required((size_t)chunks);
+    for (const ByteRange& region : metadata) {
+        if (region.length == 0 || region.offset >= length) continue;
+        uint64_t end = std::min(length, region.offset + region.length);
+        for (uint64_t chunk = region.offset / chunkSize; chunk <= (end - 1) / chunkSize; chunk++) {
+            required[(size_t)chunk] = true;
+        }
+    }
+    std::vector<uint64_t> selected;
+    std::vector<uint64_t> data;
+    for (uint64_t chunk = 0; chunk < chunks; chunk++) {
+        (required[(size_t)chunk] ? selected : data).push_back(chunk);
+    }
+
+    // Damage to a fraction f of the chunks escapes n draws with chance at
+    // most (1 - f)^n.
+    double confidence = std::min(std::max(sampling.confidence, 0.5), 0.999999);
+    double fraction = std::min(std::max(sampling.detectFraction, 1e-6), 1.0);
+    uint64_t wanted = fraction >= 1.0 ? 1 : (uint64_t)std::ceil(std::log(1.0 - confidence) / std::log(1.0 - fraction));
+    uint64_t samples = std::min<uint64_t>(wanted, data.size());
+
+    uint64_t seed = sampling.seed;
+    if (seed == 0) {
+        std::random_device device;
+        seed = ((uint64_t)device() << 32 | device()) | 1;
+    }
+    // A partial Fisher-Yates shuffle leaves the sample at the front.
+    uint64_t state = seed;
+    for (uint64_t i = 0; i < samples; i++) {
+        uint64_t j = i + NextRandom(state) % (data.size() - i);
+        std::swap(data[(size_t)i], data[(size_t)j]);
+    }
+    selected.insert(selected.end(), data.begin(), data.begin() + (size_t)samples);
+    std::sort(selected.begin(), selected.end());
+
+    report.seed = seed;
+    report.metadataChunks = selected.size() - samples;
+    report.dataChunks = data.size();
+    report.sampledChunks = samples;
+    for (uint64_t chunk : selected) {
+        report.bytesVerified += std::min<uint64_t>(chunkSize, length - chunk * chunkSize);
+    }
+    report.coverage = length ? (double)report.bytesVerified / length : 1.0;
+    report.confidence = confidence;
+    report.undetectedChunks = UndetectedBound(data.size(), samples, confidence);
+    report.undetectedFraction = data.empty() ? 0.0 : (double)report.undetectedChunks / data.size();
+    return selected;
+}
+
+// The planned chunks laid end to end. The pipelines stream this and map
+// each chunk back to its place in the image.
+struct SampledStream {
+    const std::vector<uint64_t>& chunks;
+    uint32_t chunkSize;
+    uint64_t imageLength;
+
+    uint64_t ToImage(uint64_t offset) const {
+        return chunks[(size_t)(offset / chunkSize)] * chunkSize + offset % chunkSize;
+    }
+
+    uint64_t Length() const {
+        if (chunks.empty()) return 0;
+        uint64_t last = chunks.back() * chunkSize;
+        return (chunks.size() - 1) * (uint64_t)chunkSize + std::min<uint64_t>(chunkSize, imageLength - last);
+    }
+};
+
+static void LogSampledVerify(const SampledVerifyReport& report) {
+    LogEvent(LogLevel::Info, "verify", "sampled",
+             {{"seed", (int64_t)report.seed}, {"metadata_chunks", (int64_t)report.metadataChunks},
+              {"sampled_chunks", (int64_t)report.sampledChunks}, {"data_chunks", (int64_t)report.dataChunks},
+              {"undetected_chunks", (int64_t)report.undetectedChunks}});
+}
+
+bool VerifyImageSampled(const std::wstring& imagePath, BlockDevice& target, const std::vector<ByteRange>& metadata,
+                        const SampledVerifyParams& sampling, const WriterParams& params,
+                        const ProgressCallback& progress, SampledVerifyReport* report, uint64_t* mismatchOffset,
+                        std::wstring& error, const ChunkTransform& transform) {
+    uint32_t sectorSize = target.GetGeometry().logicalSectorSize;
+    if (sampling.chunkSize == 0 || sampling.chunkSize % sectorSize != 0) {
+        error = L"Invalid sampling chunk size.";
+        return false;
+    }
+    std::unique_ptr<ImageSource> image = OpenImageSource(imagePath, error, params.readPolicy);
+    if (!image) {
+        return false;
+    }
+    uint64_t length = image->GetSize();
+    if (length == IMAGE_SIZE_UNKNOWN) {
+        error = L"Sampled verification needs an image of known size.";
+        return false;
+    }
+
+    SampledVerifyReport plan;
+    std::vector<uint64_t> chunks = PlanSampledVerify(length, sampling.chunkSize, metadata, sampling, plan);
+    SampledStream stream{chunks, sampling.chunkSize, length};
+    uint64_t position = 0;
+    ChunkSource source = [&](uint64_t offset, void* buffer, size_t want) -> int64_t {
+        uint64_t imageOffset = stream.ToImage(offset);
+        // Compressed images are decompressed through the chunks left out.
+        while (image->IsSequential() && position < imageOffset) {
+            int64_t skipped = image->Read(position, buffer, (size_t)std::min<uint64_t>(want, imageOffset - position));
+            if (skipped <= 0) return -1;
+            position += (uint64_t)skipped;
+        }
+        int64_t got = image->Read(imageOffset, buffer, want);
+        if (got > 0) position = imageOffset + (uint64_t)got;
+        return got;
+    };
+    ChunkAction compare = [&](uint64_t offset, uint8_t* data, uint8_t* scratch, size_t chunkLength,
+                              std::wstring& chunkError) -> bool {
+        uint64_t imageOffset = stream.ToImage(offset);
+        if (transform) {
+            TraceSpan span("cpu", "transform");
+            transform(imageOffset, data, chunkLength);
+        }
+        return CompareWithDevice(target, imageOffset, data, scratch, chunkLength, mismatchOffset, chunkError);
+    };
+
+    WriterParams chunked = params;
+    chunked.chunkSize = sampling.chunkSize;
+    if (!RunChunkPipeline(stream.Length(), sectorSize, sectorSize, source, chunked, "verify sample", true, compare,
+                          progress, nullptr, error)) {
+        return false;
+    }
+    LogSampledVerify(plan);
+    if (report) *report = plan;
+    return true;
+}
+
+bool VerifyImageDigestSampled(BlockDevice& target, const ImageDigest& digest, const std::vector<ByteRange>& metadata,
+                              const SampledVerifyParams& sampling, const WriterParams& params,
+                              const ProgressCallback& progress, SampledVerifyReport* report,
+                              uint64_t* mismatchOffset, std::wstring& error) {
+    if (!CheckDigestUsable(target, digest, error)) {
+        return false;
+    }
+    uint32_t sectorSize = target.GetGeometry().logicalSectorSize;
+
+    SampledVerifyReport plan;
+    std::vector<uint64_t> chunks = PlanSampledVerify(digest.length, digest.chunkSize, metadata, sampling, plan);
+    SampledStream stream{chunks, digest.chunkSize, digest.length};
+    ChunkSource none = [](uint64_t, void*, size_t length) -> int64_t { return (int64_t)length; };
+    ChunkAction check = [&](uint64_t offset, uint8_t* data, uint8_t*, size_t chunkLength,
+                            std::wstring& chunkError) -> bool {
+        return CheckChunkDigest(target, digest, stream.ToImage(offset), data, chunkLength, mismatchOffset, chunkError);
+    };
+
+    WriterParams chunked = params;
+    chunked.chunkSize = digest.chunkSize;
+    if (!RunChunkPipeline(stream.Length(), sectorSize, sectorSize, none, chunked, "verify digest sample", false,
+                          check, progress, nullptr, error)) {
+        return false;
+    }
+    LogSampledVerify(plan);
+    if (report) *report = plan;
+    return true;
+}
+
+// ============================================================================
+// DEVICE ERASE
+// ============================================================================
+
+// Sample positions within a region: its first and last block plus
+// pseudo-random ones in between, the same for a given region every run.
+static uint64_t EraseSampleOffset(uint64_t region, uint32_t sample, uint32_t samples, uint64_t slots) {
+    if (slots <= 1 || sample == 0) return 0;
+    if (sample == samples - 1) return slots - 1;
+    uint64_t x = region * 0x9E3779B97F4A7C15ull + sample;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x % slots;
+}
+
+bool EraseDevice(BlockDevice& device, const WriterParams& params, const ProgressCallback& progress,
+                 EraseStats* stats, std::wstring& error, const EraseParams& erase) {
+    const DeviceGeometry& geometry = device.GetGeometry();
+    const DeviceTraits& traits = device.GetTraits();
+    uint64_t size = geometry.sizeBytes;
+    uint32_t sectorSize = std::max<uint32_t>(geometry.logicalSectorSize, 512);
+    if (size == 0 || size % sectorSize != 0) {
+        error = L"The device size is unknown or not a whole number of sectors.";
+        return false;
+    }
+    // Regions start on physical sectors so the zero fill of each stretch
+    // writes them whole.
+    uint64_t unit = std::max<uint32_t>(GetWriteAlignment(geometry), sectorSize);
+    uint64_t regionSize = std::max<uint64_t>(erase.regionSize / unit * unit, unit);
+    uint32_t sampleSize = (uint32_t)std::min<uint64_t>(std::max<uint32_t>(erase.sampleSize / sectorSize * sectorSize,
+                                                                          sectorSize), regionSize);
+    uint64_t regionCount = (size + regionSize - 1) / regionSize;
+    uint64_t firstRegion = std::min(erase.startOffset / regionSize, regionCount);
+    uint64_t eraseRegions = regionCount - firstRegion;
+    auto startTime = std::chrono::steady_clock::now();
+    TraceSpan eraseSpan("stage", "erase device");
+
+    EraseStats result;
+    result.regions = eraseRegions;
+    // Progress as fractions of the whole job: discarding and sampling take
+    // the first tenth, a full read-back (when needed) the next 30%, and zero
+    // writes the rest, so a plain fill reports from the start.
+    double quickShare = traits.supportsDiscard ? 0.1 : 0.0;
+    auto report = [&](double fraction) -> bool {
+        return !progress || progress((uint64_t)(std::min(fraction, 1.0) * (double)size), size);
+    };
+
+    std::vector<uint8_t> dirty((size_t)regionCount, 1);
+    std::fill(dirty.begin(), dirty.begin() + (size_t)firstRegion, 0);
+    if (traits.supportsDiscard && eraseRegions > 0) {
+        // Ranges are kept to the device's limit and to whole discard granules;
+        // the unaligned tail, if any, is left for the zero writes.
+        uint64_t granule = std::max<uint64_t>(traits.discardGranularity, sectorSize);
+        uint64_t step = traits.maxDiscardBytes ? traits.maxDiscardBytes : 1024ull * 1024 * 1024;
+        step = std::max(step / granule * granule, granule);
+        uint64_t discardStart = (firstRegion * regionSize + granule - 1) / granule * granule;
+        uint64_t discardEnd = size / granule * granule;
+        for (uint64_t offset = discardStart; offset < discardEnd; offset += step) {
+            uint64_t length = std::min(step, discardEnd - offset);
+            TraceSpan span("io", "discard");
+            span.SetArg("offset", (int64_t)offset);
+            if (!device.Discard(offset, length)) {
+                // Drives that advertise discard but refuse it (some USB
+                // bridges) get the zero fill for everything left.
+                LogEvent(LogLevel::Warning, "erase", "discard_failed", {{"offset", (int64_t)offset}});
+                break;
+            }
+            result.bytesDiscarded += length;
+            double discardShare = (double)(offset + length - discardStart) / (double)(discardEnd - discardStart);
+            if (!report(quickShare / 2 * discardShare)) {
+                error = L"Operation cancelled.";
+                return false;
+            }
+        }
+
+        size_t bufferSize = std::max<size_t>(sampleSize, (size_t)params.chunkSize / sectorSize * sectorSize);
+        ArenaBuffer buffer = BufferArena::Default().Acquire(bufferSize);
+        if (!buffer) {
+            error = L"Not enough buffer memory.";
+            return false;
+        }
+        auto readsZero = [&](uint64_t offset, size_t length) -> bool {
+            return device.Read(offset, buffer.Data(), length) && IsZeroBuffer(buffer.Data(), length);
+        };
+
+        // Only regions discarded whole can skip the zero writes; of those,
+        // sample each for deterministic read-zero after discard.
+        TraceSpan sampleSpan("io", "sample discarded regions");
+        uint32_t samples = std::max<uint32_t>(erase.samplesPerRegion, 1);
+        uint64_t staleRegions = 0;
+        uint64_t discarded = discardStart + result.bytesDiscarded;
+        for (uint64_t region = firstRegion; region < regionCount; region++) {
+            uint64_t start = region * regionSize;
+            uint64_t length = std::min(regionSize, size - start);
+            if (start < discardStart) continue;
+            if (start + length > discarded) break;
+            uint64_t slots = length / sampleSize;
+            bool zero = true;
+            for (uint32_t i = 0; i < samples && zero; i++) {
+                uint64_t offset = start + EraseSampleOffset(region, i, samples, slots) * sampleSize;
+                size_t want = (size_t)std::min<uint64_t>(sampleSize, start + length - offset);
+                result.bytesSampled += want;
+                zero = readsZero(offset, want);
+            }
+            dirty[(size_t)region] = !zero;
+            if (!zero) staleRegions++;
+            if (!report(quickShare / 2 + quickShare / 2 * (double)(region + 1 - firstRegion) / (double)eraseRegions)) {
+                error = L"Operation cancelled.";
+                return false;
+            }
+        }
+
+        // A stale sample means the device does not zero on discard, so the
+        // regions whose samples happened to read zero cannot be trusted
+        // either: read them back in full and keep the zero writes to the
+        // ones that still hold data. Reads are cheaper than writes on flash.
+        if (staleRegions > 0) {
+            LogEvent(LogLevel::Warning, "erase", "stale_after_discard", {{"regions", (int64_t)staleRegions}});
+            TraceSpan scanSpan("io", "read back discarded regions");
+            for (uint64_t region = firstRegion; region < regionCount; region++) {
+                uint64_t start = region * regionSize;
+                uint64_t length = std::min(regionSize, size - start);
+                if (dirty[(size_t)region] || start < discardStart || start + length > discarded) continue;
+                for (uint64_t offset = start; offset < start + length && !dirty[(size_t)region];
+                     offset += bufferSize) {
+                    size_t want = (size_t)std::min<uint64_t>(bufferSize, start + length - offset);
+                    result.bytesScanned += want;
+                    dirty[(size_t)region] = !readsZero(offset, want);
+                }
+                if (!report(quickShare + 0.3 * (double)(region + 1 - firstRegion) / (double)eraseRegions)) {
+                    error = L"Operation cancelled.";
+                    return false;
+                }
+            }
+            quickShare += 0.3;
+        }
+    }
+
+    // Zero fill, one pipeline run per stretch of adjacent dirty regions.
+    uint64_t dirtyBytes = 0;
+    for (uint64_t region = 0; region < regionCount; region++) {
+        if (dirty[(size_t)region]) {
+            result.dirtyRegions++;
+            dirtyBytes += std::min(regionSize, size - region * regionSize);
+        }
+    }
+    ChunkSource zeros = [](uint64_t, void* buffer, size_t length) -> int64_t {
+        memset(buffer, 0, length);
+        return (int64_t)length;
+    };
+    for (uint64_t region = 0; region < regionCount;) {
+        if (!dirty[(size_t)region]) {
+            region++;
+            continue;
+        }
+        uint64_t first = region;
+        while (region < regionCount && dirty[(size_t)region]) region++;
+        uint64_t start = first * regionSize;
+        uint64_t length = std::min(region * regionSize, size) - start;
+        uint64_t zeroedBefore = result.bytesZeroed;
+        ProgressCallback rangeProgress = [&](uint64_t done, uint64_t) -> bool {
+            return report(quickShare + (1.0 - quickShare) * (double)(zeroedBefore + done) / (double)dirtyBytes);
+        };
+        if (!RunWritePipeline(device, start, length, zeros, params, rangeProgress, nullptr, error)) {
+            return false;
+        }
+        result.bytesZeroed += length;
+    }
+    if (result.bytesZeroed == 0 && !device.Flush()) {
+        error = L"Failed to flush the target device.";
+        return false;
+    }
+
+    result.elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    LogEvent(LogLevel::Info, "erase", "done",
+             {{"bytes", (int64_t)size}, {"discarded", (int64_t)result.bytesDiscarded},
+              {"sampled", (int64_t)result.bytesSampled}, {"scanned", (int64_t)result.bytesScanned},
+              {"zeroed", (int64_t)result.bytesZeroed},
+              {"dirty_regions", (int64_t)result.dirtyRegions}, {"ms", (int64_t)(result.elapsedSeconds * 1000)}});
+    if (stats) {
+        *stats = result;
+    }
+    report(1.0);
+    return true;
+}
+
+// ============================================================================
+// BUFFER HELPERS
+// ============================================================================
+
+bool IsZeroBuffer(const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t i = 0;
+
+    // Byte steps up to word alignment, then eight words per iteration.
+    while (i < length && ((uintptr_t)(bytes + i) & (sizeof(uint64_t) - 1)) != 0) {
+        if (bytes[i++] != 0) return false;
+    }
+    const uint64_t* words = (const uint64_t*)(bytes + i);
+    size_t wordCount = (length - i) / sizeof(uint64_t);
+    size_t w = 0;
+    for (; w + 8 <= wordCount; w += 8) {
+        if ((words[w] | words[w + 1] | words[w + 2] | words[w + 3] |
+             words[w + 4] | words[w + 5] | words[w + 6] | words[w + 7]) != 0) {
+            return false;
+        }
+    }
+    for (; w < wordCount; w++) {
+        if (words[w] != 0) return false;
+    }
+    for (i += wordCount * sizeof(uint64_t); i < length; i++) {
+        if (bytes[i] != 0) return false;
+    }
+    return true;
+}
@@ -0,0 +1,198 @@
+// ============================================================================
+// INFERNO - Image write pipeline
+// ============================================================================
+
+#pragma once
+
+#include "AsyncIo.h"
+#include "BlockDevice.h"
+#include "ImageSource.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+class WriteController;
+
+struct WriterParams {
+    uint32_t chunkSize = 1024 * 1024;   // bytes per write request
+    uint32_t queueDepth = 4;            // writes kept in flight
+    ReadPolicy readPolicy = ReadPolicy::Buffered;   // how image files are read (see ImageSource.h)
+    // Retunes chunk size and queue depth during writes and adds flushes (see
+    // WriteController.h); chunkSize and queueDepth are then only the start.
+    // Verification ignores it.
+    WriteController* controller = nullptr;
+};
+
+struct ByteRange {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+};
+
+struct WriteStats {
+    uint64_t bytesWritten = 0;
+    double elapsedSeconds = 0.0;
+
+    double BytesPerSecond() const {
+        return elapsedSeconds > 0.0 ? bytesWritten / elapsedSeconds : 0.0;
+    }
+};
+
+// Produces up to `length` bytes of the stream at `offset` into `buffer`.
+// Returns the number of bytes produced (0 at end of stream) or -1 on error.
+using ChunkSource = std::function<int64_t(uint64_t offset, void* buffer, size_t length)>;
+
+// Called from the pipeline thread after each completed chunk. Return false
+// to cancel the operation.
+using ProgressCallback = std::function<bool(uint64_t bytesDone, uint64_t bytesTotal)>;
+
+// Rewrites a sector-padded chunk in place on a pipeline worker before it is
+// written or compared, e.g. to encrypt it. `offset` is the chunk's position
+// in the stream. Runs concurrently on up to `queueDepth` workers.
+using ChunkTransform = std::function<void(uint64_t offset, uint8_t* data, size_t length)>;
+
+// Stream `length` bytes from `source` to `target` starting at `targetOffset`.
+// One thread reads ahead while `queueDepth` writers keep requests in flight.
+// The final chunk is zero-padded to the device's logical sector size.
+// `length` may be IMAGE_SIZE_UNKNOWN for streams that end when the source
+// returns 0; progress then reports a total of 0.
+bool RunWritePipeline(BlockDevice& target, uint64_t targetOffset, uint64_t length,
+                      const ChunkSource& source, const WriterParams& params,
+                      const ProgressCallback& progress, WriteStats* stats, std::wstring& error,
+                      const ChunkTransform& transform = ChunkTransform());
+
+// Read `target` back and compare it with `source` using the same pipeline
+// shape. Stops at the first difference and reports its byte offset.
+// `transform` is applied to the source side before comparing.
+bool RunVerifyPipeline(BlockDevice& target, uint64_t targetOffset, uint64_t length,
+                       const ChunkSource& source, const WriterParams& params,
+                       const ProgressCallback& progress, uint64_t* mismatchOffset, std::wstring& error,
+                       const ChunkTransform& transform = ChunkTransform());
+
+// Stream the same `length` bytes to the start of every target from one
+// thread through an asynchronous I/O queue (see AsyncIo.h), keeping up to
+// 2 x queueDepth chunks in flight to each target. A target that fails is
+// dropped while the others finish; the call then fails naming it. There is
+// no transform: chunks go to the kernel straight from the reader.
+bool RunFanOutWritePipeline(const std::vector<BlockDevice*>& targets, uint64_t length, const ChunkSource& source,
+                            const WriterParams& params, const ProgressCallback& progress, WriteStats* stats,
+                            std::wstring& error, AsyncBackend backend = AsyncBackend::Auto);
+
+// Raw (DD-mode) copy of an image file to the start of `target`. Compressed
+// images are decompressed on the fly (see OpenImageSource). `transform`
+// sees every chunk before it is written, e.g. to scan or patch it.
+bool WriteImage(const std::wstring& imagePath, BlockDevice& target, const WriterParams& params,
+                const ProgressCallback& progress, WriteStats* stats, std::wstring& error,
+                const ChunkTransform& transform = ChunkTransform());
+
+// Raw copy of an image file to several targets at once, or to one target
+// without pipeline worker threads.
+bool WriteImageToDevices(const std::wstring& imagePath, const std::vector<BlockDevice*>& targets,
+                         const WriterParams& params, const ProgressCallback& progress, WriteStats* stats,
+                         std::wstring& error);
+
+// `transform` must rewrite the image the way it was rewritten when written.
+bool VerifyImage(const std::wstring& imagePath, BlockDevice& target, const WriterParams& params,
+                 const ProgressCallback& progress, uint64_t* mismatchOffset, std::wstring& error,
+                 const ChunkTransform& transform = ChunkTransform());
+
+// SHA-256 of the (decompressed) image contents.
+bool HashImage(const std::wstring& imagePath, uint8_t digest[32], const ProgressCallback& progress,
+               std::wstring& error);
+
+using ChunkDigest = std::array<uint8_t, 32>;
+
+// The whole-image SHA-256 plus one per `chunkSize` bytes of content, which
+// is enough to verify a written device without reading the image again.
+struct ImageDigest {
+    uint8_t sha256[32] = {};
+    uint64_t length = 0;                // bytes of (decompressed) content
+    uint32_t chunkSize = 0;             // 0 when there are no chunk digests
+    std::vector<ChunkDigest> chunks;
+};
+
+// As HashImage, also hashing each `chunkSize` chunk when `chunkSize` is
+// non-zero (a multiple of 4096 so every sector size divides it).
+bool HashImage(const std::wstring& imagePath, uint32_t chunkSize, ImageDigest& digest,
+               const ProgressCallback& progress, std::wstring& error,
+               ReadPolicy policy = ReadPolicy::Buffered);
+
+// Verify that `target` starts with the content `digest` describes by reading
+// it back and hashing each chunk on `queueDepth` workers. Reports the offset
+// of the first mismatching chunk.
+bool VerifyImageDigest(BlockDevice& target, const ImageDigest& digest, const WriterParams& params,
+                       const ProgressCallback& progress, uint64_t* mismatchOffset, std::wstring& error);
+
+struct SampledVerifyParams {
+    uint32_t chunkSize = 4 * 1024 * 1024;   // unit of sampling; digest verification uses the digest's
+    double confidence = 0.99;               // chance of catching damage to `detectFraction` of the data
+    double detectFraction = 0.01;
+    uint64_t seed = 0;                      // 0 draws a fresh one
+};
+
+struct SampledVerifyReport {
+    uint64_t seed = 0;                      // reproduces the sample
+    uint32_t chunkSize = 0;
+    uint64_t metadataChunks = 0;            // verified in full: they touch a metadata region
+    uint64_t dataChunks = 0;                // every other chunk
+    uint64_t sampledChunks = 0;             // data chunks verified
+    uint64_t bytesVerified = 0;
+    double coverage = 0.0;                  // share of the image verified
+    double confidence = 0.0;
+    uint64_t undetectedChunks = 0;          // with `confidence`, no more unverified data chunks are damaged
+    double undetectedFraction = 0.0;        // the same as a share of the data chunks
+};
+
+// The chunks a sampled verification of `length` bytes reads: all that touch
+// a `metadata` range, plus a seeded random sample of the rest just large
+// enough that damage to `detectFraction` of them is caught with probability
+// `confidence`. Returns chunk indices in ascending order; the report gets
+// the plan and the bound a clean result would establish.
+std::vector<uint64_t> PlanSampledVerify(uint64_t length, uint32_t chunkSize, const std::vector<ByteRange>& metadata,
+                                        const SampledVerifyParams& sampling, SampledVerifyReport& report);
+
+// VerifyImage over the planned chunks only. Compressed images are still
+// decompressed up to the last chunk, and must have a known length.
+bool VerifyImageSampled(const std::wstring& imagePath, BlockDevice& target, const std::vector<ByteRange>& metadata,
+                        const SampledVerifyParams& sampling, const WriterParams& params,
+                        const ProgressCallback& progress, SampledVerifyReport* report, uint64_t* mismatchOffset,
+                        std::wstring& error, const ChunkTransform& transform = ChunkTransform());
+
+// VerifyImageDigest over the planned chunks only, at the digest's chunk size.
+bool VerifyImageDigestSampled(BlockDevice& target, const ImageDigest& digest, const std::vector<ByteRange>& metadata,
+                              const SampledVerifyParams& sampling, const WriterParams& params,
+                              const ProgressCallback& progress, SampledVerifyReport* report,
+                              uint64_t* mismatchOffset, std::wstring& error);
+
+struct EraseParams {
+    uint64_t regionSize = 64ull * 1024 * 1024;  // unit of verification and of the zero-write fallback
+    uint32_t samplesPerRegion = 4;              // reads per region, including its first and last block
+    uint32_t sampleSize = 64 * 1024;
+    uint64_t startOffset = 0;                   // bytes before it are left alone (a raw copy overwrites them next)
+};
+
+struct EraseStats {
+    uint64_t bytesDiscarded = 0;
+    uint64_t bytesSampled = 0;
+    uint64_t bytesScanned = 0;                  // read back in full after a sample showed stale data
+    uint64_t bytesZeroed = 0;                   // written because discard was unavailable or left data behind
+    uint64_t regions = 0;
+    uint64_t dirtyRegions = 0;
+    double elapsedSeconds = 0.0;
+};
+
+// Full erase: leaves every byte of `device` reading as zero. Discards the
+// whole device where it supports discard and reads sample blocks from every
+// region to check that discarded sectors really read back as zeros. If any
+// sample does not, the device lacks deterministic read-zero and the other
+// discarded regions are read back in full. Zeros are then written (through
+// the write pipeline) only over regions that still hold data or that discard
+// did not cover. Without discard it is a plain zero fill. Progress reports a
+// total of the device size. With a start offset, erasing begins at the
+// region holding it.
+bool EraseDevice(BlockDevice& device, const WriterParams& params, const ProgressCallback& progress,
+                 EraseStats* stats, std::wstring& error, const EraseParams& erase = EraseParams());
+
+bool IsZeroBuffer(const void* data, size_t length);
@@ -31,6 +31,30 @@
 #include <numeric>
 #include <cmath>
 
+#include "BlockDevice.h"
+#include "BootConfig.h"
+#include "BufferArena.h"
+#include "Checksum.h"
+#include "DeviceTuner.h"
+#include "DriverCatalog.h"
+#include "ImageHashCache.h"
+#include "ImageLibrary.h"
+#include "JobQueue.h"
+#include "ImageMetadata.h"
+#include "ImageSource.h"
+#include "ImageWriter.h"
+#include "IsoHybrid.h"
+#include "Log.h"
+#include "Luks2.h"
+#include "PartitionTable.h"
+#include "Platform.h"
+#include "SignatureScanner.h"
+#include "StepScheduler.h"
+#include "Trace.h"
+#include "VolumeGrow.h"
+#include "WriteController.h"
+#include "WritePlanner.h"
+
 #pragma comment(lib, "shlwapi.lib")
 #pragma comment(lib, "setupapi.lib")
 #pragma comment(lib, "comctl32.lib")
@@ -51,12 +75,12 @@
 #define WM_USER_OPERATION_COMPLETE (WM_USER + 102)
 #define WM_USER_VERIFICATION_PROGRESS (WM_USER + 103)
 #define WM_USER_DRIVE_REFRESH (WM_USER + 104)
+#define WM_USER_LIBRARY_CHANGED (WM_USER + 105)
+#define WM_USER_JOBS_CHANGED (WM_USER + 106)
+#define WM_USER_SETTINGS_PLANNED (WM_USER + 107)
 
 #define INFERNO_LOGO_FILE L"inferno.png"
 #define MAX_BUFFER_SIZE 4096
-#define SECTOR_SIZE 512
-#define MBR_SIZE 512
-#define GPT_HEADER_SIZE 512
 
 // ============================================================================
 // GLOBAL VARIABLES
@@ -75,7 +99,8 @@ std::map<std::wstring, std::wstring> g_SupportedISOs = {
     {L".wim", L"Windows Imaging Format"},
     {L".esd", L"Electronic Software Distribution"},
     {L".vhd", L"Virtual Hard Disk"},
-    {L".vhdx", L"Virtual Hard Disk v2"}
+    {L".vhdx", L"Virtual Hard Disk v2"},
+    {L".gz", L"Compressed Disk Image"}
 };
 
 std::map<std::wstring, std::wstring> g_PartitionSchemes = {
@@ -109,6 +134,10 @@ struct DriveInfo {
     ULONGLONG freeSize;
     bool isRemovable;
     bool isUSB;
+    bool isRotational;
+    bool supportsDiscard;
+    DWORD logicalSectorSize;
+    DWORD physicalSectorSize;
     bool hasVolume;
     std::wstring fileSystem;
     std::wstring partitionStyle;
@@ -124,6 +153,7 @@ struct ISOInfo {
     bool isLinux;
     bool supportsUEFI;
     bool supportsBIOS;
+    std::wstring sha256;        // known without hashing when the image is in the digest cache
 };
 
 struct FormatOptions {
@@ -151,7 +181,9 @@ struct FormatOptions {
     bool enableVirusScan;
     bool createRecoveryPartition;
     bool enableOptimization;
+    bool enableAdaptiveWrite; // retune the raw copy as it runs (see WriteController.h)
     std::wstring optimizationProfile; // "performance", "capacity", "balanced"
+    std::wstring sourceReadPolicy; // "buffered", "sequential", "drop-behind", "direct", "pinned"; empty: each job decides
     bool enableSSDOptimization;
     bool enableRaidDriverIntegration;
     std::wstring additionalDriversPath;
@@ -162,8 +194,13 @@ struct FormatOptions {
     std::wstring bootPassword;
     bool enableChecksumVerification;
     bool enablePostFormatVerification;
+    std::wstring verificationMode; // "full", "sampled"
+    double verificationConfidence; // sampled mode; 0 means 0.99
     bool enableSectorBySectorCopy;
     bool enableISOHybridization;
+    bool enableUefiBridge;      // exFAT volume booted through a small FAT partition (see WritePlanner.h)
+    bool enableWimSplit;        // install.wim split into .swm parts for FAT32
+    bool enableGrowToDrive;     // a raw-copied disk image's last partition grown to the drive (see VolumeGrow.h)
     bool enableMultiBoot;
     std::vector<std::wstring> additionalISOs;
     bool enableCustomScripts;
@@ -177,6 +214,27 @@ struct FormatOptions {
     bool enableRealTimeProgress;
     bool enableDetailedLogging;
     std::wstring logFilePath;
+    bool enableTracing;
+    std::wstring traceFilePath;     // Chrome trace JSON; inferno_trace.json when empty
+};
+
+// What a format job found, for its report
+struct FormatResults {
+    std::wstring imageSha256;
+    std::wstring verificationSummary;
+    WriteControllerSummary writeSummary;
+    std::unique_ptr<SignatureScanner> signatureScanner;
+    IsoHybridLayout isoHybridLayout;
+};
+
+// A format job owns the selection and options it was submitted with and
+// its own results: the window may change the selection, or queue the next
+// job, before this one has run or been reported.
+struct FormatJob {
+    DriveInfo drive;
+    ISOInfo iso;
+    FormatOptions options;
+    FormatResults results;
 };
 
 // ============================================================================
@@ -184,12 +242,19 @@ struct FormatOptions {
 // ============================================================================
 
 LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+LRESULT CALLBACK LibraryWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
 void InitializeUI();
 void RefreshDriveList();
 void BrowseForISO();
+void SelectISO(const ISOInfo& info);
+void ShowImageLibrary();
+void FillLibraryList();
+ISOInfo ToISOInfo(const ImageInfo& image);
 void UpdateUIFromOptions();
 void StartFormatting();
-void FormatThread();
+void EndFormatting();
+bool FormatThread(JobContext& context, const std::shared_ptr<FormatJob>& formatJob);
+void StartJobQueue();
 void ShowAdvancedOptions();
 void ShowDiagnostics();
 void ShowAboutDialog();
@@ -197,44 +262,65 @@ void LoadLogo();
 std::wstring GetDriveLetters(DWORD diskNumber);
 std::vector<DriveInfo> GetAvailableDrives();
 ISOInfo GetISOInfo(const std::wstring& isoPath);
-BOOL GetPhysicalDriveInfo(DWORD driveNumber, ULONGLONG* totalSize, ULONGLONG* freeSize);
 std::wstring FormatSize(ULONGLONG size);
 std::wstring GetFileSystemName(const std::wstring& rootPath);
 std::wstring GetPartitionStyle(DWORD diskNumber);
-BOOL IsDriveUSB(DWORD diskNumber);
 void ShowErrorMessage(const std::wstring& message);
 void ShowSuccessMessage(const std::wstring& message);
 BOOL RunAsAdmin();
-void CreateMultiplePartitions(const DriveInfo& drive, const FormatOptions& options);
+BOOL GetVolumeDiskNumber(const wchar_t* rootPath, DWORD* diskNumber);
+BOOL CreateMultiplePartitions(const DriveInfo& drive, const FormatOptions& options);
+BOOL PerformFullErase(const DriveInfo& drive, const FormatOptions& options, uint64_t startOffset, StepContext& step);
 void AddBootMenu(const DriveInfo& drive, const FormatOptions& options);
 void IntegrateAdditionalDrivers(const DriveInfo& drive, const FormatOptions& options);
-void PerformPostFormatVerification(const DriveInfo& drive, const FormatOptions& options);
+BOOL PerformPostFormatVerification(const DriveInfo& drive, const std::wstring& isoPath, const FormatOptions& options,
+                                   FormatResults& results, StepContext& step);
+bool IsSampledVerification(const FormatOptions& options);
 void EnableEncryption(const DriveInfo& drive, const FormatOptions& options);
 void CreatePersistentStorage(const DriveInfo& drive, const FormatOptions& options);
 void RunCustomScripts(const std::wstring& scriptPath, const DriveInfo& drive);
 void OptimizeForSSD(const DriveInfo& drive);
 void EnableSecureBoot(const DriveInfo& drive);
 void CreateRecoveryPartition(const DriveInfo& drive);
-void ScanForViruses(const DriveInfo& drive);
+BOOL ScanForViruses(const DriveInfo& drive, const std::wstring& isoPath, const FormatOptions& options,
+                    FormatResults& results, StepContext& step);
 void BackupToCloud(const std::wstring& sourcePath, const std::wstring& cloudPath);
 void ApplyAIOSOptimization(const DriveInfo& drive);
 void EnableSmartSectorAllocation(const DriveInfo& drive);
-void GenerateDetailedReport(const DriveInfo& drive, const FormatOptions& options, BOOL success);
+void GenerateDetailedReport(const FormatJob& job, BOOL success);
 void EnableTPMEmulation(const DriveInfo& drive);
 void AddDiagnosticTools(const DriveInfo& drive);
 void CreateCustomBootMenu(const DriveInfo& drive, const FormatOptions& options);
+BOOL PatchBootMenus(const DriveInfo& drive, const FormatOptions& options, StepContext& step);
+BOOL GrowCopiedImage(const DriveInfo& drive, StepContext& step);
 void EnableLegacyBootSupport(const DriveInfo& drive);
 void EnableUEFISecureBootSupport(const DriveInfo& drive);
 void SetBootPassword(const DriveInfo& drive, const std::wstring& password);
-void VerifyChecksums(const DriveInfo& drive, const std::wstring& isoPath);
-void PerformSectorBySectorCopy(const DriveInfo& drive, const std::wstring& isoPath);
+BOOL VerifyChecksums(const DriveInfo& drive, const std::wstring& isoPath, const FormatOptions& options,
+                     FormatResults& results, StepContext& step);
+BOOL PerformSectorBySectorCopy(const DriveInfo& drive, const std::wstring& isoPath, const FormatOptions& options,
+                               FormatResults& results, StepContext& step);
+WriterParams GetTunedWriterParams(BlockDevice& device, const FormatOptions& options);
 void CreateHybridISO(const DriveInfo& drive, const std::wstring& isoPath);
+void CreateUefiBridge(const DriveInfo& drive);
+void SplitWindowsImage(const DriveInfo& drive, const std::wstring& isoPath);
 void SetupMultiBoot(const DriveInfo& drive, const std::vector<std::wstring>& isos);
 void EnableRealTimeMonitoring(const DriveInfo& drive);
 void EnableTelemetry(const DriveInfo& drive, const FormatOptions& options);
 void PreProvisionBitLocker(const DriveInfo& drive);
-void IntegrateRaidDrivers(const DriveInfo& drive, const std::wstring& driversPath);
-void AutoDetectBestSettings(const DriveInfo& drive, const ISOInfo& iso, FormatOptions& options);
+void IntegrateRaidDrivers(const DriveInfo& drive, const std::wstring& driversPath, const std::wstring& architecture);
+
+// What AutoDetectBestSettings learns from the image and the drive. Built on
+// a worker thread: reading the image and opening the drive can take seconds.
+struct SettingsPlan {
+    ImageContents contents;
+    WritePlan plan;
+    bool planned = false;
+    std::wstring error;
+};
+SettingsPlan PlanBestSettings(const DriveInfo& drive, const ISOInfo& iso);
+void StartAutoDetect();
+void AutoDetectBestSettings(const ISOInfo& iso, const SettingsPlan& planned, FormatOptions& options);
 
 // ============================================================================
 // GLOBAL UI CONTROLS
@@ -258,6 +344,11 @@ HWND g_hAboutButton;
 HWND g_hDriveInfoText;
 HWND g_hISOInfoText;
 HWND g_hLogoStatic;
+HWND g_hLibraryButton;
+HWND g_hLibraryWnd = NULL;
+HWND g_hLibrarySearch;
+HWND g_hLibraryList;
+HWND g_hLibraryStatus;
 
 // ============================================================================
 // GLOBAL STATE
@@ -267,7 +358,13 @@ DriveInfo g_SelectedDrive;
 ISOInfo g_SelectedISO;
 FormatOptions g_FormatOptions;
 BOOL g_IsFormatting = FALSE;
-HANDLE g_hFormatThread = NULL;
+std::unique_ptr<JobQueue> g_JobQueue;
+std::unique_ptr<JobQueueServer> g_JobServer;
+uint64_t g_FormatJobId = 0;
+uint64_t g_AutoDetectGeneration = 0;   // the selection whose settings plan is awaited
+std::wstring g_LibraryRoot;
+std::vector<ImageInfo> g_LibraryResults;
+std::unique_ptr<ImageLibraryWatcher> g_LibraryWatcher;
 
 // ============================================================================
 // MAIN ENTRY POINT
@@ -276,6 +373,9 @@ HANDLE g_hFormatThread = NULL;
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
     g_hInstance = hInstance;
     
+    // Logging is asynchronous and cheap enough to leave on for every job
+    g_FormatOptions.enableDetailedLogging = true;
+    
     // Initialize Common Controls
     INITCOMMONCONTROLSEX icex;
     icex.dwSize = sizeof(INITCOMMONCONTROLSEX);
@@ -323,6 +423,12 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     // Initialize UI
     InitializeUI();
     
+    // Map the image library index now so the library opens instantly
+    ImageLibrary::Default().Open();
+    
+    // Formatting jobs, from this window and from other processes
+    StartJobQueue();
+    
     // Show window
     ShowWindow(g_hMainWnd, nCmdShow);
     UpdateWindow(g_hMainWnd);
@@ -338,6 +444,8 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     }
     
     // Cleanup
+    g_JobServer.reset();
+    g_JobQueue.reset();
     if (g_hLogoBitmap) DeleteObject(g_hLogoBitmap);
     if (g_hTitleFont) DeleteObject(g_hTitleFont);
     if (g_hNormalFont) DeleteObject(g_hNormalFont);
@@ -361,21 +469,19 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                 RefreshDriveList();
             } else if (wmId == IDC_BROWSE_ISO) {
                 BrowseForISO();
+            } else if (wmId == IDC_LIBRARY) {
+                ShowImageLibrary();
             } else if (wmId == IDC_ADVANCED) {
                 ShowAdvancedOptions();
             } else if (wmId == IDC_START) {
                 if (!g_IsFormatting) {
                     StartFormatting();
-                } else {
-                    // Cancel operation
-                    g_IsFormatting = FALSE;
-                    if (g_hFormatThread) {
-                        WaitForSingleObject(g_hFormatThread, INFINITE);
-                        CloseHandle(g_hFormatThread);
-                        g_hFormatThread = NULL;
-                    }
-                    SetWindowText(g_hStartButton, L"START");
-                    SetWindowText(g_hStatusText, L"Operation cancelled by user.");
+                } else if (g_FormatJobId) {
+                    // The job stops at its next progress report; the window
+                    // is reset once the queue reports it ended
+                    g_JobQueue->Cancel(g_FormatJobId);
+                    EnableWindow(g_hStartButton, FALSE);
+                    SetWindowText(g_hStatusText, L"Cancelling...");
                 }
             } else if (wmId == IDC_DIAGNOSTICS) {
                 ShowDiagnostics();
@@ -405,8 +511,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                                 
                                 // Auto-detect best settings based on drive and ISO
                                 if (g_SelectedISO.path.length() > 0) {
-                                    AutoDetectBestSettings(g_SelectedDrive, g_SelectedISO, g_FormatOptions);
-                                    UpdateUIFromOptions();
+                                    StartAutoDetect();
                                 }
                             }
                         }
@@ -431,24 +536,19 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         
         case WM_USER_OPERATION_COMPLETE: {
             BOOL success = (BOOL)wParam;
-            g_IsFormatting = FALSE;
-            SetWindowText(g_hStartButton, L"START");
+            std::unique_ptr<std::shared_ptr<FormatJob>> job((std::shared_ptr<FormatJob>*)lParam);
             
+            // The controls are enabled again when the queue reports the
+            // job ended (WM_USER_JOBS_CHANGED)
             if (success) {
-                ShowSuccessMessage(L"Operation completed successfully!");
                 SetWindowText(g_hStatusText, L"Operation completed successfully!");
+                ShowSuccessMessage(L"Operation completed successfully!");
             } else {
                 SetWindowText(g_hStatusText, L"Operation failed. Check logs for details.");
             }
             
-            // Enable controls
-            EnableWindow(g_hDriveCombo, TRUE);
-            EnableWindow(g_hISOButton, TRUE);
-            EnableWindow(g_hAdvancedButton, TRUE);
-            EnableWindow(g_hRefreshButton, TRUE);
-            
             // Generate report
-            GenerateDetailedReport(g_SelectedDrive, g_FormatOptions, success);
+            GenerateDetailedReport(**job, success);
             
             break;
         }
@@ -458,6 +558,63 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             break;
         }
         
+        case WM_USER_LIBRARY_CHANGED: {
+            wchar_t* status = (wchar_t*)wParam;
+            if (g_hLibraryWnd) {
+                FillLibraryList();
+                if (status) SetWindowText(g_hLibraryStatus, status);
+            }
+            free(status);
+            break;
+        }
+        
+        case WM_USER_JOBS_CHANGED: {
+            uint64_t id = (uint64_t)wParam;
+            JobState state = (JobState)lParam;
+            
+            // An image stays pinned only while a queued or running job
+            // still writes it
+            if (state != JobState::Queued && state != JobState::Running && g_JobQueue) {
+                std::vector<std::wstring> images;
+                for (const JobStatus& status : g_JobQueue->List()) {
+                    if (status.state == JobState::Queued || status.state == JobState::Running) {
+                        images.push_back(status.request.image);
+                    }
+                }
+                ReleaseUnusedPinnedImages(images);
+            }
+            
+            if (g_IsFormatting && id == g_FormatJobId) {
+                if (state == JobState::Queued) {
+                    SetWindowText(g_hStatusText, L"Waiting for USB bandwidth on this drive's hub...");
+                } else if (state != JobState::Running) {
+                    // Its completion message, posted before its thread
+                    // ended, has already been handled
+                    if (state == JobState::Cancelled) {
+                        SetWindowText(g_hStatusText, L"Operation cancelled by user.");
+                    }
+                    EndFormatting();
+                }
+            } else if (!g_IsFormatting && g_JobQueue) {
+                JobQueueStats stats = g_JobQueue->GetStats();
+                std::wstringstream status;
+                status << L"Station jobs: " << stats.running << L" running, " << stats.queued << L" queued ("
+                       << FormatSize((ULONGLONG)stats.bytesPerSecond) << L"/s)";
+                SetWindowText(g_hStatusText, status.str().c_str());
+            }
+            break;
+        }
+        
+        case WM_USER_SETTINGS_PLANNED: {
+            std::unique_ptr<SettingsPlan> plan((SettingsPlan*)lParam);
+            // Plans for selections that have since changed are dropped
+            if (wParam == (WPARAM)g_AutoDetectGeneration) {
+                AutoDetectBestSettings(g_SelectedISO, *plan, g_FormatOptions);
+                UpdateUIFromOptions();
+            }
+            break;
+        }
+        
         case WM_DEVICECHANGE: {
             // Refresh drive list when devices change
             PostMessage(hWnd, WM_USER_DRIVE_REFRESH, 0, 0);
@@ -553,6 +710,10 @@ void InitializeUI() {
                                  WS_CHILD | WS_VISIBLE | WS_TABSTOP | BS_PUSHBUTTON,
                                  430, 263, 80, 25, g_hMainWnd, (HMENU)IDC_BROWSE_ISO, g_hInstance, NULL);
     
+    g_hLibraryButton = CreateWindowEx(0, L"BUTTON", L"Library...",
+                                     WS_CHILD | WS_VISIBLE | WS_TABSTOP | BS_PUSHBUTTON,
+                                     430, 293, 80, 25, g_hMainWnd, (HMENU)IDC_LIBRARY, g_hInstance, NULL);
+    
     // ISO info
     g_hISOInfoText = CreateWindowEx(WS_EX_CLIENTEDGE, L"EDIT", NULL,
                                    WS_CHILD | WS_VISIBLE | ES_MULTILINE | ES_READONLY | WS_VSCROLL,
@@ -636,7 +797,7 @@ void InitializeUI() {
                                    600, 530, 150, 25, g_hMainWnd, (HMENU)IDC_ABOUT, g_hInstance, NULL);
     
     // Set fonts
-    HWND controls[] = {g_hDriveCombo, g_hRefreshButton, g_hISOPath, g_hISOButton,
+    HWND controls[] = {g_hDriveCombo, g_hRefreshButton, g_hISOPath, g_hISOButton, g_hLibraryButton,
                       g_hPartitionSchemeCombo, g_hTargetSystemCombo, g_hFileSystemCombo,
                       g_hVolumeLabel, g_hQuickFormatCheck, g_hAdvancedButton,
                       g_hStartButton, g_hStatusText, g_hDiagnosticsButton, g_hAboutButton,
@@ -672,6 +833,9 @@ void InitializeUI() {
 std::vector<DriveInfo> GetAvailableDrives() {
     std::vector<DriveInfo> drives;
     
+    // Bus, media and sector properties come from the disks themselves
+    std::vector<BlockDeviceInfo> disks = EnumerateBlockDevices();
+    
     // Get logical drives
     DWORD driveMask = GetLogicalDrives();
     
@@ -700,7 +864,10 @@ std::vector<DriveInfo> GetAvailableDrives() {
                     info.hasVolume = false;
                 }
                 
-                // Get disk free space
+                // Free space is the volume's; the size is replaced by the
+                // whole disk's below, since a write replaces every partition.
+                info.totalSize = 0;
+                info.freeSize = 0;
                 ULONGLONG freeBytes, totalBytes, totalFreeBytes;
                 if (GetDiskFreeSpaceEx(rootPath, (PULARGE_INTEGER)&freeBytes,
                     (PULARGE_INTEGER)&totalBytes, (PULARGE_INTEGER)&totalFreeBytes)) {
@@ -716,11 +883,31 @@ std::vector<DriveInfo> GetAvailableDrives() {
                     info.friendlyName = rootPath;
                 }
                 
-                // Check if USB
-                info.isUSB = IsDriveUSB(i);
+                // Get partition style from the disk holding the volume
+                info.diskNumber = (DWORD)-1;
+                if (GetVolumeDiskNumber(rootPath, &info.diskNumber)) {
+                    info.partitionStyle = GetPartitionStyle(info.diskNumber);
+                } else {
+                    info.partitionStyle = L"Unknown";
+                }
                 
-                // Get partition style
-                info.partitionStyle = GetPartitionStyle(i);
+                info.isUSB = false;
+                info.isRotational = false;
+                info.supportsDiscard = false;
+                info.logicalSectorSize = 512;
+                info.physicalSectorSize = 512;
+                for (const BlockDeviceInfo& disk : disks) {
+                    if (info.diskNumber == (DWORD)-1 || disk.path != GetPhysicalDrivePath(info.diskNumber)) {
+                        continue;
+                    }
+                    info.isUSB = disk.traits.usb;
+                    info.isRemovable = info.isRemovable || disk.traits.removable;
+                    info.isRotational = disk.traits.rotational;
+                    info.supportsDiscard = disk.traits.supportsDiscard;
+                    info.totalSize = disk.geometry.sizeBytes;
+                    info.logicalSectorSize = disk.geometry.logicalSectorSize;
+                    info.physicalSectorSize = disk.geometry.physicalSectorSize;
+                }
                 
                 drives.push_back(info);
             }
@@ -778,76 +965,257 @@ void BrowseForISO() {
     ZeroMemory(&ofn, sizeof(ofn));
     ofn.lStructSize = sizeof(ofn);
     ofn.hwndOwner = g_hMainWnd;
-    ofn.lpstrFilter = L"Disk Images\0*.iso;*.img;*.wim;*.esd;*.vhd;*.vhdx\0All Files\0*.*\0";
+    ofn.lpstrFilter = L"Disk Images\0*.iso;*.img;*.img.gz;*.wim;*.esd;*.vhd;*.vhdx\0All Files\0*.*\0";
     ofn.lpstrFile = fileName;
     ofn.nMaxFile = MAX_PATH;
     ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST;
     ofn.lpstrDefExt = L"iso";
     
     if (GetOpenFileName(&ofn)) {
-        SetWindowText(g_hISOPath, fileName);
-        
-        // Get ISO info
-        g_SelectedISO = GetISOInfo(fileName);
-        
-        // Update ISO info display
-        std::wstringstream info;
-        info << L"File: " << g_SelectedISO.path << L"\n";
-        info << L"Size: " << FormatSize(g_SelectedISO.size) << L"\n";
-        info << L"Label: " << g_SelectedISO.label << L"\n";
-        info << L"Architecture: " << g_SelectedISO.architecture << L"\n";
-        info << L"Supports UEFI: " << (g_SelectedISO.supportsUEFI ? L"Yes" : L"No") << L"\n";
-        info << L"Supports BIOS: " << (g_SelectedISO.supportsBIOS ? L"Yes" : L"No");
-        
-        SetWindowText(g_hISOInfoText, info.str().c_str());
-        
-        // Auto-detect best settings
-        if (g_SelectedDrive.deviceID.length() > 0) {
-            AutoDetectBestSettings(g_SelectedDrive, g_SelectedISO, g_FormatOptions);
-            UpdateUIFromOptions();
-        }
+        SelectISO(GetISOInfo(fileName));
+    }
+}
+
+void SelectISO(const ISOInfo& info) {
+    g_SelectedISO = info;
+    SetWindowText(g_hISOPath, info.path.c_str());
+    
+    // Update ISO info display
+    std::wstringstream text;
+    text << L"File: " << g_SelectedISO.path << L"\n";
+    text << L"Size: " << FormatSize(g_SelectedISO.size) << L"\n";
+    text << L"Label: " << g_SelectedISO.label << L"\n";
+    text << L"Architecture: " << g_SelectedISO.architecture << L"\n";
+    text << L"Supports UEFI: " << (g_SelectedISO.supportsUEFI ? L"Yes" : L"No") << L"\n";
+    text << L"Supports BIOS: " << (g_SelectedISO.supportsBIOS ? L"Yes" : L"No");
+    if (!g_SelectedISO.sha256.empty()) {
+        text << L"\nSHA-256: " << g_SelectedISO.sha256;
+    }
+    
+    SetWindowText(g_hISOInfoText, text.str().c_str());
+    
+    // Auto-detect best settings
+    if (g_SelectedDrive.deviceID.length() > 0) {
+        StartAutoDetect();
     }
 }
 
+ISOInfo ToISOInfo(const ImageInfo& image) {
+    ISOInfo info = {};
+    info.path = image.path;
+    info.label = image.label.empty() ? std::wstring(PathFindFileName(image.path.c_str())) : image.label;
+    info.size = image.size;
+    info.architecture = image.architectures ? DescribeArchitectures(image.architectures) : L"Unknown";
+    info.isWindows = image.os == ImageOs::Windows;
+    info.isLinux = image.os == ImageOs::Linux;
+    info.supportsUEFI = (image.boot & IMAGE_BOOT_UEFI) != 0;
+    info.supportsBIOS = (image.boot & IMAGE_BOOT_BIOS) != 0;
+    info.sha256 = Utf8ToWide(image.sha256);
+    return info;
+}
+
 ISOInfo GetISOInfo(const std::wstring& isoPath) {
-    ISOInfo info;
-    info.path = isoPath;
+    // Images in the library were read when they were indexed
+    ImageInfo image;
+    FileIdentity file;
+    bool indexed = ImageLibrary::Default().Find(isoPath, image) && GetFileIdentity(isoPath, file) &&
+                   file.size == image.size && file.modifiedTime == image.modifiedTime;
+    std::wstring error;
+    if (!indexed && !ReadImageInfo(isoPath, image, error)) {
+        LogMessage(LogLevel::Warning, "library", error);
+        ISOInfo info = {};
+        info.path = isoPath;
+        info.label = L"Unknown";
+        info.architecture = L"Unknown";
+        return info;
+    }
+    ISOInfo info = ToISOInfo(image);
+    
+    // An image hashed by an earlier job shows its digest straight away
+    ImageDigest digest;
+    if (info.sha256.empty() && ImageHashCache::Default().Lookup(isoPath, digest)) {
+        info.sha256 = DigestToHex(digest.sha256, sizeof(digest.sha256));
+    }
     
-    // Get file size
-    HANDLE hFile = CreateFile(isoPath.c_str(), GENERIC_READ, FILE_SHARE_READ,
-                             NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    return info;
+}
+
+// ============================================================================
+// IMAGE LIBRARY
+// ============================================================================
+
+static std::wstring GetLibraryRootFile() {
+    return GetInfernoDataDirectory() + L"\\library_root.txt";
+}
+
+static bool ChooseLibraryFolder(HWND owner) {
+    BROWSEINFO bi = {0};
+    bi.hwndOwner = owner;
+    bi.lpszTitle = L"Choose the folder that holds your images:";
+    bi.ulFlags = BIF_RETURNONLYFSDIRS | BIF_NEWDIALOGSTYLE;
     
-    if (hFile != INVALID_HANDLE_VALUE) {
-        LARGE_INTEGER size;
-        if (GetFileSizeEx(hFile, &size)) {
-            info.size = size.QuadPart;
+    LPITEMIDLIST pidl = SHBrowseForFolder(&bi);
+    if (!pidl) {
+        return false;
+    }
+    wchar_t folder[MAX_PATH] = {0};
+    BOOL ok = SHGetPathFromIDList(pidl, folder);
+    CoTaskMemFree(pidl);
+    if (!ok) {
+        return false;
+    }
+    g_LibraryRoot = folder;
+    WriteFileAtomically(GetLibraryRootFile(), WideToUtf8(g_LibraryRoot));
+    return true;
+}
+
+// Watches the library folder and brings the index up to date in the
+// background; the list is refreshed from the index whenever either finishes.
+static void StartLibraryScan() {
+    g_LibraryWatcher.reset(new ImageLibraryWatcher(ImageLibrary::Default(), g_LibraryRoot,
+                                                   [](const LibraryIndexStats&) {
+        PostMessage(g_hMainWnd, WM_USER_LIBRARY_CHANGED, 0, 0);
+    }));
+    
+    std::wstring root = g_LibraryRoot;
+    std::thread([root]() {
+        LibraryIndexStats stats;
+        std::wstring error;
+        std::wstringstream status;
+        if (ImageLibrary::Default().Update(root, &stats, error)) {
+            status << stats.images << L" images (" << stats.read << L" read, " << stats.reused
+                   << L" unchanged) in " << std::fixed << std::setprecision(1) << stats.seconds << L" s";
+        } else {
+            status << error;
+        }
+        PostMessage(g_hMainWnd, WM_USER_LIBRARY_CHANGED, (WPARAM)_wcsdup(status.str().c_str()), 0);
+    }).detach();
+}
+
+void FillLibraryList() {
+    wchar_t query[256] = {0};
+    GetWindowText(g_hLibrarySearch, query, 256);
+    g_LibraryResults = ImageLibrary::Default().Search(g_LibraryRoot, query);
+    
+    SendMessage(g_hLibraryList, WM_SETREDRAW, FALSE, 0);
+    ListBox_ResetContent(g_hLibraryList);
+    for (const ImageInfo& image : g_LibraryResults) {
+        std::wstringstream item;
+        item << (image.label.empty() ? PathFindFileName(image.path.c_str()) : image.label.c_str());
+        item << L"  |  " << ImageOsName(image.os);
+        if (image.architectures) item << L" " << DescribeArchitectures(image.architectures);
+        if (image.boot & IMAGE_BOOT_BIOS) item << L" BIOS";
+        if (image.boot & IMAGE_BOOT_UEFI) item << L" UEFI";
+        item << L"  |  " << FormatSize(image.size) << L"  |  " << PathFindFileName(image.path.c_str());
+        ListBox_AddString(g_hLibraryList, item.str().c_str());
+    }
+    SendMessage(g_hLibraryList, WM_SETREDRAW, TRUE, 0);
+    InvalidateRect(g_hLibraryList, NULL, TRUE);
+}
+
+void ShowImageLibrary() {
+    if (g_hLibraryWnd) {
+        SetForegroundWindow(g_hLibraryWnd);
+        return;
+    }
+    if (g_LibraryRoot.empty()) {
+        std::string saved;
+        if (ReadWholeFile(GetLibraryRootFile(), saved)) {
+            g_LibraryRoot = Utf8ToWide(saved);
         }
-        CloseHandle(hFile);
     }
+    if (g_LibraryRoot.empty() && !ChooseLibraryFolder(g_hMainWnd)) {
+        return;
+    }
+    
+    static bool registered = false;
+    if (!registered) {
+        WNDCLASSEX wcex = {0};
+        wcex.cbSize = sizeof(WNDCLASSEX);
+        wcex.lpfnWndProc = LibraryWndProc;
+        wcex.hInstance = g_hInstance;
+        wcex.hCursor = LoadCursor(NULL, IDC_ARROW);
+        wcex.hbrBackground = (HBRUSH)(COLOR_WINDOW);
+        wcex.lpszClassName = L"InfernoLibrary";
+        registered = RegisterClassEx(&wcex) != 0;
+    }
+    
+    g_hLibraryWnd = CreateWindowEx(0, L"InfernoLibrary", APP_NAME L" - Image Library",
+                                   WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU,
+                                   CW_USEDEFAULT, CW_USEDEFAULT, 640, 470, g_hMainWnd, NULL, g_hInstance, NULL);
+    if (!g_hLibraryWnd) {
+        return;
+    }
+    
+    g_hLibrarySearch = CreateWindowEx(WS_EX_CLIENTEDGE, L"EDIT", NULL,
+                                      WS_CHILD | WS_VISIBLE | WS_TABSTOP | ES_AUTOHSCROLL,
+                                      10, 10, 480, 25, g_hLibraryWnd, (HMENU)IDC_LIBRARY_SEARCH, g_hInstance, NULL);
+    SendMessage(g_hLibrarySearch, EM_SETCUEBANNER, TRUE, (LPARAM)L"Search label, OS, architecture, file name...");
+    
+    HWND hFolder = CreateWindowEx(0, L"BUTTON", L"Folder...",
+                                  WS_CHILD | WS_VISIBLE | WS_TABSTOP | BS_PUSHBUTTON,
+                                  500, 10, 115, 25, g_hLibraryWnd, (HMENU)IDC_LIBRARY_FOLDER, g_hInstance, NULL);
     
-    // Try to mount ISO and read information
-    // This is a simplified version - actual implementation would be more complex
-    info.label = L"Unknown";
-    info.architecture = L"x64/x86";
-    info.isWindows = true;
-    info.isLinux = false;
-    info.supportsUEFI = true;
-    info.supportsBIOS = true;
+    g_hLibraryList = CreateWindowEx(WS_EX_CLIENTEDGE, L"LISTBOX", NULL,
+                                    WS_CHILD | WS_VISIBLE | WS_TABSTOP | WS_VSCROLL | LBS_NOTIFY |
+                                    LBS_NOINTEGRALHEIGHT,
+                                    10, 45, 605, 330, g_hLibraryWnd, (HMENU)IDC_LIBRARY_LIST, g_hInstance, NULL);
     
-    // Check file extension for basic detection
-    std::wstring ext = isoPath.substr(isoPath.find_last_of(L"."));
-    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    g_hLibraryStatus = CreateWindowEx(0, L"STATIC", g_LibraryRoot.c_str(),
+                                      WS_CHILD | WS_VISIBLE | SS_LEFT | SS_PATHELLIPSIS,
+                                      10, 390, 480, 20, g_hLibraryWnd, NULL, g_hInstance, NULL);
     
-    if (ext == L".iso" || ext == L".img") {
-        info.label = L"Bootable Disk Image";
-    } else if (ext == L".wim" || ext == L".esd") {
-        info.label = L"Windows Image";
-        info.isWindows = true;
-    } else if (ext == L".vhd" || ext == L".vhdx") {
-        info.label = L"Virtual Hard Disk";
+    HWND hSelect = CreateWindowEx(0, L"BUTTON", L"Select",
+                                  WS_CHILD | WS_VISIBLE | WS_TABSTOP | BS_PUSHBUTTON | BS_DEFPUSHBUTTON,
+                                  500, 385, 115, 30, g_hLibraryWnd, (HMENU)IDC_LIBRARY_SELECT, g_hInstance, NULL);
+    
+    HWND controls[] = {g_hLibrarySearch, hFolder, g_hLibraryList, g_hLibraryStatus, hSelect};
+    for (HWND hControl : controls) {
+        SendMessage(hControl, WM_SETFONT, (WPARAM)g_hNormalFont, TRUE);
     }
     
-    return info;
+    // The mapped index fills the list before any file is looked at
+    FillLibraryList();
+    StartLibraryScan();
+    
+    ShowWindow(g_hLibraryWnd, SW_SHOW);
+    SetFocus(g_hLibrarySearch);
+}
+
+LRESULT CALLBACK LibraryWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    switch (message) {
+        case WM_COMMAND: {
+            int wmId = LOWORD(wParam);
+            int code = HIWORD(wParam);
+            
+            if (wmId == IDC_LIBRARY_SEARCH && code == EN_CHANGE) {
+                FillLibraryList();
+            } else if (wmId == IDC_LIBRARY_FOLDER) {
+                if (ChooseLibraryFolder(hWnd)) {
+                    SetWindowText(g_hLibraryStatus, g_LibraryRoot.c_str());
+                    FillLibraryList();
+                    StartLibraryScan();
+                }
+            } else if ((wmId == IDC_LIBRARY_LIST && code == LBN_DBLCLK) || wmId == IDC_LIBRARY_SELECT) {
+                int sel = ListBox_GetCurSel(g_hLibraryList);
+                if (sel != LB_ERR && (size_t)sel < g_LibraryResults.size()) {
+                    // Everything shown comes from the index; the image is not opened
+                    SelectISO(ToISOInfo(g_LibraryResults[sel]));
+                    DestroyWindow(hWnd);
+                }
+            }
+            break;
+        }
+        
+        case WM_DESTROY:
+            g_LibraryWatcher.reset();
+            g_hLibraryWnd = NULL;
+            break;
+            
+        default:
+            return DefWindowProc(hWnd, message, wParam, lParam);
+    }
+    return 0;
 }
 
 // ============================================================================
@@ -897,9 +1265,10 @@ void StartFormatting() {
         return;
     }
     
-    // Check if drive is large enough
-    if (g_SelectedISO.size > g_SelectedDrive.freeSize) {
-        ShowErrorMessage(L"Selected drive doesn't have enough free space.");
+    // Check if drive is large enough: the write replaces everything on the
+    // disk, so what its current volume has free does not matter
+    if (g_SelectedISO.size > g_SelectedDrive.totalSize) {
+        ShowErrorMessage(L"Selected drive is too small for this image.");
         return;
     }
     
@@ -920,6 +1289,7 @@ void StartFormatting() {
     // Disable controls
     EnableWindow(g_hDriveCombo, FALSE);
     EnableWindow(g_hISOButton, FALSE);
+    EnableWindow(g_hLibraryButton, FALSE);
     EnableWindow(g_hAdvancedButton, FALSE);
     EnableWindow(g_hRefreshButton, FALSE);
     
@@ -929,200 +1299,517 @@ void StartFormatting() {
     SetWindowText(g_hStatusText, L"Starting operation...");
     SendMessage(g_hProgressBar, PBM_SETPOS, 0, 0);
     
-    // Start formatting thread
-    g_hFormatThread = CreateThread(NULL, 0, 
-                                   (LPTHREAD_START_ROUTINE)FormatThread, 
-                                   NULL, 0, NULL);
+    // Queue the job; it starts once its hub has bandwidth to spare
+    JobRequest request;
+    request.target = GetPhysicalDrivePath(g_SelectedDrive.diskNumber);
+    request.image = g_SelectedISO.path;
+    request.owner = L"gui";
+    request.priority = 1;       // ahead of station jobs submitted by other processes
+    request.bytes = g_SelectedISO.size;
+    std::shared_ptr<FormatJob> job(new FormatJob());
+    job->drive = g_SelectedDrive;
+    job->iso = g_SelectedISO;
+    job->options = g_FormatOptions;
+    g_FormatJobId = g_JobQueue->Submit(request, [job](JobContext& context, std::wstring&) {
+        return FormatThread(context, job);
+    });
+}
+
+// Returns the window to its idle state once the format job has ended
+void EndFormatting() {
+    g_IsFormatting = FALSE;
+    g_FormatJobId = 0;
+    SetWindowText(g_hStartButton, L"START");
+    EnableWindow(g_hStartButton, TRUE);
+    EnableWindow(g_hDriveCombo, TRUE);
+    EnableWindow(g_hISOButton, TRUE);
+    EnableWindow(g_hLibraryButton, TRUE);
+    EnableWindow(g_hAdvancedButton, TRUE);
+    EnableWindow(g_hRefreshButton, TRUE);
+}
+
+// Jobs submitted over IPC by station scripts: a raw copy of the image to a
+// USB disk, then a read-back verification, with the default options.
+static bool CreateStationJob(const JobRequest& request, JobRunner& run, std::wstring& error) {
+    bool usbDisk = false;
+    for (const BlockDeviceInfo& disk : EnumerateBlockDevices()) {
+        if (disk.path == request.target) usbDisk = disk.traits.usb;
+    }
+    if (!usbDisk) {
+        error = L"Only USB disks can be targets: " + request.target;
+        return false;
+    }
+    if (GetFileAttributes(request.image.c_str()) == INVALID_FILE_ATTRIBUTES) {
+        error = L"Image not found: " + request.image;
+        return false;
+    }
+    run = [](JobContext& job, std::wstring& error) {
+        const JobRequest& request = job.GetRequest();
+        std::unique_ptr<BlockDevice> device = OpenBlockDevice(request.target, true);
+        if (!device) {
+            error = L"Cannot open " + request.target + L" for writing.";
+            return false;
+        }
+        if (!device->Lock(error)) return false;
+        // Station jobs usually write the same image to a rack of drives:
+        // keep it in memory for the ones that follow
+        WriterParams params;
+        params.readPolicy = ReadPolicy::Pinned;
+        ProgressCallback progress = [&](uint64_t done, uint64_t total) -> bool {
+            job.ReportProgress(done, total);
+            return !job.IsCancelled();
+        };
+        job.SetStatus(L"Writing " + request.image);
+        WriteStats stats;
+        uint64_t mismatch = 0;
+        if (!WriteImage(request.image, *device, params, progress, &stats, error)) return false;
+        job.SetStatus(L"Verifying");
+        if (!VerifyImage(request.image, *device, params, progress, &mismatch, error)) return false;
+        job.SetStatus(L"Done in " + std::to_wstring((int)stats.elapsedSeconds) + L" s");
+        return true;
+    };
+    return true;
+}
+
+void StartJobQueue() {
+    g_JobQueue.reset(new JobQueue());
+    g_JobQueue->SetChangeCallback([](const JobStatus& status) {
+        PostMessage(g_hMainWnd, WM_USER_JOBS_CHANGED, (WPARAM)status.id, (LPARAM)status.state);
+    });
+    g_JobServer.reset(new JobQueueServer(*g_JobQueue, CreateStationJob));
+    std::wstring error;
+    if (!g_JobServer->Start(JobQueueServer::DefaultEndpoint(), error)) {
+        // Another instance serves the station; this one still runs its own jobs
+        LogMessage(LogLevel::Warning, "queue", error);
+        g_JobServer.reset();
+    }
+}
+
+// Partition indices used as "device" claim ranges by the job steps
+static const uint64_t BOOT_PARTITION = 0;
+static const uint64_t DATA_PARTITION = 1;
+
+static ResourceClaim ClaimPartition(uint64_t index) {
+    return ResourceClaim::Exclusive("device", index, index + 1);
+}
+
+// Compiled before the job starts so a raw copy can scan each chunk as it is
+// written. A missing database disables the scan without failing the job.
+static std::unique_ptr<SignatureScanner> LoadSignatureScanner() {
+    SignatureDatabase database;
+    std::unique_ptr<SignatureScanner> scanner(new SignatureScanner());
+    std::wstring error;
+    if (!database.Load(SignatureDatabase::DefaultPath(), error) || !scanner->Build(database, error)) {
+        LogMessage(LogLevel::Warning, "scan", error);
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup((L"Virus scan unavailable: " + error).c_str()), 0);
+        return nullptr;
+    }
+    LogMessage(LogLevel::Info, "scan",
+               std::to_wstring(scanner->GetSignatureCount()) + L" signatures loaded, " +
+               std::to_wstring(database.GetSkippedCount()) + L" unsupported skipped");
+    return scanner;
+}
+
+// Steps that only post a status and return
+static std::function<bool(StepContext&)> RunAction(std::function<void()> action) {
+    return [action](StepContext&) {
+        action();
+        return true;
+    };
+}
+
+// A job reads the image up to three times (checksum, write, verify). It is
+// kept in memory only when other jobs in the queue are about to read it
+// too; otherwise it is kept from pushing everything else out of the OS cache.
+static bool IsImageHot(const JobContext& context) {
+    for (const JobStatus& status : g_JobQueue->List()) {
+        if (status.id == context.GetId() || (status.state != JobState::Queued && status.state != JobState::Running)) {
+            continue;
+        }
+        if (_wcsicmp(status.request.image.c_str(), context.GetRequest().image.c_str()) == 0) return true;
+    }
+    return false;
+}
+
+// Hands the job, results and all, to the window for its report.
+static void PostOperationComplete(const std::shared_ptr<FormatJob>& job, BOOL success) {
+    std::shared_ptr<FormatJob>* message = new std::shared_ptr<FormatJob>(job);
+    if (!PostMessage(g_hMainWnd, WM_USER_OPERATION_COMPLETE, success, (LPARAM)message)) {
+        delete message;
+    }
 }
 
-DWORD WINAPI FormatThread(LPVOID lpParam) {
+bool FormatThread(JobContext& context, const std::shared_ptr<FormatJob>& formatJob) {
     // Simulate formatting process with enhanced features
     // In a real application, this would use actual disk formatting APIs
+    const DriveInfo& drive = formatJob->drive;
+    const ISOInfo& iso = formatJob->iso;
+    FormatOptions& options = formatJob->options;
+    FormatResults& results = formatJob->results;
+    
+    // Exported when the thread returns, including on failure
+    std::wstring tracePath;
+    if (options.enableTracing) {
+        tracePath = options.traceFilePath.empty() ? L"inferno_trace.json" : options.traceFilePath;
+    }
+    ScopedTraceSession traceSession(tracePath);
+    TraceSetThreadName("format thread");
+    
+    std::wstring logPath;
+    if (options.enableDetailedLogging) {
+        logPath = options.logFilePath.empty() ? GetInfernoDataDirectory() + L"\\inferno.log" : options.logFilePath;
+    }
+    ScopedLogSession logSession(logPath, LogLevel::Debug);
+    LogMessage(LogLevel::Info, "job", L"Drive: " + drive.friendlyName + L", image: " + iso.path);
     
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
                 (WPARAM)_wcsdup(L"Initializing..."), 0);
-    Sleep(500);
-    
-    // Step 1: Check drive
     PostMessage(g_hMainWnd, WM_USER_UPDATE_PROGRESS, 5, 0);
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                (WPARAM)_wcsdup(L"Checking drive integrity..."), 0);
     
-    if (g_FormatOptions.enableBadSectorCheck) {
-        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                    (WPARAM)_wcsdup(L"Performing bad sector check..."), 0);
-        Sleep(1000);
+    // Each step declares what it must wait for and which part of the drive
+    // it touches; independent steps run concurrently. Costs are estimated
+    // seconds and weight the progress bar.
+    if (options.sourceReadPolicy.empty()) {
+        options.sourceReadPolicy = IsImageHot(context) ? L"pinned" : L"drop-behind";
     }
+    const ResourceClaim wholeDevice = ResourceClaim::Exclusive("device");
+    const ResourceClaim sourceImage = ResourceClaim::Shared("source");
+    double imageMegabytes = (double)iso.size / (1024 * 1024);
     
-    // Step 2: Create partitions
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_PROGRESS, 10, 0);
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                (WPARAM)_wcsdup(L"Creating partition layout..."), 0);
-    
-    if (g_FormatOptions.createMultiplePartitions) {
-        CreateMultiplePartitions(g_SelectedDrive, g_FormatOptions);
+    if (options.enableVirusScan) {
+        results.signatureScanner = LoadSignatureScanner();
     }
     
-    // Step 3: Format drive
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_PROGRESS, 20, 0);
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                (WPARAM)_wcsdup(L"Formatting drive..."), 0);
-    
-    if (!g_FormatOptions.quickFormat) {
-        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                    (WPARAM)_wcsdup(L"Performing full format (this may take a while)..."), 0);
-        Sleep(2000);
+    StepScheduler job;
+    std::vector<const char*> featureSteps;
+    auto addFeature = [&](const char* name, std::vector<ResourceClaim> claims, double cost,
+                          std::function<bool(StepContext&)> run) {
+        job.AddStep({name, {"Format drive", "Copy image"}, claims, cost, run});
+        featureSteps.push_back(name);
+    };
+    
+    if (options.enableCustomScripts && !options.preFormatScript.empty()) {
+        job.AddStep({"Pre-format script", {}, {wholeDevice}, 0.5,
+                     RunAction([&] { RunCustomScripts(options.preFormatScript, drive); })});
     }
     
-    // Step 4: Copy files
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_PROGRESS, 40, 0);
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                (WPARAM)_wcsdup(L"Copying files..."), 0);
-    
-    if (g_FormatOptions.enableSectorBySectorCopy) {
-        PerformSectorBySectorCopy(g_SelectedDrive, g_SelectedISO.path);
+    job.AddStep({"Check drive", {"Pre-format script"}, {wholeDevice}, options.enableBadSectorCheck ? 1.0 : 0.1,
+                 RunAction([&] {
+                     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                                 (WPARAM)_wcsdup(L"Checking drive integrity..."), 0);
+                     if (options.enableBadSectorCheck) {
+                         PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                                     (WPARAM)_wcsdup(L"Performing bad sector check..."), 0);
+                         Sleep(1000);
+                     }
+                 })});
+    
+    // A full format clears the whole drive before anything is laid out on
+    // it, except what a raw copy overwrites straight after. Without discard
+    // that is a zero fill, as slow as the copy per byte
+    if (!options.quickFormat) {
+        uint64_t eraseStart = options.enableSectorBySectorCopy ? iso.size : 0;
+        double cost = 2.0;
+        if (!drive.supportsDiscard && drive.totalSize > eraseStart) {
+            cost += (double)(drive.totalSize - eraseStart) / (1024 * 1024) / 20.0;
+        }
+        job.AddStep({"Erase drive", {"Check drive"}, {wholeDevice}, cost, [&, eraseStart](StepContext& step) {
+            return PerformFullErase(drive, options, eraseStart, step) != FALSE;
+        }});
     }
     
-    // Step 5: Install bootloader
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_PROGRESS, 60, 0);
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                (WPARAM)_wcsdup(L"Installing bootloader..."), 0);
-    
-    if (g_FormatOptions.enableCustomBootMenu) {
-        CreateCustomBootMenu(g_SelectedDrive, g_FormatOptions);
+    if (options.createMultiplePartitions) {
+        job.AddStep({"Create partitions", {"Check drive", "Erase drive"}, {wholeDevice}, 0.5, [&](StepContext&) {
+            PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                        (WPARAM)_wcsdup(L"Creating partition layout..."), 0);
+            return CreateMultiplePartitions(drive, options) != FALSE;
+        }});
     }
     
-    // Step 6: Additional features
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_PROGRESS, 70, 0);
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                (WPARAM)_wcsdup(L"Applying additional features..."), 0);
-    
-    if (g_FormatOptions.enableEncryption) {
-        EnableEncryption(g_SelectedDrive, g_FormatOptions);
+    job.AddStep({"Format drive", {"Check drive", "Erase drive", "Create partitions"}, {wholeDevice}, 0.2,
+                 RunAction([&] {
+                     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                                 (WPARAM)_wcsdup(L"Formatting drive..."), 0);
+                 })});
+    
+    if (options.enableSectorBySectorCopy) {
+        job.AddStep({"Copy image", {"Format drive"}, {wholeDevice, sourceImage}, 1.0 + imageMegabytes / 20.0,
+                     [&](StepContext& step) {
+                         PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                                     (WPARAM)_wcsdup(L"Copying files..."), 0);
+                         return PerformSectorBySectorCopy(drive, iso.path, options, results, step) != FALSE;
+                     }});
     }
     
-    if (g_FormatOptions.addPersistentStorage) {
-        CreatePersistentStorage(g_SelectedDrive, g_FormatOptions);
+    // The image can be hashed while the drive is being prepared
+    if (options.enableChecksumVerification) {
+        job.AddStep({"Verify checksums", {}, {sourceImage}, 0.5 + imageMegabytes / 200.0, [&](StepContext& step) {
+            return VerifyChecksums(drive, iso.path, options, results, step) != FALSE;
+        }});
     }
     
-    if (g_FormatOptions.enableSecureBoot) {
-        EnableSecureBoot(g_SelectedDrive);
+    // A raw copy keeps the image's own menus; their files are patched in
+    // place once it has been written and verified (see "Patch boot menus")
+    if (options.enableCustomBootMenu && !options.enableSectorBySectorCopy) {
+        addFeature("Custom boot menu", {ClaimPartition(BOOT_PARTITION)}, 0.5,
+                   RunAction([&] { CreateCustomBootMenu(drive, options); }));
     }
-    
-    if (g_FormatOptions.enableTPMEmulation) {
-        EnableTPMEmulation(g_SelectedDrive);
+    // A raw copy encrypts inline instead (see PerformSectorBySectorCopy)
+    if (options.enableEncryption && !options.enableSectorBySectorCopy) {
+        addFeature("Encryption", {ClaimPartition(DATA_PARTITION)}, 0.5,
+                   RunAction([&] { EnableEncryption(drive, options); }));
     }
-    
-    if (g_FormatOptions.addDiagnosticTools) {
-        AddDiagnosticTools(g_SelectedDrive);
+    if (options.addPersistentStorage) {
+        addFeature("Persistent storage", {ClaimPartition(DATA_PARTITION)}, 0.5,
+                   RunAction([&] { CreatePersistentStorage(drive, options); }));
     }
-    
-    if (g_FormatOptions.enableLegacyBootMenu) {
-        EnableLegacyBootSupport(g_SelectedDrive);
+    if (options.enableSecureBoot) {
+        addFeature("Secure Boot", {ClaimPartition(BOOT_PARTITION)}, 0.5,
+                   RunAction([&] { EnableSecureBoot(drive); }));
     }
-    
-    if (g_FormatOptions.enableUEFISecureBoot) {
-        EnableUEFISecureBootSupport(g_SelectedDrive);
+    if (options.enableTPMEmulation) {
+        addFeature("TPM emulation", {ClaimPartition(BOOT_PARTITION)}, 0.5,
+                   RunAction([&] { EnableTPMEmulation(drive); }));
     }
-    
-    if (g_FormatOptions.enableBootPassword) {
-        SetBootPassword(g_SelectedDrive, g_FormatOptions.bootPassword);
+    if (options.addDiagnosticTools) {
+        addFeature("Diagnostic tools", {ClaimPartition(DATA_PARTITION)}, 0.5,
+                   RunAction([&] { AddDiagnosticTools(drive); }));
     }
-    
-    if (g_FormatOptions.enableChecksumVerification) {
-        VerifyChecksums(g_SelectedDrive, g_SelectedISO.path);
+    if (options.enableLegacyBootMenu) {
+        addFeature("Legacy boot support", {ClaimPartition(BOOT_PARTITION)}, 0.5,
+                   RunAction([&] { EnableLegacyBootSupport(drive); }));
     }
-    
-    if (g_FormatOptions.enableISOHybridization) {
-        CreateHybridISO(g_SelectedDrive, g_SelectedISO.path);
+    if (options.enableUEFISecureBoot) {
+        addFeature("UEFI Secure Boot support", {ClaimPartition(BOOT_PARTITION)}, 0.5,
+                   RunAction([&] { EnableUEFISecureBootSupport(drive); }));
     }
-    
-    if (g_FormatOptions.enableMultiBoot && !g_FormatOptions.additionalISOs.empty()) {
-        SetupMultiBoot(g_SelectedDrive, g_FormatOptions.additionalISOs);
+    if (options.enableBootPassword) {
+        addFeature("Boot password", {ClaimPartition(BOOT_PARTITION)}, 0.5,
+                   RunAction([&] { SetBootPassword(drive, options.bootPassword); }));
     }
-    
-    if (g_FormatOptions.enableOptimization) {
-        if (g_FormatOptions.enableSSDOptimization) {
-            OptimizeForSSD(g_SelectedDrive);
+    // A raw copy patches the hybrid tables in as it writes (see PerformSectorBySectorCopy)
+    if (options.enableISOHybridization && !options.enableSectorBySectorCopy) {
+        addFeature("Hybrid ISO", {wholeDevice, sourceImage}, 0.5,
+                   RunAction([&] { CreateHybridISO(drive, iso.path); }));
+    }
+    if (options.enableUefiBridge && !options.enableSectorBySectorCopy) {
+        addFeature("UEFI bridge", {wholeDevice}, 0.5, RunAction([&] { CreateUefiBridge(drive); }));
+    }
+    if (options.enableWimSplit && !options.enableSectorBySectorCopy) {
+        addFeature("Split Windows image", {ClaimPartition(BOOT_PARTITION), sourceImage}, 1.0 + imageMegabytes / 500.0,
+                   RunAction([&] { SplitWindowsImage(drive, iso.path); }));
+    }
+    if (options.enableMultiBoot && !options.additionalISOs.empty()) {
+        addFeature("Multi-boot", {ClaimPartition(BOOT_PARTITION), ClaimPartition(DATA_PARTITION)}, 1.0,
+                   RunAction([&] { SetupMultiBoot(drive, options.additionalISOs); }));
+    }
+    if (options.enableOptimization) {
+        if (options.enableSSDOptimization) {
+            addFeature("SSD optimization", {wholeDevice}, 0.5, RunAction([&] { OptimizeForSSD(drive); }));
         }
-        
-        if (g_FormatOptions.enableSmartSectorAllocation) {
-            EnableSmartSectorAllocation(g_SelectedDrive);
+        if (options.enableSmartSectorAllocation) {
+            addFeature("Smart sector allocation", {wholeDevice}, 0.5,
+                       RunAction([&] { EnableSmartSectorAllocation(drive); }));
         }
-        
-        if (g_FormatOptions.enableAIOSOptimization) {
-            ApplyAIOSOptimization(g_SelectedDrive);
+        if (options.enableAIOSOptimization) {
+            addFeature("AIOS optimization", {wholeDevice}, 0.5, RunAction([&] { ApplyAIOSOptimization(drive); }));
         }
     }
+    if (options.enableRaidDriverIntegration) {
+        addFeature("RAID drivers", {ClaimPartition(DATA_PARTITION)}, 0.5,
+                   RunAction([&] { IntegrateRaidDrivers(drive, options.additionalDriversPath, iso.architecture); }));
+    }
+    if (options.enableBitLockerPreProvision) {
+        addFeature("BitLocker pre-provisioning", {ClaimPartition(DATA_PARTITION)}, 0.5,
+                   RunAction([&] { PreProvisionBitLocker(drive); }));
+    }
+    if (options.createRecoveryPartition) {
+        addFeature("Recovery partition", {wholeDevice}, 0.5, RunAction([&] { CreateRecoveryPartition(drive); }));
+    }
     
-    if (g_FormatOptions.enableRaidDriverIntegration) {
-        IntegrateRaidDrivers(g_SelectedDrive, g_FormatOptions.additionalDriversPath);
+    // A raw copy scans the image as it is written, so this step only reports;
+    // otherwise the image is scanned while the drive is being prepared
+    if (options.enableVirusScan) {
+        double cost = options.enableSectorBySectorCopy ? 0.1 : 0.5 + imageMegabytes / 500.0;
+        job.AddStep({"Virus scan", {"Copy image"}, {sourceImage}, cost, [&](StepContext& step) {
+            return ScanForViruses(drive, iso.path, options, results, step) != FALSE;
+        }});
+        featureSteps.push_back("Virus scan");
     }
     
-    if (g_FormatOptions.enableBitLockerPreProvision) {
-        PreProvisionBitLocker(g_SelectedDrive);
+    std::vector<const char*> contentSteps = featureSteps;
+    contentSteps.insert(contentSteps.end(), {"Format drive", "Copy image", "Verify checksums"});
+    if (options.enableCustomScripts && !options.postFormatScript.empty()) {
+        job.AddStep({"Post-format script", contentSteps, {wholeDevice}, 0.5,
+                     RunAction([&] { RunCustomScripts(options.postFormatScript, drive); })});
+        contentSteps.push_back("Post-format script");
     }
     
-    if (g_FormatOptions.createRecoveryPartition) {
-        CreateRecoveryPartition(g_SelectedDrive);
+    if (options.enablePostFormatVerification) {
+        double cost = options.enableSectorBySectorCopy ? 0.5 + imageMegabytes / 30.0 : 0.5;
+        if (options.enableSectorBySectorCopy && IsSampledVerification(options)) {
+            // Metadata plus a few hundred sampled chunks at most
+            cost = 0.5 + std::min(imageMegabytes, 2048.0) / 30.0;
+        }
+        job.AddStep({"Verification", contentSteps, {ResourceClaim::Shared("device")}, cost, [&](StepContext& step) {
+            PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                        (WPARAM)_wcsdup(L"Verifying installation..."), 0);
+            return PerformPostFormatVerification(drive, iso.path, options, results, step) != FALSE;
+        }});
+        contentSteps.push_back("Verification");
     }
     
-    if (g_FormatOptions.enableVirusScan) {
-        ScanForViruses(g_SelectedDrive);
+    // Verification compares the drive with the image as it was copied, so
+    // the steps that rewrite parts of the copy come after it, one at a time
+    if (options.enableSectorBySectorCopy && (options.enableCustomBootMenu || options.addPersistentStorage)) {
+        job.AddStep({"Patch boot menus", contentSteps, {wholeDevice}, 0.2, [&](StepContext& step) {
+            return PatchBootMenus(drive, options, step) != FALSE;
+        }});
+        contentSteps.push_back("Patch boot menus");
+    }
+    // An encrypted copy's partition table is inside the LUKS volume
+    if (options.enableSectorBySectorCopy && options.enableGrowToDrive && !options.enableEncryption) {
+        job.AddStep({"Grow to drive", contentSteps, {wholeDevice}, 0.1, [&](StepContext& step) {
+            return GrowCopiedImage(drive, step) != FALSE;
+        }});
+        contentSteps.push_back("Grow to drive");
     }
     
-    if (g_FormatOptions.enableCustomScripts) {
-        if (!g_FormatOptions.preFormatScript.empty()) {
-            RunCustomScripts(g_FormatOptions.preFormatScript, g_SelectedDrive);
-        }
-        if (!g_FormatOptions.postFormatScript.empty()) {
-            RunCustomScripts(g_FormatOptions.postFormatScript, g_SelectedDrive);
-        }
+    if (options.enableCloudBackup) {
+        job.AddStep({"Cloud backup", contentSteps, {ResourceClaim::Shared("device")}, 0.5,
+                     RunAction([&] { BackupToCloud(drive.deviceID, options.cloudBackupPath); })});
+    }
+    if (options.enableTelemetry) {
+        job.AddStep({"Telemetry", contentSteps, {}, 0.5, RunAction([&] { EnableTelemetry(drive, options); })});
     }
     
-    // Step 7: Verification
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_PROGRESS, 90, 0);
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                (WPARAM)_wcsdup(L"Verifying installation..."), 0);
+    LogEvent(LogLevel::Info, "job", "schedule",
+             {{"total_ms", (int64_t)(job.TotalCost() * 1000)}, {"critical_path_ms", (int64_t)(job.CriticalPathCost() * 1000)}});
     
-    if (g_FormatOptions.enablePostFormatVerification) {
-        PerformPostFormatVerification(g_SelectedDrive, g_FormatOptions);
+    // The job owns the 5-95% band of the progress bar
+    int lastProgress = 5;
+    JobProgressCallback progress = [&](double fraction, const char*) -> bool {
+        int value = 5 + (int)(fraction * 90);
+        if (value != lastProgress) {
+            lastProgress = value;
+            PostMessage(g_hMainWnd, WM_USER_UPDATE_PROGRESS, value, 0);
+        }
+        context.ReportProgress((uint64_t)(fraction * iso.size), iso.size);
+        return !context.IsCancelled();
+    };
+    
+    // Failing steps post their own status message
+    std::wstring error;
+    bool completed = job.Run(4, progress, error);
+    
+    // Hand the buffers cached for this job's stages back to the OS
+    BufferArena& arena = BufferArena::Default();
+    ArenaStats arenaStats = arena.GetStats();
+    LogEvent(LogLevel::Info, "arena", "job",
+             {{"peak_bytes", (int64_t)arenaStats.peakReservedBytes}, {"limit", (int64_t)arenaStats.memoryLimit},
+              {"huge_page_bytes", (int64_t)arenaStats.hugePageBytes}, {"reuses", (int64_t)arenaStats.reuses},
+              {"waits", (int64_t)arenaStats.waits}});
+    arena.Trim();
+    
+    if (!completed) {
+        LogMessage(LogLevel::Error, "job", error);
+        PostOperationComplete(formatJob, FALSE);
+        return false;
     }
     
-    // Step 8: Finalization
     PostMessage(g_hMainWnd, WM_USER_UPDATE_PROGRESS, 95, 0);
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
                 (WPARAM)_wcsdup(L"Finalizing..."), 0);
     
-    if (g_FormatOptions.enableCloudBackup) {
-        BackupToCloud(g_SelectedDrive.deviceID, g_FormatOptions.cloudBackupPath);
-    }
-    
-    if (g_FormatOptions.enableTelemetry) {
-        EnableTelemetry(g_SelectedDrive, g_FormatOptions);
-    }
-    
     // Complete
     PostMessage(g_hMainWnd, WM_USER_UPDATE_PROGRESS, 100, 0);
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
                 (WPARAM)_wcsdup(L"Operation completed successfully!"), 0);
     
     Sleep(1000);
-    PostMessage(g_hMainWnd, WM_USER_OPERATION_COMPLETE, TRUE, 0);
+    PostOperationComplete(formatJob, TRUE);
     
-    return 0;
+    return true;
 }
 
 // ============================================================================
 // ADVANCED FEATURES IMPLEMENTATION
 // ============================================================================
 
-void CreateMultiplePartitions(const DriveInfo& drive, const FormatOptions& options) {
-    // Implementation for creating multiple partitions
-    // This would use Windows Disk Management APIs
+BOOL CreateMultiplePartitions(const DriveInfo& drive, const FormatOptions& options) {
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
                 (WPARAM)_wcsdup(L"Creating multiple partitions..."), 0);
-    Sleep(500);
+    
+    PartitionLayoutRequest request;
+    request.style = (options.partitionScheme == L"GPT") ? PartitionStyle::GPT : PartitionStyle::MBR;
+    request.mbrType = (options.fileSystem == L"FAT32") ? 0x0C : 0x07;
+    request.name = options.volumeLabel;
+    request.sizesPercent = options.partitionSizes;
+    if (request.sizesPercent.empty()) {
+        // No explicit sizes: split the drive evenly. The last partition takes
+        // the remainder, so the total is 100 and it runs to the end of the disk
+        int count = std::max(options.partitionCount, 1);
+        request.sizesPercent.assign(count, 100 / count);
+        request.sizesPercent.back() = 100 - (count - 1) * (100 / count);
+    }
+    
+    std::wstring error;
+    std::unique_ptr<BlockDevice> device = OpenBlockDevice(GetPhysicalDrivePath(drive.diskNumber), true);
+    BOOL success = FALSE;
+    if (!device) {
+        error = L"Cannot open the physical drive for writing.";
+    } else if (device->Lock(error)) {
+        PartitionTable table;
+        if (ComputePartitionLayout(device->GetGeometry(), request, table, error) &&
+            WritePartitionTable(*device, table, error)) {
+            success = TRUE;
+        }
+    }
+    
+    if (!success) {
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup((L"Partitioning failed: " + error).c_str()), 0);
+    }
+    return success;
+}
+
+// Full format: discard the drive from `startOffset` on where it supports
+// TRIM/UNMAP, check samples of every region for zeros and write zeros only
+// where they are not
+BOOL PerformFullErase(const DriveInfo& drive, const FormatOptions& options, uint64_t startOffset, StepContext& step) {
+    std::wstring error;
+    std::unique_ptr<BlockDevice> device = OpenBlockDevice(GetPhysicalDrivePath(drive.diskNumber), true);
+    if (!device) {
+        error = L"Cannot open the physical drive for writing.";
+    } else if (device->Lock(error)) {
+        const wchar_t* status = device->GetTraits().supportsDiscard
+                                    ? L"Erasing drive (discard)..."
+                                    : L"Performing full format (this may take a while)...";
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(status), 0);
+        WriterParams params = GetTunedWriterParams(*device, options);
+        ProgressCallback progress = [&](uint64_t done, uint64_t total) -> bool {
+            if (total) step.ReportProgress((double)done / total);
+            return !step.IsCancelled();
+        };
+        EraseParams erase;
+        erase.startOffset = startOffset;
+        EraseStats stats;
+        if (EraseDevice(*device, params, progress, &stats, error, erase)) {
+            std::wstringstream summary;
+            summary << L"Drive erased in " << std::fixed << std::setprecision(1) << stats.elapsedSeconds << L" s ("
+                    << FormatSize(stats.bytesDiscarded) << L" discarded, " << FormatSize(stats.bytesZeroed)
+                    << L" written)";
+            LogMessage(LogLevel::Info, "erase", summary.str());
+            PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(summary.str().c_str()), 0);
+            return TRUE;
+        }
+    }
+    
+    LogMessage(LogLevel::Error, "erase", error);
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                (WPARAM)_wcsdup((L"Full format failed: " + error).c_str()), 0);
+    return FALSE;
 }
 
 void EnableEncryption(const DriveInfo& drive, const FormatOptions& options) {
@@ -1167,6 +1854,81 @@ void CreateCustomBootMenu(const DriveInfo& drive, const FormatOptions& options)
     Sleep(500);
 }
 
+// Edits the GRUB, syslinux and systemd-boot files of the image just copied
+// to the drive rather than extracting it in file mode: a few sectors of
+// patching against a copy of every file.
+BOOL PatchBootMenus(const DriveInfo& drive, const FormatOptions& options, StepContext& step) {
+    BootConfigPatch patch;
+    patch.persistence = options.addPersistentStorage;
+    if (options.enableCustomBootMenu) {
+        patch.menuTitle = options.customBootMenuText;
+    }
+    if (patch.IsEmpty()) {
+        return TRUE;
+    }
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                (WPARAM)_wcsdup(L"Patching boot menus..."), 0);
+    
+    std::wstring error;
+    std::unique_ptr<BlockDevice> device = OpenBlockDevice(GetPhysicalDrivePath(drive.diskNumber), true);
+    BootConfigPatchReport report;
+    if (!device) {
+        error = L"Cannot open the physical drive for writing.";
+    } else if (device->Lock(error) && PatchBootConfigs(*device, patch, &report, error)) {
+        step.ReportProgress(1.0);
+        std::wstringstream summary;
+        summary << L"Boot menus patched: " << report.patchedFiles.size() << L" of " << report.configFiles
+                << L" files, " << FormatSize(report.sectorsWritten * device->GetGeometry().logicalSectorSize)
+                << L" written in " << std::fixed << std::setprecision(1) << report.seconds * 1000 << L" ms";
+        LogMessage(LogLevel::Info, "bootcfg", summary.str());
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(summary.str().c_str()), 0);
+        return TRUE;
+    }
+    
+    LogMessage(LogLevel::Error, "bootcfg", error);
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                (WPARAM)_wcsdup((L"Boot menu patching failed: " + error).c_str()), 0);
+    return FALSE;
+}
+
+// The copied image's GPT backup moves to the end of the drive and its last
+// partition, with the file system in it, grows into the rest: metadata
+// writes only, where repartitioning would mean formatting and copying again.
+BOOL GrowCopiedImage(const DriveInfo& drive, StepContext& step) {
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                (WPARAM)_wcsdup(L"Growing the last partition to the drive..."), 0);
+    
+    std::wstring error;
+    std::unique_ptr<BlockDevice> device = OpenBlockDevice(GetPhysicalDrivePath(drive.diskNumber), true);
+    DriveGrowReport report;
+    if (!device) {
+        error = L"Cannot open the physical drive for writing.";
+    } else if (device->Lock(error) && GrowToDrive(*device, &report, error)) {
+        step.ReportProgress(1.0);
+        std::wstringstream summary;
+        if (report.partitionBytesAfter > report.partitionBytesBefore) {
+            summary << L"Last partition grown from " << FormatSize(report.partitionBytesBefore) << L" to "
+                    << FormatSize(report.partitionBytesAfter) << L", " << report.fileSystem.fileSystem << L" to "
+                    << FormatSize(report.fileSystem.bytesAfter) << L" ("
+                    << FormatSize(report.fileSystem.bytesWritten) << L" written in " << std::fixed << std::setprecision(1) << report.seconds * 1000 << L" ms)";
+        } else {
+            summary << L"Partition table extended to the end of the drive";
+        }
+        LogMessage(LogLevel::Info, "grow", summary.str());
+        if (!report.fileSystem.limit.empty()) {
+            LogMessage(LogLevel::Info, "grow", report.fileSystem.fileSystem + L" stops short: " +
+                                                   report.fileSystem.limit);
+        }
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(summary.str().c_str()), 0);
+        return TRUE;
+    }
+    
+    LogMessage(LogLevel::Error, "grow", error);
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                (WPARAM)_wcsdup((L"Growing to the drive failed: " + error).c_str()), 0);
+    return FALSE;
+}
+
 void EnableLegacyBootSupport(const DriveInfo& drive) {
     // Implementation for legacy boot support
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
@@ -1188,27 +1950,277 @@ void SetBootPassword(const DriveInfo& drive, const std::wstring& password) {
     Sleep(500);
 }
 
-void VerifyChecksums(const DriveInfo& drive, const std::wstring& isoPath) {
-    // Implementation for checksum verification
+// Looks for a published digest next to the image: "<image>.sha256" or an
+// entry in "SHA256SUMS" ("<hex>  <name>" or "<hex> *<name>").
+std::wstring FindPublishedSha256(const std::wstring& isoPath) {
+    size_t slash = isoPath.find_last_of(L"\\/");
+    std::wstring directory = (slash == std::wstring::npos) ? L"" : isoPath.substr(0, slash + 1);
+    std::wstring fileName = (slash == std::wstring::npos) ? isoPath : isoPath.substr(slash + 1);
+    
+    const std::wstring candidates[] = {isoPath + L".sha256", directory + L"SHA256SUMS"};
+    for (const std::wstring& candidate : candidates) {
+        FILE* file = _wfopen(candidate.c_str(), L"rb");
+        if (!file) continue;
+        
+        char line[1024];
+        std::wstring found;
+        bool sidecar = (&candidate == &candidates[0]);
+        while (found.empty() && fgets(line, sizeof(line), file)) {
+            std::string text(line);
+            size_t end = text.find_first_of(" \t\r\n");
+            std::string hex = text.substr(0, end);
+            if (hex.size() != 64 || hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+                continue;
+            }
+            std::string rest = (end == std::string::npos) ? "" : text.substr(end);
+            rest.erase(0, rest.find_first_not_of(" \t*"));
+            rest.erase(rest.find_last_not_of("\r\n") + 1);
+            
+            std::wstring name(rest.begin(), rest.end());
+            if (sidecar || _wcsicmp(name.c_str(), fileName.c_str()) == 0) {
+                found.assign(hex.begin(), hex.end());
+                std::transform(found.begin(), found.end(), found.begin(), ::towlower);
+            }
+        }
+        fclose(file);
+        if (!found.empty()) return found;
+    }
+    return L"";
+}
+
+static ReadPolicy GetSourceReadPolicy(const FormatOptions& options) {
+    ReadPolicy policy = ReadPolicy::Buffered;
+    if (!options.sourceReadPolicy.empty() && !ParseReadPolicy(options.sourceReadPolicy, policy)) {
+        LogMessage(LogLevel::Warning, "source", L"Unknown read policy " + options.sourceReadPolicy);
+    }
+    return policy;
+}
+
+BOOL VerifyChecksums(const DriveInfo& drive, const std::wstring& isoPath, const FormatOptions& options,
+                     FormatResults& results, StepContext& step) {
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
                 (WPARAM)_wcsdup(L"Verifying checksums..."), 0);
-    Sleep(500);
+    
+    ProgressCallback progress = [&](uint64_t done, uint64_t total) -> bool {
+        if (total) step.ReportProgress((double)done / total);
+        return !step.IsCancelled();
+    };
+    
+    // Unchanged images are not read again; the chunk digests stored with
+    // the checksum also let verification skip the image
+    ImageDigest digest;
+    bool fromCache = false;
+    std::wstring error;
+    if (!GetImageDigest(isoPath, ImageHashCache::Default(), digest, progress, &fromCache, error,
+                        GetSourceReadPolicy(options))) {
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup((L"Checksum failed: " + error).c_str()), 0);
+        return FALSE;
+    }
+    results.imageSha256 = DigestToHex(digest.sha256, sizeof(digest.sha256));
+    LogEvent(LogLevel::Info, "checksum", fromCache ? "cache_hit" : "hashed", {{"bytes", (int64_t)digest.length}});
+    
+    std::wstring expected = FindPublishedSha256(isoPath);
+    if (!expected.empty() && expected != results.imageSha256) {
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup((L"SHA-256 mismatch: expected " + expected).c_str()), 0);
+        return FALSE;
+    }
+    
+    std::wstring status = (expected.empty() ? L"SHA-256: " : L"SHA-256 matches published digest: ") +
+                          results.imageSha256;
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(status.c_str()), 0);
+    return TRUE;
+}
+
+WriterParams GetTunedWriterParams(BlockDevice& device, const FormatOptions& options) {
+    WriterParams params;
+    params.readPolicy = GetSourceReadPolicy(options);
+    if (!options.enableOptimization) {
+        return params;
+    }
+    
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                (WPARAM)_wcsdup(L"Calibrating drive write performance..."), 0);
+    
+    TraceSpan span("stage", "Calibrate writer");
+    TuningResult result;
+    std::wstring error;
+    if (!TuneWriter(device, ParseTuningProfile(options.optimizationProfile),
+                    DeviceProfileDatabase::Default(), result, error)) {
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup((L"Calibration skipped: " + error).c_str()), 0);
+        return params;
+    }
+    
+    std::wstringstream status;
+    status << (result.fromDatabase ? L"Using stored drive profile: " : L"Drive calibrated: ")
+           << result.params.chunkSize / 1024 << L" KB x " << result.params.queueDepth
+           << L" (" << FormatSize((ULONGLONG)result.expectedBytesPerSecond) << L"/s)";
+    LogMessage(LogLevel::Info, "tuner", status.str());
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(status.str().c_str()), 0);
+    result.params.readPolicy = params.readPolicy;
+    return result.params;
+}
+
+// The partition tables that make a plain ISO boot from the drive, patched
+// into the image's system area on the way to the drive instead of writing
+// a modified copy of the image first. Images that cannot be hybridized are
+// still copied as they are.
+static bool PrepareHybridISO(const std::wstring& isoPath, BlockDevice& device, IsoHybridLayout& layout) {
+    std::wstring error;
+    if (!BuildIsoHybridLayout(isoPath, device.GetGeometry(), layout, error)) {
+        layout = IsoHybridLayout();
+        LogMessage(LogLevel::Warning, "hybrid", error);
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup((L"Hybrid ISO skipped: " + error).c_str()), 0);
+        return false;
+    }
+    
+    std::wstring boot = layout.biosBootable && layout.efiBootable ? L"BIOS and UEFI"
+                        : layout.efiBootable ? L"UEFI" : L"BIOS";
+    std::wstring status = layout.head.empty() ? L"Image is already hybrid (" + boot + L")"
+                                              : L"Creating hybrid ISO (" + boot + L" boot)...";
+    LogMessage(LogLevel::Info, "hybrid", status);
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(status.c_str()), 0);
+    return true;
 }
 
-void PerformSectorBySectorCopy(const DriveInfo& drive, const std::wstring& isoPath) {
-    // Implementation for sector-by-sector copy
+BOOL PerformSectorBySectorCopy(const DriveInfo& drive, const std::wstring& isoPath, const FormatOptions& options,
+                               FormatResults& results, StepContext& step) {
+    std::unique_ptr<BlockDevice> device = OpenBlockDevice(GetPhysicalDrivePath(drive.diskNumber), true);
+    if (!device) {
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup(L"Cannot open the physical drive for writing."), 0);
+        return FALSE;
+    }
+    
+    // Windows refuses raw writes over a mounted volume; the volumes stay
+    // locked and dismounted until the device is closed
+    std::wstring error;
+    if (!device->Lock(error)) {
+        LogMessage(LogLevel::Error, "copy", error);
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup((L"Copy failed: " + error).c_str()), 0);
+        return FALSE;
+    }
+    
+    WriterParams params = GetTunedWriterParams(*device, options);
+    
+    // The controller retunes the write past the drive's SLC cache and
+    // expects the slowdown where this model last hit it
+    DeviceIdentity identity = device->GetIdentity();
+    std::unique_ptr<WriteController> controller;
+    if (options.enableAdaptiveWrite) {
+        WriteControllerParams adaptive;
+        DeviceProfile stored;
+        if (identity.IsKnown() && DeviceProfileDatabase::Default().Find(identity, stored)) {
+            adaptive.expectedCacheBytes = stored.slcCacheBytes;
+            adaptive.expectedSlowBytesPerSecond = stored.slcExhaustedBytesPerSecond;
+        }
+        controller.reset(new WriteController(params, adaptive));
+        params.controller = controller.get();
+    }
+    
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
                 (WPARAM)_wcsdup(L"Performing sector-by-sector copy..."), 0);
-    Sleep(1000);
+    
+    // Compressed images report no total until the end. With a controller the
+    // bar follows the expected time rather than the bytes written
+    auto lastEstimate = std::chrono::steady_clock::now();
+    ProgressCallback progress = [&](uint64_t done, uint64_t total) -> bool {
+        if (total) {
+            step.ReportProgress(controller ? controller->EstimateTimeFraction(done, total) : (double)done / total);
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (controller && total && now - lastEstimate >= std::chrono::seconds(2)) {
+            lastEstimate = now;
+            double remaining = controller->EstimateSecondsRemaining(done, total);
+            if (remaining >= 0) {
+                std::wstringstream status;
+                status << L"Copying: " << FormatSize(done) << L" of " << FormatSize(total) << L", about "
+                       << (int64_t)remaining / 60 << L" min " << (int64_t)remaining % 60 << L" s left";
+                PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(status.str().c_str()), 0);
+            }
+        }
+        return !step.IsCancelled();
+    };
+    
+    // Every chunk passes the signature scanner on its way to the drive
+    ChunkTransform scanTap = results.signatureScanner ? results.signatureScanner->AsTap() : ChunkTransform();
+    
+    results.isoHybridLayout = IsoHybridLayout();
+    ChunkTransform transform = scanTap;
+    if (options.enableISOHybridization && !options.enableEncryption) {
+        if (PrepareHybridISO(isoPath, *device, results.isoHybridLayout) && !results.isoHybridLayout.head.empty()) {
+            ChunkTransform patch = MakeIsoHybridPatch(results.isoHybridLayout);
+            transform = [scanTap, patch](uint64_t offset, uint8_t* data, size_t length) {
+                if (scanTap) scanTap(offset, data, length);
+                patch(offset, data, length);
+            };
+        }
+    }
+    
+    WriteStats stats;
+    BOOL success;
+    if (options.enableEncryption) {
+        // The whole drive becomes a LUKS2 volume holding the image
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup(L"Deriving encryption key..."), 0);
+        EncryptionParams encryption;
+        encryption.passphrase = WideToUtf8(options.encryptionPassword);
+        // Encryption sectors as large as the physical ones, so a 512e
+        // drive is written in whole sectors
+        uint32_t alignment = GetWriteAlignment(device->GetGeometry());
+        encryption.sectorSize = std::min<uint32_t>(4096, std::max<uint32_t>(512, alignment));
+        success = WriteEncryptedImage(isoPath, *device, 0, encryption, params, progress, &stats, error, scanTap);
+    } else if (!transform) {
+        // Nothing to rewrite on the way: one thread keeps the whole queue
+        // in flight through overlapped I/O
+        success = WriteImageToDevices(isoPath, {device.get()}, params, progress, &stats, error);
+    } else {
+        success = WriteImage(isoPath, *device, params, progress, &stats, error, transform) &&
+                  WriteIsoHybridBackup(*device, results.isoHybridLayout, error);
+    }
+    
+    device.reset();
+    
+    if (controller) {
+        results.writeSummary = controller->GetSummary();
+        if (results.writeSummary.cliffDetected && identity.IsKnown()) {
+            DeviceProfileDatabase::Default().StoreWriteCliff(identity, results.writeSummary.cliffBytes,
+                                                             results.writeSummary.slowBytesPerSecond);
+        }
+    }
+    
+    if (!success) {
+        LogMessage(LogLevel::Error, "copy", error);
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup((L"Copy failed: " + error).c_str()), 0);
+    }
+    return success;
 }
 
 void CreateHybridISO(const DriveInfo& drive, const std::wstring& isoPath) {
-    // Implementation for ISO hybridization
+    // Hybrid tables describe the image's own layout, which only a raw copy keeps
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                (WPARAM)_wcsdup(L"Hybrid ISO needs a sector-by-sector copy; skipped."), 0);
+}
+
+void CreateUefiBridge(const DriveInfo& drive) {
+    // Implementation for the UEFI bridge partition
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                (WPARAM)_wcsdup(L"Creating hybrid ISO..."), 0);
+                (WPARAM)_wcsdup(L"Adding UEFI bridge partition..."), 0);
     Sleep(500);
 }
 
+void SplitWindowsImage(const DriveInfo& drive, const std::wstring& isoPath) {
+    // Implementation for splitting install.wim into .swm parts
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                (WPARAM)_wcsdup(L"Splitting Windows image..."), 0);
+    Sleep(1000);
+}
+
 void SetupMultiBoot(const DriveInfo& drive, const std::vector<std::wstring>& isos) {
     // Implementation for multi-boot setup
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
@@ -1237,11 +2249,75 @@ void ApplyAIOSOptimization(const DriveInfo& drive) {
     Sleep(500);
 }
 
-void IntegrateRaidDrivers(const DriveInfo& drive, const std::wstring& driversPath) {
-    // Implementation for RAID driver integration
+// Copies the files of one driver package folder (not its subfolders, which
+// usually hold other packages) into `target`
+static BOOL CopyDriverFolder(const std::wstring& folder, const std::wstring& target) {
+    int created = SHCreateDirectoryExW(NULL, target.c_str(), NULL);
+    if (created != ERROR_SUCCESS && created != ERROR_ALREADY_EXISTS && created != ERROR_FILE_EXISTS) {
+        return FALSE;
+    }
+    WIN32_FIND_DATAW entry;
+    HANDLE find = FindFirstFileW((folder + L"\\*").c_str(), &entry);
+    if (find == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+    BOOL ok = TRUE;
+    do {
+        if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+        if (!CopyFileW((folder + L"\\" + entry.cFileName).c_str(), (target + L"\\" + entry.cFileName).c_str(),
+                       FALSE)) {
+            ok = FALSE;
+        }
+    } while (FindNextFileW(find, &entry));
+    FindClose(find);
+    return ok;
+}
+
+void IntegrateRaidDrivers(const DriveInfo& drive, const std::wstring& driversPath, const std::wstring& architecture) {
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                (WPARAM)_wcsdup(L"Integrating RAID drivers..."), 0);
-    Sleep(500);
+                (WPARAM)_wcsdup(L"Indexing RAID drivers..."), 0);
+    
+    // The catalog remembers every INF it has parsed, so only packages added
+    // or changed since the last run are read again
+    DriverCatalog& catalog = DriverCatalog::Default();
+    DriverIndexStats stats;
+    std::wstring error;
+    if (!catalog.Update(driversPath, &stats, error)) {
+        LogMessage(LogLevel::Warning, "drivers", error);
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup((L"RAID drivers: " + error).c_str()), 0);
+        return;
+    }
+    
+    // Storage controller packages for the image's architecture
+    uint32_t architectures = ParseDriverArchitecture(architecture);
+    std::vector<DriverPackage> packages = catalog.Select(driversPath, architectures, {L"SCSIAdapter", L"HDC"});
+    
+    // Windows Setup loads every driver under \$WinPEDriver$ on the install
+    // media before it looks for disks
+    std::vector<std::wstring> folders;
+    for (const DriverPackage& package : packages) {
+        std::wstring folder = package.path.substr(0, package.path.find_last_of(L'\\'));
+        if (std::find(folders.begin(), folders.end(), folder) == folders.end()) {
+            folders.push_back(folder);
+        }
+    }
+    
+    size_t copied = 0;
+    for (size_t i = 0; i < folders.size(); i++) {
+        std::wstring name = folders[i].substr(folders[i].find_last_of(L'\\') + 1);
+        std::wstring target = drive.deviceID + L"$WinPEDriver$\\" + std::to_wstring(i + 1) + L"_" + name;
+        if (CopyDriverFolder(folders[i], target)) {
+            copied++;
+        } else {
+            LogMessage(LogLevel::Warning, "drivers", L"Cannot copy driver package " + folders[i]);
+        }
+    }
+    
+    std::wstringstream status;
+    status << L"RAID drivers: " << copied << L" of " << stats.packages << L" packages integrated ("
+           << stats.parsed << L" indexed, " << stats.reused + stats.rehashed << L" cached)";
+    LogMessage(LogLevel::Info, "drivers", status.str());
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(status.str().c_str()), 0);
 }
 
 void PreProvisionBitLocker(const DriveInfo& drive) {
@@ -1258,11 +2334,40 @@ void CreateRecoveryPartition(const DriveInfo& drive) {
     Sleep(500);
 }
 
-void ScanForViruses(const DriveInfo& drive) {
-    // Implementation for virus scanning
-    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
-                (WPARAM)_wcsdup(L"Scanning for viruses..."), 0);
-    Sleep(1000);
+BOOL ScanForViruses(const DriveInfo& drive, const std::wstring& isoPath, const FormatOptions& options,
+                    FormatResults& results, StepContext& step) {
+    if (!results.signatureScanner) {
+        return TRUE;
+    }
+    SignatureScanner& scanner = *results.signatureScanner;
+    
+    // Raw copies were scanned on the way to the drive
+    if (!options.enableSectorBySectorCopy) {
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup(L"Scanning for viruses..."), 0);
+        ProgressCallback progress = [&](uint64_t done, uint64_t total) -> bool {
+            if (total) step.ReportProgress((double)done / total);
+            return !step.IsCancelled();
+        };
+        std::wstring error;
+        TraceSpan span("stage", "Signature scan");
+        if (!ScanImage(isoPath, scanner, progress, error)) {
+            PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                        (WPARAM)_wcsdup((L"Virus scan failed: " + error).c_str()), 0);
+            return FALSE;
+        }
+    }
+    
+    for (const SignatureMatch& match : scanner.GetMatches()) {
+        LogMessage(LogLevel::Warning, "scan",
+                   Utf8ToWide(scanner.GetSignature(match.signature).name) + L" at offset " +
+                   std::to_wstring(match.offset));
+    }
+    std::wstring status = scanner.GetMatchCount() == 0
+        ? L"Virus scan: no signatures found in " + FormatSize(scanner.GetBytesScanned())
+        : L"Virus scan: " + std::to_wstring(scanner.GetMatchCount()) + L" signature matches (see report)";
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(status.c_str()), 0);
+    return TRUE;
 }
 
 void BackupToCloud(const std::wstring& sourcePath, const std::wstring& cloudPath) {
@@ -1279,11 +2384,115 @@ void EnableTelemetry(const DriveInfo& drive, const FormatOptions& options) {
     Sleep(500);
 }
 
-void PerformPostFormatVerification(const DriveInfo& drive, const FormatOptions& options) {
-    // Implementation for post-format verification
+bool IsSampledVerification(const FormatOptions& options) {
+    return options.verificationMode == L"sampled";
+}
+
+// Verifies the partition tables, file system metadata and boot images in
+// full and a seeded random sample of the rest. Returns 1 if the drive
+// matches, 0 on a mismatch and -1 if the image cannot be sampled (a
+// compressed image of unknown length with no cached digest), in which case
+// the caller verifies in full.
+static int PerformSampledVerification(BlockDevice& device, const std::wstring& isoPath, const FormatOptions& options,
+                                      FormatResults& results, const ProgressCallback& progress, std::wstring& error) {
+    std::vector<ByteRange> metadata;
+    if (!FindImageMetadataRegions(isoPath, metadata, error)) {
+        return -1;
+    }
+    SampledVerifyParams sampling;
+    if (options.verificationConfidence > 0 && options.verificationConfidence < 1) {
+        sampling.confidence = options.verificationConfidence;
+    }
+    
+    SampledVerifyReport report;
+    bool verified;
+    ImageDigest digest;
+    if (results.isoHybridLayout.head.empty() && ImageHashCache::Default().Lookup(isoPath, digest)) {
+        verified = VerifyImageDigestSampled(device, digest, metadata, sampling, WriterParams(), progress,
+                                            &report, nullptr, error);
+    } else {
+        std::unique_ptr<ImageSource> image = OpenImageSource(isoPath, error);
+        if (!image || image->GetSize() == 0) {
+            if (image) error = L"The image size is unknown.";
+            return -1;
+        }
+        image.reset();
+        const IsoHybridLayout& layout = results.isoHybridLayout;
+        ChunkTransform patch = layout.head.empty() ? ChunkTransform() : MakeIsoHybridPatch(layout);
+        verified = VerifyImageSampled(isoPath, device, metadata, sampling, WriterParams(), progress,
+                                      &report, nullptr, error, patch);
+    }
+    if (!verified) {
+        return 0;
+    }
+    
+    std::wstringstream summary;
+    summary << std::fixed << std::setprecision(1) << L"Sampled verification (seed " << report.seed << L"): "
+            << report.metadataChunks << L" metadata and " << report.sampledChunks << L" of "
+            << report.dataChunks << L" data chunks, " << report.coverage * 100 << L"% of the image; with "
+            << report.confidence * 100 << L"% confidence at most " << report.undetectedChunks << L" data chunks ("
+            << report.undetectedFraction * 100 << L"%) are damaged undetected";
+    results.verificationSummary = summary.str();
+    PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, (WPARAM)_wcsdup(results.verificationSummary.c_str()), 0);
+    return 1;
+}
+
+BOOL PerformPostFormatVerification(const DriveInfo& drive, const std::wstring& isoPath, const FormatOptions& options,
+                                   FormatResults& results, StepContext& step) {
     PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
                 (WPARAM)_wcsdup(L"Performing post-format verification..."), 0);
-    Sleep(1000);
+    
+    // Only a raw copy has a byte-for-byte reference to compare against
+    if (!options.enableSectorBySectorCopy) {
+        return TRUE;
+    }
+    
+    std::unique_ptr<BlockDevice> device = OpenBlockDevice(GetPhysicalDrivePath(drive.diskNumber), false);
+    if (!device) {
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup(L"Cannot open the physical drive for verification."), 0);
+        return FALSE;
+    }
+    
+    ProgressCallback progress = [&](uint64_t done, uint64_t total) -> bool {
+        if (total) step.ReportProgress((double)done / total);
+        return !step.IsCancelled();
+    };
+    
+    std::wstring error;
+    BOOL verified;
+    ImageDigest digest;
+    if (!options.enableEncryption && IsSampledVerification(options)) {
+        int sampled = PerformSampledVerification(*device, isoPath, options, results, progress, error);
+        if (sampled >= 0) {
+            verified = sampled != 0;
+            if (!verified) {
+                PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                            (WPARAM)_wcsdup((L"Verification failed: " + error).c_str()), 0);
+            }
+            return verified;
+        }
+        LogMessage(LogLevel::Warning, "verify", L"Sampled verification unavailable, verifying in full: " + error);
+        error.clear();
+    }
+    if (options.enableEncryption) {
+        verified = VerifyEncryptedImage(isoPath, *device, 0, WideToUtf8(options.encryptionPassword),
+                                        WriterParams(), progress, nullptr, error);
+    } else if (results.isoHybridLayout.head.empty() && ImageHashCache::Default().Lookup(isoPath, digest)) {
+        // The drive holds the image unchanged and its chunk digests are
+        // cached: hash the drive alone instead of reading both
+        verified = VerifyImageDigest(*device, digest, WriterParams(), progress, nullptr, error);
+    } else {
+        const IsoHybridLayout& layout = results.isoHybridLayout;
+        ChunkTransform patch = layout.head.empty() ? ChunkTransform() : MakeIsoHybridPatch(layout);
+        verified = VerifyImage(isoPath, *device, WriterParams(), progress, nullptr, error, patch);
+    }
+    if (!verified) {
+        PostMessage(g_hMainWnd, WM_USER_UPDATE_STATUS, 
+                    (WPARAM)_wcsdup((L"Verification failed: " + error).c_str()), 0);
+        return FALSE;
+    }
+    return TRUE;
 }
 
 void RunCustomScripts(const std::wstring& scriptPath, const DriveInfo& drive) {
@@ -1463,41 +2672,88 @@ void UpdateUIFromOptions() {
                    g_FormatOptions.quickFormat ? BST_CHECKED : BST_UNCHECKED);
 }
 
-void AutoDetectBestSettings(const DriveInfo& drive, const ISOInfo& iso, FormatOptions& options) {
+// How the image is written follows from what is in it (hybrid tables,
+// boot modes, how many files and how large) and from how fast this drive
+// model has taken writes before. Touches no UI or global state.
+SettingsPlan PlanBestSettings(const DriveInfo& drive, const ISOInfo& iso) {
+    SettingsPlan result;
+    if (AnalyzeImage(iso.path, result.contents, result.error)) {
+        std::wstring devicePath = GetPhysicalDrivePath(drive.diskNumber);
+        std::unique_ptr<BlockDevice> device = OpenBlockDevice(devicePath, false);
+        DeviceIdentity identity = device ? device->GetIdentity() : DeviceIdentity();
+        DeviceGeometry geometry;
+        if (device) {
+            geometry = device->GetGeometry();
+        } else {
+            geometry.sizeBytes = drive.totalSize;
+            geometry.logicalSectorSize = drive.logicalSectorSize;
+            geometry.physicalSectorSize = drive.physicalSectorSize;
+        }
+        DeviceSpeed speed = LookupDeviceSpeed(identity, devicePath, DeviceProfileDatabase::Default());
+        result.planned = PlanImageWrite(result.contents, speed, geometry, result.plan, result.error);
+    }
+    return result;
+}
+
+// Plans for the current selection on a worker and posts the result back
+// (WM_USER_SETTINGS_PLANNED); only the latest selection's plan is applied.
+void StartAutoDetect() {
+    WPARAM generation = (WPARAM)++g_AutoDetectGeneration;
+    DriveInfo drive = g_SelectedDrive;
+    ISOInfo iso = g_SelectedISO;
+    SetWindowText(g_hStatusText, L"Analyzing image...");
+    std::thread([generation, drive, iso]() {
+        SettingsPlan* plan = new SettingsPlan(PlanBestSettings(drive, iso));
+        if (!PostMessage(g_hMainWnd, WM_USER_SETTINGS_PLANNED, generation, (LPARAM)plan)) {
+            delete plan;
+        }
+    }).detach();
+}
+
+void AutoDetectBestSettings(const ISOInfo& iso, const SettingsPlan& planned, FormatOptions& options) {
     // Auto-detect best settings based on drive and ISO
     options.volumeLabel = L"INFERNO_USB";
     
-    // Set partition scheme based on drive size and type
-    if (drive.totalSize > 2ULL * 1024 * 1024 * 1024) { // > 2GB
-        options.partitionScheme = L"GPT";
-    } else {
-        options.partitionScheme = L"MBR";
-    }
-    
-    // Set target system based on ISO capabilities
-    if (iso.supportsUEFI) {
-        options.targetSystem = L"UEFI";
-    } else if (iso.supportsBIOS) {
-        options.targetSystem = L"BIOS";
-    } else {
-        options.targetSystem = L"UEFI-CSM";
-    }
-    
-    // Set file system based on target system
-    if (options.targetSystem == L"UEFI") {
-        options.fileSystem = L"FAT32";
+    const ImageContents& contents = planned.contents;
+    const WritePlan& plan = planned.plan;
+    if (planned.planned) {
+        options.enableSectorBySectorCopy = plan.strategy == WriteStrategy::RawCopy;
+        options.enableISOHybridization = options.enableSectorBySectorCopy && contents.hybridizable;
+        options.enableUefiBridge = plan.strategy == WriteStrategy::ExfatUefiBridge;
+        options.enableWimSplit = plan.strategy == WriteStrategy::WimSplit;
+        // An ISO's partitions are read-only ISO9660 and a small ESP, and its
+        // system area is covered by media checksums: left as written
+        options.enableGrowToDrive = options.enableSectorBySectorCopy && contents.info.format != ImageFormat::Iso9660;
+        options.partitionScheme = plan.partitionScheme;
+        options.targetSystem = plan.targetSystem;
+        if (!plan.fileSystem.empty()) {
+            options.fileSystem = plan.fileSystem;
+        }
+        
+        std::wstring status = DescribeEstimate(plan.estimates[(size_t)plan.strategy]);
+        for (const StrategyEstimate& estimate : plan.estimates) {
+            LogMessage(LogLevel::Info, "planner", DescribeEstimate(estimate));
+        }
+        SetWindowText(g_hStatusText, status.c_str());
     } else {
-        options.fileSystem = L"NTFS";
-    }
-    
-    // Enable advanced features for large drives
-    if (drive.totalSize > 8ULL * 1024 * 1024 * 1024) { // > 8GB
-        options.createMultiplePartitions = true;
-        options.partitionCount = 2;
-        options.partitionSizes = {70, 30};
-        options.addPersistentStorage = true;
-        options.enableOptimization = true;
-        options.enableSSDOptimization = true;
+        LogMessage(LogLevel::Warning, "planner", planned.error);
+        
+        // Set target system based on ISO capabilities
+        if (iso.supportsUEFI) {
+            options.targetSystem = L"UEFI";
+        } else if (iso.supportsBIOS) {
+            options.targetSystem = L"BIOS";
+        } else {
+            options.targetSystem = L"UEFI-CSM";
+        }
+        options.partitionScheme = options.targetSystem == L"UEFI" ? L"GPT" : L"MBR";
+        
+        // Set file system based on target system
+        if (options.targetSystem == L"UEFI") {
+            options.fileSystem = L"FAT32";
+        } else {
+            options.fileSystem = L"NTFS";
+        }
     }
     
     // Enable security features for Windows ISOs
@@ -1507,16 +2763,27 @@ void AutoDetectBestSettings(const DriveInfo& drive, const ISOInfo& iso, FormatOp
         options.enableBitLockerPreProvision = true;
     }
     
-    // Enable diagnostic tools for all
-    options.addDiagnosticTools = true;
-    options.createRecoveryPartition = true;
+    // Extra partitions need room the image's own layout does not leave
+    options.addDiagnosticTools = !options.enableSectorBySectorCopy;
+    options.createRecoveryPartition = !options.enableSectorBySectorCopy;
     
     // Set optimization profile
     options.optimizationProfile = L"performance";
+    
+    // A full format zero-fills drives without discard, which takes hours
+    // on a large stick; it stays something the user asks for
+    options.quickFormat = true;
+    
+    // Calibration sees only the fast start of a stick with an SLC cache
+    options.enableAdaptiveWrite = true;
 }
 
-void GenerateDetailedReport(const DriveInfo& drive, const FormatOptions& options, BOOL success) {
+void GenerateDetailedReport(const FormatJob& job, BOOL success) {
     // Generate a detailed report of the operation
+    const DriveInfo& drive = job.drive;
+    const ISOInfo& iso = job.iso;
+    const FormatOptions& options = job.options;
+    const FormatResults& results = job.results;
     std::wstringstream report;
     report << L"Inferno Operation Report\n";
     report << L"========================\n\n";
@@ -1530,9 +2797,13 @@ void GenerateDetailedReport(const DriveInfo& drive, const FormatOptions& options
     report << L"  Partition Scheme: " << options.partitionScheme << L"\n\n";
     
     report << L"ISO Information:\n";
-    report << L"  Path: " << g_SelectedISO.path << L"\n";
-    report << L"  Size: " << FormatSize(g_SelectedISO.size) << L"\n";
-    report << L"  Label: " << g_SelectedISO.label << L"\n\n";
+    report << L"  Path: " << iso.path << L"\n";
+    report << L"  Size: " << FormatSize(iso.size) << L"\n";
+    report << L"  Label: " << iso.label << L"\n";
+    if (!results.imageSha256.empty()) {
+        report << L"  SHA-256: " << results.imageSha256 << L"\n";
+    }
+    report << L"\n";
     
     report << L"Options Used:\n";
     report << L"  Target System: " << options.targetSystem << L"\n";
@@ -1544,6 +2815,47 @@ void GenerateDetailedReport(const DriveInfo& drive, const FormatOptions& options
     report << L"  Optimization: " << (options.enableOptimization ? L"Yes" : L"No") << L"\n";
     report << L"  Cloud Backup: " << (options.enableCloudBackup ? L"Yes" : L"No") << L"\n";
     
+    if (!results.writeSummary.decisions.empty()) {
+        const WriteControllerSummary& write = results.writeSummary;
+        report << L"\nWrite Control:\n";
+        report << L"  Peak: " << FormatSize((ULONGLONG)write.peakBytesPerSecond) << L"/s\n";
+        if (write.cliffDetected) {
+            report << L"  SLC cache exhausted after " << FormatSize(write.cliffBytes) << L", then "
+                   << FormatSize((ULONGLONG)write.slowBytesPerSecond) << L"/s\n";
+        }
+        report << L"  Final: " << write.chunkSize / 1024 << L" KB x " << write.queueDepth << L", "
+               << write.flushes << L" intermediate flushes\n";
+        for (const WriteDecision& decision : write.decisions) {
+            report << L"    " << DescribeWriteDecision(decision) << L"\n";
+        }
+    }
+    
+    if (options.enablePostFormatVerification) {
+        report << L"\nVerification:\n";
+        report << L"  Mode: " << (IsSampledVerification(options) ? L"Sampled" : L"Full") << L"\n";
+        if (!results.verificationSummary.empty()) {
+            report << L"  " << results.verificationSummary << L"\n";
+        }
+    }
+    
+    // Offsets are into the image; LBAs are the drive's logical sectors from
+    // its start, where an unencrypted raw copy puts them (4096 bytes on 4Kn)
+    if (results.signatureScanner) {
+        const SignatureScanner& scanner = *results.signatureScanner;
+        uint64_t sectorSize = drive.logicalSectorSize ? drive.logicalSectorSize : 512;
+        report << L"\nVirus Scan:\n";
+        report << L"  Signatures: " << scanner.GetSignatureCount() << L"\n";
+        report << L"  Scanned: " << FormatSize(scanner.GetBytesScanned()) << L"\n";
+        report << L"  Matches: " << scanner.GetMatchCount() << L"\n";
+        for (const SignatureMatch& match : scanner.GetMatches()) {
+            report << L"    " << Utf8ToWide(scanner.GetSignature(match.signature).name)
+                   << L" at offset " << match.offset << L" (LBA " << match.offset / sectorSize << L")\n";
+        }
+        if (scanner.GetMatchCount() > scanner.GetMatches().size()) {
+            report << L"    ... " << scanner.GetMatchCount() - scanner.GetMatches().size() << L" more\n";
+        }
+    }
+    
     // Save report to file
     std::wofstream file(L"inferno_report.txt");
     if (file.is_open()) {
@@ -1571,15 +2883,38 @@ std::wstring FormatSize(ULONGLONG size) {
     return ss.str();
 }
 
-BOOL IsDriveUSB(DWORD diskNumber) {
-    // Simplified USB detection
-    // In a real application, this would use SetupDi APIs
-    return TRUE; // Assume all removable drives are USB for demo
+std::wstring GetPartitionStyle(DWORD diskNumber) {
+    std::unique_ptr<BlockDevice> device = OpenBlockDevice(GetPhysicalDrivePath(diskNumber), false);
+    if (!device) {
+        return L"Unknown";
+    }
+    
+    PartitionTable table;
+    if (!ReadPartitionTable(*device, table)) {
+        return L"Unknown";
+    }
+    return PartitionStyleName(table.style);
 }
 
-std::wstring GetPartitionStyle(DWORD diskNumber) {
-    // Simplified partition style detection
-    return L"MBR"; // Default for demo
+BOOL GetVolumeDiskNumber(const wchar_t* rootPath, DWORD* diskNumber) {
+    // "E:\" -> "\\.\E:"
+    std::wstring volumePath = L"\\\\.\\" + std::wstring(rootPath).substr(0, 2);
+    HANDLE hVolume = CreateFile(volumePath.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL, OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+    
+    STORAGE_DEVICE_NUMBER number;
+    DWORD bytes = 0;
+    BOOL ok = DeviceIoControl(hVolume, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0,
+                              &number, sizeof(number), &bytes, NULL);
+    CloseHandle(hVolume);
+    
+    if (ok) {
+        *diskNumber = number.DeviceNumber;
+    }
+    return ok;
 }
 
 std::wstring GetFileSystemName(const std::wstring& rootPath) {
@@ -1666,3 +3001,8 @@ std::wstring GetCurrentDateTime() {
 #define IDC_START             1005
 #define IDC_DIAGNOSTICS       1006
 #define IDC_ABOUT             1007
+#define IDC_LIBRARY           1008
+#define IDC_LIBRARY_SEARCH    1009
+#define IDC_LIBRARY_LIST      1010
+#define IDC_LIBRARY_SELECT    1011
+#define IDC_LIBRARY_FOLDER    1012
@@ -0,0 +1,274 @@
+// ============================================================================
+// INFERNO - In-place isohybrid for raw ISO9660 copies
+// ============================================================================
+
+#include "IsoHybrid.h"
+#include "ImageSource.h"
+#include "PartitionTable.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+static const uint32_t ISO_FIRST_DESCRIPTOR = 16;
+static const uint32_t ISO_MAX_DESCRIPTORS = 32;
+static const uint8_t DESCRIPTOR_BOOT_RECORD = 0;
+static const uint8_t DESCRIPTOR_PRIMARY = 1;
+static const uint8_t DESCRIPTOR_TERMINATOR = 255;
+static const char EL_TORITO_ID[] = "EL TORITO SPECIFICATION";
+
+static const uint8_t CATALOG_VALIDATION = 0x01;
+static const uint8_t CATALOG_BOOTABLE = 0x88;
+static const uint8_t CATALOG_SECTION_MORE = 0x90;
+static const uint8_t CATALOG_SECTION_FINAL = 0x91;
+static const uint8_t CATALOG_EXTENSION = 0x44;
+static const uint8_t PLATFORM_X86 = 0x00;
+static const uint8_t PLATFORM_EFI = 0xEF;
+
+static const size_t MBR_BOOT_CODE_SIZE = 440;
+static const size_t MBR_PARTITION_OFFSET = 446;
+
+// ============================================================================
+// BYTE ORDER
+// ============================================================================
+
+static uint16_t ReadLe16(const uint8_t* p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t ReadLe32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// ============================================================================
+// BOOT RECORDS
+// ============================================================================
+
+// An EFI El Torito entry usually records a sector count of 0 or 1 and
+// leaves the size to the FAT file system inside the image.
+static bool ReadFatImageSize(ImageReader& reader, uint64_t offset, uint64_t& bytes, std::wstring& error) {
+    uint8_t boot[512];
+    if (!reader.ReadAt(offset, boot, sizeof(boot), error)) {
+        return false;
+    }
+    uint16_t bytesPerSector = ReadLe16(boot + 0x0B);
+    uint32_t sectors = ReadLe16(boot + 0x13);
+    if (sectors == 0) sectors = ReadLe32(boot + 0x20);
+    if (ReadLe16(boot + 510) != 0xAA55 || bytesPerSector < 512 || sectors == 0) {
+        error = L"The EFI boot image is not a FAT file system.";
+        return false;
+    }
+    bytes = (uint64_t)sectors * bytesPerSector;
+    return true;
+}
+
+static bool ParseBootCatalog(ImageReader& reader, uint32_t catalogSector, IsoBootInfo& info, std::wstring& error) {
+    info.catalogOffset = (uint64_t)catalogSector * ISO_SECTOR_SIZE;
+    uint8_t catalog[ISO_SECTOR_SIZE];
+    if (!reader.ReadAt((uint64_t)catalogSector * ISO_SECTOR_SIZE, catalog, sizeof(catalog), error)) {
+        return false;
+    }
+
+    // The validation entry's 16-bit words sum to zero.
+    uint16_t sum = 0;
+    for (int i = 0; i < 32; i += 2) sum = (uint16_t)(sum + ReadLe16(catalog + i));
+    if (catalog[0] != CATALOG_VALIDATION || catalog[0x1E] != 0x55 || catalog[0x1F] != 0xAA || sum != 0) {
+        error = L"The El Torito boot catalog is damaged.";
+        return false;
+    }
+
+    uint8_t platform = catalog[1];
+    uint32_t efiSector = 0;
+    uint16_t efiCount = 0;
+    for (size_t entry = 32; entry + 32 <= sizeof(catalog); entry += 32) {
+        const uint8_t* record = catalog + entry;
+        if (record[0] == CATALOG_SECTION_MORE || record[0] == CATALOG_SECTION_FINAL) {
+            platform = record[1];
+            continue;
+        }
+        if (record[0] == CATALOG_EXTENSION) {
+            continue;
+        }
+        if (record[0] != CATALOG_BOOTABLE) {
+            // The default entry may be non-bootable; later zeros end the catalog.
+            if (entry == 32) continue;
+            break;
+        }
+        // Counts are in 512-byte virtual sectors; no-emulation loaders often
+        // record only their first ISO sector.
+        uint32_t loadSector = ReadLe32(record + 8);
+        uint16_t loadCount = ReadLe16(record + 6);
+        info.bootImages.push_back({(uint64_t)loadSector * ISO_SECTOR_SIZE,
+                                   std::max<uint64_t>((uint64_t)loadCount * 512, ISO_SECTOR_SIZE)});
+        if (platform == PLATFORM_X86) {
+            info.hasBiosImage = true;
+        } else if (platform == PLATFORM_EFI && !info.hasEfiImage) {
+            info.hasEfiImage = true;
+            efiSector = loadSector;
+            efiCount = loadCount;
+        }
+    }
+
+    if (info.hasEfiImage) {
+        info.efiImageOffset = (uint64_t)efiSector * ISO_SECTOR_SIZE;
+        if (efiCount > 1) {
+            info.efiImageBytes = (uint64_t)efiCount * 512;
+        } else if (!ReadFatImageSize(reader, info.efiImageOffset, info.efiImageBytes, error)) {
+            return false;
+        }
+        for (ByteRange& image : info.bootImages) {
+            if (image.offset == info.efiImageOffset) image.length = std::max(image.length, info.efiImageBytes);
+        }
+    }
+    return true;
+}
+
+bool ReadIsoBootInfo(const std::wstring& imagePath, IsoBootInfo& info, std::wstring& error) {
+    info = IsoBootInfo();
+    ImageReader reader(imagePath);
+
+    uint8_t systemArea[512];
+    if (!reader.ReadAt(0, systemArea, sizeof(systemArea), error)) {
+        return false;
+    }
+    info.hasMbrBootCode = std::any_of(systemArea, systemArea + MBR_BOOT_CODE_SIZE, [](uint8_t b) { return b != 0; });
+    if (ReadLe16(systemArea + 510) == 0xAA55) {
+        for (int i = 0; i < 4; i++) {
+            info.alreadyHybrid |= systemArea[MBR_PARTITION_OFFSET + 16 * i + 4] != 0;
+        }
+    }
+
+    uint32_t catalogSector = 0;
+    bool foundPrimary = false;
+    for (uint32_t index = 0; index < ISO_MAX_DESCRIPTORS; index++) {
+        uint8_t descriptor[ISO_SECTOR_SIZE];
+        if (!reader.ReadAt((uint64_t)(ISO_FIRST_DESCRIPTOR + index) * ISO_SECTOR_SIZE, descriptor,
+                           sizeof(descriptor), error)) {
+            return false;
+        }
+        if (memcmp(descriptor + 1, "CD001", 5) != 0) {
+            break;
+        }
+        if (descriptor[0] == DESCRIPTOR_PRIMARY) {
+            info.volumeBytes = (uint64_t)ReadLe32(descriptor + 80) * ISO_SECTOR_SIZE;
+            foundPrimary = true;
+        } else if (descriptor[0] == DESCRIPTOR_BOOT_RECORD &&
+                   memcmp(descriptor + 7, EL_TORITO_ID, sizeof(EL_TORITO_ID) - 1) == 0) {
+            catalogSector = ReadLe32(descriptor + 0x47);
+        } else if (descriptor[0] == DESCRIPTOR_TERMINATOR) {
+            break;
+        }
+    }
+    if (!foundPrimary) {
+        error = L"The image is not an ISO9660 file system.";
+        return false;
+    }
+    if (catalogSector != 0 && !ParseBootCatalog(reader, catalogSector, info, error)) {
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+// HYBRID LAYOUT
+// ============================================================================
+
+bool BuildIsoHybridLayout(const std::wstring& imagePath, const DeviceGeometry& geometry,
+                          IsoHybridLayout& layout, std::wstring& error) {
+    layout = IsoHybridLayout();
+    IsoBootInfo info;
+    if (!ReadIsoBootInfo(imagePath, info, error)) {
+        return false;
+    }
+    layout.biosBootable = info.hasBiosImage && info.hasMbrBootCode;
+    layout.efiBootable = info.hasEfiImage;
+    if (info.alreadyHybrid) {
+        return true;
+    }
+    // Without MBR boot code in the image there is nothing a BIOS could run,
+    // and synthesizing it would mean shipping a boot loader.
+    if (!layout.efiBootable && !layout.biosBootable) {
+        error = info.hasBiosImage ? L"The image boots from CD only: it has no MBR boot code or EFI boot image."
+                                  : L"The image has no El Torito boot image.";
+        return false;
+    }
+
+    uint32_t sectorSize = geometry.logicalSectorSize;
+    PartitionTable table;
+    table.style = PartitionStyle::GPT;
+    table.sectorSize = sectorSize;
+    table.totalSectors = geometry.sizeBytes / sectorSize;
+    table.diskGuid = NewRandomGuid();
+    memcpy(&table.mbrSignature, table.diskGuid.bytes, sizeof(table.mbrSignature));
+    table.firstUsableLba = ISO_SYSTEM_AREA_SIZE / sectorSize;
+    uint64_t entrySectors = (128 * 128 + sectorSize - 1) / sectorSize;
+    if (table.totalSectors < table.firstUsableLba + 2 * entrySectors + 2 ||
+        info.volumeBytes > (table.totalSectors - entrySectors - 1) * sectorSize) {
+        error = L"The image does not fit on the drive with a backup GPT.";
+        return false;
+    }
+    table.lastUsableLba = table.totalSectors - entrySectors - 2;
+
+    if (info.hasEfiImage) {
+        if (info.efiImageOffset % sectorSize != 0) {
+            error = L"The EFI boot image is not aligned to the drive's sectors.";
+            return false;
+        }
+        PartitionEntry esp;
+        esp.startLba = info.efiImageOffset / sectorSize;
+        esp.sectorCount = (info.efiImageBytes + sectorSize - 1) / sectorSize;
+        esp.typeGuid = GPT_TYPE_EFI_SYSTEM;
+        esp.uniqueGuid = NewRandomGuid();
+        esp.name = L"EFI System";
+        table.partitions.push_back(esp);
+    }
+
+    GptImage gpt;
+    if (!BuildGptImage(table, gpt, error)) {
+        return false;
+    }
+    if (gpt.primary.size() > ISO_SYSTEM_AREA_SIZE) {
+        error = L"The drive's sectors are too large for the ISO system area.";
+        return false;
+    }
+
+    // Start from the image's own system area: its boot code stays, and only
+    // the MBR records and the GPT sectors are replaced.
+    layout.head.resize(ISO_SYSTEM_AREA_SIZE);
+    ImageReader reader(imagePath);
+    if (!reader.ReadAt(0, layout.head.data(), layout.head.size(), error)) {
+        return false;
+    }
+    memcpy(layout.head.data() + MBR_BOOT_CODE_SIZE, gpt.primary.data() + MBR_BOOT_CODE_SIZE,
+           512 - MBR_BOOT_CODE_SIZE);
+    memcpy(layout.head.data() + sectorSize, gpt.primary.data() + sectorSize, gpt.primary.size() - sectorSize);
+    // Many BIOSes only boot a drive with an active partition.
+    if (layout.biosBootable) {
+        layout.head[MBR_PARTITION_OFFSET] = 0x80;
+    }
+
+    layout.backup = gpt.backup;
+    layout.backupOffset = gpt.backupLba * sectorSize;
+    return true;
+}
+
+ChunkTransform MakeIsoHybridPatch(const IsoHybridLayout& layout) {
+    std::vector<uint8_t> head = layout.head;
+    return [head](uint64_t offset, uint8_t* data, size_t length) {
+        if (offset >= head.size()) return;
+        size_t count = (size_t)std::min<uint64_t>(length, head.size() - offset);
+        memcpy(data, head.data() + offset, count);
+    };
+}
+
+bool WriteIsoHybridBackup(BlockDevice& device, const IsoHybridLayout& layout, std::wstring& error) {
+    if (layout.backup.empty()) {
+        return true;
+    }
+    if (!WriteAligned(device, layout.backupOffset, layout.backup.data(), layout.backup.size()) || !device.Flush()) {
+        error = L"Failed to write the backup GPT.";
+        return false;
+    }
+    device.ReloadPartitionTable();
+    return true;
+}
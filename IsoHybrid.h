@@ -0,0 +1,56 @@
+// ============================================================================
+// INFERNO - In-place isohybrid for raw ISO9660 copies
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+#include "ImageWriter.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// ISO9660 logical sectors and the 16-sector system area before the volume
+// descriptors, which hybrid images use for their partition tables.
+static const uint32_t ISO_SECTOR_SIZE = 2048;
+static const uint32_t ISO_SYSTEM_AREA_SIZE = 16 * ISO_SECTOR_SIZE;
+
+// What an image's volume descriptors and El Torito boot catalog offer.
+struct IsoBootInfo {
+    uint64_t volumeBytes = 0;           // ISO9660 volume space size
+    bool hasBiosImage = false;          // x86 El Torito entry
+    bool hasEfiImage = false;           // EFI El Torito entry (a FAT image)
+    uint64_t efiImageOffset = 0;
+    uint64_t efiImageBytes = 0;
+    uint64_t catalogOffset = 0;         // 0 without a boot catalog
+    std::vector<ByteRange> bootImages;  // every bootable catalog entry
+    bool hasMbrBootCode = false;        // system area carries MBR boot code
+    bool alreadyHybrid = false;         // system area already holds a partition table
+};
+
+bool ReadIsoBootInfo(const std::wstring& imagePath, IsoBootInfo& info, std::wstring& error);
+
+// The partition tables that make the image boot from a USB drive in DD
+// mode: a bootable protective MBR that keeps the image's boot code, and a
+// GPT whose EFI system partition is the El Torito EFI image. The primary
+// tables replace the start of the system area; the backup GPT goes at the
+// end of the drive.
+struct IsoHybridLayout {
+    std::vector<uint8_t> head;          // new contents of the image's first head.size() bytes
+    std::vector<uint8_t> backup;
+    uint64_t backupOffset = 0;          // device byte offset of `backup`
+    bool biosBootable = false;
+    bool efiBootable = false;
+};
+
+// Fails when the image cannot be made bootable this way. An image that is
+// already hybrid yields an empty layout, which patches nothing.
+bool BuildIsoHybridLayout(const std::wstring& imagePath, const DeviceGeometry& geometry,
+                          IsoHybridLayout& layout, std::wstring& error);
+
+// Overlays the layout's head on the chunks of the image stream it covers.
+ChunkTransform MakeIsoHybridPatch(const IsoHybridLayout& layout);
+
+// Writes the backup GPT after the image has been copied.
+bool WriteIsoHybridBackup(BlockDevice& device, const IsoHybridLayout& layout, std::wstring& error);
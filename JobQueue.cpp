@@ -0,0 +1,981 @@
+// ============================================================================
+// INFERNO - Topology-aware multi-job queue and its local IPC endpoint
+// ============================================================================
+
+#include "JobQueue.h"
+#include "Log.h"
+#include "Platform.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <sstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+static const size_t MAX_HISTORY = 256;
+static const double SATURATED_RATIO = 0.8;      // a shared link delivering less than this of the demand is full
+static const size_t MAX_REQUEST_BYTES = 64 * 1024;
+static const int IO_TIMEOUT_MILLIS = 5000;
+
+const wchar_t* JobStateName(JobState state) {
+    switch (state) {
+    case JobState::Queued:    return L"queued";
+    case JobState::Running:   return L"running";
+    case JobState::Succeeded: return L"succeeded";
+    case JobState::Failed:    return L"failed";
+    case JobState::Cancelled: return L"cancelled";
+    default:                  return L"unknown";
+    }
+}
+
+// ============================================================================
+// JOB CONTEXT
+// ============================================================================
+
+void JobContext::ReportProgress(uint64_t bytesDone, uint64_t bytesTotal) {
+    m_bytesDone.store(bytesDone, std::memory_order_relaxed);
+    m_bytesTotal.store(bytesTotal, std::memory_order_relaxed);
+}
+
+void JobContext::SetStatus(const std::wstring& status) {
+    std::lock_guard<std::mutex> guard(m_statusLock);
+    m_status = status;
+}
+
+bool JobContext::IsCancelled() const {
+    return m_cancelled.load(std::memory_order_relaxed);
+}
+
+// ============================================================================
+// QUEUE
+// ============================================================================
+
+struct JobQueue::Job {
+    JobContext context;
+    JobRunner run;
+    UsbTopology topology;
+    std::vector<std::string> links;     // controller first, then each hub down to the target's
+    JobState state = JobState::Queued;
+    double submittedAt = 0.0;
+    double startedAt = 0.0;
+    bool started = false;
+    bool returned = false;              // the runner is done; the thread can be joined
+    bool succeeded = false;
+    std::wstring error;
+    std::thread thread;
+
+    uint64_t sampleBytes = 0;
+    double sampleTime = 0.0;
+    double rate = 0.0;                  // smoothed measured bytes per second
+    bool progressed = false;            // wrote something in the last sampling interval
+};
+
+JobQueue::JobQueue(const JobQueueParams& params)
+    : m_params(params), m_start(std::chrono::steady_clock::now()) {
+    m_thread = std::thread([this] { Run(); });
+}
+
+JobQueue::~JobQueue() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    m_thread.join();
+}
+
+double JobQueue::Now() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+void JobQueue::SetChangeCallback(const JobChangeCallback& changed) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_changed = changed;
+}
+
+uint64_t JobQueue::Submit(const JobRequest& request, const JobRunner& run) {
+    // Resolved outside the lock: it reads sysfs or walks the device tree.
+    UsbTopology topology;
+    QueryUsbTopology(request.target, topology);
+
+    std::unique_ptr<Job> job(new Job());
+    job->context.m_request = request;
+    job->run = run;
+    job->topology = topology;
+    if (topology.IsKnown()) {
+        job->links.push_back("controller:" + WideToUtf8(topology.controller));
+        for (const UsbHub& hub : topology.hubs) {
+            job->links.push_back("hub:" + WideToUtf8(hub.path));
+        }
+    }
+
+    JobStatus status;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        job->context.m_id = m_nextId++;
+        job->submittedAt = Now();
+        // Nominal capacities; measurements replace them
+        if (topology.IsKnown()) {
+            m_linkCapacities.emplace(job->links[0], m_params.unknownLinkBytesPerSecond);
+            for (size_t i = 0; i < topology.hubs.size(); i++) {
+                uint32_t speed = topology.hubs[i].speedMbps;
+                m_linkCapacities.emplace(job->links[i + 1], speed ? EstimateUsbLinkBytesPerSecond(speed)
+                                                                  : m_params.unknownLinkBytesPerSecond);
+            }
+        }
+        status = MakeStatus(*job, job->submittedAt);
+        m_jobs.push_back(std::move(job));
+    }
+    LogMessage(LogLevel::Info, "queue", L"Job " + std::to_wstring(status.id) + L" for " + request.target + L" on " +
+                                            DescribeUsbTopology(topology));
+    Notify({status});
+    m_wake.notify_all();
+    return status.id;
+}
+
+bool JobQueue::Cancel(uint64_t id) {
+    std::vector<JobStatus> events;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        auto found = std::find_if(m_jobs.begin(), m_jobs.end(),
+                                  [id](const std::unique_ptr<Job>& job) { return job->context.m_id == id; });
+        if (found == m_jobs.end()) return false;
+        Job& job = **found;
+        job.context.m_cancelled = true;
+        if (job.state == JobState::Queued) {
+            Finish(job, Now());
+            events.push_back(m_history.back());
+            m_jobs.erase(found);
+        }
+    }
+    Notify(events);
+    m_wake.notify_all();
+    return true;
+}
+
+bool JobQueue::SetPriority(uint64_t id, int priority) {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        auto found = std::find_if(m_jobs.begin(), m_jobs.end(),
+                                  [id](const std::unique_ptr<Job>& job) { return job->context.m_id == id; });
+        if (found == m_jobs.end()) return false;
+        (*found)->context.m_request.priority = priority;
+    }
+    m_wake.notify_all();
+    return true;
+}
+
+void JobQueue::SetOwnerShare(const std::wstring& owner, double share) {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_ownerShares[owner] = std::max(share, 0.01);
+    }
+    m_wake.notify_all();
+}
+
+// Called with m_lock held.
+JobStatus JobQueue::MakeStatus(const Job& job, double now) const {
+    JobStatus status;
+    status.id = job.context.m_id;
+    status.request = job.context.m_request;
+    status.state = job.state;
+    status.topology = job.topology;
+    status.bytesDone = job.context.m_bytesDone.load(std::memory_order_relaxed);
+    status.bytesTotal = job.context.m_bytesTotal.load(std::memory_order_relaxed);
+    status.bytesPerSecond = job.rate;
+    if (!job.started) {
+        status.queuedSeconds = now - job.submittedAt;
+    } else {
+        status.queuedSeconds = job.startedAt - job.submittedAt;
+        status.runSeconds = now - job.startedAt;
+    }
+    {
+        std::lock_guard<std::mutex> guard(job.context.m_statusLock);
+        status.status = job.context.m_status;
+    }
+    status.error = job.error;
+    return status;
+}
+
+bool JobQueue::GetStatus(uint64_t id, JobStatus& status) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    for (const std::unique_ptr<Job>& job : m_jobs) {
+        if (job->context.m_id == id) {
+            status = MakeStatus(*job, Now());
+            return true;
+        }
+    }
+    for (const JobStatus& finished : m_history) {
+        if (finished.id == id) {
+            status = finished;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<JobStatus> JobQueue::List() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    double now = Now();
+    std::vector<JobStatus> list;
+    for (const std::unique_ptr<Job>& job : m_jobs) {
+        list.push_back(MakeStatus(*job, now));
+    }
+    std::stable_sort(list.begin(), list.end(), [](const JobStatus& a, const JobStatus& b) {
+        if (a.state != b.state) return a.state == JobState::Running;
+        return a.request.priority > b.request.priority;
+    });
+    list.insert(list.end(), m_history.rbegin(), m_history.rend());
+    return list;
+}
+
+JobQueueStats JobQueue::GetStats() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    JobQueueStats stats;
+    std::vector<Job*> running;
+    for (const std::unique_ptr<Job>& job : m_jobs) {
+        if (job->state == JobState::Running) {
+            running.push_back(job.get());
+            stats.bytesPerSecond += job->rate;
+        } else {
+            stats.queued++;
+        }
+    }
+    stats.running = running.size();
+    stats.finished = m_history.size();
+    stats.predictedBytesPerSecond = PredictThroughput(running, nullptr);
+    return stats;
+}
+
+bool JobQueue::Wait(uint64_t id) {
+    std::unique_lock<std::mutex> guard(m_lock);
+    auto pending = [&] {
+        return std::any_of(m_jobs.begin(), m_jobs.end(),
+                           [id](const std::unique_ptr<Job>& job) { return job->context.m_id == id; });
+    };
+    if (!pending()) {
+        return std::any_of(m_history.begin(), m_history.end(),
+                           [id](const JobStatus& status) { return status.id == id; });
+    }
+    m_finished.wait(guard, [&] { return !pending(); });
+    return true;
+}
+
+void JobQueue::WaitAll() {
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_finished.wait(guard, [&] { return m_jobs.empty(); });
+}
+
+void JobQueue::Notify(const std::vector<JobStatus>& events) {
+    JobChangeCallback changed;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        changed = m_changed;
+    }
+    if (!changed) return;
+    for (const JobStatus& status : events) {
+        changed(status);
+    }
+}
+
+// ============================================================================
+// BANDWIDTH MODEL
+// ============================================================================
+
+// Called with m_lock held.
+double JobQueue::GetExpectedRate(const Job& job) const {
+    const JobRequest& request = job.context.m_request;
+    double rate = m_params.defaultBytesPerSecond;
+    auto learned = m_targetRates.find(request.target);
+    if (request.bytesPerSecond > 0.0) {
+        rate = request.bytesPerSecond;
+    } else if (learned != m_targetRates.end()) {
+        rate = learned->second;
+    }
+    if (job.topology.speedMbps) {
+        rate = std::min(rate, EstimateUsbLinkBytesPerSecond(job.topology.speedMbps));
+    }
+    return rate;
+}
+
+// Max-min fair rates of `jobs` under the link capacities, by progressive
+// filling: every unsaturated job's rate rises in step until it reaches its
+// own expected rate or one of its links is full. Returns their sum and
+// optionally the load on each link. Called with m_lock held.
+double JobQueue::PredictThroughput(const std::vector<Job*>& jobs, std::map<std::string, double>* linkLoads) const {
+    std::map<std::string, double> remaining;
+    for (const Job* job : jobs) {
+        for (const std::string& link : job->links) {
+            remaining.emplace(link, m_linkCapacities.at(link));
+        }
+    }
+    std::vector<double> demands(jobs.size());
+    std::vector<double> rates(jobs.size(), 0.0);
+    std::vector<bool> frozen(jobs.size(), false);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        demands[i] = GetExpectedRate(*jobs[i]);
+    }
+
+    for (;;) {
+        std::map<std::string, size_t> sharing;
+        double step = -1.0;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (frozen[i]) continue;
+            double headroom = demands[i] - rates[i];
+            if (step < 0.0 || headroom < step) step = headroom;
+            for (const std::string& link : jobs[i]->links) sharing[link]++;
+        }
+        if (step < 0.0) break;
+        for (const auto& link : sharing) {
+            step = std::min(step, remaining[link.first] / link.second);
+        }
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (frozen[i]) continue;
+            rates[i] += step;
+            for (const std::string& link : jobs[i]->links) remaining[link] -= step;
+        }
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (frozen[i]) continue;
+            frozen[i] = rates[i] >= demands[i] * 0.999;
+            for (const std::string& link : jobs[i]->links) {
+                if (remaining[link] <= m_linkCapacities.at(link) * 0.001) frozen[i] = true;
+            }
+        }
+    }
+
+    if (linkLoads) {
+        linkLoads->clear();
+        for (const auto& link : remaining) {
+            (*linkLoads)[link.first] = m_linkCapacities.at(link.first) - link.second;
+        }
+    }
+    double total = 0.0;
+    for (double rate : rates) total += rate;
+    return total;
+}
+
+// Measures each running job's rate and learns from it: a target's own rate
+// while nothing else shares its hub, and a link's capacity while the jobs
+// below it get clearly less than they would alone. Links are examined from
+// the target up so that a full hub does not also mark its controller full.
+// Called with m_lock held.
+void JobQueue::Sample(double now) {
+    std::vector<Job*> running;
+    for (const std::unique_ptr<Job>& job : m_jobs) {
+        if (job->state != JobState::Running) continue;
+        Job& sampled = *job;
+        uint64_t bytes = sampled.context.m_bytesDone.load(std::memory_order_relaxed);
+        double elapsed = now - sampled.sampleTime;
+        if (elapsed <= 0.0) continue;
+        double rate = bytes > sampled.sampleBytes ? (bytes - sampled.sampleBytes) / elapsed : 0.0;
+        sampled.progressed = rate > 0.0;
+        sampled.rate = sampled.rate > 0.0 ? 0.5 * sampled.rate + 0.5 * rate : rate;
+        sampled.sampleBytes = bytes;
+        sampled.sampleTime = now;
+        running.push_back(&sampled);
+    }
+
+    std::map<std::string, std::vector<Job*>> linkJobs;
+    for (Job* job : running) {
+        for (const std::string& link : job->links) linkJobs[link].push_back(job);
+    }
+    for (Job* job : running) {
+        if (!job->progressed) continue;
+        bool alone = job->links.empty() || linkJobs[job->links.back()].size() == 1;
+        if (alone) {
+            double& learned = m_targetRates[job->context.m_request.target];
+            learned = learned > 0.0 ? 0.5 * learned + 0.5 * job->rate : job->rate;
+        }
+    }
+
+    size_t depth = 0;
+    for (Job* job : running) depth = std::max(depth, job->links.size());
+    std::vector<std::vector<Job*>> saturated;
+    while (depth-- > 0) {
+        for (Job* job : running) {
+            if (job->links.size() <= depth) continue;
+            const std::string& link = job->links[depth];
+            std::vector<Job*>& jobs = linkJobs[link];
+            if (jobs.size() < 2 || jobs.front() != job) continue;       // once per link
+            bool measured = std::all_of(jobs.begin(), jobs.end(), [](const Job* j) { return j->progressed; });
+            if (!measured) continue;
+            double observed = 0.0;
+            double demand = 0.0;
+            for (const Job* shared : jobs) {
+                observed += shared->rate;
+                demand += GetExpectedRate(*shared);
+            }
+            double& capacity = m_linkCapacities[link];
+            if (observed < SATURATED_RATIO * demand) {
+                std::vector<Job*> members = jobs;
+                std::sort(members.begin(), members.end());
+                if (std::find(saturated.begin(), saturated.end(), members) != saturated.end()) continue;
+                saturated.push_back(members);
+                if (std::abs(observed - capacity) > 0.1 * capacity) {
+                    LogEvent(LogLevel::Info, "queue", "link_capacity",
+                             {{"jobs", (int64_t)jobs.size()}, {"bps", (int64_t)observed},
+                              {"was_bps", (int64_t)capacity}});
+                }
+                capacity = observed;
+            } else if (observed > capacity) {
+                capacity = observed;
+            }
+        }
+    }
+}
+
+// ============================================================================
+// SCHEDULING
+// ============================================================================
+
+// Called with m_lock held; `events` are reported once it is released.
+void JobQueue::Start(Job& job, double now, std::vector<JobStatus>& events) {
+    job.state = JobState::Running;
+    job.started = true;
+    job.startedAt = now;
+    job.sampleTime = now;
+    job.context.m_bytesTotal = job.context.m_request.bytes;
+    events.push_back(MakeStatus(job, now));
+    Job* running = &job;
+    job.thread = std::thread([this, running] {
+        TraceSetThreadName("queued job");
+        std::wstring error;
+        bool succeeded = running->run(running->context, error);
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            running->returned = true;
+            running->succeeded = succeeded;
+            running->error = error;
+        }
+        m_wake.notify_all();
+    });
+}
+
+// Called with m_lock held.
+void JobQueue::Finish(Job& job, double now) {
+    if (job.thread.joinable()) job.thread.join();
+    if (job.succeeded) {
+        job.state = JobState::Succeeded;
+    } else if (job.context.IsCancelled()) {
+        job.state = JobState::Cancelled;
+    } else {
+        job.state = JobState::Failed;
+    }
+    JobStatus status = MakeStatus(job, now);
+    m_history.push_back(status);
+    if (m_history.size() > MAX_HISTORY) {
+        m_history.erase(m_history.begin());
+    }
+    LogEvent(job.state == JobState::Failed ? LogLevel::Warning : LogLevel::Info, "queue", "finish",
+             {{"job", (int64_t)status.id}, {"state", (int64_t)job.state}, {"bytes", (int64_t)status.bytesDone},
+              {"run_ms", (int64_t)(status.runSeconds * 1000)}});
+    m_finished.notify_all();
+}
+
+// Starts queued jobs in order of priority, the owner's running jobs over its
+// share, and submission, while each one adds enough predicted throughput.
+// Called with m_lock held; `events` are reported once it is released.
+void JobQueue::Schedule(std::vector<JobStatus>& events) {
+    std::vector<Job*> running;
+    std::set<std::wstring> busyTargets;
+    std::map<std::wstring, size_t> ownerRunning;
+    for (const std::unique_ptr<Job>& job : m_jobs) {
+        if (job->state != JobState::Running) continue;
+        running.push_back(job.get());
+        busyTargets.insert(job->context.m_request.target);
+        ownerRunning[job->context.m_request.owner]++;
+    }
+
+    std::vector<Job*> candidates;
+    for (const std::unique_ptr<Job>& job : m_jobs) {
+        if (job->state == JobState::Queued) candidates.push_back(job.get());
+    }
+    auto share = [&](const std::wstring& owner) {
+        auto found = m_ownerShares.find(owner);
+        return found == m_ownerShares.end() ? 1.0 : found->second;
+    };
+
+    std::map<std::string, double> loads;
+    double throughput = PredictThroughput(running, &loads);
+    std::set<std::string> reserved;
+    double now = Now();
+    while (!candidates.empty() && running.size() < m_params.maxRunningJobs) {
+        auto next = std::min_element(candidates.begin(), candidates.end(), [&](const Job* a, const Job* b) {
+            const JobRequest& x = a->context.m_request;
+            const JobRequest& y = b->context.m_request;
+            if (x.priority != y.priority) return x.priority > y.priority;
+            double xLoad = ownerRunning[x.owner] / share(x.owner);
+            double yLoad = ownerRunning[y.owner] / share(y.owner);
+            if (xLoad != yLoad) return xLoad < yLoad;
+            return a->context.m_id < b->context.m_id;
+        });
+        Job& job = **next;
+        candidates.erase(next);
+        const JobRequest& request = job.context.m_request;
+        if (busyTargets.count(request.target)) continue;
+
+        bool admit = true;
+        std::map<std::string, double> newLoads;
+        double predicted = throughput;
+        if (m_params.modelBandwidth && !running.empty()) {
+            bool blocked = std::any_of(job.links.begin(), job.links.end(),
+                                       [&](const std::string& link) { return reserved.count(link) > 0; });
+            running.push_back(&job);
+            predicted = PredictThroughput(running, &newLoads);
+            running.pop_back();
+            double alone = GetExpectedRate(job);
+            for (const std::string& link : job.links) alone = std::min(alone, m_linkCapacities.at(link));
+            admit = !blocked && predicted - throughput >= m_params.minGainRatio * alone;
+            if (!admit) {
+                // Keep jobs behind this one off the links it is waiting for
+                double needed = m_params.minGainRatio * GetExpectedRate(job);
+                for (const std::string& link : job.links) {
+                    if (m_linkCapacities.at(link) - loads[link] < needed) reserved.insert(link);
+                }
+                continue;
+            }
+        } else {
+            running.push_back(&job);
+            predicted = PredictThroughput(running, &newLoads);
+            running.pop_back();
+        }
+
+        LogEvent(LogLevel::Info, "queue", "start",
+                 {{"job", (int64_t)job.context.m_id}, {"priority", (int64_t)request.priority},
+                  {"predicted_bps", (int64_t)predicted}, {"running", (int64_t)running.size() + 1}});
+        Start(job, now, events);
+        running.push_back(&job);
+        busyTargets.insert(request.target);
+        ownerRunning[request.owner]++;
+        throughput = predicted;
+        loads = newLoads;
+    }
+}
+
+void JobQueue::Run() {
+    TraceSetThreadName("job queue");
+    std::unique_lock<std::mutex> guard(m_lock);
+    double lastSample = 0.0;
+    for (;;) {
+        double now = Now();
+        if (now - lastSample >= m_params.sampleSeconds) {
+            Sample(now);
+            lastSample = now;
+        }
+
+        std::vector<JobStatus> events;
+        for (size_t i = 0; i < m_jobs.size();) {
+            Job& job = *m_jobs[i];
+            bool finished = job.returned || (m_stop && job.state == JobState::Queued);
+            if (!finished) {
+                if (m_stop) job.context.m_cancelled = true;
+                i++;
+                continue;
+            }
+            if (job.state == JobState::Queued) job.context.m_cancelled = true;
+            Finish(job, now);
+            events.push_back(m_history.back());
+            m_jobs.erase(m_jobs.begin() + i);
+        }
+        if (m_stop && m_jobs.empty()) break;
+        if (!m_stop) Schedule(events);
+        if (!events.empty()) {
+            guard.unlock();
+            Notify(events);
+            guard.lock();
+            continue;
+        }
+        m_wake.wait_for(guard, std::chrono::duration<double>(m_params.sampleSeconds));
+    }
+}
+
+// ============================================================================
+// IPC PROTOCOL
+// ============================================================================
+
+static std::vector<std::string> SplitFields(const std::string& line) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (start <= line.size()) {
+        size_t end = line.find('\t', start);
+        if (end == std::string::npos) end = line.size();
+        fields.push_back(line.substr(start, end - start));
+        start = end + 1;
+    }
+    return fields;
+}
+
+// A reply field: UTF-8 with no tabs or line breaks
+static std::string ToField(const std::wstring& text) {
+    std::string field = WideToUtf8(text);
+    std::replace_if(field.begin(), field.end(), [](char c) { return c == '\t' || c == '\r' || c == '\n'; }, ' ');
+    return field;
+}
+
+static bool IsFinalReply(const std::string& line) {
+    return line.compare(0, 2, "OK") == 0 || line.compare(0, 3, "ERR") == 0;
+}
+
+JobQueueServer::JobQueueServer(JobQueue& queue, const JobFactory& factory) : m_queue(queue), m_factory(factory) {
+}
+
+JobQueueServer::~JobQueueServer() {
+    Stop();
+}
+
+std::string JobQueueServer::Execute(const std::string& request) {
+    std::string line = request;
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) line.pop_back();
+    std::vector<std::string> fields = SplitFields(line);
+    const std::string& command = fields[0];
+
+    if (command == "SUBMIT") {
+        JobRequest job;
+        job.owner = L"ipc";
+        for (size_t i = 1; i < fields.size(); i++) {
+            size_t equals = fields[i].find('=');
+            std::string key = fields[i].substr(0, equals);
+            std::string value = equals == std::string::npos ? std::string() : fields[i].substr(equals + 1);
+            if (key == "target") {
+                job.target = Utf8ToWide(value);
+            } else if (key == "image") {
+                job.image = Utf8ToWide(value);
+            } else if (key == "owner") {
+                job.owner = Utf8ToWide(value);
+            } else if (key == "priority") {
+                job.priority = atoi(value.c_str());
+            } else if (key == "bytes") {
+                job.bytes = strtoull(value.c_str(), nullptr, 10);
+            } else {
+                return "ERR\tunknown field " + key + "\n";
+            }
+        }
+        if (job.target.empty()) {
+            return "ERR\ttarget= is required\n";
+        }
+        JobRunner run;
+        std::wstring error;
+        if (!m_factory || !m_factory(job, run, error)) {
+            return "ERR\t" + ToField(error.empty() ? L"rejected" : error) + "\n";
+        }
+        return "OK\t" + std::to_string(m_queue.Submit(job, run)) + "\n";
+    }
+
+    if (command == "LIST") {
+        std::ostringstream reply;
+        for (const JobStatus& status : m_queue.List()) {
+            reply << "JOB\t" << status.id << '\t' << ToField(JobStateName(status.state)) << '\t'
+                  << status.request.priority << '\t' << ToField(status.request.owner) << '\t' << status.bytesDone
+                  << '\t' << status.bytesTotal << '\t' << (uint64_t)status.bytesPerSecond << '\t'
+                  << ToField(status.request.target) << '\t' << ToField(DescribeUsbTopology(status.topology)) << '\t'
+                  << ToField(status.error.empty() ? status.status : status.error) << '\n';
+        }
+        reply << "OK\n";
+        return reply.str();
+    }
+
+    if (command == "CANCEL" && fields.size() == 2) {
+        return m_queue.Cancel(strtoull(fields[1].c_str(), nullptr, 10)) ? "OK\n" : "ERR\tno such job\n";
+    }
+    if (command == "PRIORITY" && fields.size() == 3) {
+        return m_queue.SetPriority(strtoull(fields[1].c_str(), nullptr, 10), atoi(fields[2].c_str()))
+                   ? "OK\n"
+                   : "ERR\tno such job\n";
+    }
+    if (command == "SHARE" && fields.size() == 3) {
+        m_queue.SetOwnerShare(Utf8ToWide(fields[1]), atof(fields[2].c_str()));
+        return "OK\n";
+    }
+    return "ERR\tunknown command\n";
+}
+
+// ============================================================================
+// WINDOWS ENDPOINT (NAMED PIPE)
+// ============================================================================
+
+#ifdef _WIN32
+
+std::wstring JobQueueServer::DefaultEndpoint() {
+    return L"\\\\.\\pipe\\inferno-jobs";
+}
+
+// Waits for an overlapped operation started on `pipe` (`started` is what
+// the call returned), giving up after the I/O timeout or when `stop` is set.
+static bool CompletePipeIo(HANDLE pipe, HANDLE stop, OVERLAPPED& overlapped, BOOL started, DWORD& bytes) {
+    if (!started && GetLastError() != ERROR_IO_PENDING) return false;
+    HANDLE events[2] = {overlapped.hEvent, stop};
+    if (WaitForMultipleObjects(2, events, FALSE, IO_TIMEOUT_MILLIS) != WAIT_OBJECT_0) {
+        CancelIo(pipe);
+        GetOverlappedResult(pipe, &overlapped, &bytes, TRUE);
+        return false;
+    }
+    return GetOverlappedResult(pipe, &overlapped, &bytes, FALSE) != 0;
+}
+
+bool JobQueueServer::Start(const std::wstring& endpoint, std::wstring& error) {
+    m_endpoint = endpoint;
+    m_stop = false;
+    // One instance, reused for each client in turn: a second server fails
+    // here, and clients wait with WaitNamedPipe while it is busy. The default
+    // security lets only the creator, administrators and SYSTEM write.
+    HANDLE pipe = CreateNamedPipeW(endpoint.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                   PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1,
+                                   (DWORD)MAX_REQUEST_BYTES, (DWORD)MAX_REQUEST_BYTES, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        error = L"Cannot create " + endpoint + L"; is another instance serving it?";
+        return false;
+    }
+    m_listener = (intptr_t)pipe;
+    m_stopEvent = (intptr_t)CreateEventW(NULL, TRUE, FALSE, NULL);
+    m_thread = std::thread([this] { Listen(); });
+    return true;
+}
+
+void JobQueueServer::Listen() {
+    TraceSetThreadName("job queue server");
+    HANDLE pipe = (HANDLE)m_listener;
+    HANDLE stop = (HANDLE)m_stopEvent;
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    while (!m_stop) {
+        ResetEvent(overlapped.hEvent);
+        BOOL connected = ConnectNamedPipe(pipe, &overlapped);
+        DWORD bytes = 0;
+        if (!connected && GetLastError() == ERROR_PIPE_CONNECTED) {
+            connected = TRUE;
+        } else if (!connected && GetLastError() == ERROR_IO_PENDING) {
+            HANDLE events[2] = {stop, overlapped.hEvent};
+            if (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0) {
+                CancelIo(pipe);
+                GetOverlappedResult(pipe, &overlapped, &bytes, TRUE);
+                break;
+            }
+            connected = GetOverlappedResult(pipe, &overlapped, &bytes, FALSE);
+        }
+        if (!connected) {
+            WaitForSingleObject(stop, 100);
+            continue;
+        }
+
+        std::string request;
+        char buffer[4096];
+        while (request.find('\n') == std::string::npos && request.size() < MAX_REQUEST_BYTES) {
+            ResetEvent(overlapped.hEvent);
+            BOOL started = ReadFile(pipe, buffer, sizeof(buffer), NULL, &overlapped);
+            if (!CompletePipeIo(pipe, stop, overlapped, started, bytes) || bytes == 0) break;
+            request.append(buffer, bytes);
+        }
+        if (request.find('\n') != std::string::npos) {
+            std::string reply = Execute(request.substr(0, request.find('\n')));
+            ResetEvent(overlapped.hEvent);
+            BOOL started = WriteFile(pipe, reply.data(), (DWORD)reply.size(), NULL, &overlapped);
+            if (CompletePipeIo(pipe, stop, overlapped, started, bytes)) FlushFileBuffers(pipe);
+        }
+        DisconnectNamedPipe(pipe);
+    }
+    CloseHandle(overlapped.hEvent);
+}
+
+void JobQueueServer::Stop() {
+    if (!m_thread.joinable()) return;
+    m_stop = true;
+    SetEvent((HANDLE)m_stopEvent);
+    m_thread.join();
+    CloseHandle((HANDLE)m_listener);
+    CloseHandle((HANDLE)m_stopEvent);
+    m_listener = -1;
+    m_stopEvent = 0;
+}
+
+bool SendJobCommand(const std::wstring& endpoint, const std::string& request, std::vector<std::string>& reply,
+                    std::wstring& error) {
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    for (int attempt = 0; attempt < 2 && pipe == INVALID_HANDLE_VALUE; attempt++) {
+        pipe = CreateFileW(endpoint.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY) {
+            WaitNamedPipeW(endpoint.c_str(), IO_TIMEOUT_MILLIS);
+        }
+    }
+    if (pipe == INVALID_HANDLE_VALUE) {
+        error = L"Cannot connect to " + endpoint;
+        return false;
+    }
+    std::string line = request + "\n";
+    DWORD bytes = 0;
+    bool ok = WriteFile(pipe, line.data(), (DWORD)line.size(), &bytes, NULL) && bytes == line.size();
+    std::string received;
+    reply.clear();
+    char buffer[4096];
+    while (ok && (reply.empty() || !IsFinalReply(reply.back()))) {
+        size_t end = received.find('\n');
+        if (end != std::string::npos) {
+            reply.push_back(received.substr(0, end));
+            received.erase(0, end + 1);
+            continue;
+        }
+        ok = ReadFile(pipe, buffer, sizeof(buffer), &bytes, NULL) && bytes > 0;
+        received.append(buffer, ok ? bytes : 0);
+    }
+    CloseHandle(pipe);
+    if (!ok) error = L"The job queue at " + endpoint + L" did not answer.";
+    return ok;
+}
+
+// ============================================================================
+// POSIX ENDPOINT (UNIX DOMAIN SOCKET)
+// ============================================================================
+
+#else
+
+std::wstring JobQueueServer::DefaultEndpoint() {
+    return GetInfernoDataDirectory() + L"/jobs.sock";
+}
+
+static bool MakeSocketAddress(const std::wstring& endpoint, sockaddr_un& address, std::wstring& error) {
+    std::string path = WideToUtf8(endpoint);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        error = L"Socket path too long: " + endpoint;
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+static void SetSocketTimeouts(int fd) {
+    timeval timeout = {IO_TIMEOUT_MILLIS / 1000, (IO_TIMEOUT_MILLIS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static bool SendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t done = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (done < 0 && errno == EINTR) continue;
+        if (done <= 0) return false;
+        sent += done;
+    }
+    return true;
+}
+
+bool JobQueueServer::Start(const std::wstring& endpoint, std::wstring& error) {
+    m_endpoint = endpoint;
+    m_stop = false;
+    sockaddr_un address;
+    if (!MakeSocketAddress(endpoint, address, error)) return false;
+
+    // A socket left behind by a process that died is replaced; a live one is not
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0) {
+        bool live = connect(probe, (sockaddr*)&address, sizeof(address)) == 0;
+        close(probe);
+        if (live) {
+            error = L"Another process is serving " + endpoint;
+            return false;
+        }
+    }
+    unlink(address.sun_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || chmod(address.sun_path, 0600) != 0 ||
+        listen(fd, 16) != 0) {
+        error = L"Cannot listen on " + endpoint + L": " + Utf8ToWide(strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    m_listener = fd;
+    m_thread = std::thread([this] { Listen(); });
+    return true;
+}
+
+void JobQueueServer::Listen() {
+    TraceSetThreadName("job queue server");
+    int listener = (int)m_listener;
+    while (!m_stop) {
+        pollfd entry = {listener, POLLIN, 0};
+        if (poll(&entry, 1, 200) <= 0) continue;
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) continue;
+#ifdef __linux__
+        // The socket's mode already keeps other users out; this also covers
+        // a directory that lets them traverse it.
+        struct ucred peer = {};
+        socklen_t length = sizeof(peer);
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 || peer.uid != geteuid()) {
+            close(client);
+            continue;
+        }
+#endif
+        SetSocketTimeouts(client);
+        std::string request;
+        char buffer[4096];
+        while (request.find('\n') == std::string::npos && request.size() < MAX_REQUEST_BYTES) {
+            ssize_t received = recv(client, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) break;
+            request.append(buffer, received);
+        }
+        if (request.find('\n') != std::string::npos) {
+            SendAll(client, Execute(request.substr(0, request.find('\n'))));
+        }
+        close(client);
+    }
+}
+
+void JobQueueServer::Stop() {
+    if (!m_thread.joinable()) return;
+    m_stop = true;
+    m_thread.join();
+    close((int)m_listener);
+    m_listener = -1;
+    unlink(WideToUtf8(m_endpoint).c_str());
+}
+
+bool SendJobCommand(const std::wstring& endpoint, const std::string& request, std::vector<std::string>& reply,
+                    std::wstring& error) {
+    sockaddr_un address;
+    if (!MakeSocketAddress(endpoint, address, error)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        error = L"Cannot connect to " + endpoint + L": " + Utf8ToWide(strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    SetSocketTimeouts(fd);
+    bool ok = SendAll(fd, request + "\n");
+    std::string received;
+    reply.clear();
+    char buffer[4096];
+    while (ok && (reply.empty() || !IsFinalReply(reply.back()))) {
+        size_t end = received.find('\n');
+        if (end != std::string::npos) {
+            reply.push_back(received.substr(0, end));
+            received.erase(0, end + 1);
+            continue;
+        }
+        ssize_t done = recv(fd, buffer, sizeof(buffer), 0);
+        if (done < 0 && errno == EINTR) continue;
+        ok = done > 0;
+        if (ok) received.append(buffer, done);
+    }
+    close(fd);
+    if (!ok) error = L"The job queue at " + endpoint + L" did not answer.";
+    return ok;
+}
+
+#endif
@@ -0,0 +1,228 @@
+// ============================================================================
+// INFERNO - Topology-aware multi-job queue and its local IPC endpoint
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class JobState : uint8_t {
+    Queued,
+    Running,
+    Succeeded,
+    Failed,
+    Cancelled
+};
+
+const wchar_t* JobStateName(JobState state);
+
+struct JobRequest {
+    std::wstring target;                // device path or "sim:" spec; one job per target runs at a time
+    std::wstring image;                 // what the runner writes; the queue only reports it
+    std::wstring owner;                 // station, technician or client sharing the queue fairly
+    int priority = 0;                   // higher runs first
+    uint64_t bytes = 0;                 // expected bytes to write; 0 when unknown
+    double bytesPerSecond = 0.0;        // expected rate of the target alone; 0 to use what was learned
+};
+
+struct JobStatus {
+    uint64_t id = 0;
+    JobRequest request;
+    JobState state = JobState::Queued;
+    UsbTopology topology;
+    uint64_t bytesDone = 0;
+    uint64_t bytesTotal = 0;
+    double bytesPerSecond = 0.0;        // measured over the last sampling interval
+    double queuedSeconds = 0.0;
+    double runSeconds = 0.0;
+    std::wstring status;                // the runner's latest status line
+    std::wstring error;
+};
+
+// Handed to a job's runner on its own thread.
+class JobContext {
+public:
+    // Bytes written so far; the queue derives the job's rate from them.
+    void ReportProgress(uint64_t bytesDone, uint64_t bytesTotal);
+    void SetStatus(const std::wstring& status);
+
+    // Set when the job is cancelled or the queue shuts down.
+    bool IsCancelled() const;
+
+    uint64_t GetId() const { return m_id; }
+    const JobRequest& GetRequest() const { return m_request; }
+
+private:
+    friend class JobQueue;
+    uint64_t m_id = 0;
+    JobRequest m_request;
+    std::atomic<bool> m_cancelled{false};
+    std::atomic<uint64_t> m_bytesDone{0};
+    std::atomic<uint64_t> m_bytesTotal{0};
+    mutable std::mutex m_statusLock;
+    std::wstring m_status;
+};
+
+// Returns false with `error` set when the job fails.
+using JobRunner = std::function<bool(JobContext& job, std::wstring& error)>;
+
+// Called on the queue's threads whenever a job changes state.
+using JobChangeCallback = std::function<void(const JobStatus& status)>;
+
+struct JobQueueParams {
+    uint32_t maxRunningJobs = 16;
+    // A job starts only while it would add at least this share of its own
+    // rate to the predicted aggregate throughput.
+    double minGainRatio = 0.5;
+    // Rate assumed for a target nothing has been learned about.
+    double defaultBytesPerSecond = 20.0 * 1024 * 1024;
+    // Capacity of a link whose speed the OS does not report (Windows). It is
+    // corrected as soon as jobs sharing the link saturate it.
+    double unknownLinkBytesPerSecond = 400.0 * 1024 * 1024;
+    double sampleSeconds = 0.5;
+    // False ignores topology and starts jobs in order up to maxRunningJobs,
+    // the way a plain thread per job would.
+    bool modelBandwidth = true;
+};
+
+struct JobQueueStats {
+    size_t queued = 0;
+    size_t running = 0;
+    size_t finished = 0;
+    double bytesPerSecond = 0.0;            // measured, all running jobs
+    double predictedBytesPerSecond = 0.0;   // by the bandwidth model, all running jobs
+};
+
+// Runs flashing jobs for many targets at once. Each target is mapped to its
+// host controller and hub chain (see QueryUsbTopology); every controller and
+// hub is a link with a capacity, from its negotiated speed at first and then
+// from the aggregate rate measured while the jobs below it saturate it. The
+// rate each target reaches on its own is learned per target path.
+//
+// Whenever a job finishes or is queued, the scheduler walks the queue in
+// order of priority, then of the owner's running jobs relative to its share,
+// then of submission, and starts each job whose addition raises the
+// predicted aggregate throughput (a max-min fair share of every link) by
+// enough. A job that cannot start reserves the saturated links on its path,
+// so jobs behind it on the same hub do not overtake it, while jobs on idle
+// hubs still start.
+class JobQueue {
+public:
+    explicit JobQueue(const JobQueueParams& params = JobQueueParams());
+    // Cancels every job and waits for the running ones.
+    ~JobQueue();
+    JobQueue(const JobQueue&) = delete;
+    JobQueue& operator=(const JobQueue&) = delete;
+
+    // Set before the first Submit.
+    void SetChangeCallback(const JobChangeCallback& changed);
+
+    uint64_t Submit(const JobRequest& request, const JobRunner& run);
+
+    // Queued jobs are dropped; running ones are asked to stop.
+    bool Cancel(uint64_t id);
+    bool SetPriority(uint64_t id, int priority);
+
+    // Relative share of the running jobs for an owner; 1 by default.
+    void SetOwnerShare(const std::wstring& owner, double share);
+
+    bool GetStatus(uint64_t id, JobStatus& status);
+    // Running jobs, queued jobs by priority, then finished jobs, newest
+    // first.
+    std::vector<JobStatus> List();
+    JobQueueStats GetStats();
+
+    // Block until the job has finished; false for an unknown id.
+    bool Wait(uint64_t id);
+    void WaitAll();
+
+private:
+    struct Job;
+
+    void Run();
+    void Schedule(std::vector<JobStatus>& events);
+    void Sample(double now);
+    double GetExpectedRate(const Job& job) const;
+    double PredictThroughput(const std::vector<Job*>& jobs, std::map<std::string, double>* linkLoads) const;
+    void Start(Job& job, double now, std::vector<JobStatus>& events);
+    void Finish(Job& job, double now);
+    void Notify(const std::vector<JobStatus>& events);
+    JobStatus MakeStatus(const Job& job, double now) const;
+    double Now() const;
+
+    JobQueueParams m_params;
+    JobChangeCallback m_changed;
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::condition_variable m_finished;
+    bool m_stop = false;
+    uint64_t m_nextId = 1;
+    std::vector<std::unique_ptr<Job>> m_jobs;       // queued and running, in submission order
+    std::vector<JobStatus> m_history;               // finished, oldest first
+    std::map<std::wstring, double> m_ownerShares;
+    std::map<std::wstring, double> m_targetRates;   // learned rate of each target alone
+    std::map<std::string, double> m_linkCapacities; // from link speeds, then learned
+    std::chrono::steady_clock::time_point m_start;
+    std::thread m_thread;
+};
+
+// Builds the runner for a job submitted over IPC, or rejects it.
+using JobFactory = std::function<bool(const JobRequest& request, JobRunner& run, std::wstring& error)>;
+
+// Accepts commands for a JobQueue from other processes of the same user on
+// one machine: a Unix domain socket in the Inferno data directory, readable
+// by its owner only, or a named pipe that rejects remote clients. Each
+// request is one line of UTF-8 fields separated by tabs; the reply is zero
+// or more lines of the same form followed by one starting with OK or ERR.
+//
+//   SUBMIT target=<path> image=<path> [owner=<name>] [priority=<n>] [bytes=<n>]
+//                               -> OK <id>
+//   LIST                        -> JOB <id> <state> <priority> <owner> <done> <total>
+//                                      <bytes/s> <target> <topology> <status>, then OK
+//   CANCEL <id>                 -> OK
+//   PRIORITY <id> <n>           -> OK
+//   SHARE <owner> <share>       -> OK
+class JobQueueServer {
+public:
+    JobQueueServer(JobQueue& queue, const JobFactory& factory);
+    ~JobQueueServer();
+    JobQueueServer(const JobQueueServer&) = delete;
+    JobQueueServer& operator=(const JobQueueServer&) = delete;
+
+    // \\.\pipe\inferno-jobs, or jobs.sock in the Inferno data directory.
+    static std::wstring DefaultEndpoint();
+
+    bool Start(const std::wstring& endpoint, std::wstring& error);
+    void Stop();
+
+    // Handles one request line; used by the listener and usable in-process.
+    std::string Execute(const std::string& request);
+
+private:
+    void Listen();
+
+    JobQueue& m_queue;
+    JobFactory m_factory;
+    std::wstring m_endpoint;
+    std::atomic<bool> m_stop{false};
+    intptr_t m_listener = -1;           // listening socket, or the pipe instance awaiting a client on Windows
+    intptr_t m_stopEvent = 0;           // Windows: signalled to wake the listener thread
+    std::thread m_thread;
+};
+
+// Sends one request line to a JobQueueServer and collects the reply lines,
+// the final OK or ERR line included.
+bool SendJobCommand(const std::wstring& endpoint, const std::string& request, std::vector<std::string>& reply,
+                    std::wstring& error);
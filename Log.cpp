@@ -0,0 +1,310 @@
+// ============================================================================
+// INFERNO - Asynchronous structured logging
+// ============================================================================
+
+#include "Log.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+std::atomic<int> g_LogMinLevel(INT_MAX);
+
+static const size_t MAX_FIELDS = 4;
+static const size_t MAX_TEXT = 160;
+static const uint32_t RING_CAPACITY = 2048;
+
+struct LogRecord {
+    int64_t time;               // microseconds since the Unix epoch
+    const char* component;
+    const char* event;
+    LogField fields[MAX_FIELDS];
+    uint8_t fieldCount;
+    uint8_t level;
+    char text[MAX_TEXT];        // empty when the record has no message
+};
+
+// Single-producer single-consumer ring: the owning thread advances `head`,
+// the flusher advances `tail`.
+struct LogRing {
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+    uint32_t threadId = 0;
+    LogRecord records[RING_CAPACITY];
+};
+
+static std::mutex g_LogRegistryLock;
+static std::vector<std::shared_ptr<LogRing>> g_LogRings;
+static uint32_t g_LogNextThreadId = 1;
+
+static std::mutex g_LogSessionLock;
+static std::thread g_LogFlusher;
+static std::mutex g_LogWakeLock;
+static std::condition_variable g_LogWake;
+static bool g_LogStopping = false;
+static FILE* g_LogFile = nullptr;
+
+static LogRing& GetThreadRing() {
+    thread_local std::shared_ptr<LogRing> ring;
+    if (!ring) {
+        ring = std::make_shared<LogRing>();
+        std::lock_guard<std::mutex> guard(g_LogRegistryLock);
+        ring->threadId = g_LogNextThreadId++;
+        g_LogRings.push_back(ring);
+    }
+    return *ring;
+}
+
+static int64_t LogNow() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static LogRecord* BeginRecord(LogRing& ring) {
+    uint32_t head = ring.head.load(std::memory_order_relaxed);
+    uint32_t tail = ring.tail.load(std::memory_order_acquire);
+    if (head - tail >= RING_CAPACITY) {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    return &ring.records[head % RING_CAPACITY];
+}
+
+static void CommitRecord(LogRing& ring) {
+    ring.head.store(ring.head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void LogEvent(LogLevel level, const char* component, const char* event, std::initializer_list<LogField> fields) {
+    if (!IsLogging(level)) return;
+    LogRing& ring = GetThreadRing();
+    LogRecord* record = BeginRecord(ring);
+    if (!record) return;
+
+    record->time = LogNow();
+    record->component = component;
+    record->event = event;
+    record->level = (uint8_t)level;
+    record->fieldCount = 0;
+    for (const LogField& field : fields) {
+        if (record->fieldCount == MAX_FIELDS) break;
+        record->fields[record->fieldCount++] = field;
+    }
+    record->text[0] = '\0';
+    CommitRecord(ring);
+}
+
+void LogMessage(LogLevel level, const char* component, const std::wstring& message) {
+    if (!IsLogging(level)) return;
+    std::string text = WideToUtf8(message);
+    LogRing& ring = GetThreadRing();
+    LogRecord* record = BeginRecord(ring);
+    if (!record) return;
+
+    record->time = LogNow();
+    record->component = component;
+    record->event = "message";
+    record->level = (uint8_t)level;
+    record->fieldCount = 0;
+    size_t length = std::min(text.size(), MAX_TEXT - 1);
+    // Do not cut a UTF-8 sequence in half.
+    while (length > 0 && length < text.size() && ((unsigned char)text[length] & 0xC0) == 0x80) {
+        length--;
+    }
+    memcpy(record->text, text.data(), length);
+    record->text[length] = '\0';
+    CommitRecord(ring);
+}
+
+// ============================================================================
+// FLUSHER
+// ============================================================================
+
+static void AppendJsonString(std::string& out, const char* text) {
+    out += '"';
+    for (const char* c = text ? text : ""; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            out += '\\';
+            out += *c;
+        } else if ((unsigned char)*c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+            out += escaped;
+        } else {
+            out += *c;
+        }
+    }
+    out += '"';
+}
+
+static void AppendRecord(std::string& out, const LogRecord& record, uint32_t threadId) {
+    static const char* levels[] = {"debug", "info", "warning", "error"};
+
+    time_t seconds = (time_t)(record.time / 1000000);
+    struct tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &seconds);
+#else
+    gmtime_r(&seconds, &utc);
+#endif
+    // Room for every field at its widest int, not just for sane dates
+    char stamp[96];
+    snprintf(stamp, sizeof(stamp), "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ",
+             utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec,
+             (int)(record.time % 1000000));
+
+    out += "{\"time\":\"";
+    out += stamp;
+    out += "\",\"level\":\"";
+    out += levels[std::min<int>(record.level, 3)];
+    out += "\",\"thread\":" + std::to_string(threadId) + ",\"component\":";
+    AppendJsonString(out, record.component);
+    out += ",\"event\":";
+    AppendJsonString(out, record.event);
+    for (uint8_t i = 0; i < record.fieldCount; i++) {
+        out += ',';
+        AppendJsonString(out, record.fields[i].key);
+        out += ':' + std::to_string(record.fields[i].value);
+    }
+    if (record.text[0]) {
+        out += ",\"message\":";
+        AppendJsonString(out, record.text);
+    }
+    out += "}\n";
+}
+
+struct DrainedRecord {
+    LogRecord record;
+    uint32_t threadId;
+};
+
+static void DrainRings(FILE* file) {
+    std::vector<DrainedRecord> batch;
+    std::vector<std::pair<uint32_t, uint64_t>> dropped;
+    {
+        std::lock_guard<std::mutex> guard(g_LogRegistryLock);
+        for (const std::shared_ptr<LogRing>& ring : g_LogRings) {
+            uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+            uint32_t head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; tail++) {
+                batch.push_back({ring->records[tail % RING_CAPACITY], ring->threadId});
+            }
+            ring->tail.store(tail, std::memory_order_release);
+            uint64_t lost = ring->dropped.exchange(0, std::memory_order_relaxed);
+            if (lost > 0) dropped.push_back({ring->threadId, lost});
+        }
+        // Rings held only by the registry belong to threads that have exited.
+        g_LogRings.erase(std::remove_if(g_LogRings.begin(), g_LogRings.end(),
+                                        [](const std::shared_ptr<LogRing>& ring) {
+                                            return ring.use_count() == 1 &&
+                                                   ring->head.load() == ring->tail.load();
+                                        }),
+                         g_LogRings.end());
+    }
+    if (batch.empty() && dropped.empty()) return;
+
+    std::stable_sort(batch.begin(), batch.end(), [](const DrainedRecord& a, const DrainedRecord& b) {
+        return a.record.time < b.record.time;
+    });
+
+    std::string out;
+    out.reserve(batch.size() * 160);
+    for (const DrainedRecord& entry : batch) {
+        AppendRecord(out, entry.record, entry.threadId);
+    }
+    for (const auto& lost : dropped) {
+        LogRecord record = {};
+        record.time = LogNow();
+        record.component = "log";
+        record.event = "records dropped";
+        record.level = (uint8_t)LogLevel::Warning;
+        record.fields[0] = {"count", (int64_t)lost.second};
+        record.fieldCount = 1;
+        AppendRecord(out, record, lost.first);
+    }
+    fwrite(out.data(), 1, out.size(), file);
+    fflush(file);
+}
+
+static void FlusherLoop(FILE* file) {
+    std::unique_lock<std::mutex> guard(g_LogWakeLock);
+    while (!g_LogStopping) {
+        g_LogWake.wait_for(guard, std::chrono::milliseconds(50));
+        guard.unlock();
+        DrainRings(file);
+        guard.lock();
+    }
+}
+
+// ============================================================================
+// SESSION
+// ============================================================================
+
+static void StopLoggingLocked() {
+    if (!g_LogFile) return;
+    g_LogMinLevel = INT_MAX;
+    {
+        std::lock_guard<std::mutex> guard(g_LogWakeLock);
+        g_LogStopping = true;
+    }
+    g_LogWake.notify_all();
+    g_LogFlusher.join();
+    DrainRings(g_LogFile);
+    fclose(g_LogFile);
+    g_LogFile = nullptr;
+}
+
+bool StartLogging(const std::wstring& path, LogLevel minLevel, std::wstring& error) {
+    std::lock_guard<std::mutex> session(g_LogSessionLock);
+    StopLoggingLocked();
+
+#ifdef _WIN32
+    FILE* file = _wfopen(path.c_str(), L"ab");
+#else
+    FILE* file = fopen(WideToUtf8(path).c_str(), "ab");
+#endif
+    if (!file) {
+        error = L"Cannot open the log file.";
+        return false;
+    }
+
+    // Anything left from a previous session was recorded after it stopped.
+    {
+        std::lock_guard<std::mutex> guard(g_LogRegistryLock);
+        for (const std::shared_ptr<LogRing>& ring : g_LogRings) {
+            ring->tail.store(ring->head.load(std::memory_order_acquire), std::memory_order_release);
+            ring->dropped = 0;
+        }
+    }
+
+    g_LogFile = file;
+    g_LogStopping = false;
+    g_LogFlusher = std::thread(FlusherLoop, file);
+    g_LogMinLevel = (int)minLevel;
+    return true;
+}
+
+void StopLogging() {
+    std::lock_guard<std::mutex> session(g_LogSessionLock);
+    StopLoggingLocked();
+}
+
+ScopedLogSession::ScopedLogSession(const std::wstring& path, LogLevel minLevel) {
+    std::wstring error;
+    m_active = !path.empty() && StartLogging(path, minLevel, error);
+}
+
+ScopedLogSession::~ScopedLogSession() {
+    if (m_active) {
+        StopLogging();
+    }
+}
@@ -0,0 +1,61 @@
+// ============================================================================
+// INFERNO - Asynchronous structured logging
+// ============================================================================
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+
+// Records go into a fixed-size lock-free ring owned by the calling thread; a
+// background thread drains every ring and appends them to the log file as
+// JSON lines. Logging never blocks: when a ring is full the record is
+// dropped and counted, and the count is written with the next batch.
+//
+// Components, events and field keys are stored as pointers: pass string
+// literals.
+
+enum class LogLevel {
+    Debug,
+    Info,
+    Warning,
+    Error
+};
+
+struct LogField {
+    const char* key;
+    int64_t value;
+};
+
+extern std::atomic<int> g_LogMinLevel;
+
+// True when a session is running and records at `level` are kept.
+inline bool IsLogging(LogLevel level) {
+    return (int)level >= g_LogMinLevel.load(std::memory_order_relaxed);
+}
+
+// Appends to `path`. Starting a new session ends the previous one.
+bool StartLogging(const std::wstring& path, LogLevel minLevel, std::wstring& error);
+
+// Writes everything recorded so far and stops the flusher.
+void StopLogging();
+
+// Up to four numeric fields per record.
+void LogEvent(LogLevel level, const char* component, const char* event,
+              std::initializer_list<LogField> fields = {});
+
+// Free-form text, truncated to a fixed length. Converts to UTF-8 on the
+// calling thread, so keep it off per-chunk paths.
+void LogMessage(LogLevel level, const char* component, const std::wstring& message);
+
+// Logs for its lifetime; does nothing when `path` is empty.
+class ScopedLogSession {
+public:
+    ScopedLogSession(const std::wstring& path, LogLevel minLevel);
+    ~ScopedLogSession();
+
+private:
+    bool m_active = false;
+};
@@ -0,0 +1,722 @@
+// ============================================================================
+// INFERNO - LUKS2 encrypted volumes
+// ============================================================================
+
+#include "Luks2.h"
+#include "Checksum.h"
+#include "ImageSource.h"
+#include "Log.h"
+#include "Platform.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// Binary header fields (LUKS2 on-disk format, all integers big-endian).
+static const uint64_t HEADER_SIZE = 16 * 1024;          // binary header + JSON area
+static const size_t BINARY_HEADER_SIZE = 4096;
+static const size_t OFFSET_VERSION = 6;
+static const size_t OFFSET_HEADER_SIZE = 8;
+static const size_t OFFSET_SEQID = 16;
+static const size_t OFFSET_LABEL = 24;
+static const size_t OFFSET_CHECKSUM_ALG = 72;
+static const size_t OFFSET_SALT = 104;
+static const size_t OFFSET_UUID = 168;
+static const size_t OFFSET_HEADER_OFFSET = 256;
+static const size_t OFFSET_CHECKSUM = 448;
+static const size_t LABEL_SIZE = 48;
+static const size_t CHECKSUM_SIZE = 64;
+
+static const uint64_t KEYSLOTS_OFFSET = 2 * HEADER_SIZE;
+static const uint32_t AF_STRIPES = 4000;
+static const size_t SALT_SIZE = 32;
+static const uint32_t KEYSLOT_SECTOR_SIZE = 512;
+
+static const uint8_t MAGIC_PRIMARY[6] = {'L', 'U', 'K', 'S', 0xBA, 0xBE};
+static const uint8_t MAGIC_SECONDARY[6] = {'S', 'K', 'U', 'L', 0xBA, 0xBE};
+
+static inline uint64_t RoundUp(uint64_t value, uint64_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+static void StoreBe(uint8_t* p, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--, value >>= 8) p[i] = (uint8_t)value;
+}
+
+static uint64_t LoadBe(const uint8_t* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value = (value << 8) | p[i];
+    return value;
+}
+
+// ============================================================================
+// ENCODING
+// ============================================================================
+
+static const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static std::string Base64Encode(const uint8_t* data, size_t length) {
+    std::string out;
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t group = (uint32_t)data[i] << 16;
+        if (i + 1 < length) group |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < length) group |= data[i + 2];
+        out += BASE64_ALPHABET[(group >> 18) & 63];
+        out += BASE64_ALPHABET[(group >> 12) & 63];
+        out += (i + 1 < length) ? BASE64_ALPHABET[(group >> 6) & 63] : '=';
+        out += (i + 2 < length) ? BASE64_ALPHABET[group & 63] : '=';
+    }
+    return out;
+}
+
+static bool Base64Decode(const std::string& text, std::vector<uint8_t>& out) {
+    out.clear();
+    uint32_t group = 0;
+    int bits = 0;
+    for (char c : text) {
+        if (c == '=') break;
+        const char* found = c ? strchr(BASE64_ALPHABET, c) : nullptr;
+        if (!found) return false;
+        group = (group << 6) | (uint32_t)(found - BASE64_ALPHABET);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((uint8_t)(group >> bits));
+        }
+    }
+    return true;
+}
+
+// Just enough JSON for LUKS2 metadata: no surrogate pairs, numbers kept as
+// text so 64-bit values survive.
+struct JsonValue {
+    enum Kind { Null, Boolean, Number, String, Array, Object } kind = Null;
+    std::string text;
+    std::vector<std::pair<std::string, JsonValue>> members;
+    std::vector<JsonValue> items;
+
+    const JsonValue* Get(const char* key) const {
+        for (const auto& member : members) {
+            if (member.first == key) return &member.second;
+        }
+        return nullptr;
+    }
+
+    std::string GetString(const char* key) const {
+        const JsonValue* value = Get(key);
+        return (value && value->kind == String) ? value->text : std::string();
+    }
+
+    // LUKS2 writes 64-bit quantities as strings and small ones as numbers.
+    bool GetUint(const char* key, uint64_t& out) const {
+        const JsonValue* value = Get(key);
+        if (!value || (value->kind != Number && value->kind != String) || value->text.empty()) return false;
+        out = 0;
+        for (char c : value->text) {
+            if (c < '0' || c > '9' || out > (UINT64_MAX - 9) / 10) return false;
+            out = out * 10 + (uint64_t)(c - '0');
+        }
+        return true;
+    }
+};
+
+class JsonParser {
+public:
+    explicit JsonParser(const std::string& text) : m_text(text) {}
+
+    bool Parse(JsonValue& value) {
+        if (!ParseValue(value, 0)) return false;
+        SkipSpace();
+        return m_pos == m_text.size();
+    }
+
+private:
+    void SkipSpace() {
+        while (m_pos < m_text.size() && m_text[m_pos] && strchr(" \t\r\n", m_text[m_pos])) m_pos++;
+    }
+
+    bool Consume(char c) {
+        SkipSpace();
+        if (m_pos < m_text.size() && m_text[m_pos] == c) {
+            m_pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool ParseString(std::string& out) {
+        if (!Consume('"')) return false;
+        while (m_pos < m_text.size()) {
+            char c = m_text[m_pos++];
+            if (c == '"') return true;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (m_pos >= m_text.size()) return false;
+            char escaped = m_text[m_pos++];
+            switch (escaped) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                if (m_pos + 4 > m_text.size()) return false;
+                unsigned code = (unsigned)strtoul(m_text.substr(m_pos, 4).c_str(), nullptr, 16);
+                m_pos += 4;
+                out += (code < 0x80) ? (char)code : '?';
+                break;
+            }
+            default: out += escaped; break;
+            }
+        }
+        return false;
+    }
+
+    bool ParseValue(JsonValue& value, int depth) {
+        if (depth > 16) return false;
+        SkipSpace();
+        if (m_pos >= m_text.size()) return false;
+        char c = m_text[m_pos];
+        if (c == '{') {
+            m_pos++;
+            value.kind = JsonValue::Object;
+            if (Consume('}')) return true;
+            do {
+                std::pair<std::string, JsonValue> member;
+                if (!ParseString(member.first) || !Consume(':') || !ParseValue(member.second, depth + 1)) return false;
+                value.members.push_back(std::move(member));
+            } while (Consume(','));
+            return Consume('}');
+        }
+        if (c == '[') {
+            m_pos++;
+            value.kind = JsonValue::Array;
+            if (Consume(']')) return true;
+            do {
+                value.items.emplace_back();
+                if (!ParseValue(value.items.back(), depth + 1)) return false;
+            } while (Consume(','));
+            return Consume(']');
+        }
+        if (c == '"') {
+            value.kind = JsonValue::String;
+            return ParseString(value.text);
+        }
+        static const char* literals[] = {"true", "false", "null"};
+        for (const char* literal : literals) {
+            if (m_text.compare(m_pos, strlen(literal), literal) == 0) {
+                value.kind = (literal[0] == 'n') ? JsonValue::Null : JsonValue::Boolean;
+                value.text = literal;
+                m_pos += strlen(literal);
+                return true;
+            }
+        }
+        size_t start = m_pos;
+        while (m_pos < m_text.size() && m_text[m_pos] && strchr("+-0123456789.eE", m_text[m_pos])) m_pos++;
+        if (m_pos == start) return false;
+        value.kind = JsonValue::Number;
+        value.text = m_text.substr(start, m_pos - start);
+        return true;
+    }
+
+    const std::string& m_text;
+    size_t m_pos = 0;
+};
+
+// ============================================================================
+// ANTI-FORENSIC SPLITTER
+// ============================================================================
+
+// LUKS1 AF: the key is spread over `stripes` copies that are chained through
+// a hash diffusion, so losing any part of the material destroys the key.
+static void AfDiffuse(uint8_t* buffer, size_t length) {
+    const size_t digestSize = Sha256::DIGEST_SIZE;
+    for (size_t offset = 0, block = 0; offset < length; offset += digestSize, block++) {
+        size_t take = std::min(length - offset, digestSize);
+        uint8_t counter[4];
+        StoreBe(counter, block, 4);
+        uint8_t digest[Sha256::DIGEST_SIZE];
+        Sha256 hash;
+        hash.Update(counter, sizeof(counter));
+        hash.Update(buffer + offset, take);
+        hash.Final(digest);
+        memcpy(buffer + offset, digest, take);
+    }
+}
+
+static bool AfSplit(const uint8_t* key, size_t keyBytes, uint32_t stripes, uint8_t* material) {
+    if (!GetRandomBytes(material, keyBytes * (stripes - 1))) {
+        return false;
+    }
+    std::vector<uint8_t> mixed(keyBytes, 0);
+    for (uint32_t stripe = 0; stripe + 1 < stripes; stripe++) {
+        for (size_t i = 0; i < keyBytes; i++) mixed[i] ^= material[stripe * keyBytes + i];
+        AfDiffuse(mixed.data(), keyBytes);
+    }
+    uint8_t* last = material + (size_t)(stripes - 1) * keyBytes;
+    for (size_t i = 0; i < keyBytes; i++) last[i] = mixed[i] ^ key[i];
+    SecureZero(mixed.data(), mixed.size());
+    return true;
+}
+
+static void AfMerge(const uint8_t* material, size_t keyBytes, uint32_t stripes, uint8_t* key) {
+    std::vector<uint8_t> mixed(keyBytes, 0);
+    for (uint32_t stripe = 0; stripe + 1 < stripes; stripe++) {
+        for (size_t i = 0; i < keyBytes; i++) mixed[i] ^= material[stripe * keyBytes + i];
+        AfDiffuse(mixed.data(), keyBytes);
+    }
+    const uint8_t* last = material + (size_t)(stripes - 1) * keyBytes;
+    for (size_t i = 0; i < keyBytes; i++) key[i] = mixed[i] ^ last[i];
+    SecureZero(mixed.data(), mixed.size());
+}
+
+// ============================================================================
+// HEADER
+// ============================================================================
+
+static std::string MakeUuid(const uint8_t random[16]) {
+    uint8_t bytes[16];
+    memcpy(bytes, random, sizeof(bytes));
+    bytes[6] = (uint8_t)((bytes[6] & 0x0F) | 0x40);     // version 4
+    bytes[8] = (uint8_t)((bytes[8] & 0x3F) | 0x80);     // RFC 4122 variant
+    static const char digits[] = "0123456789abcdef";
+    std::string uuid;
+    for (int i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) uuid += '-';
+        uuid += digits[bytes[i] >> 4];
+        uuid += digits[bytes[i] & 15];
+    }
+    return uuid;
+}
+
+struct KeyslotMetadata {
+    uint32_t keyBytes;
+    uint64_t areaSize;
+    uint32_t iterations;
+    uint8_t salt[SALT_SIZE];
+    uint32_t digestIterations;
+    uint8_t digestSalt[SALT_SIZE];
+    uint8_t digest[Sha256::DIGEST_SIZE];
+    uint32_t sectorSize;
+};
+
+static std::string BuildMetadataJson(const KeyslotMetadata& slot) {
+    std::string keyBytes = std::to_string(slot.keyBytes);
+    std::string json;
+    json += "{\"keyslots\":{\"0\":{\"type\":\"luks2\",\"key_size\":" + keyBytes + ",";
+    json += "\"af\":{\"type\":\"luks1\",\"stripes\":" + std::to_string(AF_STRIPES) + ",\"hash\":\"sha256\"},";
+    json += "\"area\":{\"type\":\"raw\",\"offset\":\"" + std::to_string(KEYSLOTS_OFFSET) + "\",\"size\":\"" +
+            std::to_string(slot.areaSize) + "\",\"encryption\":\"aes-xts-plain64\",\"key_size\":" + keyBytes + "},";
+    json += "\"kdf\":{\"type\":\"pbkdf2\",\"hash\":\"sha256\",\"iterations\":" + std::to_string(slot.iterations) +
+            ",\"salt\":\"" + Base64Encode(slot.salt, SALT_SIZE) + "\"}}},";
+    json += "\"tokens\":{},";
+    json += "\"segments\":{\"0\":{\"type\":\"crypt\",\"offset\":\"" + std::to_string(LUKS2_PAYLOAD_OFFSET) +
+            "\",\"size\":\"dynamic\",\"iv_tweak\":\"0\",\"encryption\":\"aes-xts-plain64\",\"sector_size\":" +
+            std::to_string(slot.sectorSize) + "}},";
+    json += "\"digests\":{\"0\":{\"type\":\"pbkdf2\",\"keyslots\":[\"0\"],\"segments\":[\"0\"],\"hash\":\"sha256\","
+            "\"iterations\":" + std::to_string(slot.digestIterations) +
+            ",\"salt\":\"" + Base64Encode(slot.digestSalt, SALT_SIZE) +
+            "\",\"digest\":\"" + Base64Encode(slot.digest, sizeof(slot.digest)) + "\"}},";
+    json += "\"config\":{\"json_size\":\"" + std::to_string(HEADER_SIZE - BINARY_HEADER_SIZE) +
+            "\",\"keyslots_size\":\"" + std::to_string(LUKS2_PAYLOAD_OFFSET - KEYSLOTS_OFFSET) + "\"}}";
+    return json;
+}
+
+static void ComputeHeaderChecksum(const uint8_t* header, uint64_t headerSize, uint8_t digest[Sha256::DIGEST_SIZE]) {
+    static const uint8_t zeros[CHECKSUM_SIZE] = {};
+    Sha256 hash;
+    hash.Update(header, OFFSET_CHECKSUM);
+    hash.Update(zeros, CHECKSUM_SIZE);
+    hash.Update(header + OFFSET_CHECKSUM + CHECKSUM_SIZE, (size_t)headerSize - OFFSET_CHECKSUM - CHECKSUM_SIZE);
+    hash.Final(digest);
+}
+
+// Both copies carry the same metadata and sequence number; only the magic
+// and their own offset differ.
+static bool BuildHeader(uint8_t* header, bool primary, const std::string& json, const std::string& uuid,
+                        const std::string& label) {
+    memset(header, 0, HEADER_SIZE);
+    memcpy(header, primary ? MAGIC_PRIMARY : MAGIC_SECONDARY, sizeof(MAGIC_PRIMARY));
+    StoreBe(header + OFFSET_VERSION, 2, 2);
+    StoreBe(header + OFFSET_HEADER_SIZE, HEADER_SIZE, 8);
+    StoreBe(header + OFFSET_SEQID, 1, 8);
+    memcpy(header + OFFSET_LABEL, label.data(), std::min(label.size(), LABEL_SIZE - 1));
+    memcpy(header + OFFSET_CHECKSUM_ALG, "sha256", 6);
+    if (!GetRandomBytes(header + OFFSET_SALT, 64)) {
+        return false;
+    }
+    memcpy(header + OFFSET_UUID, uuid.data(), uuid.size());
+    StoreBe(header + OFFSET_HEADER_OFFSET, primary ? 0 : HEADER_SIZE, 8);
+    memcpy(header + BINARY_HEADER_SIZE, json.data(), json.size());
+    ComputeHeaderChecksum(header, HEADER_SIZE, header + OFFSET_CHECKSUM);
+    return true;
+}
+
+static bool IsValidSectorSize(uint32_t sectorSize) {
+    return sectorSize >= 512 && sectorSize <= 4096 && (sectorSize & (sectorSize - 1)) == 0;
+}
+
+bool FormatLuks2Volume(BlockDevice& target, uint64_t volumeOffset, const EncryptionParams& params,
+                       XtsCipher& volumeCipher, Luks2Segment& segment, std::wstring& error) {
+    const DeviceGeometry& geometry = target.GetGeometry();
+    if (params.keyBytes != 32 && params.keyBytes != 64) {
+        error = L"Unsupported encryption key size.";
+        return false;
+    }
+    if (!IsValidSectorSize(params.sectorSize) || params.sectorSize < geometry.logicalSectorSize) {
+        error = L"The encryption sector size must be a power of two from 512 to 4096 bytes and at least the "
+                L"device sector size.";
+        return false;
+    }
+    if (volumeOffset % geometry.logicalSectorSize != 0) {
+        error = L"The encrypted volume is not sector aligned.";
+        return false;
+    }
+    if (geometry.sizeBytes > 0 && geometry.sizeBytes < volumeOffset + LUKS2_PAYLOAD_OFFSET + params.sectorSize) {
+        error = L"The target is too small for an encrypted volume.";
+        return false;
+    }
+    if (params.passphrase.empty()) {
+        error = L"An encrypted volume needs a passphrase.";
+        return false;
+    }
+
+    TraceSpan span("encrypt", "format volume");
+    KeyslotMetadata slot = {};
+    slot.keyBytes = params.keyBytes;
+    slot.sectorSize = params.sectorSize;
+    uint8_t volumeKey[64];
+    uint8_t uuidBytes[16];
+    if (!GetRandomBytes(volumeKey, params.keyBytes) || !GetRandomBytes(slot.salt, SALT_SIZE) ||
+        !GetRandomBytes(slot.digestSalt, SALT_SIZE) || !GetRandomBytes(uuidBytes, sizeof(uuidBytes))) {
+        error = L"The system random number generator is unavailable.";
+        return false;
+    }
+
+    // The keyslot KDF is what an attacker has to brute-force; the digest
+    // only confirms a candidate key, so it gets a fraction of the work.
+    slot.iterations = params.kdfIterations ? params.kdfIterations
+                                           : CalibratePbkdf2Iterations(params.kdfMilliseconds, params.keyBytes);
+    slot.digestIterations = std::max<uint32_t>(1000, slot.iterations / 16);
+    LogEvent(LogLevel::Info, "encrypt", "kdf",
+             {{"iterations", slot.iterations}, {"digest_iterations", slot.digestIterations}});
+
+    std::vector<uint8_t> region((size_t)LUKS2_PAYLOAD_OFFSET, 0);
+    size_t materialBytes = (size_t)params.keyBytes * AF_STRIPES;
+    size_t encryptedBytes = (size_t)RoundUp(materialBytes, KEYSLOT_SECTOR_SIZE);
+    slot.areaSize = RoundUp(materialBytes, 4096);
+    uint8_t* material = region.data() + KEYSLOTS_OFFSET;
+    if (!AfSplit(volumeKey, params.keyBytes, AF_STRIPES, material)) {
+        SecureZero(volumeKey, sizeof(volumeKey));
+        error = L"The system random number generator is unavailable.";
+        return false;
+    }
+
+    uint8_t areaKey[64];
+    Pbkdf2Sha256(params.passphrase.data(), params.passphrase.size(), slot.salt, SALT_SIZE, slot.iterations,
+                 areaKey, params.keyBytes);
+    {
+        XtsCipher areaCipher;
+        areaCipher.SetKey(areaKey, params.keyBytes);
+        areaCipher.EncryptSectors(0, KEYSLOT_SECTOR_SIZE, material, encryptedBytes);
+    }
+    SecureZero(areaKey, sizeof(areaKey));
+    Pbkdf2Sha256(volumeKey, params.keyBytes, slot.digestSalt, SALT_SIZE, slot.digestIterations, slot.digest,
+                 sizeof(slot.digest));
+
+    std::string json = BuildMetadataJson(slot);
+    std::string uuid = MakeUuid(uuidBytes);
+    if (json.size() >= HEADER_SIZE - BINARY_HEADER_SIZE ||
+        !BuildHeader(region.data(), true, json, uuid, params.label) ||
+        !BuildHeader(region.data() + HEADER_SIZE, false, json, uuid, params.label)) {
+        SecureZero(volumeKey, sizeof(volumeKey));
+        error = L"Cannot build the LUKS2 header.";
+        return false;
+    }
+
+    if (!target.Write(volumeOffset, region.data(), region.size()) || !target.Flush()) {
+        SecureZero(volumeKey, sizeof(volumeKey));
+        error = L"Failed to write the LUKS2 header.";
+        return false;
+    }
+
+    volumeCipher.SetKey(volumeKey, params.keyBytes);
+    SecureZero(volumeKey, sizeof(volumeKey));
+    segment = Luks2Segment();
+    segment.sectorSize = params.sectorSize;
+    LogMessage(LogLevel::Info, "encrypt", L"LUKS2 volume " + Utf8ToWide(uuid) + L" formatted");
+    return true;
+}
+
+// Reads and checks one header copy. `headerOffset` is relative to the volume.
+static bool ReadHeaderCopy(BlockDevice& source, uint64_t volumeOffset, uint64_t headerOffset, bool primary,
+                           std::string& json) {
+    uint8_t binary[BINARY_HEADER_SIZE];
+    if (!source.Read(volumeOffset + headerOffset, binary, sizeof(binary)) ||
+        memcmp(binary, primary ? MAGIC_PRIMARY : MAGIC_SECONDARY, sizeof(MAGIC_PRIMARY)) != 0 ||
+        LoadBe(binary + OFFSET_VERSION, 2) != 2 || LoadBe(binary + OFFSET_HEADER_OFFSET, 8) != headerOffset ||
+        strncmp((const char*)binary + OFFSET_CHECKSUM_ALG, "sha256", 32) != 0) {
+        return false;
+    }
+    uint64_t headerSize = LoadBe(binary + OFFSET_HEADER_SIZE, 8);
+    if (headerSize < HEADER_SIZE || headerSize > 4 * 1024 * 1024 || (headerSize & (headerSize - 1)) != 0 ||
+        (!primary && headerSize != headerOffset)) {
+        return false;
+    }
+
+    std::vector<uint8_t> header((size_t)headerSize);
+    if (!source.Read(volumeOffset + headerOffset, header.data(), header.size())) {
+        return false;
+    }
+    uint8_t digest[Sha256::DIGEST_SIZE];
+    ComputeHeaderChecksum(header.data(), headerSize, digest);
+    if (memcmp(digest, header.data() + OFFSET_CHECKSUM, sizeof(digest)) != 0) {
+        return false;
+    }
+    const char* text = (const char*)header.data() + BINARY_HEADER_SIZE;
+    json.assign(text, strnlen(text, header.size() - BINARY_HEADER_SIZE));
+    return true;
+}
+
+static bool ReadMetadata(BlockDevice& source, uint64_t volumeOffset, JsonValue& metadata, std::wstring& error) {
+    std::string json;
+    bool found = ReadHeaderCopy(source, volumeOffset, 0, true, json);
+    // The secondary copy sits right after the primary, whose size is unknown
+    // when the primary is damaged.
+    for (uint64_t size = HEADER_SIZE; !found && size <= 4 * 1024 * 1024; size *= 2) {
+        found = ReadHeaderCopy(source, volumeOffset, size, false, json);
+    }
+    if (!found) {
+        error = L"No valid LUKS2 header found.";
+        return false;
+    }
+    if (!JsonParser(json).Parse(metadata) || metadata.kind != JsonValue::Object) {
+        error = L"The LUKS2 metadata is malformed.";
+        return false;
+    }
+    return true;
+}
+
+static bool DigestMatches(const JsonValue& digest, const uint8_t* key, size_t keyBytes) {
+    uint64_t iterations;
+    std::vector<uint8_t> salt;
+    std::vector<uint8_t> expected;
+    if (digest.GetString("type") != "pbkdf2" || digest.GetString("hash") != "sha256" ||
+        !digest.GetUint("iterations", iterations) || iterations == 0 || iterations > UINT32_MAX ||
+        !Base64Decode(digest.GetString("salt"), salt) || !Base64Decode(digest.GetString("digest"), expected) ||
+        expected.empty() || expected.size() > 64) {
+        return false;
+    }
+    uint8_t actual[64];
+    Pbkdf2Sha256(key, keyBytes, salt.data(), salt.size(), (uint32_t)iterations, actual, expected.size());
+    return memcmp(actual, expected.data(), expected.size()) == 0;
+}
+
+static bool ListContains(const JsonValue* list, const std::string& name) {
+    if (!list) return false;
+    for (const JsonValue& item : list->items) {
+        if (item.text == name) return true;
+    }
+    return false;
+}
+
+bool UnlockLuks2Volume(BlockDevice& source, uint64_t volumeOffset, const std::string& passphrase,
+                       XtsCipher& volumeCipher, Luks2Segment& segment, std::wstring& error) {
+    JsonValue metadata;
+    if (!ReadMetadata(source, volumeOffset, metadata, error)) {
+        return false;
+    }
+    const JsonValue* keyslots = metadata.Get("keyslots");
+    const JsonValue* digests = metadata.Get("digests");
+    const JsonValue* segments = metadata.Get("segments");
+    if (!keyslots || !digests || !segments) {
+        error = L"The LUKS2 metadata is incomplete.";
+        return false;
+    }
+
+    TraceSpan span("encrypt", "unlock volume");
+    uint32_t readUnit = std::max<uint32_t>(source.GetGeometry().logicalSectorSize, KEYSLOT_SECTOR_SIZE);
+    bool skippedUnsupported = false;
+    for (const auto& entry : keyslots->members) {
+        const JsonValue& slot = entry.second;
+        const JsonValue* kdf = slot.Get("kdf");
+        const JsonValue* af = slot.Get("af");
+        const JsonValue* area = slot.Get("area");
+        uint64_t keyBytes = 0, iterations = 0, stripes = 0, areaOffset = 0, areaSize = 0;
+        std::vector<uint8_t> salt;
+        if (!kdf || !af || !area || slot.GetString("type") != "luks2" || !slot.GetUint("key_size", keyBytes) ||
+            (keyBytes != 32 && keyBytes != 64)) {
+            continue;
+        }
+        if (kdf->GetString("type") != "pbkdf2" || kdf->GetString("hash") != "sha256" ||
+            af->GetString("type") != "luks1" || af->GetString("hash") != "sha256" ||
+            area->GetString("type") != "raw" || area->GetString("encryption") != "aes-xts-plain64") {
+            skippedUnsupported = true;
+            continue;
+        }
+        uint64_t areaKeyBytes = keyBytes;
+        area->GetUint("key_size", areaKeyBytes);
+        if (!kdf->GetUint("iterations", iterations) || iterations == 0 || iterations > UINT32_MAX ||
+            !Base64Decode(kdf->GetString("salt"), salt) || !af->GetUint("stripes", stripes) ||
+            stripes == 0 || stripes > 65536 || !area->GetUint("offset", areaOffset) ||
+            !area->GetUint("size", areaSize) || (areaKeyBytes != 32 && areaKeyBytes != 64)) {
+            continue;
+        }
+        size_t materialBytes = (size_t)(keyBytes * stripes);
+        size_t readBytes = (size_t)RoundUp(materialBytes, readUnit);
+        if (readBytes > areaSize || areaOffset % readUnit != 0) {
+            continue;
+        }
+
+        std::vector<uint8_t> material(readBytes);
+        if (!source.Read(volumeOffset + areaOffset, material.data(), material.size())) {
+            error = L"Cannot read the LUKS2 keyslot area.";
+            return false;
+        }
+        uint8_t areaKey[64];
+        Pbkdf2Sha256(passphrase.data(), passphrase.size(), salt.data(), salt.size(), (uint32_t)iterations, areaKey,
+                     (size_t)areaKeyBytes);
+        XtsCipher areaCipher;
+        areaCipher.SetKey(areaKey, (size_t)areaKeyBytes);
+        SecureZero(areaKey, sizeof(areaKey));
+        areaCipher.DecryptSectors(0, KEYSLOT_SECTOR_SIZE, material.data(),
+                                  (size_t)RoundUp(materialBytes, KEYSLOT_SECTOR_SIZE));
+        uint8_t candidate[64];
+        AfMerge(material.data(), (size_t)keyBytes, (uint32_t)stripes, candidate);
+        SecureZero(material.data(), material.size());
+
+        for (const auto& digestEntry : digests->members) {
+            const JsonValue& digest = digestEntry.second;
+            if (!ListContains(digest.Get("keyslots"), entry.first) ||
+                !DigestMatches(digest, candidate, (size_t)keyBytes)) {
+                continue;
+            }
+            const JsonValue* segmentList = digest.Get("segments");
+            const JsonValue* crypt = (segmentList && !segmentList->items.empty())
+                                         ? segments->Get(segmentList->items[0].text.c_str()) : nullptr;
+            uint64_t offset, sectorSize = 512, ivTweak = 0;
+            if (!crypt || crypt->GetString("type") != "crypt" ||
+                crypt->GetString("encryption") != "aes-xts-plain64" || !crypt->GetUint("offset", offset)) {
+                SecureZero(candidate, sizeof(candidate));
+                error = L"The LUKS2 data segment uses an unsupported cipher.";
+                return false;
+            }
+            crypt->GetUint("sector_size", sectorSize);
+            crypt->GetUint("iv_tweak", ivTweak);
+            if (!IsValidSectorSize((uint32_t)sectorSize) || offset % sectorSize != 0) {
+                SecureZero(candidate, sizeof(candidate));
+                error = L"The LUKS2 data segment is malformed.";
+                return false;
+            }
+            volumeCipher.SetKey(candidate, (size_t)keyBytes);
+            SecureZero(candidate, sizeof(candidate));
+            segment.offset = offset;
+            segment.sectorSize = (uint32_t)sectorSize;
+            segment.ivTweak = ivTweak;
+            return true;
+        }
+        SecureZero(candidate, sizeof(candidate));
+    }
+
+    error = skippedUnsupported ? L"Wrong passphrase, or the keyslot uses a KDF other than PBKDF2-SHA256."
+                               : L"Wrong passphrase.";
+    return false;
+}
+
+// ============================================================================
+// IMAGES
+// ============================================================================
+
+// Extends the image with zeros to a whole number of encryption sectors. The
+// reported end moves with the padding so sequential sources are not read
+// past it.
+static ChunkSource MakePaddedChunkSource(ImageSource& image, uint32_t sectorSize) {
+    uint64_t paddedEnd = UINT64_MAX;
+    return [&image, sectorSize, paddedEnd](uint64_t offset, void* buffer, size_t length) mutable -> int64_t {
+        if (offset >= paddedEnd) return 0;
+        int64_t got = image.Read(offset, buffer, length);
+        if (got <= 0 || got % sectorSize == 0) return got;
+        size_t padded = std::min<size_t>(length, (size_t)RoundUp((uint64_t)got, sectorSize));
+        memset((uint8_t*)buffer + got, 0, padded - (size_t)got);
+        paddedEnd = offset + padded;
+        return (int64_t)padded;
+    };
+}
+
+// dm-crypt numbers IVs in encryption sectors; iv_tweak is in 512-byte units.
+static ChunkTransform MakeEncryptTransform(const XtsCipher& cipher, const Luks2Segment& segment) {
+    return [&cipher, segment](uint64_t offset, uint8_t* data, size_t length) {
+        cipher.EncryptSectors((segment.ivTweak * 512 + offset) / segment.sectorSize, segment.sectorSize, data, length);
+    };
+}
+
+// Chunks must hold whole encryption sectors.
+static WriterParams AlignWriterParams(const WriterParams& params, uint32_t sectorSize) {
+    WriterParams aligned = params;
+    aligned.chunkSize = (uint32_t)RoundUp(std::max<uint32_t>(params.chunkSize, sectorSize), sectorSize);
+    return aligned;
+}
+
+static uint64_t PaddedImageLength(uint64_t imageSize, uint32_t sectorSize) {
+    return imageSize == IMAGE_SIZE_UNKNOWN ? IMAGE_SIZE_UNKNOWN : RoundUp(imageSize, sectorSize);
+}
+
+bool WriteEncryptedImage(const std::wstring& imagePath, BlockDevice& target, uint64_t volumeOffset,
+                         const EncryptionParams& params, const WriterParams& writerParams,
+                         const ProgressCallback& progress, WriteStats* stats, std::wstring& error,
+                         const ChunkTransform& tap) {
+    std::unique_ptr<ImageSource> image = OpenImageSource(imagePath, error, writerParams.readPolicy);
+    if (!image) {
+        return false;
+    }
+    uint64_t length = PaddedImageLength(image->GetSize(), std::max<uint32_t>(params.sectorSize, 1));
+    uint64_t deviceSize = target.GetGeometry().sizeBytes;
+    if (length != IMAGE_SIZE_UNKNOWN && deviceSize > 0 && volumeOffset + LUKS2_PAYLOAD_OFFSET + length > deviceSize) {
+        error = L"The image does not fit in the encrypted volume.";
+        return false;
+    }
+
+    XtsCipher cipher;
+    Luks2Segment segment;
+    if (!FormatLuks2Volume(target, volumeOffset, params, cipher, segment, error)) {
+        return false;
+    }
+    LogMessage(LogLevel::Info, "encrypt",
+               L"XTS-AES-" + std::to_wstring(params.keyBytes * 4) + L" using " +
+               Utf8ToWide(GetAesImplementationName()));
+    ChunkTransform encrypt = MakeEncryptTransform(cipher, segment);
+    ChunkTransform transform = encrypt;
+    if (tap) {
+        transform = [&tap, &encrypt](uint64_t offset, uint8_t* data, size_t chunkLength) {
+            tap(offset, data, chunkLength);
+            encrypt(offset, data, chunkLength);
+        };
+    }
+    return RunWritePipeline(target, volumeOffset + segment.offset, length,
+                            MakePaddedChunkSource(*image, segment.sectorSize),
+                            AlignWriterParams(writerParams, segment.sectorSize), progress, stats, error,
+                            transform);
+}
+
+bool VerifyEncryptedImage(const std::wstring& imagePath, BlockDevice& target, uint64_t volumeOffset,
+                          const std::string& passphrase, const WriterParams& writerParams,
+                          const ProgressCallback& progress, uint64_t* mismatchOffset, std::wstring& error) {
+    XtsCipher cipher;
+    Luks2Segment segment;
+    if (!UnlockLuks2Volume(target, volumeOffset, passphrase, cipher, segment, error)) {
+        return false;
+    }
+    std::unique_ptr<ImageSource> image = OpenImageSource(imagePath, error, writerParams.readPolicy);
+    if (!image) {
+        return false;
+    }
+    return RunVerifyPipeline(target, volumeOffset + segment.offset, PaddedImageLength(image->GetSize(), segment.sectorSize),
+                             MakePaddedChunkSource(*image, segment.sectorSize),
+                             AlignWriterParams(writerParams, segment.sectorSize), progress, mismatchOffset, error,
+                             MakeEncryptTransform(cipher, segment));
+}
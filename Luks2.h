@@ -0,0 +1,59 @@
+// ============================================================================
+// INFERNO - LUKS2 encrypted volumes
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+#include "Crypto.h"
+#include "ImageWriter.h"
+
+#include <cstdint>
+#include <string>
+
+// Volumes use the LUKS2 on-disk format so cryptsetup and systemd-cryptenroll
+// can open them: two 16 KiB header copies, one passphrase keyslot with a
+// PBKDF2-SHA256 key and anti-forensic split material, and an
+// aes-xts-plain64 data segment starting 16 MiB into the volume.
+static const uint64_t LUKS2_PAYLOAD_OFFSET = 16 * 1024 * 1024;
+
+struct EncryptionParams {
+    std::string passphrase;             // UTF-8
+    uint32_t keyBytes = 64;             // 64: XTS-AES-256, 32: XTS-AES-128
+    uint32_t sectorSize = 512;          // encryption unit: 512 to 4096, at least the device sector
+    uint32_t kdfIterations = 0;         // 0: calibrate to kdfMilliseconds on this machine
+    uint32_t kdfMilliseconds = 2000;
+    std::string label;
+};
+
+// Where the encrypted data of an unlocked volume lives.
+struct Luks2Segment {
+    uint64_t offset = LUKS2_PAYLOAD_OFFSET;     // bytes from the start of the volume
+    uint32_t sectorSize = 512;
+    uint64_t ivTweak = 0;                       // sector number of the first payload sector
+};
+
+// Writes a fresh header at `volumeOffset` and keys `volumeCipher` with the
+// new random volume key. Everything in the first 16 MiB is overwritten.
+bool FormatLuks2Volume(BlockDevice& target, uint64_t volumeOffset, const EncryptionParams& params,
+                       XtsCipher& volumeCipher, Luks2Segment& segment, std::wstring& error);
+
+// Tries each PBKDF2 keyslot with `passphrase`. Argon2 keyslots, as created
+// by cryptsetup's defaults, are skipped.
+bool UnlockLuks2Volume(BlockDevice& source, uint64_t volumeOffset, const std::string& passphrase,
+                       XtsCipher& volumeCipher, Luks2Segment& segment, std::wstring& error);
+
+// Formats a volume at `volumeOffset` and streams the image into it,
+// encrypting on the pipeline workers. The image is padded with zeros to a
+// whole encryption sector. `tap` sees each chunk's plaintext; its offsets
+// are relative to the start of the image.
+bool WriteEncryptedImage(const std::wstring& imagePath, BlockDevice& target, uint64_t volumeOffset,
+                         const EncryptionParams& params, const WriterParams& writerParams,
+                         const ProgressCallback& progress, WriteStats* stats, std::wstring& error,
+                         const ChunkTransform& tap = ChunkTransform());
+
+// Unlocks the volume and compares its ciphertext with the image encrypted
+// under the same key, so nothing is decrypted on the read-back path.
+bool VerifyEncryptedImage(const std::wstring& imagePath, BlockDevice& target, uint64_t volumeOffset,
+                          const std::string& passphrase, const WriterParams& writerParams,
+                          const ProgressCallback& progress, uint64_t* mismatchOffset, std::wstring& error);
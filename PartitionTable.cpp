@@ -0,0 +1,728 @@
+// ============================================================================
+// INFERNO - MBR / GPT partition table engine
+// ============================================================================
+
+#include "PartitionTable.h"
+#include "Checksum.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+#include <random>
+
+// ============================================================================
+// ON-DISK STRUCTURES
+// ============================================================================
+
+#pragma pack(push, 1)
+
+struct MbrPartitionRecord {
+    uint8_t status;
+    uint8_t chsFirst[3];
+    uint8_t type;
+    uint8_t chsLast[3];
+    uint32_t lbaFirst;
+    uint32_t sectorCount;
+};
+
+struct MasterBootRecord {
+    uint8_t bootCode[440];
+    uint32_t diskSignature;
+    uint16_t reserved;
+    MbrPartitionRecord partitions[4];
+    uint16_t signature;
+};
+
+struct GptHeader {
+    char signature[8];
+    uint32_t revision;
+    uint32_t headerSize;
+    uint32_t headerCrc32;
+    uint32_t reserved;
+    uint64_t myLba;
+    uint64_t alternateLba;
+    uint64_t firstUsableLba;
+    uint64_t lastUsableLba;
+    uint8_t diskGuid[16];
+    uint64_t partitionEntryLba;
+    uint32_t numberOfPartitionEntries;
+    uint32_t sizeOfPartitionEntry;
+    uint32_t partitionEntryArrayCrc32;
+};
+
+struct GptPartitionEntry {
+    uint8_t typeGuid[16];
+    uint8_t uniqueGuid[16];
+    uint64_t startingLba;
+    uint64_t endingLba;
+    uint64_t attributes;
+    uint16_t name[36];
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(MasterBootRecord) == 512, "MBR layout");
+static_assert(sizeof(GptHeader) == 92, "GPT header layout");
+static_assert(sizeof(GptPartitionEntry) == 128, "GPT entry layout");
+
+static const char GPT_SIGNATURE[8] = {'E', 'F', 'I', ' ', 'P', 'A', 'R', 'T'};
+static const uint32_t GPT_REVISION = 0x00010000;
+static const uint32_t GPT_ENTRY_COUNT = 128;
+static const uint16_t MBR_BOOT_SIGNATURE = 0xAA55;
+static const uint8_t MBR_TYPE_GPT_PROTECTIVE = 0xEE;
+
+// ============================================================================
+// GUID HELPERS
+// ============================================================================
+
+bool Guid::operator==(const Guid& other) const {
+    return memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+}
+
+bool Guid::IsZero() const {
+    for (uint8_t b : bytes) {
+        if (b != 0) return false;
+    }
+    return true;
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+Guid GuidFromString(const char* text) {
+    // Textual order, then swap the three little-endian leading fields.
+    uint8_t raw[16] = {0};
+    int count = 0;
+    for (const char* p = text; *p && count < 32; p++) {
+        int v = HexValue(*p);
+        if (v < 0) continue;
+        raw[count / 2] = (uint8_t)((raw[count / 2] << 4) | v);
+        count++;
+    }
+
+    Guid guid;
+    static const int order[16] = {3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15};
+    for (int i = 0; i < 16; i++) {
+        guid.bytes[i] = raw[order[i]];
+    }
+    return guid;
+}
+
+Guid NewRandomGuid() {
+    static std::mutex lock;
+    static std::mt19937_64 engine(std::random_device{}());
+    uint64_t a, b;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        a = engine();
+        b = engine();
+    }
+    Guid guid;
+    memcpy(guid.bytes, &a, 8);
+    memcpy(guid.bytes + 8, &b, 8);
+    guid.bytes[7] = (uint8_t)((guid.bytes[7] & 0x0F) | 0x40);  // version 4
+    guid.bytes[8] = (uint8_t)((guid.bytes[8] & 0x3F) | 0x80);  // RFC 4122 variant
+    return guid;
+}
+
+// ============================================================================
+// HELPERS
+// ============================================================================
+
+const wchar_t* PartitionStyleName(PartitionStyle style) {
+    switch (style) {
+        case PartitionStyle::MBR: return L"MBR";
+        case PartitionStyle::GPT: return L"GPT";
+        default: return L"RAW";
+    }
+}
+
+uint64_t GetPartitionAlignment(const DeviceGeometry& geometry) {
+    uint64_t alignment = 1024 * 1024;
+    alignment = std::lcm(alignment, (uint64_t)std::max<uint32_t>(geometry.logicalSectorSize, 1));
+    alignment = std::lcm(alignment, (uint64_t)std::max<uint32_t>(geometry.physicalSectorSize, 1));
+    if (geometry.eraseBlockSize > 0) {
+        alignment = std::lcm(alignment, (uint64_t)geometry.eraseBlockSize);
+    }
+    return alignment;
+}
+
+static uint64_t AlignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static uint32_t GetGptEntrySectors(uint32_t sectorSize) {
+    return (GPT_ENTRY_COUNT * sizeof(GptPartitionEntry) + sectorSize - 1) / sectorSize;
+}
+
+static void LbaToChs(uint64_t lba, uint8_t chs[3]) {
+    const uint64_t heads = 255;
+    const uint64_t sectorsPerTrack = 63;
+    if (lba >= 1024 * heads * sectorsPerTrack) {
+        chs[0] = 0xFE;
+        chs[1] = 0xFF;
+        chs[2] = 0xFF;
+        return;
+    }
+    uint64_t cylinder = lba / (heads * sectorsPerTrack);
+    uint64_t head = (lba / sectorsPerTrack) % heads;
+    uint64_t sector = lba % sectorsPerTrack + 1;
+    chs[0] = (uint8_t)head;
+    chs[1] = (uint8_t)(((cylinder >> 2) & 0xC0) | sector);
+    chs[2] = (uint8_t)(cylinder & 0xFF);
+}
+
+static void FillMbrRecord(MbrPartitionRecord& record, uint8_t type, uint64_t startLba,
+                          uint64_t sectorCount, bool bootable) {
+    record.status = bootable ? 0x80 : 0x00;
+    record.type = type;
+    record.lbaFirst = (uint32_t)startLba;
+    record.sectorCount = (uint32_t)std::min<uint64_t>(sectorCount, 0xFFFFFFFFull);
+    LbaToChs(startLba, record.chsFirst);
+    LbaToChs(startLba + sectorCount - 1, record.chsLast);
+}
+
+// ============================================================================
+// READING
+// ============================================================================
+
+// Reads and checks the GPT header at `headerLba` and its entry array; the
+// header's own sector is kept for rewriting it in place.
+static bool LoadGpt(BlockDevice& device, uint64_t headerLba, uint32_t sectorSize, std::vector<uint8_t>& sector,
+                    GptHeader& header, std::vector<uint8_t>& entries) {
+    sector.assign(sectorSize, 0);
+    if (!device.Read(headerLba * sectorSize, sector.data(), sectorSize)) {
+        return false;
+    }
+
+    memcpy(&header, sector.data(), sizeof(header));
+    if (memcmp(header.signature, GPT_SIGNATURE, sizeof(GPT_SIGNATURE)) != 0 ||
+        header.headerSize < sizeof(GptHeader) || header.headerSize > sectorSize ||
+        header.myLba != headerLba) {
+        return false;
+    }
+
+    std::vector<uint8_t> check(sector);
+    memset(check.data() + offsetof(GptHeader, headerCrc32), 0, sizeof(uint32_t));
+    if (Crc32(check.data(), header.headerSize) != header.headerCrc32) {
+        return false;
+    }
+
+    if (header.sizeOfPartitionEntry < sizeof(GptPartitionEntry) || header.sizeOfPartitionEntry % 8 != 0 ||
+        header.numberOfPartitionEntries == 0 || header.numberOfPartitionEntries > 4096) {
+        return false;
+    }
+
+    size_t arrayBytes = (size_t)header.numberOfPartitionEntries * header.sizeOfPartitionEntry;
+    entries.assign((size_t)AlignUp(arrayBytes, sectorSize), 0);
+    return device.Read(header.partitionEntryLba * sectorSize, entries.data(), entries.size()) &&
+           Crc32(entries.data(), arrayBytes) == header.partitionEntryArrayCrc32;
+}
+
+static bool ReadGpt(BlockDevice& device, uint64_t headerLba, PartitionTable& table) {
+    std::vector<uint8_t> sector;
+    GptHeader header;
+    std::vector<uint8_t> entries;
+    if (!LoadGpt(device, headerLba, table.sectorSize, sector, header, entries)) {
+        return false;
+    }
+
+    table.style = PartitionStyle::GPT;
+    memcpy(table.diskGuid.bytes, header.diskGuid, 16);
+    table.firstUsableLba = header.firstUsableLba;
+    table.lastUsableLba = header.lastUsableLba;
+    table.partitions.clear();
+
+    for (uint32_t i = 0; i < header.numberOfPartitionEntries; i++) {
+        GptPartitionEntry raw;
+        memcpy(&raw, entries.data() + (size_t)i * header.sizeOfPartitionEntry, sizeof(raw));
+
+        PartitionEntry entry;
+        memcpy(entry.typeGuid.bytes, raw.typeGuid, 16);
+        if (entry.typeGuid.IsZero()) continue;
+        memcpy(entry.uniqueGuid.bytes, raw.uniqueGuid, 16);
+        entry.startLba = raw.startingLba;
+        entry.sectorCount = raw.endingLba - raw.startingLba + 1;
+        entry.attributes = raw.attributes;
+        for (uint16_t c : raw.name) {
+            if (c == 0) break;
+            entry.name += (wchar_t)c;
+        }
+        table.partitions.push_back(entry);
+    }
+    return true;
+}
+
+bool ReadPartitionTable(BlockDevice& device, PartitionTable& table) {
+    const DeviceGeometry& geometry = device.GetGeometry();
+    table = PartitionTable();
+    table.sectorSize = geometry.logicalSectorSize;
+    table.totalSectors = geometry.sizeBytes / table.sectorSize;
+    if (table.totalSectors < 2) {
+        return false;
+    }
+
+    std::vector<uint8_t> sector(table.sectorSize);
+    if (!device.Read(0, sector.data(), table.sectorSize)) {
+        return false;
+    }
+    MasterBootRecord mbr;
+    memcpy(&mbr, sector.data(), sizeof(mbr));
+
+    if (ReadGpt(device, 1, table) || ReadGpt(device, table.totalSectors - 1, table)) {
+        table.mbrSignature = mbr.diskSignature;
+        return true;
+    }
+
+    if (mbr.signature != MBR_BOOT_SIGNATURE) {
+        return true;  // blank or unpartitioned
+    }
+
+    // A FAT/NTFS boot sector on a "superfloppy" also ends in 55AA; reject
+    // anything whose status bytes are not 0x00/0x80.
+    for (const MbrPartitionRecord& record : mbr.partitions) {
+        if (record.status != 0x00 && record.status != 0x80) {
+            return true;
+        }
+    }
+
+    table.style = PartitionStyle::MBR;
+    table.mbrSignature = mbr.diskSignature;
+    table.firstUsableLba = 1;
+    table.lastUsableLba = std::min<uint64_t>(table.totalSectors, 0x100000000ull) - 1;
+    for (const MbrPartitionRecord& record : mbr.partitions) {
+        if (record.type == 0 || record.sectorCount == 0) continue;
+        PartitionEntry entry;
+        entry.startLba = record.lbaFirst;
+        entry.sectorCount = record.sectorCount;
+        entry.mbrType = record.type;
+        entry.bootable = (record.status == 0x80);
+        table.partitions.push_back(entry);
+    }
+    return true;
+}
+
+// ============================================================================
+// LAYOUT
+// ============================================================================
+
+bool ComputePartitionLayout(const DeviceGeometry& geometry, const PartitionLayoutRequest& request,
+                            PartitionTable& table, std::wstring& error) {
+    table = PartitionTable();
+    table.style = request.style;
+    table.sectorSize = geometry.logicalSectorSize;
+    table.totalSectors = geometry.sizeBytes / table.sectorSize;
+
+    if (request.style == PartitionStyle::Raw) {
+        error = L"No partition style selected.";
+        return false;
+    }
+    if (request.sizesPercent.empty()) {
+        error = L"No partitions requested.";
+        return false;
+    }
+    if (request.style == PartitionStyle::MBR && request.sizesPercent.size() > 4) {
+        error = L"MBR supports at most four primary partitions.";
+        return false;
+    }
+
+    int totalPercent = 0;
+    for (int percent : request.sizesPercent) {
+        if (percent <= 0) {
+            error = L"Partition sizes must be positive percentages.";
+            return false;
+        }
+        totalPercent += percent;
+    }
+    if (totalPercent > 100) {
+        error = L"Partition sizes add up to more than 100%.";
+        return false;
+    }
+
+    uint32_t entrySectors = GetGptEntrySectors(table.sectorSize);
+    if (request.style == PartitionStyle::GPT) {
+        if (table.totalSectors < 2 * (uint64_t)entrySectors + 3) {
+            error = L"Device is too small for a GPT.";
+            return false;
+        }
+        table.diskGuid = NewRandomGuid();
+        table.firstUsableLba = 2 + entrySectors;
+        table.lastUsableLba = table.totalSectors - 2 - entrySectors;
+    } else {
+        table.mbrSignature = (uint32_t)std::random_device{}();
+        table.firstUsableLba = 1;
+        table.lastUsableLba = std::min<uint64_t>(table.totalSectors, 0x100000000ull) - 1;
+        // MBR addresses 2^32 logical sectors: 2 TiB with 512-byte sectors,
+        // 16 TiB with 4K native ones. The rest of a larger disk stays unused.
+        if (table.totalSectors > 0x100000000ull) {
+            LogEvent(LogLevel::Warning, "partition", "mbr_capped",
+                     {{"sectors", (int64_t)table.totalSectors},
+                      {"usable_sectors", (int64_t)(table.lastUsableLba + 1)},
+                      {"sector_size", (int64_t)table.sectorSize}});
+        }
+    }
+
+    uint64_t alignment = GetPartitionAlignment(geometry) / table.sectorSize;
+    uint64_t start = AlignUp(table.firstUsableLba, alignment);
+    if (start > table.lastUsableLba) {
+        error = L"Device is too small for the requested layout.";
+        return false;
+    }
+    uint64_t usable = table.lastUsableLba + 1 - start;
+
+    for (size_t i = 0; i < request.sizesPercent.size(); i++) {
+        uint64_t count = usable * request.sizesPercent[i] / 100 / alignment * alignment;
+        bool last = (i + 1 == request.sizesPercent.size());
+        if (last && totalPercent == 100) {
+            count = table.lastUsableLba + 1 - start;
+        }
+        if (count == 0 || start + count - 1 > table.lastUsableLba) {
+            error = L"Device is too small for partition " + std::to_wstring(i + 1) + L".";
+            return false;
+        }
+
+        PartitionEntry entry;
+        entry.startLba = start;
+        entry.sectorCount = count;
+        entry.bootable = request.markFirstBootable && i == 0;
+        if (request.style == PartitionStyle::GPT) {
+            entry.typeGuid = request.gptType;
+            entry.uniqueGuid = NewRandomGuid();
+            entry.name = request.name;
+            if (request.sizesPercent.size() > 1) {
+                entry.name += L" " + std::to_wstring(i + 1);
+            }
+        } else {
+            entry.mbrType = request.mbrType;
+        }
+        table.partitions.push_back(entry);
+        start += count;
+    }
+    return true;
+}
+
+// ============================================================================
+// WRITING
+// ============================================================================
+
+static void BuildGptHeader(const PartitionTable& table, uint64_t myLba, uint64_t alternateLba,
+                           uint64_t entryLba, uint32_t entriesCrc, uint8_t* sector) {
+    GptHeader header = {};
+    memcpy(header.signature, GPT_SIGNATURE, sizeof(GPT_SIGNATURE));
+    header.revision = GPT_REVISION;
+    header.headerSize = sizeof(GptHeader);
+    header.myLba = myLba;
+    header.alternateLba = alternateLba;
+    header.firstUsableLba = table.firstUsableLba;
+    header.lastUsableLba = table.lastUsableLba;
+    memcpy(header.diskGuid, table.diskGuid.bytes, 16);
+    header.partitionEntryLba = entryLba;
+    header.numberOfPartitionEntries = GPT_ENTRY_COUNT;
+    header.sizeOfPartitionEntry = sizeof(GptPartitionEntry);
+    header.partitionEntryArrayCrc32 = entriesCrc;
+    header.headerCrc32 = Crc32(&header, sizeof(header));
+    memcpy(sector, &header, sizeof(header));
+}
+
+static bool WriteMbrTable(BlockDevice& device, const PartitionTable& table, std::wstring& error) {
+    uint32_t sectorSize = table.sectorSize;
+    uint32_t gptSectors = 1 + GetGptEntrySectors(sectorSize);
+
+    // LBA 0 plus the area a previous primary GPT occupied, in one write.
+    std::vector<uint8_t> head((size_t)(1 + gptSectors) * sectorSize, 0);
+    MasterBootRecord mbr = {};
+    mbr.diskSignature = table.mbrSignature;
+    mbr.signature = MBR_BOOT_SIGNATURE;
+    for (size_t i = 0; i < table.partitions.size() && i < 4; i++) {
+        const PartitionEntry& entry = table.partitions[i];
+        FillMbrRecord(mbr.partitions[i], entry.mbrType, entry.startLba, entry.sectorCount, entry.bootable);
+    }
+    memcpy(head.data(), &mbr, sizeof(mbr));
+
+    if (!WriteAligned(device, 0, head.data(), head.size())) {
+        error = L"Failed to write the master boot record.";
+        return false;
+    }
+
+    // Clear a stale backup GPT so firmware does not resurrect the old layout.
+    std::vector<uint8_t> tail((size_t)gptSectors * sectorSize, 0);
+    if (table.totalSectors > 2 * (uint64_t)gptSectors + 1 &&
+        !WriteAligned(device, (table.totalSectors - gptSectors) * sectorSize, tail.data(), tail.size())) {
+        error = L"Failed to clear the backup GPT area.";
+        return false;
+    }
+    return true;
+}
+
+bool BuildGptImage(const PartitionTable& table, GptImage& image, std::wstring& error) {
+    uint32_t sectorSize = table.sectorSize;
+    uint32_t entrySectors = GetGptEntrySectors(sectorSize);
+    uint64_t lastLba = table.totalSectors - 1;
+
+    if (table.partitions.size() > GPT_ENTRY_COUNT) {
+        error = L"Too many GPT partitions.";
+        return false;
+    }
+
+    std::vector<uint8_t> entries((size_t)entrySectors * sectorSize, 0);
+    for (size_t i = 0; i < table.partitions.size(); i++) {
+        const PartitionEntry& entry = table.partitions[i];
+        GptPartitionEntry raw = {};
+        memcpy(raw.typeGuid, entry.typeGuid.bytes, 16);
+        memcpy(raw.uniqueGuid, entry.uniqueGuid.bytes, 16);
+        raw.startingLba = entry.startLba;
+        raw.endingLba = entry.startLba + entry.sectorCount - 1;
+        raw.attributes = entry.attributes;
+        for (size_t c = 0; c < entry.name.size() && c < 36; c++) {
+            raw.name[c] = (uint16_t)entry.name[c];
+        }
+        memcpy(entries.data() + i * sizeof(raw), &raw, sizeof(raw));
+    }
+    uint32_t entriesCrc = Crc32(entries.data(), GPT_ENTRY_COUNT * sizeof(GptPartitionEntry));
+
+    // Protective MBR, primary header and primary entries.
+    image.primary.assign((size_t)(2 + entrySectors) * sectorSize, 0);
+    MasterBootRecord mbr = {};
+    mbr.diskSignature = table.mbrSignature;
+    mbr.signature = MBR_BOOT_SIGNATURE;
+    FillMbrRecord(mbr.partitions[0], MBR_TYPE_GPT_PROTECTIVE, 1, table.totalSectors - 1, false);
+    memcpy(image.primary.data(), &mbr, sizeof(mbr));
+    BuildGptHeader(table, 1, lastLba, 2, entriesCrc, image.primary.data() + sectorSize);
+    memcpy(image.primary.data() + 2 * (size_t)sectorSize, entries.data(), entries.size());
+
+    // Backup entries followed by the backup header in the last sector.
+    image.backupLba = lastLba - entrySectors;
+    image.backup.assign((size_t)(entrySectors + 1) * sectorSize, 0);
+    memcpy(image.backup.data(), entries.data(), entries.size());
+    BuildGptHeader(table, lastLba, 1, image.backupLba, entriesCrc, image.backup.data() + entries.size());
+    return true;
+}
+
+static bool WriteGptTable(BlockDevice& device, const PartitionTable& table, std::wstring& error) {
+    GptImage image;
+    if (!BuildGptImage(table, image, error)) {
+        return false;
+    }
+    if (!WriteAligned(device, 0, image.primary.data(), image.primary.size())) {
+        error = L"Failed to write the primary GPT.";
+        return false;
+    }
+    if (!WriteAligned(device, image.backupLba * table.sectorSize, image.backup.data(), image.backup.size())) {
+        error = L"Failed to write the backup GPT.";
+        return false;
+    }
+    return true;
+}
+
+bool WritePartitionTable(BlockDevice& device, const PartitionTable& table, std::wstring& error) {
+    if (table.sectorSize != device.GetGeometry().logicalSectorSize) {
+        error = L"Partition table sector size does not match the device.";
+        return false;
+    }
+
+    bool written = false;
+    if (table.style == PartitionStyle::GPT) {
+        written = WriteGptTable(device, table, error);
+    } else if (table.style == PartitionStyle::MBR) {
+        written = WriteMbrTable(device, table, error);
+    } else {
+        error = L"No partition style selected.";
+    }
+    if (!written) {
+        return false;
+    }
+
+    if (!device.Flush()) {
+        error = L"Failed to flush the partition table to the device.";
+        return false;
+    }
+    device.ReloadPartitionTable();
+    return true;
+}
+
+// ============================================================================
+// EXTENDING
+// ============================================================================
+
+// Stores `header` in its sector with a fresh header CRC.
+static void SealGptHeader(GptHeader header, uint8_t* sector) {
+    header.headerCrc32 = 0;
+    memcpy(sector, &header, sizeof(header));
+    header.headerCrc32 = Crc32(sector, header.headerSize);
+    memcpy(sector, &header, sizeof(header));
+}
+
+static bool IsExtendedMbrType(uint8_t type) {
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+bool ExtendPartitionTable(BlockDevice& device, uint64_t growStartLba, uint64_t* grownSectors, std::wstring& error) {
+    const DeviceGeometry& geometry = device.GetGeometry();
+    uint32_t sectorSize = geometry.logicalSectorSize;
+    uint64_t totalSectors = geometry.sizeBytes / sectorSize;
+    if (grownSectors) *grownSectors = 0;
+
+    std::vector<uint8_t> mbrSector(sectorSize);
+    if (totalSectors < 3 || !device.Read(0, mbrSector.data(), sectorSize)) {
+        error = L"Cannot read the partition table.";
+        return false;
+    }
+    MasterBootRecord mbr;
+    memcpy(&mbr, mbrSector.data(), sizeof(mbr));
+
+    std::vector<uint8_t> headerSector;
+    GptHeader header;
+    std::vector<uint8_t> entries;
+    bool gpt = LoadGpt(device, 1, sectorSize, headerSector, header, entries);
+    bool gptChanged = false;
+    uint64_t grown = 0;
+    uint64_t oldAlternateLba = 0;
+    uint64_t staleHeaderLba = 0;        // the old backup header, when nothing else covers it
+
+    if (gpt) {
+        uint64_t entrySectors = entries.size() / sectorSize;
+        uint64_t backupEntryLba = totalSectors - 1 - entrySectors;
+        if (header.lastUsableLba >= backupEntryLba || header.partitionEntryLba + entrySectors > header.firstUsableLba) {
+            error = L"The GPT describes a disk larger than the drive.";
+            return false;
+        }
+        oldAlternateLba = header.alternateLba;
+        if (header.alternateLba != totalSectors - 1 || header.lastUsableLba != backupEntryLba - 1) {
+            header.alternateLba = totalSectors - 1;
+            header.lastUsableLba = backupEntryLba - 1;
+            gptChanged = true;
+        }
+
+        // The partition to grow must end after every other one.
+        GptPartitionEntry* target = nullptr;
+        bool staleCovered = false;
+        for (uint32_t i = 0; i < header.numberOfPartitionEntries; i++) {
+            GptPartitionEntry* raw = (GptPartitionEntry*)(entries.data() + (size_t)i * header.sizeOfPartitionEntry);
+            Guid type;
+            memcpy(type.bytes, raw->typeGuid, 16);
+            if (type.IsZero()) continue;
+            if (oldAlternateLba >= raw->startingLba && oldAlternateLba <= raw->endingLba) staleCovered = true;
+            if (growStartLba && raw->startingLba == growStartLba) {
+                target = raw;
+            } else if (growStartLba && raw->endingLba >= growStartLba) {
+                error = L"The partition at LBA " + std::to_wstring(growStartLba) + L" is not the last one on the drive.";
+                return false;
+            }
+        }
+        if (growStartLba && !target) {
+            error = L"No partition starts at LBA " + std::to_wstring(growStartLba) + L".";
+            return false;
+        }
+        if (target && target->endingLba < header.lastUsableLba) {
+            target->endingLba = header.lastUsableLba;
+            gptChanged = true;
+        }
+        if (target) grown = target->endingLba - target->startingLba + 1;
+        if (!staleCovered && oldAlternateLba != header.alternateLba && oldAlternateLba > 1 &&
+            oldAlternateLba < backupEntryLba) {
+            staleHeaderLba = oldAlternateLba;
+        }
+
+        if (gptChanged) {
+            header.partitionEntryArrayCrc32 =
+                Crc32(entries.data(), (size_t)header.numberOfPartitionEntries * header.sizeOfPartitionEntry);
+            SealGptHeader(header, headerSector.data());
+
+            // The backup first: until the primary is rewritten, firmware
+            // still finds the old one through the primary's alternate LBA.
+            std::vector<uint8_t> backup(entries);
+            backup.resize(entries.size() + sectorSize, 0);
+            GptHeader backupHeader = header;
+            backupHeader.myLba = totalSectors - 1;
+            backupHeader.alternateLba = 1;
+            backupHeader.partitionEntryLba = backupEntryLba;
+            memcpy(backup.data() + entries.size(), headerSector.data(), sectorSize);
+            SealGptHeader(backupHeader, backup.data() + entries.size());
+            if (!WriteAligned(device, backupEntryLba * sectorSize, backup.data(), backup.size())) {
+                error = L"Failed to write the backup GPT.";
+                return false;
+            }
+            if (!WriteAligned(device, header.partitionEntryLba * sectorSize, entries.data(), entries.size()) ||
+                !WriteAligned(device, sectorSize, headerSector.data(), sectorSize)) {
+                error = L"Failed to write the primary GPT.";
+                return false;
+            }
+            if (staleHeaderLba) {
+                std::vector<uint8_t> zero(sectorSize, 0);
+                if (!WriteAligned(device, staleHeaderLba * sectorSize, zero.data(), zero.size())) {
+                    error = L"Failed to clear the old backup GPT header.";
+                    return false;
+                }
+            }
+        }
+    } else if (mbr.signature != MBR_BOOT_SIGNATURE) {
+        error = L"The drive has no partition table.";
+        return false;
+    }
+
+    // MBR records: a protective one that covered the image is widened, and
+    // the grown partition's own (an MBR disk, or a hybrid MBR mirroring the
+    // GPT) takes as much as MBR addresses.
+    uint64_t mbrLimit = std::min<uint64_t>(totalSectors, 0x100000000ull);
+    bool mbrChanged = false;
+    bool found = false;
+    for (MbrPartitionRecord& record : mbr.partitions) {
+        if (record.type == 0 || record.sectorCount == 0) continue;
+        uint64_t count = record.sectorCount;
+        if (record.type == MBR_TYPE_GPT_PROTECTIVE) {
+            if (!gpt) {
+                error = L"The drive's GPT is damaged.";
+                return false;
+            }
+            if (record.lbaFirst + (uint64_t)record.sectorCount > oldAlternateLba || record.sectorCount == 0xFFFFFFFF) {
+                count = mbrLimit - record.lbaFirst;
+            }
+        } else if (growStartLba && record.lbaFirst == growStartLba) {
+            if (IsExtendedMbrType(record.type)) {
+                error = L"Logical partitions cannot be grown.";
+                return false;
+            }
+            found = true;
+            count = std::max(count, gpt ? std::min(grown, mbrLimit - record.lbaFirst) : mbrLimit - record.lbaFirst);
+            if (!gpt) grown = count;
+        } else if (!gpt && growStartLba && record.lbaFirst + (uint64_t)record.sectorCount > growStartLba) {
+            error = L"The partition at LBA " + std::to_wstring(growStartLba) + L" is not the last one on the drive.";
+            return false;
+        }
+        if (count != record.sectorCount) {
+            FillMbrRecord(record, record.type, record.lbaFirst, count, record.status == 0x80);
+            mbrChanged = true;
+        }
+    }
+    if (!gpt && growStartLba && !found) {
+        error = L"No partition starts at LBA " + std::to_wstring(growStartLba) + L".";
+        return false;
+    }
+    if (mbrChanged) {
+        memcpy(mbrSector.data(), &mbr, sizeof(mbr));
+        if (!WriteAligned(device, 0, mbrSector.data(), sectorSize)) {
+            error = L"Failed to write the master boot record.";
+            return false;
+        }
+    }
+    if (grownSectors) *grownSectors = grown;
+
+    if (gptChanged || mbrChanged) {
+        if (!device.Flush()) {
+            error = L"Failed to flush the partition table to the device.";
+            return false;
+        }
+        device.ReloadPartitionTable();
+        LogEvent(LogLevel::Info, "partition", "extended",
+                 {{"sectors", (int64_t)totalSectors}, {"backup_moved_from", (int64_t)oldAlternateLba},
+                  {"grown_start", (int64_t)growStartLba}, {"grown_sectors", (int64_t)grown}});
+    }
+    return true;
+}
@@ -0,0 +1,109 @@
+// ============================================================================
+// INFERNO - MBR / GPT partition table engine
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class PartitionStyle {
+    Raw,
+    MBR,
+    GPT
+};
+
+// GUID in its on-disk (mixed-endian) byte order.
+struct Guid {
+    uint8_t bytes[16] = {0};
+
+    bool operator==(const Guid& other) const;
+    bool IsZero() const;
+};
+
+Guid GuidFromString(const char* text);
+Guid NewRandomGuid();
+
+// EBD0A0A2-B9E5-4433-87C0-68B6B72699C7
+constexpr Guid GPT_TYPE_BASIC_DATA = {{0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+                                       0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7}};
+// C12A7328-F81F-11D2-BA4B-00A0C93EC93B
+constexpr Guid GPT_TYPE_EFI_SYSTEM = {{0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11,
+                                       0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B}};
+
+struct PartitionEntry {
+    uint64_t startLba = 0;
+    uint64_t sectorCount = 0;
+    bool bootable = false;
+    uint8_t mbrType = 0;        // MBR only
+    Guid typeGuid;              // GPT only
+    Guid uniqueGuid;            // GPT only
+    uint64_t attributes = 0;    // GPT only
+    std::wstring name;          // GPT only
+};
+
+struct PartitionTable {
+    PartitionStyle style = PartitionStyle::Raw;
+    uint32_t sectorSize = 512;
+    uint64_t totalSectors = 0;
+    uint32_t mbrSignature = 0;
+    Guid diskGuid;
+    uint64_t firstUsableLba = 0;
+    uint64_t lastUsableLba = 0;
+    std::vector<PartitionEntry> partitions;
+};
+
+struct PartitionLayoutRequest {
+    PartitionStyle style = PartitionStyle::MBR;
+    std::vector<int> sizesPercent;      // percentage of the usable space, in order
+    uint8_t mbrType = 0x0C;             // FAT32 (LBA)
+    Guid gptType = GPT_TYPE_BASIC_DATA;
+    std::wstring name;                  // GPT partition name, numbered per entry
+    bool markFirstBootable = true;
+};
+
+const wchar_t* PartitionStyleName(PartitionStyle style);
+
+// Partition start alignment in bytes: the least common multiple of the
+// device erase block (when known), the physical sector and 1 MiB.
+uint64_t GetPartitionAlignment(const DeviceGeometry& geometry);
+
+// Parse the table currently on the device. A damaged primary GPT falls back
+// to the backup header at the end of the disk.
+bool ReadPartitionTable(BlockDevice& device, PartitionTable& table);
+
+bool ComputePartitionLayout(const DeviceGeometry& geometry, const PartitionLayoutRequest& request,
+                            PartitionTable& table, std::wstring& error);
+
+// On-disk bytes of a GPT, for callers that place the tables themselves
+// (e.g. inside an image stream). `primary` covers LBA 0 (the protective MBR)
+// through the primary entries; `backup` holds the backup entries followed
+// by the backup header and starts at `backupLba`.
+struct GptImage {
+    std::vector<uint8_t> primary;
+    std::vector<uint8_t> backup;
+    uint64_t backupLba = 0;
+};
+
+bool BuildGptImage(const PartitionTable& table, GptImage& image, std::wstring& error);
+
+// Write the table built by ComputePartitionLayout. GPT writes the protective
+// MBR, primary header and entries as one I/O and the backup entries and
+// header as a second one; stale tables of the other style are cleared. Each
+// write covers whole physical sectors (see WriteAligned), so a 512e drive
+// does not read-modify-write the sectors around the tables.
+bool WritePartitionTable(BlockDevice& device, const PartitionTable& table, std::wstring& error);
+
+// For a drive an image made for a smaller disk was copied to sector by
+// sector. A GPT's backup entries and header move to the last LBAs of the
+// device, the primary's alternate and last usable LBAs follow, and a
+// protective MBR record that covered the image is widened. When
+// `growStartLba` is not 0, the partition starting there, which must end
+// after every other one, is ended at the new last usable LBA (GPT) or as
+// far as MBR addresses; its size in sectors is stored in `grownSectors`.
+// Boot code and all other entries are kept; nothing is written when the
+// table already spans the drive.
+bool ExtendPartitionTable(BlockDevice& device, uint64_t growStartLba, uint64_t* grownSectors, std::wstring& error);
@@ -0,0 +1,482 @@
+// ============================================================================
+// INFERNO - Platform helpers shared by the engine modules
+// ============================================================================
+
+#include "Platform.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cwctype>
+#include <fstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef INFERNO_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// ============================================================================
+// STRING CONVERSION
+// ============================================================================
+
+#ifdef _WIN32
+
+std::string WideToUtf8(const std::wstring& text) {
+    if (text.empty()) return std::string();
+    int length = WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), NULL, 0, NULL, NULL);
+    std::string result(length, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), &result[0], length, NULL, NULL);
+    return result;
+}
+
+std::wstring Utf8ToWide(const std::string& text) {
+    if (text.empty()) return std::wstring();
+    int length = MultiByteToWideChar(CP_UTF8, 0, text.c_str(), (int)text.size(), NULL, 0);
+    std::wstring result(length, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, text.c_str(), (int)text.size(), &result[0], length);
+    return result;
+}
+
+#else
+
+// wchar_t is UTF-32 on every POSIX target we build for.
+std::string WideToUtf8(const std::wstring& text) {
+    std::string result;
+    result.reserve(text.size());
+    for (wchar_t wc : text) {
+        unsigned long cp = (unsigned long)wc;
+        if (cp < 0x80) {
+            result += (char)cp;
+        } else if (cp < 0x800) {
+            result += (char)(0xC0 | (cp >> 6));
+            result += (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            result += (char)(0xE0 | (cp >> 12));
+            result += (char)(0x80 | ((cp >> 6) & 0x3F));
+            result += (char)(0x80 | (cp & 0x3F));
+        } else {
+            result += (char)(0xF0 | (cp >> 18));
+            result += (char)(0x80 | ((cp >> 12) & 0x3F));
+            result += (char)(0x80 | ((cp >> 6) & 0x3F));
+            result += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+    return result;
+}
+
+std::wstring Utf8ToWide(const std::string& text) {
+    std::wstring result;
+    result.reserve(text.size());
+    size_t i = 0;
+    while (i < text.size()) {
+        unsigned char c = (unsigned char)text[i];
+        unsigned long cp;
+        size_t extra;
+        if (c < 0x80) { cp = c; extra = 0; }
+        else if ((c & 0xE0) == 0xC0) { cp = c & 0x1F; extra = 1; }
+        else if ((c & 0xF0) == 0xE0) { cp = c & 0x0F; extra = 2; }
+        else { cp = c & 0x07; extra = 3; }
+        i++;
+        for (size_t k = 0; k < extra && i < text.size(); k++, i++) {
+            cp = (cp << 6) | ((unsigned char)text[i] & 0x3F);
+        }
+        result += (wchar_t)cp;
+    }
+    return result;
+}
+
+#endif
+
+// ============================================================================
+// PERSISTENT STORAGE
+// ============================================================================
+
+#ifdef _WIN32
+
+std::wstring GetInfernoDataDirectory() {
+    wchar_t base[MAX_PATH];
+    DWORD length = GetEnvironmentVariableW(L"LOCALAPPDATA", base, MAX_PATH);
+    std::wstring directory = (length > 0 && length < MAX_PATH) ? std::wstring(base) : std::wstring(L".");
+    directory += L"\\Inferno";
+    CreateDirectoryW(directory.c_str(), NULL);
+    return directory;
+}
+
+bool WriteFileAtomically(const std::wstring& path, const std::string& contents) {
+    std::wstring temporary = path + L".tmp" + std::to_wstring(GetCurrentProcessId());
+    {
+        std::ofstream file(temporary.c_str(), std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) return false;
+        file.write(contents.data(), (std::streamsize)contents.size());
+        if (!file.good()) return false;
+    }
+    if (!MoveFileExW(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        DeleteFileW(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+#else
+
+std::wstring GetInfernoDataDirectory() {
+    std::string directory;
+    if (const char* cache = getenv("XDG_CACHE_HOME")) {
+        directory = cache;
+    } else if (const char* home = getenv("HOME")) {
+        directory = std::string(home) + "/.cache";
+    } else {
+        directory = ".";
+    }
+    mkdir(directory.c_str(), 0755);
+    directory += "/inferno";
+    mkdir(directory.c_str(), 0755);
+    return Utf8ToWide(directory);
+}
+
+bool WriteFileAtomically(const std::wstring& path, const std::string& contents) {
+    std::string target = WideToUtf8(path);
+    std::string temporary = target + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) return false;
+        file.write(contents.data(), (std::streamsize)contents.size());
+        if (!file.good()) return false;
+    }
+    if (rename(temporary.c_str(), target.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
+
+// ============================================================================
+// FILES
+// ============================================================================
+
+static bool HasExtension(const std::wstring& name, const std::wstring& extension) {
+    if (extension.empty()) return true;
+    if (name.size() < extension.size()) return false;
+    return std::equal(extension.begin(), extension.end(), name.end() - extension.size(),
+                      [](wchar_t a, wchar_t b) { return towlower(a) == towlower(b); });
+}
+
+MappedFile::~MappedFile() {
+    Close();
+}
+
+#ifdef _WIN32
+
+bool ReadWholeFile(const std::wstring& path, std::string& contents) {
+    FILE* file = _wfopen(path.c_str(), L"rb");
+    if (!file) return false;
+    contents.clear();
+    char buffer[64 * 1024];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        contents.append(buffer, got);
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+// FILETIME counts 100 ns intervals since 1601.
+static int64_t FileTimeToUnixNanoseconds(const FILETIME& time) {
+    int64_t ticks = ((int64_t)time.dwHighDateTime << 32) | time.dwLowDateTime;
+    return (ticks - 116444736000000000LL) * 100;
+}
+
+static void ListFilesIn(const std::wstring& directory, const std::wstring& extension, std::vector<FileInfo>& files) {
+    WIN32_FIND_DATAW entry;
+    HANDLE find = FindFirstFileExW((directory + L"\\*").c_str(), FindExInfoBasic, &entry, FindExSearchNameMatch,
+                                   NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (find == INVALID_HANDLE_VALUE) return;
+    do {
+        std::wstring name = entry.cFileName;
+        if (name == L"." || name == L"..") continue;
+        std::wstring path = directory + L"\\" + name;
+        if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+                ListFilesIn(path, extension, files);
+            }
+        } else if (HasExtension(name, extension)) {
+            FileInfo info;
+            info.path = path;
+            info.size = ((uint64_t)entry.nFileSizeHigh << 32) | entry.nFileSizeLow;
+            info.modifiedTime = FileTimeToUnixNanoseconds(entry.ftLastWriteTime);
+            files.push_back(info);
+        }
+    } while (FindNextFileW(find, &entry));
+    FindClose(find);
+}
+
+bool ListFiles(const std::wstring& directory, const std::wstring& extension, std::vector<FileInfo>& files,
+               std::wstring& error) {
+    DWORD attributes = GetFileAttributesW(directory.c_str());
+    if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        error = L"Cannot open folder " + directory + L".";
+        return false;
+    }
+    ListFilesIn(directory, extension, files);
+    return true;
+}
+
+bool GetFileIdentity(const std::wstring& path, FileIdentity& identity) {
+    HANDLE file = CreateFileW(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    BY_HANDLE_FILE_INFORMATION info;
+    BOOL ok = GetFileInformationByHandle(file, &info);
+    CloseHandle(file);
+    if (!ok) return false;
+    identity.size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    identity.modifiedTime = FileTimeToUnixNanoseconds(info.ftLastWriteTime);
+    identity.volumeId = info.dwVolumeSerialNumber;
+    identity.fileId = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    return true;
+}
+
+bool MappedFile::Open(const std::wstring& path) {
+    Close();
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    // The view keeps the mapping, and the mapping the file, open.
+    CloseHandle(file);
+    if (!mapping) return false;
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) return false;
+    m_data = (const uint8_t*)view;
+    m_size = (uint64_t)size.QuadPart;
+    return true;
+}
+
+void MappedFile::Close() {
+    if (m_data) UnmapViewOfFile(m_data);
+    m_data = nullptr;
+    m_size = 0;
+}
+
+ScopedFileLock::ScopedFileLock(const std::wstring& path) {
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return;
+    OVERLAPPED whole = {};
+    if (!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &whole)) {
+        CloseHandle(file);
+        return;
+    }
+    m_handle = (intptr_t)file;
+}
+
+ScopedFileLock::~ScopedFileLock() {
+    if (m_handle == -1) return;
+    OVERLAPPED whole = {};
+    UnlockFileEx((HANDLE)m_handle, 0, MAXDWORD, MAXDWORD, &whole);
+    CloseHandle((HANDLE)m_handle);
+}
+
+#else
+
+bool ReadWholeFile(const std::wstring& path, std::string& contents) {
+    std::ifstream file(WideToUtf8(path), std::ios::binary);
+    if (!file) return false;
+    contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+static void ListFilesIn(const std::string& directory, const std::wstring& extension, std::vector<FileInfo>& files) {
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) return;
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        std::string path = directory + "/" + name;
+        struct stat info;
+        if (lstat(path.c_str(), &info) != 0) continue;
+        if (S_ISDIR(info.st_mode)) {
+            ListFilesIn(path, extension, files);
+            continue;
+        }
+        if (S_ISLNK(info.st_mode) && (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))) continue;
+        if (!S_ISREG(info.st_mode)) continue;
+        std::wstring wideName = Utf8ToWide(name);
+        if (!HasExtension(wideName, extension)) continue;
+        FileInfo file;
+        file.path = Utf8ToWide(path);
+        file.size = (uint64_t)info.st_size;
+        file.modifiedTime = (int64_t)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+        files.push_back(file);
+    }
+    closedir(dir);
+}
+
+bool ListFiles(const std::wstring& directory, const std::wstring& extension, std::vector<FileInfo>& files,
+               std::wstring& error) {
+    std::string root = WideToUtf8(directory);
+    struct stat info;
+    if (stat(root.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+        error = L"Cannot open folder " + directory + L".";
+        return false;
+    }
+    while (root.size() > 1 && root.back() == '/') root.pop_back();
+    ListFilesIn(root, extension, files);
+    return true;
+}
+
+bool GetFileIdentity(const std::wstring& path, FileIdentity& identity) {
+    struct stat info;
+    if (stat(WideToUtf8(path).c_str(), &info) != 0) return false;
+    identity.size = (uint64_t)info.st_size;
+    identity.modifiedTime = (int64_t)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+    identity.volumeId = (uint64_t)info.st_dev;
+    identity.fileId = (uint64_t)info.st_ino;
+    return true;
+}
+
+bool MappedFile::Open(const std::wstring& path) {
+    Close();
+    int fd = open(WideToUtf8(path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat info;
+    void* view = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (view == MAP_FAILED) return false;
+    m_data = (const uint8_t*)view;
+    m_size = (uint64_t)info.st_size;
+    return true;
+}
+
+void MappedFile::Close() {
+    if (m_data) munmap((void*)m_data, (size_t)m_size);
+    m_data = nullptr;
+    m_size = 0;
+}
+
+ScopedFileLock::ScopedFileLock(const std::wstring& path) {
+    int fd = open(WideToUtf8(path).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return;
+        }
+    }
+    m_handle = fd;
+}
+
+ScopedFileLock::~ScopedFileLock() {
+    if (m_handle == -1) return;
+    flock((int)m_handle, LOCK_UN);
+    close((int)m_handle);
+}
+
+#endif
+
+// ============================================================================
+// MEMORY
+// ============================================================================
+
+#ifdef _WIN32
+
+uint64_t GetPhysicalMemorySize() {
+    MEMORYSTATUSEX status = {};
+    status.dwLength = sizeof(status);
+    return GlobalMemoryStatusEx(&status) ? status.ullTotalPhys : 0;
+}
+
+#else
+
+uint64_t GetPhysicalMemorySize() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    return (pages > 0 && pageSize > 0) ? (uint64_t)pages * (uint64_t)pageSize : 0;
+}
+
+#endif
+
+// ============================================================================
+// CPU FEATURES
+// ============================================================================
+
+#ifdef INFERNO_X86
+
+static void Cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, (int)leaf, (int)subleaf);
+    for (int i = 0; i < 4; i++) regs[i] = (uint32_t)info[i];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t ReadXcr0() {
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t low, high;
+    __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return ((uint64_t)high << 32) | low;
+#endif
+}
+
+static CpuFeatures DetectCpuFeatures() {
+    CpuFeatures features;
+    uint32_t basic[4];
+    Cpuid(0, 0, basic);
+    uint32_t leaf1[4];
+    Cpuid(1, 0, leaf1);
+    features.ssse3 = (leaf1[2] & (1u << 9)) != 0;
+    features.aesni = (leaf1[2] & (1u << 25)) != 0;
+
+    // AVX registers are only usable when the OS saves them on context switch.
+    bool osSavesAvx = (leaf1[2] & (1u << 27)) && (leaf1[2] & (1u << 28)) && (ReadXcr0() & 0x6) == 0x6;
+    if (osSavesAvx && basic[0] >= 7) {
+        uint32_t leaf7[4];
+        Cpuid(7, 0, leaf7);
+        features.avx2 = (leaf7[1] & (1u << 5)) != 0;
+        features.vaes = features.avx2 && features.aesni && (leaf7[2] & (1u << 9)) != 0;
+    }
+    return features;
+}
+
+#else
+
+static CpuFeatures DetectCpuFeatures() {
+    return CpuFeatures();
+}
+
+#endif
+
+const CpuFeatures& GetCpuFeatures() {
+    static const CpuFeatures features = DetectCpuFeatures();
+    return features;
+}
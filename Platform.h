@@ -0,0 +1,111 @@
+// ============================================================================
+// INFERNO - Platform helpers shared by the engine modules
+// ============================================================================
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define INFERNO_X86 1
+#endif
+
+// Lets one translation unit carry code for instruction sets beyond the
+// build's baseline; callers check GetCpuFeatures() before using it.
+#if defined(__GNUC__)
+#define INFERNO_TARGET(features) __attribute__((target(features)))
+#else
+#define INFERNO_TARGET(features)
+#endif
+
+// UTF-8 <-> wide conversion. Paths and messages are std::wstring throughout
+// Inferno; POSIX system calls need UTF-8.
+std::string WideToUtf8(const std::wstring& text);
+std::wstring Utf8ToWide(const std::string& text);
+
+// Per-user directory for Inferno's persistent caches and databases
+// (%LOCALAPPDATA%\Inferno, $XDG_CACHE_HOME/inferno). Created on first use.
+std::wstring GetInfernoDataDirectory();
+
+// Replace `path` with `contents` so concurrent readers never observe a
+// partially written file.
+bool WriteFileAtomically(const std::wstring& path, const std::string& contents);
+
+bool ReadWholeFile(const std::wstring& path, std::string& contents);
+
+struct FileInfo {
+    std::wstring path;
+    uint64_t size = 0;
+    int64_t modifiedTime = 0;   // nanoseconds since the Unix epoch
+};
+
+// Regular files anywhere below `directory` whose names end in `extension`
+// (case-insensitive, e.g. L".inf"; empty for every file). Symbolic links to
+// directories are not followed.
+bool ListFiles(const std::wstring& directory, const std::wstring& extension, std::vector<FileInfo>& files,
+               std::wstring& error);
+
+// What identifies one version of a file: a file replaced under the same name
+// gets a new file ID, and one rewritten in place a new size or time.
+struct FileIdentity {
+    uint64_t size = 0;
+    int64_t modifiedTime = 0;   // nanoseconds since the Unix epoch
+    uint64_t volumeId = 0;      // volume serial number or st_dev
+    uint64_t fileId = 0;        // NTFS file index or inode number
+};
+
+bool GetFileIdentity(const std::wstring& path, FileIdentity& identity);
+
+// A read-only view of a whole file through the page cache: opening it reads
+// nothing, and pages come in as they are touched. On Windows the view keeps
+// the file from being replaced, so close it before WriteFileAtomically.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // False when the file is missing or empty; the view is then empty.
+    bool Open(const std::wstring& path);
+    void Close();
+
+    const uint8_t* GetData() const { return m_data; }
+    uint64_t GetSize() const { return m_size; }
+
+private:
+    const uint8_t* m_data = nullptr;
+    uint64_t m_size = 0;
+};
+
+// An exclusive lock shared between processes, on a lock file created next to
+// the data it protects. Blocks until the lock is granted; IsLocked() is
+// false only when the lock file could not be opened.
+class ScopedFileLock {
+public:
+    explicit ScopedFileLock(const std::wstring& path);
+    ~ScopedFileLock();
+    ScopedFileLock(const ScopedFileLock&) = delete;
+    ScopedFileLock& operator=(const ScopedFileLock&) = delete;
+
+    bool IsLocked() const { return m_handle != -1; }
+
+private:
+    intptr_t m_handle = -1;
+};
+
+// Installed RAM in bytes, or 0 when it cannot be determined.
+uint64_t GetPhysicalMemorySize();
+
+// Instruction set extensions the engine dispatches on at runtime. All false
+// on non-x86 builds.
+struct CpuFeatures {
+    bool ssse3 = false;
+    bool avx2 = false;          // including OS support for the AVX state
+    bool aesni = false;
+    bool vaes = false;          // 256-bit VAES
+};
+
+const CpuFeatures& GetCpuFeatures();
@@ -0,0 +1,492 @@
+// ============================================================================
+// INFERNO - Streaming signature scanner
+// ============================================================================
+
+#include "SignatureScanner.h"
+#include "BufferArena.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <utility>
+
+#ifdef INFERNO_X86
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+const size_t SignatureDatabase::MIN_PATTERN;
+const size_t SignatureDatabase::MAX_PATTERN;
+const size_t SignatureScanner::MAX_RECORDED_MATCHES;
+
+// Longest signature prefix in the automaton. Longer prefixes mean fewer
+// candidates to confirm but more states; large databases fall back to
+// shorter ones to stay within MAX_DFA_BYTES.
+static const size_t MAX_PREFIX = 8;
+static const size_t MAX_DFA_BYTES = 64 * 1024 * 1024;
+static const uint32_t OUTPUT_FLAG = 0x80000000u;
+
+// ============================================================================
+// SIGNATURE DATABASE
+// ============================================================================
+
+std::wstring SignatureDatabase::DefaultPath() {
+#ifdef _WIN32
+    return GetInfernoDataDirectory() + L"\\signatures.ndb";
+#else
+    return GetInfernoDataDirectory() + L"/signatures.ndb";
+#endif
+}
+
+static int HexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool ParseHexPattern(const std::string& hex, std::vector<uint8_t>& pattern) {
+    if (hex.size() % 2 != 0) return false;
+    pattern.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int high = HexDigit(hex[i]);
+        int low = HexDigit(hex[i + 1]);
+        if (high < 0 || low < 0) return false;
+        pattern.push_back((uint8_t)(high << 4 | low));
+    }
+    return true;
+}
+
+bool SignatureDatabase::Load(const std::wstring& path, std::wstring& error) {
+    std::ifstream file(WideToUtf8(path));
+    if (!file) {
+        error = L"Cannot open signature database " + path + L".";
+        return false;
+    }
+
+    std::string line;
+    std::vector<uint8_t> pattern;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+
+        std::vector<std::string> fields;
+        size_t start = 0;
+        for (;;) {
+            size_t colon = line.find(':', start);
+            fields.push_back(line.substr(start, colon == std::string::npos ? std::string::npos : colon - start));
+            if (colon == std::string::npos) break;
+            start = colon + 1;
+        }
+        if (fields.size() < 4 || fields[2] != "*" || !ParseHexPattern(fields[3], pattern) ||
+            !Add(fields[0], pattern)) {
+            m_skipped++;
+        }
+    }
+    return true;
+}
+
+bool SignatureDatabase::Add(const std::string& name, const std::vector<uint8_t>& pattern) {
+    if (pattern.size() < MIN_PATTERN || pattern.size() > MAX_PATTERN) {
+        return false;
+    }
+    m_signatures.push_back(Signature{name, pattern});
+    return true;
+}
+
+// ============================================================================
+// AUTOMATON
+// ============================================================================
+
+struct TrieNode {
+    std::vector<std::pair<uint8_t, uint32_t>> children;
+    std::vector<uint32_t> outputs;     // signatures whose prefix ends here
+};
+
+static uint32_t FindChild(const TrieNode& node, uint8_t byte) {
+    for (const auto& child : node.children) {
+        if (child.first == byte) return child.second;
+    }
+    return 0;
+}
+
+static std::vector<TrieNode> BuildPrefixTrie(const std::vector<Signature>& signatures, size_t prefixLength) {
+    std::vector<TrieNode> nodes(1);
+    for (uint32_t index = 0; index < signatures.size(); index++) {
+        const std::vector<uint8_t>& pattern = signatures[index].pattern;
+        size_t depth = std::min(prefixLength, pattern.size());
+        uint32_t node = 0;
+        for (size_t i = 0; i < depth; i++) {
+            uint32_t child = FindChild(nodes[node], pattern[i]);
+            if (child == 0) {
+                child = (uint32_t)nodes.size();
+                nodes[node].children.emplace_back(pattern[i], child);
+                nodes.emplace_back();
+            }
+            node = child;
+        }
+        nodes[node].outputs.push_back(index);
+    }
+    return nodes;
+}
+
+bool SignatureScanner::Build(const SignatureDatabase& database, std::wstring& error) {
+    m_signatures = database.GetSignatures();
+    if (m_signatures.empty()) {
+        error = L"The signature database contains no usable signatures.";
+        return false;
+    }
+    m_maxLength = 0;
+    for (const Signature& signature : m_signatures) {
+        m_maxLength = std::max(m_maxLength, signature.pattern.size());
+    }
+
+    // Every byte on a trie edge leads somewhere different from every other
+    // byte, so it needs its own class; all remaining bytes share one.
+    std::vector<TrieNode> nodes;
+    for (m_prefixLength = MAX_PREFIX;; m_prefixLength--) {
+        nodes = BuildPrefixTrie(m_signatures, m_prefixLength);
+        bool used[256] = {};
+        for (const TrieNode& node : nodes) {
+            for (const auto& child : node.children) used[child.first] = true;
+        }
+        m_classCount = std::count(used, used + 256, false) > 0 ? 1 : 0;
+        for (int b = 0; b < 256; b++) {
+            m_byteClass[b] = used[b] ? (uint8_t)m_classCount++ : 0;
+        }
+        if ((uint64_t)nodes.size() * m_classCount * sizeof(uint32_t) <= MAX_DFA_BYTES) break;
+        if (m_prefixLength == SignatureDatabase::MIN_PATTERN) {
+            error = L"The signature database is too large to compile.";
+            return false;
+        }
+    }
+
+    // Breadth-first, so a state's failure state is complete before its row
+    // is derived from it.
+    size_t stateCount = nodes.size();
+    std::vector<uint32_t> rows(stateCount * m_classCount, 0);
+    std::vector<uint32_t> failure(stateCount, 0);
+    std::vector<std::vector<uint32_t>> outputs(stateCount);
+    std::vector<uint32_t> queue;
+    queue.reserve(stateCount);
+    queue.push_back(0);
+    for (size_t head = 0; head < queue.size(); head++) {
+        uint32_t state = queue[head];
+        uint32_t* row = &rows[(size_t)state * m_classCount];
+        if (state != 0) {
+            const uint32_t* fallback = &rows[(size_t)failure[state] * m_classCount];
+            memcpy(row, fallback, m_classCount * sizeof(uint32_t));
+        }
+        for (const auto& child : nodes[state].children) {
+            uint32_t next = child.second;
+            failure[next] = state == 0 ? 0 : rows[(size_t)failure[state] * m_classCount + m_byteClass[child.first]];
+            row[m_byteClass[child.first]] = next;
+            queue.push_back(next);
+        }
+        outputs[state] = nodes[state].outputs;
+        if (state != 0) {
+            const std::vector<uint32_t>& inherited = outputs[failure[state]];
+            outputs[state].insert(outputs[state].end(), inherited.begin(), inherited.end());
+        }
+    }
+
+    // Renumber in breadth-first order: the root is 0 and its children come
+    // next, so "at most one byte deep" is a single comparison while scanning.
+    std::vector<uint32_t> rank(stateCount);
+    for (uint32_t i = 0; i < stateCount; i++) rank[queue[i]] = i;
+    m_transitions.resize(rows.size());
+    m_outputBegin.assign(stateCount + 1, 0);
+    m_outputs.clear();
+    for (uint32_t i = 0; i < stateCount; i++) {
+        uint32_t state = queue[i];
+        for (uint32_t c = 0; c < m_classCount; c++) {
+            uint32_t next = rows[(size_t)state * m_classCount + c];
+            m_transitions[(size_t)i * m_classCount + c] =
+                rank[next] * m_classCount | (outputs[next].empty() ? 0 : OUTPUT_FLAG);
+        }
+        m_outputBegin[i] = (uint32_t)m_outputs.size();
+        m_outputs.insert(m_outputs.end(), outputs[state].begin(), outputs[state].end());
+    }
+    m_outputBegin[stateCount] = (uint32_t)m_outputs.size();
+    m_shallowLimit = (uint32_t)nodes[0].children.size() * m_classCount;
+
+    memset(m_startPairs, 0, sizeof(m_startPairs));
+    for (const Signature& signature : m_signatures) {
+        uint32_t pair = signature.pattern[0] | (uint32_t)signature.pattern[1] << 8;
+        m_startPairs[pair >> 6] |= 1ull << (pair & 63);
+    }
+
+    memset(m_startLow, 0, sizeof(m_startLow));
+    memset(m_startHigh, 0, sizeof(m_startHigh));
+    size_t startBytes = 0;
+    for (int b = 0; b < 256; b++) {
+        m_startByte[b] = rows[m_byteClass[b]] != 0;
+        if (!m_startByte[b]) continue;
+        startBytes++;
+        if (b < 0x80) {
+            m_startLow[b & 0x0F] |= (uint8_t)(1 << (b >> 4));
+        } else {
+            m_startHigh[b & 0x0F] |= (uint8_t)(1 << ((b >> 4) - 8));
+        }
+    }
+    // Once most bytes can start a signature the vector test rarely skips
+    // anything and only adds overhead.
+    m_vectorPrefilter = startBytes <= 64;
+    return true;
+}
+
+// ============================================================================
+// PREFILTER
+// ============================================================================
+
+static inline unsigned CountTrailingZeros(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+#ifdef INFERNO_X86
+
+// Exact membership in a 256-bit byte set: the low nibble selects a row of
+// high-nibble bits, split into two tables for high nibbles 0-7 and 8-15.
+// Returns the first member at or after `position`, or where the vector part
+// stopped so the caller can finish the tail.
+INFERNO_TARGET("ssse3")
+static size_t FindSetByteSsse3(const uint8_t* data, size_t position, size_t length,
+                               const uint8_t* lowTable, const uint8_t* highTable) {
+    const __m128i low = _mm_load_si128((const __m128i*)lowTable);
+    const __m128i high = _mm_load_si128((const __m128i*)highTable);
+    const __m128i lowBits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i highBits = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_setzero_si128();
+    for (; position + 16 <= length; position += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(data + position));
+        __m128i lo = _mm_and_si128(bytes, nibble);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+        __m128i hits = _mm_or_si128(_mm_and_si128(_mm_shuffle_epi8(low, lo), _mm_shuffle_epi8(lowBits, hi)),
+                                    _mm_and_si128(_mm_shuffle_epi8(high, lo), _mm_shuffle_epi8(highBits, hi)));
+        uint32_t mask = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hits, zero)) & 0xFFFFu;
+        if (mask) return position + CountTrailingZeros(mask);
+    }
+    return position;
+}
+
+INFERNO_TARGET("avx2")
+static size_t FindSetByteAvx2(const uint8_t* data, size_t position, size_t length,
+                              const uint8_t* lowTable, const uint8_t* highTable) {
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)lowTable));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)highTable));
+    const __m256i lowBits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i highBits = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32, 64, -128,
+                                              0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; position + 32 <= length; position += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + position));
+        __m256i lo = _mm256_and_si256(bytes, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+        __m256i hits = _mm256_or_si256(
+            _mm256_and_si256(_mm256_shuffle_epi8(low, lo), _mm256_shuffle_epi8(lowBits, hi)),
+            _mm256_and_si256(_mm256_shuffle_epi8(high, lo), _mm256_shuffle_epi8(highBits, hi)));
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hits, zero));
+        if (mask) return position + CountTrailingZeros(mask);
+    }
+    return position;
+}
+
+#endif
+
+static inline bool TestPair(const uint64_t* pairs, uint8_t first, uint8_t second) {
+    uint32_t pair = first | (uint32_t)second << 8;
+    return (pairs[pair >> 6] >> (pair & 63)) & 1;
+}
+
+// First position at or after `position` whose byte, and the one after it,
+// can begin a signature; `length` if there is none.
+size_t SignatureScanner::SkipToCandidate(const uint8_t* data, size_t position, size_t length) const {
+    while (position + 1 < length) {
+#ifdef INFERNO_X86
+        if (m_vectorPrefilter) {
+            const CpuFeatures& cpu = GetCpuFeatures();
+            if (cpu.avx2) {
+                position = FindSetByteAvx2(data, position, length - 1, m_startLow, m_startHigh);
+            } else if (cpu.ssse3) {
+                position = FindSetByteSsse3(data, position, length - 1, m_startLow, m_startHigh);
+            }
+        }
+#endif
+        while (position + 1 < length && !TestPair(m_startPairs, data[position], data[position + 1])) {
+            position++;
+            if (m_vectorPrefilter && !m_startByte[data[position]]) break;
+        }
+        if (position + 1 >= length) break;
+        if (TestPair(m_startPairs, data[position], data[position + 1])) return position;
+    }
+    return position < length && m_startByte[data[position]] ? position : length;
+}
+
+// ============================================================================
+// SCANNING
+// ============================================================================
+
+// Reports every signature that lies entirely inside `data`.
+template <typename OnMatch>
+void SignatureScanner::Scan(const uint8_t* data, size_t length, OnMatch onMatch) const {
+    const uint32_t* transitions = m_transitions.data();
+    uint32_t state = 0;
+    for (size_t i = 0; i < length; i++) {
+        // Within one byte of the root the automaton remembers nothing the
+        // pair filter does not, so jump to the next plausible start and take
+        // its first byte from the root.
+        if (state <= m_shallowLimit) {
+            i = SkipToCandidate(data, state == 0 ? i : i - 1, length);
+            if (i == length) break;
+            state = transitions[m_byteClass[data[i]]];
+            if (++i == length) break;
+        }
+        uint32_t next = transitions[state + m_byteClass[data[i]]];
+        state = next & ~OUTPUT_FLAG;
+        if (!(next & OUTPUT_FLAG)) continue;
+
+        uint32_t node = state / m_classCount;
+        for (uint32_t k = m_outputBegin[node]; k < m_outputBegin[node + 1]; k++) {
+            uint32_t index = m_outputs[k];
+            const std::vector<uint8_t>& pattern = m_signatures[index].pattern;
+            size_t prefix = std::min(m_prefixLength, pattern.size());
+            size_t start = i + 1 - prefix;
+            if (start + pattern.size() <= length &&
+                memcmp(data + i + 1, pattern.data() + prefix, pattern.size() - prefix) == 0) {
+                onMatch(start, index);
+            }
+        }
+    }
+}
+
+void SignatureScanner::ScanSeam(uint64_t boundary, const SeamEdges& edges, std::vector<SignatureMatch>& found) const {
+    std::vector<uint8_t> seam(edges.before);
+    seam.insert(seam.end(), edges.after.begin(), edges.after.end());
+    size_t split = edges.before.size();
+    Scan(seam.data(), seam.size(), [&](size_t start, uint32_t index) {
+        if (start < split && start + m_signatures[index].pattern.size() > split) {
+            found.push_back(SignatureMatch{boundary - split + start, index});
+        }
+    });
+}
+
+void SignatureScanner::ScanChunk(uint64_t offset, const uint8_t* data, size_t length) {
+    if (m_transitions.empty() || length == 0) {
+        return;
+    }
+
+    std::vector<SignatureMatch> found;
+    Scan(data, length, [&](size_t start, uint32_t index) {
+        found.push_back(SignatureMatch{offset + start, index});
+    });
+
+    // A signature crossing a boundary lies within m_maxLength - 1 bytes of
+    // it on both sides. Whichever chunk reaches a boundary second scans it.
+    size_t edge = std::min(m_maxLength - 1, length);
+    std::vector<std::pair<uint64_t, SeamEdges>> ready;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (offset > 0) {
+            SeamEdges& seam = m_seams[offset];
+            seam.after.assign(data, data + edge);
+            seam.haveAfter = true;
+            if (seam.haveBefore) {
+                ready.emplace_back(offset, std::move(seam));
+                m_seams.erase(offset);
+            }
+        }
+        uint64_t end = offset + length;
+        SeamEdges& seam = m_seams[end];
+        seam.before.assign(data + length - edge, data + length);
+        seam.haveBefore = true;
+        if (seam.haveAfter) {
+            ready.emplace_back(end, std::move(seam));
+            m_seams.erase(end);
+        }
+    }
+    for (const auto& seam : ready) {
+        ScanSeam(seam.first, seam.second, found);
+    }
+
+    m_bytesScanned += length;
+    if (!found.empty()) {
+        Record(found);
+    }
+}
+
+void SignatureScanner::Record(const std::vector<SignatureMatch>& found) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_matchCount += found.size();
+    for (const SignatureMatch& match : found) {
+        if (m_matches.size() >= MAX_RECORDED_MATCHES) break;
+        m_matches.push_back(match);
+    }
+}
+
+ChunkTransform SignatureScanner::AsTap() {
+    return [this](uint64_t offset, uint8_t* data, size_t length) {
+        ScanChunk(offset, data, length);
+    };
+}
+
+std::vector<SignatureMatch> SignatureScanner::GetMatches() const {
+    std::vector<SignatureMatch> matches;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        matches = m_matches;
+    }
+    std::sort(matches.begin(), matches.end(), [](const SignatureMatch& a, const SignatureMatch& b) {
+        return a.offset != b.offset ? a.offset < b.offset : a.signature < b.signature;
+    });
+    return matches;
+}
+
+// ============================================================================
+// IMAGE FILES
+// ============================================================================
+
+bool ScanImage(const std::wstring& imagePath, SignatureScanner& scanner, const ProgressCallback& progress,
+               std::wstring& error) {
+    std::unique_ptr<ImageSource> image = OpenImageSource(imagePath, error);
+    if (!image) {
+        return false;
+    }
+
+    uint64_t size = image->GetSize();
+    uint64_t total = (size == IMAGE_SIZE_UNKNOWN) ? 0 : size;
+    ArenaBuffer buffer = BufferArena::Default().Acquire(4 * 1024 * 1024);
+    if (!buffer) {
+        error = L"Not enough buffer memory.";
+        return false;
+    }
+    uint64_t offset = 0;
+    for (;;) {
+        int64_t got = image->Read(offset, buffer.Data(), buffer.Size());
+        if (got < 0) {
+            error = L"Read failed at source offset " + std::to_wstring(offset) + L".";
+            return false;
+        }
+        if (got == 0) break;
+        scanner.ScanChunk(offset, buffer.Data(), (size_t)got);
+        offset += (uint64_t)got;
+        if (progress && !progress(offset, total)) {
+            error = L"Operation cancelled.";
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,126 @@
+// ============================================================================
+// INFERNO - Streaming signature scanner
+// ============================================================================
+
+#pragma once
+
+#include "ImageWriter.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct Signature {
+    std::string name;
+    std::vector<uint8_t> pattern;
+};
+
+// Byte signatures in ClamAV's extended (.ndb) format, one per line:
+// Name:TargetType:Offset:HexSignature. Only fixed hex bodies that may occur
+// at any offset ("*") are used; signatures with wildcards, alternatives or
+// anchored offsets are counted as skipped.
+class SignatureDatabase {
+public:
+    static const size_t MIN_PATTERN = 4;
+    static const size_t MAX_PATTERN = 512;
+
+    // signatures.ndb in the Inferno data directory.
+    static std::wstring DefaultPath();
+
+    bool Load(const std::wstring& path, std::wstring& error);
+    bool Add(const std::string& name, const std::vector<uint8_t>& pattern);
+
+    const std::vector<Signature>& GetSignatures() const { return m_signatures; }
+    size_t GetSkippedCount() const { return m_skipped; }
+
+private:
+    std::vector<Signature> m_signatures;
+    size_t m_skipped = 0;
+};
+
+struct SignatureMatch {
+    uint64_t offset = 0;        // stream offset of the first matched byte
+    uint32_t signature = 0;     // index into GetSignatures()
+};
+
+// Multi-pattern matcher over a whole database: an Aho-Corasick automaton on
+// signature prefixes, compiled to a dense DFA over byte classes. Whenever
+// the automaton is back near its root, a SIMD first-byte test and a bitmap
+// of two-byte prefixes skip ahead to the next place a signature could
+// start. Candidates are confirmed against the full signature.
+//
+// Chunks may be scanned from several threads and in any order. The edges of
+// each chunk are kept until its neighbour arrives, so signatures spanning a
+// chunk boundary are still found exactly once.
+class SignatureScanner {
+public:
+    static const size_t MAX_RECORDED_MATCHES = 1000;
+
+    SignatureScanner() = default;
+    SignatureScanner(const SignatureScanner&) = delete;
+    SignatureScanner& operator=(const SignatureScanner&) = delete;
+
+    bool Build(const SignatureDatabase& database, std::wstring& error);
+
+    void ScanChunk(uint64_t offset, const uint8_t* data, size_t length);
+
+    // A write pipeline tap that scans every chunk on its way to the device.
+    ChunkTransform AsTap();
+
+    // Sorted by offset; at most MAX_RECORDED_MATCHES of GetMatchCount().
+    std::vector<SignatureMatch> GetMatches() const;
+    uint64_t GetMatchCount() const { return m_matchCount; }
+    uint64_t GetBytesScanned() const { return m_bytesScanned; }
+    const Signature& GetSignature(uint32_t index) const { return m_signatures[index]; }
+    size_t GetSignatureCount() const { return m_signatures.size(); }
+
+private:
+    struct SeamEdges {
+        std::vector<uint8_t> before;    // tail of the chunk ending at the boundary
+        std::vector<uint8_t> after;     // head of the chunk starting there
+        bool haveBefore = false;
+        bool haveAfter = false;
+    };
+
+    template <typename OnMatch>
+    void Scan(const uint8_t* data, size_t length, OnMatch onMatch) const;
+    size_t SkipToCandidate(const uint8_t* data, size_t position, size_t length) const;
+    void ScanSeam(uint64_t boundary, const SeamEdges& edges, std::vector<SignatureMatch>& found) const;
+    void Record(const std::vector<SignatureMatch>& found);
+
+    std::vector<Signature> m_signatures;
+    size_t m_maxLength = 0;
+    size_t m_prefixLength = 0;
+
+    // Transitions are pre-multiplied by the class count, so a state is the
+    // index of its row; OUTPUT_FLAG marks states that end a prefix.
+    uint8_t m_byteClass[256] = {};
+    uint32_t m_classCount = 0;
+    std::vector<uint32_t> m_transitions;
+    std::vector<uint32_t> m_outputBegin;    // per state, into m_outputs
+    std::vector<uint32_t> m_outputs;        // signature indices
+    uint32_t m_shallowLimit = 0;            // highest state at depth 0 or 1
+
+    // Bytes that leave the root state, as nibble tables for the SIMD
+    // prefilter (rows: low nibble; bits: high nibble) and as a flat table,
+    // and a bitmap of the two-byte prefixes of all signatures.
+    alignas(16) uint8_t m_startLow[16] = {};
+    alignas(16) uint8_t m_startHigh[16] = {};
+    bool m_startByte[256] = {};
+    bool m_vectorPrefilter = false;
+    uint64_t m_startPairs[65536 / 64] = {};
+
+    mutable std::mutex m_lock;
+    std::map<uint64_t, SeamEdges> m_seams;
+    std::vector<SignatureMatch> m_matches;
+    std::atomic<uint64_t> m_matchCount{0};
+    std::atomic<uint64_t> m_bytesScanned{0};
+};
+
+// Scans an image file (decompressed if needed) in one sequential pass, for
+// when the image is not streamed through a write pipeline.
+bool ScanImage(const std::wstring& imagePath, SignatureScanner& scanner, const ProgressCallback& progress,
+               std::wstring& error);
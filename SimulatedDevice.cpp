@@ -0,0 +1,501 @@
+// ============================================================================
+// INFERNO - Simulated block device for testing and benchmarking
+// ============================================================================
+
+#include "SimulatedDevice.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// ============================================================================
+// SHARED HUBS
+// ============================================================================
+
+// When each simulated hub's link is next free, across all devices
+static std::mutex g_hubLock;
+static std::unordered_map<std::wstring, std::chrono::steady_clock::time_point> g_hubFreeAt;
+
+// ============================================================================
+// DEVICE
+// ============================================================================
+
+class SimulatedDeviceImpl : public SimulatedDevice {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    SimulatedDeviceImpl(const SimulatedDeviceConfig& config, std::unique_ptr<BlockDevice> backing)
+        : m_config(config), m_backing(std::move(backing)),
+          m_readErrors(config.readErrorLbas), m_writeErrors(config.writeErrorLbas),
+          m_channelFreeAt(Clock::now()) {
+        m_geometry.sizeBytes = config.reportedBytes;
+        m_geometry.logicalSectorSize = config.logicalSectorSize;
+        m_geometry.physicalSectorSize = config.physicalSectorSize;
+        m_geometry.eraseBlockSize = config.eraseBlockSize;
+        m_path = config.name.empty() ? L"sim:" : config.name;
+        m_traits.removable = true;
+        m_traits.usb = true;
+        m_traits.supportsDiscard = config.discard != SimulatedDiscard::None;
+        m_traits.discardGranularity = config.discard != SimulatedDiscard::None ? config.physicalSectorSize : 0;
+        m_hubBytesPerSecond = EstimateUsbLinkBytesPerSecond(config.hubSpeedMbps);
+    }
+
+    bool Read(uint64_t offset, void* buffer, size_t length) override {
+        if (!CheckRequest(offset, length)) return false;
+        bool failed = HitsInjectedError(m_readErrors, offset, length);
+        Throttle(false, length);
+        if (failed) return false;
+
+        if (!Transfer(offset, (uint8_t*)buffer, length, false)) return false;
+        std::lock_guard<std::mutex> guard(m_statsLock);
+        m_stats.reads++;
+        m_stats.bytesRead += length;
+        return true;
+    }
+
+    bool Write(uint64_t offset, const void* buffer, size_t length) override {
+        if (!CheckRequest(offset, length)) return false;
+        bool failed = HitsInjectedError(m_writeErrors, offset, length);
+        // Physical sectors written in part are read into the controller
+        // first and programmed whole.
+        uint64_t physical = m_config.physicalSectorSize;
+        uint64_t begin = offset / physical * physical;
+        uint64_t end = (offset + length + physical - 1) / physical * physical;
+        uint64_t partial = (begin != offset) + (end != offset + length);
+        if (partial == 2 && end - begin == physical) partial = 1;
+        if (partial) {
+            Throttle(false, (size_t)(partial * physical));
+            std::lock_guard<std::mutex> guard(m_statsLock);
+            m_stats.readModifyWrites++;
+        }
+        Throttle(true, (size_t)(end - begin));
+        if (failed) return false;
+
+        if (!Transfer(offset, (uint8_t*)buffer, length, true)) return false;
+        std::lock_guard<std::mutex> guard(m_statsLock);
+        m_stats.writes++;
+        m_stats.bytesWritten += length;
+        return true;
+    }
+
+    bool Flush() override {
+        {
+            std::lock_guard<std::mutex> guard(m_statsLock);
+            m_stats.flushes++;
+        }
+        return m_backing ? m_backing->Flush() : true;
+    }
+
+    bool ReloadPartitionTable() override { return true; }
+
+    bool Discard(uint64_t offset, uint64_t length) override {
+        if (m_config.discard == SimulatedDiscard::None || !CheckRequest(offset, 0) ||
+            length % m_config.logicalSectorSize != 0 || length > m_geometry.sizeBytes - offset) {
+            return false;
+        }
+        uint64_t total = length;
+        if (m_config.discard == SimulatedDiscard::Zero) {
+            while (length > 0) {
+                uint64_t physical = offset % m_config.capacityBytes;
+                uint64_t piece = std::min<uint64_t>(length, m_config.capacityBytes - physical);
+                if (m_backing) {
+                    if (!m_backing->Discard(physical, piece)) return false;
+                } else {
+                    DiscardMemory(physical, piece);
+                }
+                offset += piece;
+                length -= piece;
+            }
+        }
+        std::lock_guard<std::mutex> guard(m_statsLock);
+        m_stats.discards++;
+        m_stats.bytesDiscarded += total;
+        return true;
+    }
+
+    const DeviceGeometry& GetGeometry() const override { return m_geometry; }
+    const DeviceIdentity& GetIdentity() const override { return m_config.identity; }
+    const DeviceTraits& GetTraits() const override { return m_traits; }
+    const std::wstring& GetPath() const override { return m_path; }
+
+    SimulatedDeviceStats GetStats() const override {
+        std::lock_guard<std::mutex> guard(m_statsLock);
+        return m_stats;
+    }
+
+private:
+    static const size_t PAGE_SIZE = 1024 * 1024;
+
+    bool CheckRequest(uint64_t offset, size_t length) const {
+        uint32_t sector = m_config.logicalSectorSize;
+        return offset % sector == 0 && length % sector == 0 &&
+               offset <= m_geometry.sizeBytes && length <= m_geometry.sizeBytes - offset;
+    }
+
+    bool HitsInjectedError(std::set<uint64_t>& lbas, uint64_t offset, size_t length) {
+        if (length == 0) return false;
+        uint64_t first = offset / m_config.logicalSectorSize;
+        uint64_t last = (offset + length - 1) / m_config.logicalSectorSize;
+
+        std::lock_guard<std::mutex> guard(m_errorLock);
+        auto hit = lbas.lower_bound(first);
+        if (hit == lbas.end() || *hit > last) return false;
+        if (m_config.transientErrors) {
+            lbas.erase(hit);
+        }
+        std::lock_guard<std::mutex> statsGuard(m_statsLock);
+        m_stats.injectedErrors++;
+        return true;
+    }
+
+    // Bandwidth is a single channel shared by all requests; latency is paid
+    // per request after its transfer slot, so concurrent requests overlap it.
+    void Throttle(bool write, size_t length) {
+        double rate = write ? m_config.writeBytesPerSecond : m_config.readBytesPerSecond;
+        uint32_t latency = write ? m_config.writeLatencyMicros : m_config.readLatencyMicros;
+        bool slc = write && m_config.slcCacheBytes > 0;
+        bool hub = !m_config.hub.empty() && m_hubBytesPerSecond > 0.0;
+        if (rate <= 0.0 && latency == 0 && !slc && !hub) return;
+
+        Clock::time_point done;
+        {
+            std::lock_guard<std::mutex> guard(m_timingLock);
+            Clock::time_point now = Clock::now();
+
+            double seconds = 0.0;
+            if (slc) {
+                if (now > m_channelFreeAt && m_config.slcDrainBytesPerSecond > 0.0) {
+                    double idle = std::chrono::duration<double>(now - m_channelFreeAt).count();
+                    uint64_t drained = (uint64_t)(idle * m_config.slcDrainBytesPerSecond);
+                    m_slcUsed -= std::min(m_slcUsed, drained);
+                }
+                uint64_t fast = std::min<uint64_t>(length, m_config.slcCacheBytes - m_slcUsed);
+                uint64_t slow = length - fast;
+                m_slcUsed += fast;
+                if (rate > 0.0) seconds += fast / rate;
+                if (m_config.slcExhaustedBytesPerSecond > 0.0) seconds += slow / m_config.slcExhaustedBytesPerSecond;
+                if (slow > 0) {
+                    std::lock_guard<std::mutex> statsGuard(m_statsLock);
+                    m_stats.slcExhaustedBytes += slow;
+                }
+            } else if (rate > 0.0) {
+                seconds = length / rate;
+            }
+
+            Clock::time_point start = std::max(now, m_channelFreeAt);
+            m_channelFreeAt = start + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(seconds));
+            done = m_channelFreeAt + std::chrono::microseconds(latency);
+        }
+        // The transfer also needs its turn on the hub's link
+        if (hub) {
+            std::lock_guard<std::mutex> guard(g_hubLock);
+            Clock::time_point now = Clock::now();
+            auto found = g_hubFreeAt.find(m_config.hub);
+            Clock::time_point start = (found == g_hubFreeAt.end()) ? now : std::max(now, found->second);
+            Clock::time_point freeAt = start + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(length / m_hubBytesPerSecond));
+            g_hubFreeAt[m_config.hub] = freeAt;
+            done = std::max(done, freeAt + std::chrono::microseconds(latency));
+        }
+        std::this_thread::sleep_until(done);
+    }
+
+    // Addresses past the real capacity wrap around, the way counterfeit
+    // sticks silently overwrite their own start.
+    bool Transfer(uint64_t offset, uint8_t* data, size_t length, bool write) {
+        while (length > 0) {
+            uint64_t physical = offset % m_config.capacityBytes;
+            size_t piece = (size_t)std::min<uint64_t>(length, m_config.capacityBytes - physical);
+            if (m_backing) {
+                bool ok = write ? m_backing->Write(physical, data, piece) : m_backing->Read(physical, data, piece);
+                if (!ok) return false;
+            } else {
+                TransferMemory(physical, data, piece, write);
+            }
+            offset += piece;
+            data += piece;
+            length -= piece;
+        }
+        return true;
+    }
+
+    // Pages are allocated on first write; unwritten space reads as zeros.
+    void TransferMemory(uint64_t offset, uint8_t* data, size_t length, bool write) {
+        std::lock_guard<std::mutex> guard(m_pageLock);
+        while (length > 0) {
+            uint64_t index = offset / PAGE_SIZE;
+            size_t within = (size_t)(offset % PAGE_SIZE);
+            size_t piece = std::min(length, PAGE_SIZE - within);
+
+            auto page = m_pages.find(index);
+            if (write) {
+                if (page == m_pages.end()) {
+                    page = m_pages.emplace(index, std::vector<uint8_t>(PAGE_SIZE, 0)).first;
+                }
+                memcpy(page->second.data() + within, data, piece);
+            } else if (page == m_pages.end()) {
+                memset(data, 0, piece);
+            } else {
+                memcpy(data, page->second.data() + within, piece);
+            }
+            offset += piece;
+            data += piece;
+            length -= piece;
+        }
+    }
+
+    // Whole pages are dropped so they read as zeros again; partial ones are cleared.
+    void DiscardMemory(uint64_t offset, uint64_t length) {
+        std::lock_guard<std::mutex> guard(m_pageLock);
+        while (length > 0) {
+            uint64_t index = offset / PAGE_SIZE;
+            size_t within = (size_t)(offset % PAGE_SIZE);
+            size_t piece = (size_t)std::min<uint64_t>(length, PAGE_SIZE - within);
+            auto page = m_pages.find(index);
+            if (page != m_pages.end()) {
+                if (piece == PAGE_SIZE) {
+                    m_pages.erase(page);
+                } else {
+                    memset(page->second.data() + within, 0, piece);
+                }
+            }
+            offset += piece;
+            length -= piece;
+        }
+    }
+
+    SimulatedDeviceConfig m_config;
+    std::unique_ptr<BlockDevice> m_backing;
+    DeviceGeometry m_geometry;
+    DeviceTraits m_traits;
+    std::wstring m_path;
+
+    std::mutex m_pageLock;
+    std::unordered_map<uint64_t, std::vector<uint8_t>> m_pages;
+
+    std::mutex m_errorLock;
+    std::set<uint64_t> m_readErrors;
+    std::set<uint64_t> m_writeErrors;
+
+    std::mutex m_timingLock;
+    Clock::time_point m_channelFreeAt;
+    uint64_t m_slcUsed = 0;
+    double m_hubBytesPerSecond = 0.0;
+
+    mutable std::mutex m_statsLock;
+    SimulatedDeviceStats m_stats;
+};
+
+std::unique_ptr<SimulatedDevice> CreateSimulatedDevice(const SimulatedDeviceConfig& config, std::wstring& error) {
+    SimulatedDeviceConfig effective = config;
+    uint32_t sector = effective.logicalSectorSize;
+    if (sector < 512 || (sector & (sector - 1)) != 0 || effective.physicalSectorSize % sector != 0) {
+        error = L"Invalid simulated sector size.";
+        return nullptr;
+    }
+
+    std::unique_ptr<BlockDevice> backing;
+    if (!effective.backingFile.empty()) {
+        backing = OpenBlockDevice(effective.backingFile, true);
+        if (!backing) {
+            error = L"Cannot open the simulated device backing file.";
+            return nullptr;
+        }
+        uint64_t fileSize = backing->GetGeometry().sizeBytes;
+        if (effective.capacityBytes == 0) {
+            effective.capacityBytes = fileSize;
+        } else if (effective.capacityBytes > fileSize) {
+            error = L"The backing file is smaller than the simulated capacity.";
+            return nullptr;
+        }
+    }
+
+    effective.capacityBytes -= effective.capacityBytes % sector;
+    if (effective.capacityBytes == 0) {
+        error = L"The simulated device needs a size.";
+        return nullptr;
+    }
+    if (effective.reportedBytes == 0) {
+        effective.reportedBytes = effective.capacityBytes;
+    }
+    effective.reportedBytes -= effective.reportedBytes % sector;
+    effective.capacityBytes = std::min(effective.capacityBytes, effective.reportedBytes);
+
+    return std::unique_ptr<SimulatedDevice>(new SimulatedDeviceImpl(effective, std::move(backing)));
+}
+
+// ============================================================================
+// SPEC PARSING
+// ============================================================================
+
+static const wchar_t SPEC_PREFIX[] = L"sim:";
+
+static bool ParseScaled(const std::wstring& text, double& value) {
+    wchar_t* end = nullptr;
+    double number = wcstod(text.c_str(), &end);
+    if (end == text.c_str() || number < 0.0) return false;
+    double scale = 1.0;
+    switch (*end) {
+        case L'\0': break;
+        case L'k': case L'K': scale = 1024.0; end++; break;
+        case L'm': case L'M': scale = 1024.0 * 1024; end++; break;
+        case L'g': case L'G': scale = 1024.0 * 1024 * 1024; end++; break;
+        case L't': case L'T': scale = 1024.0 * 1024 * 1024 * 1024; end++; break;
+        default: return false;
+    }
+    if (*end == L'B' || *end == L'b') end++;
+    if (*end != L'\0') return false;
+    value = number * scale;
+    return true;
+}
+
+static bool ParseMicros(const std::wstring& text, uint32_t& micros) {
+    wchar_t* end = nullptr;
+    double number = wcstod(text.c_str(), &end);
+    if (end == text.c_str() || number < 0.0) return false;
+    std::wstring unit(end);
+    double scale;
+    if (unit.empty() || unit == L"us") scale = 1.0;
+    else if (unit == L"ms") scale = 1000.0;
+    else if (unit == L"s") scale = 1000000.0;
+    else return false;
+    double value = number * scale;
+    if (value > 4.0e9) return false;
+    micros = (uint32_t)value;
+    return true;
+}
+
+// "100;200-210" -> {100, 200, ..., 210}
+static bool ParseLbaList(const std::wstring& text, std::set<uint64_t>& lbas) {
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(L';', start);
+        std::wstring item = text.substr(start, end == std::wstring::npos ? std::wstring::npos : end - start);
+        wchar_t* stop = nullptr;
+        uint64_t first = wcstoull(item.c_str(), &stop, 10);
+        if (stop == item.c_str()) return false;
+        uint64_t last = first;
+        if (*stop == L'-') {
+            const wchar_t* rangeEnd = stop + 1;
+            last = wcstoull(rangeEnd, &stop, 10);
+            if (stop == rangeEnd || last < first || last - first > 1000000) return false;
+        }
+        if (*stop != L'\0') return false;
+        for (uint64_t lba = first; lba <= last; lba++) {
+            lbas.insert(lba);
+        }
+        if (end == std::wstring::npos) break;
+        start = end + 1;
+    }
+    return true;
+}
+
+bool IsSimulatedDeviceSpec(const std::wstring& path) {
+    return path.compare(0, wcslen(SPEC_PREFIX), SPEC_PREFIX) == 0;
+}
+
+bool ParseSimulatedDeviceSpec(const std::wstring& spec, SimulatedDeviceConfig& config, std::wstring& error) {
+    if (!IsSimulatedDeviceSpec(spec)) {
+        error = L"Not a simulated device spec.";
+        return false;
+    }
+
+    config = SimulatedDeviceConfig();
+    config.name = spec;
+    config.identity.vendor = L"Inferno";
+    config.identity.product = L"Simulated Device";
+
+    std::wstring body = spec.substr(wcslen(SPEC_PREFIX));
+    size_t start = 0;
+    while (start < body.size()) {
+        size_t end = body.find(L',', start);
+        std::wstring item = body.substr(start, end == std::wstring::npos ? std::wstring::npos : end - start);
+        start = (end == std::wstring::npos) ? body.size() : end + 1;
+        if (item.empty()) continue;
+
+        size_t equals = item.find(L'=');
+        std::wstring key = item.substr(0, equals);
+        std::wstring value = (equals == std::wstring::npos) ? L"" : item.substr(equals + 1);
+
+        double number = 0.0;
+        uint32_t micros = 0;
+        bool ok = true;
+        if (key == L"size") {
+            ok = ParseScaled(value, number) && number >= 1.0;
+            config.capacityBytes = (uint64_t)number;
+        } else if (key == L"fake") {
+            ok = ParseScaled(value, number);
+            config.reportedBytes = (uint64_t)number;
+        } else if (key == L"sector") {
+            ok = ParseScaled(value, number) && number <= 65536;
+            config.logicalSectorSize = config.physicalSectorSize = (uint32_t)number;
+        } else if (key == L"physical-sector") {
+            ok = ParseScaled(value, number) && number <= 65536;
+            config.physicalSectorSize = (uint32_t)number;
+        } else if (key == L"erase") {
+            ok = ParseScaled(value, number) && number <= 4294967295.0;
+            config.eraseBlockSize = (uint32_t)number;
+        } else if (key == L"read") {
+            ok = ParseScaled(value, config.readBytesPerSecond);
+        } else if (key == L"write") {
+            ok = ParseScaled(value, config.writeBytesPerSecond);
+        } else if (key == L"latency") {
+            ok = ParseMicros(value, micros);
+            config.readLatencyMicros = config.writeLatencyMicros = micros;
+        } else if (key == L"read-latency") {
+            ok = ParseMicros(value, config.readLatencyMicros);
+        } else if (key == L"write-latency") {
+            ok = ParseMicros(value, config.writeLatencyMicros);
+        } else if (key == L"slc") {
+            ok = ParseScaled(value, number);
+            config.slcCacheBytes = (uint64_t)number;
+        } else if (key == L"slc-write") {
+            ok = ParseScaled(value, config.slcExhaustedBytesPerSecond);
+        } else if (key == L"slc-drain") {
+            ok = ParseScaled(value, config.slcDrainBytesPerSecond);
+        } else if (key == L"bad-read") {
+            ok = ParseLbaList(value, config.readErrorLbas);
+        } else if (key == L"bad-write") {
+            ok = ParseLbaList(value, config.writeErrorLbas);
+        } else if (key == L"transient") {
+            config.transientErrors = true;
+        } else if (key == L"discard") {
+            if (value.empty() || value == L"zero") config.discard = SimulatedDiscard::Zero;
+            else if (value == L"stale") config.discard = SimulatedDiscard::Stale;
+            else ok = false;
+        } else if (key == L"file") {
+            config.backingFile = value;
+            ok = !value.empty();
+        } else if (key == L"vendor") {
+            config.identity.vendor = value;
+        } else if (key == L"product") {
+            config.identity.product = value;
+        } else if (key == L"hub") {
+            config.hub = value;
+            ok = !value.empty();
+        } else if (key == L"hub-speed") {
+            ok = ParseScaled(value, number) && number >= 1.0 && number <= 100000.0;
+            config.hubSpeedMbps = (uint32_t)number;
+        } else {
+            error = L"Unknown simulated device option: " + key;
+            return false;
+        }
+        if (!ok) {
+            error = L"Invalid value for simulated device option: " + key;
+            return false;
+        }
+    }
+
+    if (config.capacityBytes == 0 && config.backingFile.empty()) {
+        error = L"A simulated device needs size= or file=.";
+        return false;
+    }
+    return true;
+}
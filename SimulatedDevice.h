@@ -0,0 +1,93 @@
+// ============================================================================
+// INFERNO - Simulated block device for testing and benchmarking
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+
+// Behaviour of a simulated USB stick. Rates are bytes per second (0 means
+// unthrottled); latencies are added to every request but overlap across
+// requests in flight, so queue depth matters the way it does on hardware.
+enum class SimulatedDiscard {
+    None,       // discard is not supported
+    Zero,       // discarded sectors read back as zeros
+    Stale       // accepted, but the old data stays readable (no deterministic read-zero)
+};
+
+struct SimulatedDeviceConfig {
+    uint64_t capacityBytes = 0;         // bytes that actually hold data
+    uint64_t reportedBytes = 0;         // advertised size; larger than capacity fakes a counterfeit stick
+    uint32_t logicalSectorSize = 512;
+    uint32_t physicalSectorSize = 512;  // larger than the logical one (512e): partial writes cost a read-modify-write
+    uint32_t eraseBlockSize = 0;
+
+    double readBytesPerSecond = 0.0;
+    double writeBytesPerSecond = 0.0;
+    uint32_t readLatencyMicros = 0;
+    uint32_t writeLatencyMicros = 0;
+
+    // SLC cache: the first `slcCacheBytes` of a burst are written at
+    // writeBytesPerSecond, the rest at slcExhaustedBytesPerSecond. The cache
+    // drains at slcDrainBytesPerSecond while the device is idle.
+    uint64_t slcCacheBytes = 0;
+    double slcExhaustedBytesPerSecond = 0.0;
+    double slcDrainBytesPerSecond = 0.0;
+
+    // Requests touching any of these logical sectors fail. Transient errors
+    // fire once per sector and then clear, so retries succeed.
+    std::set<uint64_t> readErrorLbas;
+    std::set<uint64_t> writeErrorLbas;
+    bool transientErrors = false;
+
+    SimulatedDiscard discard = SimulatedDiscard::None;
+
+    // Devices naming the same hub share its bandwidth, the usable payload of
+    // a USB link at hubSpeedMbps (see EstimateUsbLinkBytesPerSecond), and
+    // report it as their USB topology.
+    std::wstring hub;
+    uint32_t hubSpeedMbps = 480;
+
+    std::wstring backingFile;           // sparse in-memory storage when empty
+    DeviceIdentity identity;
+    std::wstring name;                  // returned by GetPath(); the spec when parsed from one
+};
+
+struct SimulatedDeviceStats {
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t flushes = 0;
+    uint64_t discards = 0;
+    uint64_t bytesDiscarded = 0;
+    uint64_t injectedErrors = 0;
+    uint64_t slcExhaustedBytes = 0;     // bytes written past the cache cliff
+    uint64_t readModifyWrites = 0;      // writes that covered a physical sector in part
+};
+
+class SimulatedDevice : public BlockDevice {
+public:
+    virtual SimulatedDeviceStats GetStats() const = 0;
+};
+
+// Spec strings select a simulated device wherever a device path is accepted
+// (OpenBlockDevice, inferno_bench --sink):
+//
+//   sim:size=16G,write=20M,read=40M,latency=1ms,slc=2G,slc-write=6M,physical-sector=4K,
+//       fake=64G,bad-write=2048;4096-4100,bad-read=100,transient,discard,file=/tmp/x.img,
+//       hub=a,hub-speed=480
+//
+// `discard` (or discard=zero) accepts discards that zero the range;
+// discard=stale accepts them but leaves the data readable.
+//
+// Sizes and rates take K/M/G/T suffixes (binary); latencies take us/ms/s.
+bool IsSimulatedDeviceSpec(const std::wstring& path);
+bool ParseSimulatedDeviceSpec(const std::wstring& spec, SimulatedDeviceConfig& config, std::wstring& error);
+
+std::unique_ptr<SimulatedDevice> CreateSimulatedDevice(const SimulatedDeviceConfig& config, std::wstring& error);
@@ -0,0 +1,271 @@
+// ============================================================================
+// INFERNO - Dependency-driven job step scheduler
+// ============================================================================
+
+#include "StepScheduler.h"
+#include "Log.h"
+#include "Platform.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+void StepContext::ReportProgress(double fraction) {
+    m_fraction = std::min(1.0, std::max(0.0, fraction));
+    if (m_onProgress) m_onProgress();
+}
+
+bool StepContext::IsCancelled() const {
+    return m_cancelled && m_cancelled->load();
+}
+
+void StepScheduler::AddStep(JobStep step) {
+    m_steps.push_back(std::move(step));
+}
+
+double StepScheduler::TotalCost() const {
+    double total = 0.0;
+    for (const JobStep& step : m_steps) {
+        total += step.estimatedCost;
+    }
+    return total;
+}
+
+bool StepScheduler::ResolveDependencies(std::vector<std::vector<size_t>>& dependents,
+                                        std::vector<size_t>& pendingCounts, std::wstring& error) const {
+    std::map<std::string, size_t> byName;
+    for (size_t i = 0; i < m_steps.size(); i++) {
+        if (!m_steps[i].name || !m_steps[i].run) {
+            error = L"Job step is missing a name or body.";
+            return false;
+        }
+        if (!byName.emplace(m_steps[i].name, i).second) {
+            error = L"Duplicate job step: " + Utf8ToWide(m_steps[i].name);
+            return false;
+        }
+    }
+
+    dependents.assign(m_steps.size(), std::vector<size_t>());
+    pendingCounts.assign(m_steps.size(), 0);
+    for (size_t i = 0; i < m_steps.size(); i++) {
+        for (const char* dependency : m_steps[i].dependsOn) {
+            auto found = byName.find(dependency);
+            if (found == byName.end()) continue;
+            dependents[found->second].push_back(i);
+            pendingCounts[i]++;
+        }
+    }
+
+    // Kahn's algorithm: every step must become ready at some point.
+    std::vector<size_t> counts = pendingCounts;
+    std::vector<size_t> queue;
+    for (size_t i = 0; i < counts.size(); i++) {
+        if (counts[i] == 0) queue.push_back(i);
+    }
+    size_t visited = 0;
+    while (!queue.empty()) {
+        size_t current = queue.back();
+        queue.pop_back();
+        visited++;
+        for (size_t next : dependents[current]) {
+            if (--counts[next] == 0) queue.push_back(next);
+        }
+    }
+    if (visited != m_steps.size()) {
+        error = L"Job steps have a circular dependency.";
+        return false;
+    }
+    return true;
+}
+
+double StepScheduler::CriticalPathCost() const {
+    std::vector<std::vector<size_t>> dependents;
+    std::vector<size_t> pendingCounts;
+    std::wstring error;
+    if (!ResolveDependencies(dependents, pendingCounts, error)) {
+        return TotalCost();
+    }
+
+    // Relax in topological order: longest[i] is the costliest chain ending at i.
+    std::vector<double> longest(m_steps.size(), 0.0);
+    std::vector<size_t> queue;
+    for (size_t i = 0; i < m_steps.size(); i++) {
+        if (pendingCounts[i] == 0) queue.push_back(i);
+    }
+    double best = 0.0;
+    while (!queue.empty()) {
+        size_t current = queue.back();
+        queue.pop_back();
+        longest[current] += m_steps[current].estimatedCost;
+        best = std::max(best, longest[current]);
+        for (size_t next : dependents[current]) {
+            longest[next] = std::max(longest[next], longest[current]);
+            if (--pendingCounts[next] == 0) queue.push_back(next);
+        }
+    }
+    return best;
+}
+
+static bool ClaimsConflict(const JobStep& a, const JobStep& b) {
+    for (const ResourceClaim& x : a.claims) {
+        for (const ResourceClaim& y : b.claims) {
+            if ((x.exclusive || y.exclusive) && strcmp(x.resource, y.resource) == 0 &&
+                x.begin < y.end && y.begin < x.end) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool StepScheduler::Run(uint32_t workerCount, const JobProgressCallback& progress, std::wstring& error) {
+    std::vector<std::vector<size_t>> dependents;
+    std::vector<size_t> pendingCounts;
+    if (!ResolveDependencies(dependents, pendingCounts, error)) {
+        return false;
+    }
+    if (m_steps.empty()) {
+        return true;
+    }
+    workerCount = std::max<uint32_t>(1, std::min<uint32_t>(workerCount, (uint32_t)m_steps.size()));
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<std::deque<size_t>> ready(workerCount);
+    std::vector<size_t> running;
+    std::vector<std::unique_ptr<StepContext>> contexts;
+    std::atomic<bool> cancelled(false);
+    size_t finished = 0;
+    double finishedCost = 0.0;
+    double totalCost = std::max(TotalCost(), 1e-9);
+    std::wstring firstError;
+
+    std::mutex progressLock;
+    auto reportProgress = [&](const char* stepName) {
+        double done;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done = finishedCost;
+            for (size_t index : running) {
+                done += m_steps[index].estimatedCost * contexts[index]->m_fraction.load();
+            }
+        }
+        std::lock_guard<std::mutex> guard(progressLock);
+        if (progress && !progress(std::min(1.0, done / totalCost), stepName) && !cancelled.exchange(true)) {
+            {
+                std::lock_guard<std::mutex> stateGuard(lock);
+                if (firstError.empty()) firstError = L"Operation cancelled.";
+            }
+            wake.notify_all();
+        }
+    };
+
+    for (size_t i = 0; i < m_steps.size(); i++) {
+        contexts.emplace_back(new StepContext());
+        contexts[i]->m_cancelled = &cancelled;
+        const char* name = m_steps[i].name;
+        contexts[i]->m_onProgress = [&reportProgress, name] { reportProgress(name); };
+        if (pendingCounts[i] == 0) {
+            ready[i % workerCount].push_back(i);
+        }
+    }
+
+    // Own queue first, newest first; otherwise steal the oldest from a peer.
+    // A step whose claims conflict with a running step is left queued.
+    auto takeRunnable = [&](uint32_t worker) -> size_t {
+        auto runnable = [&](size_t candidate) {
+            for (size_t index : running) {
+                if (ClaimsConflict(m_steps[candidate], m_steps[index])) return false;
+            }
+            return true;
+        };
+        std::deque<size_t>& own = ready[worker];
+        for (auto it = own.begin(); it != own.end(); ++it) {
+            if (runnable(*it)) {
+                size_t pick = *it;
+                own.erase(it);
+                return pick;
+            }
+        }
+        for (uint32_t offset = 1; offset < workerCount; offset++) {
+            std::deque<size_t>& victim = ready[(worker + offset) % workerCount];
+            for (auto it = victim.rbegin(); it != victim.rend(); ++it) {
+                if (runnable(*it)) {
+                    size_t pick = *it;
+                    victim.erase(std::next(it).base());
+                    return pick;
+                }
+            }
+        }
+        return SIZE_MAX;
+    };
+
+    auto workerLoop = [&](uint32_t worker) {
+        TraceSetThreadName("step worker");
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            if (finished == m_steps.size() || (cancelled && running.empty())) break;
+            size_t pick = cancelled ? SIZE_MAX : takeRunnable(worker);
+            if (pick == SIZE_MAX) {
+                wake.wait(guard);
+                continue;
+            }
+            running.push_back(pick);
+            guard.unlock();
+
+            const JobStep& step = m_steps[pick];
+            StepContext& context = *contexts[pick];
+            auto started = std::chrono::steady_clock::now();
+            bool ok;
+            {
+                TraceSpan span("step", step.name);
+                LogEvent(LogLevel::Info, "step", step.name, {{"worker", worker}});
+                ok = step.run(context);
+            }
+            int64_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - started).count();
+            LogEvent(ok ? LogLevel::Info : LogLevel::Error, "step", ok ? "step done" : "step failed",
+                     {{"ms", elapsed}});
+
+            guard.lock();
+            running.erase(std::find(running.begin(), running.end(), pick));
+            finished++;
+            finishedCost += step.estimatedCost;
+            if (!ok) {
+                if (!cancelled.exchange(true) && firstError.empty()) {
+                    firstError = context.error.empty() ? Utf8ToWide(step.name) + L" failed." : context.error;
+                }
+            } else {
+                for (size_t next : dependents[pick]) {
+                    if (--pendingCounts[next] == 0) ready[worker].push_front(next);
+                }
+            }
+            wake.notify_all();
+
+            guard.unlock();
+            reportProgress(step.name);
+            guard.lock();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < workerCount; i++) {
+        workers.emplace_back(workerLoop, i);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    if (cancelled) {
+        error = firstError;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,79 @@
+// ============================================================================
+// INFERNO - Dependency-driven job step scheduler
+// ============================================================================
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Something a step reads or modifies. Claims on the same resource conflict
+// when their ranges overlap and at least one of them is exclusive. Ranges
+// are in whatever unit the resource uses: byte offsets for a device,
+// partition indices, or the whole resource by default.
+struct ResourceClaim {
+    const char* resource;
+    uint64_t begin = 0;
+    uint64_t end = UINT64_MAX;
+    bool exclusive = true;
+
+    static ResourceClaim Exclusive(const char* resource, uint64_t begin = 0, uint64_t end = UINT64_MAX) {
+        return {resource, begin, end, true};
+    }
+    static ResourceClaim Shared(const char* resource, uint64_t begin = 0, uint64_t end = UINT64_MAX) {
+        return {resource, begin, end, false};
+    }
+};
+
+class StepContext {
+public:
+    // Fraction of this step completed, 0..1. Feeds the job's weighted progress.
+    void ReportProgress(double fraction);
+
+    // Set once any step fails or the job is cancelled; long steps should stop.
+    bool IsCancelled() const;
+
+    // Reported by StepScheduler::Run when the step returns false.
+    std::wstring error;
+
+private:
+    friend class StepScheduler;
+    std::atomic<double> m_fraction{0.0};
+    const std::atomic<bool>* m_cancelled = nullptr;
+    std::function<void()> m_onProgress;
+};
+
+// Names and dependencies are stored as pointers: pass string literals.
+struct JobStep {
+    const char* name = nullptr;
+    std::vector<const char*> dependsOn;     // steps not in the job are ignored
+    std::vector<ResourceClaim> claims;
+    double estimatedCost = 1.0;             // relative; seconds are a good unit
+    std::function<bool(StepContext&)> run;
+};
+
+// Return false to cancel the job. Called from worker threads, serialized.
+using JobProgressCallback = std::function<bool(double fraction, const char* stepName)>;
+
+// Runs steps as soon as their dependencies have finished and no running step
+// holds a conflicting claim. Each worker prefers steps it unblocked itself
+// and otherwise steals the oldest ready step from another worker.
+class StepScheduler {
+public:
+    void AddStep(JobStep step);
+
+    // Longest cost-weighted dependency chain: the best possible job time.
+    double CriticalPathCost() const;
+    double TotalCost() const;
+
+    bool Run(uint32_t workerCount, const JobProgressCallback& progress, std::wstring& error);
+
+private:
+    bool ResolveDependencies(std::vector<std::vector<size_t>>& dependents,
+                             std::vector<size_t>& pendingCounts, std::wstring& error) const;
+
+    std::vector<JobStep> m_steps;
+};
@@ -0,0 +1,258 @@
+// ============================================================================
+// INFERNO - Low-overhead tracing with Chrome trace export
+// ============================================================================
+
+#include "Trace.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> g_TraceEnabled(false);
+
+struct TraceEvent {
+    const char* category;
+    const char* name;
+    char phase;                 // 'X' complete span, 'C' counter, 'i' instant
+    uint64_t timestamp;         // nanoseconds since the session started
+    uint64_t duration;
+    const char* argKeys[2];
+    int64_t argValues[2];
+};
+
+// Owned jointly by the registry and the recording thread so events survive
+// threads that exit before the export. The lock is only contended while a
+// session is being reset or exported.
+struct TraceThreadBuffer {
+    std::mutex lock;
+    uint32_t threadId = 0;
+    const char* threadName = nullptr;
+    std::vector<TraceEvent> events;
+    uint64_t dropped = 0;
+};
+
+static const size_t MAX_EVENTS_PER_THREAD = 1 << 20;
+
+static std::mutex g_TraceRegistryLock;
+static std::vector<std::shared_ptr<TraceThreadBuffer>> g_TraceBuffers;
+static std::atomic<int64_t> g_TraceEpoch(0);
+static uint32_t g_TraceNextThreadId = 1;
+
+static uint64_t TraceNow() {
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t elapsed = now - g_TraceEpoch.load(std::memory_order_relaxed);
+    return elapsed > 0 ? (uint64_t)elapsed : 0;
+}
+
+static TraceThreadBuffer& GetThreadBuffer() {
+    thread_local std::shared_ptr<TraceThreadBuffer> buffer;
+    if (!buffer) {
+        buffer = std::make_shared<TraceThreadBuffer>();
+        std::lock_guard<std::mutex> guard(g_TraceRegistryLock);
+        buffer->threadId = g_TraceNextThreadId++;
+        g_TraceBuffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+static void Record(const TraceEvent& event) {
+    TraceThreadBuffer& buffer = GetThreadBuffer();
+    std::lock_guard<std::mutex> guard(buffer.lock);
+    if (buffer.events.size() >= MAX_EVENTS_PER_THREAD) {
+        buffer.dropped++;
+        return;
+    }
+    buffer.events.push_back(event);
+}
+
+// ============================================================================
+// SESSION
+// ============================================================================
+
+void StartTracing() {
+    std::lock_guard<std::mutex> guard(g_TraceRegistryLock);
+    // Buffers held only by the registry belong to threads that have exited.
+    g_TraceBuffers.erase(std::remove_if(g_TraceBuffers.begin(), g_TraceBuffers.end(),
+                                        [](const std::shared_ptr<TraceThreadBuffer>& buffer) {
+                                            return buffer.use_count() == 1;
+                                        }),
+                         g_TraceBuffers.end());
+    for (const std::shared_ptr<TraceThreadBuffer>& buffer : g_TraceBuffers) {
+        std::lock_guard<std::mutex> bufferGuard(buffer->lock);
+        buffer->events.clear();
+        buffer->dropped = 0;
+    }
+    g_TraceEpoch = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    g_TraceEnabled = true;
+}
+
+void StopTracing() {
+    g_TraceEnabled = false;
+}
+
+static void AppendJsonString(std::string& out, const char* text) {
+    out += '"';
+    for (const char* c = text ? text : ""; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            out += '\\';
+            out += *c;
+        } else if ((unsigned char)*c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+            out += escaped;
+        } else {
+            out += *c;
+        }
+    }
+    out += '"';
+}
+
+static void AppendMicros(std::string& out, uint64_t nanoseconds) {
+    char text[32];
+    snprintf(text, sizeof(text), "%" PRIu64 ".%03u", nanoseconds / 1000, (unsigned)(nanoseconds % 1000));
+    out += text;
+}
+
+bool ExportChromeTrace(const std::wstring& path, std::wstring& error) {
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    auto separator = [&] {
+        if (!first) out += ",\n";
+        first = false;
+    };
+
+    std::lock_guard<std::mutex> guard(g_TraceRegistryLock);
+    for (const std::shared_ptr<TraceThreadBuffer>& buffer : g_TraceBuffers) {
+        std::lock_guard<std::mutex> bufferGuard(buffer->lock);
+        std::string tid = std::to_string(buffer->threadId);
+
+        if (buffer->threadName) {
+            separator();
+            out += "{\"ph\":\"M\",\"pid\":1,\"tid\":" + tid + ",\"name\":\"thread_name\",\"args\":{\"name\":";
+            AppendJsonString(out, buffer->threadName);
+            out += "}}";
+        }
+        if (buffer->dropped > 0) {
+            separator();
+            out += "{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":" + tid +
+                   ",\"ts\":0,\"name\":\"events dropped\",\"args\":{\"count\":" +
+                   std::to_string(buffer->dropped) + "}}";
+        }
+
+        for (const TraceEvent& event : buffer->events) {
+            separator();
+            out += "{\"ph\":\"";
+            out += event.phase;
+            out += "\",\"pid\":1,\"tid\":" + tid + ",\"ts\":";
+            AppendMicros(out, event.timestamp);
+            if (event.phase == 'X') {
+                out += ",\"dur\":";
+                AppendMicros(out, event.duration);
+            } else if (event.phase == 'i') {
+                out += ",\"s\":\"t\"";
+            }
+            if (event.category) {
+                out += ",\"cat\":";
+                AppendJsonString(out, event.category);
+            }
+            out += ",\"name\":";
+            AppendJsonString(out, event.name);
+
+            if (event.argKeys[0]) {
+                out += ",\"args\":{";
+                for (int i = 0; i < 2 && event.argKeys[i]; i++) {
+                    if (i) out += ",";
+                    AppendJsonString(out, event.argKeys[i]);
+                    out += ":" + std::to_string(event.argValues[i]);
+                }
+                out += "}";
+            }
+            out += "}";
+        }
+    }
+    out += "\n]}\n";
+
+    if (!WriteFileAtomically(path, out)) {
+        error = L"Cannot write the trace file.";
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+// EVENTS
+// ============================================================================
+
+void TraceSetThreadName(const char* name) {
+    if (!IsTracingEnabled()) return;
+    TraceThreadBuffer& buffer = GetThreadBuffer();
+    std::lock_guard<std::mutex> guard(buffer.lock);
+    buffer.threadName = name;
+}
+
+void TraceCounter(const char* name, int64_t value) {
+    if (!IsTracingEnabled()) return;
+    Record({nullptr, name, 'C', TraceNow(), 0, {"value", nullptr}, {value, 0}});
+}
+
+void TraceInstant(const char* category, const char* name) {
+    if (!IsTracingEnabled()) return;
+    Record({category, name, 'i', TraceNow(), 0, {nullptr, nullptr}, {0, 0}});
+}
+
+TraceSpan::TraceSpan(const char* category, const char* name) : m_category(category), m_name(name) {
+    if (IsTracingEnabled()) {
+        m_active = true;
+        m_start = TraceNow();
+    }
+}
+
+void TraceSpan::SetArg(const char* key, int64_t value) {
+    for (int i = 0; i < 2; i++) {
+        if (!m_argKeys[i] || m_argKeys[i] == key) {
+            m_argKeys[i] = key;
+            m_argValues[i] = value;
+            return;
+        }
+    }
+}
+
+void TraceSpan::Next(const char* name) {
+    End();
+    m_name = name;
+    m_argKeys[0] = m_argKeys[1] = nullptr;
+    if (IsTracingEnabled()) {
+        m_active = true;
+        m_start = TraceNow();
+    }
+}
+
+void TraceSpan::End() {
+    if (!m_active) return;
+    m_active = false;
+    // A span that outlives its session is dropped rather than misattributed.
+    if (!IsTracingEnabled()) return;
+    uint64_t now = TraceNow();
+    Record({m_category, m_name, 'X', m_start, now > m_start ? now - m_start : 0,
+            {m_argKeys[0], m_argKeys[1]}, {m_argValues[0], m_argValues[1]}});
+}
+
+ScopedTraceSession::ScopedTraceSession(const std::wstring& path) : m_path(path) {
+    if (!m_path.empty()) {
+        StartTracing();
+    }
+}
+
+ScopedTraceSession::~ScopedTraceSession() {
+    if (m_path.empty()) return;
+    StopTracing();
+    std::wstring error;
+    ExportChromeTrace(m_path, error);
+}
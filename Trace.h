@@ -0,0 +1,69 @@
+// ============================================================================
+// INFERNO - Low-overhead tracing with Chrome trace export
+// ============================================================================
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Spans, counters and instant events are recorded into per-thread buffers
+// while a session is active and exported as Chrome trace JSON, which both
+// chrome://tracing and the Perfetto UI open. With no session active every
+// call reduces to one relaxed atomic load.
+//
+// Categories, names and argument keys are stored as pointers: pass string
+// literals.
+
+extern std::atomic<bool> g_TraceEnabled;
+
+inline bool IsTracingEnabled() {
+    return g_TraceEnabled.load(std::memory_order_relaxed);
+}
+
+// Starting a session discards events from the previous one. Thread names
+// are only recorded while a session is active.
+void StartTracing();
+void StopTracing();
+bool ExportChromeTrace(const std::wstring& path, std::wstring& error);
+
+void TraceSetThreadName(const char* name);
+void TraceCounter(const char* name, int64_t value);
+void TraceInstant(const char* category, const char* name);
+
+class TraceSpan {
+public:
+    TraceSpan(const char* category, const char* name);
+    ~TraceSpan() { End(); }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    // Up to two numeric arguments are shown with the span.
+    void SetArg(const char* key, int64_t value);
+
+    // End this span and start the next one in the same category, for
+    // sequential stages in one function.
+    void Next(const char* name);
+    void End();
+
+private:
+    const char* m_category;
+    const char* m_name;
+    uint64_t m_start = 0;
+    bool m_active = false;
+    const char* m_argKeys[2] = {nullptr, nullptr};
+    int64_t m_argValues[2] = {0, 0};
+};
+
+// Records for its lifetime and exports to `path` when destroyed. Does
+// nothing when `path` is empty.
+class ScopedTraceSession {
+public:
+    explicit ScopedTraceSession(const std::wstring& path);
+    ~ScopedTraceSession();
+
+private:
+    std::wstring m_path;
+};
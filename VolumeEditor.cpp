@@ -0,0 +1,1034 @@
+// ============================================================================
+// INFERNO - Block-level file editing on written ISO9660 and FAT volumes
+// ============================================================================
+
+#include "VolumeEditor.h"
+#include "IsoHybrid.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <cwctype>
+#include <map>
+#include <set>
+
+static const uint32_t ISO_FIRST_DESCRIPTOR = 16;
+static const uint32_t ISO_MAX_DESCRIPTORS = 32;
+static const uint8_t DESCRIPTOR_BOOT_RECORD = 0;
+static const uint8_t DESCRIPTOR_PRIMARY = 1;
+static const uint8_t DESCRIPTOR_SUPPLEMENTARY = 2;
+static const uint8_t DESCRIPTOR_TERMINATOR = 255;
+
+static const uint8_t ISO_FLAG_DIRECTORY = 0x02;
+static const uint8_t ISO_FLAG_MULTI_EXTENT = 0x80;
+
+static const uint8_t FAT_ATTRIBUTE_VOLUME = 0x08;
+static const uint8_t FAT_ATTRIBUTE_DIRECTORY = 0x10;
+static const uint8_t FAT_ATTRIBUTE_LONG_NAME = 0x0F;
+
+// Bounds on what damaged or hostile metadata can make us read. Files edited
+// here are boot configurations of a few KiB.
+static const uint32_t MAX_DIRECTORIES = 65536;
+static const uint32_t MAX_DIRECTORY_BYTES = 16 * 1024 * 1024;
+static const uint64_t MAX_FILE_BYTES = 16 * 1024 * 1024;
+// How much of the unreferenced ISO9660 space is read looking for zeros
+// before relocating a file gives up.
+static const uint64_t MAX_FREE_SCAN_BYTES = 64 * 1024 * 1024;
+
+// ============================================================================
+// BYTE ORDER AND NAMES
+// ============================================================================
+
+static uint16_t ReadLe16(const uint8_t* p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t ReadLe32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void WriteLe16(uint8_t* p, uint16_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void WriteLe32(uint8_t* p, uint32_t value) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static void WriteBe32(uint8_t* p, uint32_t value) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(value >> (8 * (3 - i)));
+}
+
+static std::wstring ToLower(std::wstring text) {
+    for (wchar_t& c : text) c = (wchar_t)towlower(c);
+    return text;
+}
+
+// Lower-case path components, empty ones dropped.
+static std::vector<std::wstring> SplitPath(const std::wstring& path) {
+    std::vector<std::wstring> parts;
+    size_t position = 0;
+    while (position <= path.size()) {
+        size_t slash = path.find_first_of(L"/\\", position);
+        if (slash == std::wstring::npos) slash = path.size();
+        if (slash > position) parts.push_back(ToLower(path.substr(position, slash - position)));
+        position = slash + 1;
+    }
+    return parts;
+}
+
+static uint32_t IsoSectors(uint64_t bytes) {
+    return (uint32_t)((bytes + ISO_SECTOR_SIZE - 1) / ISO_SECTOR_SIZE);
+}
+
+const wchar_t* VolumeTypeName(VolumeType type) {
+    switch (type) {
+        case VolumeType::Iso9660: return L"ISO9660";
+        case VolumeType::Fat12: return L"FAT12";
+        case VolumeType::Fat16: return L"FAT16";
+        case VolumeType::Fat32: return L"FAT32";
+        default: return L"unknown";
+    }
+}
+
+// ============================================================================
+// SECTOR ACCESS
+// ============================================================================
+
+VolumeEditor::VolumeEditor(BlockDevice& device, uint64_t offset) : m_device(device), m_offset(offset) {}
+
+bool VolumeEditor::Load(uint64_t offset, void* buffer, size_t length, std::wstring& error) {
+    if (length == 0) return true;
+    uint64_t sectorSize = std::max<uint32_t>(m_device.GetGeometry().logicalSectorSize, 512);
+    uint64_t absolute = m_offset + offset;
+    uint64_t begin = absolute / sectorSize * sectorSize;
+    uint64_t end = (absolute + length + sectorSize - 1) / sectorSize * sectorSize;
+    std::vector<uint8_t> span((size_t)(end - begin));
+    if (!m_device.Read(begin, span.data(), span.size())) {
+        error = L"Cannot read the volume at byte " + std::to_wstring(absolute);
+        return false;
+    }
+    memcpy(buffer, span.data() + (absolute - begin), length);
+    return true;
+}
+
+bool VolumeEditor::Store(uint64_t offset, const void* data, size_t length, std::wstring& error) {
+    if (length == 0) return true;
+    const DeviceGeometry& geometry = m_device.GetGeometry();
+    uint64_t logicalSize = std::max<uint32_t>(geometry.logicalSectorSize, 512);
+    uint64_t sectorSize = std::max<uint64_t>(GetWriteAlignment(geometry), logicalSize);
+    uint64_t absolute = m_offset + offset;
+    uint64_t begin = absolute / sectorSize * sectorSize;
+    uint64_t end = (absolute + length + sectorSize - 1) / sectorSize * sectorSize;
+    if (geometry.sizeBytes && end > geometry.sizeBytes && absolute + length <= geometry.sizeBytes) {
+        end = geometry.sizeBytes;   // a disk that ends part way into a physical sector
+    }
+    std::vector<uint8_t> current((size_t)(end - begin));
+    if (!m_device.Read(begin, current.data(), current.size())) {
+        error = L"Cannot read the volume at byte " + std::to_wstring(absolute);
+        return false;
+    }
+    std::vector<uint8_t> updated(current);
+    memcpy(updated.data() + (absolute - begin), data, length);
+
+    // Runs of sectors that differ, each written once.
+    size_t sectors = (current.size() + (size_t)sectorSize - 1) / (size_t)sectorSize;
+    auto sectorBytes = [&](size_t sector) {
+        return std::min<size_t>((size_t)sectorSize, current.size() - sector * (size_t)sectorSize);
+    };
+    for (size_t first = 0; first < sectors;) {
+        auto differs = [&](size_t sector) {
+            return memcmp(current.data() + sector * sectorSize, updated.data() + sector * sectorSize,
+                          sectorBytes(sector)) != 0;
+        };
+        if (!differs(first)) {
+            first++;
+            continue;
+        }
+        size_t last = first + 1;
+        while (last < sectors && differs(last)) last++;
+        size_t bytes = (last - 1 - first) * (size_t)sectorSize + sectorBytes(last - 1);
+        if (!m_device.Write(begin + first * sectorSize, updated.data() + first * sectorSize, bytes)) {
+            error = L"Cannot write the volume at byte " + std::to_wstring(begin + first * sectorSize);
+            return false;
+        }
+        m_sectorsWritten += bytes / logicalSize;
+        m_bytesWritten += bytes;
+        first = last;
+    }
+    return true;
+}
+
+// ============================================================================
+// ISO9660
+// ============================================================================
+
+// A directory record as found in a directory extent.
+struct IsoRecord {
+    uint32_t directory = 0;     // extent holding the record
+    uint32_t position = 0;      // of the record in that extent
+    uint32_t extent = 0;
+    uint32_t bytes = 0;
+    uint8_t flags = 0;
+    std::wstring name;
+};
+
+struct IsoTreeRoot {
+    uint32_t extent = 0;
+    uint32_t bytes = 0;
+    bool joliet = false;
+};
+
+// Sector ranges, half open.
+using SectorRange = std::pair<uint32_t, uint32_t>;
+
+class IsoVolumeEditor : public VolumeEditor {
+public:
+    IsoVolumeEditor(BlockDevice& device, uint64_t offset) : VolumeEditor(device, offset) {}
+
+    bool Open(std::wstring& error);
+
+    VolumeType GetType() const override { return VolumeType::Iso9660; }
+    bool List(const std::wstring& path, std::vector<VolumeFileEntry>& entries, std::wstring& error) override;
+    bool ReadFile(const std::wstring& path, std::string& contents, std::wstring& error) override;
+    bool WriteFile(const std::wstring& path, const std::string& contents, std::wstring& error) override;
+
+private:
+    const std::vector<IsoRecord>* ReadDirectory(uint32_t extent, uint32_t bytes, bool joliet, std::wstring& error);
+    bool Resolve(const std::wstring& path, IsoRecord& record, bool& joliet, std::wstring& error);
+    bool IndexVolume(std::wstring& error);
+    bool FindFreeExtent(uint32_t sectors, uint32_t& extent, std::wstring& error);
+    bool UpdateRecords(const IsoRecord& old, uint32_t extent, uint32_t bytes, std::wstring& error);
+
+    std::vector<IsoTreeRoot> m_trees;                       // the one with the real names first
+    uint32_t m_volumeSectors = 0;
+    std::vector<SectorRange> m_reserved;                    // descriptors, path tables, boot catalog and images
+    std::map<uint32_t, std::vector<uint8_t>> m_extents;     // directory contents
+    std::map<uint32_t, std::vector<IsoRecord>> m_listings;  // their records, by extent
+    bool m_rockRidge = false;
+    bool m_indexed = false;
+    std::vector<IsoRecord> m_files;                         // every file record of every tree
+    std::vector<SectorRange> m_used;                        // sorted and merged
+};
+
+// Rock Ridge keeps the POSIX name in NM entries of the system use area
+// after the file identifier.
+static std::wstring RockRidgeName(const uint8_t* record, uint8_t length) {
+    uint8_t nameLength = record[32];
+    size_t position = 33u + nameLength + (nameLength % 2 == 0 ? 1 : 0);
+    std::string name;
+    while (position + 4 <= length) {
+        const uint8_t* entry = record + position;
+        uint8_t entryLength = entry[2];
+        if (entryLength < 4 || position + entryLength > length) break;
+        if (entry[0] == 'S' && entry[1] == 'T') break;
+        // Flags 0x02 and 0x04 stand for "." and "..".
+        if (entry[0] == 'N' && entry[1] == 'M' && entryLength >= 5 && (entry[4] & 0x06) == 0) {
+            name.append((const char*)entry + 5, entryLength - 5);
+        }
+        position += entryLength;
+    }
+    return name.empty() ? std::wstring() : Utf8ToWide(name);
+}
+
+bool IsoVolumeEditor::Open(std::wstring& error) {
+    uint32_t catalog = 0;
+    uint32_t descriptorEnd = ISO_FIRST_DESCRIPTOR;
+    IsoTreeRoot primary, joliet;
+    for (uint32_t index = 0; index < ISO_MAX_DESCRIPTORS; index++) {
+        uint32_t sector = ISO_FIRST_DESCRIPTOR + index;
+        uint8_t descriptor[ISO_SECTOR_SIZE];
+        if (!Load((uint64_t)sector * ISO_SECTOR_SIZE, descriptor, sizeof(descriptor), error)) {
+            return false;
+        }
+        if (memcmp(descriptor + 1, "CD001", 5) != 0) {
+            break;
+        }
+        descriptorEnd = sector + 1;
+        if (descriptor[0] == DESCRIPTOR_TERMINATOR) {
+            break;
+        }
+        if (descriptor[0] == DESCRIPTOR_BOOT_RECORD && memcmp(descriptor + 7, "EL TORITO SPECIFICATION", 23) == 0) {
+            catalog = ReadLe32(descriptor + 71);
+            continue;
+        }
+        bool isJoliet = descriptor[0] == DESCRIPTOR_SUPPLEMENTARY && descriptor[88] == '%' && descriptor[89] == '/' &&
+                        (descriptor[90] == '@' || descriptor[90] == 'C' || descriptor[90] == 'E');
+        if (!(descriptor[0] == DESCRIPTOR_PRIMARY && primary.extent == 0) && !(isJoliet && joliet.extent == 0)) {
+            continue;
+        }
+
+        // Type L path tables are little-endian, type M big-endian.
+        uint32_t pathTableSectors = IsoSectors(ReadLe32(descriptor + 132));
+        uint32_t pathTables[] = {ReadLe32(descriptor + 140), ReadLe32(descriptor + 144),
+                                 (uint32_t)descriptor[148] << 24 | (uint32_t)descriptor[149] << 16 |
+                                     (uint32_t)descriptor[150] << 8 | descriptor[151],
+                                 (uint32_t)descriptor[152] << 24 | (uint32_t)descriptor[153] << 16 |
+                                     (uint32_t)descriptor[154] << 8 | descriptor[155]};
+        for (uint32_t table : pathTables) {
+            if (table) m_reserved.push_back({table, table + pathTableSectors});
+        }
+        IsoTreeRoot& root = isJoliet ? joliet : primary;
+        root.extent = ReadLe32(descriptor + 156 + 2);
+        root.bytes = ReadLe32(descriptor + 156 + 10);
+        root.joliet = isJoliet;
+        if (!isJoliet) m_volumeSectors = ReadLe32(descriptor + 80);
+    }
+    if (primary.extent == 0) {
+        error = L"No ISO9660 primary volume descriptor";
+        return false;
+    }
+    m_reserved.push_back({0, descriptorEnd});
+
+    // The catalog and every image it loads, whether or not a file names it.
+    if (catalog) {
+        m_reserved.push_back({catalog, catalog + 1});
+        uint8_t entries[ISO_SECTOR_SIZE];
+        if (Load((uint64_t)catalog * ISO_SECTOR_SIZE, entries, sizeof(entries), error)) {
+            for (size_t position = 32; position + 32 <= sizeof(entries); position += 32) {
+                const uint8_t* entry = entries + position;
+                uint32_t load = ReadLe32(entry + 8);
+                if ((entry[0] == 0x88 || entry[0] == 0x00) && load != 0) {
+                    uint32_t sectors = std::max<uint32_t>(1, IsoSectors((uint64_t)ReadLe16(entry + 6) * 512));
+                    m_reserved.push_back({load, load + sectors});
+                }
+            }
+        }
+    }
+
+    // Rock Ridge names beat Joliet's, which beat the primary's 8.3 ones.
+    if (!ReadDirectory(primary.extent, primary.bytes, false, error)) {
+        return false;
+    }
+    m_trees.push_back(primary);
+    if (joliet.extent) {
+        m_trees.insert(m_rockRidge ? m_trees.end() : m_trees.begin(), joliet);
+    }
+    return true;
+}
+
+const std::vector<IsoRecord>* IsoVolumeEditor::ReadDirectory(uint32_t extent, uint32_t bytes, bool joliet,
+                                                             std::wstring& error) {
+    auto cached = m_listings.find(extent);
+    if (cached != m_listings.end()) return &cached->second;
+
+    std::vector<uint8_t> data((size_t)IsoSectors(std::min(bytes, MAX_DIRECTORY_BYTES)) * ISO_SECTOR_SIZE);
+    if (!Load((uint64_t)extent * ISO_SECTOR_SIZE, data.data(), data.size(), error)) {
+        return nullptr;
+    }
+    std::vector<IsoRecord> records;
+    // Records never span sectors; a zero length pads to the next one.
+    size_t position = 0;
+    while (position + 34 <= data.size()) {
+        uint8_t length = data[position];
+        if (length == 0) {
+            position = (position / ISO_SECTOR_SIZE + 1) * ISO_SECTOR_SIZE;
+            continue;
+        }
+        if (length < 34 || position + length > data.size()) break;
+        const uint8_t* record = data.data() + position;
+        uint8_t nameLength = record[32];
+        if (33u + nameLength <= length && !(nameLength == 1 && record[33] <= 1)) {
+            IsoRecord entry;
+            entry.directory = extent;
+            entry.position = (uint32_t)position;
+            entry.extent = ReadLe32(record + 2);
+            entry.bytes = ReadLe32(record + 10);
+            entry.flags = record[25];
+            const uint8_t* name = record + 33;
+            if (joliet) {
+                for (uint8_t i = 0; i + 1 < nameLength; i += 2) {
+                    entry.name.push_back((wchar_t)((name[i] << 8) | name[i + 1]));
+                }
+            } else {
+                entry.name = RockRidgeName(record, length);
+                m_rockRidge = m_rockRidge || !entry.name.empty();
+            }
+            if (entry.name.empty()) {
+                entry.name.assign(name, name + nameLength);
+                size_t version = entry.name.find(L';');
+                if (version != std::wstring::npos) entry.name.resize(version);
+                if (!entry.name.empty() && entry.name.back() == L'.') entry.name.pop_back();
+            }
+            records.push_back(entry);
+        }
+        position += length;
+    }
+    m_extents[extent].swap(data);
+    return &(m_listings[extent] = std::move(records));
+}
+
+bool IsoVolumeEditor::Resolve(const std::wstring& path, IsoRecord& record, bool& joliet, std::wstring& error) {
+    std::vector<std::wstring> parts = SplitPath(path);
+    for (const IsoTreeRoot& tree : m_trees) {
+        IsoRecord current;
+        current.extent = tree.extent;
+        current.bytes = tree.bytes;
+        current.flags = ISO_FLAG_DIRECTORY;
+        bool found = true;
+        for (const std::wstring& part : parts) {
+            const std::vector<IsoRecord>* records =
+                (current.flags & ISO_FLAG_DIRECTORY) ? ReadDirectory(current.extent, current.bytes, tree.joliet, error)
+                                                     : nullptr;
+            auto it = records ? std::find_if(records->begin(), records->end(),
+                                             [&](const IsoRecord& entry) { return ToLower(entry.name) == part; })
+                              : std::vector<IsoRecord>::const_iterator();
+            if (!records || it == records->end()) {
+                found = false;
+                break;
+            }
+            current = *it;
+        }
+        if (found) {
+            record = current;
+            joliet = tree.joliet;
+            return true;
+        }
+    }
+    error = L"Not found on the ISO9660 volume: " + path;
+    return false;
+}
+
+bool IsoVolumeEditor::List(const std::wstring& path, std::vector<VolumeFileEntry>& entries, std::wstring& error) {
+    entries.clear();
+    IsoRecord directory;
+    bool joliet = false;
+    if (!Resolve(path, directory, joliet, error)) return false;
+    if (!(directory.flags & ISO_FLAG_DIRECTORY)) {
+        error = L"Not a directory: " + path;
+        return false;
+    }
+    const std::vector<IsoRecord>* records = ReadDirectory(directory.extent, directory.bytes, joliet, error);
+    if (!records) return false;
+    for (const IsoRecord& record : *records) {
+        VolumeFileEntry entry;
+        entry.name = record.name;
+        entry.size = record.bytes;
+        entry.directory = (record.flags & ISO_FLAG_DIRECTORY) != 0;
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+bool IsoVolumeEditor::ReadFile(const std::wstring& path, std::string& contents, std::wstring& error) {
+    IsoRecord record;
+    bool joliet = false;
+    if (!Resolve(path, record, joliet, error)) return false;
+    if (record.flags & (ISO_FLAG_DIRECTORY | ISO_FLAG_MULTI_EXTENT)) {
+        error = L"Not a single-extent file: " + path;
+        return false;
+    }
+    if (record.bytes > MAX_FILE_BYTES) {
+        error = L"Too large to edit: " + path;
+        return false;
+    }
+    contents.resize(record.bytes);
+    return Load((uint64_t)record.extent * ISO_SECTOR_SIZE, &contents[0], contents.size(), error);
+}
+
+bool IsoVolumeEditor::WriteFile(const std::wstring& path, const std::string& contents, std::wstring& error) {
+    IsoRecord record;
+    bool joliet = false;
+    if (!Resolve(path, record, joliet, error)) return false;
+    if (record.flags & (ISO_FLAG_DIRECTORY | ISO_FLAG_MULTI_EXTENT)) {
+        error = L"Not a single-extent file: " + path;
+        return false;
+    }
+    // Empty files may all share one extent, so theirs cannot be told apart.
+    if (record.bytes == 0 || contents.size() > MAX_FILE_BYTES) {
+        error = L"Cannot edit a file of this size: " + path;
+        return false;
+    }
+    if (!IndexVolume(error)) return false;
+
+    uint32_t sectors = IsoSectors(contents.size());
+    uint32_t extent = record.extent;
+    if (sectors > IsoSectors(record.bytes) && !FindFreeExtent(sectors, extent, error)) {
+        return false;
+    }
+    // The rest of the last sector is zeroed, as mastering tools leave it.
+    std::vector<uint8_t> data((size_t)sectors * ISO_SECTOR_SIZE, 0);
+    memcpy(data.data(), contents.data(), contents.size());
+    if (!Store((uint64_t)extent * ISO_SECTOR_SIZE, data.data(), data.size(), error)) {
+        return false;
+    }
+    return UpdateRecords(record, extent, (uint32_t)contents.size(), error);
+}
+
+// Every file record and every sector anything refers to, for the records
+// that share an extent (the primary and Joliet trees name each file once)
+// and for finding free space.
+bool IsoVolumeEditor::IndexVolume(std::wstring& error) {
+    if (m_indexed) return true;
+    std::vector<SectorRange> used = m_reserved;
+    std::set<uint32_t> visited;
+    struct Pending {
+        uint32_t extent;
+        uint32_t bytes;
+        bool joliet;
+    };
+    std::vector<Pending> queue;
+    for (const IsoTreeRoot& tree : m_trees) queue.push_back({tree.extent, tree.bytes, tree.joliet});
+    for (size_t next = 0; next < queue.size() && visited.size() < MAX_DIRECTORIES; next++) {
+        Pending directory = queue[next];
+        if (!visited.insert(directory.extent).second) continue;
+        used.push_back({directory.extent, directory.extent + IsoSectors(directory.bytes)});
+        const std::vector<IsoRecord>* records = ReadDirectory(directory.extent, directory.bytes, directory.joliet, error);
+        if (!records) return false;
+        for (const IsoRecord& record : *records) {
+            if (record.flags & ISO_FLAG_DIRECTORY) {
+                queue.push_back({record.extent, record.bytes, directory.joliet});
+                continue;
+            }
+            m_files.push_back(record);
+            if (record.bytes) used.push_back({record.extent, record.extent + IsoSectors(record.bytes)});
+        }
+    }
+
+    std::sort(used.begin(), used.end());
+    for (const SectorRange& range : used) {
+        if (!m_used.empty() && range.first <= m_used.back().second) {
+            m_used.back().second = std::max(m_used.back().second, range.second);
+        } else {
+            m_used.push_back(range);
+        }
+    }
+    m_indexed = true;
+    return true;
+}
+
+// Sectors inside the volume space that nothing refers to. Mastering tools
+// zero their padding; anything else there (hidden files, checksum tags) is
+// not ours to overwrite, so only zero-filled runs are taken.
+bool IsoVolumeEditor::FindFreeExtent(uint32_t sectors, uint32_t& extent, std::wstring& error) {
+    uint64_t scanned = 0;
+    uint32_t gapStart = 0;
+    std::vector<uint8_t> data((size_t)sectors * ISO_SECTOR_SIZE);
+    for (size_t index = 0; index <= m_used.size() && scanned < MAX_FREE_SCAN_BYTES; index++) {
+        uint32_t gapEnd = index < m_used.size() ? std::min(m_used[index].first, m_volumeSectors) : m_volumeSectors;
+        uint32_t start = gapStart;
+        while (gapEnd >= start && gapEnd - start >= sectors && scanned < MAX_FREE_SCAN_BYTES) {
+            if (!Load((uint64_t)start * ISO_SECTOR_SIZE, data.data(), data.size(), error)) return false;
+            scanned += data.size();
+            uint32_t lastUsed = sectors;
+            for (uint32_t sector = 0; sector < sectors; sector++) {
+                const uint8_t* bytes = data.data() + (size_t)sector * ISO_SECTOR_SIZE;
+                if (std::any_of(bytes, bytes + ISO_SECTOR_SIZE, [](uint8_t b) { return b != 0; })) lastUsed = sector;
+            }
+            if (lastUsed == sectors) {
+                extent = start;
+                m_used.push_back({start, start + sectors});
+                std::sort(m_used.begin(), m_used.end());
+                return true;
+            }
+            start += lastUsed + 1;
+        }
+        if (index < m_used.size()) gapStart = std::max(gapStart, m_used[index].second);
+    }
+    error = L"No free space in the ISO9660 volume to grow the file; copy the image in file mode instead";
+    return false;
+}
+
+// Points every record of the file at its new extent and length. The data
+// is written before this, so a record is never left naming stale sectors.
+bool IsoVolumeEditor::UpdateRecords(const IsoRecord& old, uint32_t extent, uint32_t bytes, std::wstring& error) {
+    for (IsoRecord& file : m_files) {
+        if (file.extent != old.extent || file.bytes != old.bytes) continue;
+        std::vector<uint8_t>& data = m_extents[file.directory];
+        uint8_t* record = data.data() + file.position;
+        WriteLe32(record + 2, extent);
+        WriteBe32(record + 6, extent);
+        WriteLe32(record + 10, bytes);
+        WriteBe32(record + 14, bytes);
+        if (!Store((uint64_t)file.directory * ISO_SECTOR_SIZE + file.position, record, 34, error)) {
+            return false;
+        }
+        for (IsoRecord& listed : m_listings[file.directory]) {
+            if (listed.position == file.position) {
+                listed.extent = extent;
+                listed.bytes = bytes;
+            }
+        }
+        file.extent = extent;
+        file.bytes = bytes;
+    }
+    return true;
+}
+
+// ============================================================================
+// FAT
+// ============================================================================
+
+struct FatEntry {
+    std::wstring name;          // long name, or the 8.3 name
+    std::wstring shortName;
+    uint8_t attributes = 0;
+    uint32_t cluster = 0;
+    uint32_t size = 0;
+    uint64_t position = 0;      // of the 32-byte short entry in the volume
+};
+
+class FatVolumeEditor : public VolumeEditor {
+public:
+    FatVolumeEditor(BlockDevice& device, uint64_t offset) : VolumeEditor(device, offset) {}
+
+    bool Open(uint64_t length, std::wstring& error);
+
+    VolumeType GetType() const override { return m_type; }
+    bool List(const std::wstring& path, std::vector<VolumeFileEntry>& entries, std::wstring& error) override;
+    bool ReadFile(const std::wstring& path, std::string& contents, std::wstring& error) override;
+    bool WriteFile(const std::wstring& path, const std::string& contents, std::wstring& error) override;
+
+private:
+    bool ReadDirectory(uint32_t cluster, std::vector<FatEntry>& entries, std::wstring& error);
+    bool Resolve(const std::wstring& path, FatEntry& entry, std::wstring& error);
+    bool GetChain(uint32_t first, std::vector<uint32_t>& chain, std::wstring& error);
+    bool GetNext(uint32_t cluster, uint32_t& next, std::wstring& error);
+    bool SetNext(uint32_t cluster, uint32_t next, std::wstring& error);
+    uint8_t* FatByte(uint64_t index, bool dirty, std::wstring& error);
+    bool FlushFat(std::wstring& error);
+    bool Allocate(uint32_t count, std::vector<uint32_t>& clusters, std::wstring& error);
+    bool UpdateFsInfo(int64_t freeDelta, std::wstring& error);
+
+    uint64_t ClusterOffset(uint32_t cluster) const {
+        return m_dataStart + (uint64_t)(cluster - 2) * m_clusterBytes;
+    }
+    uint32_t EndOfChain() const {
+        return m_type == VolumeType::Fat12 ? 0xFFF : m_type == VolumeType::Fat16 ? 0xFFFF : 0x0FFFFFFF;
+    }
+
+    VolumeType m_type = VolumeType::Unknown;
+    uint32_t m_sectorSize = 0;
+    uint32_t m_clusterBytes = 0;
+    uint32_t m_reserved = 0;
+    uint32_t m_fats = 0;
+    uint32_t m_fatSectors = 0;
+    uint32_t m_clusters = 0;            // data clusters, numbered from 2
+    uint32_t m_rootCluster = 0;         // FAT32; 0 for the fixed root directory of FAT12/16
+    uint64_t m_rootStart = 0;
+    uint32_t m_rootBytes = 0;
+    uint64_t m_dataStart = 0;
+    uint32_t m_fsInfoSector = 0;
+    uint32_t m_nextFree = 2;
+    std::map<uint32_t, std::vector<uint8_t>> m_fat;     // sectors of the first FAT read so far
+    std::set<uint32_t> m_dirtyFat;
+};
+
+static bool IsPowerOfTwo(uint32_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+bool FatVolumeEditor::Open(uint64_t length, std::wstring& error) {
+    uint8_t boot[512];
+    if (!Load(0, boot, sizeof(boot), error)) return false;
+    m_sectorSize = ReadLe16(boot + 11);
+    uint32_t clusterSectors = boot[13];
+    m_reserved = ReadLe16(boot + 14);
+    m_fats = boot[16];
+    uint32_t rootEntries = ReadLe16(boot + 17);
+    uint64_t totalSectors = ReadLe16(boot + 19) ? ReadLe16(boot + 19) : ReadLe32(boot + 32);
+    m_fatSectors = ReadLe16(boot + 22) ? ReadLe16(boot + 22) : ReadLe32(boot + 36);
+    if (ReadLe16(boot + 510) != 0xAA55 || m_sectorSize < 512 || m_sectorSize > 4096 || !IsPowerOfTwo(m_sectorSize) ||
+        !IsPowerOfTwo(clusterSectors) || m_reserved == 0 || m_fats == 0 || m_fats > 4 || m_fatSectors == 0) {
+        error = L"No FAT boot sector";
+        return false;
+    }
+    if (length) totalSectors = std::min<uint64_t>(totalSectors, length / m_sectorSize);
+
+    m_clusterBytes = clusterSectors * m_sectorSize;
+    uint64_t rootSectors = ((uint64_t)rootEntries * 32 + m_sectorSize - 1) / m_sectorSize;
+    uint64_t rootSector = m_reserved + (uint64_t)m_fats * m_fatSectors;
+    uint64_t dataSector = rootSector + rootSectors;
+    if (dataSector >= totalSectors) {
+        error = L"FAT boot sector leaves no data area";
+        return false;
+    }
+    // The cluster count alone decides the FAT type.
+    m_clusters = (uint32_t)std::min<uint64_t>((totalSectors - dataSector) / clusterSectors, 0x0FFFFFF5);
+    m_type = m_clusters < 4085 ? VolumeType::Fat12 : m_clusters < 65525 ? VolumeType::Fat16 : VolumeType::Fat32;
+    uint64_t entryBits = m_type == VolumeType::Fat12 ? 12 : m_type == VolumeType::Fat16 ? 16 : 32;
+    if ((uint64_t)m_fatSectors * m_sectorSize * 8 / entryBits < (uint64_t)m_clusters + 2) {
+        error = L"FAT too small for the volume";
+        return false;
+    }
+    m_rootStart = rootSector * m_sectorSize;
+    m_rootBytes = rootEntries * 32;
+    m_dataStart = dataSector * m_sectorSize;
+    if (m_type == VolumeType::Fat32) {
+        m_rootCluster = ReadLe32(boot + 44);
+        m_fsInfoSector = ReadLe16(boot + 48);
+        if (m_rootCluster < 2 || m_rootCluster >= m_clusters + 2) {
+            error = L"FAT32 root directory out of range";
+            return false;
+        }
+        uint8_t fsInfo[512];
+        if (m_fsInfoSector > 0 && m_fsInfoSector < m_reserved &&
+            Load((uint64_t)m_fsInfoSector * m_sectorSize, fsInfo, sizeof(fsInfo), error) &&
+            ReadLe32(fsInfo) == 0x41615252 && ReadLe32(fsInfo + 484) == 0x61417272) {
+            uint32_t hint = ReadLe32(fsInfo + 492);
+            if (hint >= 2 && hint < m_clusters + 2) m_nextFree = hint;
+        } else {
+            m_fsInfoSector = 0;
+        }
+    }
+    return true;
+}
+
+uint8_t* FatVolumeEditor::FatByte(uint64_t index, bool dirty, std::wstring& error) {
+    uint32_t sector = (uint32_t)(index / m_sectorSize);
+    auto cached = m_fat.find(sector);
+    if (cached == m_fat.end()) {
+        std::vector<uint8_t> data(m_sectorSize);
+        if (sector >= m_fatSectors ||
+            !Load((uint64_t)(m_reserved + sector) * m_sectorSize, data.data(), data.size(), error)) {
+            if (sector >= m_fatSectors) error = L"FAT entry out of range";
+            return nullptr;
+        }
+        cached = m_fat.emplace(sector, std::move(data)).first;
+    }
+    if (dirty) m_dirtyFat.insert(sector);
+    return cached->second.data() + index % m_sectorSize;
+}
+
+bool FatVolumeEditor::GetNext(uint32_t cluster, uint32_t& next, std::wstring& error) {
+    if (m_type == VolumeType::Fat12) {
+        // 12-bit entries pack two into three bytes and may straddle sectors.
+        uint64_t index = cluster + cluster / 2;
+        uint8_t* low = FatByte(index, false, error);
+        uint8_t value = low ? *low : 0;
+        uint8_t* high = low ? FatByte(index + 1, false, error) : nullptr;
+        if (!high) return false;
+        uint32_t pair = value | (uint32_t)*high << 8;
+        next = cluster & 1 ? pair >> 4 : pair & 0xFFF;
+        return true;
+    }
+    uint32_t width = m_type == VolumeType::Fat16 ? 2 : 4;
+    uint8_t bytes[4] = {0};
+    for (uint32_t i = 0; i < width; i++) {
+        uint8_t* p = FatByte((uint64_t)cluster * width + i, false, error);
+        if (!p) return false;
+        bytes[i] = *p;
+    }
+    next = width == 2 ? ReadLe16(bytes) : ReadLe32(bytes) & 0x0FFFFFFF;
+    return true;
+}
+
+bool FatVolumeEditor::SetNext(uint32_t cluster, uint32_t next, std::wstring& error) {
+    if (m_type == VolumeType::Fat12) {
+        uint64_t index = cluster + cluster / 2;
+        uint8_t* low = FatByte(index, true, error);
+        uint8_t* high = low ? FatByte(index + 1, true, error) : nullptr;
+        if (!high) return false;
+        if (cluster & 1) {
+            *low = (uint8_t)((*low & 0x0F) | (next << 4));
+            *high = (uint8_t)(next >> 4);
+        } else {
+            *low = (uint8_t)next;
+            *high = (uint8_t)((*high & 0xF0) | ((next >> 8) & 0x0F));
+        }
+        return true;
+    }
+    uint32_t width = m_type == VolumeType::Fat16 ? 2 : 4;
+    uint32_t value = next;
+    if (width == 4) {
+        // The top four bits of a FAT32 entry are reserved and kept.
+        uint8_t* top = FatByte((uint64_t)cluster * 4 + 3, false, error);
+        if (!top) return false;
+        value = (next & 0x0FFFFFFF) | (uint32_t)(*top & 0xF0) << 24;
+    }
+    for (uint32_t i = 0; i < width; i++) {
+        uint8_t* p = FatByte((uint64_t)cluster * width + i, true, error);
+        if (!p) return false;
+        *p = (uint8_t)(value >> (8 * i));
+    }
+    return true;
+}
+
+bool FatVolumeEditor::GetChain(uint32_t first, std::vector<uint32_t>& chain, std::wstring& error) {
+    chain.clear();
+    uint32_t endOfChain = EndOfChain() & ~7u;
+    for (uint32_t cluster = first; cluster < endOfChain;) {
+        if (cluster < 2 || cluster >= m_clusters + 2 || chain.size() > m_clusters) {
+            error = L"Broken FAT cluster chain";
+            return false;
+        }
+        chain.push_back(cluster);
+        if (!GetNext(cluster, cluster, error)) return false;
+    }
+    return true;
+}
+
+// Every copy of the FAT gets the changed sectors of the first.
+bool FatVolumeEditor::FlushFat(std::wstring& error) {
+    for (uint32_t sector : m_dirtyFat) {
+        const std::vector<uint8_t>& data = m_fat[sector];
+        for (uint32_t copy = 0; copy < m_fats; copy++) {
+            uint64_t offset = ((uint64_t)m_reserved + (uint64_t)copy * m_fatSectors + sector) * m_sectorSize;
+            if (!Store(offset, data.data(), data.size(), error)) return false;
+        }
+    }
+    m_dirtyFat.clear();
+    return true;
+}
+
+// Free clusters from the last allocation on, linked into a chain of their
+// own in the cached FAT.
+bool FatVolumeEditor::Allocate(uint32_t count, std::vector<uint32_t>& clusters, std::wstring& error) {
+    clusters.clear();
+    uint32_t cluster = m_nextFree;
+    for (uint32_t checked = 0; checked < m_clusters && clusters.size() < count; checked++) {
+        uint32_t next = 0;
+        if (!GetNext(cluster, next, error)) return false;
+        if (next == 0) clusters.push_back(cluster);
+        cluster = cluster + 1 < m_clusters + 2 ? cluster + 1 : 2;
+    }
+    if (clusters.size() < count) {
+        error = L"The FAT volume is full";
+        return false;
+    }
+    for (size_t i = 0; i < clusters.size(); i++) {
+        if (!SetNext(clusters[i], i + 1 < clusters.size() ? clusters[i + 1] : EndOfChain(), error)) return false;
+    }
+    m_nextFree = cluster;
+    return true;
+}
+
+bool FatVolumeEditor::UpdateFsInfo(int64_t freeDelta, std::wstring& error) {
+    if (m_fsInfoSector == 0) return true;
+    uint8_t fsInfo[512];
+    uint64_t offset = (uint64_t)m_fsInfoSector * m_sectorSize;
+    if (!Load(offset, fsInfo, sizeof(fsInfo), error)) return false;
+    // 0xFFFFFFFF means the count is unknown and left for a full scan.
+    uint32_t freeClusters = ReadLe32(fsInfo + 488);
+    if (freeClusters != 0xFFFFFFFF) {
+        int64_t updated = std::max<int64_t>(0, (int64_t)freeClusters + freeDelta);
+        WriteLe32(fsInfo + 488, (uint32_t)std::min<int64_t>(updated, m_clusters));
+    }
+    WriteLe32(fsInfo + 492, m_nextFree);
+    return Store(offset, fsInfo, sizeof(fsInfo), error);
+}
+
+static uint8_t ShortNameChecksum(const uint8_t* name) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + name[i]);
+    return sum;
+}
+
+static std::wstring ShortNamePart(const uint8_t* field, size_t length, bool lowerCase) {
+    std::wstring part(field, field + length);
+    while (!part.empty() && part.back() == L' ') part.pop_back();
+    if (!part.empty() && part[0] == 0x05) part[0] = 0xE5;
+    return lowerCase ? ToLower(part) : part;
+}
+
+// `cluster` 0 is the fixed root directory of FAT12/16.
+bool FatVolumeEditor::ReadDirectory(uint32_t cluster, std::vector<FatEntry>& entries, std::wstring& error) {
+    entries.clear();
+    std::vector<std::pair<uint64_t, uint32_t>> extents;
+    if (cluster == 0) {
+        extents.push_back({m_rootStart, m_rootBytes});
+    } else {
+        std::vector<uint32_t> chain;
+        if (!GetChain(cluster, chain, error)) return false;
+        for (uint32_t link : chain) extents.push_back({ClusterOffset(link), m_clusterBytes});
+    }
+
+    std::wstring longName;
+    uint8_t longChecksum = 0;
+    uint64_t total = 0;
+    std::vector<uint8_t> data;
+    for (const auto& extent : extents) {
+        total += extent.second;
+        if (total > MAX_DIRECTORY_BYTES) break;
+        data.resize(extent.second);
+        if (!Load(extent.first, data.data(), data.size(), error)) return false;
+        for (size_t position = 0; position + 32 <= data.size(); position += 32) {
+            const uint8_t* record = data.data() + position;
+            if (record[0] == 0x00) return true;
+            if (record[0] == 0xE5) {
+                longName.clear();
+                continue;
+            }
+            if ((record[11] & 0x3F) == FAT_ATTRIBUTE_LONG_NAME) {
+                // Long name pieces come last piece first.
+                if (record[0] & 0x40) {
+                    longName.clear();
+                    longChecksum = record[13];
+                }
+                std::wstring piece;
+                static const int CHARACTERS[] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+                for (int offset : CHARACTERS) {
+                    uint16_t c = ReadLe16(record + offset);
+                    if (c == 0 || c == 0xFFFF) break;
+                    piece.push_back((wchar_t)c);
+                }
+                longName = piece + longName;
+                continue;
+            }
+            if (record[11] & FAT_ATTRIBUTE_VOLUME) {
+                longName.clear();
+                continue;
+            }
+
+            FatEntry entry;
+            std::wstring base = ShortNamePart(record, 8, (record[12] & 0x08) != 0);
+            std::wstring extension = ShortNamePart(record + 8, 3, (record[12] & 0x10) != 0);
+            entry.shortName = extension.empty() ? base : base + L"." + extension;
+            entry.name = !longName.empty() && longChecksum == ShortNameChecksum(record) ? longName : entry.shortName;
+            longName.clear();
+            if (entry.shortName == L"." || entry.shortName == L"..") continue;
+            entry.attributes = record[11];
+            entry.cluster = (uint32_t)ReadLe16(record + 20) << 16 | ReadLe16(record + 26);
+            if (m_type != VolumeType::Fat32) entry.cluster &= 0xFFFF;
+            entry.size = ReadLe32(record + 28);
+            entry.position = extent.first + position;
+            entries.push_back(entry);
+        }
+    }
+    return true;
+}
+
+bool FatVolumeEditor::Resolve(const std::wstring& path, FatEntry& entry, std::wstring& error) {
+    FatEntry current;
+    current.attributes = FAT_ATTRIBUTE_DIRECTORY;
+    current.cluster = m_rootCluster;
+    std::vector<FatEntry> entries;
+    for (const std::wstring& part : SplitPath(path)) {
+        if (!(current.attributes & FAT_ATTRIBUTE_DIRECTORY) || !ReadDirectory(current.cluster, entries, error)) {
+            error = L"Not found on the FAT volume: " + path;
+            return false;
+        }
+        auto it = std::find_if(entries.begin(), entries.end(), [&](const FatEntry& candidate) {
+            return ToLower(candidate.name) == part || ToLower(candidate.shortName) == part;
+        });
+        if (it == entries.end()) {
+            error = L"Not found on the FAT volume: " + path;
+            return false;
+        }
+        current = *it;
+    }
+    entry = current;
+    return true;
+}
+
+bool FatVolumeEditor::List(const std::wstring& path, std::vector<VolumeFileEntry>& entries, std::wstring& error) {
+    entries.clear();
+    FatEntry directory;
+    std::vector<FatEntry> records;
+    if (!Resolve(path, directory, error)) return false;
+    if (!(directory.attributes & FAT_ATTRIBUTE_DIRECTORY)) {
+        error = L"Not a directory: " + path;
+        return false;
+    }
+    if (!ReadDirectory(directory.cluster, records, error)) return false;
+    for (const FatEntry& record : records) {
+        VolumeFileEntry entry;
+        entry.name = record.name;
+        entry.size = record.size;
+        entry.directory = (record.attributes & FAT_ATTRIBUTE_DIRECTORY) != 0;
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+bool FatVolumeEditor::ReadFile(const std::wstring& path, std::string& contents, std::wstring& error) {
+    FatEntry entry;
+    std::vector<uint32_t> chain;
+    if (!Resolve(path, entry, error)) return false;
+    if ((entry.attributes & FAT_ATTRIBUTE_DIRECTORY) || entry.size > MAX_FILE_BYTES) {
+        error = L"Not a file that can be edited: " + path;
+        return false;
+    }
+    if (entry.size && !GetChain(entry.cluster, chain, error)) return false;
+    if ((uint64_t)chain.size() * m_clusterBytes < entry.size) {
+        error = L"FAT cluster chain shorter than the file: " + path;
+        return false;
+    }
+    contents.resize(entry.size);
+    for (size_t i = 0; i * m_clusterBytes < contents.size(); i++) {
+        size_t bytes = std::min<size_t>(m_clusterBytes, contents.size() - i * m_clusterBytes);
+        if (!Load(ClusterOffset(chain[i]), &contents[i * m_clusterBytes], bytes, error)) return false;
+    }
+    return true;
+}
+
+// Data first, then the FAT linking in any new clusters, then the directory
+// entry, and clusters the file no longer needs are freed last: an
+// interrupted edit leaves lost clusters at worst, never cross-linked ones.
+bool FatVolumeEditor::WriteFile(const std::wstring& path, const std::string& contents, std::wstring& error) {
+    FatEntry entry;
+    std::vector<uint32_t> chain, added;
+    if (!Resolve(path, entry, error)) return false;
+    if ((entry.attributes & FAT_ATTRIBUTE_DIRECTORY) || contents.size() > MAX_FILE_BYTES) {
+        error = L"Not a file that can be edited: " + path;
+        return false;
+    }
+    if (entry.cluster && !GetChain(entry.cluster, chain, error)) return false;
+
+    size_t needed = (contents.size() + m_clusterBytes - 1) / m_clusterBytes;
+    if (needed > chain.size() && !Allocate((uint32_t)(needed - chain.size()), added, error)) return false;
+    std::vector<uint32_t> clusters(chain);
+    clusters.insert(clusters.end(), added.begin(), added.end());
+
+    // The rest of the last sector is zeroed; the rest of the cluster is left.
+    std::vector<uint8_t> data;
+    for (size_t i = 0; i < needed; i++) {
+        size_t bytes = std::min<size_t>(m_clusterBytes, contents.size() - i * m_clusterBytes);
+        data.assign((bytes + m_sectorSize - 1) / m_sectorSize * m_sectorSize, 0);
+        memcpy(data.data(), contents.data() + i * m_clusterBytes, bytes);
+        if (!Store(ClusterOffset(clusters[i]), data.data(), data.size(), error)) return false;
+    }
+    if (!added.empty()) {
+        if (!chain.empty() && !SetNext(chain.back(), added.front(), error)) return false;
+        if (!FlushFat(error)) return false;
+    }
+
+    uint8_t record[32];
+    if (!Load(entry.position, record, sizeof(record), error)) return false;
+    uint32_t first = needed ? clusters.front() : 0;
+    WriteLe16(record + 20, m_type == VolumeType::Fat32 ? (uint16_t)(first >> 16) : ReadLe16(record + 20));
+    WriteLe16(record + 26, (uint16_t)first);
+    WriteLe32(record + 28, (uint32_t)contents.size());
+    time_t now = time(nullptr);
+    struct tm local = {};
+#ifdef _WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    uint16_t date = (uint16_t)(std::max(local.tm_year - 80, 0) << 9 | (local.tm_mon + 1) << 5 | local.tm_mday);
+    WriteLe16(record + 18, date);
+    WriteLe16(record + 22, (uint16_t)(local.tm_hour << 11 | local.tm_min << 5 | local.tm_sec / 2));
+    WriteLe16(record + 24, date);
+    if (!Store(entry.position, record, sizeof(record), error)) return false;
+
+    if (needed < chain.size()) {
+        if (needed && !SetNext(chain[needed - 1], EndOfChain(), error)) return false;
+        for (size_t i = needed; i < chain.size(); i++) {
+            if (!SetNext(chain[i], 0, error)) return false;
+        }
+        if (!FlushFat(error)) return false;
+    }
+    return UpdateFsInfo((int64_t)chain.size() - (int64_t)needed, error);
+}
+
+// ============================================================================
+// OPENING
+// ============================================================================
+
+std::unique_ptr<VolumeEditor> OpenVolumeEditor(BlockDevice& device, uint64_t offset, uint64_t length,
+                                               std::wstring& error) {
+    std::wstring reason;
+    std::unique_ptr<IsoVolumeEditor> iso(new IsoVolumeEditor(device, offset));
+    if (iso->Open(reason)) {
+        return std::unique_ptr<VolumeEditor>(iso.release());
+    }
+    std::unique_ptr<FatVolumeEditor> fat(new FatVolumeEditor(device, offset));
+    if (fat->Open(length, reason)) {
+        return std::unique_ptr<VolumeEditor>(fat.release());
+    }
+    error = L"No ISO9660 or FAT file system at byte " + std::to_wstring(offset) + L": " + reason;
+    return nullptr;
+}
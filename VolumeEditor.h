@@ -0,0 +1,77 @@
+// ============================================================================
+// INFERNO - Block-level file editing on written ISO9660 and FAT volumes
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class VolumeType : uint8_t {
+    Unknown,
+    Iso9660,
+    Fat12,
+    Fat16,
+    Fat32
+};
+
+const wchar_t* VolumeTypeName(VolumeType type);
+
+struct VolumeFileEntry {
+    std::wstring name;                  // as stored: Rock Ridge, Joliet or long file name when there is one
+    uint64_t size = 0;
+    bool directory = false;
+};
+
+// Edits files of a volume on a device without mounting it: reads the few
+// directories on a path, then rewrites a file's contents and the directory
+// records that describe it. Writes compare against what is on the device and
+// only rewrite the logical sectors that change.
+//
+// Files are replaced, never created. A file grows in place while it fits in
+// what it already occupies (the rest of its last ISO9660 sector, its FAT
+// cluster chain), on FAT by allocating more clusters, and on ISO9660 by
+// moving it to unreferenced, zero-filled sectors inside the volume space.
+//
+// Paths are '/'-separated and matched case-insensitively.
+class VolumeEditor {
+public:
+    virtual ~VolumeEditor() = default;
+
+    virtual VolumeType GetType() const = 0;
+
+    virtual bool List(const std::wstring& path, std::vector<VolumeFileEntry>& entries, std::wstring& error) = 0;
+    virtual bool ReadFile(const std::wstring& path, std::string& contents, std::wstring& error) = 0;
+    virtual bool WriteFile(const std::wstring& path, const std::string& contents, std::wstring& error) = 0;
+
+    uint64_t GetOffset() const { return m_offset; }
+    uint64_t GetSectorsWritten() const { return m_sectorsWritten; }
+    uint64_t GetBytesWritten() const { return m_bytesWritten; }
+
+protected:
+    VolumeEditor(BlockDevice& device, uint64_t offset);
+
+    // Byte access relative to the start of the volume, at any alignment.
+    bool Load(uint64_t offset, void* buffer, size_t length, std::wstring& error);
+    // Writes only the device's physical sectors whose contents differ, so a
+    // 512e drive never has to merge a partial one. The count kept is in
+    // logical sectors.
+    bool Store(uint64_t offset, const void* data, size_t length, std::wstring& error);
+
+    BlockDevice& m_device;
+    uint64_t m_offset;
+
+private:
+    uint64_t m_sectorsWritten = 0;
+    uint64_t m_bytesWritten = 0;
+};
+
+// Recognises the volume at `offset` on `device` (an ISO9660 volume
+// descriptor set, or a FAT boot sector) and opens it for editing. `length`
+// bounds a FAT volume; 0 takes its boot sector's word for it.
+std::unique_ptr<VolumeEditor> OpenVolumeEditor(BlockDevice& device, uint64_t offset, uint64_t length,
+                                               std::wstring& error);
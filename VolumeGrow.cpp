@@ -0,0 +1,895 @@
+// ============================================================================
+// INFERNO - Growing a raw copy's last volume to the end of the drive
+// ============================================================================
+
+#include "VolumeGrow.h"
+#include "Checksum.h"
+#include "ImageWriter.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+static const uint16_t BOOT_SIGNATURE = 0xAA55;
+
+static const uint32_t FAT32_MIN_CLUSTERS = 65525;
+static const uint32_t FAT32_MAX_CLUSTERS = 0x0FFFFFF5;
+static const uint32_t FSINFO_LEAD_SIGNATURE = 0x41615252;
+static const uint32_t FSINFO_STRUCT_SIGNATURE = 0x61417272;
+
+static const uint32_t EXFAT_MAX_CLUSTERS = 0xFFFFFFF5;
+static const uint32_t EXFAT_END_OF_CHAIN = 0xFFFFFFF8;
+static const uint32_t EXFAT_BOOT_REGION_SECTORS = 12;
+static const uint16_t EXFAT_VOLUME_DIRTY = 0x0002;
+static const uint8_t EXFAT_ENTRY_BITMAP = 0x81;
+static const uint8_t EXFAT_ENTRY_END = 0x00;
+static const uint32_t EXFAT_MAX_ROOT_CLUSTERS = 256;
+
+// ext2/3/4 superblock fields, as byte offsets into it.
+static const uint64_t EXT_SUPERBLOCK_OFFSET = 1024;
+static const size_t EXT_SUPERBLOCK_SIZE = 1024;
+static const size_t EXT_INODES_COUNT = 0x00;
+static const size_t EXT_BLOCKS_COUNT = 0x04;
+static const size_t EXT_R_BLOCKS_COUNT = 0x08;
+static const size_t EXT_FREE_BLOCKS = 0x0C;
+static const size_t EXT_FREE_INODES = 0x10;
+static const size_t EXT_FIRST_DATA_BLOCK = 0x14;
+static const size_t EXT_LOG_BLOCK_SIZE = 0x18;
+static const size_t EXT_BLOCKS_PER_GROUP = 0x20;
+static const size_t EXT_CLUSTERS_PER_GROUP = 0x24;
+static const size_t EXT_INODES_PER_GROUP = 0x28;
+static const size_t EXT_MAGIC = 0x38;
+static const size_t EXT_STATE = 0x3A;
+static const size_t EXT_REV_LEVEL = 0x4C;
+static const size_t EXT_INODE_SIZE = 0x58;
+static const size_t EXT_BLOCK_GROUP_NR = 0x5A;
+static const size_t EXT_FEATURE_COMPAT = 0x5C;
+static const size_t EXT_FEATURE_INCOMPAT = 0x60;
+static const size_t EXT_FEATURE_RO_COMPAT = 0x64;
+static const size_t EXT_UUID = 0x68;
+static const size_t EXT_RESERVED_GDT_BLOCKS = 0xCE;
+static const size_t EXT_DESC_SIZE = 0xFE;
+static const size_t EXT_BLOCKS_COUNT_HI = 0x150;
+static const size_t EXT_R_BLOCKS_COUNT_HI = 0x154;
+static const size_t EXT_FREE_BLOCKS_HI = 0x158;
+static const size_t EXT_CHECKSUM_TYPE = 0x175;
+static const size_t EXT_OVERHEAD_CLUSTERS = 0x248;
+static const size_t EXT_CHECKSUM_SEED = 0x270;
+static const size_t EXT_CHECKSUM = 0x3FC;
+
+static const uint16_t EXT_SUPER_MAGIC = 0xEF53;
+static const uint16_t EXT_STATE_VALID = 0x0001;
+static const uint16_t EXT_STATE_ERRORS = 0x0002;
+static const uint8_t EXT_CHECKSUM_CRC32C = 1;
+
+static const uint32_t EXT_COMPAT_HAS_JOURNAL = 0x0004;
+static const uint32_t EXT_COMPAT_RESIZE_INODE = 0x0010;
+static const uint32_t EXT_COMPAT_SPARSE_SUPER2 = 0x0200;
+static const uint32_t EXT_INCOMPAT_RECOVER = 0x0004;
+static const uint32_t EXT_INCOMPAT_META_BG = 0x0010;
+static const uint32_t EXT_INCOMPAT_EXTENTS = 0x0040;
+static const uint32_t EXT_INCOMPAT_64BIT = 0x0080;
+static const uint32_t EXT_INCOMPAT_FLEX_BG = 0x0200;
+static const uint32_t EXT_INCOMPAT_CSUM_SEED = 0x2000;
+static const uint32_t EXT_RO_COMPAT_SPARSE_SUPER = 0x0001;
+static const uint32_t EXT_RO_COMPAT_GDT_CSUM = 0x0010;
+static const uint32_t EXT_RO_COMPAT_BIGALLOC = 0x0200;
+static const uint32_t EXT_RO_COMPAT_METADATA_CSUM = 0x0400;
+
+// Group descriptor fields; the _HI halves exist with 64bit only.
+static const size_t EXT_BG_BLOCK_BITMAP = 0x00;
+static const size_t EXT_BG_INODE_BITMAP = 0x04;
+static const size_t EXT_BG_INODE_TABLE = 0x08;
+static const size_t EXT_BG_FREE_BLOCKS = 0x0C;
+static const size_t EXT_BG_FREE_INODES = 0x0E;
+static const size_t EXT_BG_FLAGS = 0x12;
+static const size_t EXT_BG_BLOCK_BITMAP_CSUM = 0x18;
+static const size_t EXT_BG_ITABLE_UNUSED = 0x1C;
+static const size_t EXT_BG_CHECKSUM = 0x1E;
+static const size_t EXT_BG_BLOCK_BITMAP_HI = 0x20;
+static const size_t EXT_BG_INODE_BITMAP_HI = 0x24;
+static const size_t EXT_BG_INODE_TABLE_HI = 0x28;
+static const size_t EXT_BG_FREE_BLOCKS_HI = 0x2C;
+static const size_t EXT_BG_FREE_INODES_HI = 0x2E;
+static const size_t EXT_BG_ITABLE_UNUSED_HI = 0x32;
+static const size_t EXT_BG_BLOCK_BITMAP_CSUM_HI = 0x38;
+static const size_t EXT_MIN_DESC_SIZE_64BIT = 64;
+
+static const uint16_t EXT_BG_INODE_UNINIT = 0x0001;
+static const uint16_t EXT_BG_BLOCK_UNINIT = 0x0002;
+
+// Inode fields.
+static const uint32_t EXT_RESIZE_INODE = 7;
+static const size_t EXT_I_BLOCKS = 0x1C;
+static const size_t EXT_I_BLOCK = 0x28;
+static const size_t EXT_I_GENERATION = 0x64;
+static const size_t EXT_I_BLOCKS_HI = 0x74;
+static const size_t EXT_I_CHECKSUM = 0x7C;
+static const size_t EXT_I_EXTRA_ISIZE = 0x80;
+static const size_t EXT_I_CHECKSUM_HI = 0x82;
+static const size_t EXT_GOOD_OLD_INODE_SIZE = 128;
+static const size_t EXT_DIND_BLOCK = 13;
+
+// A new last group this much larger than its own metadata, or it is left
+// out, as resize2fs does.
+static const uint64_t EXT_MIN_LAST_GROUP_FREE = 50;
+
+// ============================================================================
+// BYTE ORDER
+// ============================================================================
+
+static uint16_t ReadLe16(const uint8_t* p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t ReadLe32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t ReadLe64(const uint8_t* p) {
+    return (uint64_t)ReadLe32(p) | (uint64_t)ReadLe32(p + 4) << 32;
+}
+
+static void WriteLe16(uint8_t* p, uint16_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void WriteLe32(uint8_t* p, uint32_t value) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static void WriteLe64(uint8_t* p, uint64_t value) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static bool IsPowerOfTwo(uint64_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// ============================================================================
+// VOLUME ACCESS
+// ============================================================================
+
+// Byte ranges relative to the start of the volume. Reads are widened to
+// whole logical sectors, writes to whole physical ones (see WriteAligned);
+// what was written is counted.
+class GrowVolume {
+public:
+    GrowVolume(BlockDevice& device, uint64_t offset) : m_device(device), m_offset(offset) {}
+
+    bool Load(uint64_t offset, void* buffer, size_t length, std::wstring& error);
+    bool Store(uint64_t offset, const void* data, size_t length, std::wstring& error);
+    // Zeroes a range where it is not zero already.
+    bool Clear(uint64_t offset, uint64_t length, std::wstring& error);
+
+    uint64_t GetBytesWritten() const { return m_bytesWritten; }
+
+private:
+    BlockDevice& m_device;
+    uint64_t m_offset;
+    uint64_t m_bytesWritten = 0;
+};
+
+bool GrowVolume::Load(uint64_t offset, void* buffer, size_t length, std::wstring& error) {
+    if (length == 0) return true;
+    uint64_t sectorSize = std::max<uint32_t>(m_device.GetGeometry().logicalSectorSize, 512);
+    uint64_t absolute = m_offset + offset;
+    uint64_t begin = absolute / sectorSize * sectorSize;
+    uint64_t end = (absolute + length + sectorSize - 1) / sectorSize * sectorSize;
+    std::vector<uint8_t> span((size_t)(end - begin));
+    if (!m_device.Read(begin, span.data(), span.size())) {
+        error = L"Cannot read the volume at byte " + std::to_wstring(absolute);
+        return false;
+    }
+    memcpy(buffer, span.data() + (absolute - begin), length);
+    return true;
+}
+
+bool GrowVolume::Store(uint64_t offset, const void* data, size_t length, std::wstring& error) {
+    if (length == 0) return true;
+    if (!WriteAligned(m_device, m_offset + offset, data, length)) {
+        error = L"Cannot write the volume at byte " + std::to_wstring(m_offset + offset);
+        return false;
+    }
+    m_bytesWritten += length;
+    return true;
+}
+
+bool GrowVolume::Clear(uint64_t offset, uint64_t length, std::wstring& error) {
+    const uint64_t CHUNK = 1024 * 1024;
+    std::vector<uint8_t> buffer;
+    for (uint64_t done = 0; done < length;) {
+        size_t piece = (size_t)std::min(length - done, CHUNK);
+        buffer.resize(piece);
+        if (!Load(offset + done, buffer.data(), piece, error)) return false;
+        if (!IsZeroBuffer(buffer.data(), piece)) {
+            memset(buffer.data(), 0, piece);
+            if (!Store(offset + done, buffer.data(), piece, error)) return false;
+        }
+        done += piece;
+    }
+    return true;
+}
+
+// ============================================================================
+// FAT32
+// ============================================================================
+
+static bool IsFat32BootSector(const uint8_t* boot) {
+    uint32_t sectorSize = ReadLe16(boot + 11);
+    return ReadLe16(boot + 510) == BOOT_SIGNATURE && sectorSize >= 512 && sectorSize <= 4096 &&
+           IsPowerOfTwo(sectorSize) && IsPowerOfTwo(boot[13]) && ReadLe16(boot + 14) != 0 &&
+           boot[16] >= 1 && boot[16] <= 4 && ReadLe16(boot + 17) == 0 && ReadLe16(boot + 22) == 0 &&
+           ReadLe32(boot + 36) != 0;
+}
+
+static bool GrowFat32(GrowVolume& volume, uint64_t bytes, FileSystemGrowth& growth, std::wstring& error) {
+    std::vector<uint8_t> boot(512);
+    if (!volume.Load(0, boot.data(), boot.size(), error)) return false;
+    uint32_t sectorSize = ReadLe16(&boot[11]);
+    uint32_t clusterSectors = boot[13];
+    uint32_t reservedSectors = ReadLe16(&boot[14]);
+    uint32_t fatCount = boot[16];
+    uint32_t fatSectors = ReadLe32(&boot[36]);
+    uint64_t totalSectors = ReadLe32(&boot[32]);
+    uint64_t dataSector = reservedSectors + (uint64_t)fatCount * fatSectors;
+    boot.resize(sectorSize);
+    if (!volume.Load(0, boot.data(), boot.size(), error)) return false;
+
+    growth.fileSystem = L"FAT32";
+    growth.bytesBefore = growth.bytesAfter = totalSectors * sectorSize;
+    if (totalSectors <= dataSector || (totalSectors - dataSector) / clusterSectors < FAT32_MIN_CLUSTERS) {
+        error = L"The FAT32 boot sector describes fewer clusters than FAT32 has.";
+        return false;
+    }
+
+    uint64_t clusters = (totalSectors - dataSector) / clusterSectors;
+    uint64_t fatClusters = std::min<uint64_t>((uint64_t)fatSectors * sectorSize / 4 - 2, FAT32_MAX_CLUSTERS);
+    uint64_t available = std::min<uint64_t>(bytes / sectorSize, 0xFFFFFFFFull);
+    uint64_t fitting = available > dataSector ? (available - dataSector) / clusterSectors : 0;
+    uint64_t newClusters = std::min(fitting, fatClusters);
+    if (fitting > fatClusters) {
+        growth.limit = L"Its FATs have entries for " + std::to_wstring(fatClusters) +
+                       L" clusters; more would move the data area.";
+    }
+    if (newClusters <= clusters) return true;
+
+    // The new clusters' entries are free in every FAT; formatters clear
+    // whole FATs, so this normally only reads.
+    for (uint32_t fat = 0; fat < fatCount; fat++) {
+        uint64_t fatOffset = ((uint64_t)reservedSectors + (uint64_t)fat * fatSectors) * sectorSize;
+        if (!volume.Clear(fatOffset + (clusters + 2) * 4, (newClusters - clusters) * 4, error)) return false;
+    }
+
+    // FSInfo's free count, unless it is unknown (0xFFFFFFFF) already.
+    uint32_t fsInfoSector = ReadLe16(&boot[48]);
+    if (fsInfoSector != 0 && fsInfoSector < reservedSectors) {
+        std::vector<uint8_t> fsInfo(sectorSize);
+        if (!volume.Load((uint64_t)fsInfoSector * sectorSize, fsInfo.data(), fsInfo.size(), error)) return false;
+        uint32_t freeClusters = ReadLe32(&fsInfo[488]);
+        if (ReadLe32(&fsInfo[0]) == FSINFO_LEAD_SIGNATURE && ReadLe32(&fsInfo[484]) == FSINFO_STRUCT_SIGNATURE &&
+            freeClusters <= clusters) {
+            WriteLe32(&fsInfo[488], (uint32_t)(freeClusters + newClusters - clusters));
+            if (!volume.Store((uint64_t)fsInfoSector * sectorSize, fsInfo.data(), fsInfo.size(), error)) {
+                return false;
+            }
+        }
+    }
+
+    // The boot sector last, then its backup. The volume ends with its last
+    // cluster so that no later reading of its size counts more.
+    uint64_t newTotal = dataSector + newClusters * clusterSectors;
+    WriteLe32(&boot[32], (uint32_t)newTotal);
+    if (!volume.Store(0, boot.data(), boot.size(), error)) return false;
+    uint32_t backupSector = ReadLe16(&boot[50]);
+    if (backupSector != 0 && backupSector < reservedSectors && backupSector != fsInfoSector) {
+        std::vector<uint8_t> backup(sectorSize);
+        if (!volume.Load((uint64_t)backupSector * sectorSize, backup.data(), backup.size(), error)) return false;
+        if (ReadLe16(&backup[510]) == BOOT_SIGNATURE) {
+            WriteLe32(&backup[32], (uint32_t)newTotal);
+            if (!volume.Store((uint64_t)backupSector * sectorSize, backup.data(), backup.size(), error)) return false;
+        }
+    }
+    growth.bytesAfter = newTotal * sectorSize;
+    return true;
+}
+
+// ============================================================================
+// EXFAT
+// ============================================================================
+
+static bool IsExfatBootSector(const uint8_t* boot) {
+    return memcmp(boot + 3, "EXFAT   ", 8) == 0;
+}
+
+static uint32_t ExfatBootChecksum(const std::vector<uint8_t>& region, size_t length) {
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (i == 106 || i == 107 || i == 112) continue;     // VolumeFlags, PercentInUse
+        checksum = ((checksum & 1) ? 0x80000000u : 0) + (checksum >> 1) + region[i];
+    }
+    return checksum;
+}
+
+static bool GrowExfat(GrowVolume& volume, uint64_t bytes, FileSystemGrowth& growth, std::wstring& error) {
+    std::vector<uint8_t> boot(512);
+    if (!volume.Load(0, boot.data(), boot.size(), error)) return false;
+    uint32_t sectorShift = boot[108];
+    uint32_t clusterShift = boot[109];
+    if (sectorShift < 9 || sectorShift > 12 || sectorShift + clusterShift > 25) {
+        error = L"The exFAT boot sector is damaged.";
+        return false;
+    }
+    uint64_t sectorSize = 1ull << sectorShift;
+    uint64_t clusterBytes = sectorSize << clusterShift;
+    std::vector<uint8_t> region((size_t)(EXFAT_BOOT_REGION_SECTORS * sectorSize));
+    if (!volume.Load(0, region.data(), region.size(), error)) return false;
+    uint64_t volumeLength = ReadLe64(&region[72]);
+    uint64_t fatOffset = (uint64_t)ReadLe32(&region[80]) * sectorSize;
+    uint64_t fatLength = (uint64_t)ReadLe32(&region[84]) * sectorSize;
+    uint64_t heapOffset = ReadLe32(&region[88]);
+    uint64_t clusters = ReadLe32(&region[92]);
+    uint32_t rootCluster = ReadLe32(&region[96]);
+    uint16_t flags = ReadLe16(&region[106]);
+
+    growth.fileSystem = L"exFAT";
+    growth.bytesBefore = growth.bytesAfter = (heapOffset + (clusters << clusterShift)) * sectorSize;
+    if (region[110] != 1) {
+        growth.limit = L"TexFAT volumes, with a second FAT, are not grown.";
+        return true;
+    }
+    if (flags & EXFAT_VOLUME_DIRTY) {
+        growth.limit = L"The volume was not cleanly unmounted; check it first.";
+        return true;
+    }
+
+    auto next = [&](uint32_t cluster, uint32_t& following) {
+        uint8_t entry[4];
+        if (!volume.Load(fatOffset + (uint64_t)cluster * 4, entry, 4, error)) return false;
+        following = ReadLe32(entry);
+        return true;
+    };
+    auto clusterOffset = [&](uint32_t cluster) {
+        return heapOffset * sectorSize + (uint64_t)(cluster - 2) * clusterBytes;
+    };
+
+    // The allocation bitmap's directory entry, in the root directory.
+    uint64_t entryOffset = 0;
+    std::vector<uint8_t> directory((size_t)clusterBytes);
+    uint32_t cluster = rootCluster;
+    for (uint32_t walked = 0; walked < EXFAT_MAX_ROOT_CLUSTERS; walked++) {
+        if (cluster < 2 || cluster - 2 >= clusters) break;
+        if (!volume.Load(clusterOffset(cluster), directory.data(), directory.size(), error)) return false;
+        bool end = false;
+        for (size_t i = 0; i < directory.size() && !end && !entryOffset; i += 32) {
+            if (directory[i] == EXFAT_ENTRY_END) end = true;
+            else if (directory[i] == EXFAT_ENTRY_BITMAP && (directory[i + 1] & 1) == 0) {
+                entryOffset = clusterOffset(cluster) + i;
+            }
+        }
+        if (end || entryOffset) break;
+        if (!next(cluster, cluster)) return false;
+    }
+    if (!entryOffset) {
+        error = L"The exFAT root directory has no allocation bitmap.";
+        return false;
+    }
+    uint8_t entry[32];
+    if (!volume.Load(entryOffset, entry, sizeof(entry), error)) return false;
+    uint32_t bitmapCluster = ReadLe32(entry + 20);
+    uint64_t bitmapLength = ReadLe64(entry + 24);
+    if (bitmapCluster < 2 || bitmapCluster - 2 >= clusters || bitmapLength < (clusters + 7) / 8) {
+        error = L"The exFAT allocation bitmap entry is damaged.";
+        return false;
+    }
+
+    // The clusters allocated to the bitmap, which must follow each other;
+    // the slack in its last one is room to grow into.
+    uint64_t allocated = 1;
+    uint64_t needed = (bitmapLength + clusterBytes - 1) / clusterBytes;
+    for (uint32_t current = bitmapCluster;; current++, allocated++) {
+        uint32_t following = 0;
+        if (!next(current, following)) return false;
+        if (following == 0 || following >= EXFAT_END_OF_CHAIN) break;
+        if (following != current + 1 || allocated > needed) {
+            growth.limit = L"Its allocation bitmap is fragmented.";
+            return true;
+        }
+    }
+    allocated = std::max(allocated, needed);
+
+    uint64_t fatClusters = std::min<uint64_t>(fatLength / 4 - 2, EXFAT_MAX_CLUSTERS);
+    uint64_t bitmapClusters = allocated * clusterBytes * 8;
+    uint64_t available = bytes / sectorSize;
+    uint64_t fitting = available > heapOffset ? (available - heapOffset) >> clusterShift : 0;
+    uint64_t newClusters = std::min({fitting, fatClusters, bitmapClusters});
+    if (fitting > newClusters) {
+        growth.limit = (fatClusters < bitmapClusters ? L"Its FAT has entries for "
+                                                     : L"Its allocation bitmap has room for ") +
+                       std::to_wstring(newClusters) + L" clusters; more would move the cluster heap.";
+    }
+    if (newClusters <= clusters) return true;
+
+    // The new clusters are free in the FAT and in the bitmap.
+    if (!volume.Clear(fatOffset + (clusters + 2) * 4, (newClusters - clusters) * 4, error)) return false;
+    uint64_t bitmapOffset = clusterOffset(bitmapCluster);
+    if (clusters % 8) {
+        uint8_t partial = 0;
+        if (!volume.Load(bitmapOffset + clusters / 8, &partial, 1, error)) return false;
+        uint8_t kept = (uint8_t)(partial & ((1u << (clusters % 8)) - 1));
+        if (kept != partial && !volume.Store(bitmapOffset + clusters / 8, &kept, 1, error)) return false;
+    }
+    uint64_t firstWhole = (clusters + 7) / 8;
+    uint64_t lastByte = (newClusters + 7) / 8;
+    if (lastByte > firstWhole && !volume.Clear(bitmapOffset + firstWhole, lastByte - firstWhole, error)) {
+        return false;
+    }
+    WriteLe64(entry + 24, lastByte);
+    if (!volume.Store(entryOffset, entry, sizeof(entry), error)) return false;
+
+    // The boot region, its checksum sector and then the backup region.
+    WriteLe64(&region[72], std::max(volumeLength, available));
+    WriteLe32(&region[92], (uint32_t)newClusters);
+    region[112] = 0xFF;     // percent in use: not known
+    size_t checksummed = (size_t)(11 * sectorSize);
+    uint32_t checksum = ExfatBootChecksum(region, checksummed);
+    for (size_t i = checksummed; i < region.size(); i += 4) WriteLe32(&region[i], checksum);
+    if (!volume.Store(0, region.data(), region.size(), error)) return false;
+    if (!volume.Store(region.size(), region.data(), region.size(), error)) return false;
+    growth.bytesAfter = (heapOffset + (newClusters << clusterShift)) * sectorSize;
+    return true;
+}
+
+// ============================================================================
+// EXT2/3/4
+// ============================================================================
+
+// ext4's checksums are CRC-32C without the final inversion, seeded.
+static uint32_t ExtChecksum(uint32_t seed, const void* data, size_t length) {
+    return ~Crc32c(data, length, ~seed);
+}
+
+static bool IsPowerOf(uint64_t value, uint64_t base) {
+    while (value > 1 && value % base == 0) value /= base;
+    return value == 1;
+}
+
+// Field access for a 32/64 bit split value; `hi` is only used with 64bit.
+struct ExtLayout {
+    bool is64 = false;
+    size_t descSize = 32;
+
+    uint64_t Get32(const uint8_t* p, size_t lo, size_t hi) const {
+        return ReadLe32(p + lo) | (is64 ? (uint64_t)ReadLe32(p + hi) << 32 : 0);
+    }
+    void Set32(uint8_t* p, size_t lo, size_t hi, uint64_t value) const {
+        WriteLe32(p + lo, (uint32_t)value);
+        if (is64) WriteLe32(p + hi, (uint32_t)(value >> 32));
+    }
+    uint32_t Get16(const uint8_t* p, size_t lo, size_t hi) const {
+        return ReadLe16(p + lo) | (is64 && descSize >= EXT_MIN_DESC_SIZE_64BIT ? (uint32_t)ReadLe16(p + hi) << 16 : 0);
+    }
+    void Set16(uint8_t* p, size_t lo, size_t hi, uint32_t value) const {
+        WriteLe16(p + lo, (uint16_t)value);
+        if (is64 && descSize >= EXT_MIN_DESC_SIZE_64BIT) WriteLe16(p + hi, (uint16_t)(value >> 16));
+    }
+};
+
+static bool GrowExt(GrowVolume& volume, uint64_t bytes, FileSystemGrowth& growth, std::wstring& error) {
+    std::vector<uint8_t> super(EXT_SUPERBLOCK_SIZE);
+    if (!volume.Load(EXT_SUPERBLOCK_OFFSET, super.data(), super.size(), error)) return false;
+    uint32_t compat = ReadLe32(&super[EXT_FEATURE_COMPAT]);
+    uint32_t incompat = ReadLe32(&super[EXT_FEATURE_INCOMPAT]);
+    uint32_t roCompat = ReadLe32(&super[EXT_FEATURE_RO_COMPAT]);
+    bool metadataCsum = (roCompat & EXT_RO_COMPAT_METADATA_CSUM) != 0;
+    bool gdtCsum = !metadataCsum && (roCompat & EXT_RO_COMPAT_GDT_CSUM) != 0;
+    bool sparse = (roCompat & EXT_RO_COMPAT_SPARSE_SUPER) != 0;
+    ExtLayout layout;
+    layout.is64 = (incompat & EXT_INCOMPAT_64BIT) != 0;
+    layout.descSize = layout.is64 ? ReadLe16(&super[EXT_DESC_SIZE]) : 32;
+
+    growth.fileSystem = (incompat & (EXT_INCOMPAT_EXTENTS | EXT_INCOMPAT_64BIT | EXT_INCOMPAT_FLEX_BG)) ? L"ext4"
+                        : (compat & EXT_COMPAT_HAS_JOURNAL)                                           ? L"ext3"
+                                                                                                       : L"ext2";
+    uint32_t logBlockSize = ReadLe32(&super[EXT_LOG_BLOCK_SIZE]);
+    uint64_t blockSize = 1024ull << std::min<uint32_t>(logBlockSize, 6);
+    uint64_t blocks = layout.Get32(&super[0], EXT_BLOCKS_COUNT, EXT_BLOCKS_COUNT_HI);
+    uint64_t firstDataBlock = ReadLe32(&super[EXT_FIRST_DATA_BLOCK]);
+    uint64_t blocksPerGroup = ReadLe32(&super[EXT_BLOCKS_PER_GROUP]);
+    uint64_t inodesPerGroup = ReadLe32(&super[EXT_INODES_PER_GROUP]);
+    uint64_t inodeSize = ReadLe32(&super[EXT_REV_LEVEL]) ? ReadLe16(&super[EXT_INODE_SIZE]) : EXT_GOOD_OLD_INODE_SIZE;
+    if (logBlockSize > 6 || blocksPerGroup == 0 || blocksPerGroup > blockSize * 8 ||
+        ReadLe32(&super[EXT_CLUSTERS_PER_GROUP]) != blocksPerGroup || inodesPerGroup == 0 ||
+        inodeSize < EXT_GOOD_OLD_INODE_SIZE || !IsPowerOfTwo(inodeSize) || inodeSize > blockSize ||
+        layout.descSize < 32 || !IsPowerOfTwo(layout.descSize) || layout.descSize > blockSize ||
+        (layout.is64 && layout.descSize < EXT_MIN_DESC_SIZE_64BIT) || blocks <= firstDataBlock) {
+        error = L"The ext superblock is damaged.";
+        return false;
+    }
+    growth.bytesBefore = growth.bytesAfter = blocks * blockSize;
+
+    const wchar_t* unsupported = nullptr;
+    if (roCompat & EXT_RO_COMPAT_BIGALLOC) unsupported = L"bigalloc";
+    else if (incompat & EXT_INCOMPAT_META_BG) unsupported = L"meta_bg";
+    else if (compat & EXT_COMPAT_SPARSE_SUPER2) unsupported = L"sparse_super2";
+    if (unsupported) {
+        growth.limit = std::wstring(L"Growing in place does not handle its ") + unsupported + L" layout.";
+        return true;
+    }
+    if (!metadataCsum && !gdtCsum) {
+        growth.limit = L"Without uninit_bg or metadata_csum every new inode table would have to be zeroed.";
+        return true;
+    }
+    if (metadataCsum && super[EXT_CHECKSUM_TYPE] != EXT_CHECKSUM_CRC32C) {
+        growth.limit = L"Its metadata checksums are of an unknown kind.";
+        return true;
+    }
+    uint16_t state = ReadLe16(&super[EXT_STATE]);
+    if ((incompat & EXT_INCOMPAT_RECOVER) || !(state & EXT_STATE_VALID) || (state & EXT_STATE_ERRORS)) {
+        growth.limit = L"It was not cleanly unmounted; check it first.";
+        return true;
+    }
+
+    uint32_t seed = 0;
+    if (metadataCsum) {
+        seed = (incompat & EXT_INCOMPAT_CSUM_SEED) ? ReadLe32(&super[EXT_CHECKSUM_SEED])
+                                                   : ExtChecksum(~0u, &super[EXT_UUID], 16);
+    }
+    auto hasSuper = [&](uint64_t group) {
+        return group <= 1 || !sparse || IsPowerOf(group, 3) || IsPowerOf(group, 5) || IsPowerOf(group, 7);
+    };
+
+    uint64_t descPerBlock = blockSize / layout.descSize;
+    uint64_t groups = (blocks - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup;
+    uint64_t descBlocks = (groups + descPerBlock - 1) / descPerBlock;
+    uint64_t reservedGdt = ReadLe16(&super[EXT_RESERVED_GDT_BLOCKS]);
+    bool resizeInode = (compat & EXT_COMPAT_RESIZE_INODE) != 0;
+    uint64_t itableBlocks = (inodesPerGroup * inodeSize + blockSize - 1) / blockSize;
+    uint64_t gdtBlock = firstDataBlock + 1;
+
+    // How many groups: as many as the drive holds, up to what the
+    // descriptor blocks plus the reserved ones describe and what 32-bit
+    // inode numbers reach.
+    uint64_t target = std::min<uint64_t>(bytes / blockSize, layout.is64 ? 1ull << 48 : 0xFFFFFFFFull);
+    if (target <= blocks) return true;
+    uint64_t newGroups = (target - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup;
+    uint64_t descriptorLimit = (descBlocks + (resizeInode ? reservedGdt : 0)) * descPerBlock;
+    uint64_t inodeLimit = 0xFFFFFFFFull / inodesPerGroup;
+    if (newGroups > std::min(descriptorLimit, inodeLimit)) {
+        newGroups = std::min(descriptorLimit, inodeLimit);
+        target = firstDataBlock + newGroups * blocksPerGroup;
+        if (descriptorLimit <= inodeLimit) {
+            growth.limit = L"Its reserved GDT blocks describe at most " + std::to_wstring(newGroups) + L" groups.";
+        } else {
+            growth.limit = L"More block groups would number inodes past 32 bits.";
+        }
+    }
+    uint64_t newDescBlocks = 0;
+    auto groupOverhead = [&](uint64_t group) {
+        uint64_t metadata = hasSuper(group) ? 1 + newDescBlocks + reservedGdt - (newDescBlocks - descBlocks) : 0;
+        return metadata + 2 + itableBlocks;
+    };
+    while (newGroups > groups) {
+        newDescBlocks = (newGroups + descPerBlock - 1) / descPerBlock;
+        uint64_t lastSize = target - firstDataBlock - (newGroups - 1) * blocksPerGroup;
+        if (lastSize >= groupOverhead(newGroups - 1) + EXT_MIN_LAST_GROUP_FREE) break;
+        newGroups--;
+        target = firstDataBlock + newGroups * blocksPerGroup;
+    }
+    newGroups = std::max(newGroups, groups);
+    target = std::min(target, firstDataBlock + newGroups * blocksPerGroup);
+    if (target <= blocks) return true;
+    newDescBlocks = (newGroups + descPerBlock - 1) / descPerBlock;
+    uint64_t converted = newDescBlocks - descBlocks;
+    uint64_t newReservedGdt = reservedGdt - converted;
+    uint64_t backupsBefore = 0, backupsAfter = 0;
+    for (uint64_t group = 1; group < newGroups; group++) {
+        if (hasSuper(group)) (group < groups ? backupsBefore : backupsAfter)++;
+    }
+    backupsAfter += backupsBefore;
+
+    std::vector<uint8_t> gdt((size_t)(newDescBlocks * blockSize), 0);
+    if (!volume.Load(gdtBlock * blockSize, gdt.data(), (size_t)(descBlocks * blockSize), error)) return false;
+    auto descriptor = [&](uint64_t group) { return &gdt[(size_t)(group * layout.descSize)]; };
+    auto sealDescriptor = [&](uint64_t group) {
+        uint8_t* desc = descriptor(group);
+        uint8_t number[4];
+        WriteLe32(number, (uint32_t)group);
+        if (metadataCsum) {
+            std::vector<uint8_t> copy(desc, desc + layout.descSize);
+            WriteLe16(&copy[EXT_BG_CHECKSUM], 0);
+            uint32_t checksum = ExtChecksum(ExtChecksum(seed, number, 4), copy.data(), copy.size());
+            WriteLe16(desc + EXT_BG_CHECKSUM, (uint16_t)checksum);
+        } else {
+            uint16_t checksum = Crc16(&super[EXT_UUID], 16, 0xFFFF);
+            checksum = Crc16(number, 4, checksum);
+            checksum = Crc16(desc, EXT_BG_CHECKSUM, checksum);
+            if (layout.is64 && layout.descSize > EXT_BG_CHECKSUM + 2) {
+                checksum = Crc16(desc + EXT_BG_CHECKSUM + 2, layout.descSize - EXT_BG_CHECKSUM - 2, checksum);
+            }
+            WriteLe16(desc + EXT_BG_CHECKSUM, checksum);
+        }
+    };
+    auto sealBitmap = [&](uint8_t* desc, const std::vector<uint8_t>& bitmap) {
+        if (!metadataCsum) return;
+        uint32_t checksum = ExtChecksum(seed, bitmap.data(), (size_t)(blocksPerGroup / 8));
+        WriteLe16(desc + EXT_BG_BLOCK_BITMAP_CSUM, (uint16_t)checksum);
+        if (layout.is64 && layout.descSize >= EXT_MIN_DESC_SIZE_64BIT) {
+            WriteLe16(desc + EXT_BG_BLOCK_BITMAP_CSUM_HI, (uint16_t)(checksum >> 16));
+        }
+    };
+
+    // The resize inode maps the reserved GDT blocks and their backups.
+    // Checked before anything is written, and left alone when mkfs's layout
+    // is not what it holds.
+    bool updateResizeInode = resizeInode && reservedGdt && (converted || backupsAfter > backupsBefore);
+    std::vector<uint8_t> inode, dind, indirect;
+    uint64_t inodeOffset = 0, dindBlock = 0;
+    uint64_t perBlock = blockSize / 4;
+    uint64_t sectorsPerBlock = blockSize / 512;
+    if (updateResizeInode) {
+        inode.resize((size_t)inodeSize);
+        inodeOffset = layout.Get32(descriptor(0), EXT_BG_INODE_TABLE, EXT_BG_INODE_TABLE_HI) * blockSize +
+                      (EXT_RESIZE_INODE - 1) * inodeSize;
+        if (!volume.Load(inodeOffset, inode.data(), inode.size(), error)) return false;
+        dindBlock = ReadLe32(&inode[EXT_I_BLOCK + EXT_DIND_BLOCK * 4]);
+        uint64_t iBlocks = ReadLe32(&inode[EXT_I_BLOCKS]) | (uint64_t)ReadLe16(&inode[EXT_I_BLOCKS_HI]) << 32;
+        bool intact = dindBlock > firstDataBlock && dindBlock < blocks &&
+                      iBlocks == (1 + reservedGdt * (1 + backupsBefore)) * sectorsPerBlock &&
+                      backupsAfter <= perBlock;
+        if (intact) {
+            dind.resize((size_t)blockSize);
+            indirect.resize((size_t)(reservedGdt * blockSize));
+            if (!volume.Load(dindBlock * blockSize, dind.data(), dind.size(), error) ||
+                !volume.Load((gdtBlock + descBlocks) * blockSize, indirect.data(), indirect.size(), error)) {
+                return false;
+            }
+            for (uint64_t r = 0; r < reservedGdt && intact; r++) {
+                uint64_t block = gdtBlock + descBlocks + r;
+                intact = ReadLe32(&dind[(size_t)((descBlocks + r) % perBlock * 4)]) == block &&
+                         (backupsBefore == 0 || ReadLe32(&indirect[(size_t)(r * blockSize)]) == block + blocksPerGroup);
+            }
+        }
+        if (!intact) {
+            growth.limit = L"Its resize inode is not laid out the way mkfs leaves it.";
+            return true;
+        }
+    }
+
+    // The old last group fills up to a whole one (or the new end).
+    uint64_t freeAdded = 0;
+    std::vector<std::pair<uint64_t, std::vector<uint8_t>>> bitmaps;
+    uint64_t lastOld = groups - 1;
+    uint64_t lastOldStart = firstDataBlock + lastOld * blocksPerGroup;
+    uint64_t oldSize = blocks - lastOldStart;
+    uint64_t grownSize = std::min(blocksPerGroup, target - lastOldStart);
+    if (grownSize > oldSize) {
+        uint8_t* desc = descriptor(lastOld);
+        layout.Set16(desc, EXT_BG_FREE_BLOCKS, EXT_BG_FREE_BLOCKS_HI,
+                     layout.Get16(desc, EXT_BG_FREE_BLOCKS, EXT_BG_FREE_BLOCKS_HI) + (uint32_t)(grownSize - oldSize));
+        freeAdded += grownSize - oldSize;
+        if (!(ReadLe16(desc + EXT_BG_FLAGS) & EXT_BG_BLOCK_UNINIT)) {
+            uint64_t bitmapBlock = layout.Get32(desc, EXT_BG_BLOCK_BITMAP, EXT_BG_BLOCK_BITMAP_HI);
+            std::vector<uint8_t> bitmap((size_t)blockSize);
+            if (!volume.Load(bitmapBlock * blockSize, bitmap.data(), bitmap.size(), error)) return false;
+            for (uint64_t bit = oldSize; bit < grownSize; bit++) bitmap[bit / 8] &= (uint8_t)~(1u << (bit % 8));
+            sealBitmap(desc, bitmap);
+            bitmaps.emplace_back(bitmapBlock, std::move(bitmap));
+        }
+        sealDescriptor(lastOld);
+    }
+
+    // New groups keep their metadata at their start: superblock and GDT
+    // backups where sparse_super puts them, then the bitmaps and the inode
+    // table. Their inodes and, but for the last, their blocks are left
+    // uninitialised, for the kernel to set up when it first allocates there.
+    for (uint64_t group = groups; group < newGroups; group++) {
+        uint64_t start = firstDataBlock + group * blocksPerGroup;
+        uint64_t size = std::min(blocksPerGroup, target - start);
+        uint64_t metadata = hasSuper(group) ? 1 + newDescBlocks + newReservedGdt : 0;
+        uint64_t overhead = metadata + 2 + itableBlocks;
+        uint8_t* desc = descriptor(group);
+        memset(desc, 0, layout.descSize);
+        layout.Set32(desc, EXT_BG_BLOCK_BITMAP, EXT_BG_BLOCK_BITMAP_HI, start + metadata);
+        layout.Set32(desc, EXT_BG_INODE_BITMAP, EXT_BG_INODE_BITMAP_HI, start + metadata + 1);
+        layout.Set32(desc, EXT_BG_INODE_TABLE, EXT_BG_INODE_TABLE_HI, start + metadata + 2);
+        layout.Set16(desc, EXT_BG_FREE_BLOCKS, EXT_BG_FREE_BLOCKS_HI, (uint32_t)(size - overhead));
+        layout.Set16(desc, EXT_BG_FREE_INODES, EXT_BG_FREE_INODES_HI, (uint32_t)inodesPerGroup);
+        layout.Set16(desc, EXT_BG_ITABLE_UNUSED, EXT_BG_ITABLE_UNUSED_HI, (uint32_t)inodesPerGroup);
+        uint16_t flags = EXT_BG_INODE_UNINIT;
+        if (group + 1 < newGroups) {
+            flags |= EXT_BG_BLOCK_UNINIT;
+        } else {
+            // The last group's bitmap is written, with the blocks past the
+            // end of the file system marked in use, as mkfs does.
+            std::vector<uint8_t> bitmap((size_t)blockSize, 0);
+            for (uint64_t bit = 0; bit < blockSize * 8; bit++) {
+                if (bit < overhead || bit >= size) bitmap[bit / 8] |= (uint8_t)(1u << (bit % 8));
+            }
+            sealBitmap(desc, bitmap);
+            bitmaps.emplace_back(start + metadata, std::move(bitmap));
+        }
+        WriteLe16(desc + EXT_BG_FLAGS, flags);
+        sealDescriptor(group);
+        freeAdded += size - overhead;
+    }
+
+    // The superblock's counts. Reserved blocks keep their share.
+    uint64_t addedInodes = (newGroups - groups) * inodesPerGroup;
+    uint64_t reservedBlocks = layout.Get32(&super[0], EXT_R_BLOCKS_COUNT, EXT_R_BLOCKS_COUNT_HI);
+    layout.Set32(&super[0], EXT_BLOCKS_COUNT, EXT_BLOCKS_COUNT_HI, target);
+    layout.Set32(&super[0], EXT_R_BLOCKS_COUNT, EXT_R_BLOCKS_COUNT_HI,
+                 (uint64_t)((double)reservedBlocks * (double)target / (double)blocks));
+    layout.Set32(&super[0], EXT_FREE_BLOCKS, EXT_FREE_BLOCKS_HI,
+                 layout.Get32(&super[0], EXT_FREE_BLOCKS, EXT_FREE_BLOCKS_HI) + freeAdded);
+    WriteLe32(&super[EXT_INODES_COUNT], (uint32_t)(ReadLe32(&super[EXT_INODES_COUNT]) + addedInodes));
+    WriteLe32(&super[EXT_FREE_INODES], (uint32_t)(ReadLe32(&super[EXT_FREE_INODES]) + addedInodes));
+    WriteLe16(&super[EXT_RESERVED_GDT_BLOCKS], (uint16_t)newReservedGdt);
+    WriteLe32(&super[EXT_OVERHEAD_CLUSTERS], 0);     // recounted at mount
+    auto sealSuper = [&](std::vector<uint8_t>& block, uint64_t group) {
+        WriteLe16(&block[EXT_BLOCK_GROUP_NR], (uint16_t)group);
+        if (metadataCsum) WriteLe32(&block[EXT_CHECKSUM], ExtChecksum(~0u, block.data(), EXT_CHECKSUM));
+    };
+
+    // Bitmaps, then every backup (new groups' included), then the primary
+    // descriptors with the resize inode's blocks, and the superblock last:
+    // until it is written the file system is the old one, intact.
+    for (const auto& bitmap : bitmaps) {
+        if (!volume.Store(bitmap.first * blockSize, bitmap.second.data(), bitmap.second.size(), error)) return false;
+    }
+    std::vector<uint8_t> backup = super;
+    for (uint64_t group = 1; group < newGroups; group++) {
+        if (!hasSuper(group)) continue;
+        uint64_t start = firstDataBlock + group * blocksPerGroup;
+        sealSuper(backup, group);
+        if (!volume.Store(start * blockSize, backup.data(), backup.size(), error) ||
+            !volume.Store((start + 1) * blockSize, gdt.data(), gdt.size(), error)) {
+            return false;
+        }
+    }
+    if (updateResizeInode) {
+        // Converted reserved blocks leave the map; the others gain the
+        // backup locations in the new groups.
+        for (uint64_t r = 0; r < converted; r++) WriteLe32(&dind[(size_t)((descBlocks + r) % perBlock * 4)], 0);
+        for (uint64_t r = converted; r < reservedGdt; r++) {
+            uint8_t* map = &indirect[(size_t)(r * blockSize)];
+            uint64_t slot = 0;
+            for (uint64_t group = 1; group < newGroups; group++) {
+                if (!hasSuper(group)) continue;
+                if (group >= groups) {
+                    WriteLe32(map + slot * 4, (uint32_t)(gdtBlock + descBlocks + r + group * blocksPerGroup));
+                }
+                slot++;
+            }
+        }
+        uint64_t iBlocks = (1 + newReservedGdt * (1 + backupsAfter)) * sectorsPerBlock;
+        WriteLe32(&inode[EXT_I_BLOCKS], (uint32_t)iBlocks);
+        WriteLe16(&inode[EXT_I_BLOCKS_HI], (uint16_t)(iBlocks >> 32));
+        if (metadataCsum) {
+            bool hasHigh = inodeSize > EXT_GOOD_OLD_INODE_SIZE && ReadLe16(&inode[EXT_I_EXTRA_ISIZE]) >= 4;
+            std::vector<uint8_t> copy = inode;
+            WriteLe16(&copy[EXT_I_CHECKSUM], 0);
+            if (hasHigh) WriteLe16(&copy[EXT_I_CHECKSUM_HI], 0);
+            uint8_t number[4];
+            WriteLe32(number, EXT_RESIZE_INODE);
+            uint32_t checksum = ExtChecksum(seed, number, 4);
+            checksum = ExtChecksum(checksum, &inode[EXT_I_GENERATION], 4);
+            checksum = ExtChecksum(checksum, copy.data(), copy.size());
+            WriteLe16(&inode[EXT_I_CHECKSUM], (uint16_t)checksum);
+            if (hasHigh) WriteLe16(&inode[EXT_I_CHECKSUM_HI], (uint16_t)(checksum >> 16));
+        }
+        std::vector<uint8_t> primary = gdt;
+        primary.insert(primary.end(), indirect.begin() + (size_t)(converted * blockSize), indirect.end());
+        if (!volume.Store(gdtBlock * blockSize, primary.data(), primary.size(), error) ||
+            !volume.Store(dindBlock * blockSize, dind.data(), dind.size(), error) ||
+            !volume.Store(inodeOffset, inode.data(), inode.size(), error)) {
+            return false;
+        }
+    } else if (!volume.Store(gdtBlock * blockSize, gdt.data(), gdt.size(), error)) {
+        return false;
+    }
+    sealSuper(super, 0);
+    if (!volume.Store(EXT_SUPERBLOCK_OFFSET, super.data(), super.size(), error)) return false;
+    growth.bytesAfter = target * blockSize;
+    return true;
+}
+
+// ============================================================================
+// FILE SYSTEM
+// ============================================================================
+
+enum class GrowableKind { None, Fat32, Exfat, Ext };
+
+static bool DetectGrowable(GrowVolume& volume, GrowableKind& kind, std::wstring& error) {
+    uint8_t boot[512];
+    uint8_t super[EXT_SUPERBLOCK_SIZE];
+    if (!volume.Load(0, boot, sizeof(boot), error)) return false;
+    if (!volume.Load(EXT_SUPERBLOCK_OFFSET, super, sizeof(super), error)) return false;
+    if (IsExfatBootSector(boot)) kind = GrowableKind::Exfat;
+    else if (IsFat32BootSector(boot)) kind = GrowableKind::Fat32;
+    else if (ReadLe16(super + EXT_MAGIC) == EXT_SUPER_MAGIC) kind = GrowableKind::Ext;
+    else kind = GrowableKind::None;
+    return true;
+}
+
+bool GrowFileSystem(BlockDevice& device, uint64_t offset, uint64_t bytes, FileSystemGrowth& growth,
+                    std::wstring& error) {
+    growth = FileSystemGrowth();
+    GrowVolume volume(device, offset);
+    GrowableKind kind = GrowableKind::None;
+    if (!DetectGrowable(volume, kind, error)) return false;
+    bool grown = false;
+    switch (kind) {
+    case GrowableKind::Fat32: grown = GrowFat32(volume, bytes, growth, error); break;
+    case GrowableKind::Exfat: grown = GrowExfat(volume, bytes, growth, error); break;
+    case GrowableKind::Ext: grown = GrowExt(volume, bytes, growth, error); break;
+    case GrowableKind::None:
+        error = L"No FAT32, exFAT or ext2/3/4 file system to grow.";
+        return false;
+    }
+    growth.bytesWritten = volume.GetBytesWritten();
+    if (!grown) return false;
+    if (growth.bytesWritten && !device.Flush()) {
+        error = L"Failed to flush the grown file system to the device.";
+        return false;
+    }
+    LogEvent(LogLevel::Info, "grow", "file_system",
+             {{"before", (int64_t)growth.bytesBefore}, {"after", (int64_t)growth.bytesAfter},
+              {"written", (int64_t)growth.bytesWritten}, {"limited", (int64_t)!growth.limit.empty()}});
+    return true;
+}
+
+// ============================================================================
+// DRIVE
+// ============================================================================
+
+bool GrowToDrive(BlockDevice& device, DriveGrowReport* report, std::wstring& error) {
+    auto start = std::chrono::steady_clock::now();
+    DriveGrowReport result;
+    PartitionTable table;
+    if (!ReadPartitionTable(device, table) || table.style == PartitionStyle::Raw) {
+        error = L"The drive has no partition table to extend.";
+        return false;
+    }
+    result.style = table.style;
+
+    // The partition that ends last grows, when nothing else reaches into it
+    // and it holds a file system that grows too.
+    const PartitionEntry* last = nullptr;
+    for (const PartitionEntry& entry : table.partitions) {
+        if (!last || entry.startLba + entry.sectorCount > last->startLba + last->sectorCount) last = &entry;
+    }
+    bool grow = last != nullptr;
+    for (const PartitionEntry& entry : table.partitions) {
+        if (grow && &entry != last && entry.startLba + entry.sectorCount > last->startLba) grow = false;
+    }
+    GrowableKind kind = GrowableKind::None;
+    if (grow) {
+        GrowVolume volume(device, last->startLba * table.sectorSize);
+        if (!DetectGrowable(volume, kind, error)) return false;
+        grow = kind != GrowableKind::None;
+    }
+
+    uint64_t grownSectors = 0;
+    if (!ExtendPartitionTable(device, grow ? last->startLba : 0, &grownSectors, error)) return false;
+    if (grow && grownSectors > last->sectorCount) {
+        result.partitionOffset = last->startLba * table.sectorSize;
+        result.partitionBytesBefore = last->sectorCount * table.sectorSize;
+        result.partitionBytesAfter = grownSectors * table.sectorSize;
+        if (!GrowFileSystem(device, result.partitionOffset, result.partitionBytesAfter, result.fileSystem, error)) {
+            error = L"The partition was extended but its file system was not grown: " + error;
+            return false;
+        }
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    LogEvent(LogLevel::Info, "grow", "drive",
+             {{"partition_before", (int64_t)result.partitionBytesBefore},
+              {"partition_after", (int64_t)result.partitionBytesAfter},
+              {"written", (int64_t)result.fileSystem.bytesWritten},
+              {"ms", (int64_t)(result.seconds * 1000.0)}});
+    if (report) *report = result;
+    return true;
+}
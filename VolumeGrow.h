@@ -0,0 +1,57 @@
+// ============================================================================
+// INFERNO - Growing a raw copy's last volume to the end of the drive
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+#include "PartitionTable.h"
+
+#include <cstdint>
+#include <string>
+
+struct FileSystemGrowth {
+    std::wstring fileSystem;            // "FAT32", "exFAT", "ext4" ...
+    uint64_t bytesBefore = 0;           // space the file system spanned
+    uint64_t bytesAfter = 0;
+    // Why it stops short of the space it was given; empty when it does not.
+    std::wstring limit;
+    uint64_t bytesWritten = 0;          // metadata, all of it
+};
+
+// Grows the FAT32, exFAT or ext2/3/4 file system at byte `offset` of
+// `device` towards `bytes` by rewriting only its metadata; no file data
+// moves. How far each can go:
+//
+//   FAT32  as many clusters as its FATs have entries for. Both FATs sit in
+//          front of the data area, so going further would move every file.
+//   exFAT  as many clusters as its FAT and allocation bitmap have room for,
+//          for the same reason.
+//   ext4   whole block groups, until the reserved GDT blocks mkfs leaves for
+//          online resizing run out (normally 1024 times the original size).
+//          The new groups' bitmaps and inode tables are left for the kernel
+//          to initialise (uninit_bg or metadata_csum is required), so only
+//          superblocks and group descriptors are written.
+//
+// Stopping short is not a failure: `growth.limit` says why. Fails on a read
+// or write error, or when no supported file system is found at `offset`.
+bool GrowFileSystem(BlockDevice& device, uint64_t offset, uint64_t bytes, FileSystemGrowth& growth,
+                    std::wstring& error);
+
+struct DriveGrowReport {
+    PartitionStyle style = PartitionStyle::Raw;
+    uint64_t partitionOffset = 0;       // bytes; 0 when no partition grew
+    uint64_t partitionBytesBefore = 0;
+    uint64_t partitionBytesAfter = 0;
+    FileSystemGrowth fileSystem;        // empty when the last partition holds none that grows
+    double seconds = 0.0;
+};
+
+// After an image made for a smaller disk has been copied to the drive
+// sector by sector: relocates a GPT's backup to the end of the drive and,
+// when the partition that ends last holds a file system GrowFileSystem
+// knows, ends it at the new last usable LBA and grows the file system into
+// it (see ExtendPartitionTable). Partition first, file system second, so an
+// interruption leaves a file system smaller than its partition rather than
+// the reverse.
+bool GrowToDrive(BlockDevice& device, DriveGrowReport* report, std::wstring& error);
@@ -0,0 +1,274 @@
+// ============================================================================
+// INFERNO - Adaptive write control
+// ============================================================================
+
+#include "WriteController.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+static const uint64_t MIB = 1024 * 1024;
+static const uint64_t MIN_FLUSH_INTERVAL = 16 * MIB;
+static const uint64_t MAX_FLUSH_INTERVAL = 256 * MIB;
+static const uint64_t MIN_WINDOW_REQUESTS = 4;
+static const size_t MAX_DECISIONS = 256;
+
+static const char* const MOVE_NAMES[] = {"try smaller queue", "try larger chunk", "try larger queue",
+                                         "try smaller chunk"};
+
+// ============================================================================
+// CONTROLLER
+// ============================================================================
+
+WriteController::WriteController(const WriterParams& initial, const WriteControllerParams& params)
+    : m_params(params),
+      m_chunkSize(std::min(std::max(initial.chunkSize, params.minChunkSize), params.maxChunkSize)),
+      m_queueDepth(std::min(std::max<uint32_t>(initial.queueDepth, 1), params.maxQueueDepth)),
+      m_start(std::chrono::steady_clock::now()) {
+}
+
+double WriteController::Seconds(std::chrono::steady_clock::time_point time) const {
+    return std::chrono::duration<double>(time - m_start).count();
+}
+
+void WriteController::Begin() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_decisions.empty()) {
+        m_start = std::chrono::steady_clock::now();
+        Record("start", 0.0, 0.0, 0.0);
+    }
+    m_windowStart = Seconds(std::chrono::steady_clock::now());
+    m_windowStartBytes = m_bytesDone;
+    m_windowBytes = 0;
+    m_windowRequests = 0;
+    m_windowLatency = 0.0;
+    // The first window includes the queue filling up.
+    m_skipWindow = true;
+}
+
+void WriteController::OnChunkWritten(uint64_t bytes, double seconds) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    double now = Seconds(std::chrono::steady_clock::now());
+    m_bytesDone += bytes;
+    m_windowBytes += bytes;
+    m_windowRequests++;
+    m_windowLatency += seconds;
+
+    double elapsed = now - m_windowStart;
+    if (elapsed < m_params.windowSeconds || m_windowRequests < MIN_WINDOW_REQUESTS) {
+        return;
+    }
+    EndWindow(now, m_windowBytes / elapsed, m_windowLatency / m_windowRequests * 1000.0);
+    m_windowStart = now;
+    m_windowStartBytes = m_bytesDone;
+    m_windowBytes = 0;
+    m_windowRequests = 0;
+    m_windowLatency = 0.0;
+}
+
+// Called with m_lock held.
+void WriteController::EndWindow(double now, double bytesPerSecond, double latencyMillis) {
+    m_rate = m_rate > 0.0 ? 0.5 * m_rate + 0.5 * bytesPerSecond : bytesPerSecond;
+    if (m_skipWindow) {
+        m_skipWindow = false;
+        return;
+    }
+
+    bool low = !m_cliff && m_peak > 0.0 && bytesPerSecond < m_params.cliffRatio * m_peak;
+    if (low) {
+        if (m_lowWindows++ == 0) m_lowStartBytes = m_windowStartBytes;
+    } else {
+        m_lowWindows = 0;
+        m_peak = std::max(m_peak, bytesPerSecond);
+    }
+
+    if (m_trialActive) {
+        m_trialActive = false;
+        Move move = (Move)((m_nextMove + MOVE_COUNT - 1) % MOVE_COUNT);
+        bool shrinking = (move == SmallerQueue || move == SmallerChunk);
+        bool keep = !low && bytesPerSecond >= m_baseline * (shrinking ? m_params.keepRatio : m_params.gainRatio);
+        if (keep) {
+            m_baseline = bytesPerSecond;
+            m_failedMoves = 0;
+            Record("keep", now, bytesPerSecond, latencyMillis);
+        } else {
+            m_chunkSize = m_trialChunkSize;
+            m_queueDepth = m_trialQueueDepth;
+            m_failedMoves++;
+            m_skipWindow = true;
+            Record("revert", now, bytesPerSecond, latencyMillis);
+        }
+        // A collapse is confirmed on the restored settings before anything else.
+        if (!low) StartTrial(now, bytesPerSecond, latencyMillis);
+        return;
+    }
+
+    if (m_lowWindows >= 2) {
+        m_cliff = true;
+        m_cliffBytes = m_lowStartBytes;
+        m_slowRate = bytesPerSecond;
+        m_rate = bytesPerSecond;
+        uint64_t interval = (uint64_t)(bytesPerSecond * m_params.flushSeconds) / MIB * MIB;
+        m_flushInterval = std::min(std::max(interval, MIN_FLUSH_INTERVAL), MAX_FLUSH_INTERVAL);
+        Record("cliff", now, bytesPerSecond, latencyMillis);
+        // Search again from the top: what was right for the cache rarely is for the flash behind it.
+        m_settled = false;
+        m_failedMoves = 0;
+        m_nextMove = SmallerQueue;
+        m_baseline = bytesPerSecond;
+        StartTrial(now, bytesPerSecond, latencyMillis);
+        return;
+    }
+    if (low || m_settled) {
+        return;
+    }
+    m_baseline = bytesPerSecond;
+    StartTrial(now, bytesPerSecond, latencyMillis);
+}
+
+// Called with m_lock held.
+bool WriteController::ApplyMove(Move move) {
+    uint32_t chunkSize = m_chunkSize;
+    uint32_t queueDepth = m_queueDepth;
+    switch (move) {
+    case SmallerQueue:
+        if (queueDepth <= 1) return false;
+        m_queueDepth = queueDepth / 2;
+        return true;
+    case LargerChunk:
+        if (chunkSize > m_params.maxChunkSize / 2) return false;
+        m_chunkSize = chunkSize * 2;
+        return true;
+    case LargerQueue:
+        if (queueDepth > m_params.maxQueueDepth / 2) return false;
+        m_queueDepth = queueDepth * 2;
+        return true;
+    case SmallerChunk:
+        if (chunkSize / 2 < m_params.minChunkSize) return false;
+        m_chunkSize = chunkSize / 2;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Applies the next step that is in range. Called with m_lock held.
+void WriteController::StartTrial(double now, double bytesPerSecond, double latencyMillis) {
+    while (m_failedMoves < MOVE_COUNT) {
+        Move move = m_nextMove;
+        m_nextMove = (Move)((m_nextMove + 1) % MOVE_COUNT);
+        m_trialChunkSize = m_chunkSize;
+        m_trialQueueDepth = m_queueDepth;
+        if (ApplyMove(move)) {
+            m_trialActive = true;
+            m_skipWindow = true;
+            Record(MOVE_NAMES[move], now, bytesPerSecond, latencyMillis);
+            return;
+        }
+        m_failedMoves++;
+    }
+    m_settled = true;
+    Record("settled", now, bytesPerSecond, latencyMillis);
+}
+
+// Called with m_lock held.
+void WriteController::Record(const char* reason, double now, double bytesPerSecond, double latencyMillis) {
+    WriteDecision decision;
+    decision.reason = reason;
+    decision.seconds = now;
+    decision.bytesDone = m_bytesDone;
+    decision.chunkSize = m_chunkSize;
+    decision.queueDepth = m_queueDepth;
+    decision.flushInterval = m_flushInterval;
+    decision.bytesPerSecond = bytesPerSecond;
+    decision.latencyMillis = latencyMillis;
+    LogEvent(LogLevel::Info, "writer", reason,
+             {{"bytes", (int64_t)decision.bytesDone}, {"bps", (int64_t)bytesPerSecond},
+              {"chunk", decision.chunkSize}, {"queue_depth", decision.queueDepth}});
+    if (m_decisions.size() < MAX_DECISIONS) {
+        m_decisions.push_back(decision);
+    }
+}
+
+bool WriteController::TakeFlush(uint64_t bytes) {
+    uint64_t interval = m_flushInterval;
+    uint64_t unflushed = m_unflushed.fetch_add(bytes) + bytes;
+    if (interval == 0 || unflushed < interval) {
+        return false;
+    }
+    // Only the caller that resets the count flushes.
+    if (!m_unflushed.compare_exchange_strong(unflushed, 0)) {
+        return false;
+    }
+    m_flushes++;
+    return true;
+}
+
+// ============================================================================
+// ESTIMATES
+// ============================================================================
+
+double WriteController::EstimateSecondsRemaining(uint64_t done, uint64_t total) const {
+    if (total == 0) return -1.0;
+    if (done >= total) return 0.0;
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    double elapsed = Seconds(std::chrono::steady_clock::now());
+    double rate = m_rate > 0.0 ? m_rate : (elapsed > 0.0 && done > 0 ? done / elapsed : 0.0);
+    if (rate <= 0.0) return -1.0;
+
+    uint64_t remaining = total - done;
+    uint64_t cache = m_params.expectedCacheBytes;
+    // Detection lags the cliff by a few windows; the expected one is trusted
+    // until it is overdue by more than that (or a quarter of the cache).
+    uint64_t overdue = std::max<uint64_t>(cache / 4, (uint64_t)(m_peak * m_params.windowSeconds * 4));
+    if (!m_cliff && cache > 0 && done < cache + overdue && m_params.expectedSlowBytesPerSecond > 0.0) {
+        uint64_t fast = done < cache ? std::min(cache - done, remaining) : 0;
+        return fast / rate + (remaining - fast) / m_params.expectedSlowBytesPerSecond;
+    }
+    return remaining / rate;
+}
+
+double WriteController::EstimateTimeFraction(uint64_t done, uint64_t total) const {
+    double remaining = EstimateSecondsRemaining(done, total);
+    if (remaining < 0.0) {
+        return total ? (double)done / total : 0.0;
+    }
+    double elapsed;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        elapsed = Seconds(std::chrono::steady_clock::now());
+    }
+    return elapsed + remaining > 0.0 ? elapsed / (elapsed + remaining) : 1.0;
+}
+
+WriteControllerSummary WriteController::GetSummary() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    WriteControllerSummary summary;
+    summary.chunkSize = m_chunkSize;
+    summary.queueDepth = m_queueDepth;
+    summary.flushInterval = m_flushInterval;
+    summary.flushes = m_flushes;
+    summary.peakBytesPerSecond = m_peak;
+    summary.cliffDetected = m_cliff;
+    summary.cliffBytes = m_cliffBytes;
+    summary.slowBytesPerSecond = m_slowRate;
+    summary.decisions = m_decisions;
+    return summary;
+}
+
+std::wstring DescribeWriteDecision(const WriteDecision& decision) {
+    std::wstringstream text;
+    text << std::fixed << std::setprecision(1) << decision.seconds << L" s, "
+         << (double)decision.bytesDone / MIB << L" MB: " << decision.reason;
+    if (decision.bytesPerSecond > 0.0) {
+        text << L" (" << decision.bytesPerSecond / MIB << L" MB/s, " << decision.latencyMillis << L" ms)";
+    }
+    text << L"; " << decision.chunkSize / 1024 << L" KB x " << decision.queueDepth;
+    if (decision.flushInterval) {
+        text << L", flush every " << decision.flushInterval / MIB << L" MB";
+    }
+    return text.str();
+}
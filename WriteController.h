@@ -0,0 +1,142 @@
+// ============================================================================
+// INFERNO - Adaptive write control
+// ============================================================================
+
+#pragma once
+
+#include "ImageWriter.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct WriteControllerParams {
+    uint32_t minChunkSize = 128 * 1024;
+    uint32_t maxChunkSize = 4 * 1024 * 1024;
+    uint32_t maxQueueDepth = 8;
+    double windowSeconds = 1.0;         // throughput is sampled over windows this long
+    double cliffRatio = 0.5;            // two windows this far below the peak mark the cliff
+    double keepRatio = 0.95;            // a smaller setting stays if it keeps this share of the throughput
+    double gainRatio = 1.05;            // a larger one only if it gains this much
+    double flushSeconds = 2.0;          // past the cliff, flush after this long's worth of writes
+
+    // The device model's cliff from an earlier write (see DeviceProfile);
+    // 0 when unknown. Lets the estimate anticipate the slowdown.
+    uint64_t expectedCacheBytes = 0;
+    double expectedSlowBytesPerSecond = 0.0;
+};
+
+// One change of the controller's settings, or an observation that caused one.
+// `reason` is a string literal.
+struct WriteDecision {
+    const char* reason = "";
+    double seconds = 0.0;               // since the write began
+    uint64_t bytesDone = 0;
+    uint32_t chunkSize = 0;             // settings in effect after the decision
+    uint32_t queueDepth = 0;
+    uint64_t flushInterval = 0;         // bytes between flushes; 0 for none
+    double bytesPerSecond = 0.0;        // the window that prompted it
+    double latencyMillis = 0.0;         // mean request latency in that window
+};
+
+struct WriteControllerSummary {
+    uint32_t chunkSize = 0;             // final settings
+    uint32_t queueDepth = 0;
+    uint64_t flushInterval = 0;
+    uint64_t flushes = 0;
+    double peakBytesPerSecond = 0.0;
+    bool cliffDetected = false;
+    uint64_t cliffBytes = 0;            // bytes written when throughput fell off
+    double slowBytesPerSecond = 0.0;    // throughput in the first windows past it
+    std::vector<WriteDecision> decisions;
+};
+
+// Retunes a running write (WriterParams::controller) for sticks whose SLC
+// cache makes them fast for the first gigabytes and slow after. Completed
+// requests are sampled in windows of throughput and mean latency; between
+// windows the controller tries one step at a time (halve the queue, double
+// the chunk, double the queue, halve the chunk), keeping a smaller setting
+// if throughput holds and a larger one only if it clearly improves, and
+// settles once a full round of steps changes nothing. Two windows far below
+// the peak mark the cliff: the search starts over for the slow regime and
+// periodic flushes begin, so the final flush does not stall on gigabytes
+// of cached writes with the progress bar at 100%.
+//
+// Called concurrently by pipeline workers; every method is thread-safe.
+class WriteController {
+public:
+    WriteController(const WriterParams& initial, const WriteControllerParams& params = WriteControllerParams());
+
+    // Called by the pipeline as it starts; the clock and windows restart.
+    void Begin();
+
+    uint32_t GetChunkSize() const { return m_chunkSize.load(std::memory_order_relaxed); }
+    uint32_t GetQueueDepth() const { return m_queueDepth.load(std::memory_order_relaxed); }
+    uint32_t GetMaxChunkSize() const { return m_params.maxChunkSize; }
+    uint32_t GetMaxQueueDepth() const { return m_params.maxQueueDepth; }
+
+    // A write request of `bytes` completed after `seconds` in flight.
+    void OnChunkWritten(uint64_t bytes, double seconds);
+
+    // Counts `bytes` as written; true when a flush is due.
+    bool TakeFlush(uint64_t bytes);
+
+    // Seconds until `total` bytes are written, from the current throughput
+    // and, before the cliff, the expected one past it. -1 when unknown.
+    double EstimateSecondsRemaining(uint64_t done, uint64_t total) const;
+
+    // Share of the expected write time already spent: a progress fraction
+    // that does not race ahead of the slow tail.
+    double EstimateTimeFraction(uint64_t done, uint64_t total) const;
+
+    WriteControllerSummary GetSummary() const;
+
+private:
+    enum Move { SmallerQueue, LargerChunk, LargerQueue, SmallerChunk, MOVE_COUNT };
+
+    void EndWindow(double now, double bytesPerSecond, double latencyMillis);
+    void StartTrial(double now, double bytesPerSecond, double latencyMillis);
+    bool ApplyMove(Move move);
+    void Record(const char* reason, double now, double bytesPerSecond, double latencyMillis);
+    double Seconds(std::chrono::steady_clock::time_point time) const;
+
+    WriteControllerParams m_params;
+    std::atomic<uint32_t> m_chunkSize;
+    std::atomic<uint32_t> m_queueDepth;
+    std::atomic<uint64_t> m_flushInterval{0};
+    std::atomic<uint64_t> m_unflushed{0};
+    std::atomic<uint64_t> m_flushes{0};
+
+    mutable std::mutex m_lock;
+    std::chrono::steady_clock::time_point m_start;
+    uint64_t m_bytesDone = 0;
+    double m_windowStart = 0.0;
+    uint64_t m_windowStartBytes = 0;
+    uint64_t m_windowBytes = 0;
+    uint64_t m_windowRequests = 0;
+    double m_windowLatency = 0.0;
+    double m_rate = 0.0;                // smoothed over windows
+    double m_peak = 0.0;
+    uint32_t m_lowWindows = 0;
+    uint64_t m_lowStartBytes = 0;
+    bool m_cliff = false;
+    uint64_t m_cliffBytes = 0;
+    double m_slowRate = 0.0;
+
+    bool m_skipWindow = false;          // settings just changed: the next window mixes both
+    bool m_trialActive = false;
+    bool m_settled = false;
+    Move m_nextMove = SmallerQueue;
+    uint32_t m_failedMoves = 0;
+    double m_baseline = 0.0;
+    uint32_t m_trialChunkSize = 0;      // settings to return to if the trial fails
+    uint32_t m_trialQueueDepth = 0;
+    std::vector<WriteDecision> m_decisions;
+};
+
+// "41.3 s, 3968.0 MB: cliff (5.8 MB/s, 310.2 ms); 1024 KB x 4, flush every
+// 11 MB" for logs and reports.
+std::wstring DescribeWriteDecision(const WriteDecision& decision);
@@ -0,0 +1,472 @@
+// ============================================================================
+// INFERNO - Write strategy planning from an image's contents
+// ============================================================================
+
+#include "WritePlanner.h"
+#include "ImageSource.h"
+#include "IsoHybrid.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cwctype>
+#include <set>
+
+// Bounds on what a damaged or hostile image can make us read.
+static const uint32_t ISO_FIRST_DESCRIPTOR = 16;
+static const uint32_t ISO_MAX_DESCRIPTORS = 32;
+static const uint32_t MAX_DIRECTORY_BYTES = 1024 * 1024;
+static const uint32_t MAX_DIRECTORIES = 65536;
+
+static const uint8_t DESCRIPTOR_PRIMARY = 1;
+static const uint8_t DESCRIPTOR_SUPPLEMENTARY = 2;
+static const uint8_t DESCRIPTOR_TERMINATOR = 255;
+
+// A UDF image's ISO9660 tree holds no more than this many files.
+static const uint64_t PLACEHOLDER_FILES = 3;
+
+static const uint8_t FILE_FLAG_DIRECTORY = 0x02;
+static const uint8_t FILE_FLAG_MORE_EXTENTS = 0x80;    // a file over 4 GiB continues in the next record
+
+static const uint64_t SIZE_CLASS_LIMITS[IMAGE_SIZE_CLASSES - 1] = {64 * 1024, 1024 * 1024, 64 * 1024 * 1024,
+                                                                    FAT32_MAX_FILE_BYTES + 1};
+
+// Share of the sequential rate a stick keeps on files of each size class:
+// small files are written in a few scattered requests each, which the
+// controller of a stick handles far slower than long runs.
+static const double SIZE_CLASS_EFFICIENCY[IMAGE_SIZE_CLASSES] = {0.3, 0.6, 0.9, 1.0, 1.0};
+
+// An unprofiled stick, as it would calibrate on a fast enough link.
+static const double DEFAULT_BYTES_PER_SECOND = 20.0 * 1000 * 1000;
+static const double DEFAULT_SECONDS_PER_FILE = 0.005;
+
+// Parts of a split install.wim (install.swm, install2.swm ...), as Windows
+// Setup's own media tools make them.
+static const uint64_t WIM_PART_BYTES = 3800ull * 1024 * 1024;
+
+// The FAT partition that carries the exFAT driver and the boot loader that
+// chains to the exFAT volume.
+static const uint64_t UEFI_BRIDGE_BYTES = 1024 * 1024;
+
+// Strategies are listed simplest first; a later one is chosen only when it
+// is estimated this much faster.
+static const double PREFERENCE_MARGIN = 0.95;
+
+// Partitions start on the first MiB.
+static const uint64_t PARTITION_OFFSET = 1024 * 1024;
+
+// What an MBR partition can address: 2^32 - 1 logical sectors, 2 TiB on a
+// drive with 512-byte ones.
+static uint64_t MbrMaxBytes(const DeviceGeometry& geometry) {
+    return 0xFFFFFFFFull * std::max<uint32_t>(geometry.logicalSectorSize, 512);
+}
+
+static uint32_t ReadLe32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool EndsWithNoCase(const std::wstring& text, const wchar_t* suffix) {
+    size_t length = wcslen(suffix);
+    if (text.size() < length) return false;
+    for (size_t i = 0; i < length; i++) {
+        if (towlower(text[text.size() - length + i]) != (wint_t)suffix[i]) return false;
+    }
+    return true;
+}
+
+const wchar_t* WriteStrategyName(WriteStrategy strategy) {
+    switch (strategy) {
+    case WriteStrategy::RawCopy: return L"Raw copy";
+    case WriteStrategy::Fat32Files: return L"FAT32 file copy";
+    case WriteStrategy::ExfatUefiBridge: return L"exFAT with UEFI bridge";
+    case WriteStrategy::WimSplit: return L"FAT32 with split Windows image";
+    default: return L"Unknown";
+    }
+}
+
+// ============================================================================
+// IMAGE ANALYSIS
+// ============================================================================
+
+static void AddFile(ImageContents& contents, const std::wstring& path, uint64_t bytes) {
+    contents.fileCount++;
+    contents.fileBytes += bytes;
+    if (bytes > contents.largestFileBytes) {
+        contents.largestFileBytes = bytes;
+        contents.largestFile = path;
+    }
+    if (bytes > FAT32_MAX_FILE_BYTES) {
+        contents.oversizedFiles.push_back(path);
+    }
+    size_t sizeClass = 0;
+    while (sizeClass < IMAGE_SIZE_CLASSES - 1 && bytes >= SIZE_CLASS_LIMITS[sizeClass]) sizeClass++;
+    contents.classFiles[sizeClass]++;
+    contents.classBytes[sizeClass] += bytes;
+}
+
+// Every file below the directory at `rootSector`, breadth first. A file of
+// more than 4 GiB is recorded as several extents in consecutive records of
+// the same name, all but the last flagged.
+static bool ListIsoFiles(ImageReader& reader, uint32_t rootSector, uint32_t rootBytes, bool joliet,
+                         ImageContents& contents, std::wstring& error) {
+    struct Directory {
+        uint32_t sector;
+        uint32_t bytes;
+        std::wstring path;
+    };
+    std::set<uint32_t> visited;
+    std::vector<Directory> queue = {{rootSector, rootBytes, std::wstring()}};
+    std::vector<uint8_t> extent;
+    for (size_t next = 0; next < queue.size() && visited.size() < MAX_DIRECTORIES; next++) {
+        Directory directory = queue[next];
+        uint32_t bytes = std::min(directory.bytes, MAX_DIRECTORY_BYTES);
+        if (bytes == 0 || !visited.insert(directory.sector).second) continue;
+
+        extent.resize(bytes);
+        if (!reader.ReadAt((uint64_t)directory.sector * ISO_SECTOR_SIZE, extent.data(), extent.size(), error)) {
+            return false;
+        }
+        contents.directoryCount++;
+
+        // Records never span sectors; a zero length pads to the next one.
+        uint64_t pendingBytes = 0;
+        size_t position = 0;
+        while (position + 34 <= extent.size()) {
+            uint8_t length = extent[position];
+            if (length == 0) {
+                position = (position / ISO_SECTOR_SIZE + 1) * ISO_SECTOR_SIZE;
+                continue;
+            }
+            if (length < 34 || position + length > extent.size()) break;
+            const uint8_t* record = extent.data() + position;
+            position += length;
+            uint8_t nameLength = record[32];
+            if (33u + nameLength > length || (nameLength == 1 && record[33] <= 1)) continue;
+
+            std::wstring name;
+            const uint8_t* text = record + 33;
+            if (joliet) {
+                for (uint8_t i = 0; i + 1 < nameLength; i += 2) name.push_back((wchar_t)((text[i] << 8) | text[i + 1]));
+            } else {
+                name.assign(text, text + nameLength);
+            }
+            size_t version = name.find(L';');
+            if (version != std::wstring::npos) name.resize(version);
+            if (!name.empty() && name.back() == L'.') name.pop_back();
+            std::wstring path = directory.path + L"/" + name;
+
+            uint8_t flags = record[25];
+            if (flags & FILE_FLAG_DIRECTORY) {
+                queue.push_back({ReadLe32(record + 2), ReadLe32(record + 10), path});
+                continue;
+            }
+            pendingBytes += ReadLe32(record + 10);
+            if (flags & FILE_FLAG_MORE_EXTENTS) continue;
+            AddFile(contents, path, pendingBytes);
+            pendingBytes = 0;
+        }
+    }
+    return true;
+}
+
+static void AnalyzeIso(ImageReader& reader, ImageContents& contents) {
+    uint32_t rootSector = 0, rootBytes = 0;
+    bool joliet = false;
+    std::wstring error;
+    for (uint32_t index = 0; index < ISO_MAX_DESCRIPTORS; index++) {
+        uint8_t descriptor[ISO_SECTOR_SIZE];
+        uint64_t offset = (uint64_t)(ISO_FIRST_DESCRIPTOR + index) * ISO_SECTOR_SIZE;
+        if (!reader.ReadAt(offset, descriptor, sizeof(descriptor), error) || memcmp(descriptor + 1, "CD001", 5) != 0 ||
+            descriptor[0] == DESCRIPTOR_TERMINATOR) {
+            break;
+        }
+        bool isJoliet = descriptor[0] == DESCRIPTOR_SUPPLEMENTARY && descriptor[88] == '%' && descriptor[89] == '/' &&
+                        (descriptor[90] == '@' || descriptor[90] == 'C' || descriptor[90] == 'E');
+        if ((descriptor[0] == DESCRIPTOR_PRIMARY && rootSector == 0) || (isJoliet && !joliet)) {
+            rootSector = ReadLe32(descriptor + 156 + 2);
+            rootBytes = ReadLe32(descriptor + 156 + 10);
+            joliet = isJoliet;
+        }
+    }
+
+    IsoBootInfo boot;
+    if (ReadIsoBootInfo(contents.info.path, boot, error)) {
+        contents.volumeBytes = boot.volumeBytes;
+        contents.hybridMbr = boot.alreadyHybrid;
+        contents.biosBootable = boot.hasBiosImage && boot.hasMbrBootCode;
+        contents.efiBootable = boot.hasEfiImage;
+        contents.hybridizable = !boot.alreadyHybrid && (contents.biosBootable || contents.efiBootable);
+    }
+
+    // A compressed image would be decompressed up to each directory read.
+    if (contents.info.compressed || rootSector == 0) {
+        return;
+    }
+    if (!ListIsoFiles(reader, rootSector, rootBytes, joliet, contents, error)) {
+        LogMessage(LogLevel::Warning, "planner", L"Cannot list " + contents.info.path + L": " + error);
+        return;
+    }
+    // UDF images (Windows media) carry an ISO9660 tree with a README only,
+    // which says nothing about the files a copy would take.
+    contents.filesListed = contents.fileCount > PLACEHOLDER_FILES || contents.fileBytes >= contents.volumeBytes / 2;
+}
+
+bool AnalyzeImage(const std::wstring& path, ImageContents& contents, std::wstring& error) {
+    contents = ImageContents();
+    if (!ReadImageInfo(path, contents.info, error)) {
+        return false;
+    }
+    contents.volumeBytes = contents.info.size;
+    if (contents.info.format == ImageFormat::Iso9660) {
+        ImageReader reader(path);
+        AnalyzeIso(reader, contents);
+    } else if (contents.info.boot & IMAGE_BOOT_RAW) {
+        contents.biosBootable = (contents.info.boot & IMAGE_BOOT_BIOS) != 0;
+        contents.efiBootable = (contents.info.boot & IMAGE_BOOT_UEFI) != 0;
+    }
+    return true;
+}
+
+// ============================================================================
+// DEVICE SPEED
+// ============================================================================
+
+DeviceSpeed LookupDeviceSpeed(const DeviceIdentity& identity, const std::wstring& devicePath,
+                              DeviceProfileDatabase& database) {
+    DeviceSpeed speed;
+    speed.secondsPerFile = DEFAULT_SECONDS_PER_FILE;
+
+    DeviceProfile profile;
+    if (identity.IsKnown() && database.Find(identity, profile)) {
+        for (const TuningSample& sample : profile.samples) {
+            speed.bytesPerSecond = std::max(speed.bytesPerSecond, sample.bytesPerSecond);
+        }
+        speed.measured = speed.bytesPerSecond > 0;
+        speed.slcCacheBytes = profile.slcCacheBytes;
+        speed.slcExhaustedBytesPerSecond = profile.slcExhaustedBytesPerSecond;
+    }
+    if (!speed.measured) {
+        speed.bytesPerSecond = DEFAULT_BYTES_PER_SECOND;
+        UsbTopology topology;
+        if (QueryUsbTopology(devicePath, topology) && topology.speedMbps) {
+            speed.bytesPerSecond = std::min(speed.bytesPerSecond, EstimateUsbLinkBytesPerSecond(topology.speedMbps));
+        }
+    }
+    return speed;
+}
+
+// ============================================================================
+// PLANNING
+// ============================================================================
+
+// Sequential writing of `bytes`, at the cache's speed until it runs out.
+static double SequentialSeconds(const DeviceSpeed& speed, uint64_t bytes) {
+    if (speed.slcCacheBytes && speed.slcExhaustedBytesPerSecond > 0 && bytes > speed.slcCacheBytes) {
+        return speed.slcCacheBytes / speed.bytesPerSecond +
+               (bytes - speed.slcCacheBytes) / speed.slcExhaustedBytesPerSecond;
+    }
+    return bytes / speed.bytesPerSecond;
+}
+
+// Windows' default cluster sizes for FAT32 and exFAT volumes of this size.
+static uint64_t Fat32ClusterBytes(uint64_t volumeBytes) {
+    if (volumeBytes <= 8ull << 30) return 4096;
+    if (volumeBytes <= 16ull << 30) return 8192;
+    if (volumeBytes <= 32ull << 30) return 16384;
+    return 32768;
+}
+
+static uint64_t ExfatClusterBytes(uint64_t volumeBytes) {
+    if (volumeBytes <= 256ull << 20) return 4096;
+    if (volumeBytes <= 32ull << 30) return 32768;
+    return 131072;
+}
+
+// Copying the listed files onto a freshly formatted volume of
+// `volumeBytes`, whose format writes `metadataBytes`.
+static void EstimateFileCopy(const ImageContents& contents, const DeviceSpeed& speed, uint64_t volumeBytes,
+                             uint64_t clusterBytes, uint64_t metadataBytes, StrategyEstimate& estimate) {
+    double weightedBytes = 0.0;
+    for (size_t i = 0; i < IMAGE_SIZE_CLASSES; i++) {
+        weightedBytes += contents.classBytes[i] / SIZE_CLASS_EFFICIENCY[i];
+    }
+    double slowdown = contents.fileBytes ? weightedBytes / contents.fileBytes : 1.0;
+    estimate.bytesWritten = contents.fileBytes + metadataBytes;
+    estimate.seconds = SequentialSeconds(speed, contents.fileBytes) * slowdown +
+                       metadataBytes / speed.bytesPerSecond + contents.fileCount * speed.secondsPerFile;
+
+    // Each file and directory ends in a partly used cluster.
+    uint64_t needed = contents.fileBytes + metadataBytes +
+                      (contents.fileCount + contents.directoryCount) * clusterBytes;
+    if (needed > volumeBytes) {
+        estimate.valid = false;
+        estimate.reason = L"The image's files do not fit on the drive.";
+    }
+}
+
+static StrategyEstimate EstimateRawCopy(const ImageContents& contents, const DeviceSpeed& speed,
+                                        const DeviceGeometry& geometry) {
+    StrategyEstimate estimate;
+    estimate.strategy = WriteStrategy::RawCopy;
+    // The whole file is written, padding included; a compressed image's
+    // size is only known once it is read.
+    estimate.bytesWritten = contents.info.compressed ? contents.volumeBytes
+                                                     : std::max(contents.info.size, contents.volumeBytes);
+    estimate.seconds = SequentialSeconds(speed, estimate.bytesWritten);
+    if (contents.biosBootable) estimate.boot |= IMAGE_BOOT_BIOS;
+    if (contents.efiBootable) estimate.boot |= IMAGE_BOOT_UEFI;
+
+    if (contents.info.format == ImageFormat::Iso9660 && contents.info.os == ImageOs::Windows) {
+        estimate.reason = L"Windows Setup does not find its files on an ISO9660 volume on a USB drive.";
+    } else if (contents.info.format == ImageFormat::Iso9660 && !contents.hybridMbr && !contents.hybridizable) {
+        estimate.reason = L"The image has no boot image a USB drive can start.";
+    } else if (contents.info.format != ImageFormat::Iso9660 && !(contents.info.boot & IMAGE_BOOT_RAW)) {
+        estimate.reason = L"The image is not a disk that can be copied sector by sector.";
+    } else if (estimate.bytesWritten > geometry.sizeBytes) {
+        estimate.reason = L"The image is larger than the drive.";
+    } else {
+        estimate.valid = true;
+    }
+    return estimate;
+}
+
+static StrategyEstimate EstimateFileMode(WriteStrategy strategy, const ImageContents& contents,
+                                         const DeviceSpeed& speed, const DeviceGeometry& geometry) {
+    StrategyEstimate estimate;
+    estimate.strategy = strategy;
+    estimate.boot = contents.info.boot & (IMAGE_BOOT_BIOS | IMAGE_BOOT_UEFI);
+    if (strategy == WriteStrategy::ExfatUefiBridge) {
+        // Firmware reads FAT only; the bridge cannot be chained from a BIOS.
+        estimate.boot &= IMAGE_BOOT_UEFI;
+    }
+
+    if (contents.info.format != ImageFormat::Iso9660) {
+        estimate.reason = L"Only an ISO image's files can be copied.";
+        return estimate;
+    }
+    if (!contents.filesListed) {
+        estimate.reason = L"The image's files cannot be listed.";
+        return estimate;
+    }
+    if (!estimate.boot) {
+        estimate.reason = strategy == WriteStrategy::ExfatUefiBridge ? L"The image does not boot UEFI."
+                                                                     : L"The image has no known boot loader.";
+        return estimate;
+    }
+
+    bool wimOnly = !contents.oversizedFiles.empty() &&
+                   std::all_of(contents.oversizedFiles.begin(), contents.oversizedFiles.end(),
+                               [](const std::wstring& file) {
+                                   return EndsWithNoCase(file, L".wim") || EndsWithNoCase(file, L".esd");
+                               });
+    if (strategy == WriteStrategy::Fat32Files && !contents.oversizedFiles.empty()) {
+        estimate.reason = contents.oversizedFiles.front() + L" is too large for FAT32.";
+        return estimate;
+    }
+    if (strategy == WriteStrategy::WimSplit && !(wimOnly && contents.info.os == ImageOs::Windows)) {
+        estimate.reason = contents.oversizedFiles.empty() ? L"No file needs splitting."
+                                                          : L"Only a Windows image can be split.";
+        return estimate;
+    }
+
+    estimate.valid = true;
+    uint64_t volumeBytes = geometry.sizeBytes > PARTITION_OFFSET ? geometry.sizeBytes - PARTITION_OFFSET : 0;
+    if (strategy == WriteStrategy::ExfatUefiBridge) {
+        volumeBytes = volumeBytes > UEFI_BRIDGE_BYTES ? volumeBytes - UEFI_BRIDGE_BYTES : 0;
+        uint64_t cluster = ExfatClusterBytes(volumeBytes);
+        uint64_t clusters = volumeBytes / cluster;
+        // Contiguous files need no FAT chain, so a quick format writes the
+        // allocation bitmap and little else; then the bridge partition
+        uint64_t metadata = clusters / 8 + UEFI_BRIDGE_BYTES;
+        EstimateFileCopy(contents, speed, volumeBytes, cluster, metadata, estimate);
+    } else {
+        if (estimate.boot & IMAGE_BOOT_BIOS) volumeBytes = std::min(volumeBytes, MbrMaxBytes(geometry));
+        uint64_t cluster = Fat32ClusterBytes(volumeBytes);
+        // Both FATs, written in full by the format
+        uint64_t metadata = volumeBytes / cluster * 4 * 2;
+        EstimateFileCopy(contents, speed, volumeBytes, cluster, metadata, estimate);
+        if (strategy == WriteStrategy::WimSplit) {
+            // The parts are written as they are cut, each with its own
+            // header and resource table.
+            uint64_t parts = contents.classFiles[IMAGE_SIZE_CLASSES - 1] +
+                             contents.classBytes[IMAGE_SIZE_CLASSES - 1] / WIM_PART_BYTES;
+            estimate.seconds += parts * speed.secondsPerFile;
+        }
+    }
+    return estimate;
+}
+
+bool PlanImageWrite(const ImageContents& contents, const DeviceSpeed& speed, const DeviceGeometry& geometry,
+                    WritePlan& plan, std::wstring& error) {
+    plan = WritePlan();
+    if (speed.bytesPerSecond <= 0) {
+        error = L"No write speed to estimate with.";
+        return false;
+    }
+    plan.estimates.push_back(EstimateRawCopy(contents, speed, geometry));
+    for (WriteStrategy strategy : {WriteStrategy::Fat32Files, WriteStrategy::ExfatUefiBridge, WriteStrategy::WimSplit}) {
+        plan.estimates.push_back(EstimateFileMode(strategy, contents, speed, geometry));
+    }
+
+    // Keeping every boot mode the image has comes before speed, and a
+    // strategy only wins over an earlier, simpler one by a clear margin
+    uint32_t imageBoot = contents.info.boot & (IMAGE_BOOT_BIOS | IMAGE_BOOT_UEFI);
+    const StrategyEstimate* best = nullptr;
+    for (bool keepAll : {true, false}) {
+        for (const StrategyEstimate& estimate : plan.estimates) {
+            if (!estimate.valid || (keepAll && (estimate.boot & imageBoot) != imageBoot)) continue;
+            if (!best || estimate.seconds < best->seconds * PREFERENCE_MARGIN) best = &estimate;
+        }
+        if (best) break;
+    }
+    for (const StrategyEstimate& estimate : plan.estimates) {
+        LogEvent(LogLevel::Debug, "planner", "estimate",
+                 {{"strategy", (int64_t)estimate.strategy}, {"valid", (int64_t)estimate.valid},
+                  {"bytes", (int64_t)estimate.bytesWritten}, {"milliseconds", (int64_t)(estimate.seconds * 1000)}});
+    }
+    if (!best) {
+        error = L"No way of writing this image to the drive.";
+        for (const StrategyEstimate& estimate : plan.estimates) error += L" " + DescribeEstimate(estimate);
+        return false;
+    }
+    plan.strategy = best->strategy;
+
+    // A BIOS boots from MBR only; past what MBR addresses (2 TiB with
+    // 512-byte sectors) a drive that can boot UEFI takes GPT rather than
+    // lose the rest
+    bool bios = (best->boot & IMAGE_BOOT_BIOS) != 0;
+    bool uefi = (best->boot & IMAGE_BOOT_UEFI) != 0;
+    if (bios && uefi && plan.strategy != WriteStrategy::RawCopy &&
+        geometry.sizeBytes > MbrMaxBytes(geometry)) {
+        bios = false;
+    }
+    plan.partitionScheme = bios || !uefi ? L"MBR" : L"GPT";
+    plan.targetSystem = bios == uefi ? L"UEFI-CSM" : bios ? L"BIOS" : L"UEFI";
+    switch (plan.strategy) {
+    case WriteStrategy::Fat32Files:
+    case WriteStrategy::WimSplit: plan.fileSystem = L"FAT32"; break;
+    case WriteStrategy::ExfatUefiBridge: plan.fileSystem = L"exFAT"; break;
+    default: break;
+    }
+    LogEvent(LogLevel::Info, "planner", "plan",
+             {{"strategy", (int64_t)plan.strategy}, {"files", (int64_t)contents.fileCount},
+              {"oversized", (int64_t)contents.oversizedFiles.size()},
+              {"milliseconds", (int64_t)(best->seconds * 1000)}});
+    return true;
+}
+
+std::wstring DescribeEstimate(const StrategyEstimate& estimate) {
+    std::wstring text = WriteStrategyName(estimate.strategy);
+    if (!estimate.valid) {
+        return text + L": " + estimate.reason;
+    }
+    uint64_t seconds = (uint64_t)(estimate.seconds + 0.5);
+    if (seconds < 60) {
+        return text + L", about " + std::to_wstring(seconds) + L" s";
+    }
+    text += L", about " + std::to_wstring(seconds / 60) + L" min";
+    if (seconds < 600 && seconds % 60) {
+        text += L" " + std::to_wstring(seconds % 60) + L" s";
+    }
+    return text;
+}
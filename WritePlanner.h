@@ -0,0 +1,102 @@
+// ============================================================================
+// INFERNO - Write strategy planning from an image's contents
+// ============================================================================
+
+#pragma once
+
+#include "BlockDevice.h"
+#include "DeviceTuner.h"
+#include "ImageLibrary.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Ways an image can be put on a drive.
+enum class WriteStrategy : uint8_t {
+    RawCopy,            // sector by sector, hybrid tables added to an ISO that has none
+    Fat32Files,         // one FAT32 partition, the image's files copied onto it
+    ExfatUefiBridge,    // the files on exFAT, booted through a small FAT partition with an exFAT driver
+    WimSplit            // FAT32 with the Windows image split into .swm parts below 4 GiB
+};
+
+const wchar_t* WriteStrategyName(WriteStrategy strategy);
+
+// Largest file FAT32 can hold.
+static const uint64_t FAT32_MAX_FILE_BYTES = 0xFFFFFFFFull;
+
+// File size classes: below 64 KiB, 1 MiB, 64 MiB, 4 GiB, and larger.
+static const size_t IMAGE_SIZE_CLASSES = 5;
+
+// What an image holds, as far as choosing how to write it goes.
+struct ImageContents {
+    ImageInfo info;
+    uint64_t volumeBytes = 0;           // ISO9660 volume space; the file size for other images
+    bool hybridMbr = false;             // the ISO's system area already holds a partition table
+    bool hybridizable = false;          // a hybrid layout can be built from its El Torito images
+    bool biosBootable = false;          // in DD mode
+    bool efiBootable = false;
+
+    // From the ISO9660 directory tree (Joliet's when there is one). Not
+    // listed for other images, compressed ISOs, and ISOs whose ISO9660 tree
+    // is only a placeholder next to the UDF one.
+    bool filesListed = false;
+    uint64_t fileCount = 0;
+    uint64_t directoryCount = 0;
+    uint64_t fileBytes = 0;
+    uint64_t largestFileBytes = 0;
+    std::wstring largestFile;
+    std::vector<std::wstring> oversizedFiles;   // larger than FAT32_MAX_FILE_BYTES, '/'-separated
+    uint64_t classFiles[IMAGE_SIZE_CLASSES] = {};
+    uint64_t classBytes[IMAGE_SIZE_CLASSES] = {};
+};
+
+// Reads the image's header and boot records and, for an ISO, walks its
+// directories: a few small reads per directory, none of file data.
+bool AnalyzeImage(const std::wstring& path, ImageContents& contents, std::wstring& error);
+
+// How fast a drive takes writes, for estimating. Measured figures come from
+// the drive model's profile (see DeviceTuner.h); without one, a typical
+// stick's speed capped by its USB link.
+struct DeviceSpeed {
+    double bytesPerSecond = 0.0;        // sequential, within the SLC cache
+    uint64_t slcCacheBytes = 0;         // 0 when no cliff is known
+    double slcExhaustedBytesPerSecond = 0.0;
+    double secondsPerFile = 0.0;        // creating a file: directory entry, allocation, a partial cluster
+    bool measured = false;
+};
+
+// `identity` may be unknown; `devicePath` is only asked for its USB link.
+DeviceSpeed LookupDeviceSpeed(const DeviceIdentity& identity, const std::wstring& devicePath,
+                              DeviceProfileDatabase& database);
+
+struct StrategyEstimate {
+    WriteStrategy strategy = WriteStrategy::RawCopy;
+    bool valid = false;
+    std::wstring reason;                // why it cannot be used; empty when valid
+    uint32_t boot = 0;                  // IMAGE_BOOT_BIOS / IMAGE_BOOT_UEFI the drive boots with
+    uint64_t bytesWritten = 0;
+    double seconds = 0.0;
+};
+
+struct WritePlan {
+    WriteStrategy strategy = WriteStrategy::RawCopy;
+    std::vector<StrategyEstimate> estimates;    // every strategy, in WriteStrategy order
+    // FormatOptions values for file-mode strategies; a raw copy takes the
+    // image's own layout.
+    std::wstring partitionScheme;       // "MBR", "GPT"
+    std::wstring targetSystem;          // "BIOS", "UEFI", "UEFI-CSM"
+    std::wstring fileSystem;            // "FAT32", "exFAT"
+};
+
+// Estimates every strategy for writing `contents` to the drive described by
+// `geometry` (its logical sector size sets how much of it MBR can address)
+// and picks the fastest valid one. A strategy is valid when
+// the drive boots with it at least one way the image boots and everything
+// fits; one that loses a boot mode the image has (exFAT boots UEFI only) is
+// only chosen when no strategy keeps them all. Fails when none is valid.
+bool PlanImageWrite(const ImageContents& contents, const DeviceSpeed& speed, const DeviceGeometry& geometry,
+                    WritePlan& plan, std::wstring& error);
+
+// "Raw copy, about 4 min 10 s"
+std::wstring DescribeEstimate(const StrategyEstimate& estimate);
@@ -0,0 +1,1602 @@
+// ============================================================================
+// INFERNO - Benchmark suite
+// ============================================================================
+//
+// Measures each stage of the write path in isolation and end to end, and
+// prints the results as JSON so runs can be compared across builds.
+//
+//   inferno_bench [--size 256M] [--chunk 1M] [--queue-depth 4] [--iterations 3]
+//                 [--read-policy buffered]
+//                 [--stages read,hash,...] [--source image] [--sink device]
+//                 [--work-dir dir] [--output results.json] [--trace trace.json]
+//                 [--log run.log] [--keep]
+//
+// --sink accepts a "sim:" spec (see SimulatedDevice.h) to measure the write
+// stages against a throttled or faulty device without real hardware.
+
+#include "AsyncIo.h"
+#include "BlockDevice.h"
+#include "BootConfig.h"
+#include "BufferArena.h"
+#include "Checksum.h"
+#include "Crypto.h"
+#include "ImageHashCache.h"
+#include "ImageLibrary.h"
+#include "JobQueue.h"
+#include "ImageMetadata.h"
+#include "ImageSource.h"
+#include "ImageWriter.h"
+#include "Log.h"
+#include "PartitionTable.h"
+#include "Platform.h"
+#include "SignatureScanner.h"
+#include "SimulatedDevice.h"
+#include "Trace.h"
+#include "VolumeGrow.h"
+#include "WriteController.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef INFERNO_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#ifndef INFERNO_VERSION
+#define INFERNO_VERSION "dev"
+#endif
+
+static const char* ALL_STAGES[] = {
+    "read", "decompress", "hash", "zero-detect", "buffers", "write", "fan-out", "encrypt", "scan", "verify", "erase", "format", "library", "queue",
+    "bootcfg", "grow", "end-to-end"
+};
+
+struct BenchConfig {
+    uint64_t size = 256ull * 1024 * 1024;
+    uint32_t iterations = 3;
+    WriterParams params;
+    std::set<std::string> stages;
+    std::string sourcePath;             // existing image; generated when empty
+    std::string sinkPath;               // device, file or sim: spec; scratch file when empty
+    std::string workDir = ".";
+    std::string outputPath;             // stdout when empty
+    std::string tracePath;              // Chrome trace of the run; none when empty
+    std::string logPath;                // debug-level JSON-lines log; none when empty
+    bool keepFiles = false;
+};
+
+struct BenchResult {
+    std::string stage;
+    std::string variant;
+    std::string status = "ok";          // ok, failed, unavailable
+    std::string message;
+    uint64_t bytes = 0;                 // per iteration; 0 for operation-count stages
+    int64_t sourceCachedBytes = -1;     // source bytes left in the OS cache; -1 when not measured
+    std::vector<double> seconds;
+};
+
+// ============================================================================
+// HELPERS
+// ============================================================================
+
+static bool ParseSize(const std::string& text, uint64_t& value) {
+    char* end = nullptr;
+    unsigned long long number = strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str()) return false;
+    uint64_t scale = 1;
+    switch (*end) {
+        case '\0': break;
+        case 'k': case 'K': scale = 1024ull; end++; break;
+        case 'm': case 'M': scale = 1024ull * 1024; end++; break;
+        case 'g': case 'G': scale = 1024ull * 1024 * 1024; end++; break;
+        default: return false;
+    }
+    if (*end != '\0' || number == 0) return false;
+    value = number * scale;
+    return true;
+}
+
+static std::string JoinPath(const std::string& dir, const std::string& name) {
+    if (dir.empty()) return name;
+    char last = dir.back();
+    return (last == '/' || last == '\\') ? dir + name : dir + "/" + name;
+}
+
+static bool MakeDirectory(const std::string& path) {
+#ifdef _WIN32
+    return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+static void RemoveDirectory(const std::string& path) {
+#ifdef _WIN32
+    _rmdir(path.c_str());
+#else
+    rmdir(path.c_str());
+#endif
+}
+
+static std::string JsonEscape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}
+
+static double Median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    return (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.0;
+}
+
+// Image-like test data: random, text-like, zero and repeating 64 KiB blocks
+// so the compression and zero-detection stages see a realistic mix.
+static void FillSyntheticImage(std::vector<uint8_t>& data) {
+    const size_t block = 64 * 1024;
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (size_t offset = 0; offset < data.size(); offset += block) {
+        size_t length = std::min(block, data.size() - offset);
+        uint8_t* out = data.data() + offset;
+        switch ((offset / block) % 4) {
+            case 0:
+                for (size_t i = 0; i < length; i++) {
+                    state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+                    out[i] = (uint8_t)state;
+                }
+                break;
+            case 1:
+                for (size_t i = 0; i < length; i++) {
+                    state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+                    out[i] = (uint8_t)("etaoin shrdlu\n"[state % 14]);
+                }
+                break;
+            case 2:
+                memset(out, 0, length);
+                break;
+            default:
+                for (size_t i = 0; i < length; i++) out[i] = (uint8_t)(i * 31);
+                break;
+        }
+    }
+}
+
+static bool WriteWholeFile(const std::string& path, const std::vector<uint8_t>& data) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write((const char*)data.data(), (std::streamsize)data.size());
+    return (bool)file;
+}
+
+static bool CreateSizedFile(const std::string& path, uint64_t size) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) return false;
+    if (size > 0) {
+        file.seekp((std::streamoff)(size - 1));
+        file.put('\0');
+    }
+    return (bool)file;
+}
+
+static std::string Narrow(const std::wstring& text) {
+    return WideToUtf8(text);
+}
+
+static ChunkSource MemorySource(const std::vector<uint8_t>& data) {
+    return [&data](uint64_t offset, void* buffer, size_t length) -> int64_t {
+        if (offset >= data.size()) return 0;
+        size_t take = (size_t)std::min<uint64_t>(length, data.size() - offset);
+        memcpy(buffer, data.data() + offset, take);
+        return (int64_t)take;
+    };
+}
+
+// Accepts every write; isolates pipeline and source cost from the device.
+class NullBlockDevice : public BlockDevice {
+public:
+    explicit NullBlockDevice(uint64_t size) : m_path(L"null") {
+        m_geometry.sizeBytes = size;
+    }
+
+    bool Read(uint64_t, void* buffer, size_t length) override {
+        memset(buffer, 0, length);
+        return true;
+    }
+    bool Write(uint64_t, const void*, size_t) override { return true; }
+    bool Flush() override { return true; }
+    bool ReloadPartitionTable() override { return true; }
+
+    const DeviceGeometry& GetGeometry() const override { return m_geometry; }
+    const DeviceIdentity& GetIdentity() const override { return m_identity; }
+    const std::wstring& GetPath() const override { return m_path; }
+
+private:
+    DeviceGeometry m_geometry;
+    DeviceIdentity m_identity;
+    std::wstring m_path;
+};
+
+// ============================================================================
+// BENCHMARK RUNNER
+// ============================================================================
+
+class Bench {
+public:
+    explicit Bench(const BenchConfig& config) : m_config(config) {
+    }
+
+    bool Prepare(std::string& error);
+    void Run();
+    void Cleanup();
+    std::string ToJson() const;
+
+private:
+    bool Enabled(const char* stage) const {
+        return m_config.stages.empty() || m_config.stages.count(stage) > 0;
+    }
+
+    // Times `body` once per iteration. `setup` runs untimed before each one.
+    void Measure(const std::string& stage, const std::string& variant, uint64_t bytes,
+                 const std::function<bool(std::wstring&)>& body,
+                 const std::function<bool(std::wstring&)>& setup = nullptr);
+    void Unavailable(const std::string& stage, const std::string& variant, const std::string& reason);
+
+    void RunRead();
+    void RunDecompress();
+    void RunHash();
+    void RunZeroDetect();
+    void RunBuffers();
+    void RunWrite();
+    void RunFanOut();
+    void RunEncrypt();
+    void RunScan();
+    void RunVerify();
+    void RunErase();
+    void RunFormat();
+    void RunLibrary();
+    void RunQueue();
+    void RunBootConfig();
+    void RunGrow();
+    void RunEndToEnd();
+
+    BenchConfig m_config;
+    std::vector<uint8_t> m_data;
+    std::vector<uint8_t> m_zeros;
+    std::string m_sourcePath;
+    std::string m_compressedPath;
+    std::string m_sinkPath;
+    std::string m_sinkVariant;
+    std::vector<std::string> m_generated;
+    std::vector<std::string> m_generatedDirectories;   // removed after m_generated, deepest first
+    std::vector<BenchResult> m_results;
+    std::set<std::string> m_traceNames;
+};
+
+bool Bench::Prepare(std::string& error) {
+    if (!m_config.sourcePath.empty()) {
+        // Benchmark a real image: load it so memory-backed stages see the same bytes.
+        std::ifstream file(m_config.sourcePath, std::ios::binary | std::ios::ate);
+        if (!file) {
+            error = "cannot open source image " + m_config.sourcePath;
+            return false;
+        }
+        uint64_t size = (uint64_t)file.tellg();
+        if (size == 0) {
+            error = "source image is empty";
+            return false;
+        }
+        m_config.size = size;
+        m_data.resize((size_t)size);
+        file.seekg(0);
+        file.read((char*)m_data.data(), (std::streamsize)size);
+        m_sourcePath = m_config.sourcePath;
+    } else {
+        m_data.resize((size_t)m_config.size);
+        FillSyntheticImage(m_data);
+        m_sourcePath = JoinPath(m_config.workDir, "inferno_bench_source.img");
+        if (!WriteWholeFile(m_sourcePath, m_data)) {
+            error = "cannot create " + m_sourcePath;
+            return false;
+        }
+        m_generated.push_back(m_sourcePath);
+    }
+    m_zeros.assign(m_data.size(), 0);
+
+    if (!m_config.sinkPath.empty()) {
+        m_sinkPath = m_config.sinkPath;
+        m_sinkVariant = IsSimulatedDeviceSpec(Utf8ToWide(m_sinkPath)) ? "sim" : "device";
+        std::unique_ptr<BlockDevice> sink = OpenBlockDevice(Utf8ToWide(m_sinkPath), true);
+        if (!sink) {
+            error = "cannot open sink " + m_sinkPath;
+            return false;
+        }
+        if (sink->GetGeometry().sizeBytes < m_config.size) {
+            error = "sink is smaller than the benchmark size";
+            return false;
+        }
+    } else {
+        m_sinkPath = JoinPath(m_config.workDir, "inferno_bench_sink.img");
+        m_sinkVariant = "file";
+        if (!CreateSizedFile(m_sinkPath, m_config.size)) {
+            error = "cannot create " + m_sinkPath;
+            return false;
+        }
+        m_generated.push_back(m_sinkPath);
+    }
+
+#ifdef INFERNO_HAVE_ZLIB
+    if (Enabled("decompress")) {
+        m_compressedPath = JoinPath(m_config.workDir, "inferno_bench_source.img.gz");
+        gzFile gz = gzopen(m_compressedPath.c_str(), "wb6");
+        if (!gz) {
+            error = "cannot create " + m_compressedPath;
+            return false;
+        }
+        bool ok = true;
+        for (size_t offset = 0; ok && offset < m_data.size(); offset += 1 << 20) {
+            unsigned length = (unsigned)std::min<size_t>(1 << 20, m_data.size() - offset);
+            ok = gzwrite(gz, m_data.data() + offset, length) == (int)length;
+        }
+        gzclose(gz);
+        m_generated.push_back(m_compressedPath);
+        if (!ok) {
+            error = "cannot compress the source image";
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+void Bench::Measure(const std::string& stage, const std::string& variant, uint64_t bytes,
+                    const std::function<bool(std::wstring&)>& body,
+                    const std::function<bool(std::wstring&)>& setup) {
+    BenchResult result;
+    result.stage = stage;
+    result.variant = variant;
+    result.bytes = bytes;
+
+    // Trace names are kept as pointers; std::set nodes never move.
+    const char* traceName = m_traceNames.insert(stage + "/" + variant).first->c_str();
+
+    for (uint32_t i = 0; i < m_config.iterations; i++) {
+        TraceSpan span("bench", traceName);
+        std::wstring error;
+        if (setup && !setup(error)) {
+            result.status = "failed";
+            result.message = Narrow(error);
+            break;
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool ok = body(error);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!ok) {
+            result.status = "failed";
+            result.message = Narrow(error);
+            break;
+        }
+        result.seconds.push_back(elapsed);
+    }
+
+    std::cerr << stage << "/" << variant << ": " << result.status << std::endl;
+    m_results.push_back(result);
+}
+
+void Bench::Unavailable(const std::string& stage, const std::string& variant, const std::string& reason) {
+    BenchResult result;
+    result.stage = stage;
+    result.variant = variant;
+    result.status = "unavailable";
+    result.message = reason;
+    m_results.push_back(result);
+}
+
+void Bench::Run() {
+    if (Enabled("read")) RunRead();
+    if (Enabled("decompress")) RunDecompress();
+    if (Enabled("hash")) RunHash();
+    if (Enabled("zero-detect")) RunZeroDetect();
+    if (Enabled("buffers")) RunBuffers();
+    if (Enabled("write")) RunWrite();
+    if (Enabled("fan-out")) RunFanOut();
+    if (Enabled("encrypt")) RunEncrypt();
+    if (Enabled("scan")) RunScan();
+    if (Enabled("verify")) RunVerify();
+    if (Enabled("erase")) RunErase();
+    if (Enabled("format")) RunFormat();
+    if (Enabled("library")) RunLibrary();
+    if (Enabled("queue")) RunQueue();
+    if (Enabled("bootcfg")) RunBootConfig();
+    if (Enabled("grow")) RunGrow();
+    if (Enabled("end-to-end")) RunEndToEnd();
+}
+
+void Bench::Cleanup() {
+    if (m_config.keepFiles) return;
+    for (const std::string& path : m_generated) {
+        remove(path.c_str());
+    }
+    for (auto it = m_generatedDirectories.rbegin(); it != m_generatedDirectories.rend(); ++it) {
+        RemoveDirectory(*it);
+    }
+}
+
+// Sequential read of the source file through the image reader under each
+// read policy. Iterations start with the source evicted from the OS cache,
+// except buffered/warm and pinned/hot (pinned before the first iteration).
+// Each result records how much of the source the OS cache holds afterwards:
+// what drop-behind and direct reads leave to the rest of the system.
+void Bench::RunRead() {
+    std::vector<uint8_t> buffer(m_config.params.chunkSize);
+    std::wstring path = Utf8ToWide(m_sourcePath);
+    auto readAll = [&](ReadPolicy policy, std::wstring& error) {
+        std::unique_ptr<ImageSource> image = OpenImageSource(path, error, policy);
+        if (!image) return false;
+        uint64_t offset = 0;
+        for (;;) {
+            int64_t got = image->Read(offset, buffer.data(), buffer.size());
+            if (got < 0) {
+                error = L"read failed";
+                return false;
+            }
+            if (got == 0) return true;
+            offset += (uint64_t)got;
+        }
+    };
+    auto evict = [&](std::wstring& error) {
+        ReleasePinnedImages();
+        if (!EvictImageFromCache(path)) {
+            error = L"cannot evict the source from the OS cache";
+            return false;
+        }
+        return true;
+    };
+    auto measure = [&](const std::string& variant, ReadPolicy policy,
+                       const std::function<bool(std::wstring&)>& setup) {
+        Measure("read", variant, m_config.size, [&](std::wstring& error) { return readAll(policy, error); }, setup);
+        m_results.back().sourceCachedBytes = GetCachedImageBytes(path);
+    };
+
+    measure("buffered/warm", ReadPolicy::Buffered, nullptr);
+    const ReadPolicy COLD[] = {ReadPolicy::Buffered, ReadPolicy::Sequential, ReadPolicy::DropBehind,
+                               ReadPolicy::Direct, ReadPolicy::Pinned};
+    for (ReadPolicy policy : COLD) {
+        measure(Narrow(ReadPolicyName(policy)), policy, evict);
+    }
+
+    std::wstring error;
+    if (!evict(error) || !readAll(ReadPolicy::Pinned, error)) {
+        Unavailable("read", "pinned/hot", Narrow(error));
+        return;
+    }
+    measure("pinned/hot", ReadPolicy::Pinned, nullptr);
+    std::cerr << "read: " << GetPinnedImageBytes() / (1024 * 1024) << " MiB pinned" << std::endl;
+    ReleasePinnedImages();
+}
+
+void Bench::RunDecompress() {
+    if (!IsDecompressionSupported() || m_compressedPath.empty()) {
+        Unavailable("decompress", "gzip", "built without zlib");
+        return;
+    }
+    std::vector<uint8_t> buffer(m_config.params.chunkSize);
+    std::wstring path = Utf8ToWide(m_compressedPath);
+    Measure("decompress", "gzip", m_config.size, [&](std::wstring& error) {
+        std::unique_ptr<ImageSource> image = OpenImageSource(path, error);
+        if (!image) return false;
+        uint64_t offset = 0;
+        for (;;) {
+            int64_t got = image->Read(offset, buffer.data(), buffer.size());
+            if (got < 0) {
+                error = L"decompression failed";
+                return false;
+            }
+            if (got == 0) return true;
+            offset += (uint64_t)got;
+        }
+    });
+}
+
+void Bench::RunHash() {
+    Measure("hash", "sha256", m_config.size, [&](std::wstring&) {
+        uint8_t digest[Sha256::DIGEST_SIZE];
+        Sha256 hash;
+        hash.Update(m_data.data(), m_data.size());
+        hash.Final(digest);
+        return true;
+    });
+    Measure("hash", "crc32", m_config.size, [&](std::wstring&) {
+        volatile uint32_t crc = Crc32(m_data.data(), m_data.size());
+        (void)crc;
+        return true;
+    });
+
+    // The source image as a job checksums it: read and hashed with chunk
+    // digests, then answered from the digest cache on a repeat run.
+    std::wstring source = Utf8ToWide(m_sourcePath);
+    Measure("hash", "image+chunks", m_config.size, [&](std::wstring& error) {
+        ImageDigest digest;
+        return HashImage(source, IMAGE_DIGEST_CHUNK, digest, nullptr, error);
+    });
+    std::string cachePath = JoinPath(m_config.workDir, "inferno_bench_hashes.tsv");
+    m_generated.push_back(cachePath);
+    m_generated.push_back(cachePath + ".lock");
+    ImageHashCache cache(Utf8ToWide(cachePath));
+    ImageDigest digest;
+    std::wstring error;
+    if (!GetImageDigest(source, cache, digest, nullptr, nullptr, error)) {
+        Unavailable("hash", "image/cache-hit", Narrow(error));
+        return;
+    }
+    Measure("hash", "image/cache-hit", m_config.size, [&](std::wstring& lookupError) {
+        bool fromCache = false;
+        if (!GetImageDigest(source, cache, digest, nullptr, &fromCache, lookupError)) return false;
+        if (!fromCache) lookupError = L"cache miss";
+        return fromCache;
+    });
+}
+
+// Worst case for zero detection: every byte has to be inspected.
+void Bench::RunZeroDetect() {
+    Measure("zero-detect", "all-zero", m_config.size, [&](std::wstring& error) {
+        size_t chunk = m_config.params.chunkSize;
+        for (size_t offset = 0; offset < m_zeros.size(); offset += chunk) {
+            if (!IsZeroBuffer(m_zeros.data() + offset, std::min(chunk, m_zeros.size() - offset))) {
+                error = L"unexpected data";
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+// A chunk-sized buffer per chunk from the heap versus the shared arena, then
+// 16 write pipelines at once drawing from the arena under its memory cap.
+void Bench::RunBuffers() {
+    size_t chunk = m_config.params.chunkSize;
+    uint64_t chunks = (m_config.size + chunk - 1) / chunk;
+    Measure("buffers", "heap/" + std::to_string(chunk), m_config.size, [&](std::wstring&) {
+        for (uint64_t i = 0; i < chunks; i++) {
+            std::unique_ptr<uint8_t[]> buffer(new uint8_t[chunk]);
+            memset(buffer.get(), (int)i, chunk);
+        }
+        return true;
+    });
+    BufferArena& arena = BufferArena::Default();
+    Measure("buffers", "arena/" + std::to_string(chunk), m_config.size, [&](std::wstring& error) {
+        for (uint64_t i = 0; i < chunks; i++) {
+            ArenaBuffer buffer = arena.Acquire(chunk);
+            if (!buffer) {
+                error = L"arena refused the chunk";
+                return false;
+            }
+            memset(buffer.Data(), (int)i, chunk);
+        }
+        return true;
+    });
+
+    const int jobs = 16;
+    NullBlockDevice null(m_config.size);
+    Measure("buffers", "write-x16/null", m_config.size * jobs, [&](std::wstring& error) {
+        std::vector<std::thread> threads;
+        std::vector<std::wstring> errors(jobs);
+        std::atomic<bool> ok(true);
+        for (int i = 0; i < jobs; i++) {
+            threads.emplace_back([&, i] {
+                if (!RunWritePipeline(null, 0, m_data.size(), MemorySource(m_data), m_config.params,
+                                      nullptr, nullptr, errors[i])) {
+                    ok = false;
+                }
+            });
+        }
+        for (std::thread& thread : threads) thread.join();
+        for (const std::wstring& jobError : errors) {
+            if (!jobError.empty()) error = jobError;
+        }
+        return ok.load();
+    });
+    ArenaStats stats = arena.GetStats();
+    std::cerr << "buffers: arena peak " << stats.peakReservedBytes / (1024 * 1024) << " MiB of "
+              << stats.memoryLimit / (1024 * 1024) << " MiB, " << stats.hugePageBytes / (1024 * 1024)
+              << " MiB huge pages, " << stats.waits << " waits" << std::endl;
+}
+
+void Bench::RunWrite() {
+    NullBlockDevice null(m_config.size);
+    Measure("write", "null", m_config.size, [&](std::wstring& error) {
+        return RunWritePipeline(null, 0, m_data.size(), MemorySource(m_data), m_config.params,
+                                nullptr, nullptr, error);
+    });
+
+    std::wstring sink = Utf8ToWide(m_sinkPath);
+    Measure("write", m_sinkVariant, m_config.size, [&](std::wstring& error) {
+        std::unique_ptr<BlockDevice> device = OpenBlockDevice(sink, true);
+        if (!device) {
+            error = L"cannot open sink";
+            return false;
+        }
+        return RunWritePipeline(*device, 0, m_data.size(), MemorySource(m_data), m_config.params,
+                                nullptr, nullptr, error);
+    });
+
+    // The same with the write controller retuning it; on a sim: sink with an
+    // SLC cache (slc=, slc-write=) it has a cliff to react to
+    WriteControllerSummary summary;
+    Measure("write", "adaptive/" + m_sinkVariant, m_config.size, [&](std::wstring& error) {
+        std::unique_ptr<BlockDevice> device = OpenBlockDevice(sink, true);
+        if (!device) {
+            error = L"cannot open sink";
+            return false;
+        }
+        WriteController controller(m_config.params);
+        WriterParams params = m_config.params;
+        params.controller = &controller;
+        bool ok = RunWritePipeline(*device, 0, m_data.size(), MemorySource(m_data), params, nullptr, nullptr, error);
+        summary = controller.GetSummary();
+        return ok;
+    });
+    for (const WriteDecision& decision : summary.decisions) {
+        std::cerr << "write controller: " << Narrow(DescribeWriteDecision(decision)) << std::endl;
+    }
+
+    // A 512e drive written on and off its 4K physical sectors: every write
+    // that splits one costs the drive a flash read (read-latency) before it
+    // programs the sector. Large chunks split only their first and last
+    // sector; the 4 KB cluster writes of a file system in a partition at
+    // sector 63 split two each, which is what aligning partitions saves
+    std::wstring emulated = L"sim:size=" + std::to_wstring(m_config.size / (1024 * 1024) + 1) +
+                            L"M,physical-sector=4K,read=200M,write=40M,read-latency=1ms";
+    struct AlignmentCase {
+        const char* variant;
+        uint64_t offset;
+        uint32_t chunkSize;             // 0 for the configured one
+        uint64_t bytes;
+    };
+    uint64_t smallBytes = std::min<uint64_t>(m_data.size(), 8ull * 1024 * 1024);
+    const AlignmentCase cases[] = {
+        {"512e", 0, 0, m_data.size()},
+        {"512e-unaligned", 512, 0, m_data.size()},
+        {"512e-4k", 0, 4096, smallBytes},
+        {"512e-4k-unaligned", 63 * 512, 4096, smallBytes},
+    };
+    for (const AlignmentCase& test : cases) {
+        WriterParams params = m_config.params;
+        if (test.chunkSize) params.chunkSize = test.chunkSize;
+        uint64_t readModifyWrites = 0;
+        Measure("write", test.variant, test.bytes, [&](std::wstring& error) {
+            SimulatedDeviceConfig config;
+            std::unique_ptr<SimulatedDevice> device;
+            if (!ParseSimulatedDeviceSpec(emulated, config, error) ||
+                !(device = CreateSimulatedDevice(config, error))) {
+                return false;
+            }
+            bool ok = RunWritePipeline(*device, test.offset, test.bytes, MemorySource(m_data), params,
+                                       nullptr, nullptr, error);
+            readModifyWrites = device->GetStats().readModifyWrites;
+            return ok;
+        });
+        std::cerr << "write " << test.variant << " at " << test.offset << ": " << readModifyWrites
+                  << " read-modify-writes" << std::endl;
+    }
+}
+
+// The sink written from one thread through each asynchronous backend, then
+// the sink plus three scratch files at once (scratch sinks only); bytes
+// count every target. Compare the single-target variants with write/<sink>.
+void Bench::RunFanOut() {
+    std::vector<std::unique_ptr<BlockDevice>> devices;
+    devices.push_back(OpenBlockDevice(Utf8ToWide(m_sinkPath), true));
+    if (m_sinkVariant == "file") {
+        for (int i = 1; i < 4; i++) {
+            std::string path = JoinPath(m_config.workDir, "inferno_bench_sink" + std::to_string(i) + ".img");
+            if (!CreateSizedFile(path, m_config.size)) break;
+            m_generated.push_back(path);
+            devices.push_back(OpenBlockDevice(Utf8ToWide(path), true));
+        }
+    }
+    for (const std::unique_ptr<BlockDevice>& device : devices) {
+        if (!device) {
+            Unavailable("fan-out", m_sinkVariant, "cannot open sink");
+            return;
+        }
+    }
+
+#ifdef _WIN32
+    const AsyncBackend kernel = AsyncBackend::Iocp;
+#else
+    const AsyncBackend kernel = AsyncBackend::IoUring;
+#endif
+    for (AsyncBackend backend : {kernel, AsyncBackend::ThreadPool}) {
+        std::string name = Narrow(AsyncBackendName(backend));
+        std::vector<BlockDevice*> targets;
+        for (const std::unique_ptr<BlockDevice>& device : devices) {
+            targets.push_back(device.get());
+            if (targets.size() != 1 && targets.size() != devices.size()) continue;
+
+            std::wstring error;
+            if (!CreateAsyncBlockIo(targets, 1, error, backend)) {
+                Unavailable("fan-out", name + "/" + m_sinkVariant, Narrow(error));
+                break;
+            }
+            std::string variant = name + (targets.size() > 1 ? "-x" + std::to_string(targets.size()) : "") + "/" +
+                                  m_sinkVariant;
+            Measure("fan-out", variant, m_config.size * targets.size(), [&](std::wstring& runError) {
+                return RunFanOutWritePipeline(targets, m_data.size(), MemorySource(m_data), m_config.params,
+                                              nullptr, nullptr, runError, backend);
+            });
+        }
+    }
+}
+
+// XTS-AES-256 on one core, then inline in the write pipeline where each
+// worker encrypts its own chunk; compare the sink variant with write/<sink>.
+void Bench::RunEncrypt() {
+    uint8_t key[64];
+    for (int i = 0; i < 64; i++) key[i] = (uint8_t)(i * 37 + 11);
+    XtsCipher cipher;
+    cipher.SetKey(key, sizeof(key));
+    const uint32_t sectorSize = 512;
+
+    std::vector<uint8_t> scratch(m_data);
+    Measure("encrypt", std::string("xts-aes-256/") + GetAesImplementationName(), m_config.size,
+            [&](std::wstring&) {
+                size_t whole = scratch.size() / sectorSize * sectorSize;
+                cipher.EncryptSectors(0, sectorSize, scratch.data(), whole);
+                return true;
+            });
+    scratch = std::vector<uint8_t>();
+
+    // The pipeline encrypts its own buffers in place, so the source stays intact.
+    ChunkTransform encrypt = [&](uint64_t offset, uint8_t* data, size_t length) {
+        cipher.EncryptSectors(offset / sectorSize, sectorSize, data, length);
+    };
+    NullBlockDevice null(m_config.size);
+    Measure("encrypt", "write+xts/null", m_config.size, [&](std::wstring& error) {
+        return RunWritePipeline(null, 0, m_data.size(), MemorySource(m_data), m_config.params,
+                                nullptr, nullptr, error, encrypt);
+    });
+
+    std::wstring sink = Utf8ToWide(m_sinkPath);
+    Measure("encrypt", "write+xts/" + m_sinkVariant, m_config.size, [&](std::wstring& error) {
+        std::unique_ptr<BlockDevice> device = OpenBlockDevice(sink, true);
+        if (!device) {
+            error = L"cannot open sink";
+            return false;
+        }
+        return RunWritePipeline(*device, 0, m_data.size(), MemorySource(m_data), m_config.params,
+                                nullptr, nullptr, error, encrypt);
+    });
+}
+
+// Signature matching against a synthetic database of 1000 random 16-32
+// byte patterns, alone and as a tap on the write pipeline.
+void Bench::RunScan() {
+    SignatureDatabase database;
+    uint32_t seed = 0x5CA11EDu;
+    for (int i = 0; i < 1000; i++) {
+        std::vector<uint8_t> pattern(16 + i % 17);
+        for (uint8_t& byte : pattern) {
+            seed = seed * 1664525u + 1013904223u;
+            byte = (uint8_t)(seed >> 24);
+        }
+        database.Add("Bench.Signature-" + std::to_string(i), pattern);
+    }
+    SignatureScanner scanner;
+    std::wstring error;
+    if (!scanner.Build(database, error)) {
+        Unavailable("scan", "aho-corasick", Narrow(error));
+        return;
+    }
+
+    Measure("scan", "aho-corasick/1000", m_config.size, [&](std::wstring&) {
+        size_t chunk = m_config.params.chunkSize;
+        for (size_t offset = 0; offset < m_data.size(); offset += chunk) {
+            scanner.ScanChunk(offset, m_data.data() + offset, std::min(chunk, m_data.size() - offset));
+        }
+        return true;
+    });
+
+    NullBlockDevice null(m_config.size);
+    Measure("scan", "write+scan/null", m_config.size, [&](std::wstring& error) {
+        return RunWritePipeline(null, 0, m_data.size(), MemorySource(m_data), m_config.params,
+                                nullptr, nullptr, error, scanner.AsTap());
+    });
+}
+
+void Bench::RunVerify() {
+    std::wstring sink = Utf8ToWide(m_sinkPath);
+    std::unique_ptr<BlockDevice> device = OpenBlockDevice(sink, true);
+    std::wstring error;
+    if (!device || !RunWritePipeline(*device, 0, m_data.size(), MemorySource(m_data), m_config.params,
+                                     nullptr, nullptr, error)) {
+        Unavailable("verify", m_sinkVariant, "cannot prepare the sink: " + Narrow(error));
+        return;
+    }
+    Measure("verify", m_sinkVariant, m_config.size, [&](std::wstring& verifyError) {
+        return RunVerifyPipeline(*device, 0, m_data.size(), MemorySource(m_data), m_config.params,
+                                 nullptr, nullptr, verifyError);
+    });
+
+    // Metadata in full plus a fixed-seed sample giving 99% confidence of
+    // catching 5% damage (the default 1% samples 459 chunks, all of an image
+    // under 1.8 GiB); bytes are the whole image
+    std::vector<ByteRange> metadata;
+    if (!FindImageMetadataRegions(Utf8ToWide(m_sourcePath), metadata, error)) {
+        Unavailable("verify", "sampled/" + m_sinkVariant, Narrow(error));
+        return;
+    }
+    SampledVerifyParams sampling;
+    sampling.detectFraction = 0.05;
+    sampling.seed = 1;
+    Measure("verify", "sampled/" + m_sinkVariant, m_config.size, [&](std::wstring& verifyError) {
+        return VerifyImageSampled(Utf8ToWide(m_sourcePath), *device, metadata, sampling, m_config.params,
+                                  nullptr, nullptr, nullptr, verifyError);
+    });
+}
+
+// Full format of a sink holding the image: discard plus sampled zero checks
+// (a zero fill where the sink has no discard), against writing zeros over
+// all of it. Bytes are the whole sink.
+void Bench::RunErase() {
+    std::wstring sink = Utf8ToWide(m_sinkPath);
+    std::unique_ptr<BlockDevice> device = OpenBlockDevice(sink, true);
+    if (!device) {
+        Unavailable("erase", m_sinkVariant, "cannot open sink");
+        return;
+    }
+    uint64_t size = device->GetGeometry().sizeBytes;
+    auto fill = [&](std::wstring& error) {
+        return RunWritePipeline(*device, 0, m_data.size(), MemorySource(m_data), m_config.params,
+                                nullptr, nullptr, error);
+    };
+    std::string variant = device->GetTraits().supportsDiscard ? "discard+sample/" : "no-discard/";
+    Measure("erase", variant + m_sinkVariant, size, [&](std::wstring& error) {
+        return EraseDevice(*device, m_config.params, nullptr, nullptr, error);
+    }, fill);
+
+    ChunkSource zeros = [](uint64_t, void* buffer, size_t length) -> int64_t {
+        memset(buffer, 0, length);
+        return (int64_t)length;
+    };
+    Measure("erase", "zero-fill/" + m_sinkVariant, size, [&](std::wstring& error) {
+        return RunWritePipeline(*device, 0, size, zeros, m_config.params, nullptr, nullptr, error);
+    }, fill);
+}
+
+// The engine formats by writing partition tables; time one full table write
+// (layout, primary and backup structures, flush) per style.
+void Bench::RunFormat() {
+    std::wstring sink = Utf8ToWide(m_sinkPath);
+    const PartitionStyle styles[] = {PartitionStyle::GPT, PartitionStyle::MBR};
+    for (PartitionStyle style : styles) {
+        std::string variant = Narrow(PartitionStyleName(style)) + "/" + m_sinkVariant;
+        Measure("format", variant, 0, [&](std::wstring& error) {
+            std::unique_ptr<BlockDevice> device = OpenBlockDevice(sink, true);
+            if (!device) {
+                error = L"cannot open sink";
+                return false;
+            }
+            PartitionLayoutRequest request;
+            request.style = style;
+            request.sizesPercent = {50, 50};
+            request.name = L"INFERNO";
+            PartitionTable table;
+            return ComputePartitionLayout(device->GetGeometry(), request, table, error) &&
+                   WritePartitionTable(*device, table, error);
+        });
+    }
+}
+
+// A small ISO9660 image: volume descriptors, a root directory and `files`
+// ("DIR/NAME" paths, at most two levels) with empty contents.
+static bool WriteLibraryIso(const std::string& path, const std::string& label,
+                            const std::vector<std::string>& files) {
+    const uint32_t sector = 2048, sectors = 64, rootSector = 20;
+    std::vector<uint8_t> image((size_t)sector * sectors);
+    auto both16 = [&](size_t offset, uint16_t value) {
+        image[offset] = image[offset + 3] = (uint8_t)value;
+        image[offset + 1] = image[offset + 2] = (uint8_t)(value >> 8);
+    };
+    auto both32 = [&](size_t offset, uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            image[offset + i] = image[offset + 7 - i] = (uint8_t)(value >> (8 * i));
+        }
+    };
+    // Appends a directory record at `offset`; returns its length.
+    auto record = [&](size_t offset, uint32_t extent, uint32_t bytes, bool directory, const std::string& name) {
+        size_t length = 33 + name.size() + (name.size() % 2 == 0 ? 1 : 0);
+        image[offset] = (uint8_t)length;
+        both32(offset + 2, extent);
+        both32(offset + 10, bytes);
+        image[offset + 25] = directory ? 2 : 0;
+        both16(offset + 28, 1);
+        image[offset + 32] = (uint8_t)name.size();
+        memcpy(&image[offset + 33], name.data(), name.size());
+        return length;
+    };
+
+    size_t descriptor = 16 * sector;
+    image[descriptor] = 1;
+    memcpy(&image[descriptor + 1], "CD001\x01", 6);
+    memset(&image[descriptor + 40], ' ', 32);
+    memcpy(&image[descriptor + 40], label.data(), std::min<size_t>(label.size(), 32));
+    both32(descriptor + 80, sectors);
+    both16(descriptor + 128, (uint16_t)sector);
+    record(descriptor + 156, rootSector, sector, true, std::string(1, '\0'));
+    image[17 * sector] = 255;
+    memcpy(&image[17 * sector + 1], "CD001\x01", 6);
+
+    // One sector per directory, after the root.
+    std::vector<std::string> directories;
+    std::vector<std::vector<std::string>> contents(1);
+    for (const std::string& file : files) {
+        size_t slash = file.find('/');
+        std::string directory = slash == std::string::npos ? "" : file.substr(0, slash);
+        auto it = std::find(directories.begin(), directories.end(), directory);
+        if (!directory.empty() && it == directories.end()) {
+            directories.push_back(directory);
+            contents.emplace_back();
+            it = directories.end() - 1;
+        }
+        size_t index = directory.empty() ? 0 : (size_t)(it - directories.begin()) + 1;
+        contents[index].push_back(file.substr(slash == std::string::npos ? 0 : slash + 1));
+    }
+    for (size_t index = 0; index < contents.size(); index++) {
+        uint32_t self = rootSector + (uint32_t)index;
+        size_t offset = (size_t)self * sector;
+        offset += record(offset, self, sector, true, std::string(1, '\0'));
+        offset += record(offset, rootSector, sector, true, std::string(1, '\1'));
+        if (index == 0) {
+            for (size_t d = 0; d < directories.size(); d++) {
+                offset += record(offset, rootSector + 1 + (uint32_t)d, sector, true, directories[d]);
+            }
+        }
+        for (const std::string& name : contents[index]) {
+            offset += record(offset, sectors - 1, 0, false, name + ";1");
+        }
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write((const char*)image.data(), (std::streamsize)image.size());
+    return out.good();
+}
+
+// The image library over a share-sized folder of 500 small ISOs in 10
+// subfolders: the first index of the folder, an update that finds nothing
+// changed, and what startup costs, mapping the index and searching it.
+void Bench::RunLibrary() {
+    std::string root = JoinPath(m_config.workDir, "inferno_bench_library");
+    std::string indexPath = JoinPath(m_config.workDir, "inferno_bench_library.idx");
+    const size_t folders = 10, imagesPerFolder = 50;
+    bool ok = MakeDirectory(root);
+    m_generatedDirectories.push_back(root);
+    for (size_t f = 0; f < folders && ok; f++) {
+        std::string folder = JoinPath(root, "shelf" + std::to_string(f));
+        ok = MakeDirectory(folder);
+        m_generatedDirectories.push_back(folder);
+        for (size_t i = 0; i < imagesPerFolder && ok; i++) {
+            size_t n = f * imagesPerFolder + i;
+            bool windows = n % 3 == 0;
+            std::string label = (windows ? "WIN_X64_" : "LINUX_LIVE_") + std::to_string(n);
+            std::vector<std::string> files = windows ? std::vector<std::string>{"SOURCES/INSTALL.WIM", "BOOTMGR"}
+                                                     : std::vector<std::string>{"CASPER/VMLINUZ", "ISOLINUX/ISOLINUX.BIN"};
+            std::string path = JoinPath(folder, "image" + std::to_string(n) + ".iso");
+            ok = WriteLibraryIso(path, label, files);
+            m_generated.push_back(path);
+        }
+    }
+    m_generated.push_back(indexPath);
+    m_generated.push_back(indexPath + ".lock");
+    if (!ok) {
+        Unavailable("library", "scan", "cannot create the image folder");
+        return;
+    }
+
+    std::wstring wideRoot = Utf8ToWide(root);
+    std::wstring wideIndex = Utf8ToWide(indexPath);
+    Measure(
+        "library", "scan", 0,
+        [&](std::wstring& error) {
+            ImageLibrary library(wideIndex);
+            LibraryIndexStats stats;
+            return library.Update(wideRoot, &stats, error) && stats.read == folders * imagesPerFolder;
+        },
+        [&](std::wstring&) {
+            remove(indexPath.c_str());
+            return true;
+        });
+    Measure("library", "rescan-unchanged", 0, [&](std::wstring& error) {
+        ImageLibrary library(wideIndex);
+        LibraryIndexStats stats;
+        return library.Update(wideRoot, &stats, error) && stats.reused == folders * imagesPerFolder;
+    });
+    Measure("library", "open+search", 0, [&](std::wstring& error) {
+        ImageLibrary library(wideIndex);
+        if (!library.Open()) {
+            error = L"cannot open the index";
+            return false;
+        }
+        size_t found = library.Search(L"", L"linux shelf3").size() + library.Search(L"", L"x64 windows").size();
+        if (found == 0) {
+            error = L"search found nothing";
+            return false;
+        }
+        return true;
+    });
+}
+
+// A flashing station: eight simulated 20 MB/s sticks, four on each of two
+// USB 2.0 hubs, submitted hub by hub to a queue that runs four jobs at once.
+// In order, the first four share one hub while the other idles; with the
+// bandwidth model two run on each. Then the round trip of a LIST request
+// over the local socket or pipe.
+void Bench::RunQueue() {
+    const uint64_t jobBytes = std::min<uint64_t>(m_data.size(), 8ull * 1024 * 1024);
+    const int sticks = 8;
+    JobRunner write = [&](JobContext& job, std::wstring& error) {
+        std::unique_ptr<BlockDevice> device = OpenBlockDevice(job.GetRequest().target, true);
+        if (!device) {
+            error = L"cannot open the simulated stick";
+            return false;
+        }
+        ProgressCallback progress = [&](uint64_t done, uint64_t total) {
+            job.ReportProgress(done, total);
+            return !job.IsCancelled();
+        };
+        return RunWritePipeline(*device, 0, jobBytes, MemorySource(m_data), m_config.params, progress, nullptr,
+                                error);
+    };
+
+    for (bool model : {false, true}) {
+        Measure("queue", model ? "topology-x8" : "in-order-x8", jobBytes * sticks, [&](std::wstring& error) {
+            JobQueueParams params;
+            params.maxRunningJobs = 4;
+            params.modelBandwidth = model;
+            JobQueue queue(params);
+            std::vector<uint64_t> ids;
+            for (int i = 0; i < sticks; i++) {
+                JobRequest request;
+                request.target = L"sim:size=64M,write=20M,hub=" + std::wstring(i < sticks / 2 ? L"a" : L"b") +
+                                 L",product=" + std::to_wstring(i);
+                request.bytes = jobBytes;
+                ids.push_back(queue.Submit(request, write));
+            }
+            queue.WaitAll();
+            for (uint64_t id : ids) {
+                JobStatus status;
+                if (!queue.GetStatus(id, status) || status.state != JobState::Succeeded) {
+                    error = L"job " + std::to_wstring(id) + L" did not succeed: " + status.error;
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+
+    JobQueue queue;
+    JobQueueServer server(queue, nullptr);
+#ifdef _WIN32
+    std::wstring endpoint = L"\\\\.\\pipe\\inferno-bench-jobs";
+#else
+    std::wstring endpoint = Utf8ToWide(JoinPath(m_config.workDir, "inferno_bench_jobs.sock"));
+#endif
+    std::wstring error;
+    if (!server.Start(endpoint, error)) {
+        Unavailable("queue", "ipc-list", Narrow(error));
+        return;
+    }
+    Measure("queue", "ipc-list", 0, [&](std::wstring& runError) {
+        std::vector<std::string> reply;
+        return SendJobCommand(endpoint, "LIST", reply, runError) && reply.back() == "OK";
+    });
+}
+
+// An ISO9660 image with `files` ("DIR/SUB/NAME" paths, any depth) and their
+// contents, followed by `paddingSectors` of zeros inside the volume, the way
+// mastering tools pad.
+static bool WriteBootIso(const std::string& path, const std::vector<std::pair<std::string, std::string>>& files,
+                         uint32_t paddingSectors) {
+    const uint32_t sector = 2048, rootSector = 20;
+    std::vector<std::string> directories = {""};
+    for (const auto& file : files) {
+        for (size_t slash = file.first.find('/'); slash != std::string::npos; slash = file.first.find('/', slash + 1)) {
+            std::string directory = file.first.substr(0, slash);
+            if (std::find(directories.begin(), directories.end(), directory) == directories.end()) {
+                directories.push_back(directory);
+            }
+        }
+    }
+    // One sector per directory, then each file's sectors.
+    uint32_t next = rootSector + (uint32_t)directories.size();
+    std::vector<uint32_t> extents;
+    for (const auto& file : files) {
+        extents.push_back(next);
+        next += (uint32_t)((file.second.size() + sector - 1) / sector);
+    }
+    uint32_t sectors = next + paddingSectors;
+    std::vector<uint8_t> image((size_t)sector * sectors);
+    auto both16 = [&](size_t offset, uint16_t value) {
+        image[offset] = image[offset + 3] = (uint8_t)value;
+        image[offset + 1] = image[offset + 2] = (uint8_t)(value >> 8);
+    };
+    auto both32 = [&](size_t offset, uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            image[offset + i] = image[offset + 7 - i] = (uint8_t)(value >> (8 * i));
+        }
+    };
+    auto record = [&](size_t offset, uint32_t extent, uint32_t bytes, bool directory, const std::string& name) {
+        size_t length = 33 + name.size() + (name.size() % 2 == 0 ? 1 : 0);
+        image[offset] = (uint8_t)length;
+        both32(offset + 2, extent);
+        both32(offset + 10, bytes);
+        image[offset + 25] = directory ? 2 : 0;
+        both16(offset + 28, 1);
+        image[offset + 32] = (uint8_t)name.size();
+        memcpy(&image[offset + 33], name.data(), name.size());
+        return length;
+    };
+    auto parentOf = [](const std::string& path) {
+        size_t slash = path.rfind('/');
+        return slash == std::string::npos ? std::string() : path.substr(0, slash);
+    };
+    auto nameOf = [](const std::string& path) { return path.substr(path.rfind('/') + 1); };
+    auto sectorOf = [&](const std::string& directory) {
+        return rootSector + (uint32_t)(std::find(directories.begin(), directories.end(), directory) - directories.begin());
+    };
+
+    size_t descriptor = 16 * sector;
+    image[descriptor] = 1;
+    memcpy(&image[descriptor + 1], "CD001\x01", 6);
+    memset(&image[descriptor + 40], ' ', 32);
+    memcpy(&image[descriptor + 40], "INFERNO_BOOT", 12);
+    both32(descriptor + 80, sectors);
+    both16(descriptor + 128, (uint16_t)sector);
+    record(descriptor + 156, rootSector, sector, true, std::string(1, '\0'));
+    image[17 * sector] = 255;
+    memcpy(&image[17 * sector + 1], "CD001\x01", 6);
+
+    for (const std::string& directory : directories) {
+        size_t offset = (size_t)sectorOf(directory) * sector;
+        offset += record(offset, sectorOf(directory), sector, true, std::string(1, '\0'));
+        offset += record(offset, sectorOf(parentOf(directory)), sector, true, std::string(1, '\1'));
+        for (const std::string& child : directories) {
+            if (!child.empty() && child != directory && parentOf(child) == directory) {
+                offset += record(offset, sectorOf(child), sector, true, nameOf(child));
+            }
+        }
+        for (size_t i = 0; i < files.size(); i++) {
+            if (parentOf(files[i].first) == directory) {
+                offset += record(offset, extents[i], (uint32_t)files[i].second.size(), false,
+                                 nameOf(files[i].first) + ";1");
+            }
+        }
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+        memcpy(&image[(size_t)extents[i] * sector], files[i].second.data(), files[i].second.size());
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write((const char*)image.data(), (std::streamsize)image.size());
+    return out.good();
+}
+
+// Persistence and a menu title on a freshly written live ISO, patched in
+// place: when the files still fit their last sectors, when they outgrow
+// them and move into the volume's padding, and a second pass that finds
+// nothing left to change. Each iteration starts from the pristine image.
+void Bench::RunBootConfig() {
+    std::string pristinePath = JoinPath(m_config.workDir, "inferno_bench_boot_pristine.iso");
+    std::string drivePath = JoinPath(m_config.workDir, "inferno_bench_boot.iso");
+    std::string grub = "set timeout=30\n";
+    std::string txt = "default live\n";
+    for (int i = 0; i < 8; i++) {
+        grub += "menuentry \"Live " + std::to_string(i) + "\" {\n\tlinux /casper/vmlinuz boot=casper quiet splash ---\n"
+                "\tinitrd /casper/initrd\n}\n";
+        txt += "label live" + std::to_string(i) + "\n  kernel /casper/vmlinuz\n  append boot=casper "
+               "initrd=/casper/initrd quiet splash ---\n";
+    }
+    std::vector<std::pair<std::string, std::string>> files = {
+        {"BOOT/GRUB/GRUB.CFG", grub},
+        {"BOOT/GRUB/LOOPBACK.CFG", grub},
+        {"ISOLINUX/ISOLINUX.CFG", "UI vesamenu.c32\nINCLUDE txt.cfg\nTIMEOUT 50\n"},
+        {"ISOLINUX/TXT.CFG", txt},
+        {"CASPER/FILESYSTEM.SQUASHFS", std::string(4 * 1024 * 1024, 'x')}};
+    bool ok = WriteBootIso(pristinePath, files, 256);
+    m_generated.push_back(pristinePath);
+    m_generated.push_back(drivePath);
+    std::string pristine;
+    if (!ok || !ReadWholeFile(Utf8ToWide(pristinePath), pristine)) {
+        Unavailable("bootcfg", "in-place", "cannot create the image");
+        return;
+    }
+
+    std::wstring drive = Utf8ToWide(drivePath);
+    auto copyImage = [&](std::wstring& error) {
+        std::ofstream out(drivePath, std::ios::binary | std::ios::trunc);
+        out.write(pristine.data(), (std::streamsize)pristine.size());
+        if (!out.good()) error = L"cannot write the drive image";
+        return out.good();
+    };
+    auto patchDrive = [&](const BootConfigPatch& patch, std::wstring& error) {
+        std::unique_ptr<BlockDevice> device = OpenBlockDevice(drive, true);
+        if (!device) {
+            error = L"cannot open the drive image";
+            return false;
+        }
+        BootConfigPatchReport report;
+        return PatchBootConfigs(*device, patch, &report, error);
+    };
+
+    BootConfigPatch patch;
+    patch.persistence = true;
+    patch.menuTitle = L"Inferno Live";
+    Measure(
+        "bootcfg", "in-place", 0, [&](std::wstring& error) { return patchDrive(patch, error); }, copyImage);
+
+    BootConfigPatch growing = patch;
+    growing.kernelParameters.push_back("inferno.note=" + std::string(200, 'n'));
+    Measure(
+        "bootcfg", "relocate", 0, [&](std::wstring& error) { return patchDrive(growing, error); }, copyImage);
+
+    Measure(
+        "bootcfg", "unchanged", 0, [&](std::wstring& error) { return patchDrive(patch, error); },
+        [&](std::wstring& error) { return copyImage(error) && patchDrive(patch, error); });
+}
+
+// A disk image of `imageBytes` the way images meant to be grown on first
+// boot are built: one partition holding FAT32 whose FATs have entries for
+// `fatBytes` of 512-byte clusters. A larger `driveBytes` extends the file, as
+// if the image had been copied to a larger drive.
+static bool WriteGrowImage(const std::string& path, PartitionStyle style, uint64_t imageBytes, uint64_t fatBytes,
+                           uint64_t driveBytes, std::wstring& error) {
+    if (!CreateSizedFile(path, imageBytes)) {
+        error = L"cannot create the image";
+        return false;
+    }
+    PartitionTable table;
+    {
+        std::unique_ptr<BlockDevice> device = OpenBlockDevice(Utf8ToWide(path), true);
+        if (!device) {
+            error = L"cannot open the image";
+            return false;
+        }
+        PartitionLayoutRequest request;
+        request.style = style;
+        request.sizesPercent = {100};
+        if (!ComputePartitionLayout(device->GetGeometry(), request, table, error) ||
+            !WritePartitionTable(*device, table, error)) {
+            return false;
+        }
+
+        const uint32_t reserved = 32, fats = 2, backupSector = 6;
+        uint64_t sectors = table.partitions[0].sectorCount;
+        uint32_t fatSectors = (uint32_t)((fatBytes / 512 + 2) * 4 / 512);
+        uint32_t clusters = (uint32_t)(sectors - reserved - fats * fatSectors);
+        std::vector<uint8_t> head((size_t)(reserved + fats * fatSectors) * 512);
+        uint8_t* boot = head.data();
+        auto le16 = [](uint8_t* p, uint32_t value) {
+            p[0] = (uint8_t)value;
+            p[1] = (uint8_t)(value >> 8);
+        };
+        auto le32 = [&](uint8_t* p, uint32_t value) {
+            le16(p, value);
+            le16(p + 2, value >> 16);
+        };
+        boot[0] = 0xEB;     // jmp short, nop
+        boot[1] = 0x58;
+        boot[2] = 0x90;
+        memcpy(boot + 3, "MSWIN4.1", 8);
+        le16(boot + 11, 512);
+        boot[13] = 1;
+        le16(boot + 14, reserved);
+        boot[16] = (uint8_t)fats;
+        boot[21] = 0xF8;
+        le32(boot + 32, (uint32_t)sectors);
+        le32(boot + 36, fatSectors);
+        le32(boot + 44, 2);
+        le16(boot + 48, 1);
+        le16(boot + 50, backupSector);
+        boot[66] = 0x29;
+        memcpy(boot + 82, "FAT32   ", 8);
+        le16(boot + 510, 0xAA55);
+        uint8_t* fsInfo = boot + 512;
+        le32(fsInfo, 0x41615252);
+        le32(fsInfo + 484, 0x61417272);
+        le32(fsInfo + 488, clusters - 1);
+        le32(fsInfo + 492, 3);
+        le16(fsInfo + 510, 0xAA55);
+        memcpy(boot + backupSector * 512, boot, 1024);
+        for (uint32_t fat = 0; fat < fats; fat++) {
+            uint8_t* entries = head.data() + (reserved + fat * fatSectors) * 512;
+            le32(entries, 0x0FFFFFF8);
+            le32(entries + 4, 0x0FFFFFFF);
+            le32(entries + 8, 0x0FFFFFFF);      // the root directory
+        }
+        if (!device->Write(table.partitions[0].startLba * 512, head.data(), head.size()) || !device->Flush()) {
+            error = L"cannot write the file system";
+            return false;
+        }
+    }
+
+    if (driveBytes <= imageBytes) return true;
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp((std::streamoff)(driveBytes - 1));
+    file.put('\0');
+    if (!file) error = L"cannot extend the image";
+    return (bool)file;
+}
+
+// A 64 MiB image copied to a 4 GiB drive and grown to it: the GPT backup
+// moved, the partition extended and FAT32 grown to what its FATs address.
+// The last variant runs the DD-mode job's tail on a simulated drive: copy,
+// verify against the image, then grow, which verification must precede.
+void Bench::RunGrow() {
+    std::string drivePath = JoinPath(m_config.workDir, "inferno_bench_grow.img");
+    std::string imagePath = JoinPath(m_config.workDir, "inferno_bench_grow_image.img");
+    m_generated.push_back(drivePath);
+    m_generated.push_back(imagePath);
+    const uint64_t imageBytes = 64ull * 1024 * 1024, fatBytes = 1024ull * 1024 * 1024;
+    const uint64_t driveBytes = 4096ull * 1024 * 1024;
+
+    const PartitionStyle styles[] = {PartitionStyle::GPT, PartitionStyle::MBR};
+    for (PartitionStyle style : styles) {
+        std::string variant = "fat32/" + Narrow(PartitionStyleName(style));
+        Measure(
+            "grow", variant, 0,
+            [&](std::wstring& error) {
+                std::unique_ptr<BlockDevice> device = OpenBlockDevice(Utf8ToWide(drivePath), true);
+                if (!device) {
+                    error = L"cannot open the drive image";
+                    return false;
+                }
+                DriveGrowReport report;
+                if (!GrowToDrive(*device, &report, error)) return false;
+                if (report.fileSystem.bytesAfter <= report.fileSystem.bytesBefore) {
+                    error = L"the file system did not grow";
+                    return false;
+                }
+                return true;
+            },
+            [&](std::wstring& error) {
+                return WriteGrowImage(drivePath, style, imageBytes, fatBytes, driveBytes, error);
+            });
+    }
+
+    std::wstring image = Utf8ToWide(imagePath);
+    Measure(
+        "grow", "copy+verify+grow/sim", imageBytes,
+        [&](std::wstring& error) {
+            SimulatedDeviceConfig config;
+            config.capacityBytes = config.reportedBytes = driveBytes;
+            std::unique_ptr<SimulatedDevice> device = CreateSimulatedDevice(config, error);
+            if (!device || !WriteImage(image, *device, m_config.params, nullptr, nullptr, error) ||
+                !VerifyImage(image, *device, m_config.params, nullptr, nullptr, error)) {
+                return false;
+            }
+            DriveGrowReport report;
+            if (!GrowToDrive(*device, &report, error)) return false;
+            if (report.partitionBytesAfter <= report.partitionBytesBefore) {
+                error = L"the partition did not grow";
+                return false;
+            }
+            return true;
+        },
+        [&](std::wstring& error) {
+            return WriteGrowImage(imagePath, PartitionStyle::GPT, imageBytes, fatBytes, imageBytes, error);
+        });
+}
+
+// What the GUI does in DD mode: image file to device, then read-back verify.
+void Bench::RunEndToEnd() {
+    std::wstring source = Utf8ToWide(m_sourcePath);
+    std::wstring sink = Utf8ToWide(m_sinkPath);
+    Measure("end-to-end", "write+verify/" + m_sinkVariant, m_config.size, [&](std::wstring& error) {
+        std::unique_ptr<BlockDevice> device = OpenBlockDevice(sink, true);
+        if (!device) {
+            error = L"cannot open sink";
+            return false;
+        }
+        return WriteImage(source, *device, m_config.params, nullptr, nullptr, error) &&
+               VerifyImage(source, *device, m_config.params, nullptr, nullptr, error);
+    });
+}
+
+std::string Bench::ToJson() const {
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(6);
+
+    out << "{\n";
+    out << "  \"suite\": \"inferno_bench\",\n";
+    out << "  \"version\": \"" << INFERNO_VERSION << "\",\n";
+    out << "  \"timestamp\": " << (long long)time(nullptr) << ",\n";
+    out << "  \"config\": {\n";
+    out << "    \"size_bytes\": " << m_config.size << ",\n";
+    out << "    \"chunk_size\": " << m_config.params.chunkSize << ",\n";
+    out << "    \"queue_depth\": " << m_config.params.queueDepth << ",\n";
+    out << "    \"read_policy\": \"" << Narrow(ReadPolicyName(m_config.params.readPolicy)) << "\",\n";
+    out << "    \"iterations\": " << m_config.iterations << ",\n";
+    out << "    \"source\": \"" << JsonEscape(m_config.sourcePath.empty() ? "synthetic" : m_config.sourcePath)
+        << "\",\n";
+    out << "    \"logging\": " << (m_config.logPath.empty() ? "false" : "true") << ",\n";
+    out << "    \"sink\": \"" << JsonEscape(m_config.sinkPath.empty() ? "file" : m_config.sinkPath) << "\",\n";
+    out << "    \"zlib\": " << (IsDecompressionSupported() ? "true" : "false") << "\n";
+    out << "  },\n";
+    out << "  \"results\": [";
+
+    for (size_t i = 0; i < m_results.size(); i++) {
+        const BenchResult& result = m_results[i];
+        out << (i ? ",\n" : "\n") << "    {";
+        out << "\"stage\": \"" << JsonEscape(result.stage) << "\", ";
+        out << "\"variant\": \"" << JsonEscape(result.variant) << "\", ";
+        out << "\"status\": \"" << result.status << "\"";
+        if (!result.message.empty()) {
+            out << ", \"message\": \"" << JsonEscape(result.message) << "\"";
+        }
+        if (!result.seconds.empty()) {
+            double median = Median(result.seconds);
+            out << ", \"iterations\": " << result.seconds.size();
+            out << ", \"bytes\": " << result.bytes;
+            out << ", \"seconds_min\": " << *std::min_element(result.seconds.begin(), result.seconds.end());
+            out << ", \"seconds_median\": " << median;
+            out << ", \"seconds_max\": " << *std::max_element(result.seconds.begin(), result.seconds.end());
+            if (result.bytes > 0 && median > 0.0) {
+                out << ", \"bytes_per_second\": " << result.bytes / median;
+            }
+            if (result.sourceCachedBytes >= 0) {
+                out << ", \"source_cached_bytes\": " << result.sourceCachedBytes;
+            }
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+    return out.str();
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+static void PrintUsage() {
+    std::cerr <<
+        "usage: inferno_bench [options]\n"
+        "  --size N          synthetic image size (K/M/G suffixes, default 256M)\n"
+        "  --source PATH     benchmark an existing image instead of synthetic data\n"
+        "  --sink PATH       write to this device, file or sim: spec (default scratch file)\n"
+        "  --chunk N         pipeline chunk size (default 1M)\n"
+        "  --queue-depth N   pipeline queue depth (default 4)\n"
+        "  --read-policy P   how write stages read the image: buffered, sequential,\n"
+        "                    drop-behind, direct or pinned (default buffered)\n"
+        "  --iterations N    timed runs per stage (default 3)\n"
+        "  --stages LIST     comma-separated subset of:\n"
+        "                    read,decompress,hash,zero-detect,buffers,write,fan-out,\n"
+        "                    encrypt,scan,verify,erase,format,library,queue,\n"
+        "                    bootcfg,grow,end-to-end\n"
+        "  --work-dir DIR    where scratch files are created (default .)\n"
+        "  --output PATH     write JSON here instead of stdout\n"
+        "  --trace PATH      record a Chrome trace of the run\n"
+        "  --log PATH        append a debug-level log of the run (measures logging cost)\n"
+        "  --keep            keep the scratch files\n";
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&](std::string& out) {
+            if (i + 1 >= argc) return false;
+            out = argv[++i];
+            return true;
+        };
+        std::string text;
+        uint64_t number = 0;
+        ReadPolicy policy = ReadPolicy::Buffered;
+
+        if (arg == "--help" || arg == "-h") {
+            PrintUsage();
+            return 0;
+        } else if (arg == "--keep") {
+            config.keepFiles = true;
+        } else if (arg == "--size" && value(text) && ParseSize(text, number)) {
+            config.size = number;
+        } else if (arg == "--chunk" && value(text) && ParseSize(text, number) && number <= (1u << 30)) {
+            config.params.chunkSize = (uint32_t)number;
+        } else if (arg == "--queue-depth" && value(text) && ParseSize(text, number) && number <= 256) {
+            config.params.queueDepth = (uint32_t)number;
+        } else if (arg == "--read-policy" && value(text) && ParseReadPolicy(Utf8ToWide(text), policy)) {
+            config.params.readPolicy = policy;
+        } else if (arg == "--iterations" && value(text) && ParseSize(text, number) && number <= 1000) {
+            config.iterations = (uint32_t)number;
+        } else if (arg == "--source" && value(text)) {
+            config.sourcePath = text;
+        } else if (arg == "--sink" && value(text)) {
+            config.sinkPath = text;
+        } else if (arg == "--work-dir" && value(text)) {
+            config.workDir = text;
+        } else if (arg == "--output" && value(text)) {
+            config.outputPath = text;
+        } else if (arg == "--trace" && value(text)) {
+            config.tracePath = text;
+        } else if (arg == "--log" && value(text)) {
+            config.logPath = text;
+        } else if (arg == "--stages" && value(text)) {
+            std::stringstream list(text);
+            std::string stage;
+            while (std::getline(list, stage, ',')) {
+                if (std::find_if(std::begin(ALL_STAGES), std::end(ALL_STAGES),
+                                 [&](const char* known) { return stage == known; }) == std::end(ALL_STAGES)) {
+                    std::cerr << "unknown stage: " << stage << "\n";
+                    return 2;
+                }
+                config.stages.insert(stage);
+            }
+        } else {
+            std::cerr << "invalid argument: " << arg << "\n";
+            PrintUsage();
+            return 2;
+        }
+    }
+
+    Bench bench(config);
+    std::string error;
+    if (!bench.Prepare(error)) {
+        std::cerr << "inferno_bench: " << error << "\n";
+        bench.Cleanup();
+        return 1;
+    }
+    {
+        ScopedTraceSession trace(Utf8ToWide(config.tracePath));
+        ScopedLogSession log(Utf8ToWide(config.logPath), LogLevel::Debug);
+        TraceSetThreadName("bench");
+        bench.Run();
+    }
+    bench.Cleanup();
+
+    std::string json = bench.ToJson();
+    if (config.outputPath.empty()) {
+        std::cout << json;
+    } else {
+        std::ofstream file(config.outputPath, std::ios::binary | std::ios::trunc);
+        file << json;
+        if (!file) {
+            std::cerr << "inferno_bench: cannot write " << config.outputPath << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}